@@ -18,24 +18,31 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <functional>
+#include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/mapped_file.h>
 #include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <openssl/sha.h>
@@ -46,8 +53,29 @@
 
 using namespace std::string_literals;
 
+// Upper bound of the number of threads that apply the chunks of an imgdiff patch.
+static constexpr size_t kMaxImagePatchThreads = 4;
+// The size of the pieces that partitions are hashed and written in, when not held in memory.
+static constexpr size_t kPartitionIoSize = 1024 * 1024;
+// The size of the blocks that a partition gets compared with its new content in, before writing.
+static constexpr size_t kCompareBlockSize = 4096;
+
+// The check record (Paths::partition_check_record()) has a line for each partition that passed a
+// full check by CheckPartitionWithRecord():
+//   <name> <identity> <size> <expected sha1> <fingerprint> <full check time> <skipped checks>
+// The fingerprint is the SHA-1 of kCheckSamples pieces spread evenly over the partition, from the
+// first to the last bytes. A check that finds the same fingerprint relies on the full check, until
+// that's older than kFullCheckInterval or kMaxSkippedChecks checks have relied on it.
+static constexpr size_t kCheckSamples = 16;
+static constexpr size_t kCheckSampleSize = 4096;
+static constexpr time_t kFullCheckInterval = 7 * 24 * 60 * 60;
+static constexpr uint32_t kMaxSkippedChecks = 16;
+
 static bool GenerateTarget(const Partition& target, const FileContents& source_file,
                            const Value& patch, const Value* bonus_data, bool backup_source);
+static bool GenerateTargetToPartition(const Partition& target, const uint8_t* source_data,
+                                      size_t source_size, const uint8_t* source_sha1,
+                                      const Value& patch, const Value* bonus_data);
 
 bool LoadFileContents(const std::string& filename, FileContents* file) {
   // No longer allow loading contents from eMMC partitions.
@@ -66,6 +94,187 @@ bool LoadFileContents(const std::string& filename, FileContents* file) {
   return true;
 }
 
+// Computes the SHA-1 of the first |size| bytes of the file or the block device at |name|. It's read
+// in pieces, so that checking a partition doesn't need a buffer of its full size.
+static bool HashPartition(const std::string& name, size_t size, uint8_t* sha1) {
+  android::base::unique_fd dev(open(name.c_str(), O_RDONLY));
+  if (dev == -1) {
+    PLOG(ERROR) << "Failed to open eMMC partition \"" << name << "\"";
+    return false;
+  }
+
+  std::vector<uint8_t> buffer(std::min(size, kPartitionIoSize));
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  for (size_t pos = 0; pos < size; pos += buffer.size()) {
+    size_t to_read = std::min(buffer.size(), size - pos);
+    if (!android::base::ReadFully(dev, buffer.data(), to_read)) {
+      PLOG(ERROR) << "Failed to read " << size << " bytes of data for partition " << name;
+      return false;
+    }
+    SHA1_Update(&ctx, buffer.data(), to_read);
+  }
+  SHA1_Final(sha1, &ctx);
+  return true;
+}
+
+// Returns whether the contents of |partition| match its hash, without reading it into memory.
+static bool CheckPartitionHash(const Partition& partition) {
+  uint8_t expected_sha1[SHA_DIGEST_LENGTH];
+  if (ParseSha1(partition.hash, expected_sha1) != 0) {
+    LOG(ERROR) << "Failed to parse target hash \"" << partition.hash << "\"";
+    return false;
+  }
+
+  uint8_t sha1[SHA_DIGEST_LENGTH];
+  if (!HashPartition(partition.name, partition.size, sha1) ||
+      memcmp(sha1, expected_sha1, SHA_DIGEST_LENGTH) != 0) {
+    LOG(ERROR) << "Partition contents don't have the expected checksum";
+    return false;
+  }
+  return true;
+}
+
+struct CheckRecordEntry {
+  std::string identity;
+  size_t size;
+  std::string hash;
+  std::string fingerprint;
+  int64_t checked;
+  uint32_t skipped;
+};
+
+// Returns a string that changes if the partition at |name| gets replaced by another device or file.
+static bool PartitionIdentity(const std::string& name, std::string* identity) {
+  struct stat sb;
+  if (stat(name.c_str(), &sb) != 0) {
+    return false;
+  }
+  *identity = S_ISBLK(sb.st_mode)
+                  ? android::base::StringPrintf("b%" PRIx64, static_cast<uint64_t>(sb.st_rdev))
+                  : android::base::StringPrintf("f%" PRIx64 ":%" PRIx64,
+                                                static_cast<uint64_t>(sb.st_dev),
+                                                static_cast<uint64_t>(sb.st_ino));
+  return true;
+}
+
+// Computes the fingerprint of the first |size| bytes of the partition at |name|, which reads
+// kCheckSamples * kCheckSampleSize bytes at most.
+static bool PartitionFingerprint(const std::string& name, size_t size, std::string* fingerprint) {
+  android::base::unique_fd dev(open(name.c_str(), O_RDONLY));
+  if (dev == -1) {
+    return false;
+  }
+
+  std::vector<uint8_t> buffer(std::min(size, kCheckSampleSize));
+  uint64_t last = size - buffer.size();
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  for (size_t i = 0; i < kCheckSamples; i++) {
+    uint64_t offset = last * i / (kCheckSamples - 1);
+    if (!android::base::ReadFullyAtOffset(dev, buffer.data(), buffer.size(), offset)) {
+      return false;
+    }
+    SHA1_Update(&ctx, buffer.data(), buffer.size());
+  }
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, &ctx);
+  *fingerprint = print_sha1(digest);
+  return true;
+}
+
+static std::map<std::string, CheckRecordEntry> LoadCheckRecord() {
+  std::map<std::string, CheckRecordEntry> record;
+  std::string content;
+  if (!android::base::ReadFileToString(Paths::Get().partition_check_record(), &content)) {
+    return record;
+  }
+  for (const auto& line : android::base::Split(content, "\n")) {
+    std::vector<std::string> pieces = android::base::Split(line, " ");
+    CheckRecordEntry entry;
+    if (pieces.size() != 7 || !android::base::ParseUint(pieces[2], &entry.size) ||
+        !android::base::ParseInt(pieces[5], &entry.checked) ||
+        !android::base::ParseUint(pieces[6], &entry.skipped)) {
+      continue;
+    }
+    entry.identity = pieces[1];
+    entry.hash = pieces[3];
+    entry.fingerprint = pieces[4];
+    record.emplace(pieces[0], std::move(entry));
+  }
+  return record;
+}
+
+// Replaces the check record with |record|. Failures only cost a full check on the next boot.
+static void SaveCheckRecord(const std::map<std::string, CheckRecordEntry>& record) {
+  std::string content;
+  for (const auto& [name, entry] : record) {
+    content += android::base::StringPrintf(
+        "%s %s %zu %s %s %" PRId64 " %" PRIu32 "\n", name.c_str(), entry.identity.c_str(),
+        entry.size, entry.hash.c_str(), entry.fingerprint.c_str(), entry.checked, entry.skipped);
+  }
+  std::string path = Paths::Get().partition_check_record();
+  std::string temp_path = path + ".tmp";
+  if (!android::base::WriteStringToFile(content, temp_path) ||
+      rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(WARNING) << "Failed to save the partition check record to " << path;
+    unlink(temp_path.c_str());
+  }
+}
+
+bool CheckPartitionWithRecord(const Partition& partition) {
+  std::string identity;
+  std::string fingerprint;
+  bool recordable = partition.name.find_first_of(" \n") == std::string::npos &&
+                    partition.hash.find_first_of(" \n") == std::string::npos &&
+                    PartitionIdentity(partition.name, &identity) &&
+                    PartitionFingerprint(partition.name, partition.size, &fingerprint);
+
+  auto record = LoadCheckRecord();
+  int64_t now = time(nullptr);
+  auto it = record.find(partition.name);
+  if (recordable && it != record.end()) {
+    CheckRecordEntry& entry = it->second;
+    // A clock that went backwards (e.g. one that starts from zero on every boot) calls for a full
+    // check as well.
+    if (entry.identity == identity && entry.size == partition.size &&
+        entry.hash == partition.hash && entry.fingerprint == fingerprint &&
+        entry.skipped < kMaxSkippedChecks && now >= entry.checked &&
+        now - entry.checked < kFullCheckInterval) {
+      entry.skipped++;
+      SaveCheckRecord(record);
+      LOG(INFO) << partition.name << " is unchanged since its full check " << (now - entry.checked)
+                << " s ago; skipping it";
+      return true;
+    }
+  }
+
+  bool result = CheckPartitionHash(partition);
+  if (result && recordable) {
+    record[partition.name] = { identity, partition.size, partition.hash, fingerprint, now, 0 };
+  } else if (it != record.end()) {
+    record.erase(partition.name);
+  } else {
+    return result;
+  }
+  SaveCheckRecord(record);
+  return result;
+}
+
+// Returns whether the two paths refer to the same file or block device.
+static bool IsSameDevice(const std::string& name1, const std::string& name2) {
+  struct stat sb1;
+  struct stat sb2;
+  if (stat(name1.c_str(), &sb1) != 0 || stat(name2.c_str(), &sb2) != 0) {
+    // Err on the side of caution.
+    return true;
+  }
+  if (S_ISBLK(sb1.st_mode) && S_ISBLK(sb2.st_mode)) {
+    return sb1.st_rdev == sb2.st_rdev;
+  }
+  return sb1.st_dev == sb2.st_dev && sb1.st_ino == sb2.st_ino;
+}
+
 // Reads the contents of a Partition to the given FileContents buffer.
 static bool ReadPartitionToBuffer(const Partition& partition, FileContents* out,
                                   bool check_backup) {
@@ -132,7 +341,66 @@ bool SaveFileContents(const std::string& filename, const FileContents* file) {
   return true;
 }
 
-// Writes a memory buffer to 'target' Partition.
+// Drops the page cache, so that the verification reads that follow come from the device.
+static void DropCaches() {
+  sync();
+  std::string drop_cache = "/proc/sys/vm/drop_caches";
+  if (!android::base::WriteStringToFile("3\n", drop_cache)) {
+    PLOG(ERROR) << "Failed to write to " << drop_cache;
+  } else {
+    LOG(INFO) << "  caches dropped";
+  }
+  sleep(1);
+}
+
+// Writes the blocks of |data| that differ from what |fd| of |partition| already holds. The
+// partition gets read in pieces of kPartitionIoSize, and the runs of differing blocks of a piece
+// get written together. A piece that fails to read (e.g. past the end of a file) gets written in
+// full. Sets |written| to the bytes written.
+static bool WriteDifferingBlocks(int fd, const uint8_t* data, size_t len,
+                                 const Partition& partition, size_t* written) {
+  *written = 0;
+  std::vector<uint8_t> buffer(std::min(len, kPartitionIoSize));
+  for (size_t offset = 0; offset < len; offset += buffer.size()) {
+    size_t size = std::min(buffer.size(), len - offset);
+    bool readable = android::base::ReadFullyAtOffset(fd, buffer.data(), size, offset);
+
+    // The run of differing blocks in [run_start, p) of the piece, if run_start != size.
+    size_t run_start = size;
+    auto write_run = [&](size_t run_end) {
+      if (run_start == size) {
+        return true;
+      }
+      if (!android::base::WriteFullyAtOffset(fd, data + offset + run_start, run_end - run_start,
+                                             offset + run_start)) {
+        PLOG(ERROR) << "Failed to write " << run_end - run_start << " bytes at "
+                    << offset + run_start << " to \"" << partition << "\"";
+        return false;
+      }
+      *written += run_end - run_start;
+      run_start = size;
+      return true;
+    };
+    for (size_t p = 0; p < size; p += kCompareBlockSize) {
+      size_t block_size = std::min(kCompareBlockSize, size - p);
+      if (!readable || memcmp(buffer.data() + p, data + offset + p, block_size) != 0) {
+        if (run_start == size) {
+          run_start = p;
+        }
+      } else if (!write_run(p)) {
+        return false;
+      }
+    }
+    if (!write_run(size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes a memory buffer to 'target' Partition. The first attempt only writes the blocks that
+// differ from what the partition holds, e.g. a patched image that changes a few regions of it; the
+// verification that follows reads the whole partition back either way.
 static bool WriteBufferToPartition(const FileContents& file_contents, const Partition& partition) {
   const unsigned char* data = file_contents.data.data();
   size_t len = file_contents.data.size();
@@ -145,14 +413,22 @@ static bool WriteBufferToPartition(const FileContents& file_contents, const Part
       return false;
     }
 
-    if (TEMP_FAILURE_RETRY(lseek(fd, start, SEEK_SET)) == -1) {
-      PLOG(ERROR) << "Failed to seek to " << start << " on \"" << partition << "\"";
-      return false;
-    }
+    if (attempt == 0) {
+      size_t written;
+      if (!WriteDifferingBlocks(fd, data, len, partition, &written)) {
+        return false;
+      }
+      LOG(INFO) << "  wrote " << written << " of " << len << " bytes that differ";
+    } else {
+      if (TEMP_FAILURE_RETRY(lseek(fd, start, SEEK_SET)) == -1) {
+        PLOG(ERROR) << "Failed to seek to " << start << " on \"" << partition << "\"";
+        return false;
+      }
 
-    if (!android::base::WriteFully(fd, data + start, len - start)) {
-      PLOG(ERROR) << "Failed to write " << len - start << " bytes to \"" << partition << "\"";
-      return false;
+      if (!android::base::WriteFully(fd, data + start, len - start)) {
+        PLOG(ERROR) << "Failed to write " << len - start << " bytes to \"" << partition << "\"";
+        return false;
+      }
     }
 
     if (fsync(fd) != 0) {
@@ -171,14 +447,7 @@ static bool WriteBufferToPartition(const FileContents& file_contents, const Part
     }
 
     // Drop caches so our subsequent verification read won't just be reading the cache.
-    sync();
-    std::string drop_cache = "/proc/sys/vm/drop_caches";
-    if (!android::base::WriteStringToFile("3\n", drop_cache)) {
-      PLOG(ERROR) << "Failed to write to " << drop_cache;
-    } else {
-      LOG(INFO) << "  caches dropped";
-    }
-    sleep(1);
+    DropCaches();
 
     // Verify.
     if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1) {
@@ -254,10 +523,8 @@ int ParseSha1(const std::string& str, uint8_t* digest) {
 }
 
 bool PatchPartitionCheck(const Partition& target, const Partition& source) {
-  FileContents target_file;
   FileContents source_file;
-  return (ReadPartitionToBuffer(target, &target_file, false) ||
-          ReadPartitionToBuffer(source, &source_file, true));
+  return (CheckPartitionHash(target) || ReadPartitionToBuffer(source, &source_file, true));
 }
 
 int ShowLicenses() {
@@ -269,15 +536,42 @@ bool PatchPartition(const Partition& target, const Partition& source, const Valu
                     const Value* bonus, bool backup_source) {
   LOG(INFO) << "Patching " << target.name;
 
-  // We try to load and check against the target hash first.
-  FileContents target_file;
-  if (ReadPartitionToBuffer(target, &target_file, false)) {
+  // We try to check against the target hash first.
+  if (CheckPartitionHash(target)) {
     // The early-exit case: the patch was already applied, this file has the desired hash, nothing
     // for us to do.
     LOG(INFO) << "  already " << target.hash.substr(0, 8);
     return true;
   }
 
+  // Without a backup to resume from, the source can be mapped and the target streamed to its
+  // partition, as long as they're different devices. That saves holding both images in memory.
+  if (!backup_source && !IsSameDevice(source.name, target.name)) {
+    uint8_t expected_sha1[SHA_DIGEST_LENGTH];
+    if (ParseSha1(source.hash, expected_sha1) != 0) {
+      LOG(ERROR) << "Failed to parse source hash \"" << source.hash << "\"";
+      return false;
+    }
+    android::base::unique_fd dev(open(source.name.c_str(), O_RDONLY));
+    std::unique_ptr<android::base::MappedFile> mapped;
+    if (dev != -1) {
+      mapped = android::base::MappedFile::FromFd(dev, 0, source.size, PROT_READ);
+    }
+    if (mapped != nullptr) {
+      const uint8_t* source_data = reinterpret_cast<const uint8_t*>(mapped->data());
+      uint8_t source_sha1[SHA_DIGEST_LENGTH];
+      SHA1(source_data, source.size, source_sha1);
+      if (memcmp(source_sha1, expected_sha1, SHA_DIGEST_LENGTH) == 0) {
+        return GenerateTargetToPartition(target, source_data, source.size, source_sha1, patch,
+                                         bonus);
+      }
+      LOG(ERROR) << "Partition contents don't have the expected checksum";
+      LOG(ERROR) << "Failed to find any match";
+      return false;
+    }
+    LOG(WARNING) << "Failed to map \"" << source << "\"; reading it into memory";
+  }
+
   FileContents source_file;
   if (ReadPartitionToBuffer(source, &source_file, backup_source)) {
     return GenerateTarget(target, source_file, patch, bonus, backup_source);
@@ -290,9 +584,8 @@ bool PatchPartition(const Partition& target, const Partition& source, const Valu
 bool FlashPartition(const Partition& partition, const std::string& source_filename) {
   LOG(INFO) << "Flashing " << partition;
 
-  // We try to load and check against the target hash first.
-  FileContents target_file;
-  if (ReadPartitionToBuffer(partition, &target_file, false)) {
+  // We try to check against the target hash first.
+  if (CheckPartitionHash(partition)) {
     // The early-exit case: the patch was already applied, this file has the desired hash, nothing
     // for us to do.
     LOG(INFO) << "  already " << partition.hash.substr(0, 8);
@@ -325,30 +618,74 @@ bool FlashPartition(const Partition& partition, const std::string& source_filena
   return true;
 }
 
-static bool GenerateTarget(const Partition& target, const FileContents& source_file,
-                           const Value& patch, const Value* bonus_data, bool backup_source) {
-  uint8_t expected_sha1[SHA_DIGEST_LENGTH];
-  if (ParseSha1(target.hash, expected_sha1) != 0) {
-    LOG(ERROR) << "Failed to parse target hash \"" << target.hash << "\"";
-    return false;
-  }
-
+// Checks that |patch| is a blob in one of the known formats, and sets |use_bsdiff| accordingly.
+static bool GetPatchFormat(const Value& patch, bool* use_bsdiff) {
   if (patch.type != Value::Type::BLOB) {
     LOG(ERROR) << "patch is not a blob";
     return false;
   }
 
-  const char* header = patch.data.data();
-  size_t header_bytes_read = patch.data.size();
-  bool use_bsdiff = false;
+  const char* header = patch.view().data();
+  size_t header_bytes_read = patch.view().size();
   if (header_bytes_read >= 8 && memcmp(header, "BSDIFF40", 8) == 0) {
-    use_bsdiff = true;
-  } else if (header_bytes_read >= 8 && memcmp(header, "IMGDIFF2", 8) == 0) {
-    use_bsdiff = false;
+    *use_bsdiff = true;
+  } else if (header_bytes_read >= 8 &&
+             (memcmp(header, "IMGDIFF2", 8) == 0 || memcmp(header, "IMGDIFF3", 8) == 0)) {
+    *use_bsdiff = false;
   } else {
     LOG(ERROR) << "Unknown patch file format";
     return false;
   }
+  return true;
+}
+
+// Applies |patch| to the source data given by (source_data, source_size), and writes the target
+// through |sink|. Returns 0 on success.
+static int ApplyPatchToSink(const uint8_t* source_data, size_t source_size, const Value& patch,
+                            bool use_bsdiff, const Value* bonus_data, SinkFn sink) {
+  if (use_bsdiff) {
+    return ApplyBSDiffPatch(source_data, source_size, patch, 0, sink);
+  }
+  size_t jobs = std::min<size_t>(std::thread::hardware_concurrency(), kMaxImagePatchThreads);
+  return ApplyImagePatch(source_data, source_size, patch, sink, bonus_data, jobs);
+}
+
+// Logs the sizes and the hashes of the inputs, after the target came out with an unexpected hash.
+static void LogPatchMismatch(const uint8_t* expected_sha1, size_t target_size,
+                             const uint8_t* target_sha1, size_t source_size,
+                             const uint8_t* source_sha1, const Value& patch,
+                             const Value* bonus_data) {
+  LOG(ERROR) << "Patching did not produce the expected SHA-1 of " << short_sha1(expected_sha1);
+
+  LOG(ERROR) << "target size " << target_size << " SHA-1 " << short_sha1(target_sha1);
+  LOG(ERROR) << "source size " << source_size << " SHA-1 " << short_sha1(source_sha1);
+
+  uint8_t patch_digest[SHA_DIGEST_LENGTH];
+  std::string_view patch_data = patch.view();
+  SHA1(reinterpret_cast<const uint8_t*>(patch_data.data()), patch_data.size(), patch_digest);
+  LOG(ERROR) << "patch size " << patch_data.size() << " SHA-1 " << short_sha1(patch_digest);
+
+  if (bonus_data != nullptr) {
+    std::string_view bonus = bonus_data->view();
+    uint8_t bonus_digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(bonus.data()), bonus.size(), bonus_digest);
+    LOG(ERROR) << "bonus size " << bonus.size() << " SHA-1 "
+               << short_sha1(bonus_digest);
+  }
+}
+
+static bool GenerateTarget(const Partition& target, const FileContents& source_file,
+                           const Value& patch, const Value* bonus_data, bool backup_source) {
+  uint8_t expected_sha1[SHA_DIGEST_LENGTH];
+  if (ParseSha1(target.hash, expected_sha1) != 0) {
+    LOG(ERROR) << "Failed to parse target hash \"" << target.hash << "\"";
+    return false;
+  }
+
+  bool use_bsdiff;
+  if (!GetPatchFormat(patch, &use_bsdiff)) {
+    return false;
+  }
 
   // We write the original source to cache, in case the partition write is interrupted.
   if (backup_source && !CheckAndFreeSpaceOnCache(source_file.data.size())) {
@@ -370,14 +707,8 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
     return len;
   };
 
-  int result;
-  if (use_bsdiff) {
-    result = ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), patch, 0, sink);
-  } else {
-    result =
-        ApplyImagePatch(source_file.data.data(), source_file.data.size(), patch, sink, bonus_data);
-  }
-
+  int result = ApplyPatchToSink(source_file.data.data(), source_file.data.size(), patch,
+                                use_bsdiff, bonus_data, sink);
   if (result != 0) {
     LOG(ERROR) << "Failed to apply the patch: " << result;
     return false;
@@ -385,24 +716,8 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
 
   SHA1_Final(patched.sha1, &ctx);
   if (memcmp(patched.sha1, expected_sha1, SHA_DIGEST_LENGTH) != 0) {
-    LOG(ERROR) << "Patching did not produce the expected SHA-1 of " << short_sha1(expected_sha1);
-
-    LOG(ERROR) << "target size " << patched.data.size() << " SHA-1 " << short_sha1(patched.sha1);
-    LOG(ERROR) << "source size " << source_file.data.size() << " SHA-1 "
-               << short_sha1(source_file.sha1);
-
-    uint8_t patch_digest[SHA_DIGEST_LENGTH];
-    SHA1(reinterpret_cast<const uint8_t*>(patch.data.data()), patch.data.size(), patch_digest);
-    LOG(ERROR) << "patch size " << patch.data.size() << " SHA-1 " << short_sha1(patch_digest);
-
-    if (bonus_data != nullptr) {
-      uint8_t bonus_digest[SHA_DIGEST_LENGTH];
-      SHA1(reinterpret_cast<const uint8_t*>(bonus_data->data.data()), bonus_data->data.size(),
-           bonus_digest);
-      LOG(ERROR) << "bonus size " << bonus_data->data.size() << " SHA-1 "
-                 << short_sha1(bonus_digest);
-    }
-
+    LogPatchMismatch(expected_sha1, patched.data.size(), patched.sha1, source_file.data.size(),
+                     source_file.sha1, patch, bonus_data);
     return false;
   }
 
@@ -423,9 +738,104 @@ static bool GenerateTarget(const Partition& target, const FileContents& source_f
   return true;
 }
 
+// Like GenerateTarget(), but streams the target straight to the partition while hashing it, so that
+// it's never held in memory. This is only safe when the source is on a different device, as the
+// source is still being read while the target gets written, and there's no backup to resume from.
+// A target that comes out with the wrong hash is left on the partition, which didn't have the
+// expected contents to begin with, and gets rewritten the next time.
+static bool GenerateTargetToPartition(const Partition& target, const uint8_t* source_data,
+                                      size_t source_size, const uint8_t* source_sha1,
+                                      const Value& patch, const Value* bonus_data) {
+  uint8_t expected_sha1[SHA_DIGEST_LENGTH];
+  if (ParseSha1(target.hash, expected_sha1) != 0) {
+    LOG(ERROR) << "Failed to parse target hash \"" << target.hash << "\"";
+    return false;
+  }
+
+  bool use_bsdiff;
+  if (!GetPatchFormat(patch, &use_bsdiff)) {
+    return false;
+  }
+
+  for (size_t attempt = 0; attempt < 2; ++attempt) {
+    android::base::unique_fd fd(open(target.name.c_str(), O_WRONLY));
+    if (fd == -1) {
+      PLOG(ERROR) << "Failed to open \"" << target << "\"";
+      return false;
+    }
+
+    // Batch up the small writes from the patch sinks.
+    std::vector<uint8_t> buffer;
+    buffer.reserve(kPartitionIoSize);
+    size_t written = 0;
+    bool write_failed = false;
+    auto flush = [&fd, &buffer, &written, &write_failed]() {
+      if (!write_failed && !android::base::WriteFully(fd, buffer.data(), buffer.size())) {
+        PLOG(ERROR) << "Failed to write " << buffer.size() << " bytes at " << written;
+        write_failed = true;
+      }
+      written += buffer.size();
+      buffer.clear();
+      return !write_failed;
+    };
+
+    uint8_t patched_sha1[SHA_DIGEST_LENGTH];
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    SinkFn sink = [&buffer, &ctx, &flush](const unsigned char* data, size_t len) -> size_t {
+      SHA1_Update(&ctx, data, len);
+      buffer.insert(buffer.end(), data, data + len);
+      if (buffer.size() >= kPartitionIoSize && !flush()) {
+        return 0;
+      }
+      return len;
+    };
+
+    int result =
+        ApplyPatchToSink(source_data, source_size, patch, use_bsdiff, bonus_data, sink);
+    if (result != 0 || !flush()) {
+      LOG(ERROR) << "Failed to apply the patch: " << result;
+      return false;
+    }
+
+    SHA1_Final(patched_sha1, &ctx);
+    if (memcmp(patched_sha1, expected_sha1, SHA_DIGEST_LENGTH) != 0) {
+      LogPatchMismatch(expected_sha1, written, patched_sha1, source_size, source_sha1, patch,
+                       bonus_data);
+      return false;
+    }
+
+    LOG(INFO) << "  now " << short_sha1(expected_sha1);
+
+    if (fsync(fd) != 0) {
+      PLOG(ERROR) << "Failed to sync \"" << target << "\"";
+      return false;
+    }
+    if (close(fd.release()) != 0) {
+      PLOG(ERROR) << "Failed to close \"" << target << "\"";
+      return false;
+    }
+
+    // Verify what's actually on the partition, without going through the cache.
+    DropCaches();
+    uint8_t sha1[SHA_DIGEST_LENGTH];
+    if (!HashPartition(target.name, written, sha1)) {
+      return false;
+    }
+    if (memcmp(sha1, expected_sha1, SHA_DIGEST_LENGTH) == 0) {
+      LOG(INFO) << "Verification read succeeded (attempt " << attempt + 1 << ")";
+      sync();
+      return true;
+    }
+    LOG(ERROR) << "Verification failed, found " << short_sha1(sha1);
+  }
+
+  LOG(ERROR) << "Failed to verify after all attempts";
+  return false;
+}
+
 bool CheckPartition(const Partition& partition) {
-  FileContents target_file;
-  return ReadPartitionToBuffer(partition, &target_file, false);
+  return CheckPartitionHash(partition);
 }
 
 Partition Partition::Parse(const std::string& input_str, std::string* err) {
@@ -42,7 +42,7 @@ static int CheckMode(const std::string& target_emmc) {
     LOG(ERROR) << "Failed to parse target \"" << target_emmc << "\": " << err;
     return 2;
   }
-  return CheckPartition(target) ? 0 : 1;
+  return CheckPartitionWithRecord(target) ? 0 : 1;
 }
 
 static int FlashMode(const std::string& target_emmc, const std::string& source_file) {
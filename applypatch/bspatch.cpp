@@ -20,18 +20,344 @@
 // applypatch with the -l option will display the bsdiff license
 // notice.
 
+#include <bzlib.h>
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <android-base/logging.h>
+#include <brotli/decode.h>
 #include <bsdiff/bspatch.h>
 #include <openssl/sha.h>
 
 #include "applypatch/applypatch.h"
 #include "edify/expr.h"
 #include "otautil/print_sha1.h"
+#include "otautil/ring_buffer.h"
+
+// Patches for targets smaller than this are applied by bsdiff::bspatch() on the calling thread, as
+// the threads of ApplyBSDiffPatchStreams() wouldn't pay off.
+static constexpr uint64_t kMinStreamedTargetSize = 1024 * 1024;
+// The data that the control stream, and the diff and extra streams, get decompressed ahead by.
+static constexpr size_t kControlBufferSize = 64 * 1024;
+static constexpr size_t kStreamBufferSize = 1024 * 1024;
+// The output that's put together before it's handed to the sink.
+static constexpr size_t kOutputBufferSize = 256 * 1024;
+
+// The 32-byte header of both formats: the magic (with the compressor types of the three streams in
+// bytes 5 to 7 for BSDF2), the compressed sizes of the control and the diff streams, and the size
+// of the target. The compressed extra stream takes the rest of the patch.
+static constexpr size_t kHeaderSize = 32;
+
+enum class StreamCompression : uint8_t {
+  kNone = 0,
+  kBz2 = 1,
+  kBrotli = 2,
+};
+
+// Reads the sign-magnitude 64-bit integer of bsdiff.
+static int64_t ReadOfftin(const uint8_t* buf) {
+  uint64_t y = buf[7] & 0x7F;
+  for (int i = 6; i >= 0; i--) {
+    y = (y << 8) | buf[i];
+  }
+  return (buf[7] & 0x80) ? -static_cast<int64_t>(y) : static_cast<int64_t>(y);
+}
+
+struct BSDiffHeader {
+  StreamCompression types[3];
+  size_t ctrl_size;
+  size_t diff_size;
+  size_t extra_size;
+  uint64_t new_size;
+};
+
+// Parses the header of the bsdiff patch at |data|. Returns std::nullopt if it's not in a supported
+// format, or its sizes don't add up.
+static std::optional<BSDiffHeader> ParseBSDiffHeader(const uint8_t* data, size_t size) {
+  if (size < kHeaderSize) {
+    return std::nullopt;
+  }
+  BSDiffHeader header;
+  if (memcmp(data, "BSDIFF40", 8) == 0) {
+    std::fill(std::begin(header.types), std::end(header.types), StreamCompression::kBz2);
+  } else if (memcmp(data, "BSDF2", 5) == 0) {
+    for (size_t i = 0; i < 3; i++) {
+      if (data[5 + i] > static_cast<uint8_t>(StreamCompression::kBrotli)) {
+        return std::nullopt;
+      }
+      header.types[i] = static_cast<StreamCompression>(data[5 + i]);
+    }
+  } else {
+    return std::nullopt;
+  }
+
+  int64_t ctrl_size = ReadOfftin(data + 8);
+  int64_t diff_size = ReadOfftin(data + 16);
+  int64_t new_size = ReadOfftin(data + 24);
+  uint64_t streams_size = size - kHeaderSize;
+  if (ctrl_size < 0 || diff_size < 0 || new_size < 0 ||
+      static_cast<uint64_t>(ctrl_size) > streams_size ||
+      static_cast<uint64_t>(diff_size) > streams_size - ctrl_size) {
+    return std::nullopt;
+  }
+  header.ctrl_size = ctrl_size;
+  header.diff_size = diff_size;
+  header.extra_size = streams_size - ctrl_size - diff_size;
+  header.new_size = new_size;
+  return header;
+}
+
+// One of the three streams of a bsdiff patch. A compressed stream gets decompressed by a thread of
+// its own into a bounded ring buffer, while an uncompressed one is read in place.
+class PatchStream {
+ public:
+  PatchStream(StreamCompression type, const uint8_t* data, size_t size, size_t buffer_size)
+      : type_(type), data_(data), size_(size) {
+    if (type_ != StreamCompression::kNone) {
+      ring_ = std::make_unique<RingBuffer>(buffer_size);
+      thread_ = std::thread(&PatchStream::Decompress, this);
+    }
+  }
+
+  ~PatchStream() {
+    if (ring_) {
+      ring_->Abort();
+      thread_.join();
+    }
+  }
+
+  PatchStream(const PatchStream&) = delete;
+  PatchStream& operator=(const PatchStream&) = delete;
+
+  // Sets |data| to the next up to |max_size| bytes of the stream, which stay valid until the next
+  // call. Returns their number, or 0 at the end of the stream or on errors.
+  size_t Next(const uint8_t** data, size_t max_size) {
+    if (!ring_) {
+      size_t size = std::min(max_size, size_ - pos_);
+      *data = data_ + pos_;
+      pos_ += size;
+      return size;
+    }
+    ring_->Consume(pending_);
+    pending_ = std::min(ring_->GetReadable(data), max_size);
+    return pending_;
+  }
+
+  // Copies the next |size| bytes of the stream to |out|. Returns false if the stream ends before.
+  bool ReadFully(uint8_t* out, size_t size) {
+    while (size > 0) {
+      const uint8_t* data;
+      size_t n = Next(&data, size);
+      if (n == 0) {
+        return false;
+      }
+      memcpy(out, data, n);
+      out += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  bool failed() const {
+    return failed_;
+  }
+
+ private:
+  void Decompress() {
+    bool success = type_ == StreamCompression::kBz2 ? DecompressBz2() : DecompressBrotli();
+    if (!success && !ring_->aborted()) {
+      failed_ = true;
+    }
+    // The reader sees the end of the stream, even a truncated one.
+    ring_->Close();
+  }
+
+  bool DecompressBz2() {
+    bz_stream stream{};
+    if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK) {
+      LOG(ERROR) << "Failed to initialize bz2 decompression";
+      return false;
+    }
+    stream.next_in = const_cast<char*>(reinterpret_cast<const char*>(data_));
+    size_t remaining = size_;
+    int result = BZ_OK;
+    while (result == BZ_OK) {
+      uint8_t* buffer;
+      size_t buffer_size = std::min<size_t>(ring_->GetWritable(&buffer), UINT_MAX);
+      if (buffer_size == 0) {
+        break;
+      }
+      size_t available_in = std::min<size_t>(remaining, UINT_MAX);
+      stream.avail_in = available_in;
+      stream.next_out = reinterpret_cast<char*>(buffer);
+      stream.avail_out = buffer_size;
+      result = BZ2_bzDecompress(&stream);
+      remaining -= available_in - stream.avail_in;
+      ring_->Commit(buffer_size - stream.avail_out);
+      if (result == BZ_OK && remaining == 0 && stream.avail_out != 0) {
+        LOG(ERROR) << "Truncated bz2 stream";
+        result = BZ_UNEXPECTED_EOF;
+      }
+    }
+    BZ2_bzDecompressEnd(&stream);
+    if (result != BZ_STREAM_END && result != BZ_OK) {
+      LOG(ERROR) << "bz2 decompression failed: " << result;
+    }
+    return result == BZ_STREAM_END;
+  }
+
+  bool DecompressBrotli() {
+    std::unique_ptr<BrotliDecoderState, decltype(&BrotliDecoderDestroyInstance)> state(
+        BrotliDecoderCreateInstance(nullptr, nullptr, nullptr), BrotliDecoderDestroyInstance);
+    if (!state) {
+      LOG(ERROR) << "Failed to initialize brotli decompression";
+      return false;
+    }
+    const uint8_t* next_in = data_;
+    size_t available_in = size_;
+    while (true) {
+      uint8_t* buffer;
+      size_t buffer_size = ring_->GetWritable(&buffer);
+      if (buffer_size == 0) {
+        return false;
+      }
+      uint8_t* next_out = buffer;
+      size_t available_out = buffer_size;
+      BrotliDecoderResult result = BrotliDecoderDecompressStream(
+          state.get(), &available_in, &next_in, &available_out, &next_out, nullptr);
+      ring_->Commit(buffer_size - available_out);
+      if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+        return true;
+      }
+      if (result == BROTLI_DECODER_RESULT_ERROR) {
+        LOG(ERROR) << "Brotli decompression failed with "
+                   << BrotliDecoderErrorString(BrotliDecoderGetErrorCode(state.get()));
+        return false;
+      }
+      if (result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) {
+        LOG(ERROR) << "Truncated brotli stream";
+        return false;
+      }
+    }
+  }
+
+  const StreamCompression type_;
+  const uint8_t* data_;
+  const size_t size_;
+  // The read position of an uncompressed stream.
+  size_t pos_ = 0;
+
+  std::unique_ptr<RingBuffer> ring_;
+  // The size of the data returned by the last Next(), to be consumed by the next one.
+  size_t pending_ = 0;
+  std::atomic<bool> failed_{ false };
+  std::thread thread_;
+};
+
+int ApplyBSDiffPatchStreams(const unsigned char* old_data, size_t old_size,
+                            const unsigned char* patch_data, size_t patch_size,
+                            const SinkFn& sink) {
+  std::optional<BSDiffHeader> header = ParseBSDiffHeader(patch_data, patch_size);
+  if (!header) {
+    return -1;
+  }
+
+  const uint8_t* streams = patch_data + kHeaderSize;
+  PatchStream ctrl(header->types[0], streams, header->ctrl_size, kControlBufferSize);
+  PatchStream diff(header->types[1], streams + header->ctrl_size, header->diff_size,
+                   kStreamBufferSize);
+  PatchStream extra(header->types[2], streams + header->ctrl_size + header->diff_size,
+                    header->extra_size, kStreamBufferSize);
+  auto corrupt = [&](const char* what) {
+    LOG(ERROR) << "Corrupt patch: " << what
+               << (ctrl.failed() || diff.failed() || extra.failed() ? " (decompression failed)"
+                                                                    : "");
+    return 2;
+  };
+
+  std::vector<uint8_t> output(std::min<uint64_t>(kOutputBufferSize, header->new_size));
+  size_t output_size = 0;
+  auto flush = [&]() {
+    bool success = output_size == 0 || sink(output.data(), output_size) == output_size;
+    output_size = 0;
+    return success;
+  };
+
+  const int64_t old_end = old_size;
+  int64_t old_pos = 0;
+  uint64_t new_pos = 0;
+  while (new_pos < header->new_size) {
+    uint8_t ctrl_buf[24];
+    if (!ctrl.ReadFully(ctrl_buf, sizeof(ctrl_buf))) {
+      return corrupt("short control stream");
+    }
+    int64_t diff_size = ReadOfftin(ctrl_buf);
+    int64_t extra_size = ReadOfftin(ctrl_buf + 8);
+    int64_t seek = ReadOfftin(ctrl_buf + 16);
+    uint64_t left = header->new_size - new_pos;
+    if (diff_size < 0 || extra_size < 0 || static_cast<uint64_t>(diff_size) > left ||
+        static_cast<uint64_t>(extra_size) > left - diff_size) {
+      return corrupt("control entry exceeds the target");
+    }
+
+    // Add the diff bytes to the old data at old_pos; the bytes outside of the old data are taken
+    // as 0.
+    for (uint64_t remaining = diff_size; remaining > 0;) {
+      const uint8_t* data;
+      size_t n = diff.Next(&data, std::min<uint64_t>(remaining, output.size() - output_size));
+      if (n == 0) {
+        return corrupt("short diff stream");
+      }
+      uint8_t* out = output.data() + output_size;
+      memcpy(out, data, n);
+      int64_t begin = std::clamp<int64_t>(old_pos, 0, old_end);
+      int64_t end = std::clamp<int64_t>(old_pos + static_cast<int64_t>(n), 0, old_end);
+      for (int64_t i = begin; i < end; i++) {
+        out[i - old_pos] += old_data[i];
+      }
+      old_pos += n;
+      output_size += n;
+      remaining -= n;
+      if (output_size == output.size() && !flush()) {
+        return 1;
+      }
+    }
+
+    for (uint64_t remaining = extra_size; remaining > 0;) {
+      const uint8_t* data;
+      size_t n = extra.Next(&data, std::min<uint64_t>(remaining, output.size() - output_size));
+      if (n == 0) {
+        return corrupt("short extra stream");
+      }
+      memcpy(output.data() + output_size, data, n);
+      output_size += n;
+      remaining -= n;
+      if (output_size == output.size() && !flush()) {
+        return 1;
+      }
+    }
+
+    new_pos += diff_size + extra_size;
+    if (__builtin_add_overflow(old_pos, seek, &old_pos)) {
+      return corrupt("seek out of range");
+    }
+  }
+  if (!flush()) {
+    return 1;
+  }
+  return 0;
+}
 
 void ShowBSDiffLicense() {
     puts("The bsdiff library used herein is:\n"
@@ -67,18 +393,26 @@ void ShowBSDiffLicense() {
 
 int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
                      size_t patch_offset, SinkFn sink) {
-  CHECK_LE(patch_offset, patch.data.size());
+  std::string_view patch_data = patch.view();
+  CHECK_LE(patch_offset, patch_data.size());
 
-  int result = bsdiff::bspatch(old_data, old_size,
-                               reinterpret_cast<const uint8_t*>(&patch.data[patch_offset]),
-                               patch.data.size() - patch_offset, sink);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(patch_data.data() + patch_offset);
+  size_t size = patch_data.size() - patch_offset;
+  int result = -1;
+  if (std::optional<BSDiffHeader> header = ParseBSDiffHeader(data, size);
+      header && header->new_size >= kMinStreamedTargetSize) {
+    result = ApplyBSDiffPatchStreams(old_data, old_size, data, size, sink);
+  }
+  if (result == -1) {
+    result = bsdiff::bspatch(old_data, old_size, data, size, sink);
+  }
   if (result != 0) {
     LOG(ERROR) << "bspatch failed, result: " << result;
     // print SHA1 of the patch in the case of a data error.
     if (result == 2) {
       uint8_t digest[SHA_DIGEST_LENGTH];
-      SHA1(reinterpret_cast<const uint8_t*>(patch.data.data() + patch_offset),
-           patch.data.size() - patch_offset, digest);
+      SHA1(reinterpret_cast<const uint8_t*>(patch_data.data() + patch_offset),
+           patch_data.size() - patch_offset, digest);
       std::string patch_sha1 = print_sha1(digest);
       LOG(ERROR) << "Patch may be corrupted, offset: " << patch_offset << ", SHA1: " << patch_sha1;
     }
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "applypatch/deflate_backend.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <android-base/logging.h>
+
+static int ZlibDeflateInit(z_stream* strm, int level, int method, int window_bits, int mem_level,
+                           int strategy) {
+  return deflateInit2(strm, level, method, window_bits, mem_level, strategy);
+}
+
+static const DeflateBackend kZlibDeflateBackend = {
+  "zlib", ZlibDeflateInit, deflate, deflateReset, deflateEnd,
+};
+
+using DeflateParams = std::tuple<int, int, int, int, int>;
+
+static std::mutex backends_mutex;
+static std::vector<const DeflateBackend*> candidate_backends;
+static std::map<DeflateParams, const DeflateBackend*> selected_backends;
+
+const DeflateBackend* GetZlibDeflateBackend() {
+  return &kZlibDeflateBackend;
+}
+
+void RegisterDeflateBackend(const DeflateBackend* backend) {
+  std::lock_guard<std::mutex> lock(backends_mutex);
+  candidate_backends.push_back(backend);
+  // Let the new candidate compete for the parameters that have fallen back to zlib.
+  for (auto it = selected_backends.begin(); it != selected_backends.end();) {
+    it = (it->second == &kZlibDeflateBackend) ? selected_backends.erase(it) : std::next(it);
+  }
+}
+
+// Returns a probe buffer that has both long matches and incompressible runs, so that it goes
+// through the lazy matching, the block splitting and the stored blocks of the deflater.
+static const std::vector<uint8_t>& ProbeData() {
+  static const std::vector<uint8_t> probe = [] {
+    static constexpr size_t kProbeSize = 256 * 1024;
+    std::vector<uint8_t> data;
+    data.reserve(kProbeSize);
+    uint32_t seed = 0x2545f491;
+    while (data.size() < kProbeSize) {
+      seed = seed * 1103515245 + 12345;
+      size_t run = 64 + (seed >> 16) % 4096;
+      if ((seed >> 8) % 3 == 0) {
+        for (size_t i = 0; i < run; i++) {
+          seed = seed * 1103515245 + 12345;
+          data.push_back(seed >> 24);
+        }
+      } else {
+        size_t distance = std::min<size_t>(data.size(), 1 + (seed >> 4) % 32768);
+        for (size_t i = 0; i < run; i++) {
+          data.push_back(distance == 0 ? 'a' + i % 26 : data[data.size() - distance]);
+        }
+      }
+    }
+    data.resize(kProbeSize);
+    return data;
+  }();
+  return probe;
+}
+
+// Deflates |data| with |backend|, feeding the input in uneven pieces like the bspatch sink in
+// imgpatch does. Returns false on errors.
+static bool DeflateProbe(const DeflateBackend* backend, const DeflateParams& params,
+                         const std::vector<uint8_t>& data, std::vector<uint8_t>* output) {
+  const auto& [level, method, window_bits, mem_level, strategy] = params;
+  z_stream strm = {};
+  if (backend->init(&strm, level, method, window_bits, mem_level, strategy) != Z_OK) {
+    return false;
+  }
+
+  uint8_t buffer[32768];
+  size_t pos = 0;
+  size_t piece = 1;
+  int ret = Z_OK;
+  while (ret != Z_STREAM_END) {
+    size_t len = std::min(piece, data.size() - pos);
+    piece = piece * 3 + 7;
+    strm.next_in = data.data() + pos;
+    strm.avail_in = len;
+    pos += len;
+    int flush = (pos == data.size()) ? Z_FINISH : Z_NO_FLUSH;
+    do {
+      strm.next_out = buffer;
+      strm.avail_out = sizeof(buffer);
+      ret = backend->deflate(&strm, flush);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        backend->end(&strm);
+        return false;
+      }
+      output->insert(output->end(), buffer, buffer + sizeof(buffer) - strm.avail_out);
+    } while ((strm.avail_in != 0 || strm.avail_out == 0) && ret != Z_STREAM_END);
+  }
+  backend->end(&strm);
+  return true;
+}
+
+const DeflateBackend* SelectDeflateBackend(int level, int method, int window_bits, int mem_level,
+                                           int strategy) {
+  DeflateParams params(level, method, window_bits, mem_level, strategy);
+  std::lock_guard<std::mutex> lock(backends_mutex);
+  if (candidate_backends.empty()) {
+    return &kZlibDeflateBackend;
+  }
+  if (auto it = selected_backends.find(params); it != selected_backends.end()) {
+    return it->second;
+  }
+
+  const DeflateBackend* selected = &kZlibDeflateBackend;
+  std::vector<uint8_t> expected;
+  if (DeflateProbe(&kZlibDeflateBackend, params, ProbeData(), &expected)) {
+    for (const auto* backend : candidate_backends) {
+      std::vector<uint8_t> output;
+      if (DeflateProbe(backend, params, ProbeData(), &output) && output == expected) {
+        selected = backend;
+        break;
+      }
+      LOG(INFO) << "Deflate backend " << backend->name << " doesn't match zlib for level " << level
+                << ", window bits " << window_bits << ", mem level " << mem_level
+                << ", strategy " << strategy;
+    }
+  }
+  selected_backends.emplace(params, selected);
+  return selected;
+}
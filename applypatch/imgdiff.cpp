@@ -85,9 +85,14 @@
  *                windowBits      (4)
  *                memLevel        (4)
  *                strategy        (4)
- *        if chunk type == RAW:             (version 2 only)
+ *        if chunk type == RAW:             (version 2 and up)
  *           target len           (4)
  *           data                 (target len)
+ *        if chunk type == RAW_COMPRESSED:  (version 3 only)
+ *           codec                (4)   [RAW_CODEC_{BROTLI, ZSTD}]
+ *           target len           (4)
+ *           compressed len       (4)
+ *           data                 (compressed len)
  *
  * All integers are little-endian.  "source start" and "source len" specify the section of the
  * input image that comprises this chunk, including the gzip header and footer for gzip chunks.
@@ -100,6 +105,10 @@
  * After the header there are 'chunk count' bsdiff patches; the offset of each from the beginning
  * of the file is specified in the header.
  *
+ * The "IMGDIFF3" version is only written with the option "--raw-compression", and only if some
+ * target chunk gets stored compressed instead of as a bsdiff patch, or as its raw data; zstd for
+ * the fast decoding, brotli for the size, or either one where it saves the most ("auto").
+ *
  * This tool can take an optional file of "bonus data".  This is an extra file of data that is
  * appended to chunk #1 after it is compressed (it must be a CHUNK_DEFLATE chunk).  The same file
  * must be available (and passed to applypatch with -b) when applying the patch.  This is used to
@@ -153,7 +162,16 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -163,22 +181,34 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
+#include <brotli/encode.h>
 #include <bsdiff/bsdiff.h>
+#include <openssl/sha.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
+#include <zstd.h>
 
 #include "applypatch/imgdiff_image.h"
+#include "applypatch/suffix_array_cache.h"
+#include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
 
 using android::base::get_unaligned;
 
 static constexpr size_t VERSION = 2;
+// The patches with CHUNK_RAW_COMPRESSED chunks need IMGDIFF3.
+static constexpr size_t kCompressedRawVersion = 3;
 
 // We assume the header "IMGDIFF#" is 8 bytes.
-static_assert(VERSION <= 9, "VERSION occupies more than one byte");
+static_assert(kCompressedRawVersion <= 9, "VERSION occupies more than one byte");
 
 static constexpr size_t BLOCK_SIZE = 4096;
 static constexpr size_t BUFFER_SIZE = 0x8000;
+// The sources below this size leave the sorting of their suffixes to bsdiff itself.
+static constexpr size_t kMinParallelSortSize = 1024 * 1024;
+// The compression levels of the raw chunks, for size rather than encoding speed.
+static constexpr int kRawBrotliQuality = 9;
+static constexpr int kRawZstdLevel = 19;
 
 // If we use this function to write the offset and length (type size_t), their values should not
 // exceed 2^63; because the signed bit will be casted away.
@@ -245,12 +275,145 @@ static bool RemoveUsedBlocks(size_t* start, size_t* length, const SortedRangeSet
   return false;
 }
 
+// Admits the split pieces to be diffed in order, as long as their estimated memory fits within the
+// limit, so that the concurrent pieces don't push the peak memory over it. A piece larger than the
+// limit still gets admitted once nothing else holds the budget. A limit of 0 means no limit.
+// Admitting in order guarantees that the budget is only held by the pieces before the pending one,
+// which get written out (and released) first.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(size_t limit) : limit_(limit) {}
+
+  // Blocks until all the pieces before |index| have been admitted and |size| fits in the budget.
+  // Returns false if the budget got cancelled meanwhile.
+  bool Acquire(size_t index, size_t size) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&]() {
+      return cancelled_ || (index == next_index_ &&
+                            (limit_ == 0 || used_ == 0 || used_ + size <= limit_));
+    });
+    if (cancelled_) {
+      return false;
+    }
+    next_index_++;
+    used_ += size;
+    cv_.notify_all();
+    return true;
+  }
+
+  void Release(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    used_ -= size;
+    cv_.notify_all();
+  }
+
+  // Wakes up and fails all the pending Acquire() calls.
+  void Cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+    cv_.notify_all();
+  }
+
+ private:
+  const size_t limit_;
+  size_t next_index_{ 0 };
+  size_t used_{ 0 };
+  bool cancelled_{ false };
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+// Makes the patches of the chunks [0, count) with |make_patch| on up to |jobs| threads, and hands
+// them to |write_patch| in order, as soon as all the chunks before them are done, so that only the
+// patches that finished out of order are held in memory. Chunk |first|, if less than |count|, gets
+// made before all the others start, e.g. to build a suffix array that they share. Stops at the
+// first failure of either function.
+static bool MakePatchesInOrder(size_t count, size_t jobs, size_t first,
+                               const std::function<bool(size_t)>& make_patch,
+                               const std::function<bool(size_t)>& write_patch) {
+  if (jobs <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      if (!make_patch(i) || !write_patch(i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::mutex writer_mutex;
+  std::vector<uint8_t> finished(count);
+  size_t next_write = 0;
+  auto finish_patch = [&](size_t i) {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    finished[i] = true;
+    for (; next_write < count && finished[next_write]; next_write++) {
+      if (!write_patch(next_write)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  std::atomic<bool> failed{ first < count && !make_patch(first) };
+  std::atomic<size_t> next_chunk{ 0 };
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < std::min(jobs, count); t++) {
+    threads.emplace_back([&]() {
+      for (size_t i = next_chunk++; i < count && !failed; i = next_chunk++) {
+        if ((i == first || make_patch(i)) && finish_patch(i)) {
+          continue;
+        }
+        failed = true;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return !failed;
+}
+
+// The compressed target data of a chunk, as an alternative to its patch.
+struct CompressedRaw {
+  int codec = 0;
+  std::vector<uint8_t> data;
+};
+
+// Compresses the target data of |tgt| into |raw| as |compression| asks, unless the patch of
+// |patch_size| bytes is much smaller than the target data anyway.
+static void CompressRawChunk(const ImageChunk& tgt, size_t patch_size, RawCompression compression,
+                             CompressedRaw* raw) {
+  if (patch_size >= tgt.GetRawDataLength() / 8) {
+    PatchChunk::CompressRawData(tgt, compression, &raw->codec, &raw->data);
+  }
+}
+
+// Returns the smallest patch chunk of |tgt|: the bsdiff patch against |src|, the raw target data,
+// or its compressed data in |raw| if any. Releases the data that isn't used.
+static PatchChunk ChoosePatchChunk(const ImageChunk& tgt, const ImageChunk* src,
+                                   std::vector<uint8_t>* patch_data, CompressedRaw* raw) {
+  std::vector<uint8_t> patch = std::move(*patch_data);
+  std::vector<uint8_t> compressed = std::move(raw->data);
+  if (!compressed.empty() && (src == nullptr || compressed.size() < patch.size())) {
+    return PatchChunk(tgt, raw->codec, std::move(compressed));
+  }
+  if (src == nullptr || PatchChunk::RawDataIsSmaller(tgt, patch.size())) {
+    return PatchChunk(tgt);
+  }
+  return PatchChunk(tgt, *src, std::move(patch));
+}
+
 static const struct option OPTIONS[] = {
   { "zip-mode", no_argument, nullptr, 'z' },
   { "bonus-file", required_argument, nullptr, 'b' },
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "jobs", required_argument, nullptr, 0 },
+  { "memory-limit", required_argument, nullptr, 0 },
+  { "sa-cache-dir", required_argument, nullptr, 0 },
+  { "sa-threads", required_argument, nullptr, 0 },
+  { "raw-compression", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
@@ -273,6 +436,7 @@ const uint8_t* ImageChunk::GetRawData() const {
 
 const uint8_t * ImageChunk::DataForPatch() const {
   if (type_ == CHUNK_DEFLATE) {
+    CHECK(!lazy_) << "The uncompressed data of " << entry_name_ << " isn't in memory";
     return uncompressed_data_.data();
   }
   return GetRawData();
@@ -280,14 +444,58 @@ const uint8_t * ImageChunk::DataForPatch() const {
 
 size_t ImageChunk::DataLengthForPatch() const {
   if (type_ == CHUNK_DEFLATE) {
-    return uncompressed_data_.size();
+    return lazy_ ? uncompressed_len_ : uncompressed_data_.size();
   }
   return raw_data_len_;
 }
 
+const uint8_t* ImageChunk::InflateDataForPatch(std::vector<uint8_t>* buffer) const {
+  if (type_ != CHUNK_DEFLATE || !lazy_) {
+    return DataForPatch();
+  }
+
+  buffer->resize(uncompressed_len_);
+  z_stream strm = {};
+  strm.next_in = GetRawData();
+  strm.avail_in = raw_data_len_;
+  strm.next_out = buffer->data();
+  strm.avail_out = buffer->size();
+  int ret = inflateInit2(&strm, WINDOWBITS);
+  if (ret != Z_OK) {
+    LOG(ERROR) << "Failed to initialize inflate: " << ret;
+    return nullptr;
+  }
+  ret = inflate(&strm, Z_FINISH);
+  size_t inflated = buffer->size() - strm.avail_out;
+  inflateEnd(&strm);
+  if (ret != Z_STREAM_END || inflated != uncompressed_len_) {
+    LOG(ERROR) << "Failed to inflate " << entry_name_ << " to " << uncompressed_len_
+               << " bytes: " << ret;
+    return nullptr;
+  }
+  if (crc32(0, buffer->data(), buffer->size()) != crc32_) {
+    LOG(ERROR) << "CRC mismatch on " << entry_name_;
+    return nullptr;
+  }
+  return buffer->data();
+}
+
+std::string ImageChunk::GetContentSha1() const {
+  std::vector<uint8_t> buffer;
+  const uint8_t* data = InflateDataForPatch(&buffer);
+  if (data == nullptr) {
+    return "";
+  }
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(data, DataLengthForPatch(), digest);
+  return print_sha1(digest);
+}
+
 void ImageChunk::Dump(size_t index) const {
   LOG(INFO) << "chunk: " << index << ", type: " << type_ << ", start: " << start_
-            << ", len: " << DataLengthForPatch() << ", name: " << entry_name_;
+            << ", len: " << DataLengthForPatch() << ", name: " << entry_name_
+            << (GetSourceEntryName() != entry_name_ ? ", source: " + GetSourceEntryName() : "")
+            << (copy_ ? ", copy" : "");
 }
 
 bool ImageChunk::operator==(const ImageChunk& other) const {
@@ -300,6 +508,14 @@ bool ImageChunk::operator==(const ImageChunk& other) const {
 
 void ImageChunk::SetUncompressedData(std::vector<uint8_t> data) {
   uncompressed_data_ = std::move(data);
+  lazy_ = false;
+}
+
+void ImageChunk::SetLazyUncompressedData(size_t uncompressed_len, uint32_t crc32) {
+  uncompressed_data_.clear();
+  lazy_ = true;
+  uncompressed_len_ = uncompressed_len;
+  crc32_ = crc32;
 }
 
 bool ImageChunk::SetBonusData(const std::vector<uint8_t>& bonus_data) {
@@ -315,10 +531,11 @@ void ImageChunk::ChangeDeflateChunkToNormal() {
   type_ = CHUNK_NORMAL;
   // No need to clear the entry name.
   uncompressed_data_.clear();
+  lazy_ = false;
 }
 
 bool ImageChunk::IsAdjacentNormal(const ImageChunk& other) const {
-  if (type_ != CHUNK_NORMAL || other.type_ != CHUNK_NORMAL) {
+  if (type_ != CHUNK_NORMAL || other.type_ != CHUNK_NORMAL || copy_ || other.copy_) {
     return false;
   }
   return (other.start_ == start_ + raw_data_len_);
@@ -331,7 +548,7 @@ void ImageChunk::MergeAdjacentNormal(const ImageChunk& other) {
 
 bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
                            std::vector<uint8_t>* patch_data,
-                           bsdiff::SuffixArrayIndexInterface** bsdiff_cache) {
+                           bsdiff::SuffixArrayIndexInterface** bsdiff_cache, size_t sa_threads) {
 #if defined(__ANDROID__)
   char ptemp[] = "/data/local/tmp/imgdiff-patch-XXXXXX";
 #else
@@ -345,8 +562,34 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   }
   close(fd);
 
-  int r = bsdiff::bsdiff(src.DataForPatch(), src.DataLengthForPatch(), tgt.DataForPatch(),
-                         tgt.DataLengthForPatch(), ptemp, bsdiff_cache);
+  // The lazily uncompressed chunks only get inflated for the duration of the diff.
+  std::vector<uint8_t> src_buffer;
+  std::vector<uint8_t> tgt_buffer;
+  const uint8_t* src_data = src.InflateDataForPatch(&src_buffer);
+  const uint8_t* tgt_data = tgt.InflateDataForPatch(&tgt_buffer);
+  if (src_data == nullptr || tgt_data == nullptr) {
+    unlink(ptemp);
+    return false;
+  }
+
+  // bsdiff sorts the suffixes of a source that has no index yet on a single thread; a large one
+  // gets sorted on |sa_threads| threads into the same index instead.
+  std::unique_ptr<CachedSuffixArrayIndex> local_index;
+  bsdiff::SuffixArrayIndexInterface* local_cache = nullptr;
+  if (sa_threads > 1 && src.DataLengthForPatch() >= kMinParallelSortSize &&
+      (bsdiff_cache == nullptr || *bsdiff_cache == nullptr)) {
+    local_index =
+        CachedSuffixArrayIndex::CreateInMemory(src_data, src.DataLengthForPatch(), sa_threads);
+    if (bsdiff_cache != nullptr) {
+      *bsdiff_cache = local_index.release();
+    } else if (local_index != nullptr) {
+      local_cache = local_index.get();
+      bsdiff_cache = &local_cache;
+    }
+  }
+
+  int r = bsdiff::bsdiff(src_data, src.DataLengthForPatch(), tgt_data, tgt.DataLengthForPatch(),
+                         ptemp, bsdiff_cache);
   if (r != 0) {
     LOG(ERROR) << "bsdiff() failed: " << r;
     return false;
@@ -377,16 +620,26 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   return true;
 }
 
-bool ImageChunk::ReconstructDeflateChunk() {
+bool ImageChunk::ReconstructDeflateChunk(int first_level) {
   if (type_ != CHUNK_DEFLATE) {
     LOG(ERROR) << "Attempted to reconstruct non-deflate chunk";
     return false;
   }
 
   // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
-  // (the maximum).
-  for (int level = 6; level <= 9; level += 3) {
-    if (TryReconstruction(level)) {
+  // (the maximum). A wrong level usually gets rejected within the first output buffer, but trying
+  // the likely one first saves even that.
+  int levels[] = { 6, 9 };
+  if (first_level == levels[1]) {
+    std::swap(levels[0], levels[1]);
+  }
+  std::vector<uint8_t> buffer;
+  const uint8_t* uncompressed_data = InflateDataForPatch(&buffer);
+  if (uncompressed_data == nullptr) {
+    return false;
+  }
+  for (int level : levels) {
+    if (TryReconstruction(level, uncompressed_data)) {
       compress_level_ = level;
       return true;
     }
@@ -396,17 +649,17 @@ bool ImageChunk::ReconstructDeflateChunk() {
 }
 
 /*
- * Takes the uncompressed data stored in the chunk, compresses it using the zlib parameters stored
- * in the chunk, and checks that it matches exactly the compressed data we started with (also
- * stored in the chunk).
+ * Takes the uncompressed data of the chunk, compresses it using the zlib parameters stored in the
+ * chunk, and checks that it matches exactly the compressed data we started with (also stored in
+ * the chunk).
  */
-bool ImageChunk::TryReconstruction(int level) {
+bool ImageChunk::TryReconstruction(int level, const uint8_t* uncompressed_data) {
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
-  strm.avail_in = uncompressed_data_.size();
-  strm.next_in = uncompressed_data_.data();
+  strm.avail_in = DataLengthForPatch();
+  strm.next_in = uncompressed_data;
   int ret = deflateInit2(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
   if (ret < 0) {
     LOG(ERROR) << "Failed to initialize deflate: " << ret;
@@ -464,12 +717,73 @@ PatchChunk::PatchChunk(const ImageChunk& tgt)
       target_compress_level_(tgt.GetCompressLevel()),
       data_(tgt.GetRawData(), tgt.GetRawData() + tgt.GetRawDataLength()) {}
 
+PatchChunk::PatchChunk(const ImageChunk& tgt, int raw_codec, std::vector<uint8_t> compressed)
+    : type_(CHUNK_RAW_COMPRESSED),
+      source_start_(0),
+      source_len_(0),
+      source_uncompressed_len_(0),
+      target_start_(tgt.GetStartOffset()),
+      target_len_(tgt.GetRawDataLength()),
+      target_uncompressed_len_(tgt.DataLengthForPatch()),
+      target_compress_level_(tgt.GetCompressLevel()),
+      raw_codec_(raw_codec),
+      data_(std::move(compressed)) {}
+
 // Return true if raw data is smaller than the patch size.
 bool PatchChunk::RawDataIsSmaller(const ImageChunk& tgt, size_t patch_size) {
   size_t target_len = tgt.GetRawDataLength();
   return target_len < patch_size || (tgt.GetType() == CHUNK_NORMAL && target_len <= 160);
 }
 
+bool PatchChunk::CompressRawData(const ImageChunk& tgt, RawCompression compression,
+                                 int* raw_codec, std::vector<uint8_t>* compressed) {
+  if (compression == RawCompression::kNone || tgt.GetType() != CHUNK_NORMAL) {
+    return false;
+  }
+  const uint8_t* data = tgt.GetRawData();
+  size_t size = tgt.GetRawDataLength();
+
+  std::vector<uint8_t> brotli;
+  if (compression == RawCompression::kBrotli || compression == RawCompression::kAuto) {
+    brotli.resize(BrotliEncoderMaxCompressedSize(size));
+    size_t brotli_size = brotli.size();
+    if (brotli_size == 0 ||
+        !BrotliEncoderCompress(kRawBrotliQuality, BROTLI_MAX_WINDOW_BITS, BROTLI_MODE_GENERIC, size,
+                               data, &brotli_size, brotli.data())) {
+      brotli.clear();
+    } else {
+      brotli.resize(brotli_size);
+    }
+  }
+  std::vector<uint8_t> zstd;
+  if (compression == RawCompression::kZstd || compression == RawCompression::kAuto) {
+    zstd.resize(ZSTD_compressBound(size));
+    size_t zstd_size = ZSTD_compress(zstd.data(), zstd.size(), data, size, kRawZstdLevel);
+    if (ZSTD_isError(zstd_size)) {
+      zstd.clear();
+    } else {
+      zstd.resize(zstd_size);
+    }
+  }
+
+  // zstd decodes several times faster than brotli, which has to save a sixteenth to be picked.
+  if (!zstd.empty() && (brotli.empty() || brotli.size() + brotli.size() / 16 >= zstd.size())) {
+    *raw_codec = RAW_CODEC_ZSTD;
+    *compressed = std::move(zstd);
+  } else if (!brotli.empty()) {
+    *raw_codec = RAW_CODEC_BROTLI;
+    *compressed = std::move(brotli);
+  } else {
+    return false;
+  }
+  // Not worth a codec on the device unless it saves a sixteenth as well.
+  if (compressed->size() + 8 + size / 16 > size) {
+    compressed->clear();
+    return false;
+  }
+  return true;
+}
+
 void PatchChunk::UpdateSourceOffset(const SortedRangeSet& src_range) {
   if (type_ == CHUNK_DEFLATE) {
     source_start_ = src_range.GetOffsetInRangeSet(source_start_);
@@ -481,6 +795,7 @@ void PatchChunk::UpdateSourceOffset(const SortedRangeSet& src_range) {
 // CHUNK_NORMAL   8*3 = 24 bytes
 // CHUNK_DEFLATE  8*5 + 4*5 = 60 bytes
 // CHUNK_RAW      4 bytes + patch_size
+// CHUNK_RAW_COMPRESSED  4*3 bytes + compressed size
 size_t PatchChunk::GetHeaderSize() const {
   switch (type_) {
     case CHUNK_NORMAL:
@@ -489,6 +804,8 @@ size_t PatchChunk::GetHeaderSize() const {
       return 4 + 8 * 5 + 4 * 5;
     case CHUNK_RAW:
       return 4 + 4 + data_.size();
+    case CHUNK_RAW_COMPRESSED:
+      return 4 + 4 * 3 + data_.size();
     default:
       CHECK(false) << "unexpected chunk type: " << type_;  // Should not reach here.
       return 0;
@@ -496,19 +813,19 @@ size_t PatchChunk::GetHeaderSize() const {
 }
 
 // Return the offset of the next patch into the patch data.
-size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
+size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index, size_t data_size) const {
   Write4(fd, type_);
   switch (type_) {
     case CHUNK_NORMAL:
       LOG(INFO) << android::base::StringPrintf("chunk %zu: normal   (%10zu, %10zu)  %10zu", index,
-                                               target_start_, target_len_, data_.size());
+                                               target_start_, target_len_, data_size);
       Write8(fd, static_cast<int64_t>(source_start_));
       Write8(fd, static_cast<int64_t>(source_len_));
       Write8(fd, static_cast<int64_t>(offset));
-      return offset + data_.size();
+      return offset + data_size;
     case CHUNK_DEFLATE:
       LOG(INFO) << android::base::StringPrintf("chunk %zu: deflate  (%10zu, %10zu)  %10zu", index,
-                                               target_start_, target_len_, data_.size());
+                                               target_start_, target_len_, data_size);
       Write8(fd, static_cast<int64_t>(source_start_));
       Write8(fd, static_cast<int64_t>(source_len_));
       Write8(fd, static_cast<int64_t>(offset));
@@ -519,7 +836,7 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
       Write4(fd, ImageChunk::WINDOWBITS);
       Write4(fd, ImageChunk::MEMLEVEL);
       Write4(fd, ImageChunk::STRATEGY);
-      return offset + data_.size();
+      return offset + data_size;
     case CHUNK_RAW:
       LOG(INFO) << android::base::StringPrintf("chunk %zu: raw      (%10zu, %10zu)", index,
                                                target_start_, target_len_);
@@ -528,6 +845,17 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
         CHECK(false) << "Failed to write " << data_.size() << " bytes patch";
       }
       return offset;
+    case CHUNK_RAW_COMPRESSED:
+      LOG(INFO) << android::base::StringPrintf("chunk %zu: raw %-4s (%10zu, %10zu)  %10zu", index,
+                                               raw_codec_ == RAW_CODEC_ZSTD ? "zstd" : "br",
+                                               target_start_, target_len_, data_.size());
+      Write4(fd, raw_codec_);
+      Write4(fd, static_cast<int32_t>(target_len_));
+      Write4(fd, static_cast<int32_t>(data_.size()));
+      if (!android::base::WriteFully(fd, data_.data(), data_.size())) {
+        CHECK(false) << "Failed to write " << data_.size() << " bytes patch";
+      }
+      return offset;
     default:
       CHECK(false) << "unexpected chunk type: " << type_;
       return offset;
@@ -535,44 +863,88 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
 }
 
 size_t PatchChunk::PatchSize() const {
-  if (type_ == CHUNK_RAW) {
+  if (type_ == CHUNK_RAW || type_ == CHUNK_RAW_COMPRESSED) {
     return GetHeaderSize();
   }
   return GetHeaderSize() + data_.size();
 }
 
-// Write the contents of |patch_chunks| to |patch_fd|.
-bool PatchChunk::WritePatchDataToFd(const std::vector<PatchChunk>& patch_chunks, int patch_fd) {
-  // Figure out how big the imgdiff file header is going to be, so that we can correctly compute
-  // the offset of each bsdiff patch within the file.
+bool PatchWriter::Init() {
+#if defined(__ANDROID__)
+  char stemp[] = "/data/local/tmp/imgdiff-spool-XXXXXX";
+#else
+  char stemp[] = "/tmp/imgdiff-spool-XXXXXX";
+#endif
+
+  spool_fd_.reset(mkstemp(stemp));
+  if (spool_fd_ == -1) {
+    PLOG(ERROR) << "Failed to create the patch spool file";
+    return false;
+  }
+  unlink(stemp);
+  return true;
+}
+
+bool PatchWriter::Add(PatchChunk patch) {
+  size_t data_size = 0;
+  if (patch.type_ == CHUNK_NORMAL || patch.type_ == CHUNK_DEFLATE) {
+    data_size = patch.data_.size();
+    if (!android::base::WriteFully(spool_fd_, patch.data_.data(), data_size)) {
+      PLOG(ERROR) << "Failed to spool " << data_size << " bytes patch";
+      return false;
+    }
+    spool_size_ += data_size;
+    std::vector<uint8_t>().swap(patch.data_);
+  }
+  patch_size_ += patch.GetHeaderSize() + data_size;
+  headers_.push_back(std::move(patch));
+  data_sizes_.push_back(data_size);
+  return true;
+}
+
+void PatchWriter::UpdateSourceOffset(const SortedRangeSet& src_range) {
+  for (auto& patch : headers_) {
+    patch.UpdateSourceOffset(src_range);
+  }
+}
+
+bool PatchWriter::Finish(int patch_fd) const {
   size_t total_header_size = 12;
-  for (const auto& patch : patch_chunks) {
+  for (const auto& patch : headers_) {
     total_header_size += patch.GetHeaderSize();
   }
 
-  size_t offset = total_header_size;
-
-  // Write out the headers.
-  if (!android::base::WriteStringToFd("IMGDIFF" + std::to_string(VERSION), patch_fd)) {
-    PLOG(ERROR) << "Failed to write \"IMGDIFF" << VERSION << "\"";
+  size_t version = VERSION;
+  for (const auto& patch : headers_) {
+    if (patch.type_ == CHUNK_RAW_COMPRESSED) {
+      version = kCompressedRawVersion;
+    }
+  }
+  if (!android::base::WriteStringToFd("IMGDIFF" + std::to_string(version), patch_fd)) {
+    PLOG(ERROR) << "Failed to write \"IMGDIFF" << version << "\"";
     return false;
   }
 
-  Write4(patch_fd, static_cast<int32_t>(patch_chunks.size()));
-  LOG(INFO) << "Writing " << patch_chunks.size() << " patch headers...";
-  for (size_t i = 0; i < patch_chunks.size(); ++i) {
-    offset = patch_chunks[i].WriteHeaderToFd(patch_fd, offset, i);
+  Write4(patch_fd, static_cast<int32_t>(headers_.size()));
+  LOG(INFO) << "Writing " << headers_.size() << " patch headers...";
+  size_t offset = total_header_size;
+  for (size_t i = 0; i < headers_.size(); ++i) {
+    offset = headers_[i].WriteHeaderToFd(patch_fd, offset, i, data_sizes_[i]);
   }
 
-  // Append each chunk's bsdiff patch, in order.
-  for (const auto& patch : patch_chunks) {
-    if (patch.type_ == CHUNK_RAW) {
-      continue;
+  // Append the spooled bsdiff patches, which are in the order of the chunks already.
+  std::vector<uint8_t> buffer(BUFFER_SIZE);
+  for (size_t pos = 0; pos < spool_size_;) {
+    size_t length = std::min(buffer.size(), spool_size_ - pos);
+    if (!android::base::ReadFullyAtOffset(spool_fd_, buffer.data(), length, pos)) {
+      PLOG(ERROR) << "Failed to read " << length << " bytes from the patch spool";
+      return false;
     }
-    if (!android::base::WriteFully(patch_fd, patch.data_.data(), patch.data_.size())) {
-      PLOG(ERROR) << "Failed to write " << patch.data_.size() << " bytes patch to patch_fd";
+    if (!android::base::WriteFully(patch_fd, buffer.data(), length)) {
+      PLOG(ERROR) << "Failed to write " << length << " bytes patch to patch_fd";
       return false;
     }
+    pos += length;
   }
 
   return true;
@@ -801,15 +1173,11 @@ bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::strin
                  << uncompressed_len;
       return false;
     }
-    std::vector<uint8_t> uncompressed_data(uncompressed_len);
-    int ret = ExtractToMemory(handle, entry, uncompressed_data.data(), uncompressed_len);
-    if (ret != 0) {
-      LOG(ERROR) << "Failed to extract " << entry_name << " with size " << uncompressed_len << ": "
-                 << ErrorCodeString(ret);
-      return false;
-    }
+    // Don't extract the entry up front, but let the chunk inflate its data in place whenever it
+    // gets reconstructed or diffed. Holding all the uncompressed entries would otherwise take a
+    // multiple of the zip size.
     ImageChunk curr(CHUNK_DEFLATE, entry->offset, &file_content_, compressed_len, entry_name);
-    curr.SetUncompressedData(std::move(uncompressed_data));
+    curr.SetLazyUncompressedData(uncompressed_len, entry->crc32);
     chunks_.push_back(std::move(curr));
   } else {
     chunks_.emplace_back(CHUNK_NORMAL, entry->offset, &file_content_, compressed_len, entry_name);
@@ -886,32 +1254,191 @@ ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_nor
       static_cast<const ZipModeImage*>(this)->FindChunkByName(name, find_normal));
 }
 
-bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image) {
+ImageChunk* ZipModeImage::FindChunkByContent(const ImageChunk& chunk) {
+  return FindChunksByContent({ &chunk }, 1)[0];
+}
+
+std::vector<ImageChunk*> ZipModeImage::FindChunksByContent(
+    const std::vector<const ImageChunk*>& chunks, size_t jobs) {
+  if (!content_index_built_) {
+    for (size_t i = 0; i < chunks_.size(); i++) {
+      if (chunks_[i].HasContentKey()) {
+        auto key = std::make_pair(chunks_[i].GetCrc32(), chunks_[i].DataLengthForPatch());
+        content_index_.emplace(key, i);
+      }
+    }
+    content_index_built_ = true;
+  }
+
+  // Only inflate the chunks for the SHA-1s if there's any candidate, and each of them once. The
+  // chunks to hash are collected first, so that the inflation can run on up to |jobs| threads.
+  std::vector<std::string> sha1s(chunks.size());
+  std::vector<std::pair<const ImageChunk*, std::string*>> to_hash;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    const ImageChunk* chunk = chunks[i];
+    if (!chunk->HasContentKey() ||
+        content_index_.count(std::make_pair(chunk->GetCrc32(), chunk->DataLengthForPatch())) == 0) {
+      continue;
+    }
+    to_hash.emplace_back(chunk, &sha1s[i]);
+  }
+  // The candidates that haven't been hashed yet. std::map doesn't move its values on insertion.
+  size_t num_targets = to_hash.size();
+  for (size_t i = 0; i < num_targets; i++) {
+    const ImageChunk* chunk = to_hash[i].first;
+    auto [begin, end] =
+        content_index_.equal_range(std::make_pair(chunk->GetCrc32(), chunk->DataLengthForPatch()));
+    for (auto it = begin; it != end; it++) {
+      auto [sha1_it, inserted] = content_sha1s_.emplace(it->second, "");
+      if (inserted && chunks_[it->second].HasContentKey()) {
+        to_hash.emplace_back(&chunks_[it->second], &sha1_it->second);
+      }
+    }
+  }
+
+  std::atomic<size_t> next_chunk{ 0 };
+  auto hash = [&]() {
+    for (size_t i = next_chunk++; i < to_hash.size(); i = next_chunk++) {
+      *to_hash[i].second = to_hash[i].first->GetContentSha1();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < std::min(jobs, to_hash.size()); t++) {
+    threads.emplace_back(hash);
+  }
+  hash();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // The first matching candidate in the index order wins, regardless of the threads.
+  std::vector<ImageChunk*> result(chunks.size(), nullptr);
+  for (size_t i = 0; i < chunks.size(); i++) {
+    if (sha1s[i].empty()) {
+      continue;
+    }
+    const ImageChunk* chunk = chunks[i];
+    auto [begin, end] =
+        content_index_.equal_range(std::make_pair(chunk->GetCrc32(), chunk->DataLengthForPatch()));
+    for (auto it = begin; it != end; it++) {
+      ImageChunk& candidate = chunks_[it->second];
+      // It may have become a normal chunk since.
+      if (candidate.HasContentKey() && content_sha1s_[it->second] == sha1s[i]) {
+        result[i] = &candidate;
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                         size_t jobs) {
+  // The source chunks of the target deflate chunks by name. The entries that have no source entry
+  // by the same name may have been renamed or moved, with the same contents; they get looked up by
+  // their contents all at once, which inflates the candidates on up to |jobs| threads. The lookups
+  // are done before any chunk changes below, and the results get applied in the chunk order.
+  std::vector<ImageChunk*> tgt_chunks;
+  std::vector<ImageChunk*> src_chunks;
+  std::vector<const ImageChunk*> unmatched;
+  std::vector<size_t> unmatched_indices;
   for (auto& tgt_chunk : *tgt_image) {
     if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
       continue;
     }
-
     ImageChunk* src_chunk = src_image->FindChunkByName(tgt_chunk.GetEntryName());
+    if (src_chunk == nullptr) {
+      unmatched.push_back(&tgt_chunk);
+      unmatched_indices.push_back(tgt_chunks.size());
+    }
+    tgt_chunks.push_back(&tgt_chunk);
+    src_chunks.push_back(src_chunk);
+  }
+  std::vector<bool> by_content(tgt_chunks.size(), false);
+  if (!unmatched.empty()) {
+    std::vector<ImageChunk*> matches = src_image->FindChunksByContent(unmatched, jobs);
+    for (size_t i = 0; i < matches.size(); i++) {
+      src_chunks[unmatched_indices[i]] = matches[i];
+      by_content[unmatched_indices[i]] = true;
+    }
+  }
+
+  // The target deflate chunks that need to be reconstructed, along with their source chunks.
+  std::vector<std::pair<ImageChunk*, ImageChunk*>> deflate_chunks;
+  for (size_t i = 0; i < tgt_chunks.size(); i++) {
+    ImageChunk& tgt_chunk = *tgt_chunks[i];
+    ImageChunk* src_chunk = src_chunks[i];
+    if (src_chunk != nullptr && by_content[i]) {
+      // A content match; the source chunk may have been taken by an identical target chunk since.
+      if (src_chunk->GetType() != CHUNK_DEFLATE) {
+        src_chunk = nullptr;
+      } else {
+        LOG(INFO) << "Matched target entry [" << tgt_chunk.GetEntryName()
+                  << "] to source entry [" << src_chunk->GetEntryName() << "] by contents";
+        tgt_chunk.SetSourceEntryName(src_chunk->GetEntryName());
+      }
+    }
     if (src_chunk == nullptr) {
       tgt_chunk.ChangeDeflateChunkToNormal();
     } else if (tgt_chunk == *src_chunk) {
       // If two deflate chunks are identical (eg, the kernel has not changed between two builds),
       // treat them as normal chunks. This makes applypatch much faster -- it can apply a trivial
       // patch to the compressed data, rather than uncompressing and recompressing to apply the
-      // trivial patch to the uncompressed data.
+      // trivial patch to the uncompressed data. Unless the image gets split, the target chunk
+      // also gets diffed against just its source chunk, rather than the whole source file.
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk->ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+      if (tgt_image->limit_ == 0) {
+        tgt_chunk.SetCopy();
+      }
+    } else {
+      deflate_chunks.emplace_back(&tgt_chunk, src_chunk);
+    }
+  }
+
+  // Recompressing the chunks is the expensive part, and each reconstruction only touches its own
+  // target chunk, so they run on up to |jobs| threads. The entries of one zip tend to share the
+  // compression level, which gets tried first for the following chunks.
+  std::vector<uint8_t> reconstructed(deflate_chunks.size());
+  std::atomic<size_t> next_chunk{ 0 };
+  std::atomic<int> last_level{ 6 };
+  auto reconstruct = [&]() {
+    for (size_t i = next_chunk++; i < deflate_chunks.size(); i = next_chunk++) {
+      ImageChunk* tgt_chunk = deflate_chunks[i].first;
+      reconstructed[i] = tgt_chunk->ReconstructDeflateChunk(last_level);
+      if (reconstructed[i]) {
+        last_level = tgt_chunk->GetCompressLevel();
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < std::min(jobs, deflate_chunks.size()); t++) {
+    threads.emplace_back(reconstruct);
+  }
+  reconstruct();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < deflate_chunks.size(); i++) {
+    auto [tgt_chunk, src_chunk] = deflate_chunks[i];
+    if (!reconstructed[i]) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image. Treat the chunk as a normal non-deflated chunk.
-      LOG(WARNING) << "Failed to reconstruct target deflate chunk [" << tgt_chunk.GetEntryName()
+      LOG(WARNING) << "Failed to reconstruct target deflate chunk [" << tgt_chunk->GetEntryName()
                    << "]; treating as normal";
 
-      tgt_chunk.ChangeDeflateChunkToNormal();
+      tgt_chunk->ChangeDeflateChunkToNormal();
       src_chunk->ChangeDeflateChunkToNormal();
     }
   }
+  // A source chunk may be shared by several target chunks (e.g. with the split entries), where one
+  // of them may have turned it into a normal chunk above.
+  for (auto [tgt_chunk, src_chunk] : deflate_chunks) {
+    if (src_chunk->GetType() != CHUNK_DEFLATE) {
+      tgt_chunk->ChangeDeflateChunkToNormal();
+    }
+  }
 
   // For zips, we only need merge normal chunks for the target:  deflated chunks are matched via
   // filename, and normal chunks are patched using the entire source file as the source.
@@ -923,36 +1450,215 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
   return true;
 }
 
-// For each target chunk, look for the corresponding source chunk by the zip_entry name. If
-// found, add the range of this chunk in the original source file to the block aligned source
-// ranges. Construct the split src & tgt image once the size of source range reaches limit.
-bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
-                                              const ZipModeImage& src_image,
-                                              std::vector<ZipModeImage>* split_tgt_images,
-                                              std::vector<ZipModeImage>* split_src_images,
-                                              std::vector<SortedRangeSet>* split_src_ranges) {
-  CHECK_EQ(tgt_image.limit_, src_image.limit_);
-  size_t limit = tgt_image.limit_;
+// The cost model that the split images get planned with. A target chunk whose source stays
+// intact in its split is expected to diff down to 1/kMatchedPatchRatio of its size; a chunk without
+// a source, or whose source gets trimmed because its blocks went to an earlier split, is expected
+// to cost as much as itself.
+static constexpr size_t kMatchedPatchRatio = 4;
 
-  src_image.DumpChunks();
-  LOG(INFO) << "Splitting " << tgt_image.NumOfChunks() << " tgt chunks...";
+static size_t PredictPatchSize(const ImageChunk& tgt, bool source_kept) {
+  return source_kept ? tgt.GetRawDataLength() / kMatchedPatchRatio : tgt.GetRawDataLength();
+}
+
+// Returns the blocks [begin, end) that |length| bytes at |start| occupy, as SortedRangeSet takes
+// them.
+static std::pair<size_t, size_t> BlockRange(size_t start, size_t length) {
+  return { start / BLOCK_SIZE, (start + length - 1) / BLOCK_SIZE + 1 };
+}
+
+// Plans the split images for SplitZipModeImageWithLimit(), where each target chunk of |tgt_image|
+// has the source chunk in |src_chunks| (or nullptr). Of all the ways to cut the target chunks into
+// splits that fit in |limit|, it takes the one with the fewest splits, and among those the smallest
+// predicted patch size; i.e. the one that cuts the fewest chunks off their sources. The limit gets
+// checked, and the sources get trimmed, as CutSplitPieces() and RemoveUsedBlocks() do, with each
+// source block going to the first chunk that uses it; so what a split costs only depends on its
+// first and last chunks. Returns the index of the first chunk of each split, and the predicted
+// patch size in |predicted_patch_size|.
+static std::vector<size_t> PlanSplitImages(const ZipModeImage& tgt_image,
+                                           const std::vector<const ImageChunk*>& src_chunks,
+                                           const ImageChunk& central_directory, size_t src_size,
+                                           size_t limit, size_t* predicted_patch_size) {
+  constexpr ptrdiff_t kUnused = std::numeric_limits<ptrdiff_t>::max();
+  // The central directory is put aside for the last split from the start.
+  constexpr ptrdiff_t kReserved = -1;
+  const size_t n = tgt_image.NumOfChunks();
+
+  // The source ranges that RemoveUsedBlocks() tries in turn for each chunk: the whole range, the
+  // one with the head trimmed, and the one with both ends trimmed.
+  struct Trim {
+    size_t start = 0;
+    size_t length = 0;  // 0 if nothing is left.
+    ptrdiff_t first_user = kUnused;
+    size_t own_blocks = 0;  // The blocks that no chunk before uses.
+  };
+  std::vector<std::array<Trim, 3>> trims(n);
+  for (size_t k = 0; k < n; k++) {
+    if (src_chunks[k] == nullptr) {
+      continue;
+    }
+    size_t start = src_chunks[k]->GetStartOffset();
+    size_t length = src_chunks[k]->GetRawDataLength();
+    trims[k][0] = { start, length };
+    if (AlignHead(&start, &length)) {
+      trims[k][1] = { start, length };
+      if (AlignTail(&start, &length)) {
+        trims[k][2] = { start, length };
+      }
+    }
+  }
+
+  // The first chunk that uses each source block. A chunk gets trimmed the most if all the chunks
+  // before it are in the earlier splits; the blocks that it then uses are the ones that no chunk
+  // before uses, which stay the same however less it gets trimmed in the actual split.
+  std::vector<ptrdiff_t> first_users((src_size + BLOCK_SIZE - 1) / BLOCK_SIZE, kUnused);
+  auto [cd_begin, cd_end] =
+      BlockRange(central_directory.GetStartOffset(), central_directory.DataLengthForPatch());
+  std::fill(first_users.begin() + cd_begin, first_users.begin() + cd_end, kReserved);
+  for (size_t k = 0; k < n; k++) {
+    for (const auto& trim : trims[k]) {
+      if (trim.length == 0) {
+        break;
+      }
+      auto [begin, end] = BlockRange(trim.start, trim.length);
+      if (std::all_of(first_users.begin() + begin, first_users.begin() + end,
+                      [](ptrdiff_t user) { return user == kUnused; })) {
+        std::fill(first_users.begin() + begin, first_users.begin() + end, k);
+        break;
+      }
+    }
+  }
+  for (size_t k = 0; k < n; k++) {
+    for (auto& trim : trims[k]) {
+      if (trim.length == 0) {
+        break;
+      }
+      auto [begin, end] = BlockRange(trim.start, trim.length);
+      for (size_t b = begin; b < end; b++) {
+        trim.first_user = std::min(trim.first_user, first_users[b]);
+        ptrdiff_t user = first_users[b];
+        trim.own_blocks += (user == static_cast<ptrdiff_t>(k) || user == kUnused);
+      }
+    }
+  }
+  // Returns the source range that chunk |k| keeps in a split starting at chunk |j|, or nullptr if
+  // it has none. It's the first one of |trims| if the source stays intact.
+  auto trim_in_split = [&](size_t k, size_t j) -> const Trim* {
+    for (const auto& trim : trims[k]) {
+      if (trim.length == 0) {
+        break;
+      }
+      if (trim.first_user >= static_cast<ptrdiff_t>(j)) {
+        return &trim;
+      }
+    }
+    return nullptr;
+  };
+
+  // The best plan for the chunks from |j| on, found backwards from the end. A tie goes to the
+  // longer first split, which is what filling up the splits in order would give.
+  struct Plan {
+    size_t splits = SIZE_MAX;
+    size_t patch_size = 0;
+    size_t next = 0;  // Where the second split starts.
+  };
+  std::vector<Plan> plans(n + 1);
+  plans[n] = { 0, 0, n };
+  for (size_t j = n; j-- > 0;) {
+    size_t blocks = 0;
+    size_t patch_size = 0;
+    // A split whose target data ends within the block where it starts doesn't make a split image
+    // by itself; AddSplitImageFromChunkList() leaves it to the tail of the previous one.
+    size_t tgt_start = tgt_image[j].GetStartOffset();
+    size_t tgt_block_end =
+        (tgt_start % BLOCK_SIZE == 0) ? tgt_start : (tgt_start / BLOCK_SIZE + 1) * BLOCK_SIZE;
+    for (size_t k = j; k < n; k++) {
+      const Trim* trim = trim_in_split(k, j);
+      if (trim != nullptr) {
+        if (blocks * BLOCK_SIZE + trim->length > limit) {
+          break;
+        }
+        blocks += trim->own_blocks;
+      }
+      patch_size += PredictPatchSize(tgt_image[k], trim == &trims[k][0]);
+      // A split needs some source, except the last one that gets the central directory.
+      const Plan& rest = plans[k + 1];
+      if ((blocks == 0 && k + 1 < n) || rest.splits == SIZE_MAX) {
+        continue;
+      }
+      bool absorbed =
+          tgt_image[k].GetStartOffset() + tgt_image[k].GetRawDataLength() <= tgt_block_end;
+      Plan plan{ rest.splits + (absorbed ? 0 : 1), patch_size + rest.patch_size, k + 1 };
+      if (plan.splits < plans[j].splits ||
+          (plan.splits == plans[j].splits && plan.patch_size <= plans[j].patch_size)) {
+        plans[j] = plan;
+      }
+    }
+    // Nothing fits; leave the cut to CutSplitPieces().
+    if (plans[j].splits == SIZE_MAX) {
+      plans[j] = { plans[j + 1].splits + 1, plans[j + 1].patch_size, j + 1 };
+    }
+  }
 
+  std::vector<size_t> split_starts;
+  for (size_t j = 0; j < n; j = plans[j].next) {
+    split_starts.push_back(j);
+  }
+  *predicted_patch_size = plans[0].patch_size;
+  return split_starts;
+}
+
+// The chunks of a split image, before AddSplitImageFromChunkList() constructs it.
+struct SplitPiece {
+  std::vector<ImageChunk> tgt_chunks;
+  std::vector<ImageChunk> src_chunks;
+  SortedRangeSet src_ranges;
+  size_t predicted_patch_size = 0;
+};
+
+// For each target chunk, look for the corresponding source chunk in |src_chunks|. If found, add the
+// range of this chunk in the original source file to the block aligned source ranges. Cut the
+// split pieces before the chunks in |split_before|, or once the size of source range reaches limit.
+// The pieces that AddSplitImageFromChunkList() wouldn't make an image of are left out, as their
+// target chunks go to the tail of the previous piece.
+static std::vector<SplitPiece> CutSplitPieces(const ZipModeImage& tgt_image,
+                                              const std::vector<uint8_t>* tgt_content,
+                                              const std::vector<const ImageChunk*>& src_chunks,
+                                              const ImageChunk& central_directory, size_t limit,
+                                              const std::vector<bool>& split_before) {
   SortedRangeSet used_src_ranges;  // ranges used for previous split source images.
 
   // Reserve the central directory in advance for the last split image.
-  const auto& central_directory = src_image.cend() - 1;
-  CHECK_EQ(CHUNK_NORMAL, central_directory->GetType());
-  used_src_ranges.Insert(central_directory->GetStartOffset(),
-                         central_directory->DataLengthForPatch());
+  used_src_ranges.Insert(central_directory.GetStartOffset(),
+                         central_directory.DataLengthForPatch());
+
+  std::vector<SplitPiece> pieces;
+  SplitPiece piece;
+  auto add_piece = [&]() {
+    bool has_aligned_data =
+        std::any_of(piece.tgt_chunks.begin(), piece.tgt_chunks.end(), [](const ImageChunk& chunk) {
+          size_t start = chunk.GetStartOffset();
+          size_t length = chunk.GetRawDataLength();
+          return AlignHead(&start, &length);
+        });
+    // No need to update the used ranges if we don't make a split image.
+    if (has_aligned_data) {
+      used_src_ranges.Insert(piece.src_ranges);
+      pieces.push_back(std::move(piece));
+    }
+    piece = {};
+  };
 
-  SortedRangeSet src_ranges;
-  std::vector<ImageChunk> split_src_chunks;
-  std::vector<ImageChunk> split_tgt_chunks;
-  for (auto tgt = tgt_image.cbegin(); tgt != tgt_image.cend(); tgt++) {
-    const ImageChunk* src = src_image.FindChunkByName(tgt->GetEntryName(), true);
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    const ImageChunk& tgt = tgt_image[i];
+    if (split_before[i] && !piece.tgt_chunks.empty() && piece.src_ranges.blocks() > 0) {
+      add_piece();
+    }
+
+    const ImageChunk* src = src_chunks[i];
     if (src == nullptr) {
-      split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
-                                    tgt->GetRawDataLength());
+      piece.tgt_chunks.emplace_back(CHUNK_NORMAL, tgt.GetStartOffset(), tgt_content,
+                                    tgt.GetRawDataLength());
+      piece.predicted_patch_size += PredictPatchSize(tgt, false);
       continue;
     }
 
@@ -965,52 +1671,106 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
     // Make sure this source range hasn't been used before so that the src_range pieces don't
     // overlap with each other.
     if (!RemoveUsedBlocks(&src_offset, &src_length, used_src_ranges)) {
-      split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
-                                    tgt->GetRawDataLength());
-    } else if (src_ranges.blocks() * BLOCK_SIZE + src_length <= limit) {
-      src_ranges.Insert(src_offset, src_length);
+      piece.tgt_chunks.emplace_back(CHUNK_NORMAL, tgt.GetStartOffset(), tgt_content,
+                                    tgt.GetRawDataLength());
+      piece.predicted_patch_size += PredictPatchSize(tgt, false);
+    } else if (piece.src_ranges.blocks() * BLOCK_SIZE + src_length <= limit) {
+      piece.src_ranges.Insert(src_offset, src_length);
 
       // Add the deflate source chunk if it hasn't been aligned.
       if (src->GetType() == CHUNK_DEFLATE && src_length == src->GetRawDataLength()) {
-        split_src_chunks.push_back(*src);
-        split_tgt_chunks.push_back(*tgt);
+        piece.src_chunks.push_back(*src);
+        piece.tgt_chunks.push_back(tgt);
       } else {
         // TODO split smarter to avoid alignment of large deflate chunks
-        split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
-                                      tgt->GetRawDataLength());
+        piece.tgt_chunks.emplace_back(CHUNK_NORMAL, tgt.GetStartOffset(), tgt_content,
+                                      tgt.GetRawDataLength());
       }
+      piece.predicted_patch_size += PredictPatchSize(tgt, src_length == src->GetRawDataLength());
     } else {
-      bool added_image = ZipModeImage::AddSplitImageFromChunkList(
-          tgt_image, src_image, src_ranges, split_tgt_chunks, split_src_chunks, split_tgt_images,
-          split_src_images);
-
-      split_tgt_chunks.clear();
-      split_src_chunks.clear();
-      // No need to update the split_src_ranges if we don't update the split source images.
-      if (added_image) {
-        used_src_ranges.Insert(src_ranges);
-        split_src_ranges->push_back(std::move(src_ranges));
-      }
-      src_ranges = {};
+      add_piece();
 
       // We don't have enough space for the current chunk; start a new split image and handle
       // this chunk there.
-      tgt--;
+      i--;
     }
   }
 
   // TODO Trim it in case the CD exceeds limit too much.
-  src_ranges.Insert(central_directory->GetStartOffset(), central_directory->DataLengthForPatch());
-  bool added_image = ZipModeImage::AddSplitImageFromChunkList(tgt_image, src_image, src_ranges,
-                                                              split_tgt_chunks, split_src_chunks,
-                                                              split_tgt_images, split_src_images);
-  if (added_image) {
-    split_src_ranges->push_back(std::move(src_ranges));
+  piece.src_ranges.Insert(central_directory.GetStartOffset(),
+                          central_directory.DataLengthForPatch());
+  add_piece();
+  return pieces;
+}
+
+static size_t PredictedPatchSize(const std::vector<SplitPiece>& pieces) {
+  size_t patch_size = 0;
+  for (const auto& piece : pieces) {
+    patch_size += piece.predicted_patch_size;
+  }
+  return patch_size;
+}
+
+bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
+                                              const ZipModeImage& src_image,
+                                              std::vector<ZipModeImage>* split_tgt_images,
+                                              std::vector<ZipModeImage>* split_src_images,
+                                              std::vector<SortedRangeSet>* split_src_ranges,
+                                              std::vector<size_t>* predicted_patch_sizes) {
+  CHECK_EQ(tgt_image.limit_, src_image.limit_);
+  size_t limit = tgt_image.limit_;
+
+  src_image.DumpChunks();
+  LOG(INFO) << "Splitting " << tgt_image.NumOfChunks() << " tgt chunks...";
+
+  const auto& central_directory = src_image.cend() - 1;
+  CHECK_EQ(CHUNK_NORMAL, central_directory->GetType());
+
+  std::vector<const ImageChunk*> src_chunks;
+  for (auto tgt = tgt_image.cbegin(); tgt != tgt_image.cend(); tgt++) {
+    src_chunks.push_back(src_image.FindChunkByName(tgt->GetSourceEntryName(), true));
+  }
+  size_t planned_size;
+  std::vector<bool> split_before(tgt_image.NumOfChunks());
+  for (size_t start : PlanSplitImages(tgt_image, src_chunks, *central_directory,
+                                      src_image.file_content_.size(), limit, &planned_size)) {
+    split_before[start] = true;
+  }
+  std::vector<SplitPiece> pieces = CutSplitPieces(tgt_image, &tgt_image.file_content_, src_chunks,
+                                                  *central_directory, limit, split_before);
+
+  // The plan only estimates how the sources get trimmed. Cut the pieces by the size limit alone
+  // instead, if the plan turns out no better that way.
+  std::vector<SplitPiece> filled_pieces =
+      CutSplitPieces(tgt_image, &tgt_image.file_content_, src_chunks, *central_directory, limit,
+                     std::vector<bool>(tgt_image.NumOfChunks()));
+  LOG(INFO) << "Planned " << pieces.size() << " split images with a predicted patch size of "
+            << PredictedPatchSize(pieces) << " (" << planned_size << " planned), against "
+            << filled_pieces.size() << " of " << PredictedPatchSize(filled_pieces)
+            << " when filled up in order";
+  if (std::make_pair(filled_pieces.size(), PredictedPatchSize(filled_pieces)) <
+      std::make_pair(pieces.size(), PredictedPatchSize(pieces))) {
+    pieces = std::move(filled_pieces);
+  }
+
+  std::vector<size_t> predicted_sizes;
+  for (auto& piece : pieces) {
+    bool added_image = ZipModeImage::AddSplitImageFromChunkList(
+        tgt_image, src_image, piece.src_ranges, piece.tgt_chunks, piece.src_chunks,
+        split_tgt_images, split_src_images);
+    CHECK(added_image);
+    LOG(INFO) << "Split " << split_src_ranges->size() << ": source " << piece.src_ranges.ToString()
+              << ", predicted patch size " << piece.predicted_patch_size;
+    split_src_ranges->push_back(std::move(piece.src_ranges));
+    predicted_sizes.push_back(piece.predicted_patch_size);
   }
 
   ValidateSplitImages(*split_tgt_images, *split_src_images, *split_src_ranges,
                       tgt_image.file_content_.size());
 
+  if (predicted_patch_sizes != nullptr) {
+    *predicted_patch_sizes = std::move(predicted_sizes);
+  }
   return true;
 }
 
@@ -1123,55 +1883,88 @@ void ZipModeImage::ValidateSplitImages(const std::vector<ZipModeImage>& split_tg
 
 bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
                                            const ZipModeImage& src_image,
-                                           std::vector<PatchChunk>* patch_chunks) {
+                                           PatchWriter* writer, size_t jobs,
+                                           const std::string& sa_cache_dir, size_t sa_threads,
+                                           RawCompression raw_compression) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
-  patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  // The source of each target chunk, or nullptr if the chunk is stored as raw data anyway. The
+  // chunks without a matching source are diffed against the pseudo source, whose suffix array gets
+  // built once and shared through bsdiff_cache.
+  const ImageChunk pseudo_source = src_image.PseudoSource();
+  std::vector<const ImageChunk*> src_chunks(tgt_image.NumOfChunks());
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
-
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
       continue;
     }
+    // A copy gets diffed against its source chunk, which has become a normal chunk as well.
+    const ImageChunk* src_chunk = nullptr;
+    if (tgt_chunk.GetType() == CHUNK_DEFLATE || tgt_chunk.IsCopy()) {
+      src_chunk = src_image.FindChunkByName(tgt_chunk.GetSourceEntryName(), tgt_chunk.IsCopy());
+    }
+    src_chunks[i] = (src_chunk == nullptr) ? &pseudo_source : src_chunk;
+  }
 
-    const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
-                                      ? nullptr
-                                      : src_image.FindChunkByName(tgt_chunk.GetEntryName());
-
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
+  // Map (or build and store) the suffix array of the pseudo source from the cache if asked, which
+  // otherwise gets built by the first bsdiff() call that needs it.
+  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  if (!sa_cache_dir.empty() &&
+      std::find(src_chunks.begin(), src_chunks.end(), &pseudo_source) != src_chunks.end()) {
+    bsdiff_cache = CachedSuffixArrayIndex::Create(sa_cache_dir, pseudo_source.DataForPatch(),
+                                                  pseudo_source.DataLengthForPatch(), sa_threads)
+                       .release();
+  }
+  std::vector<std::vector<uint8_t>> patches(tgt_image.NumOfChunks());
+  std::vector<CompressedRaw> compressed_raws(tgt_image.NumOfChunks());
+  auto make_patch = [&](size_t i) {
+    const auto& tgt_chunk = tgt_image[i];
     bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
-
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
+        (src_chunks[i] == &pseudo_source) ? &bsdiff_cache : nullptr;
+    if (!ImageChunk::MakePatch(tgt_chunk, *src_chunks[i], &patches[i], bsdiff_cache_ptr,
+                               sa_threads)) {
       LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
       return false;
     }
-
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
-
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
-      patch_chunks->emplace_back(tgt_chunk);
-    } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
-    }
-  }
+    CompressRawChunk(tgt_chunk, patches[i].size(), raw_compression, &compressed_raws[i]);
+    return true;
+  };
+
+  auto write_patch = [&](size_t i) {
+    return writer->Add(
+        ChoosePatchChunk(tgt_image[i], src_chunks[i], &patches[i], &compressed_raws[i]));
+  };
+
+  // Unless it's been cached, the first chunk that needs the pseudo source builds its suffix array,
+  // before the chunks get diffed on |jobs| threads. The suffix array is only read from then on.
+  size_t first = src_chunks.size();
+  if (bsdiff_cache == nullptr) {
+    first = std::find(src_chunks.begin(), src_chunks.end(), &pseudo_source) - src_chunks.begin();
+  }
+  bool result = MakePatchesInOrder(
+      src_chunks.size(), jobs, first,
+      [&](size_t i) { return src_chunks[i] == nullptr || make_patch(i); }, write_patch);
   delete bsdiff_cache;
+  if (!result) {
+    return false;
+  }
 
-  CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
+  CHECK_EQ(writer->NumOfChunks(), tgt_image.NumOfChunks());
   return true;
 }
 
 bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                   const std::string& patch_name) {
-  std::vector<PatchChunk> patch_chunks;
-
-  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks);
-
-  CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
+                                   const std::string& patch_name, size_t jobs,
+                                   const std::string& sa_cache_dir, size_t sa_threads,
+                                   RawCompression raw_compression) {
+  PatchWriter writer;
+  if (!writer.Init() ||
+      !ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &writer, jobs, sa_cache_dir,
+                                             sa_threads, raw_compression)) {
+    return false;
+  }
 
   android::base::unique_fd patch_fd(
       open(patch_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR));
@@ -1180,7 +1973,18 @@ bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeI
     return false;
   }
 
-  return PatchChunk::WritePatchDataToFd(patch_chunks, patch_fd);
+  return writer.Finish(patch_fd);
+}
+
+// Roughly estimates the peak memory to diff a split piece: the suffix array of the source (one
+// saidx_t per byte) and the source data, plus the target data and its patch.
+static size_t EstimatePatchMemory(const ZipModeImage& tgt_image, const ZipModeImage& src_image) {
+  size_t src_size = src_image.PseudoSource().DataLengthForPatch();
+  size_t tgt_size = 0;
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    tgt_size += tgt_image[i].DataLengthForPatch();
+  }
+  return src_size * (sizeof(int32_t) + 1) + tgt_size * 2;
 }
 
 bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_images,
@@ -1188,7 +1992,9 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
                                    const std::vector<SortedRangeSet>& split_src_ranges,
                                    const std::string& patch_name,
                                    const std::string& split_info_file,
-                                   const std::string& debug_dir) {
+                                   const std::string& debug_dir, size_t jobs,
+                                   size_t memory_limit, const std::string& sa_cache_dir,
+                                   size_t sa_threads, RawCompression raw_compression) {
   LOG(INFO) << "Constructing patches for " << split_tgt_images.size() << " split images...";
 
   android::base::unique_fd patch_fd(
@@ -1198,22 +2004,49 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
     return false;
   }
 
+  // The split pieces get diffed on up to |jobs| threads, while this thread writes out the finished
+  // ones in order. A piece holds its share of |memory_limit| until it's been written.
+  struct SplitPatch {
+    bool done = false;
+    bool success = false;
+    size_t memory = 0;
+    PatchWriter writer;
+  };
+  size_t num_splits = split_tgt_images.size();
+  std::vector<SplitPatch> split_patches(num_splits);
+  size_t split_jobs = std::min(jobs, num_splits);
+  // Diff the chunks within a piece concurrently instead, if there's nothing else to run alongside.
+  size_t chunk_jobs = (split_jobs > 1) ? 1 : jobs;
+
   std::vector<std::string> split_info_list;
-  for (size_t i = 0; i < split_tgt_images.size(); i++) {
-    std::vector<PatchChunk> patch_chunks;
-    if (!ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
-                                               &patch_chunks)) {
-      LOG(ERROR) << "Failed to generate split patch";
-      return false;
-    }
+  MemoryBudget budget(memory_limit);
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::atomic<size_t> next_split{ 0 };
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < split_jobs; t++) {
+    threads.emplace_back([&]() {
+      for (size_t i = next_split++; i < num_splits; i = next_split++) {
+        size_t memory = EstimatePatchMemory(split_tgt_images[i], split_src_images[i]);
+        bool acquired = budget.Acquire(i, memory);
+        PatchWriter writer;
+        bool success = acquired && writer.Init() &&
+                       ZipModeImage::GeneratePatchesInternal(split_tgt_images[i],
+                                                             split_src_images[i], &writer,
+                                                             chunk_jobs, sa_cache_dir, sa_threads,
+                                                             raw_compression);
+        std::lock_guard<std::mutex> lock(mutex);
+        split_patches[i] = { true, success, acquired ? memory : 0, std::move(writer) };
+        cv.notify_all();
+      }
+    });
+  }
 
-    size_t total_patch_size = 12;
-    for (auto& p : patch_chunks) {
-      p.UpdateSourceOffset(split_src_ranges[i]);
-      total_patch_size += p.PatchSize();
-    }
+  auto write_split = [&](size_t i, PatchWriter& writer) {
+    writer.UpdateSourceOffset(split_src_ranges[i]);
+    size_t total_patch_size = writer.PatchSize();
 
-    if (!PatchChunk::WritePatchDataToFd(patch_chunks, patch_fd)) {
+    if (!writer.Finish(patch_fd)) {
       return false;
     }
 
@@ -1247,10 +2080,40 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
         PLOG(ERROR) << "Failed to open " << patch_name;
         return false;
       }
-      if (!PatchChunk::WritePatchDataToFd(patch_chunks, fd)) {
+      if (!writer.Finish(fd)) {
         return false;
       }
     }
+    return true;
+  };
+
+  bool result = true;
+  for (size_t i = 0; i < num_splits && result; i++) {
+    SplitPatch split_patch;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return split_patches[i].done; });
+      split_patch = std::move(split_patches[i]);
+    }
+    if (!split_patch.success) {
+      LOG(ERROR) << "Failed to generate split patch";
+      result = false;
+    } else {
+      result = write_split(i, split_patch.writer);
+    }
+    split_patch.writer = PatchWriter();
+    budget.Release(split_patch.memory);
+  }
+  if (!result) {
+    // Let the pending pieces fail fast, and skip the ones that haven't started.
+    next_split = num_splits;
+    budget.Cancel();
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (!result) {
+    return false;
   }
 
   // Store the split in the following format:
@@ -1456,36 +2319,42 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
 // result to |patch_name|.
 bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
-                                     const std::string& patch_name) {
+                                     const std::string& patch_name, size_t jobs,
+                                     size_t sa_threads, RawCompression raw_compression) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
-  std::vector<PatchChunk> patch_chunks;
-  patch_chunks.reserve(tgt_image.NumOfChunks());
+  PatchWriter writer;
+  if (!writer.Init()) {
+    return false;
+  }
 
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+  // Each target chunk gets diffed against the source chunk at the same index, independent of the
+  // other pairs (e.g. the kernel and the ramdisk of a boot image).
+  std::vector<std::vector<uint8_t>> patches(tgt_image.NumOfChunks());
+  std::vector<CompressedRaw> compressed_raws(tgt_image.NumOfChunks());
+  auto make_patch = [&](size_t i) {
     const auto& tgt_chunk = tgt_image[i];
-    const auto& src_chunk = src_image[i];
-
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks.emplace_back(tgt_chunk);
-      continue;
+      return true;
     }
-
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
+    if (!ImageChunk::MakePatch(tgt_chunk, src_image[i], &patches[i], nullptr, sa_threads)) {
       LOG(ERROR) << "Failed to generate patch for target chunk " << i;
       return false;
     }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
-
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
-      patch_chunks.emplace_back(tgt_chunk);
-    } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
-    }
+    CompressRawChunk(tgt_chunk, patches[i].size(), raw_compression, &compressed_raws[i]);
+    return true;
+  };
+  auto write_patch = [&](size_t i) {
+    return writer.Add(
+        ChoosePatchChunk(tgt_image[i], &src_image[i], &patches[i], &compressed_raws[i]));
+  };
+  if (!MakePatchesInOrder(tgt_image.NumOfChunks(), jobs, tgt_image.NumOfChunks(), make_patch,
+                          write_patch)) {
+    return false;
   }
 
-  CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
+  CHECK_EQ(tgt_image.NumOfChunks(), writer.NumOfChunks());
 
   android::base::unique_fd patch_fd(
       open(patch_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR));
@@ -1494,7 +2363,7 @@ bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
     return false;
   }
 
-  return PatchChunk::WritePatchDataToFd(patch_chunks, patch_fd);
+  return writer.Finish(patch_fd);
 }
 
 int imgdiff(int argc, const char** argv) {
@@ -1504,6 +2373,11 @@ int imgdiff(int argc, const char** argv) {
   size_t blocks_limit = 0;
   std::string split_info_file;
   std::string debug_dir;
+  size_t jobs = 1;
+  size_t memory_limit_mb = 0;
+  std::string sa_cache_dir;
+  size_t sa_threads = 1;
+  RawCompression raw_compression = RawCompression::kNone;
 
   int opt;
   int option_index;
@@ -1547,6 +2421,33 @@ int imgdiff(int argc, const char** argv) {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "jobs" && (!android::base::ParseUint(optarg, &jobs) || jobs == 0)) {
+          LOG(ERROR) << "Failed to parse jobs: " << optarg;
+          return 1;
+        } else if (name == "memory-limit" &&
+                   !android::base::ParseUint(optarg, &memory_limit_mb, SIZE_MAX >> 20)) {
+          LOG(ERROR) << "Failed to parse memory_limit: " << optarg;
+          return 1;
+        } else if (name == "sa-cache-dir") {
+          sa_cache_dir = optarg;
+        } else if (name == "sa-threads" &&
+                   (!android::base::ParseUint(optarg, &sa_threads) || sa_threads == 0)) {
+          LOG(ERROR) << "Failed to parse sa_threads: " << optarg;
+          return 1;
+        } else if (name == "raw-compression") {
+          std::string codec = optarg;
+          if (codec == "none") {
+            raw_compression = RawCompression::kNone;
+          } else if (codec == "brotli") {
+            raw_compression = RawCompression::kBrotli;
+          } else if (codec == "zstd") {
+            raw_compression = RawCompression::kZstd;
+          } else if (codec == "auto") {
+            raw_compression = RawCompression::kAuto;
+          } else {
+            LOG(ERROR) << "Failed to parse raw_compression: " << optarg;
+            return 1;
+          }
         }
         break;
       }
@@ -1572,6 +2473,17 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  --jobs,           Number of threads to reconstruct the deflate chunks and generate\n"
+           "                    the patches with. With block-limit, the split pieces get diffed\n"
+           "                    concurrently.\n"
+           "  --memory-limit,   The memory in MiB that the concurrent split pieces may use;\n"
+           "                    zip mode with block-limit only.\n"
+           "  --sa-cache-dir,   Directory to cache the suffix arrays of the sources in, to be\n"
+           "                    reused when diffing the same source again; zip mode only.\n"
+           "  --sa-threads,     Number of threads to sort the suffixes of the large sources\n"
+           "                    with. The patches stay the same.\n"
+           "  --raw-compression, none (default), brotli, zstd or auto. Store the target chunks\n"
+           "                    that don't diff well compressed, in an IMGDIFF3 patch.\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
@@ -1580,14 +2492,23 @@ int imgdiff(int argc, const char** argv) {
     ZipModeImage src_image(true, blocks_limit * BLOCK_SIZE);
     ZipModeImage tgt_image(false, blocks_limit * BLOCK_SIZE);
 
-    if (!src_image.Initialize(argv[optind])) {
-      return 1;
+    // Reading and parsing the two zips are independent of each other.
+    bool src_initialized = false;
+    std::thread src_thread;
+    if (jobs > 1) {
+      src_thread = std::thread([&]() { src_initialized = src_image.Initialize(argv[optind]); });
+    } else {
+      src_initialized = src_image.Initialize(argv[optind]);
     }
-    if (!tgt_image.Initialize(argv[optind + 1])) {
+    bool tgt_initialized = tgt_image.Initialize(argv[optind + 1]);
+    if (src_thread.joinable()) {
+      src_thread.join();
+    }
+    if (!src_initialized || !tgt_initialized) {
       return 1;
     }
 
-    if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image)) {
+    if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image, jobs)) {
       return 1;
     }
 
@@ -1606,11 +2527,14 @@ int imgdiff(int argc, const char** argv) {
                                                &split_src_images, &split_src_ranges);
 
       if (!ZipModeImage::GeneratePatches(split_tgt_images, split_src_images, split_src_ranges,
-                                         argv[optind + 2], split_info_file, debug_dir)) {
+                                         argv[optind + 2], split_info_file, debug_dir, jobs,
+                                         memory_limit_mb << 20, sa_cache_dir, sa_threads,
+                                         raw_compression)) {
         return 1;
       }
 
-    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], jobs,
+                                              sa_cache_dir, sa_threads, raw_compression)) {
       return 1;
     }
   } else {
@@ -1632,7 +2556,8 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], jobs,
+                                         sa_threads, raw_compression)) {
       return 1;
     }
   }
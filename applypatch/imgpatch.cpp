@@ -26,16 +26,23 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/memory.h>
 #include <applypatch/applypatch.h>
+#include <applypatch/deflate_backend.h>
 #include <applypatch/imgdiff.h>
+#include <brotli/decode.h>
 #include <openssl/sha.h>
 #include <zlib.h>
+#include <zstd.h>
 
 #include "edify/expr.h"
 #include "otautil/print_sha1.h"
@@ -48,11 +55,122 @@ static inline int32_t Read4(const void *address) {
   return android::base::get_unaligned<int32_t>(address);
 }
 
+// The zlib state and the scratch buffers for the deflate chunks of an image patch. They're set up
+// once per ApplyImagePatch() call and reset for each chunk, so that patches with thousands of small
+// deflate chunks don't pay for a pair of zlib allocations and the buffers on every chunk.
+class DeflateChunkContext {
+ public:
+  DeflateChunkContext() : output_buffer_(kOutputBufferSize) {}
+
+  ~DeflateChunkContext() {
+    if (inflate_initialized_) {
+      inflateEnd(&inflate_strm_);
+    }
+    if (deflate_initialized_) {
+      deflate_backend_->end(&deflate_strm_);
+    }
+  }
+
+  DeflateChunkContext(const DeflateChunkContext&) = delete;
+  DeflateChunkContext& operator=(const DeflateChunkContext&) = delete;
+
+  // Returns a raw inflater that's ready for a new stream, or nullptr on errors.
+  z_stream* Inflater() {
+    int ret;
+    if (inflate_initialized_) {
+      ret = inflateReset(&inflate_strm_);
+    } else {
+      inflate_strm_ = {};
+      ret = inflateInit2(&inflate_strm_, -15);
+      inflate_initialized_ = (ret == Z_OK);
+    }
+    if (ret != Z_OK) {
+      LOG(ERROR) << "Failed to init source inflation: " << ret;
+      return nullptr;
+    }
+    return &inflate_strm_;
+  }
+
+  // Returns a deflater with the given parameters that's ready for a new stream, or nullptr on
+  // errors. The existing state is only reset if the parameters match those of the previous chunk.
+  // The stream must be driven with deflate_backend()->deflate.
+  z_stream* Deflater(int level, int method, int window_bits, int mem_level, int strategy) {
+    DeflateParams params = { level, method, window_bits, mem_level, strategy };
+    const DeflateBackend* backend =
+        SelectDeflateBackend(level, method, window_bits, mem_level, strategy);
+    if (deflate_initialized_ && params == deflate_params_ && backend == deflate_backend_) {
+      int ret = deflate_backend_->reset(&deflate_strm_);
+      if (ret != Z_OK) {
+        LOG(ERROR) << "Failed to reset uncompressed data deflation: " << ret;
+        return nullptr;
+      }
+      return &deflate_strm_;
+    }
+
+    if (deflate_initialized_) {
+      deflate_backend_->end(&deflate_strm_);
+      deflate_initialized_ = false;
+    }
+    deflate_strm_ = {};
+    int ret = backend->init(&deflate_strm_, level, method, window_bits, mem_level, strategy);
+    if (ret != Z_OK) {
+      LOG(ERROR) << "Failed to init uncompressed data deflation: " << ret;
+      return nullptr;
+    }
+    deflate_initialized_ = true;
+    deflate_params_ = params;
+    deflate_backend_ = backend;
+    return &deflate_strm_;
+  }
+
+  const DeflateBackend* deflate_backend() const {
+    return deflate_backend_;
+  }
+
+  // Returns the scratch buffer for the inflated source, resized to |size|. Its capacity only
+  // grows, and the contents are left for the caller to overwrite.
+  uint8_t* ExpandedSource(size_t size) {
+    expanded_source_.resize(size);
+    return expanded_source_.data();
+  }
+
+  std::vector<uint8_t>& output_buffer() {
+    return output_buffer_;
+  }
+
+ private:
+  static constexpr size_t kOutputBufferSize = 32768;
+
+  struct DeflateParams {
+    int level;
+    int method;
+    int window_bits;
+    int mem_level;
+    int strategy;
+
+    bool operator==(const DeflateParams& other) const {
+      return level == other.level && method == other.method && window_bits == other.window_bits &&
+             mem_level == other.mem_level && strategy == other.strategy;
+    }
+  };
+
+  z_stream inflate_strm_;
+  bool inflate_initialized_{ false };
+  z_stream deflate_strm_;
+  bool deflate_initialized_{ false };
+  DeflateParams deflate_params_;
+  const DeflateBackend* deflate_backend_{ nullptr };
+
+  std::vector<uint8_t> expanded_source_;
+  std::vector<uint8_t> output_buffer_;
+};
+
 // This function is a wrapper of ApplyBSDiffPatch(). It has a custom sink function to deflate the
 // patched data and stream the deflated data to output.
 static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_len,
                                             const Value& patch, size_t patch_offset,
-                                            const char* deflate_header, SinkFn sink) {
+                                            const char* deflate_header, SinkFn sink,
+                                            DeflateChunkContext* context) {
   size_t expected_target_length = static_cast<size_t>(Read8(deflate_header + 32));
   CHECK_GT(expected_target_length, static_cast<size_t>(0));
   int level = Read4(deflate_header + 40);
@@ -61,36 +179,31 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   int mem_level = Read4(deflate_header + 52);
   int strategy = Read4(deflate_header + 56);
 
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = 0;
-  strm.next_in = nullptr;
-  int ret = deflateInit2(&strm, level, method, window_bits, mem_level, strategy);
-  if (ret != Z_OK) {
-    LOG(ERROR) << "Failed to init uncompressed data deflation: " << ret;
+  z_stream* strm = context->Deflater(level, method, window_bits, mem_level, strategy);
+  if (strm == nullptr) {
     return false;
   }
+  int ret = Z_OK;
 
   // Define a custom sink wrapper that feeds to bspatch. It deflates the available patch data on
   // the fly and outputs the compressed data to the given sink.
   size_t actual_target_length = 0;
   size_t total_written = 0;
-  static constexpr size_t buffer_size = 32768;
-  auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &total_written,
-                           &ret, &sink](const uint8_t* data, size_t len) -> size_t {
+  std::vector<uint8_t>& buffer = context->output_buffer();
+  auto deflate_fn = context->deflate_backend()->deflate;
+  auto compression_sink = [strm, deflate_fn, &buffer, &actual_target_length,
+                           &expected_target_length, &total_written, &ret,
+                           &sink](const uint8_t* data, size_t len) -> size_t {
     // The input patch length for an update never exceeds INT_MAX.
-    strm.avail_in = len;
-    strm.next_in = data;
+    strm->avail_in = len;
+    strm->next_in = data;
     do {
-      std::vector<uint8_t> buffer(buffer_size);
-      strm.avail_out = buffer_size;
-      strm.next_out = buffer.data();
+      strm->avail_out = buffer.size();
+      strm->next_out = buffer.data();
       if (actual_target_length + len < expected_target_length) {
-        ret = deflate(&strm, Z_NO_FLUSH);
+        ret = deflate_fn(strm, Z_NO_FLUSH);
       } else {
-        ret = deflate(&strm, Z_FINISH);
+        ret = deflate_fn(strm, Z_FINISH);
       }
       if (ret != Z_OK && ret != Z_STREAM_END) {
         LOG(ERROR) << "Failed to deflate stream: " << ret;
@@ -98,20 +211,19 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
         return 0;
       }
 
-      size_t have = buffer_size - strm.avail_out;
+      size_t have = buffer.size() - strm->avail_out;
       total_written += have;
       if (sink(buffer.data(), have) != have) {
         LOG(ERROR) << "Failed to write " << have << " compressed bytes to output.";
         return 0;
       }
-    } while ((strm.avail_in != 0 || strm.avail_out == 0) && ret != Z_STREAM_END);
+    } while ((strm->avail_in != 0 || strm->avail_out == 0) && ret != Z_STREAM_END);
 
     actual_target_length += len;
     return len;
   };
 
   int bspatch_result = ApplyBSDiffPatch(src_data, src_len, patch, patch_offset, compression_sink);
-  deflateEnd(&strm);
 
   if (bspatch_result != 0) {
     return false;
@@ -132,162 +244,345 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   return true;
 }
 
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
-                    size_t patch_size, SinkFn sink) {
-  Value patch(Value::Type::BLOB,
-              std::string(reinterpret_cast<const char*>(patch_data), patch_size));
-  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr);
-}
-
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    const Value* bonus_data) {
-  if (patch.data.size() < 12) {
+// The header record of a chunk in an image patch.
+struct PatchChunkRecord {
+  int type;
+  // The type-specific header, which follows the 4-byte chunk type.
+  const char* header;
+};
+
+// Parses the chunk header records of |patch| into |chunks|, and checks that they stay within the
+// patch and the source data. Returns false if the patch is corrupt.
+static bool ParseImagePatchChunks(size_t old_size, const Value& patch,
+                                  std::vector<PatchChunkRecord>* chunks) {
+  if (patch.view().size() < 12) {
     printf("patch too short to contain header\n");
-    return -1;
+    return false;
   }
 
-  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
-  // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
-  const char* const patch_header = patch.data.data();
-  if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
+  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW; IMGDIFF3 adds CHUNK_RAW_COMPRESSED.
+  // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and CHUNK_GZIP.)
+  const char* const patch_header = patch.view().data();
+  bool version3 = memcmp(patch_header, "IMGDIFF3", 8) == 0;
+  if (!version3 && memcmp(patch_header, "IMGDIFF2", 8) != 0) {
     printf("corrupt patch file header (magic number)\n");
-    return -1;
+    return false;
   }
 
   int num_chunks = Read4(patch_header + 8);
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
     // each chunk's header record starts with 4 bytes.
-    if (pos + 4 > patch.data.size()) {
+    if (pos + 4 > patch.view().size()) {
       printf("failed to read chunk %d record\n", i);
-      return -1;
+      return false;
     }
     int type = Read4(patch_header + pos);
     pos += 4;
+    chunks->push_back({ type, patch_header + pos });
 
     if (type == CHUNK_NORMAL) {
       const char* normal_header = patch_header + pos;
       pos += 24;
-      if (pos > patch.data.size()) {
+      if (pos > patch.view().size()) {
         printf("failed to read chunk %d normal header data\n", i);
-        return -1;
+        return false;
       }
 
       size_t src_start = static_cast<size_t>(Read8(normal_header));
       size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
-
       if (src_start + src_len > old_size) {
         printf("source data too short\n");
-        return -1;
+        return false;
       }
-      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink) != 0) {
-        printf("Failed to apply bsdiff patch.\n");
-        return -1;
-      }
-
-      LOG(DEBUG) << "Processed chunk type normal";
     } else if (type == CHUNK_RAW) {
       const char* raw_header = patch_header + pos;
       pos += 4;
-      if (pos > patch.data.size()) {
+      if (pos > patch.view().size()) {
         printf("failed to read chunk %d raw header data\n", i);
-        return -1;
+        return false;
       }
 
       size_t data_len = static_cast<size_t>(Read4(raw_header));
-
-      if (pos + data_len > patch.data.size()) {
+      if (pos + data_len > patch.view().size()) {
         printf("failed to read chunk %d raw data\n", i);
-        return -1;
-      }
-      if (sink(reinterpret_cast<const unsigned char*>(patch_header + pos), data_len) != data_len) {
-        printf("failed to write chunk %d raw data\n", i);
-        return -1;
+        return false;
       }
       pos += data_len;
+    } else if (type == CHUNK_RAW_COMPRESSED && version3) {
+      const char* raw_header = patch_header + pos;
+      pos += 12;
+      if (pos > patch.view().size()) {
+        printf("failed to read chunk %d compressed raw header data\n", i);
+        return false;
+      }
 
-      LOG(DEBUG) << "Processed chunk type raw";
+      int codec = Read4(raw_header);
+      size_t compressed_len = static_cast<size_t>(Read4(raw_header + 8));
+      if (codec != RAW_CODEC_BROTLI && codec != RAW_CODEC_ZSTD) {
+        printf("chunk %d has unknown raw codec %d\n", i, codec);
+        return false;
+      }
+      if (pos + compressed_len > patch.view().size()) {
+        printf("failed to read chunk %d compressed raw data\n", i);
+        return false;
+      }
+      pos += compressed_len;
     } else if (type == CHUNK_DEFLATE) {
       // deflate chunks have an additional 60 bytes in their chunk header.
       const char* deflate_header = patch_header + pos;
       pos += 60;
-      if (pos > patch.data.size()) {
+      if (pos > patch.view().size()) {
         printf("failed to read chunk %d deflate header data\n", i);
-        return -1;
+        return false;
       }
 
       size_t src_start = static_cast<size_t>(Read8(deflate_header));
       size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
-      size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
-
       if (src_start + src_len > old_size) {
         printf("source data too short\n");
-        return -1;
+        return false;
       }
+    } else {
+      printf("patch chunk %d is unknown type %d\n", i, type);
+      return false;
+    }
+  }
+  return true;
+}
 
-      // Decompress the source data; the chunk header tells us exactly
-      // how big we expect it to be when decompressed.
-
-      // Note: expanded_len will include the bonus data size if the patch was constructed with
-      // bonus data. The deflation will come up 'bonus_size' bytes short; these must be appended
-      // from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != nullptr) ? bonus_data->data.size() : 0;
-
-      std::vector<unsigned char> expanded_source(expanded_len);
-
-      // inflate() doesn't like strm.next_out being a nullptr even with
-      // avail_out being zero (Z_STREAM_ERROR).
-      if (expanded_len != 0) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = src_len;
-        strm.next_in = old_data + src_start;
-        strm.avail_out = expanded_len;
-        strm.next_out = expanded_source.data();
-
-        int ret = inflateInit2(&strm, -15);
-        if (ret != Z_OK) {
-          printf("failed to init source inflation: %d\n", ret);
-          return -1;
-        }
+// Applies the chunk |index| of |patch|, which has been checked by ParseImagePatchChunks(), and
+// writes its output to |sink|.
+static bool ApplyImagePatchChunk(const unsigned char* old_data, const Value& patch,
+                                 const PatchChunkRecord& chunk, size_t index, SinkFn sink,
+                                 const Value* bonus_data, DeflateChunkContext* context) {
+  if (chunk.type == CHUNK_NORMAL) {
+    size_t src_start = static_cast<size_t>(Read8(chunk.header));
+    size_t src_len = static_cast<size_t>(Read8(chunk.header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(chunk.header + 16));
+    if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink) != 0) {
+      printf("Failed to apply bsdiff patch.\n");
+      return false;
+    }
 
-        // Because we've provided enough room to accommodate the output
-        // data, we expect one call to inflate() to suffice.
-        ret = inflate(&strm, Z_SYNC_FLUSH);
-        if (ret != Z_STREAM_END) {
-          printf("source inflation returned %d\n", ret);
-          return -1;
-        }
-        // We should have filled the output buffer exactly, except
-        // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
-          return -1;
-        }
-        inflateEnd(&strm);
+    LOG(DEBUG) << "Processed chunk type normal";
+  } else if (chunk.type == CHUNK_RAW) {
+    size_t data_len = static_cast<size_t>(Read4(chunk.header));
+    if (sink(reinterpret_cast<const unsigned char*>(chunk.header + 4), data_len) != data_len) {
+      printf("failed to write chunk %zu raw data\n", index);
+      return false;
+    }
+
+    LOG(DEBUG) << "Processed chunk type raw";
+  } else if (chunk.type == CHUNK_RAW_COMPRESSED) {
+    int codec = Read4(chunk.header);
+    size_t data_len = static_cast<size_t>(Read4(chunk.header + 4));
+    size_t compressed_len = static_cast<size_t>(Read4(chunk.header + 8));
+    const uint8_t* compressed = reinterpret_cast<const uint8_t*>(chunk.header + 12);
+
+    std::vector<uint8_t> data(data_len);
+    size_t decoded_len = data_len;
+    bool decoded;
+    if (codec == RAW_CODEC_BROTLI) {
+      decoded = BrotliDecoderDecompress(compressed_len, compressed, &decoded_len, data.data()) ==
+                BROTLI_DECODER_RESULT_SUCCESS;
+    } else {
+      decoded_len = ZSTD_decompress(data.data(), data_len, compressed, compressed_len);
+      decoded = !ZSTD_isError(decoded_len);
+    }
+    if (!decoded || decoded_len != data_len) {
+      printf("failed to decompress chunk %zu raw data\n", index);
+      return false;
+    }
+    if (sink(data.data(), data_len) != data_len) {
+      printf("failed to write chunk %zu raw data\n", index);
+      return false;
+    }
+
+    LOG(DEBUG) << "Processed chunk type compressed raw";
+  } else {
+    const char* deflate_header = chunk.header;
+    size_t src_start = static_cast<size_t>(Read8(deflate_header));
+    size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
+    size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if the patch was constructed with
+    // bonus data. The deflation will come up 'bonus_size' bytes short; these must be appended
+    // from the bonus_data value.
+    size_t bonus_size = (index == 1 && bonus_data != nullptr) ? bonus_data->view().size() : 0;
+
+    uint8_t* expanded_source = context->ExpandedSource(expanded_len);
+
+    // inflate() doesn't like strm.next_out being a nullptr even with
+    // avail_out being zero (Z_STREAM_ERROR).
+    if (expanded_len != 0) {
+      z_stream* strm = context->Inflater();
+      if (strm == nullptr) {
+        return false;
+      }
+      strm->avail_in = src_len;
+      strm->next_in = old_data + src_start;
+      strm->avail_out = expanded_len;
+      strm->next_out = expanded_source;
+
+      // Because we've provided enough room to accommodate the output
+      // data, we expect one call to inflate() to suffice.
+      int ret = inflate(strm, Z_SYNC_FLUSH);
+      if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        return false;
+      }
+      // We should have filled the output buffer exactly, except
+      // for the bonus_size.
+      if (strm->avail_out != bonus_size) {
+        printf("source inflation short by %zu bytes\n", strm->avail_out - bonus_size);
+        return false;
+      }
+
+      if (bonus_size) {
+        memcpy(expanded_source + (expanded_len - bonus_size), bonus_data->view().data(),
+               bonus_size);
+      }
+    }
+
+    if (!ApplyBSDiffPatchAndStreamOutput(expanded_source, expanded_len, patch, patch_offset,
+                                         deflate_header, sink, context)) {
+      LOG(ERROR) << "Fail to apply streaming bspatch.";
+      return false;
+    }
+
+    LOG(DEBUG) << "Processed chunk type deflate";
+  }
+  return true;
+}
 
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), bonus_data->data.data(),
-                 bonus_size);
+// Applies the normal and deflate chunks on |jobs| threads, each with its own DeflateChunkContext.
+// Their outputs are buffered until all the earlier chunks have been written, so that |sink| still
+// sees the target in order; the raw chunks are written straight from the patch. To bound the
+// buffering, the workers don't start on a chunk more than kMaxPendingChunksPerJob * |jobs| chunks
+// ahead of the one being written.
+static bool ApplyImagePatchChunksInParallel(const unsigned char* old_data, const Value& patch,
+                                            const std::vector<PatchChunkRecord>& chunks,
+                                            SinkFn sink, const Value* bonus_data, size_t jobs) {
+  static constexpr size_t kMaxPendingChunksPerJob = 2;
+  size_t max_pending = kMaxPendingChunksPerJob * jobs;
+
+  struct ChunkOutput {
+    bool done{ false };
+    bool success{ false };
+    std::vector<uint8_t> data;
+  };
+  std::vector<ChunkOutput> outputs(chunks.size());
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next = 0;
+  size_t written = 0;
+  bool failed = false;
+
+  auto worker = [&]() {
+    DeflateChunkContext context;
+    while (true) {
+      size_t index;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] {
+          return failed || next == chunks.size() || next < written + max_pending;
+        });
+        if (failed || next == chunks.size()) {
+          return;
         }
+        index = next++;
       }
 
-      if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink)) {
-        LOG(ERROR) << "Fail to apply streaming bspatch.";
-        return -1;
+      ChunkOutput& output = outputs[index];
+      bool success = true;
+      if (chunks[index].type != CHUNK_RAW) {
+        SinkFn buffer_sink = [&output](const unsigned char* data, size_t len) {
+          output.data.insert(output.data.end(), data, data + len);
+          return len;
+        };
+        success = ApplyImagePatchChunk(old_data, patch, chunks[index], index, buffer_sink,
+                                       bonus_data, &context);
       }
 
-      LOG(DEBUG) << "Processed chunk type deflate";
-    } else {
-      printf("patch chunk %d is unknown type %d\n", i, type);
-      return -1;
+      std::lock_guard<std::mutex> lock(mutex);
+      output.done = true;
+      output.success = success;
+      if (!success) {
+        failed = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < std::min(jobs, chunks.size()); i++) {
+    threads.emplace_back(worker);
+  }
+
+  bool success = true;
+  DeflateChunkContext context;
+  for (size_t i = 0; i < chunks.size() && success; i++) {
+    ChunkOutput& output = outputs[i];
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return output.done || failed; });
+      success = output.done && output.success;
+    }
+    if (!success) {
+      break;
     }
+
+    if (chunks[i].type == CHUNK_RAW) {
+      success = ApplyImagePatchChunk(old_data, patch, chunks[i], i, sink, bonus_data, &context);
+    } else if (sink(output.data.data(), output.data.size()) != output.data.size()) {
+      printf("failed to write chunk %zu output\n", i);
+      success = false;
+    }
+    std::vector<uint8_t>().swap(output.data);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    written = i + 1;
+    if (!success) {
+      failed = true;
+    }
+    cv.notify_all();
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return success;
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
+                    size_t patch_size, SinkFn sink) {
+  Value patch(std::string_view(reinterpret_cast<const char*>(patch_data), patch_size));
+  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr);
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
+                    const Value* bonus_data, size_t jobs) {
+  std::vector<PatchChunkRecord> chunks;
+  if (!ParseImagePatchChunks(old_size, patch, &chunks)) {
+    return -1;
+  }
+
+  if (jobs > 1 && chunks.size() > 1) {
+    return ApplyImagePatchChunksInParallel(old_data, patch, chunks, sink, bonus_data, jobs) ? 0
+                                                                                            : -1;
   }
 
+  DeflateChunkContext context;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    if (!ApplyImagePatchChunk(old_data, patch, chunks[i], i, sink, bonus_data, &context)) {
+      return -1;
+    }
+  }
   return 0;
 }
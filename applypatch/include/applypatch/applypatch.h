@@ -87,6 +87,12 @@ bool PatchPartitionCheck(const Partition& target, const Partition& source);
 // the backup on /cache if the given partition doesn't have the expected checksum.
 bool CheckPartition(const Partition& target);
 
+// Like CheckPartition(), for the check that install-recovery.sh repeats on every boot. A partition
+// that passed a full check before, and still has the same identity, size, expected hash and sampled
+// contents, passes without being read in full. A full check comes back every few days or boots.
+// The outcomes are kept in Paths::partition_check_record().
+bool CheckPartitionWithRecord(const Partition& target);
+
 // Flashes a given image in 'source_filename' to the eMMC target partition. It verifies the target
 // checksum first, and will return if target already has the desired hash. Otherwise it checks the
 // checksum of the given source image, flashes, and verifies the target partition afterwards. The
@@ -109,13 +115,23 @@ void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
                      size_t patch_offset, SinkFn sink);
 
+// Applies the bsdiff-patch of 'patch_size' bytes at 'patch_data' like ApplyBSDiffPatch(), with the
+// compressed control, diff and extra streams of the patch each decompressed on a thread of its own,
+// ahead of the calling thread that puts the output together. Returns 0 on success, 1 if the sink
+// fails, 2 on a corrupt patch, and -1 if the patch isn't in a format that it supports (BSDIFF40, or
+// BSDF2 with bzip2, brotli or uncompressed streams).
+int ApplyBSDiffPatchStreams(const unsigned char* old_data, size_t old_size,
+                            const unsigned char* patch_data, size_t patch_size,
+                            const SinkFn& sink);
+
 // imgpatch.cpp
 
 // Applies the imgdiff-patch given in 'patch' to the source data given by (old_data, old_size), with
 // the optional bonus data. Writes the patched output through the given 'sink'. Returns 0 on
-// success.
+// success. With 'jobs' > 1, the chunks are patched on that many threads, and their outputs are
+// buffered so that 'sink' still gets called in order.
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    const Value* bonus_data);
+                    const Value* bonus_data, size_t jobs = 1);
 
 // freecache.cpp
 
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_DEFLATE_BACKEND_H
+#define _APPLYPATCH_DEFLATE_BACKEND_H
+
+#include <zlib.h>
+
+// A deflate implementation that works on z_stream the same way as zlib, for recompressing the
+// deflate chunks of image patches. An optimized zlib build (e.g. zlib-ng in its compat mode, or a
+// copy built with a symbol prefix) can be plugged in this way, as long as it produces the exact
+// bytes that zlib would.
+struct DeflateBackend {
+  const char* name;
+  int (*init)(z_stream* strm, int level, int method, int window_bits, int mem_level, int strategy);
+  int (*deflate)(z_stream* strm, int flush);
+  int (*reset)(z_stream* strm);
+  int (*end)(z_stream* strm);
+};
+
+// Returns the backend for the zlib that's linked in.
+const DeflateBackend* GetZlibDeflateBackend();
+
+// Adds |backend| to the candidates for SelectDeflateBackend(), after the ones registered earlier.
+// |backend| must stay alive for the rest of the process.
+void RegisterDeflateBackend(const DeflateBackend* backend);
+
+// Returns the first registered backend whose output matches zlib's for the given parameters, or
+// the zlib backend if there's none. Each candidate is checked against zlib on a probe buffer the
+// first time a set of parameters is seen, and the choice is cached from then on.
+const DeflateBackend* SelectDeflateBackend(int level, int method, int window_bits, int mem_level,
+                                           int strategy);
+
+#endif  // _APPLYPATCH_DEFLATE_BACKEND_H
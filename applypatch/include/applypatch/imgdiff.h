@@ -24,6 +24,11 @@
 #define CHUNK_GZIP 1     // version 1 only
 #define CHUNK_DEFLATE 2  // version 2 only
 #define CHUNK_RAW 3      // version 2 only
+#define CHUNK_RAW_COMPRESSED 4  // version 3 only
+
+// The codecs of the CHUNK_RAW_COMPRESSED data.
+#define RAW_CODEC_BROTLI 1
+#define RAW_CODEC_ZSTD 2
 
 // The gzip header size is actually variable, but we currently don't
 // support gzipped data with any of the optional fields, so for now it
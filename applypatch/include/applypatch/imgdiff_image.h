@@ -21,9 +21,12 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <android-base/unique_fd.h>
 #include <bsdiff/bsdiff.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
@@ -52,6 +55,23 @@ class ImageChunk {
   const std::string& GetEntryName() const {
     return entry_name_;
   }
+  // The name of the source entry that the chunk gets diffed against. That's the chunk's own entry
+  // name, unless the entry has been matched to a renamed source entry by its contents.
+  const std::string& GetSourceEntryName() const {
+    return source_entry_name_.empty() ? entry_name_ : source_entry_name_;
+  }
+  void SetSourceEntryName(std::string name) {
+    source_entry_name_ = std::move(name);
+  }
+  // A copy is a normal target chunk that's byte-identical to its source entry. It stays a chunk of
+  // its own, diffed against just that entry, instead of getting merged into its neighbors and
+  // diffed against the whole source file.
+  bool IsCopy() const {
+    return copy_;
+  }
+  void SetCopy() {
+    copy_ = true;
+  }
   size_t GetStartOffset() const {
     return start_;
   }
@@ -67,6 +87,21 @@ class ImageChunk {
   void Dump(size_t index) const;
 
   void SetUncompressedData(std::vector<uint8_t> data);
+  // Lets a CHUNK_DEFLATE chunk inflate its raw data on demand, instead of holding the
+  // |uncompressed_len| bytes of uncompressed data throughout. Each inflation is checked against
+  // |crc32|. Such a chunk only has its uncompressed data materialized while being diffed or
+  // reconstructed, so DataForPatch() isn't available for it.
+  void SetLazyUncompressedData(size_t uncompressed_len, uint32_t crc32);
+  // Whether the chunk has the CRC32 and the length of its uncompressed data, as a
+  // CHUNK_DEFLATE chunk with lazily uncompressed data does, and what they are.
+  bool HasContentKey() const {
+    return type_ == CHUNK_DEFLATE && lazy_;
+  }
+  uint32_t GetCrc32() const {
+    return crc32_;
+  }
+  // Returns the SHA-1 of the data for patch, or an empty string if it can't be inflated.
+  std::string GetContentSha1() const;
   bool SetBonusData(const std::vector<uint8_t>& bonus_data);
 
   bool operator==(const ImageChunk& other) const;
@@ -85,23 +120,28 @@ class ImageChunk {
   /*
    * Verify that we can reproduce exactly the same compressed data that we started with.  Sets the
    * level, method, windowBits, memLevel, and strategy fields in the chunk to the encoding
-   * parameters needed to produce the right output.
+   * parameters needed to produce the right output. |first_level| is tried before the other levels.
    */
-  bool ReconstructDeflateChunk();
+  bool ReconstructDeflateChunk(int first_level = 6);
   bool IsAdjacentNormal(const ImageChunk& other) const;
   void MergeAdjacentNormal(const ImageChunk& other);
 
   /*
    * Compute a bsdiff patch between |src| and |tgt|; Store the result in the patch_data.
    * |bsdiff_cache| can be used to cache the suffix array if the same |src| chunk is used
-   * repeatedly, pass nullptr if not needed.
+   * repeatedly, pass nullptr if not needed. The suffix array of a large |src| gets sorted on
+   * |sa_threads| threads.
    */
   static bool MakePatch(const ImageChunk& tgt, const ImageChunk& src,
                         std::vector<uint8_t>* patch_data,
-                        bsdiff::SuffixArrayIndexInterface** bsdiff_cache);
+                        bsdiff::SuffixArrayIndexInterface** bsdiff_cache, size_t sa_threads = 1);
 
  private:
-  bool TryReconstruction(int level);
+  bool TryReconstruction(int level, const uint8_t* uncompressed_data);
+
+  // Returns the data for patch, inflating it into |buffer| for a lazily uncompressed chunk.
+  // Returns nullptr if the inflated data doesn't match the expected length or CRC.
+  const uint8_t* InflateDataForPatch(std::vector<uint8_t>* buffer) const;
 
   int type_;                                    // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
   size_t start_;                                // offset of chunk in the original input file
@@ -113,7 +153,22 @@ class ImageChunk {
 
   // --- for CHUNK_DEFLATE chunks only: ---
   std::vector<uint8_t> uncompressed_data_;
+  // Whether the uncompressed data gets inflated on demand, instead of held in uncompressed_data_.
+  bool lazy_ = false;
+  size_t uncompressed_len_ = 0;
+  uint32_t crc32_ = 0;
   std::string entry_name_;  // used for zip entries
+  std::string source_entry_name_;
+  bool copy_ = false;
+};
+
+// How the target data of the raw chunks may get compressed, into CHUNK_RAW_COMPRESSED chunks of an
+// IMGDIFF3 patch. kAuto picks zstd, which decodes faster, unless brotli is notably smaller.
+enum class RawCompression {
+  kNone,
+  kBrotli,
+  kZstd,
+  kAuto,
 };
 
 // PatchChunk stores the patch data between a source chunk and a target chunk. It also keeps track
@@ -125,20 +180,30 @@ class PatchChunk {
   // Construct a CHUNK_RAW patch from the target data directly.
   explicit PatchChunk(const ImageChunk& tgt);
 
+  // Construct a CHUNK_RAW_COMPRESSED patch from the target data compressed with |raw_codec|.
+  PatchChunk(const ImageChunk& tgt, int raw_codec, std::vector<uint8_t> compressed);
+
   // Return true if raw data size is smaller than the patch size.
   static bool RawDataIsSmaller(const ImageChunk& tgt, size_t patch_size);
 
+  // Compresses the target data of the normal chunk |tgt| as |compression| asks, into |compressed|
+  // with the RAW_CODEC_* in |raw_codec|. Returns false if it doesn't get notably smaller.
+  static bool CompressRawData(const ImageChunk& tgt, RawCompression compression, int* raw_codec,
+                              std::vector<uint8_t>* compressed);
+
   // Update the source start with the new offset within the source range.
   void UpdateSourceOffset(const SortedRangeSet& src_range);
 
   // Return the total size (header + data) of the patch.
   size_t PatchSize() const;
 
-  static bool WritePatchDataToFd(const std::vector<PatchChunk>& patch_chunks, int patch_fd);
-
  private:
+  friend class PatchWriter;
+
   size_t GetHeaderSize() const;
-  size_t WriteHeaderToFd(int fd, size_t offset, size_t index) const;
+  // Writes the header with the patch data of |data_size| bytes at |offset|, and returns the offset
+  // of the next patch.
+  size_t WriteHeaderToFd(int fd, size_t offset, size_t index, size_t data_size) const;
 
   // The patch chunk type is the same as the target chunk type. The only exception is we change
   // the |type_| to CHUNK_RAW if target length is smaller than the patch size.
@@ -152,10 +217,47 @@ class PatchChunk {
   size_t target_len_;
   size_t target_uncompressed_len_;
   size_t target_compress_level_;  // the deflate compression level of the target chunk.
+  int raw_codec_ = 0;             // the codec of the CHUNK_RAW_COMPRESSED data.
 
   std::vector<uint8_t> data_;  // storage for the patch data
 };
 
+// Writes out an imgdiff patch incrementally, as the patch chunks get generated in order. The
+// headers come in front of all the bsdiff patches and depend on every chunk, so only the headers
+// stay in memory while the patch data of each added chunk gets spooled to an unlinked temporary
+// file.
+class PatchWriter {
+ public:
+  // Creates the spool file.
+  bool Init();
+
+  // Adds the next patch chunk, and spools out its patch data.
+  bool Add(PatchChunk patch);
+
+  // Update the source starts of the added chunks with the new offsets within the source range.
+  void UpdateSourceOffset(const SortedRangeSet& src_range);
+
+  size_t NumOfChunks() const {
+    return headers_.size();
+  }
+
+  // Return the total size of the patch so far.
+  size_t PatchSize() const {
+    return patch_size_;
+  }
+
+  // Writes the complete patch to |patch_fd|. It can be written to more than one fd.
+  bool Finish(int patch_fd) const;
+
+ private:
+  android::base::unique_fd spool_fd_;
+  // The added chunks, with the patch data of the non-raw ones moved to the spool.
+  std::vector<PatchChunk> headers_;
+  std::vector<size_t> data_sizes_;
+  size_t spool_size_ = 0;
+  size_t patch_size_ = 12;
+};
+
 // Interface for zip_mode and image_mode images. We initialize the image from an input file and
 // split the file content into a list of image chunks.
 class Image {
@@ -229,29 +331,56 @@ class ZipModeImage : public Image {
 
   const ImageChunk* FindChunkByName(const std::string& name, bool find_normal = false) const;
 
-  // Verify that we can reconstruct the deflate chunks; also change the type to CHUNK_NORMAL if
-  // src and tgt are identical.
-  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image);
+  // Find the deflate source chunk that has the same uncompressed contents as |chunk|, e.g. for an
+  // entry that has been renamed or moved. The candidates are looked up by the CRC32 and the length
+  // from the central directory, and confirmed by the SHA-1 of their contents.
+  ImageChunk* FindChunkByContent(const ImageChunk& chunk);
+  // Looks up each of |chunks| as FindChunkByContent() does, with the chunks and the candidates
+  // inflated for their SHA-1s on up to |jobs| threads. Returns the matches in the order of
+  // |chunks|.
+  std::vector<ImageChunk*> FindChunksByContent(const std::vector<const ImageChunk*>& chunks,
+                                               size_t jobs);
 
-  // Compute the patch between tgt & src images, and write the data into |patch_name|.
+  // Verify that we can reconstruct the deflate chunks; also change the type to CHUNK_NORMAL if
+  // src and tgt are identical. The deflate chunks get reconstructed on up to |jobs| threads.
+  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                    size_t jobs = 1);
+
+  // Compute the patch between tgt & src images, and write the data into |patch_name|. The patches
+  // of the chunks are generated on up to |jobs| threads. If |sa_cache_dir| is specified, the suffix
+  // array of the source gets cached in (or loaded from) that directory. The suffix arrays of the
+  // large sources get sorted on |sa_threads| threads. The raw chunks may get compressed as
+  // |raw_compression| asks.
   static bool GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t jobs = 1,
+                              const std::string& sa_cache_dir = "", size_t sa_threads = 1,
+                              RawCompression raw_compression = RawCompression::kNone);
 
   // Compute the patch based on the lists of split src and tgt images. Generate patches for each
   // pair of split pieces and write the data to |patch_name|. If |debug_dir| is specified, write
-  // each split src data and patch data into that directory.
+  // each split src data and patch data into that directory. The pieces are diffed on up to |jobs|
+  // threads, as long as their estimated memory stays within |memory_limit| bytes (0 for no limit),
+  // and written out in order. The suffix arrays of the split sources get cached in |sa_cache_dir|,
+  // if specified, and sorted on |sa_threads| threads. The raw chunks may get compressed as
+  // |raw_compression| asks.
   static bool GeneratePatches(const std::vector<ZipModeImage>& split_tgt_images,
                               const std::vector<ZipModeImage>& split_src_images,
                               const std::vector<SortedRangeSet>& split_src_ranges,
                               const std::string& patch_name, const std::string& split_info_file,
-                              const std::string& debug_dir);
-
-  // Split the tgt chunks and src chunks based on the size limit.
+                              const std::string& debug_dir, size_t jobs = 1,
+                              size_t memory_limit = 0, const std::string& sa_cache_dir = "",
+                              size_t sa_threads = 1,
+                              RawCompression raw_compression = RawCompression::kNone);
+
+  // Split the tgt chunks and src chunks based on the size limit. The cuts are planned for the
+  // fewest splits, with the fewest chunks cut off from their sources. The patch size of each split
+  // as predicted by the plan goes to |predicted_patch_sizes|, if specified.
   static bool SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
                                          const ZipModeImage& src_image,
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images,
-                                         std::vector<SortedRangeSet>* split_src_ranges);
+                                         std::vector<SortedRangeSet>* split_src_ranges,
+                                         std::vector<size_t>* predicted_patch_sizes = nullptr);
 
  private:
   // Initialize image chunks based on the zip entries.
@@ -277,13 +406,23 @@ class ZipModeImage : public Image {
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images);
 
-  // Function that actually iterates the tgt_chunks and makes patches.
+  // Function that actually iterates the tgt_chunks and makes patches, on up to |jobs| threads. The
+  // patch chunks get added to |writer| in the order of tgt_chunks regardless, as soon as they're
+  // ready. The suffix array of the pseudo source comes from |sa_cache_dir|, if specified.
   static bool GeneratePatchesInternal(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                      std::vector<PatchChunk>* patch_chunks);
+                                      PatchWriter* writer, size_t jobs,
+                                      const std::string& sa_cache_dir, size_t sa_threads,
+                                      RawCompression raw_compression);
 
   // size limit in bytes of each chunk. Also, if the length of one zip_entry exceeds the limit,
   // we'll split that entry into several smaller chunks in advance.
   size_t limit_;
+
+  // The indices of the deflate chunks by the CRC32 and the length of their uncompressed data, for
+  // FindChunkByContent(); built on its first call. And the SHA-1s of the chunks computed so far.
+  std::multimap<std::pair<uint32_t, size_t>, size_t> content_index_;
+  bool content_index_built_ = false;
+  std::map<size_t, std::string> content_sha1s_;
 };
 
 class ImageModeImage : public Image {
@@ -300,9 +439,13 @@ class ImageModeImage : public Image {
   static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image);
 
   // In image mode, generate patches against the given source chunks and bonus_data; write the
-  // result to |patch_name|.
+  // result to |patch_name|. The chunks are diffed on up to |jobs| threads, and written in order.
+  // The suffix arrays of the large source chunks get sorted on |sa_threads| threads, and the raw
+  // chunks may get compressed as |raw_compression| asks.
   static bool GeneratePatches(const ImageModeImage& tgt_image, const ImageModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t jobs = 1,
+                              size_t sa_threads = 1,
+                              RawCompression raw_compression = RawCompression::kNone);
 };
 
 #endif  // _APPLYPATCH_IMGDIFF_IMAGE_H
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_SUFFIX_ARRAY_CACHE_H
+#define _APPLYPATCH_SUFFIX_ARRAY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/mapped_file.h>
+#include <bsdiff/bsdiff.h>
+
+// A bsdiff suffix array index that's persisted in a cache directory, keyed by the SHA-256 of the
+// text. When one source gets diffed against many targets, only the first imgdiff run pays for
+// sorting the suffixes; the later ones map the cached index instead. The suffixes may get sorted on
+// several threads, into the same index.
+class CachedSuffixArrayIndex : public bsdiff::SuffixArrayIndexInterface {
+ public:
+  // Maps the cached index of |text| under |cache_dir|, or builds and stores it on a miss. The
+  // |text| must outlive the index. Returns nullptr on errors, in which case the caller may still
+  // let bsdiff build its own index.
+  static std::unique_ptr<CachedSuffixArrayIndex> Create(const std::string& cache_dir,
+                                                        const uint8_t* text, size_t size,
+                                                        size_t threads = 1);
+
+  // Sorts the suffixes of |text| on |threads| threads into an index that's only kept in memory.
+  static std::unique_ptr<CachedSuffixArrayIndex> CreateInMemory(const uint8_t* text, size_t size,
+                                                                size_t threads);
+
+  // Returns the path to the cached index of |text| under |cache_dir|.
+  static std::string CachePath(const std::string& cache_dir, const uint8_t* text, size_t size);
+
+  // Finds the longest prefix of |target| that occurs in the text, with the same binary search as
+  // bsdiff's own index.
+  void SearchPrefix(const uint8_t* target, size_t length, size_t* out_length,
+                    uint64_t* out_pos) const override;
+
+ private:
+  CachedSuffixArrayIndex(const uint8_t* text, size_t size,
+                         std::unique_ptr<android::base::MappedFile> mapping, size_t entry_size)
+      : text_(text),
+        size_(size),
+        mapping_(std::move(mapping)),
+        sa_(mapping_->data()),
+        entry_size_(entry_size) {}
+  CachedSuffixArrayIndex(const uint8_t* text, size_t size, std::vector<uint8_t> buffer,
+                         size_t entry_size)
+      : text_(text),
+        size_(size),
+        buffer_(std::move(buffer)),
+        sa_(buffer_.data()),
+        entry_size_(entry_size) {}
+
+  // Maps and validates the index at |path|. Returns nullptr if it's missing or malformed.
+  static std::unique_ptr<CachedSuffixArrayIndex> Load(const std::string& path, const uint8_t* text,
+                                                      size_t size);
+
+  // Sorts the suffixes of |text| on |threads| threads and writes the index to |path|, atomically.
+  static bool Build(const std::string& path, const uint8_t* text, size_t size, size_t threads);
+
+  template <typename T>
+  void Search(const T* sa, const uint8_t* target, size_t length, size_t* out_length,
+              uint64_t* out_pos) const;
+
+  const uint8_t* text_;
+  size_t size_;
+  // The suffix array lives in either the mapped cache file or the buffer.
+  std::unique_ptr<android::base::MappedFile> mapping_;
+  std::vector<uint8_t> buffer_;
+  const void* sa_;
+  // The width of the suffix array entries, which are 64-bit only for texts beyond 2 GiB.
+  size_t entry_size_;
+};
+
+#endif  // _APPLYPATCH_SUFFIX_ARRAY_CACHE_H
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_SUFFIX_SORT_H
+#define _APPLYPATCH_SUFFIX_SORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sorts the suffixes of the |size| bytes of |text|, and stores their positions into the |size|
+// entries of |sa|, like divsufsort() does. A suffix array is unique, so the result doesn't depend
+// on |threads|: with up to one thread, it's divsufsort() itself; with more, the suffixes get
+// bucketed by their first bytes and sorted by prefix doubling on |threads| threads, which needs two
+// more arrays of |size| entries for the ranks. T is either saidx_t or saidx64_t. Returns false on
+// errors.
+template <typename T>
+bool SortSuffixes(const uint8_t* text, size_t size, T* sa, size_t threads);
+
+#endif  // _APPLYPATCH_SUFFIX_SORT_H
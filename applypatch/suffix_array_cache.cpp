@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "applypatch/suffix_array_cache.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <divsufsort.h>
+#include <divsufsort64.h>
+#include <openssl/sha.h>
+
+#include "applypatch/suffix_sort.h"
+#include "otautil/print_sha1.h"
+
+// The cached index starts with this header, followed by the (size + 1) suffix array entries in
+// the native byte order. The first entry is the empty suffix.
+struct CacheHeader {
+  char magic[8];
+  uint64_t text_size;
+  uint32_t entry_size;
+  uint32_t reserved;
+};
+
+static constexpr char kCacheMagic[8] = { 'I', 'M', 'G', 'D', 'S', 'A', '0', '1' };
+
+static size_t EntrySize(size_t size) {
+  // The entries go up to |size| for the empty suffix.
+  return size < static_cast<size_t>(std::numeric_limits<saidx_t>::max()) ? sizeof(saidx_t)
+                                                                         : sizeof(saidx64_t);
+}
+
+std::string CachedSuffixArrayIndex::CachePath(const std::string& cache_dir, const uint8_t* text,
+                                              size_t size) {
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(text, size, digest);
+  return cache_dir + "/" + print_hex(digest, sizeof(digest)) + ".sa";
+}
+
+std::unique_ptr<CachedSuffixArrayIndex> CachedSuffixArrayIndex::Create(const std::string& cache_dir,
+                                                                       const uint8_t* text,
+                                                                       size_t size,
+                                                                       size_t threads) {
+  std::string path = CachePath(cache_dir, text, size);
+  if (auto index = Load(path, text, size); index != nullptr) {
+    LOG(INFO) << "Loaded the cached suffix array of " << size << " bytes from " << path;
+    return index;
+  }
+
+  if (!Build(path, text, size, threads)) {
+    return nullptr;
+  }
+  LOG(INFO) << "Cached the suffix array of " << size << " bytes to " << path;
+  return Load(path, text, size);
+}
+
+std::unique_ptr<CachedSuffixArrayIndex> CachedSuffixArrayIndex::Load(const std::string& path,
+                                                                     const uint8_t* text,
+                                                                     size_t size) {
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (fd == -1) {
+    return nullptr;
+  }
+
+  CacheHeader header;
+  if (!android::base::ReadFully(fd, &header, sizeof(header)) ||
+      memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || header.text_size != size ||
+      header.entry_size != EntrySize(size)) {
+    LOG(WARNING) << "Ignoring the malformed suffix array cache " << path;
+    return nullptr;
+  }
+
+  struct stat sb;
+  size_t length = (size + 1) * header.entry_size;
+  if (fstat(fd, &sb) == -1 || static_cast<uint64_t>(sb.st_size) != sizeof(header) + length) {
+    LOG(WARNING) << "Ignoring the truncated suffix array cache " << path;
+    return nullptr;
+  }
+
+  auto mapping = android::base::MappedFile::FromFd(fd, sizeof(header), length, PROT_READ);
+  if (mapping == nullptr) {
+    PLOG(WARNING) << "Failed to map " << path;
+    return nullptr;
+  }
+  return std::unique_ptr<CachedSuffixArrayIndex>(
+      new CachedSuffixArrayIndex(text, size, std::move(mapping), header.entry_size));
+}
+
+template <typename T>
+static bool BuildSuffixArray(const uint8_t* text, size_t size, size_t threads,
+                             std::vector<uint8_t>* buffer) {
+  buffer->resize((size + 1) * sizeof(T));
+  T* sa = reinterpret_cast<T*>(buffer->data());
+  sa[0] = size;
+  return SortSuffixes(text, size, sa + 1, threads);
+}
+
+static bool BuildSuffixArray(const uint8_t* text, size_t size, size_t threads,
+                             size_t entry_size, std::vector<uint8_t>* buffer) {
+  bool sorted = (entry_size == sizeof(saidx_t))
+                    ? BuildSuffixArray<saidx_t>(text, size, threads, buffer)
+                    : BuildSuffixArray<saidx64_t>(text, size, threads, buffer);
+  if (!sorted) {
+    LOG(ERROR) << "Failed to sort the suffixes of " << size << " bytes";
+  }
+  return sorted;
+}
+
+std::unique_ptr<CachedSuffixArrayIndex> CachedSuffixArrayIndex::CreateInMemory(const uint8_t* text,
+                                                                               size_t size,
+                                                                               size_t threads) {
+  size_t entry_size = EntrySize(size);
+  std::vector<uint8_t> sa;
+  if (!BuildSuffixArray(text, size, threads, entry_size, &sa)) {
+    return nullptr;
+  }
+  LOG(INFO) << "Sorted the suffixes of " << size << " bytes on " << threads << " threads";
+  return std::unique_ptr<CachedSuffixArrayIndex>(
+      new CachedSuffixArrayIndex(text, size, std::move(sa), entry_size));
+}
+
+bool CachedSuffixArrayIndex::Build(const std::string& path, const uint8_t* text, size_t size,
+                                   size_t threads) {
+  CacheHeader header = {};
+  memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+  header.text_size = size;
+  header.entry_size = EntrySize(size);
+
+  std::vector<uint8_t> sa;
+  if (!BuildSuffixArray(text, size, threads, header.entry_size, &sa)) {
+    return false;
+  }
+
+  // Write to a temporary file first, so that concurrent or interrupted runs never see a partial
+  // index.
+  std::string temp_path = path + ".XXXXXX";
+  android::base::unique_fd fd(mkstemp(temp_path.data()));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to create " << temp_path;
+    return false;
+  }
+  if (!android::base::WriteFully(fd, &header, sizeof(header)) ||
+      !android::base::WriteFully(fd, sa.data(), sa.size()) || fsync(fd) == -1) {
+    PLOG(ERROR) << "Failed to write " << temp_path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to rename " << temp_path << " to " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+static size_t MatchLength(const uint8_t* old_buf, size_t old_size, const uint8_t* new_buf,
+                          size_t new_size) {
+  size_t length = std::min(old_size, new_size);
+  size_t i = 0;
+  while (i < length && old_buf[i] == new_buf[i]) {
+    i++;
+  }
+  return i;
+}
+
+template <typename T>
+void CachedSuffixArrayIndex::Search(const T* sa, const uint8_t* target, size_t length,
+                                    size_t* out_length, uint64_t* out_pos) const {
+  // Binary search for the suffixes that |target| sorts between, then take the longer match.
+  size_t left = 0;
+  size_t right = size_;
+  while (right - left > 1) {
+    size_t mid = left + (right - left) / 2;
+    size_t pos = sa[mid];
+    if (memcmp(text_ + pos, target, std::min(size_ - pos, length)) < 0) {
+      left = mid;
+    } else {
+      right = mid;
+    }
+  }
+
+  size_t left_length = MatchLength(text_ + sa[left], size_ - sa[left], target, length);
+  size_t right_length = MatchLength(text_ + sa[right], size_ - sa[right], target, length);
+  if (left_length > right_length) {
+    *out_pos = sa[left];
+    *out_length = left_length;
+  } else {
+    *out_pos = sa[right];
+    *out_length = right_length;
+  }
+}
+
+void CachedSuffixArrayIndex::SearchPrefix(const uint8_t* target, size_t length, size_t* out_length,
+                                          uint64_t* out_pos) const {
+  if (entry_size_ == sizeof(saidx_t)) {
+    Search(static_cast<const saidx_t*>(sa_), target, length, out_length, out_pos);
+  } else {
+    Search(static_cast<const saidx64_t*>(sa_), target, length, out_length, out_pos);
+  }
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "applypatch/suffix_sort.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <divsufsort.h>
+#include <divsufsort64.h>
+
+// The suffixes get bucketed by their first byte, and their second one if any (where the suffixes
+// of a single byte sort first).
+static constexpr size_t kNumBuckets = 256 * 257;
+
+// Runs |fn| for each of the indices [0, count) on up to |threads| threads.
+template <typename Fn>
+static void ParallelFor(size_t count, size_t threads, Fn fn) {
+  std::atomic<size_t> next{ 0 };
+  auto run = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      fn(i);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < std::min(threads, count); t++) {
+    workers.emplace_back(run);
+  }
+  run();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+static size_t Bucket(const uint8_t* text, size_t size, size_t pos) {
+  return text[pos] * 257 + (pos + 1 < size ? text[pos + 1] + 1 : 0);
+}
+
+// The six bytes after the first two of the suffix at |pos|, zero padded, along with the length of
+// the suffix up to eight. Within a bucket, they compare as the first eight bytes of the suffixes
+// do: the suffixes that end early sort before the ones that continue with zeros.
+static uint64_t Prefix(const uint8_t* text, size_t size, size_t pos) {
+  size_t length = std::min<size_t>(size - pos, 8);
+  uint64_t prefix = 0;
+  for (size_t i = 2; i < 8; i++) {
+    prefix = (prefix << 8) | (i < length ? text[pos + i] : 0);
+  }
+  return (prefix << 4) | length;
+}
+
+// A range of the suffix array whose suffixes share the same prefix so far.
+using Group = std::pair<size_t, size_t>;
+
+// The buffers that SortGroup() reuses across the groups that one thread sorts.
+template <typename T>
+struct SortScratch {
+  std::vector<std::pair<uint64_t, T>> keyed;
+  std::vector<std::pair<uint64_t, T>> sorted;
+  std::vector<size_t> offsets;
+};
+
+// Sorts |keyed| by the keys; the large ones with a radix sort of 16 bits at a time.
+template <typename T>
+static void SortKeyed(std::vector<std::pair<uint64_t, T>>* keyed, SortScratch<T>* scratch) {
+  if (keyed->size() < 1024) {
+    std::sort(keyed->begin(), keyed->end());
+    return;
+  }
+  uint64_t max_key = 0;
+  for (const auto& entry : *keyed) {
+    max_key = std::max(max_key, entry.first);
+  }
+  scratch->sorted.resize(keyed->size());
+  scratch->offsets.resize(1 << 16);
+  for (size_t shift = 0; shift < 64 && (max_key >> shift) != 0; shift += 16) {
+    std::fill(scratch->offsets.begin(), scratch->offsets.end(), 0);
+    for (const auto& entry : *keyed) {
+      scratch->offsets[(entry.first >> shift) & 0xffff]++;
+    }
+    size_t total = 0;
+    for (auto& offset : scratch->offsets) {
+      total += offset;
+      offset = total - offset;
+    }
+    for (const auto& entry : *keyed) {
+      scratch->sorted[scratch->offsets[(entry.first >> shift) & 0xffff]++] = entry;
+    }
+    keyed->swap(scratch->sorted);
+  }
+}
+
+// Sorts the suffixes in sa[begin, end) by the keys of |key_of|, which get computed once for each
+// suffix. Sets the ranks of the suffixes in |rank| to the starts of their groups of equal keys, and
+// adds the groups of more than one suffix to |groups|.
+template <typename T, typename KeyFn>
+static void SortGroup(T* sa, size_t begin, size_t end, KeyFn key_of, T* rank,
+                      std::vector<Group>* groups, SortScratch<T>* scratch) {
+  // Most of the groups left after a few rounds are pairs, e.g. of a repeated piece of the text.
+  if (end - begin == 2) {
+    uint64_t first_key = key_of(sa[begin]);
+    uint64_t second_key = key_of(sa[begin + 1]);
+    if (second_key < first_key) {
+      std::swap(sa[begin], sa[begin + 1]);
+    }
+    rank[sa[begin]] = begin;
+    if (first_key == second_key) {
+      rank[sa[begin + 1]] = begin;
+      groups->emplace_back(begin, end);
+    } else {
+      rank[sa[begin + 1]] = begin + 1;
+    }
+    return;
+  }
+  auto& keyed = scratch->keyed;
+  keyed.resize(end - begin);
+  for (size_t j = begin; j < end; j++) {
+    keyed[j - begin] = { key_of(sa[j]), sa[j] };
+  }
+  SortKeyed(&keyed, scratch);
+  for (size_t j = 0; j < keyed.size();) {
+    size_t group_end = j + 1;
+    while (group_end < keyed.size() && keyed[group_end].first == keyed[j].first) {
+      group_end++;
+    }
+    for (size_t k = j; k < group_end; k++) {
+      sa[begin + k] = keyed[k].second;
+      rank[keyed[k].second] = begin + j;
+    }
+    if (group_end - j > 1) {
+      groups->emplace_back(begin + j, begin + group_end);
+    }
+    j = group_end;
+  }
+}
+
+template <typename T>
+static void SortSuffixesInParallel(const uint8_t* text, size_t size, T* sa, size_t threads) {
+  // Bucket the positions, with each thread counting and then placing a slice of them.
+  size_t num_slices = std::min(threads, size);
+  size_t slice_size = (size + num_slices - 1) / num_slices;
+  std::vector<size_t> offsets(num_slices * kNumBuckets);
+  ParallelFor(num_slices, threads, [&](size_t s) {
+    size_t* counts = &offsets[s * kNumBuckets];
+    for (size_t pos = s * slice_size; pos < std::min(size, (s + 1) * slice_size); pos++) {
+      counts[Bucket(text, size, pos)]++;
+    }
+  });
+  std::vector<Group> buckets(kNumBuckets);
+  size_t total = 0;
+  for (size_t b = 0; b < kNumBuckets; b++) {
+    buckets[b].first = total;
+    for (size_t s = 0; s < num_slices; s++) {
+      size_t count = offsets[s * kNumBuckets + b];
+      offsets[s * kNumBuckets + b] = total;
+      total += count;
+    }
+    buckets[b].second = total;
+  }
+  ParallelFor(num_slices, threads, [&](size_t s) {
+    size_t* next = &offsets[s * kNumBuckets];
+    for (size_t pos = s * slice_size; pos < std::min(size, (s + 1) * slice_size); pos++) {
+      sa[next[Bucket(text, size, pos)]++] = pos;
+    }
+  });
+  std::vector<size_t>().swap(offsets);
+
+  // Sort each bucket by the first eight bytes, the largest buckets first. The rank of a suffix is
+  // the start of its group, so the ranks compare as the prefixes of the suffixes do.
+  std::vector<T> rank(size);
+  std::vector<std::vector<Group>> groups_by_bucket(kNumBuckets);
+  std::vector<size_t> order(kNumBuckets);
+  for (size_t b = 0; b < kNumBuckets; b++) {
+    order[b] = b;
+  }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return buckets[a].second - buckets[a].first > buckets[b].second - buckets[b].first;
+  });
+  ParallelFor(kNumBuckets, threads, [&](size_t i) {
+    auto [begin, end] = buckets[order[i]];
+    if (begin < end) {
+      SortScratch<T> scratch;
+      SortGroup(sa, begin, end, [&](T pos) { return Prefix(text, size, pos); }, rank.data(),
+                &groups_by_bucket[order[i]], &scratch);
+    }
+  });
+  std::vector<Group> groups;
+  for (auto& bucket_groups : groups_by_bucket) {
+    groups.insert(groups.end(), bucket_groups.begin(), bucket_groups.end());
+  }
+  std::vector<std::vector<Group>>().swap(groups_by_bucket);
+
+  // Prefix doubling: the suffixes of a group that share their first h bytes get sorted by the rank
+  // of their suffixes h bytes further, which gives their order by the first 2 * h bytes. Only one
+  // suffix of a group can end within those (and it sorts first). The new ranks are written aside,
+  // so that the groups don't see each other's updates within a round.
+  std::vector<T> new_rank(size);
+  for (size_t h = 8; !groups.empty(); h *= 2) {
+    size_t num_tasks = std::min(groups.size(), threads * 16);
+    size_t task_size = (groups.size() + num_tasks - 1) / num_tasks;
+    std::vector<std::vector<Group>> next_groups(num_tasks);
+    auto next_rank = [&](T pos) -> uint64_t {
+      return static_cast<size_t>(pos) + h < size ? rank[pos + h] + 1 : 0;
+    };
+    ParallelFor(num_tasks, threads, [&](size_t t) {
+      SortScratch<T> scratch;
+      for (size_t g = t * task_size; g < std::min(groups.size(), (t + 1) * task_size); g++) {
+        SortGroup(sa, groups[g].first, groups[g].second, next_rank, new_rank.data(),
+                  &next_groups[t], &scratch);
+      }
+    });
+    ParallelFor(num_tasks, threads, [&](size_t t) {
+      for (size_t g = t * task_size; g < std::min(groups.size(), (t + 1) * task_size); g++) {
+        for (size_t j = groups[g].first; j < groups[g].second; j++) {
+          rank[sa[j]] = new_rank[sa[j]];
+        }
+      }
+    });
+    groups.clear();
+    for (auto& task_groups : next_groups) {
+      groups.insert(groups.end(), task_groups.begin(), task_groups.end());
+    }
+  }
+}
+
+template <typename T>
+bool SortSuffixes(const uint8_t* text, size_t size, T* sa, size_t threads) {
+  if (size == 0) {
+    return true;
+  }
+  if (threads > 1) {
+    SortSuffixesInParallel(text, size, sa, threads);
+    return true;
+  }
+  if constexpr (sizeof(T) == sizeof(saidx_t)) {
+    return divsufsort(text, sa, size) == 0;
+  } else {
+    return divsufsort64(text, sa, size) == 0;
+  }
+}
+
+template bool SortSuffixes<saidx_t>(const uint8_t* text, size_t size, saidx_t* sa,
+                                    size_t threads);
+template bool SortSuffixes<saidx64_t>(const uint8_t* text, size_t size, saidx64_t* sa,
+                                      size_t threads);
@@ -19,7 +19,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <iterator>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
@@ -40,6 +44,10 @@ using android::fs_mgr::ReadDefaultFstab;
 
 static std::optional<std::string> g_misc_device_for_test;
 
+// The misc device from the fstab, which is looked up once.
+static std::mutex g_misc_device_lock;
+static std::string g_misc_device;
+
 // Exposed for test purpose.
 void SetMiscBlockDeviceForTest(std::string_view misc_device) {
   g_misc_device_for_test = misc_device;
@@ -49,6 +57,10 @@ std::string get_misc_blk_device(std::string* err) {
   if (g_misc_device_for_test.has_value() && !g_misc_device_for_test->empty()) {
     return *g_misc_device_for_test;
   }
+  std::lock_guard<std::mutex> lock(g_misc_device_lock);
+  if (!g_misc_device.empty()) {
+    return g_misc_device;
+  }
   Fstab fstab;
   if (!ReadDefaultFstab(&fstab)) {
     *err = "failed to read default fstab";
@@ -56,7 +68,8 @@ std::string get_misc_blk_device(std::string* err) {
   }
   for (const auto& entry : fstab) {
     if (entry.mount_point == "/misc") {
-      return entry.blk_device;
+      g_misc_device = entry.blk_device;
+      return g_misc_device;
     }
   }
 
@@ -87,56 +100,164 @@ static bool wait_for_device(const std::string& blk_device, std::string* err) {
   return ret == 0;
 }
 
-static bool read_misc_partition(void* p, size_t size, const std::string& misc_blk_device,
-                                size_t offset, std::string* err) {
-  if (!wait_for_device(misc_blk_device, err)) {
-    return false;
+// Returns the end of the piece at |it|.
+static size_t PieceEnd(std::map<size_t, std::string>::const_iterator it) {
+  return it->first + it->second.size();
+}
+
+static size_t PieceEnd(std::map<size_t, size_t>::const_iterator it) {
+  return it->second;
+}
+
+// Returns the range of the pieces in |pieces| that overlap or touch [start, end).
+template <typename Map>
+static auto FindPieces(Map* pieces, size_t start, size_t end) {
+  auto first = pieces->upper_bound(start);
+  if (first != pieces->begin() && PieceEnd(std::prev(first)) >= start) {
+    --first;
   }
-  android::base::unique_fd fd(open(misc_blk_device.c_str(), O_RDONLY));
-  if (fd == -1) {
-    *err = android::base::StringPrintf("failed to open %s: %s", misc_blk_device.c_str(),
-                                       strerror(errno));
-    return false;
+  auto last = first;
+  while (last != pieces->end() && last->first <= end) {
+    ++last;
   }
-  if (lseek(fd, static_cast<off_t>(offset), SEEK_SET) != static_cast<off_t>(offset)) {
-    *err = android::base::StringPrintf("failed to lseek %s: %s", misc_blk_device.c_str(),
-                                       strerror(errno));
-    return false;
+  return std::make_pair(first, last);
+}
+
+// Adds |data| at |offset| to |pieces|, merged with the pieces around it. Where they overlap, the
+// existing pieces win if |keep_existing| is set, or |data| otherwise.
+static void AddPiece(std::map<size_t, std::string>* pieces, size_t offset, const std::string& data,
+                     bool keep_existing) {
+  auto [first, last] = FindPieces(pieces, offset, offset + data.size());
+  size_t start = offset;
+  size_t end = offset + data.size();
+  if (first != last) {
+    start = std::min(start, first->first);
+    end = std::max(end, PieceEnd(std::prev(last)));
   }
-  if (!android::base::ReadFully(fd, p, size)) {
-    *err = android::base::StringPrintf("failed to read %s: %s", misc_blk_device.c_str(),
+  std::string merged(end - start, '\0');
+  if (!keep_existing) {
+    for (auto it = first; it != last; ++it) {
+      merged.replace(it->first - start, it->second.size(), it->second);
+    }
+  }
+  merged.replace(offset - start, data.size(), data);
+  if (keep_existing) {
+    for (auto it = first; it != last; ++it) {
+      merged.replace(it->first - start, it->second.size(), it->second);
+    }
+  }
+  pieces->erase(first, last);
+  pieces->emplace(start, std::move(merged));
+}
+
+MiscStore::~MiscStore() {
+  if (read_fd_ != -1) {
+    close(read_fd_);
+  }
+}
+
+bool MiscStore::Open(const std::string& misc_blk_device, std::string* err) {
+  misc_blk_device_ = misc_blk_device.empty() ? get_misc_blk_device(err) : misc_blk_device;
+  return !misc_blk_device_.empty();
+}
+
+bool MiscStore::Load(size_t size, size_t offset, std::string* err) {
+  if (read_fd_ == -1) {
+    if (!wait_for_device(misc_blk_device_, err)) {
+      return false;
+    }
+    read_fd_ = open(misc_blk_device_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (read_fd_ == -1) {
+      *err = android::base::StringPrintf("failed to open %s: %s", misc_blk_device_.c_str(),
+                                         strerror(errno));
+      return false;
+    }
+  }
+  std::string data(size, '\0');
+  if (!android::base::ReadFullyAtOffset(read_fd_, data.data(), size, static_cast<off_t>(offset))) {
+    *err = android::base::StringPrintf("failed to read %s: %s", misc_blk_device_.c_str(),
                                        strerror(errno));
     return false;
   }
+  // What's known already is either the same, or a staged write that's newer.
+  AddPiece(&contents_, offset, data, true);
   return true;
 }
 
-bool write_misc_partition(const void* p, size_t size, const std::string& misc_blk_device,
-                          size_t offset, std::string* err) {
-  android::base::unique_fd fd(open(misc_blk_device.c_str(), O_WRONLY));
-  if (fd == -1) {
-    *err = android::base::StringPrintf("failed to open %s: %s", misc_blk_device.c_str(),
-                                       strerror(errno));
-    return false;
+bool MiscStore::Read(void* p, size_t size, size_t offset, std::string* err) {
+  auto it = contents_.upper_bound(offset);
+  if (it == contents_.begin() || PieceEnd(std::prev(it)) < offset + size) {
+    if (!Load(size, offset, err)) {
+      return false;
+    }
+    it = contents_.upper_bound(offset);
   }
-  if (lseek(fd, static_cast<off_t>(offset), SEEK_SET) != static_cast<off_t>(offset)) {
-    *err = android::base::StringPrintf("failed to lseek %s: %s", misc_blk_device.c_str(),
-                                       strerror(errno));
-    return false;
+  --it;
+  memcpy(p, it->second.data() + (offset - it->first), size);
+  return true;
+}
+
+void MiscStore::Write(const void* p, size_t size, size_t offset) {
+  AddPiece(&contents_, offset, std::string(static_cast<const char*>(p), size), false);
+  size_t end = offset + size;
+  auto [first, last] = FindPieces(&dirty_, offset, end);
+  if (first != last) {
+    offset = std::min(offset, first->first);
+    end = std::max(end, PieceEnd(std::prev(last)));
   }
-  if (!android::base::WriteFully(fd, p, size)) {
-    *err = android::base::StringPrintf("failed to write %s: %s", misc_blk_device.c_str(),
+  dirty_.erase(first, last);
+  dirty_.emplace(offset, end);
+}
+
+bool MiscStore::Commit(std::string* err) {
+  if (dirty_.empty()) {
+    return true;
+  }
+  android::base::unique_fd fd(open(misc_blk_device_.c_str(), O_WRONLY | O_CLOEXEC));
+  if (fd == -1) {
+    *err = android::base::StringPrintf("failed to open %s: %s", misc_blk_device_.c_str(),
                                        strerror(errno));
     return false;
   }
+  for (const auto& [offset, end] : dirty_) {
+    // A dirty range is always within a single piece of the contents.
+    auto it = std::prev(contents_.upper_bound(offset));
+    if (lseek(fd, static_cast<off_t>(offset), SEEK_SET) != static_cast<off_t>(offset)) {
+      *err = android::base::StringPrintf("failed to lseek %s: %s", misc_blk_device_.c_str(),
+                                         strerror(errno));
+      return false;
+    }
+    if (!android::base::WriteFully(fd, it->second.data() + (offset - it->first), end - offset)) {
+      *err = android::base::StringPrintf("failed to write %s: %s", misc_blk_device_.c_str(),
+                                         strerror(errno));
+      return false;
+    }
+  }
   if (fsync(fd) == -1) {
-    *err = android::base::StringPrintf("failed to fsync %s: %s", misc_blk_device.c_str(),
+    *err = android::base::StringPrintf("failed to fsync %s: %s", misc_blk_device_.c_str(),
                                        strerror(errno));
     return false;
   }
+  dirty_.clear();
   return true;
 }
 
+static bool read_misc_partition(void* p, size_t size, const std::string& misc_blk_device,
+                                size_t offset, std::string* err) {
+  MiscStore store;
+  return store.Open(misc_blk_device, err) && store.Read(p, size, offset, err);
+}
+
+bool write_misc_partition(const void* p, size_t size, const std::string& misc_blk_device,
+                          size_t offset, std::string* err) {
+  MiscStore store;
+  if (!store.Open(misc_blk_device, err)) {
+    return false;
+  }
+  store.Write(p, size, offset);
+  return store.Commit(err);
+}
+
 std::string get_bootloader_message_blk_device(std::string* err) {
   std::string misc_blk_device = get_misc_blk_device(err);
   if (misc_blk_device.empty()) return "";
@@ -198,13 +319,16 @@ bool write_bootloader_message_to(const std::vector<std::string>& options,
 }
 
 bool update_bootloader_message(const std::vector<std::string>& options, std::string* err) {
+  MiscStore store;
   bootloader_message boot;
-  if (!read_bootloader_message(&boot, err)) {
+  if (!store.Open("", err) ||
+      !store.Read(&boot, sizeof(boot), BOOTLOADER_MESSAGE_OFFSET_IN_MISC, err)) {
     return false;
   }
   update_bootloader_message_in_struct(&boot, options);
 
-  return write_bootloader_message(boot, err);
+  store.Write(&boot, sizeof(boot), BOOTLOADER_MESSAGE_OFFSET_IN_MISC);
+  return store.Commit(err);
 }
 
 bool update_bootloader_message_in_struct(bootloader_message* boot,
@@ -228,8 +352,10 @@ bool update_bootloader_message_in_struct(bootloader_message* boot,
 }
 
 bool write_reboot_bootloader(std::string* err) {
+  MiscStore store;
   bootloader_message boot;
-  if (!read_bootloader_message(&boot, err)) {
+  if (!store.Open("", err) ||
+      !store.Read(&boot, sizeof(boot), BOOTLOADER_MESSAGE_OFFSET_IN_MISC, err)) {
     return false;
   }
   if (boot.command[0] != '\0') {
@@ -237,7 +363,8 @@ bool write_reboot_bootloader(std::string* err) {
     return false;
   }
   strlcpy(boot.command, "bootonce-bootloader", sizeof(boot.command));
-  return write_bootloader_message(boot, err);
+  store.Write(&boot, sizeof(boot), BOOTLOADER_MESSAGE_OFFSET_IN_MISC);
+  return store.Commit(err);
 }
 
 bool read_wipe_package(std::string* package_data, size_t size, std::string* err) {
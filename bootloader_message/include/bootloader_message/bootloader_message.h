@@ -132,9 +132,46 @@ struct misc_system_space_layout {
 
 #ifdef __cplusplus
 
+#include <map>
 #include <string>
 #include <vector>
 
+// A handle for a sequence of accesses to the misc partition. The device is opened once for all the
+// reads, and the data read or written through the handle is kept in memory, so that reading it
+// again doesn't go back to the device. Writes are only staged, until Commit() writes the dirty
+// bytes to the device in the order of their offsets, and fsyncs it once. Nothing is written
+// without a successful Commit(), e.g. if the process dies in between.
+class MiscStore {
+ public:
+  MiscStore() = default;
+  ~MiscStore();
+  MiscStore(const MiscStore&) = delete;
+  MiscStore& operator=(const MiscStore&) = delete;
+
+  // Sets up the handle for |misc_blk_device|, or the /misc partition in the fstab if it's empty.
+  bool Open(const std::string& misc_blk_device, std::string* err);
+
+  // Reads |size| bytes at |offset| into |p|, including the staged writes.
+  bool Read(void* p, size_t size, size_t offset, std::string* err);
+
+  // Stages a write of the |size| bytes of |p| at |offset|.
+  void Write(const void* p, size_t size, size_t offset);
+
+  // Writes out the staged writes, and fsyncs the device.
+  bool Commit(std::string* err);
+
+ private:
+  // Reads |size| bytes at |offset| from the device into the cache.
+  bool Load(size_t size, size_t offset, std::string* err);
+
+  std::string misc_blk_device_;
+  int read_fd_ = -1;
+  // The known contents of the device, by the offset of each contiguous piece.
+  std::map<size_t, std::string> contents_;
+  // The ends of the pieces that need to be written, by their offsets.
+  std::map<size_t, size_t> dirty_;
+};
+
 // Gets the block device name of /misc partition.
 std::string get_misc_blk_device(std::string* err);
 // Return the block device name for the bootloader message partition and waits
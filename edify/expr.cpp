@@ -22,8 +22,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -56,7 +59,7 @@ bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* resu
       return false;
     }
 
-    *result = v->data;
+    *result = std::move(v->data);
     return true;
 }
 
@@ -251,6 +254,71 @@ Value* SequenceFn(const char* name, State* state, const std::vector<std::unique_
     return EvaluateValue(state, argv[1]);
 }
 
+// The maximum number of threads that parallel() evaluates its arguments on.
+static constexpr size_t kMaxParallelThreads = 4;
+
+Value* ParallelFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
+    if (argv.empty()) {
+        return ErrorAbort(state, kArgsParsingFailure, "%s() expects at least 1 arg", name);
+    }
+
+    // Each argument is evaluated against a State of its own, so the failures don't race on the
+    // error message and codes. They're merged back below in the order of the arguments.
+    std::vector<std::unique_ptr<State>> states;
+    for (size_t i = 0; i < argv.size(); ++i) {
+        states.emplace_back(std::make_unique<State>(state->script, state->updater));
+        states.back()->is_retry = state->is_retry;
+        states.back()->concurrent = true;
+    }
+
+    std::vector<std::unique_ptr<Value>> results(argv.size());
+    std::atomic<size_t> next_index{ 0 };
+    std::atomic<bool> failed{ false };
+    auto worker = [&]() {
+        for (size_t i = next_index++; i < argv.size() && !failed; i = next_index++) {
+            results[i].reset(EvaluateValue(states[i].get(), argv[i]));
+            if (!results[i]) {
+                failed = true;
+            }
+        }
+    };
+
+    size_t num_threads = std::min<size_t>(
+        { std::thread::hardware_concurrency(), kMaxParallelThreads, argv.size() });
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (!failed) {
+        return results.back().release();
+    }
+
+    // A failure stops the arguments that haven't started yet; the ones in flight still finish.
+    // Report every argument that failed, with the codes of the first one.
+    bool codes_set = false;
+    for (size_t i = 0; i < argv.size(); ++i) {
+        const State& arg_state = *states[i];
+        if (results[i] || arg_state.errmsg.empty()) {
+            continue;
+        }
+        if (!state->errmsg.empty() && state->errmsg.back() != '\n') {
+            state->errmsg += '\n';
+        }
+        state->errmsg += arg_state.errmsg;
+        if (!codes_set && (arg_state.error_code != kNoError || arg_state.cause_code != kNoCause)) {
+            state->error_code = arg_state.error_code;
+            state->cause_code = arg_state.cause_code;
+            codes_set = true;
+        }
+    }
+    return nullptr;
+}
+
 Value* LessThanIntFn(const char* name, State* state,
                      const std::vector<std::unique_ptr<Expr>>& argv) {
     if (argv.size() != 2) {
@@ -337,6 +405,7 @@ void RegisterBuiltins() {
     RegisterFunction("is_substring", SubstringFn);
     RegisterFunction("stdout", StdoutFn);
     RegisterFunction("sleep", SleepFn);
+    RegisterFunction("parallel", ParallelFn);
 
     RegisterFunction("less_than_int", LessThanIntFn);
     RegisterFunction("greater_than_int", GreaterThanIntFn);
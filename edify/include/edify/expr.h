@@ -21,6 +21,7 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "edify/updater_interface.h"
@@ -52,6 +53,11 @@ struct State {
   CauseCode cause_code;
 
   bool is_retry = false;
+
+  // Whether the evaluation may run concurrently with others, i.e. within parallel(). Functions
+  // that keep state across runs (e.g. block_image_update() and its last_command file) keep it
+  // apart then.
+  bool concurrent = false;
 };
 
 struct Value {
@@ -62,8 +68,22 @@ struct Value {
 
   Value(Type type, std::string str) : type(type), data(std::move(str)) {}
 
+  // Creates a BLOB that refers to |blob| without copying it, e.g. a stored entry in the mmapped
+  // package or a range of patch.dat. The caller must keep the memory alive for the lifetime of the
+  // Value. |data| stays empty for such values; readers should go through view().
+  explicit Value(std::string_view blob) : type(Type::BLOB), view_(blob), is_view_(true) {}
+
+  // Returns the contents of the value, whether it's owned in |data| or borrowed.
+  std::string_view view() const {
+    return is_view_ ? view_ : std::string_view(data);
+  }
+
   Type type;
   std::string data;
+
+ private:
+  std::string_view view_;
+  bool is_view_{ false };
 };
 
 struct Expr;
@@ -77,9 +97,9 @@ struct Expr {
   std::vector<std::unique_ptr<Expr>> argv;
   int start, end;
 
-  Expr(Function fn, const std::string& name, int start, int end) :
+  Expr(Function fn, std::string name, int start, int end) :
     fn(fn),
-    name(name),
+    name(std::move(name)),
     start(start),
     end(end) {}
 };
@@ -112,6 +132,13 @@ Value* IfElseFn(const char* name, State* state, const std::vector<std::unique_pt
 Value* AssertFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
 Value* AbortFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
 
+// parallel(expr1, expr2, ...) evaluates its arguments concurrently, and returns the value of the
+// last one. If any of them fails, it returns nullptr with the error messages of all the failed
+// arguments, and the error and cause codes of the first one. The functions called from the
+// arguments must be safe to run concurrently with each other; in particular they mustn't write
+// the same files or partitions, or rely on the order of their output.
+Value* ParallelFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv);
+
 // Register a new function.  The same Function may be registered under
 // multiple names, but a given name should only be used once.
 void RegisterFunction(const std::string& name, Function fn);
@@ -45,4 +45,8 @@ class UpdaterInterface {
   virtual std::string GetResult() const = 0;
   virtual uint8_t* GetMappedPackageAddress() const = 0;
   virtual size_t GetMappedPackageLength() const = 0;
+
+  // Hints that the |length| bytes at |offset| of the package are about to be read through, front
+  // to back.
+  virtual void AdvisePackageRead(uint64_t /* offset */, uint64_t /* length */) const {}
 };
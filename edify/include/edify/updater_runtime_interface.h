@@ -22,6 +22,12 @@
 
 struct selabel_handle;
 
+// The access pattern of the block image commands that follow, for TuneBlockQueues().
+enum class BlockAccess {
+  kSequential,  // Long runs of writes or reads, e.g. "new", "zero" and computing the hash tree.
+  kRandom,      // Scattered reads of source blocks, e.g. "move", "bsdiff" and the verification.
+};
+
 // This class serves as the base to updater runtime. It wraps the runtime dependent functions; and
 // updates on device and host simulations can have different implementations. e.g. block devices
 // during host simulation merely a temporary file. With this class, the caller side in registered
@@ -77,6 +83,17 @@ class UpdaterRuntimeInterface {
   // On devices supports A/B, add current slot suffix to arg. Otherwise, return |arg| as is.
   virtual std::string AddSlotSuffix(const std::string_view arg) const = 0;
 
+  // Tunes the request queues behind the block device |path| for |access|, until
+  // RestoreBlockQueues(). Returns the settings applied the first time, as "key: value" lines for
+  // the install log.
+  virtual std::vector<std::string> TuneBlockQueues(const std::string_view /* path */,
+                                                   BlockAccess /* access */) {
+    return {};
+  }
+  // Restores the settings that TuneBlockQueues() changed for |path|, once no other tuned device
+  // shares the queues.
+  virtual void RestoreBlockQueues(const std::string_view /* path */) {}
+
   virtual struct selabel_handle* sehandle() const {
     return nullptr;
   }
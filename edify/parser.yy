@@ -53,6 +53,29 @@ static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
     return e;
 }
 
+// Builds a binary operator, folding it into a literal when both operands are literals. Generated
+// scripts are full of those (e.g. a property name pasted together from constants), and folding
+// them saves allocating and evaluating the operator on every run.
+static Expr* BuildBinary(Function fn, YYLTYPE loc, Expr* left, Expr* right) {
+    if (left->fn != Literal || right->fn != Literal) {
+        return Build(fn, loc, 2, left, right);
+    }
+
+    std::string folded;
+    if (fn == ConcatFn) {
+        folded = left->name + right->name;
+    } else if (fn == EqualityFn) {
+        folded = (left->name == right->name) ? "t" : "";
+    } else if (fn == InequalityFn) {
+        folded = (left->name != right->name) ? "t" : "";
+    } else {
+        return Build(fn, loc, 2, left, right);
+    }
+    delete left;
+    delete right;
+    return new Expr(Literal, std::move(folded), loc.start, loc.end);
+}
+
 %}
 
 %locations
@@ -69,6 +92,7 @@ static Expr* Build(Function fn, YYLTYPE loc, size_t count, ...) {
 %type <args> arglist
 
 %destructor { delete $$; } expr
+%destructor { free($$); } STRING
 %destructor { delete $$; } arglist
 
 %parse-param {std::unique_ptr<Expr>* root}
@@ -91,14 +115,15 @@ input:  expr           { root->reset($1); }
 
 expr:  STRING {
     $$ = new Expr(Literal, $1, @$.start, @$.end);
+    free($1);
 }
 |  '(' expr ')'                      { $$ = $2; $$->start=@$.start; $$->end=@$.end; }
 |  expr ';'                          { $$ = $1; $$->start=@1.start; $$->end=@1.end; }
 |  expr ';' expr                     { $$ = Build(SequenceFn, @$, 2, $1, $3); }
 |  error ';' expr                    { $$ = $3; $$->start=@$.start; $$->end=@$.end; }
-|  expr '+' expr                     { $$ = Build(ConcatFn, @$, 2, $1, $3); }
-|  expr EQ expr                      { $$ = Build(EqualityFn, @$, 2, $1, $3); }
-|  expr NE expr                      { $$ = Build(InequalityFn, @$, 2, $1, $3); }
+|  expr '+' expr                     { $$ = BuildBinary(ConcatFn, @$, $1, $3); }
+|  expr EQ expr                      { $$ = BuildBinary(EqualityFn, @$, $1, $3); }
+|  expr NE expr                      { $$ = BuildBinary(InequalityFn, @$, $1, $3); }
 |  expr AND expr                     { $$ = Build(LogicalAndFn, @$, 2, $1, $3); }
 |  expr OR expr                      { $$ = Build(LogicalOrFn, @$, 2, $1, $3); }
 |  '!' expr                          { $$ = Build(LogicalNotFn, @$, 1, $2); }
@@ -109,10 +134,15 @@ expr:  STRING {
     if (fn == nullptr) {
         std::string msg = "unknown function \"" + std::string($1) + "\"";
         yyerror(root, error_count, msg.c_str());
+        // YYERROR doesn't run the destructors on the right-hand side.
+        free($1);
+        delete $3;
         YYERROR;
     }
     $$ = new Expr(fn, $1, @$.start, @$.end);
     $$->argv = std::move(*$3);
+    free($1);
+    delete $3;
 }
 ;
 
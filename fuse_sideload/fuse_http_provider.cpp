@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fuse_provider.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+// How long a connect, a send or a receive may take before the fetch fails.
+static constexpr int kSocketTimeoutSeconds = 30;
+
+// The longest status line and headers that are accepted in a response.
+static constexpr size_t kMaxHeaderSize = 64 * 1024;
+
+bool FuseHttpDataProvider::ParseUrl(const std::string& url, std::string* host, std::string* port,
+                                    std::string* path) {
+  std::string_view rest(url);
+  if (!android::base::ConsumePrefix(&rest, "http://")) {
+    return false;
+  }
+
+  size_t path_start = rest.find('/');
+  std::string_view authority = rest.substr(0, path_start);
+  *path = (path_start == std::string_view::npos) ? "/" : std::string(rest.substr(path_start));
+
+  std::string_view port_view;
+  if (android::base::ConsumePrefix(&authority, "[")) {
+    size_t end = authority.find(']');
+    if (end == std::string_view::npos) {
+      return false;
+    }
+    *host = authority.substr(0, end);
+    std::string_view after = authority.substr(end + 1);
+    if (!after.empty() && !android::base::ConsumePrefix(&after, ":")) {
+      return false;
+    }
+    port_view = after;
+  } else {
+    size_t colon = authority.find(':');
+    *host = authority.substr(0, colon);
+    if (colon != std::string_view::npos) {
+      port_view = authority.substr(colon + 1);
+    }
+  }
+  if (host->empty()) {
+    return false;
+  }
+
+  uint16_t port_number = 80;
+  if (!port_view.empty() && !android::base::ParseUint(std::string(port_view), &port_number)) {
+    return false;
+  }
+  *port = std::to_string(port_number);
+  return true;
+}
+
+FuseHttpDataProvider::FuseHttpDataProvider(std::string host, std::string port, std::string path,
+                                           uint32_t block_size)
+    : FuseDataProvider(0, block_size),
+      host_(std::move(host)),
+      port_(std::move(port)),
+      path_(std::move(path)) {}
+
+std::unique_ptr<FuseDataProvider> FuseHttpDataProvider::CreateFromUrl(const std::string& url,
+                                                                      uint32_t block_size) {
+  std::string host;
+  std::string port;
+  std::string path;
+  if (!ParseUrl(url, &host, &port, &path)) {
+    LOG(ERROR) << "Invalid package URL " << url;
+    return nullptr;
+  }
+
+  std::unique_ptr<FuseHttpDataProvider> provider(
+      new FuseHttpDataProvider(std::move(host), std::move(port), std::move(path), block_size));
+
+  // A one-byte range tells the size of the package, and whether the server supports ranges at all.
+  auto conn = provider->Connect();
+  if (!conn) {
+    return nullptr;
+  }
+  uint8_t first_byte;
+  bool keep_alive;
+  uint64_t total_size;
+  if (!provider->FetchRange(conn.get(), &first_byte, 0, 1, &total_size, &keep_alive)) {
+    LOG(ERROR) << "Failed to get the size of " << url;
+    return nullptr;
+  }
+  provider->file_size_ = total_size;
+  if (keep_alive) {
+    provider->idle_.push_back(std::move(conn));
+  }
+  LOG(INFO) << "Serving " << total_size << " bytes from " << url;
+  return provider;
+}
+
+std::unique_ptr<FuseHttpDataProvider::Connection> FuseHttpDataProvider::Connect() const {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addrs;
+  if (int err = getaddrinfo(host_.c_str(), port_.c_str(), &hints, &addrs); err != 0) {
+    LOG(ERROR) << "Failed to resolve " << host_ << ": " << gai_strerror(err);
+    return nullptr;
+  }
+
+  auto conn = std::make_unique<Connection>();
+  for (addrinfo* addr = addrs; addr != nullptr; addr = addr->ai_next) {
+    android::base::unique_fd fd(socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, 0));
+    if (fd == -1) {
+      continue;
+    }
+    // The send timeout also applies to connect(2).
+    timeval timeout = { kSocketTimeoutSeconds, 0 };
+    setsockopt(fd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (TEMP_FAILURE_RETRY(connect(fd.get(), addr->ai_addr, addr->ai_addrlen)) == 0) {
+      conn->fd = std::move(fd);
+      break;
+    }
+  }
+  freeaddrinfo(addrs);
+
+  if (conn->fd == -1) {
+    PLOG(ERROR) << "Failed to connect to " << host_ << ":" << port_;
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(lock_);
+  connections_made_++;
+  return conn;
+}
+
+bool FuseHttpDataProvider::FetchRange(Connection* conn, uint8_t* buffer, uint64_t offset,
+                                      uint64_t size, uint64_t* total_size,
+                                      bool* keep_alive) const {
+  *keep_alive = false;
+  std::string host = (host_.find(':') == std::string::npos) ? host_ : "[" + host_ + "]";
+  std::string request = android::base::StringPrintf(
+      "GET %s HTTP/1.1\r\nHost: %s:%s\r\nRange: bytes=%" PRIu64 "-%" PRIu64
+      "\r\nConnection: keep-alive\r\n\r\n",
+      path_.c_str(), host.c_str(), port_.c_str(), offset, offset + size - 1);
+  for (size_t sent = 0; sent < request.size();) {
+    // Not SIGPIPE, if the server has closed the connection.
+    ssize_t n = TEMP_FAILURE_RETRY(
+        send(conn->fd.get(), request.data() + sent, request.size() - sent, MSG_NOSIGNAL));
+    if (n <= 0) {
+      PLOG(ERROR) << "Failed to send the request";
+      return false;
+    }
+    sent += n;
+  }
+
+  size_t header_end;
+  while ((header_end = conn->pending.find("\r\n\r\n")) == std::string::npos) {
+    if (conn->pending.size() > kMaxHeaderSize) {
+      LOG(ERROR) << "Response headers too long";
+      return false;
+    }
+    char chunk[4096];
+    ssize_t n = TEMP_FAILURE_RETRY(recv(conn->fd.get(), chunk, sizeof(chunk), 0));
+    if (n <= 0) {
+      // A kept-alive connection that the server closed in the meantime ends up here.
+      if (n == -1) PLOG(ERROR) << "Failed to receive the response";
+      return false;
+    }
+    conn->pending.append(chunk, n);
+  }
+  std::vector<std::string> lines =
+      android::base::Split(conn->pending.substr(0, header_end), "\r\n");
+  conn->pending.erase(0, header_end + 4);
+
+  // "HTTP/1.1 206 Partial Content". A plain 200 means that the server ignored the range.
+  std::vector<std::string> status = android::base::Split(lines[0], " ");
+  if (status.size() < 2 || !android::base::StartsWith(status[0], "HTTP/1.") ||
+      status[1] != "206") {
+    LOG(ERROR) << "Unexpected response to the range request: " << lines[0];
+    return false;
+  }
+  bool close = (status[0] == "HTTP/1.0");
+
+  uint64_t content_length = UINT64_MAX;
+  bool range_matches = false;
+  for (size_t i = 1; i < lines.size(); i++) {
+    size_t colon = lines[i].find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = lines[i].substr(0, colon);
+    std::string value = android::base::Trim(lines[i].substr(colon + 1));
+    if (android::base::EqualsIgnoreCase(name, "Content-Length")) {
+      if (!android::base::ParseUint(value, &content_length)) {
+        LOG(ERROR) << "Invalid Content-Length: " << value;
+        return false;
+      }
+    } else if (android::base::EqualsIgnoreCase(name, "Content-Range")) {
+      // "bytes <first>-<last>/<total>"
+      uint64_t first;
+      uint64_t last;
+      std::string_view range(value);
+      if (!android::base::ConsumePrefix(&range, "bytes ")) {
+        return false;
+      }
+      std::vector<std::string> parts = android::base::Split(std::string(range), "-/");
+      if (parts.size() != 3 || !android::base::ParseUint(parts[0], &first) ||
+          !android::base::ParseUint(parts[1], &last) ||
+          !android::base::ParseUint(parts[2], total_size)) {
+        LOG(ERROR) << "Invalid Content-Range: " << value;
+        return false;
+      }
+      range_matches = (first == offset && last == offset + size - 1);
+    } else if (android::base::EqualsIgnoreCase(name, "Connection")) {
+      close = android::base::EqualsIgnoreCase(value, "close");
+    }
+  }
+  if (!range_matches || content_length != size) {
+    LOG(ERROR) << "The response doesn't match the range " << offset << "+" << size;
+    return false;
+  }
+
+  size_t buffered = std::min<size_t>(size, conn->pending.size());
+  memcpy(buffer, conn->pending.data(), buffered);
+  conn->pending.erase(0, buffered);
+  for (size_t received = buffered; received < size;) {
+    ssize_t n = TEMP_FAILURE_RETRY(recv(conn->fd.get(), buffer + received, size - received, 0));
+    if (n <= 0) {
+      if (n == -1) PLOG(ERROR) << "Failed to receive the response";
+      return false;
+    }
+    received += n;
+  }
+
+  *keep_alive = !close;
+  return true;
+}
+
+bool FuseHttpDataProvider::ReadRange(uint8_t* buffer, uint64_t offset, uint64_t size) const {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    std::unique_ptr<Connection> conn;
+    if (attempt == 0) {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (!idle_.empty()) {
+        conn = std::move(idle_.back());
+        idle_.pop_back();
+      }
+    }
+    if (!conn && !(conn = Connect())) {
+      return false;
+    }
+
+    uint64_t total_size;
+    bool keep_alive;
+    if (!FetchRange(conn.get(), buffer, offset, size, &total_size, &keep_alive)) {
+      continue;
+    }
+    if (total_size != file_size_) {
+      LOG(ERROR) << "The package size changed from " << file_size_ << " to " << total_size;
+      return false;
+    }
+    if (keep_alive) {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (idle_.size() < kMaxConnections) {
+        idle_.push_back(std::move(conn));
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+bool FuseHttpDataProvider::ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                                                uint32_t start_block) const {
+  uint64_t offset = static_cast<uint64_t>(start_block) * fuse_block_size_;
+  if (fetch_size > file_size_ || offset > file_size_ - fetch_size) {
+    LOG(ERROR) << "Out of bound read, offset: " << offset << ", fetch size: " << fetch_size
+               << ", file size " << file_size_;
+    return false;
+  }
+
+  // A single connection rarely fills a fast link, so the readahead gets fetched in parts of whole
+  // blocks in parallel; the last part takes what's left.
+  size_t parts = std::clamp<size_t>(
+      std::min(fetch_size / kMinPartSize, fetch_size / fuse_block_size_), 1, kMaxConnections);
+  if (parts == 1) {
+    return ReadRange(buffer, offset, fetch_size);
+  }
+  uint32_t blocks_per_part = (fetch_size / fuse_block_size_) / parts;
+  uint32_t part_size = blocks_per_part * fuse_block_size_;
+
+  std::vector<char> results(parts, false);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < parts; i++) {
+    threads.emplace_back([&, i]() {
+      uint32_t size = (i == parts - 1) ? fetch_size - i * part_size : part_size;
+      results[i] = ReadRange(buffer + i * part_size, offset + i * part_size, size);
+    });
+  }
+  results[0] = ReadRange(buffer, offset, part_size);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return std::all_of(results.begin(), results.end(), [](char result) { return result; });
+}
+
+void FuseHttpDataProvider::Close() {
+  std::lock_guard<std::mutex> lock(lock_);
+  idle_.clear();
+}
@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <functional>
 
 #include <android-base/file.h>
@@ -78,16 +79,15 @@ void FuseFileDataProvider::Close() {
   fd_.reset();
 }
 
-FuseBlockDataProvider::FuseBlockDataProvider(uint64_t file_size, uint32_t fuse_block_size,
+FuseBlockDataProvider::FuseBlockDataProvider(uint32_t fuse_block_size,
                                              android::base::unique_fd&& fd,
-                                             uint32_t source_block_size, RangeSet ranges)
-    : FuseDataProvider(file_size, fuse_block_size),
+                                             BlockMapData block_map)
+    : FuseDataProvider(block_map.file_size(), fuse_block_size),
       fd_(std::move(fd)),
-      source_block_size_(source_block_size),
-      ranges_(std::move(ranges)) {
+      block_map_(std::move(block_map)) {
   // Make sure the offset is also aligned with the blocks on the block device when we call
   // ReadBlockAlignedData().
-  CHECK_EQ(0, fuse_block_size_ % source_block_size_);
+  CHECK_EQ(0, fuse_block_size_ % block_map_.block_size());
 }
 
 bool FuseBlockDataProvider::ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
@@ -99,40 +99,28 @@ bool FuseBlockDataProvider::ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch
     return false;
   }
 
-  auto read_ranges =
-      ranges_.GetSubRanges(offset / source_block_size_, fetch_size / source_block_size_);
+  // The ranges cover the partial block at the end of the file (if any) as well, so that a
+  // physically contiguous fetch always takes a single read.
+  uint32_t source_block_size = block_map_.block_size();
+  auto read_ranges = block_map_.GetSubRanges(
+      offset / source_block_size, (fetch_size + source_block_size - 1) / source_block_size);
   if (!read_ranges) {
     return false;
   }
 
   uint8_t* next_out = buffer;
+  uint64_t remaining = fetch_size;
   for (const auto& [range_start, range_end] : read_ranges.value()) {
-    uint64_t bytes_start = static_cast<uint64_t>(range_start) * source_block_size_;
-    uint64_t bytes_to_read = static_cast<uint64_t>(range_end - range_start) * source_block_size_;
+    uint64_t bytes_start = static_cast<uint64_t>(range_start) * source_block_size;
+    uint64_t bytes_to_read =
+        std::min(static_cast<uint64_t>(range_end - range_start) * source_block_size, remaining);
     if (!android::base::ReadFullyAtOffset(fd_, next_out, bytes_to_read, bytes_start)) {
       PLOG(ERROR) << "Failed to read " << bytes_to_read << " bytes at offset " << bytes_start;
       return false;
     }
 
     next_out += bytes_to_read;
-  }
-
-  if (uint64_t tailing_bytes = fetch_size % source_block_size_; tailing_bytes != 0) {
-    // Calculate the offset to last partial block. Two possibilities as below:
-    // 1: fetch_size < source_block_size_, the read_ranges is a blank range_set.
-    //    Get the last block num through GetBlockNumber() of the offset block.
-    // 2: fetch_size >= source_block_size_, the last block num is already stored
-    //    in read-ranges by GetSubRanges() above.
-    uint64_t tailing_offset =
-        read_ranges.value()
-            ? static_cast<uint64_t>((read_ranges->cend() - 1)->second) * source_block_size_
-            : static_cast<uint64_t>(ranges_.GetBlockNumber(offset / source_block_size_)) *
-                  source_block_size_;
-    if (!android::base::ReadFullyAtOffset(fd_, next_out, tailing_bytes, tailing_offset)) {
-      PLOG(ERROR) << "Failed to read tailing " << tailing_bytes << " bytes at offset "
-                  << tailing_offset;
-      return false;
-    }
+    remaining -= bytes_to_read;
   }
   return true;
 }
@@ -151,8 +139,7 @@ std::unique_ptr<FuseDataProvider> FuseBlockDataProvider::CreateFromBlockMap(
   }
 
   return std::unique_ptr<FuseBlockDataProvider>(
-      new FuseBlockDataProvider(block_map.file_size(), fuse_block_size, std::move(fd),
-                                block_map.block_size(), block_map.block_ranges()));
+      new FuseBlockDataProvider(fuse_block_size, std::move(fd), std::move(block_map)));
 }
 
 void FuseBlockDataProvider::Close() {
@@ -44,6 +44,7 @@
 #include "fuse_sideload.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <limits.h>  // PATH_MAX
 #include <linux/fuse.h>
@@ -57,14 +58,30 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <openssl/sha.h>
 
+#include "otautil/live_stats.h"
+#include "otautil/memory_budget.h"
+#include "otautil/sysutil.h"
+
 static constexpr uint64_t PACKAGE_FILE_ID = FUSE_ROOT_ID + 1;
 static constexpr uint64_t EXIT_FLAG_ID = FUSE_ROOT_ID + 2;
 
@@ -73,8 +90,63 @@ static constexpr int NO_STATUS_EXIT = 2;
 
 using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 
+// Max number of blocks in the file. Block numbers must fit the 8-digit requests to the adb host.
+static constexpr uint32_t MAX_FILE_BLOCKS = 1 << 24;
+
+// The SHA-256 hash of each block, all zeros if the block hasn't been read yet. The hashes are kept
+// in pages of HASH_PAGE_BLOCKS, which only get allocated once a hash is stored into them. A small
+// fuse block size for a large package then costs a table of page pointers up front, which is
+// 1/HASH_PAGE_BLOCKS the size of a dense array, plus the pages for the parts that are read.
+class BlockHashes {
+ public:
+  void Resize(uint32_t blocks) {
+    pages_.resize((blocks + HASH_PAGE_BLOCKS - 1) / HASH_PAGE_BLOCKS);
+  }
+
+  const SHA256Digest& Get(uint32_t block) const {
+    static const SHA256Digest kZeroDigest = {};
+    const auto& page = pages_[block / HASH_PAGE_BLOCKS];
+    return page ? (*page)[block % HASH_PAGE_BLOCKS] : kZeroDigest;
+  }
+
+  void Set(uint32_t block, const SHA256Digest& hash) {
+    auto& page = pages_[block / HASH_PAGE_BLOCKS];
+    if (!page) {
+      page = std::make_unique<Page>();
+    }
+    (*page)[block % HASH_PAGE_BLOCKS] = hash;
+  }
+
+ private:
+  static constexpr uint32_t HASH_PAGE_BLOCKS = 1024;
+  using Page = std::array<SHA256Digest, HASH_PAGE_BLOCKS>;
+
+  std::vector<std::unique_ptr<Page>> pages_;
+};
+
 #define INSTALL_REQUIRED_MEMORY (400 * 1024 * 1024)
 
+// Bytes to prefetch from the provider in one read, once the blocks are being read sequentially.
+// The readahead starts at READAHEAD_SIZE, and is then resized within [READAHEAD_MIN_SIZE,
+// READAHEAD_MAX_SIZE] to what the provider's measured latency and bandwidth call for.
+static constexpr uint32_t READAHEAD_SIZE = 2 * 1024 * 1024;
+static constexpr uint32_t READAHEAD_MIN_SIZE = 256 * 1024;
+static constexpr uint32_t READAHEAD_MAX_SIZE = 8 * 1024 * 1024;
+
+// Each readahead fetch aims to take this many times the per-request latency of the provider, which
+// keeps the latency below ~10% of the time spent fetching.
+static constexpr uint32_t READAHEAD_LATENCY_FACTOR = 8;
+
+// The access order hints are only followed this far ahead of the reads, as a share of the block
+// cache that holds the prefetched blocks until they're read.
+static constexpr uint32_t HINT_AHEAD_CACHE_SHARE = 2;
+// Sizes beyond which the central directory and the hints entry aren't read.
+static constexpr uint64_t MAX_CENTRAL_DIRECTORY_SIZE = 16 * 1024 * 1024;
+static constexpr uint64_t MAX_ACCESS_ORDER_SIZE = 4 * 1024 * 1024;
+
+// Number of threads that serve the read requests.
+static constexpr int FUSE_READ_THREADS = 4;
+
 struct fuse_data {
   android::base::unique_fd ffd;  // file descriptor for the fuse socket
 
@@ -88,82 +160,95 @@ struct fuse_data {
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently used
-  uint8_t* block_data;
+  // Guards the states below, which are shared by the threads that serve the reads.
+  std::mutex lock;
+  std::condition_variable fetch_done;  // Notified whenever a fetch from the provider completes
 
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
+  uint32_t last_block;  // the block most recently asked for
+  std::vector<std::pair<uint32_t, uint32_t>> fetching;  // [start, count) of the ongoing fetches
 
-  std::vector<SHA256Digest>
-      hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
+  std::mutex provider_lock;  // Serializes the provider reads, unless it allows concurrent ones
+
+  BlockHashes hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
 
   // Block cache
   uint32_t block_cache_max_size;  // Max allowed block cache size
   uint32_t block_cache_size;      // Current block cache size
-  uint8_t** block_cache;          // Block cache data
+  uint8_t* block_cache;           // Slab of block_cache_max_size blocks, allocated once
+  std::vector<uint32_t> block_cache_blocks;     // Block held by each slot
+  std::vector<bool> block_cache_referenced;     // Whether each slot was hit since the last sweep
+  uint32_t block_cache_hand;                    // Next slot for the eviction to look at
+  std::unordered_map<uint32_t, uint32_t> block_cache_slots;  // Slot of each cached block
+  std::unique_ptr<MemoryBudget::Reservation> block_cache_memory;  // The budget of the slab
+
+  // Readahead window, holding verified blocks that were fetched along with an earlier block
+  uint32_t readahead_max_blocks;  // Max number of blocks to fetch in one read, as last resized
+  uint32_t readahead_start;       // First block in the window
+  uint32_t readahead_blocks;      // Number of blocks in the window
+  std::shared_ptr<std::vector<uint8_t>> readahead_data;  // Also held by the replies that use it
+  std::vector<std::shared_ptr<std::vector<uint8_t>>> spare_buffers;  // Fetch buffers to reuse
+
+  // Provider stats, which size the readahead and get reported when the sideload ends
+  uint64_t fetch_count;      // Number of successful fetches
+  uint64_t fetch_bytes;      // Bytes fetched by them
+  uint64_t fetch_us;         // Time spent in them
+  int64_t fetch_latency_us;  // Shortest single-block fetch, or -1 if there hasn't been one
+  double fetch_bandwidth;    // Moving average of the bytes per us beyond the latency, or 0
+  uint64_t block_hits;       // Blocks served from the block cache or the readahead window
+
+  // The blocks that the package's access order hints say get read, in order, which hint_thread
+  // prefetches into the block cache ahead of the reads. hint_read_pos follows the reads through
+  // the hints, and hint_fetch_pos the prefetches.
+  std::vector<uint32_t> hint_blocks;
+  size_t hint_read_pos;
+  size_t hint_fetch_pos;
+  uint32_t hint_ahead_blocks;  // Max number of blocks prefetched ahead of the reads
+  uint64_t hint_fetched;       // Blocks prefetched
+  std::condition_variable hint_progress;  // Notified as the reads move on through the hints
+  std::thread hint_thread;
+  bool hint_stop;  // Guarded by |lock|
 };
 
-static uint64_t free_memory() {
-  uint64_t mem = 0;
-  FILE* fp = fopen("/proc/meminfo", "r");
-  if (fp) {
-    char buf[256];
-    char* linebuf = buf;
-    size_t buflen = sizeof(buf);
-    while (getline(&linebuf, &buflen, fp) > 0) {
-      char* key = buf;
-      char* val = strchr(buf, ':');
-      *val = '\0';
-      ++val;
-      if (strcmp(key, "MemFree") == 0) {
-        mem += strtoul(val, nullptr, 0) * 1024;
-      }
-      if (strcmp(key, "Buffers") == 0) {
-        mem += strtoul(val, nullptr, 0) * 1024;
-      }
-      if (strcmp(key, "Cached") == 0) {
-        mem += strtoul(val, nullptr, 0) * 1024;
-      }
-    }
-    fclose(fp);
-  }
-  return mem;
+static bool block_cache_contains(const struct fuse_data* fd, uint32_t block) {
+  return fd->block_cache != nullptr && fd->block_cache_slots.count(block) != 0;
 }
 
-static int block_cache_fetch(struct fuse_data* fd, uint32_t block) {
+static int block_cache_fetch(struct fuse_data* fd, uint32_t block, uint8_t* out) {
   if (fd->block_cache == nullptr) {
     return -1;
   }
-  if (fd->block_cache[block] == nullptr) {
+  auto it = fd->block_cache_slots.find(block);
+  if (it == fd->block_cache_slots.end()) {
     return -1;
   }
-  memcpy(fd->block_data, fd->block_cache[block], fd->block_size);
+  fd->block_cache_referenced[it->second] = true;
+  memcpy(out, fd->block_cache + static_cast<size_t>(it->second) * fd->block_size, fd->block_size);
   return 0;
 }
 
-static void block_cache_enter(struct fuse_data* fd, uint32_t block) {
+static void block_cache_enter(struct fuse_data* fd, uint32_t block, const uint8_t* data) {
   if (!fd->block_cache) return;
-  if (fd->block_cache_size == fd->block_cache_max_size) {
-    // Evict a block from the cache.  Since the file is typically read
-    // sequentially, start looking from the block behind the current
-    // block and proceed backward.
-    int n;
-    for (n = fd->curr_block - 1; n != (int)fd->curr_block; --n) {
-      if (n < 0) {
-        n = fd->file_blocks - 1;
-      }
-      if (fd->block_cache[n]) {
-        free(fd->block_cache[n]);
-        fd->block_cache[n] = nullptr;
-        fd->block_cache_size--;
-        break;
-      }
+  uint32_t slot;
+  if (fd->block_cache_size < fd->block_cache_max_size) {
+    slot = fd->block_cache_size++;
+  } else {
+    // Evict a block from the cache with the CLOCK algorithm: sweep past (and clear) the slots that
+    // have been hit since the last sweep, and take the first one that hasn't. Blocks that keep
+    // getting looked up, such as the zip central directory, survive the sequential streaming of
+    // the entries.
+    while (fd->block_cache_referenced[fd->block_cache_hand]) {
+      fd->block_cache_referenced[fd->block_cache_hand] = false;
+      fd->block_cache_hand = (fd->block_cache_hand + 1) % fd->block_cache_max_size;
     }
+    slot = fd->block_cache_hand;
+    fd->block_cache_hand = (fd->block_cache_hand + 1) % fd->block_cache_max_size;
+    fd->block_cache_slots.erase(fd->block_cache_blocks[slot]);
   }
 
-  fd->block_cache[block] = (uint8_t*)malloc(fd->block_size);
-  memcpy(fd->block_cache[block], fd->block_data, fd->block_size);
-
-  fd->block_cache_size++;
+  fd->block_cache_blocks[slot] = block;
+  fd->block_cache_referenced[slot] = false;
+  fd->block_cache_slots[block] = slot;
+  memcpy(fd->block_cache + static_cast<size_t>(slot) * fd->block_size, data, fd->block_size);
 }
 
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
@@ -211,7 +296,8 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
 
   out.major = FUSE_KERNEL_VERSION;
   out.max_readahead = req->max_readahead;
-  out.flags = 0;
+  // The reads are served by multiple threads, so let the kernel issue them concurrently.
+  out.flags = req->flags & FUSE_ASYNC_READ;
   out.max_background = 32;
   out.congestion_threshold = 32;
   out.max_write = 4096;
@@ -294,66 +380,406 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint64_t block) {
-  if (block == fd->curr_block) {
-    return 0;
+// Verifies the hash of a block we just got from the host.
+//
+// - If the hash of the just-received data matches the stored hash for the block, accept it.
+// - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
+//   time we've read this block).
+// - Otherwise, reject the block.
+//
+// The caller must hold fd->lock.
+static bool verify_block(fuse_data* fd, uint32_t block, const SHA256Digest& hash,
+                         const uint8_t* data) {
+  const SHA256Digest& blockhash = fd->hashes.Get(block);
+  if (hash == blockhash) {
+    return true;
   }
 
-  if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
-    return 0;
+  for (uint8_t i : blockhash) {
+    if (i != 0) {
+      return false;
+    }
   }
 
-  if (block_cache_fetch(fd, block) == 0) {
-    fd->curr_block = block;
-    return 0;
+  fd->hashes.Set(block, hash);
+  block_cache_enter(fd, block, data);
+  return true;
+}
+
+// Returns whether the block is part of an ongoing fetch. The caller must hold fd->lock.
+static bool block_fetching(const fuse_data* fd, uint32_t block) {
+  return std::any_of(fd->fetching.cbegin(), fd->fetching.cend(), [block](const auto& fetch) {
+    return block >= fetch.first && block - fetch.first < fetch.second;
+  });
+}
+
+// Records a successful fetch of |blocks| blocks that took |elapsed_us|, and resizes the readahead
+// to match. A single-block fetch is dominated by the per-request latency (e.g. a USB round trip
+// for adb), while larger ones show the bandwidth on top of that. Must be called with the lock held.
+static void update_fetch_stats(fuse_data* fd, uint32_t blocks, uint32_t bytes, int64_t elapsed_us) {
+  fd->fetch_count++;
+  fd->fetch_bytes += bytes;
+  fd->fetch_us += elapsed_us;
+  SetLiveCounter("fuse_fetches", fd->fetch_count);
+  SetLiveCounter("fuse_fetch_bytes", fd->fetch_bytes);
+  SetLiveCounter("fuse_block_hits", fd->block_hits);
+
+  if (blocks == 1) {
+    if (fd->fetch_latency_us == -1 || elapsed_us < fd->fetch_latency_us) {
+      fd->fetch_latency_us = elapsed_us;
+    }
+    return;
+  }
+  if (fd->fetch_latency_us == -1 || elapsed_us <= fd->fetch_latency_us) {
+    return;
   }
+  double bandwidth = static_cast<double>(bytes) / (elapsed_us - fd->fetch_latency_us);
+  fd->fetch_bandwidth =
+      (fd->fetch_bandwidth == 0) ? bandwidth : (fd->fetch_bandwidth * 3 + bandwidth) / 4;
 
-  uint32_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
+  double target_size = READAHEAD_LATENCY_FACTOR * fd->fetch_latency_us * fd->fetch_bandwidth;
+  target_size = std::clamp<double>(target_size, READAHEAD_MIN_SIZE, READAHEAD_MAX_SIZE);
+  fd->readahead_max_blocks = std::max<uint32_t>(1, target_size / fd->block_size);
+}
+
+// Returns a buffer for a fetch, reusing a spare one if there is. The caller must hold fd->lock.
+static std::shared_ptr<std::vector<uint8_t>> take_buffer(fuse_data* fd) {
+  if (fd->spare_buffers.empty()) {
+    return std::make_shared<std::vector<uint8_t>>();
+  }
+  std::shared_ptr<std::vector<uint8_t>> buffer = std::move(fd->spare_buffers.back());
+  fd->spare_buffers.pop_back();
+  return buffer;
+}
+
+// Fetches |blocks| blocks at |block| from the provider into |buffer|, releasing |lock| (on
+// fd->lock) meanwhile, and checks them. Returns the number of blocks from the first one that passed
+// the check, i.e. 0 if the fetch failed or the first block was rejected. Only the blocks up to the
+// first one that fails the check are kept; that one will be fetched (and rejected) again if it gets
+// read.
+static uint32_t fetch_blocks(fuse_data* fd, std::unique_lock<std::mutex>& lock, uint32_t block,
+                             uint32_t blocks, std::vector<uint8_t>* buffer) {
+  fd->fetching.emplace_back(block, blocks);
+  lock.unlock();
+
+  buffer->resize(static_cast<size_t>(blocks) * fd->block_size);
+  uint32_t fetch_size = blocks * fd->block_size;
+  if (static_cast<uint64_t>(block) * fd->block_size + fetch_size > fd->file_size) {
     // If we're reading the last (partial) block of the file, expect a shorter response from the
     // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+    fetch_size = fd->file_size - (static_cast<uint64_t>(block) * fd->block_size);
+    memset(buffer->data() + fetch_size, 0, blocks * fd->block_size - fetch_size);
   }
 
-  if (!fd->provider->ReadBlockAlignedData(fd->block_data, fetch_size, block)) {
-    return -EIO;
+  bool success;
+  auto start = std::chrono::steady_clock::now();
+  if (fd->provider->SupportsConcurrentReads()) {
+    success = fd->provider->ReadBlockAlignedData(buffer->data(), fetch_size, block);
+  } else {
+    std::lock_guard<std::mutex> provider_lock(fd->provider_lock);
+    success = fd->provider->ReadBlockAlignedData(buffer->data(), fetch_size, block);
   }
+  int64_t elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
 
-  fd->curr_block = block;
+  std::vector<SHA256Digest> hashes(success ? blocks : 0);
+  for (uint32_t i = 0; i < hashes.size(); i++) {
+    SHA256(buffer->data() + i * fd->block_size, fd->block_size, hashes[i].data());
+  }
 
-  // Verify the hash of the block we just got from the host.
-  //
-  // - If the hash of the just-received data matches the stored hash for the block, accept it.
-  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
-  //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
+  lock.lock();
+  fd->fetching.erase(
+      std::find(fd->fetching.begin(), fd->fetching.end(), std::make_pair(block, blocks)));
+  fd->fetch_done.notify_all();
+  if (!success) {
+    return 0;
+  }
+  update_fetch_stats(fd, blocks, fetch_size, elapsed_us);
 
-  SHA256Digest hash;
-  SHA256(fd->block_data, fd->block_size, hash.data());
+  uint32_t verified = 0;
+  while (verified < blocks &&
+         verify_block(fd, block + verified, hashes[verified],
+                      buffer->data() + verified * fd->block_size)) {
+    verified++;
+  }
+  return verified;
+}
 
-  const SHA256Digest& blockhash = fd->hashes[block];
-  if (hash == blockhash) {
+// Moves hint_read_pos past |block|, if it's one of the hinted blocks not too far ahead, i.e. the
+// reads have got that far in the hinted order. The caller must hold fd->lock.
+static void follow_hints(fuse_data* fd, uint32_t block) {
+  size_t end = std::min(fd->hint_blocks.size(),
+                        std::max(fd->hint_read_pos, fd->hint_fetch_pos) + fd->hint_ahead_blocks);
+  for (size_t pos = fd->hint_read_pos; pos < end; pos++) {
+    if (fd->hint_blocks[pos] == block) {
+      fd->hint_read_pos = pos + 1;
+      fd->hint_progress.notify_all();
+      return;
+    }
+  }
+}
+
+// Fetch a block from the host, which may be called from multiple threads at the same time. Points
+// |data| to the block: a block in the readahead window (including the one just fetched) is used in
+// place, with |holder| keeping the window alive; otherwise the block is copied into |out|. Returns
+// 0 on successful fetch, negative otherwise.
+static int fetch_block(fuse_data* fd, uint64_t block, uint8_t* out, const uint8_t** data,
+                       std::shared_ptr<std::vector<uint8_t>>* holder) {
+  if (block >= fd->file_blocks) {
+    memset(out, 0, fd->block_size);
+    *data = out;
     return 0;
   }
 
-  for (uint8_t i : blockhash) {
-    if (i != 0) {
-      fd->curr_block = -1;
-      return -EIO;
+  std::unique_lock<std::mutex> lock(fd->lock);
+  bool sequential = (block == fd->last_block + 1);
+  fd->last_block = block;
+  follow_hints(fd, block);
+
+  // If another thread is already fetching the block, wait for it rather than fetching it again.
+  while (true) {
+    if (block_cache_fetch(fd, block, out) == 0) {
+      fd->block_hits++;
+      *data = out;
+      return 0;
     }
+    if (block >= fd->readahead_start && block - fd->readahead_start < fd->readahead_blocks) {
+      fd->block_hits++;
+      *holder = fd->readahead_data;
+      *data = fd->readahead_data->data() + (block - fd->readahead_start) * fd->block_size;
+      return 0;
+    }
+    if (!block_fetching(fd, block)) {
+      break;
+    }
+    fd->fetch_done.wait(lock);
   }
 
-  fd->hashes[block] = hash;
-  block_cache_enter(fd, block);
+  // Reads are overwhelmingly sequential when the package is streamed, so a miss on the block
+  // following the previous one also fetches the next blocks, up to the first one that's cached or
+  // being fetched.
+  uint32_t blocks = 1;
+  if (sequential) {
+    uint32_t max_blocks = std::min<uint64_t>(fd->readahead_max_blocks, fd->file_blocks - block);
+    while (blocks < max_blocks && !block_cache_contains(fd, block + blocks) &&
+           !block_fetching(fd, block + blocks)) {
+      blocks++;
+    }
+  }
+  std::shared_ptr<std::vector<uint8_t>> buffer = take_buffer(fd);
+  uint32_t verified = fetch_blocks(fd, lock, block, blocks, buffer.get());
+  if (verified == 0) {
+    fd->spare_buffers.push_back(std::move(buffer));
+    return -EIO;
+  }
+
+  // The old window can only be reused once no reply is still using it. New references are only
+  // taken under the lock, so a use count of one can't go up behind our back.
+  if (fd->readahead_data && fd->readahead_data.use_count() == 1) {
+    fd->spare_buffers.push_back(std::move(fd->readahead_data));
+  }
+  fd->readahead_data = buffer;
+  fd->readahead_start = block;
+  fd->readahead_blocks = verified;
+  *holder = std::move(buffer);
+  *data = (*holder)->data();
   return 0;
 }
 
-static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
+// Reads |size| bytes at |offset| of the file into |out|, using |buffer| of one block. Returns false
+// on errors.
+static bool read_file_data(fuse_data* fd, uint64_t offset, uint8_t* out, size_t size,
+                           uint8_t* buffer) {
+  while (size > 0) {
+    uint64_t block = offset / fd->block_size;
+    const uint8_t* block_data;
+    std::shared_ptr<std::vector<uint8_t>> holder;
+    if (fetch_block(fd, block, buffer, &block_data, &holder) != 0) {
+      return false;
+    }
+    uint32_t block_offset = offset - block * fd->block_size;
+    size_t count = std::min<size_t>(size, fd->block_size - block_offset);
+    memcpy(out, block_data + block_offset, count);
+    out += count;
+    offset += count;
+    size -= count;
+  }
+  return true;
+}
+
+// Little-endian fields of the zip records.
+static uint16_t get_le16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// Finds the stored (uncompressed) entry |name| of the package, by reading the end of central
+// directory record and the central directory through the block fetches. Zip64 archives aren't
+// looked into. Sets |offset| and |length| to the data of the entry, and returns true if it's found.
+static bool find_stored_entry(fuse_data* fd, const std::string& name, uint64_t* offset,
+                              uint64_t* length) {
+  static constexpr size_t kEocdSize = 22;
+  static constexpr size_t kCentralHeaderSize = 46;
+  static constexpr size_t kLocalHeaderSize = 30;
+  std::vector<uint8_t> buffer(fd->block_size);
+
+  // The EOCD is followed by a comment of up to 64 KiB.
+  uint64_t tail_size = std::min<uint64_t>(fd->file_size, kEocdSize + 0xffff);
+  std::vector<uint8_t> tail(tail_size);
+  if (tail_size < kEocdSize ||
+      !read_file_data(fd, fd->file_size - tail_size, tail.data(), tail_size, buffer.data())) {
+    return false;
+  }
+  size_t eocd = tail_size - kEocdSize;
+  while (get_le32(&tail[eocd]) != 0x06054b50) {
+    if (eocd == 0) {
+      return false;
+    }
+    eocd--;
+  }
+  uint64_t cd_size = get_le32(&tail[eocd + 12]);
+  uint64_t cd_offset = get_le32(&tail[eocd + 16]);
+  if (cd_offset == 0xffffffff || cd_size > MAX_CENTRAL_DIRECTORY_SIZE ||
+      cd_offset + cd_size > fd->file_size) {
+    return false;
+  }
+
+  std::vector<uint8_t> cd(cd_size);
+  if (!read_file_data(fd, cd_offset, cd.data(), cd_size, buffer.data())) {
+    return false;
+  }
+  for (size_t pos = 0; pos + kCentralHeaderSize <= cd_size;) {
+    const uint8_t* header = &cd[pos];
+    if (get_le32(header) != 0x02014b50) {
+      return false;
+    }
+    size_t name_length = get_le16(header + 28);
+    size_t entry_size = kCentralHeaderSize + name_length + get_le16(header + 30) +
+                        get_le16(header + 32);
+    if (pos + kCentralHeaderSize + name_length > cd_size) {
+      return false;
+    }
+    if (std::string_view(reinterpret_cast<const char*>(header + kCentralHeaderSize),
+                         name_length) == name) {
+      if (get_le16(header + 10) != 0) {
+        fprintf(stderr, "%s isn't stored uncompressed\n", name.c_str());
+        return false;
+      }
+      uint64_t local_offset = get_le32(header + 42);
+      uint8_t local[kLocalHeaderSize];
+      if (local_offset + kLocalHeaderSize > fd->file_size ||
+          !read_file_data(fd, local_offset, local, kLocalHeaderSize, buffer.data()) ||
+          get_le32(local) != 0x04034b50) {
+        return false;
+      }
+      *offset = local_offset + kLocalHeaderSize + get_le16(local + 26) + get_le16(local + 28);
+      *length = get_le32(header + 20);
+      return *offset + *length <= fd->file_size;
+    }
+    pos += entry_size;
+  }
+  return false;
+}
+
+bool parse_access_order_hints(const std::string& content, uint64_t file_size,
+                              uint32_t block_size, std::vector<uint32_t>* blocks) {
+  blocks->clear();
+  for (const auto& line : android::base::Split(content, "\n")) {
+    std::string trimmed = android::base::Trim(line);
+    if (trimmed.empty() || trimmed[0] == '#') {
+      continue;
+    }
+    std::vector<std::string> pieces = android::base::Split(trimmed, " ");
+    uint64_t offset;
+    uint64_t length;
+    if (pieces.size() != 2 || !android::base::ParseUint(pieces[0], &offset) ||
+        !android::base::ParseUint(pieces[1], &length) || length == 0 || offset >= file_size ||
+        length > file_size - offset) {
+      fprintf(stderr, "invalid access order hint \"%s\"\n", trimmed.c_str());
+      blocks->clear();
+      return false;
+    }
+    for (uint64_t block = offset / block_size; block <= (offset + length - 1) / block_size;
+         block++) {
+      // Ranges that follow on from each other share their boundary block.
+      if (blocks->empty() || blocks->back() != block) {
+        blocks->push_back(block);
+      }
+    }
+  }
+  return true;
+}
+
+// Reads the access order hints of the package, and prefetches the hinted blocks into the block
+// cache as the reads move on through them, up to hint_ahead_blocks ahead. Runs on fd->hint_thread.
+static void prefetch_hinted_blocks(fuse_data* fd) {
+  uint64_t offset;
+  uint64_t length;
+  if (!find_stored_entry(fd, FUSE_SIDELOAD_ACCESS_ORDER_ENTRY, &offset, &length)) {
+    return;
+  }
+  if (length > MAX_ACCESS_ORDER_SIZE) {
+    fprintf(stderr, "access order hints of %" PRIu64 " bytes are too large\n", length);
+    return;
+  }
+  std::string content(length, '\0');
+  std::vector<uint8_t> buffer(fd->block_size);
+  std::vector<uint32_t> blocks;
+  if (!read_file_data(fd, offset, reinterpret_cast<uint8_t*>(content.data()), length,
+                      buffer.data()) ||
+      !parse_access_order_hints(content, fd->file_size, fd->block_size, &blocks)) {
+    return;
+  }
+  fprintf(stderr, "following the access order hints of %zu blocks\n", blocks.size());
+
+  std::unique_lock<std::mutex> lock(fd->lock);
+  fd->hint_blocks = std::move(blocks);
+  while (!fd->hint_stop) {
+    fd->hint_fetch_pos = std::max(fd->hint_fetch_pos, fd->hint_read_pos);
+    if (fd->hint_fetch_pos == fd->hint_blocks.size()) {
+      break;
+    }
+    if (fd->hint_fetch_pos >= fd->hint_read_pos + fd->hint_ahead_blocks) {
+      fd->hint_progress.wait(lock);
+      continue;
+    }
+
+    // A run of hinted blocks that follow on from each other gets fetched at once.
+    auto needs_fetch = [fd](uint32_t block) {
+      return !block_cache_contains(fd, block) && !block_fetching(fd, block) &&
+             (block < fd->readahead_start || block - fd->readahead_start >= fd->readahead_blocks);
+    };
+    uint32_t block = fd->hint_blocks[fd->hint_fetch_pos++];
+    if (!needs_fetch(block)) {
+      continue;
+    }
+    uint32_t count = 1;
+    while (count < fd->readahead_max_blocks && fd->hint_fetch_pos < fd->hint_blocks.size() &&
+           fd->hint_blocks[fd->hint_fetch_pos] == block + count && needs_fetch(block + count)) {
+      fd->hint_fetch_pos++;
+      count++;
+    }
+
+    std::shared_ptr<std::vector<uint8_t>> fetched = take_buffer(fd);
+    uint32_t verified = fetch_blocks(fd, lock, block, count, fetched.get());
+    // The blocks fetched before got their hashes then, and need entering into the cache again.
+    for (uint32_t i = 0; i < verified; i++) {
+      if (!block_cache_contains(fd, block + i)) {
+        block_cache_enter(fd, block + i, fetched->data() + i * fd->block_size);
+      }
+    }
+    fd->hint_fetched += verified;
+    fd->spare_buffers.push_back(std::move(fetched));
+  }
+}
+
+// Serves a read request, using |buffer| of two blocks for the blocks that need to be copied.
+static int handle_read(const void* data, fuse_data* fd, const fuse_in_header* hdr,
+                       uint8_t* buffer) {
   if (hdr->nodeid != PACKAGE_FILE_ID) return -ENOENT;
 
   const fuse_read_in* req = static_cast<const fuse_read_in*>(data);
@@ -378,36 +804,23 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   vec[0].iov_len = sizeof(outhdr);
 
   uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
+  const uint8_t* block_data;
+  std::shared_ptr<std::vector<uint8_t>> holder;
+  int result = fetch_block(fd, block, buffer, &block_data, &holder);
   if (result != 0) return result;
 
-  // Two cases:
-  //
-  //   - the read request is entirely within this block. In this case we can reply immediately.
-  //
-  //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
-
+  // Since we mount the filesystem with max_read=block_size, a read can never span more than two
+  // blocks. If the request goes over into the next block, fetch it right after the first one.
   uint32_t block_offset = offset - (block * fd->block_size);
-
-  int vec_used;
-  if (size + block_offset <= fd->block_size) {
-    // First case: the read fits entirely in the first block.
-
-    vec[1].iov_base = fd->block_data + block_offset;
-    vec[1].iov_len = size;
-    vec_used = 2;
-  } else {
-    // Second case: the read spills over into the next block.
-
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
-
-    result = fetch_block(fd, block + 1);
+  vec[1].iov_base = const_cast<uint8_t*>(block_data) + block_offset;
+  vec[1].iov_len = std::min(size, fd->block_size - block_offset);
+  int vec_used = 2;
+  std::shared_ptr<std::vector<uint8_t>> next_holder;
+  if (size + block_offset > fd->block_size) {
+    const uint8_t* next_block_data;
+    result = fetch_block(fd, block + 1, buffer + fd->block_size, &next_block_data, &next_holder);
     if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
+    vec[2].iov_base = const_cast<uint8_t*>(next_block_data);
     vec[2].iov_len = size - vec[1].iov_len;
     vec_used = 3;
   }
@@ -418,6 +831,139 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   return NO_STATUS;
 }
 
+static void reply_error(const fuse_data* fd, uint64_t unique, int error) {
+  fuse_out_header outhdr;
+  outhdr.len = sizeof(outhdr);
+  outhdr.error = error;
+  outhdr.unique = unique;
+  TEMP_FAILURE_RETRY(write(fd->ffd, &outhdr, sizeof(outhdr)));
+}
+
+// Serves the requests from the kernel until the exit flag gets looked up, or the fuse connection
+// goes away. Reads are handed to FUSE_READ_THREADS threads, which reply to them in any order, so
+// that a slow fetch from the provider doesn't hold up the other reads. The other requests are
+// handled in place.
+static int serve_requests(fuse_data* fd) {
+  struct ReadRequest {
+    fuse_in_header hdr;
+    fuse_read_in req;
+  };
+  std::mutex queue_lock;
+  std::condition_variable queue_cv;
+  std::deque<ReadRequest> queue;
+  bool stopping = false;
+
+  std::vector<std::thread> readers;
+  for (int i = 0; i < FUSE_READ_THREADS; i++) {
+    readers.emplace_back([&]() {
+      std::vector<uint8_t> buffer(2 * fd->block_size);
+      while (true) {
+        ReadRequest request;
+        {
+          std::unique_lock<std::mutex> lock(queue_lock);
+          queue_cv.wait(lock, [&]() { return stopping || !queue.empty(); });
+          if (queue.empty()) {
+            return;
+          }
+          request = queue.front();
+          queue.pop_front();
+        }
+        int result = handle_read(&request.req, fd, &request.hdr, buffer.data());
+        if (result != NO_STATUS) {
+          reply_error(fd, request.hdr.unique, result);
+        }
+      }
+    });
+  }
+
+  int result;
+  uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
+  for (;;) {
+    ssize_t len = TEMP_FAILURE_RETRY(read(fd->ffd, request_buffer, sizeof(request_buffer)));
+    if (len == -1) {
+      perror("read request");
+      if (errno == ENODEV) {
+        result = -1;
+        break;
+      }
+      continue;
+    }
+
+    if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
+      fprintf(stderr, "request too short: len=%zd\n", len);
+      continue;
+    }
+
+    fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(request_buffer);
+    void* data = request_buffer + sizeof(fuse_in_header);
+
+    result = -ENOSYS;
+
+    switch (hdr->opcode) {
+      case FUSE_INIT:
+        result = handle_init(data, fd, hdr);
+        break;
+
+      case FUSE_LOOKUP:
+        result = handle_lookup(data, fd, hdr);
+        break;
+
+      case FUSE_GETATTR:
+        result = handle_getattr(data, fd, hdr);
+        break;
+
+      case FUSE_OPEN:
+        result = handle_open(data, fd, hdr);
+        break;
+
+      case FUSE_READ: {
+        ReadRequest request = { *hdr, {} };
+        memcpy(&request.req, data,
+               std::min(sizeof(request.req), static_cast<size_t>(len) - sizeof(fuse_in_header)));
+        {
+          std::lock_guard<std::mutex> lock(queue_lock);
+          queue.push_back(request);
+        }
+        queue_cv.notify_one();
+        result = NO_STATUS;
+        break;
+      }
+
+      case FUSE_FLUSH:
+        result = handle_flush(data, fd, hdr);
+        break;
+
+      case FUSE_RELEASE:
+        result = handle_release(data, fd, hdr);
+        break;
+
+      default:
+        fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
+        break;
+    }
+
+    if (result == NO_STATUS_EXIT) {
+      result = 0;
+      break;
+    }
+
+    if (result != NO_STATUS) {
+      reply_error(fd, hdr->unique, result);
+    }
+  }
+
+  // Let the threads finish the queued reads.
+  {
+    std::lock_guard<std::mutex> lock(queue_lock);
+    stopping = true;
+  }
+  queue_cv.notify_all();
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  return result;
+}
+
 int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char* mount_point) {
   // If something's already mounted on our mountpoint, try to remove it. (Mostly in case of a
   // previous abnormal exit.)
@@ -442,48 +988,56 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   fd.block_size = block_size;
   fd.file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
 
-  uint64_t mem = free_memory();
-  uint64_t avail = mem - (INSTALL_REQUIRED_MEMORY + fd.file_blocks * sizeof(uint8_t*));
+  // The block cache gets what the memory budget has left after the install.
+  uint64_t required = INSTALL_REQUIRED_MEMORY + fd.file_blocks * sizeof(uint8_t*);
+  uint64_t avail = MemoryBudget::Get().available();
+  avail = avail > required ? avail - required : 0;
 
   int result;
-  if (fd.file_blocks > (1 << 18)) {
+  if (fd.file_blocks > MAX_FILE_BLOCKS) {
     fprintf(stderr, "file has too many blocks (%u)\n", fd.file_blocks);
     result = -1;
     goto done;
   }
 
-  // All hashes will be zero-initialized.
-  fd.hashes.resize(fd.file_blocks);
+  // All hashes will read as zeros until they're stored.
+  fd.hashes.Resize(fd.file_blocks);
   fd.uid = getuid();
   fd.gid = getgid();
 
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
-    result = -1;
-    goto done;
-  }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
-    result = -1;
-    goto done;
-  }
+  fd.last_block = -1;
+  fd.readahead_max_blocks = std::max<uint32_t>(1, READAHEAD_SIZE / block_size);
+  fd.fetch_latency_us = -1;
+  fd.hint_read_pos = 0;
+  fd.hint_fetch_pos = 0;
+  fd.hint_fetched = 0;
+  fd.hint_stop = false;
+  StartLiveStats("fuse");
 
   fd.block_cache_max_size = 0;
   fd.block_cache_size = 0;
   fd.block_cache = nullptr;
-  if (mem > avail) {
-    uint32_t max_size = avail / fd.block_size;
-    if (max_size > fd.file_blocks) {
-      max_size = fd.file_blocks;
-    }
+  {
+    uint32_t max_size = std::min<uint64_t>(avail / fd.block_size, fd.file_blocks);
     // The cache must be at least 1% of the file size or two blocks,
     // whichever is larger.
-    if (max_size >= fd.file_blocks / 100 && max_size >= 2) {
-      fd.block_cache_max_size = max_size;
-      fd.block_cache = (uint8_t**)calloc(fd.file_blocks, sizeof(uint8_t*));
+    if (max_size >= fd.file_blocks / 100 && max_size >= 2 &&
+        (fd.block_cache_memory = MemoryBudget::Get().Reserve(
+             "fuse block cache", static_cast<uint64_t>(max_size) * block_size,
+             static_cast<uint64_t>(max_size) * block_size, MemoryBudget::Priority::kCache,
+             false)) != nullptr) {
+      // The pages of the slab only get committed as the blocks are filled in.
+      fd.block_cache = static_cast<uint8_t*>(malloc(static_cast<size_t>(max_size) * block_size));
+      if (fd.block_cache == nullptr) {
+        fprintf(stderr, "failed to allocate the block cache of %u blocks\n", max_size);
+      } else {
+        fd.block_cache_max_size = max_size;
+        fd.block_cache_blocks.resize(max_size);
+        fd.block_cache_referenced.resize(max_size);
+        fd.block_cache_hand = 0;
+        fd.block_cache_slots.reserve(max_size);
+        fd.hint_ahead_blocks = max_size / HINT_AHEAD_CACHE_SHARE;
+      }
     }
   }
 
@@ -507,74 +1061,32 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
     }
   }
 
-  uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
-  for (;;) {
-    ssize_t len = TEMP_FAILURE_RETRY(read(fd.ffd, request_buffer, sizeof(request_buffer)));
-    if (len == -1) {
-      perror("read request");
-      if (errno == ENODEV) {
-        result = -1;
-        break;
-      }
-      continue;
-    }
-
-    if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
-      fprintf(stderr, "request too short: len=%zd\n", len);
-      continue;
-    }
-
-    fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(request_buffer);
-    void* data = request_buffer + sizeof(fuse_in_header);
-
-    result = -ENOSYS;
-
-    switch (hdr->opcode) {
-      case FUSE_INIT:
-        result = handle_init(data, &fd, hdr);
-        break;
-
-      case FUSE_LOOKUP:
-        result = handle_lookup(data, &fd, hdr);
-        break;
-
-      case FUSE_GETATTR:
-        result = handle_getattr(data, &fd, hdr);
-        break;
-
-      case FUSE_OPEN:
-        result = handle_open(data, &fd, hdr);
-        break;
-
-      case FUSE_READ:
-        result = handle_read(data, &fd, hdr);
-        break;
-
-      case FUSE_FLUSH:
-        result = handle_flush(data, &fd, hdr);
-        break;
-
-      case FUSE_RELEASE:
-        result = handle_release(data, &fd, hdr);
-        break;
+  // The prefetched blocks are kept in the block cache, without which there are no hints to follow.
+  if (fd.hint_ahead_blocks > 0) {
+    fd.hint_thread = std::thread(prefetch_hinted_blocks, &fd);
+  }
 
-      default:
-        fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
-        break;
-    }
+  result = serve_requests(&fd);
 
-    if (result == NO_STATUS_EXIT) {
-      result = 0;
-      break;
-    }
+  {
+    std::lock_guard<std::mutex> lock(fd.lock);
+    fd.hint_stop = true;
+  }
+  fd.hint_progress.notify_all();
+  if (fd.hint_thread.joinable()) {
+    fd.hint_thread.join();
+  }
+  if (!fd.hint_blocks.empty()) {
+    fprintf(stderr, "prefetched %" PRIu64 " of the %zu hinted blocks; the reads followed %zu\n",
+            fd.hint_fetched, fd.hint_blocks.size(), fd.hint_read_pos);
+  }
 
-    if (result != NO_STATUS) {
-      fuse_out_header outhdr;
-      outhdr.len = sizeof(outhdr);
-      outhdr.error = result;
-      outhdr.unique = hdr->unique;
-      TEMP_FAILURE_RETRY(write(fd.ffd, &outhdr, sizeof(outhdr)));
-    }
+  if (fd.fetch_count > 0) {
+    fprintf(stderr,
+            "fetched %" PRIu64 " bytes in %" PRIu64 " reads over %" PRIu64
+            " ms; latency %" PRId64 " us, bandwidth %.1f MB/s, readahead %u blocks\n",
+            fd.fetch_bytes, fd.fetch_count, fd.fetch_us / 1000, fd.fetch_latency_us,
+            fd.fetch_bandwidth, fd.readahead_max_blocks);
   }
 
 done:
@@ -584,16 +1096,8 @@ done:
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  if (fd.block_cache) {
-    uint32_t n;
-    for (n = 0; n < fd.file_blocks; ++n) {
-      free(fd.block_cache[n]);
-    }
-    free(fd.block_cache);
-  }
+  free(fd.block_cache);
 
-  free(fd.block_data);
-  free(fd.extra_block);
 
   return result;
 }
@@ -19,11 +19,14 @@
 #include <stdint.h>
 
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 
 #include "otautil/rangeset.h"
+#include "otautil/sysutil.h"
 
 // This is the base class to read data from source and provide the data to FUSE.
 class FuseDataProvider {
@@ -46,6 +49,11 @@ class FuseDataProvider {
 
   virtual bool Valid() const = 0;
 
+  // Returns whether ReadBlockAlignedData() may be called from multiple threads at the same time.
+  virtual bool SupportsConcurrentReads() const {
+    return false;
+  }
+
   virtual void Close() {}
 
  protected:
@@ -72,6 +80,11 @@ class FuseFileDataProvider : public FuseDataProvider {
     return fd_ != -1;
   }
 
+  // The reads are all pread(2)'s.
+  bool SupportsConcurrentReads() const override {
+    return true;
+  }
+
   void Close() override;
 
  private:
@@ -87,7 +100,7 @@ class FuseBlockDataProvider : public FuseDataProvider {
                                                               uint32_t fuse_block_size);
 
   RangeSet ranges() const {
-    return ranges_;
+    return block_map_.block_ranges();
   }
 
   bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
@@ -97,15 +110,89 @@ class FuseBlockDataProvider : public FuseDataProvider {
     return fd_ != -1;
   }
 
+  // The reads are all pread(2)'s.
+  bool SupportsConcurrentReads() const override {
+    return true;
+  }
+
   void Close() override;
 
  private:
-  FuseBlockDataProvider(uint64_t file_size, uint32_t fuse_block_size, android::base::unique_fd&& fd,
-                        uint32_t source_block_size, RangeSet ranges);
+  FuseBlockDataProvider(uint32_t fuse_block_size, android::base::unique_fd&& fd,
+                        BlockMapData block_map);
   // The underlying block device to read data from.
   android::base::unique_fd fd_;
-  // The block size of the source block device.
-  uint32_t source_block_size_;
-  // The block ranges from the source block device that consist of the file
-  RangeSet ranges_;
+  // The block size and the block ranges from the source block device that consist of the file.
+  BlockMapData block_map_;
+};
+
+// This class reads the package over HTTP from a server that supports range requests, e.g.
+// "http://192.168.1.2:8000/ota.zip", for a network sideload. The ranges are fetched over a pool of
+// keep-alive connections, and a large fetch (i.e. a fuse readahead) is split into parts that are
+// fetched on parallel connections. The data is checked by the fuse and the package verifier as
+// for any other provider, so the server doesn't need to be trusted.
+class FuseHttpDataProvider : public FuseDataProvider {
+ public:
+  // The most connections that one fetch is split across, and that are kept open when idle.
+  static constexpr size_t kMaxConnections = 4;
+  // The smallest part that a fetch is split into.
+  static constexpr uint32_t kMinPartSize = 1024 * 1024;
+
+  // Connects to the server in |url| and gets the size of the package. Returns nullptr on errors.
+  static std::unique_ptr<FuseDataProvider> CreateFromUrl(const std::string& url,
+                                                         uint32_t block_size);
+
+  // Splits an "http://host[:port]/path" URL. The port defaults to 80, and the host may be an IPv6
+  // address in brackets. Returns false if |url| isn't one.
+  static bool ParseUrl(const std::string& url, std::string* host, std::string* port,
+                       std::string* path);
+
+  bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                            uint32_t start_block) const override;
+
+  bool Valid() const override {
+    return file_size_ > 0;
+  }
+
+  // Each read takes a connection of its own from the pool.
+  bool SupportsConcurrentReads() const override {
+    return true;
+  }
+
+  void Close() override;
+
+  // Returns the number of connections made so far.
+  size_t connections_made() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return connections_made_;
+  }
+
+ private:
+  struct Connection {
+    android::base::unique_fd fd;
+    std::string pending;  // Bytes received beyond the last response
+  };
+
+  FuseHttpDataProvider(std::string host, std::string port, std::string path, uint32_t block_size);
+
+  std::unique_ptr<Connection> Connect() const;
+
+  // Fetches |size| bytes at |offset| into |buffer| with a range request on |conn|. Sets
+  // |total_size| to the size of the whole package, and |keep_alive| to whether |conn| may be
+  // reused.
+  bool FetchRange(Connection* conn, uint8_t* buffer, uint64_t offset, uint64_t size,
+                  uint64_t* total_size, bool* keep_alive) const;
+
+  // Fetches |size| bytes at |offset| into |buffer| on a connection from the pool, retrying once on
+  // a new connection in case the server has closed an idle one.
+  bool ReadRange(uint8_t* buffer, uint64_t offset, uint64_t size) const;
+
+  std::string host_;
+  std::string port_;
+  std::string path_;
+
+  // Guards the idle connections and the stats.
+  mutable std::mutex lock_;
+  mutable std::vector<std::unique_ptr<Connection>> idle_;
+  mutable size_t connections_made_ = 0;
 };
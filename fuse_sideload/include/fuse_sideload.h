@@ -17,7 +17,11 @@
 #ifndef __FUSE_SIDELOAD_H
 #define __FUSE_SIDELOAD_H
 
+#include <stdint.h>
+
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "fuse_provider.h"
 
@@ -28,7 +32,20 @@ static constexpr const char* FUSE_SIDELOAD_HOST_PATHNAME = "/sideload/package.zi
 static constexpr const char* FUSE_SIDELOAD_HOST_EXIT_FLAG = "exit";
 static constexpr const char* FUSE_SIDELOAD_HOST_EXIT_PATHNAME = "/sideload/exit";
 
+// The entry of a package that hints at the order that the install reads the package in, for the
+// sideload fuse to prefetch the blocks ahead of the reads. It must be stored uncompressed, and
+// holds a line of "<offset> <length>" per byte range of the package, in the order they get read
+// (e.g. the metadata, the transfer lists, the patches in command order, the new data). Lines
+// starting with '#' are comments.
+static constexpr const char* FUSE_SIDELOAD_ACCESS_ORDER_ENTRY = "META-INF/com/android/access_order";
+
 int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider,
                       const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT);
 
+// Parses the access order hints in |content| (see FUSE_SIDELOAD_ACCESS_ORDER_ENTRY) of a package of
+// |file_size| bytes into the |blocks| of |block_size| bytes they cover, in order. Returns false on
+// malformed hints.
+bool parse_access_order_hints(const std::string& content, uint64_t file_size,
+                              uint32_t block_size, std::vector<uint32_t>* blocks);
+
 #endif
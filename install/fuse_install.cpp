@@ -25,8 +25,10 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -37,6 +39,7 @@
 #include "fuse_provider.h"
 #include "fuse_sideload.h"
 #include "install/install.h"
+#include "otautil/dir_lister.h"
 #include "recovery_utils/roots.h"
 
 using android::volmgr::VolumeInfo;
@@ -56,54 +59,66 @@ static void SetSdcardUpdateBootloaderMessage() {
   }
 }
 
-// Returns the selected filename, or an empty string.
-static std::string BrowseDirectory(const std::string& path, Device* device, RecoveryUI* ui) {
-  std::unique_ptr<DIR, decltype(&closedir)> d(opendir(path.c_str()), closedir);
-  if (!d) {
-    PLOG(ERROR) << "error opening " << path;
-    return "";
-  }
+// How long BrowseDirectory() waits for a listing to complete before showing the partial one, which
+// spares the menu from refreshing (and the selection from resetting) for all but large directories.
+static constexpr std::chrono::milliseconds kBrowseInitialWait{ 200 };
 
-  std::vector<std::string> dirs;
-  std::vector<std::string> entries{ "../" };  // "../" is always the first entry.
-
-  dirent* de;
-  while ((de = readdir(d.get())) != nullptr) {
-    std::string name(de->d_name);
-
-    if (de->d_type == DT_DIR) {
-      // Skip "." and ".." entries.
-      if (name == "." || name == "..") continue;
-      dirs.push_back(name + "/");
-    } else if (de->d_type == DT_REG && (android::base::EndsWithIgnoreCase(name, ".zip") ||
-                                        android::base::EndsWithIgnoreCase(name, ".map"))) {
-      entries.push_back(name);
-    }
-  }
-
-  std::sort(dirs.begin(), dirs.end());
-  std::sort(entries.begin(), entries.end());
+static DirectoryLister& GetDirectoryLister() {
+  static DirectoryLister lister({ ".zip", ".map" });
+  return lister;
+}
 
-  // Append dirs to the entries list.
-  entries.insert(entries.end(), dirs.begin(), dirs.end());
+// Returns the selected filename, or an empty string.
+static std::string BrowseDirectory(const std::string& path, Device* device, RecoveryUI* ui) {
+  DirectoryLister& lister = GetDirectoryLister();
+  // The entries arrive in batches on the lister thread, which asks the menu to refresh itself.
+  lister.List(path, [ui]() { ui->onVolumeChanged(); });
 
   std::vector<std::string> headers{ "Choose a package to install:", path };
 
   size_t chosen_item = 0;
+  std::vector<std::string> entries;
+  bool complete = false;
+  auto load_entries = [&](std::chrono::milliseconds wait) {
+    DirectoryLister::Snapshot snapshot = lister.Get(wait);
+    // "../" is always the first entry, and the dirs come after the files.
+    entries = { "../" };
+    entries.insert(entries.end(), snapshot.files.begin(), snapshot.files.end());
+    entries.insert(entries.end(), snapshot.dirs.begin(), snapshot.dirs.end());
+    complete = snapshot.complete;
+    return !snapshot.error;
+  };
+  if (!load_entries(kBrowseInitialWait)) {
+    return "";
+  }
+
   while (true) {
+    headers[0] = complete ? "Choose a package to install:"
+                          : "Choose a package to install (loading...):";
     chosen_item = ui->ShowMenu(
         headers, entries, chosen_item, true,
-        std::bind(&Device::HandleMenuKey, device, std::placeholders::_1, std::placeholders::_2));
+        std::bind(&Device::HandleMenuKey, device, std::placeholders::_1, std::placeholders::_2),
+        true /* refreshable */);
+
+    if (chosen_item == Device::kRefresh) {
+      // More entries have arrived (or a volume changed); show the ones found so far.
+      chosen_item = 0;
+      load_entries(std::chrono::milliseconds(0));
+      continue;
+    }
 
     // Return if WaitKey() was interrupted.
     if (chosen_item == static_cast<size_t>(RecoveryUI::KeyError::INTERRUPTED)) {
+      lister.Cancel();
       return "";
     }
     if (chosen_item == Device::kGoHome) {
+      lister.Cancel();
       return "@";
     }
     if (chosen_item == Device::kGoBack || chosen_item == 0) {
       // Go up but continue browsing (if the caller is browse_directory).
+      lister.Cancel();
       return "";
     }
 
@@ -115,8 +130,15 @@ static std::string BrowseDirectory(const std::string& path, Device* device, Reco
       new_path.pop_back();
       std::string result = BrowseDirectory(new_path, device, ui);
       if (!result.empty()) return result;
+      // Back in this directory, which is listed again; from the cache unless it has changed.
+      lister.List(path, [ui]() { ui->onVolumeChanged(); });
+      if (!load_entries(kBrowseInitialWait)) {
+        return "";
+      }
+      chosen_item = std::min(chosen_item, entries.size() - 1);
     } else {
       // Selected a zip file: return the path to the caller.
+      lister.Cancel();
       return new_path;
     }
   }
@@ -130,10 +152,15 @@ static bool StartInstallPackageFuse(std::string_view path) {
   }
 
   constexpr auto FUSE_BLOCK_SIZE = 65536;
-  bool is_block_map = android::base::ConsumePrefix(&path, "@");
-  auto fuse_data_provider =
-      is_block_map ? FuseBlockDataProvider::CreateFromBlockMap(std::string(path), FUSE_BLOCK_SIZE)
-                   : FuseFileDataProvider::CreateFromFile(std::string(path), FUSE_BLOCK_SIZE);
+  std::unique_ptr<FuseDataProvider> fuse_data_provider;
+  if (android::base::StartsWith(path, "http://")) {
+    fuse_data_provider = FuseHttpDataProvider::CreateFromUrl(std::string(path), FUSE_BLOCK_SIZE);
+  } else if (android::base::ConsumePrefix(&path, "@")) {
+    fuse_data_provider =
+        FuseBlockDataProvider::CreateFromBlockMap(std::string(path), FUSE_BLOCK_SIZE);
+  } else {
+    fuse_data_provider = FuseFileDataProvider::CreateFromFile(std::string(path), FUSE_BLOCK_SIZE);
+  }
 
   if (!fuse_data_provider || !fuse_data_provider->Valid()) {
     LOG(ERROR) << "Failed to create fuse data provider.";
@@ -202,6 +229,42 @@ InstallResult InstallWithFuseFromPath(std::string_view path, Device* device) {
   return result;
 }
 
+// Installs the package zip at |path| by reading the file directly, which saves the FUSE round trips
+// and the per-block hash checks. Going through FUSE guarantees that the updater reads the same
+// bytes that verify_file() checked; here that comes from remounting the volume at |mount_point|
+// read-only before the package is opened, so nothing can write to it between the verification and
+// the install. Returns std::nullopt without installing anything if the volume can't be remounted
+// (e.g. some file on it is still open for writing) or the package isn't a regular file, in which
+// case the caller should install with FUSE instead.
+static std::optional<InstallResult> InstallDirectlyFromPath(const std::string& path,
+                                                            const std::string& mount_point,
+                                                            Device* device) {
+  if (mount(nullptr, mount_point.c_str(), nullptr, MS_REMOUNT | MS_RDONLY, nullptr) == -1) {
+    PLOG(INFO) << "Failed to remount " << mount_point << " read-only";
+    return std::nullopt;
+  }
+
+  std::optional<InstallResult> result;
+  struct stat sb;
+  if (stat(path.c_str(), &sb) == -1 || !S_ISREG(sb.st_mode)) {
+    LOG(WARNING) << path << " is not a regular file";
+  } else {
+    LOG(INFO) << "Installing package " << path << " directly";
+    auto ui = device->GetUI();
+    result = INSTALL_ERROR;
+    if (auto package = Package::CreateFilePackage(
+            path, std::bind(&RecoveryUI::SetProgress, ui, std::placeholders::_1));
+        package != nullptr) {
+      result = InstallPackage(package.get(), path, false, 0 /* retry_count */, device);
+    }
+  }
+
+  if (mount(nullptr, mount_point.c_str(), nullptr, MS_REMOUNT, nullptr) == -1) {
+    PLOG(WARNING) << "Failed to remount " << mount_point << " read-write";
+  }
+  return result;
+}
+
 InstallResult ApplyFromStorage(Device* device, VolumeInfo& vi) {
   auto ui = device->GetUI();
   if (!VolumeManager::Instance()->volumeMount(vi.mId)) {
@@ -215,15 +278,24 @@ InstallResult ApplyFromStorage(Device* device, VolumeInfo& vi) {
   }
 
   // Hint the install function to read from a block map file.
-  if (android::base::EndsWithIgnoreCase(path, ".map")) {
+  bool is_block_map = android::base::EndsWithIgnoreCase(path, ".map");
+  if (is_block_map) {
     path = "@" + path;
   }
 
   ui->Print("\n-- Install %s ...\n", path.c_str());
   SetSdcardUpdateBootloaderMessage();
 
-  auto result = InstallWithFuseFromPath(path, device);
+  // A package zip on the storage can be read as is. Block maps still need FUSE to assemble the
+  // package from the listed blocks.
+  std::optional<InstallResult> result;
+  if (!is_block_map) {
+    result = InstallDirectlyFromPath(path, vi.mPath, device);
+  }
+  if (!result) {
+    result = InstallWithFuseFromPath(path, device);
+  }
 
   VolumeManager::Instance()->volumeUnmount(vi.mId);
-  return result;
+  return *result;
 }
@@ -27,8 +27,9 @@
 using android::volmgr::VolumeInfo;
 
 // Starts FUSE with the package from |path| as the data source. And installs the package from
-// |FUSE_SIDELOAD_HOST_PATHNAME|. The |path| can point to the location of a package zip file or a
-// block map file with the prefix '@'; e.g. /sdcard/package.zip, @/cache/recovery/block.map.
+// |FUSE_SIDELOAD_HOST_PATHNAME|. The |path| can point to the location of a package zip file, a
+// block map file with the prefix '@', or a package on an HTTP server that supports range requests;
+// e.g. /sdcard/package.zip, @/cache/recovery/block.map, http://192.168.1.2:8000/package.zip.
 InstallResult InstallWithFuseFromPath(std::string_view path, Device* device);
 
 InstallResult ApplyFromStorage(Device* device, VolumeInfo& vi);
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <optional>
+#include <string>
+
+#include <ota_metadata.pb.h>
+#include <ziparchive/zip_archive.h>
+
+#include "otautil/package.h"
+
+// The parsed metadata of an OTA package: the "key=value" lines of META-INF/com/android/metadata,
+// and the OtaMetadata protobuf of META-INF/com/android/metadata.pb. Each entry is read and parsed
+// once per package (see Get()), however many of the install steps look at them.
+class PackageMetadata {
+ public:
+  // Reads the metadata of |zip|.
+  explicit PackageMetadata(ZipArchiveHandle zip);
+
+  // Returns the metadata of |package|, which gets read on the first call for the package and is
+  // kept with it. Returns nullptr if the package can't be opened as a zip file.
+  static const PackageMetadata* Get(Package* package);
+
+  // Whether the package has the "key=value" metadata.
+  bool has_values() const {
+    return has_values_;
+  }
+
+  const std::map<std::string, std::string>& values() const {
+    return values_;
+  }
+
+  // Returns the value for |key|, or an empty string if it isn't present.
+  std::string GetValue(const std::string& key) const;
+
+  // The ota-type value.
+  std::string ota_type() const {
+    return GetValue("ota-type");
+  }
+
+  // Returns the OtaMetadata protobuf, or nullptr if it's missing or invalid.
+  const build::tools::releasetools::OtaMetadata* ota_metadata() const {
+    return ota_metadata_ ? &*ota_metadata_ : nullptr;
+  }
+
+ private:
+  bool has_values_{ false };
+  std::map<std::string, std::string> values_;
+  std::optional<build::tools::releasetools::OtaMetadata> ota_metadata_;
+};
@@ -17,9 +17,22 @@
 #pragma once
 
 #include "recovery_ui/device.h"
+#include "recovery_ui/ui.h"
 
+// Finishes the pending snapshot merge of a Virtual A/B update, if any, before the data wipe that
+// would lose it. Waits for the background merge first, if one is running.
 bool FinishPendingSnapshotMerges(Device* device);
 
+// Starts finishing a snapshot merge that's already under way (e.g. interrupted by the reboot into
+// recovery) on a background thread, so that the menus stay usable meanwhile. The merge has to
+// finish before a wipe anyway. Nothing happens unless the update state is "Merging".
+void StartPendingSnapshotMerge();
+
+// Waits for the merge of StartPendingSnapshotMerge() to finish, if it's running, printing its
+// progress on |ui|. This gates the steps that conflict with the merge, e.g. an install, which
+// unmounts /metadata.
+void WaitForSnapshotMerge(RecoveryUI* ui);
+
 /*
  * This function tries to create the snapshotted devices in the case a Virtual
  * A/B device is updating.
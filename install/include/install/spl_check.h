@@ -24,3 +24,7 @@ bool ViolatesSPLDowngrade(const build::tools::releasetools::OtaMetadata& metadat
                           std::string_view current_spl);
 
 bool ViolatesSPLDowngrade(ZipArchiveHandle zip, std::string_view current_spl);
+
+// Reads and parses the OtaMetadata protobuf (META-INF/com/android/metadata.pb) of |zip|. Returns
+// false if it's missing or invalid.
+bool ReadOtaMetadata(ZipArchiveHandle zip, build::tools::releasetools::OtaMetadata* metadata);
@@ -22,6 +22,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -34,7 +35,9 @@
 #include <functional>
 #include <limits>
 #include <mutex>
+#include <optional>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -47,13 +50,16 @@
 #include <android-base/unique_fd.h>
 
 #include "bootloader_message/bootloader_message.h"
+#include "install/package_metadata.h"
 #include "install/snapshot_utils.h"
 #include "install/spl_check.h"
 #include "install/wipe_data.h"
 #include "install/wipe_device.h"
 #include "otautil/error_code.h"
+#include "otautil/memory_budget.h"
 #include "otautil/package.h"
 #include "otautil/paths.h"
+#include "otautil/phase_stats.h"
 #include "otautil/sysutil.h"
 #include "otautil/verifier.h"
 #include "private/setup_commands.h"
@@ -81,6 +87,14 @@ static constexpr float VERIFICATION_PROGRESS_FRACTION = 0.25;
 static constexpr auto&& RELEASE_KEYS_TAG = "release-keys";
 // If brick packages are smaller than |MEMORY_PACKAGE_LIMIT|, read the entire package into memory
 static constexpr size_t MEMORY_PACKAGE_LIMIT = 1024 * 1024;
+// A larger package is read into memory only if that leaves this much memory free, mostly for the
+// update binary (e.g. its stashes and decompression buffers).
+static constexpr uint64_t PROMOTION_RESERVED_MEMORY = 256 * 1024 * 1024;
+// A package is copied into memory in pieces of this size. If the first piece comes in at least as
+// fast as |PROMOTION_FAST_STORAGE|, the storage is deemed fast enough for the update binary to read
+// the package directly, and the copy is abandoned.
+static constexpr uint64_t PROMOTION_PIECE_SIZE = 8 * 1024 * 1024;
+static constexpr uint64_t PROMOTION_FAST_STORAGE = 512 * 1024 * 1024;  // bytes per second
 
 static std::condition_variable finish_log_temperature;
 static bool isInStringList(const std::string& target_token, const std::string& str_list,
@@ -385,24 +399,146 @@ static bool PerformPowerwashIfRequired(ZipArchiveHandle zip, Device *device) {
   return true;
 }
 
+// Reserves the memory for a copy of |package| from the memory budget, if that leaves
+// |PROMOTION_RESERVED_MEMORY| to spare. Returns nullptr if the package doesn't fit.
+static std::unique_ptr<MemoryBudget::Reservation> ReservePackageMemory(Package* package) {
+  uint64_t available = MemoryBudget::Get().available();
+  uint64_t size = package->GetPackageSize();
+  if (available < PROMOTION_RESERVED_MEMORY || size > available - PROMOTION_RESERVED_MEMORY) {
+    LOG(INFO) << "Not reading the " << size << "-byte package into memory; " << available
+              << " bytes available";
+    return nullptr;
+  }
+  return MemoryBudget::Get().Reserve("package copy", size, size,
+                                     MemoryBudget::Priority::kRequired, false);
+}
+
+// Copies a package into a sealed memfd, which the update binary inherits and maps through
+// /proc/self/fd like a regular package file. The copy stops early, returning -1, once |cancelled|
+// gets set, or if |measure_storage| is set and the package storage turns out to be fast. Returns -1
+// on errors.
+static android::base::unique_fd CreatePackageMemfd(Package* package,
+                                                   const std::atomic<bool>* cancelled = nullptr,
+                                                   bool measure_storage = false) {
+  // Not O_CLOEXEC, so that it survives the execv of the update binary.
+  android::base::unique_fd fd(memfd_create("update_package", MFD_ALLOW_SEALING));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to create the package memfd";
+    return {};
+  }
+  uint64_t size = package->GetPackageSize();
+  if (ftruncate64(fd.get(), size) == -1) {
+    PLOG(ERROR) << "Failed to size the package memfd to " << size;
+    return {};
+  }
+  void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+  if (addr == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map the package memfd";
+    return {};
+  }
+  bool read = true;
+  for (uint64_t offset = 0; read && offset < size; offset += PROMOTION_PIECE_SIZE) {
+    if (cancelled != nullptr && *cancelled) {
+      munmap(addr, size);
+      return {};
+    }
+    uint64_t piece = std::min(PROMOTION_PIECE_SIZE, size - offset);
+    auto start = std::chrono::steady_clock::now();
+    read = package->ReadFullyAtOffset(static_cast<uint8_t*>(addr) + offset, piece, offset);
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    if (read && measure_storage && offset == 0 && piece < size &&
+        piece >= PROMOTION_FAST_STORAGE * duration.count()) {
+      LOG(INFO) << "Not copying the package into memory; read " << piece << " bytes in "
+                << duration.count() << " s";
+      munmap(addr, size);
+      return {};
+    }
+  }
+  munmap(addr, size);
+  if (!read) {
+    LOG(ERROR) << "Failed to copy the package into the memfd";
+    return {};
+  }
+  if (fcntl(fd.get(), F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) ==
+      -1) {
+    PLOG(ERROR) << "Failed to seal the package memfd";
+    return {};
+  }
+  return fd;
+}
+
+// Copies a FilePackage on slow storage (an SD card or a USB drive, an adb sideload through FUSE)
+// into a memfd on a background thread, while recovery checks the package and sets up the update
+// binary. The update binary then reads the package at memory speed, instead of faulting it in
+// page by page from the storage.
+class PackagePromotion {
+ public:
+  explicit PackagePromotion(Package* package) {
+    if (package->GetType() != PackageType::kFile || package->GetPath().empty() ||
+        (memory_ = ReservePackageMemory(package)) == nullptr) {
+      return;
+    }
+    thread_ = std::thread([this, package]() {
+      ScopedPhase phase("package_promotion");
+      memfd_ = CreatePackageMemfd(package, &cancelled_, true);
+    });
+  }
+
+  ~PackagePromotion() {
+    cancelled_ = true;
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  // Waits for the copy to finish. Returns the memfd with the package, or -1 if the package hasn't
+  // been copied. The memory stays reserved for the copy until the promotion is destroyed.
+  android::base::unique_fd Finish() {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    if (memfd_ == -1) {
+      memory_.reset();
+    }
+    return std::move(memfd_);
+  }
+
+ private:
+  std::atomic<bool> cancelled_{ false };
+  std::unique_ptr<MemoryBudget::Reservation> memory_;
+  android::base::unique_fd memfd_;
+  std::thread thread_;
+};
+
 // If the package contains an update binary, extract it and run it.
 static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
                                      std::vector<std::string>* log_buffer, int retry_count,
                                      int* max_temperature, Device* device) {
   auto ui = device->GetUI();
-  std::map<std::string, std::string> metadata;
   auto zip = package->GetZipArchiveHandle();
-  bool has_metadata = ReadMetadataFromPackage(zip, &metadata);
+  // The metadata is read once for the package, and shared with the other steps of the install
+  // (e.g. the wipe package checks).
+  std::optional<ScopedPhase> metadata_phase(std::in_place, "metadata");
+  const PackageMetadata* package_metadata = PackageMetadata::Get(package);
+  metadata_phase.reset();
+  if (package_metadata == nullptr) {
+    return INSTALL_CORRUPT;
+  }
+  const auto& metadata = package_metadata->values();
 
-  const bool package_is_ab = has_metadata && get_value(metadata, "ota-type") == OtaTypeToString(OtaType::AB);
-  const bool package_is_brick = get_value(metadata, "ota-type") == OtaTypeToString(OtaType::BRICK);
+  const bool package_is_ab = package_metadata->has_values() &&
+                             package_metadata->ota_type() == OtaTypeToString(OtaType::AB);
+  const bool package_is_brick = package_metadata->ota_type() == OtaTypeToString(OtaType::BRICK);
   if (package_is_brick) {
     LOG(INFO) << "Installing a brick package";
+    std::unique_ptr<MemoryBudget::Reservation> memory;
     if (package->GetType() == PackageType::kFile &&
-        package->GetPackageSize() < MEMORY_PACKAGE_LIMIT) {
+        (package->GetPackageSize() < MEMORY_PACKAGE_LIMIT ||
+         (memory = ReservePackageMemory(package)) != nullptr)) {
       std::vector<uint8_t> content(package->GetPackageSize());
       if (package->ReadFullyAtOffset(content.data(), content.size(), 0)) {
         auto memory_package = Package::CreateMemoryPackage(std::move(content), {});
+        memory_package->SetMetadata(package->GetMetadata());
         return WipeAbDevice(device, memory_package.get()) ? INSTALL_SUCCESS : INSTALL_ERROR;
       }
     }
@@ -414,7 +550,10 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
   bool device_supports_virtual_ab = android::base::GetBoolProperty("ro.virtual_ab.enabled", false);
 
   const auto current_spl = android::base::GetProperty("ro.build.version.security_patch", "");
-  if (ViolatesSPLDowngrade(zip, current_spl)) {
+  if (const auto* ota_metadata = package_metadata->ota_metadata(); ota_metadata == nullptr) {
+    LOG(WARNING) << "Treating this as non-spl-downgrade, permit OTA install. If device bricks "
+                    "after installing, check kernel log to see if /data failed to decrypt";
+  } else if (ViolatesSPLDowngrade(*ota_metadata, current_spl)) {
     LOG(WARNING) << "This is SPL downgrade";
   }
 
@@ -437,11 +576,19 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
     CHECK(package->GetType() == PackageType::kFile);
   }
 
+  // The update binary of a non-A/B package reads the package in place. (update_engine reads an A/B
+  // payload once, sequentially, which gains nothing from the copy.)
+  std::optional<PackagePromotion> promotion;
+  if (!package_is_ab) {
+    promotion.emplace(package);
+  }
+
   // Verify against the metadata in the package first. Expects A/B metadata if:
   // Package declares itself as an A/B package
   // Package does not declare itself as an A/B package, but device only supports A/B;
   //   still calls CheckPackageMetadata to get a meaningful error message.
   if (package_is_ab || device_only_supports_ab) {
+    ScopedPhase phase("metadata");
     if (!CheckPackageMetadata(metadata, OtaType::AB, ui)) {
       log_buffer->push_back(android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
       return INSTALL_ERROR;
@@ -459,6 +606,9 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
 
   ReadSourceTargetBuild(metadata, log_buffer);
 
+  // The updater reports the phases within, while this covers the whole run of it.
+  std::optional<ScopedPhase> update_phase(std::in_place, "update_binary");
+
   // The updater in child process writes to the pipe to communicate with recovery.
   android::base::unique_fd pipe_read, pipe_write;
   // Explicitly disable O_CLOEXEC using 0 as the flags (last) parameter to Pipe
@@ -501,6 +651,22 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
   //
 
   std::string package_path = package->GetPath();
+  // A package built from its content has no path for the update binary to map.
+  android::base::unique_fd package_memfd;
+  if (!package_is_ab && package_path.empty()) {
+    package_memfd = CreatePackageMemfd(package);
+    if (package_memfd == -1) {
+      log_buffer->push_back(android::base::StringPrintf("error: %d", kUpdateBinaryCommandFailure));
+      return INSTALL_ERROR;
+    }
+    package_path = "/proc/self/fd/" + std::to_string(package_memfd.get());
+  } else if (promotion) {
+    package_memfd = promotion->Finish();
+    if (package_memfd != -1) {
+      LOG(INFO) << "Running the update binary on the copy of " << package_path << " in memory";
+      package_path = "/proc/self/fd/" + std::to_string(package_memfd.get());
+    }
+  }
 
   std::vector<std::string> args;
   if (auto setup_result =
@@ -512,6 +678,9 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
     return INSTALL_CORRUPT;
   }
 
+  // The update binary starts its memory budget from what recovery hasn't reserved (e.g. for the
+  // copy of the package).
+  MemoryBudget::Get().Export();
   pid_t pid = fork();
   if (pid == -1) {
     PLOG(ERROR) << "Failed to fork update binary";
@@ -533,6 +702,7 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
     _exit(EXIT_FAILURE);
   }
   pipe_write.reset();
+  package_memfd.reset();
 
   std::atomic<bool> logger_finished(false);
   std::thread temperature_logger(log_max_temperature, max_temperature, std::ref(logger_finished));
@@ -598,6 +768,7 @@ static InstallResult TryUpdateBinary(Package* package, bool* wipe_cache,
 
   int status;
   waitpid(pid, &status, 0);
+  update_phase.reset();
 
   logger_finished.store(true);
   finish_log_temperature.notify_one();
@@ -666,6 +837,19 @@ InstallResult InstallPackage(Package* package, const std::string_view package_id
 
   ui->Print("Finding update package...\n");
   LOG(INFO) << "Update package id: " << package_id;
+  // The install remounts the volumes under the merge, e.g. /metadata. The metadata of the package
+  // gets read meanwhile, since the wait can take minutes; TryUpdateBinary() then finds it read.
+  std::thread metadata_reader;
+  if (package) {
+    metadata_reader = std::thread([package]() {
+      ScopedPhase phase("metadata");
+      PackageMetadata::Get(package);
+    });
+  }
+  WaitForSnapshotMerge(ui);
+  if (metadata_reader.joinable()) {
+    metadata_reader.join();
+  }
   if (!package) {
     log_buffer.push_back(android::base::StringPrintf("error: %d", kMapFileFailure));
     result = INSTALL_CORRUPT;
@@ -720,6 +904,8 @@ InstallResult InstallPackage(Package* package, const std::string_view package_id
   if (max_temperature > 0) {
     log_buffer.push_back("temperature_max: " + std::to_string(max_temperature));
   }
+  auto phase_lines = FormatPhaseStats();
+  log_buffer.insert(log_buffer.end(), phase_lines.begin(), phase_lines.end());
 
   std::string log_content =
       android::base::Join(log_header, "\n") + "\n" + android::base::Join(log_buffer, "\n") + "\n";
@@ -732,16 +918,36 @@ InstallResult InstallPackage(Package* package, const std::string_view package_id
   LOG(INFO) << log_content;
 
   if (result == INSTALL_SUCCESS && should_wipe_cache) {
-    if (!WipeCache(ui, nullptr)) {
+    bool wiped;
+    {
+      ScopedPhase phase("wipe_cache");
+      wiped = WipeCache(ui, nullptr);
+    }
+    // last_install has been written by now; add the wipe to it.
+    std::string wipe_lines;
+    for (const auto& line : FormatPhaseStats()) {
+      if (android::base::StartsWith(line, "phase_wipe_cache_")) {
+        wipe_lines += line + "\n";
+      }
+    }
+    std::string install_content;
+    if (!android::base::ReadFileToString(install_file, &install_content) ||
+        !android::base::WriteStringToFile(install_content + wipe_lines, install_file)) {
+      PLOG(ERROR) << "failed to update " << install_file;
+    }
+    if (!wiped) {
       result = INSTALL_ERROR;
     }
   }
+  // The phases of the next install start from scratch.
+  ClearPhaseStats();
 
   return result;
 }
 
 bool verify_package(Package* package, RecoveryUI* ui) {
   static constexpr const char* CERTIFICATE_ZIP_FILE = "/system/etc/security/otacerts.zip";
+  ScopedPhase phase("verify");
   std::vector<Certificate> loaded_keys = LoadKeysFromZipfile(CERTIFICATE_ZIP_FILE);
   if (loaded_keys.empty()) {
     LOG(ERROR) << "Failed to load keys";
@@ -771,6 +977,11 @@ bool SetupPackageMount(const std::string& package_path, bool* should_use_fuse) {
   }
 
   *should_use_fuse = true;
+  // A network sideload; the fuse fetches the package from the server.
+  if (android::base::StartsWith(package_path, "http://")) {
+    return true;
+  }
+
   if (package_path[0] == '@') {
     auto block_map_path = package_path.substr(1);
     if (ensure_path_mounted(block_map_path) != 0) {
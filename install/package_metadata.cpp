@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install/package_metadata.h"
+
+#include <memory>
+
+#include <android-base/logging.h>
+
+#include "install/install.h"
+#include "install/spl_check.h"
+
+PackageMetadata::PackageMetadata(ZipArchiveHandle zip) {
+  has_values_ = ReadMetadataFromPackage(zip, &values_);
+  build::tools::releasetools::OtaMetadata ota_metadata;
+  if (ReadOtaMetadata(zip, &ota_metadata)) {
+    ota_metadata_ = std::move(ota_metadata);
+  }
+}
+
+const PackageMetadata* PackageMetadata::Get(Package* package) {
+  if (!package->GetMetadata()) {
+    ZipArchiveHandle zip = package->GetZipArchiveHandle();
+    if (!zip) {
+      LOG(ERROR) << "Failed to get ZipArchiveHandle";
+      return nullptr;
+    }
+    package->SetMetadata(std::make_shared<PackageMetadata>(zip));
+  }
+  return package->GetMetadata().get();
+}
+
+std::string PackageMetadata::GetValue(const std::string& key) const {
+  auto it = values_.find(key);
+  return (it == values_.end()) ? "" : it->second;
+}
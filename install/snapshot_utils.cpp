@@ -15,6 +15,12 @@
  * limitations under the License.
  */
 
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <libsnapshot/snapshot.h>
@@ -25,6 +31,69 @@
 
 using android::snapshot::CreateResult;
 using android::snapshot::SnapshotManager;
+using android::snapshot::UpdateState;
+
+// The state of the merge of StartPendingSnapshotMerge().
+static std::mutex merge_lock;
+static std::condition_variable merge_cv;
+static bool merge_running = false;  // Guarded by merge_lock.
+static double merge_progress = 0;   // In percent. Guarded by merge_lock.
+
+void StartPendingSnapshotMerge() {
+  if (!android::base::GetBoolProperty("ro.virtual_ab.enabled", false)) {
+    return;
+  }
+  std::shared_ptr<SnapshotManager> sm = SnapshotManager::New();
+  if (!sm) {
+    LOG(WARNING) << "Could not create SnapshotManager";
+    return;
+  }
+  double progress = 0;
+  if (sm->GetUpdateState(&progress) != UpdateState::Merging) {
+    return;
+  }
+
+  LOG(INFO) << "Finishing the snapshot merge in the background, " << progress << "% done";
+  {
+    std::lock_guard<std::mutex> lock(merge_lock);
+    if (merge_running) {
+      return;
+    }
+    merge_running = true;
+    merge_progress = progress;
+  }
+  // Detached, as recovery may reboot in the middle of it; the merge resumes on the next boot.
+  std::thread([sm]() {
+    auto callback = [&sm]() {
+      double progress = 0;
+      sm->GetUpdateState(&progress);
+      std::lock_guard<std::mutex> lock(merge_lock);
+      merge_progress = progress;
+      merge_cv.notify_all();
+    };
+    if (!sm->HandleImminentDataWipe(callback)) {
+      LOG(ERROR) << "Failed to finish the snapshot merge in the background";
+    } else {
+      LOG(INFO) << "Finished the snapshot merge in the background";
+    }
+    std::lock_guard<std::mutex> lock(merge_lock);
+    merge_running = false;
+    merge_cv.notify_all();
+  }).detach();
+}
+
+void WaitForSnapshotMerge(RecoveryUI* ui) {
+  std::unique_lock<std::mutex> lock(merge_lock);
+  int printed = -1;
+  while (merge_running) {
+    // Prints each whole percent once.
+    if (static_cast<int>(merge_progress) != printed) {
+      printed = static_cast<int>(merge_progress);
+      ui->Print("Waiting for merge to complete: %.2f\n", merge_progress);
+    }
+    merge_cv.wait_for(lock, std::chrono::seconds(1));
+  }
+}
 
 bool FinishPendingSnapshotMerges(Device* device) {
   if (!android::base::GetBoolProperty("ro.virtual_ab.enabled", false)) {
@@ -32,6 +101,8 @@ bool FinishPendingSnapshotMerges(Device* device) {
   }
 
   RecoveryUI* ui = device->GetUI();
+  // Whatever the background merge left for this one, e.g. after a failure, is retried here.
+  WaitForSnapshotMerge(ui);
   auto sm = SnapshotManager::New();
   if (!sm) {
     ui->Print("Could not create SnapshotManager.\n");
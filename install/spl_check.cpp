@@ -46,13 +46,11 @@ bool ViolatesSPLDowngrade(const build::tools::releasetools::OtaMetadata& metadat
   return false;
 }
 
-bool ViolatesSPLDowngrade(ZipArchiveHandle zip, std::string_view current_spl) {
+bool ReadOtaMetadata(ZipArchiveHandle zip, build::tools::releasetools::OtaMetadata* metadata) {
   static constexpr auto&& OTA_OTA_METADATA = "META-INF/com/android/metadata.pb";
   ZipEntry64 metadata_entry;
   if (FindEntry(zip, OTA_OTA_METADATA, &metadata_entry) != 0) {
-    LOG(WARNING) << "Failed to find " << OTA_OTA_METADATA
-                 << " treating this as non-spl-downgrade, permit OTA install. If device bricks "
-                    "after installing, check kernel log to see if /data failed to decrypt";
+    LOG(WARNING) << "Failed to find " << OTA_OTA_METADATA;
     return false;
   }
   const auto metadata_entry_length = metadata_entry.uncompressed_length;
@@ -68,11 +66,19 @@ bool ViolatesSPLDowngrade(ZipArchiveHandle zip, std::string_view current_spl) {
     LOG(ERROR) << "Failed to extract " << OTA_OTA_METADATA << ": " << ErrorCodeString(err);
     return false;
   }
-  using build::tools::releasetools::OtaMetadata;
-  OtaMetadata metadata;
-  if (!metadata.ParseFromArray(ota_metadata.data(), ota_metadata.size())) {
+  if (!metadata->ParseFromArray(ota_metadata.data(), ota_metadata.size())) {
     LOG(ERROR) << "Failed to parse ota_medata";
     return false;
   }
+  return true;
+}
+
+bool ViolatesSPLDowngrade(ZipArchiveHandle zip, std::string_view current_spl) {
+  build::tools::releasetools::OtaMetadata metadata;
+  if (!ReadOtaMetadata(zip, &metadata)) {
+    LOG(WARNING) << "Treating this as non-spl-downgrade, permit OTA install. If device bricks "
+                    "after installing, check kernel log to see if /data failed to decrypt";
+    return false;
+  }
   return ViolatesSPLDowngrade(metadata, current_spl);
 }
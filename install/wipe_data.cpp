@@ -20,8 +20,11 @@
 #include <linux/fs.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
 
+#include <chrono>
 #include <functional>
+#include <future>
 #include <vector>
 
 #include <android-base/file.h>
@@ -58,13 +61,14 @@ static bool EraseVolume(const char* volume, RecoveryUI* ui) {
     android::dm::DeviceMapper& dm = android::dm::DeviceMapper::Instance();
 
     map_logical_partitions();
-    // map_logical_partitions is non-blocking, so check for some limited time
-    // if it succeeded
-    for (int i = 0; i < 500; i++) {
-      if (vol->blk_device[0] == '/' ||
-          dm.GetState(vol->blk_device) == android::dm::DmDeviceState::ACTIVE)
-        break;
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    // map_logical_partitions is non-blocking, so wait for some limited time for the device to
+    // become active, and for its node to show up in /dev/block.
+    if (vol->blk_device[0] != '/') {
+      WaitForCondition("/dev/block", std::chrono::milliseconds(500), [&dm, vol]() {
+        std::string path;
+        return dm.GetState(vol->blk_device) == android::dm::DmDeviceState::ACTIVE &&
+               dm.GetDmDevicePathByName(vol->blk_device, &path) && access(path.c_str(), F_OK) == 0;
+      });
     }
 
     if (vol->blk_device[0] != '/' && !dm.GetDmDevicePathByName(vol->blk_device, &vol->blk_device)) {
@@ -109,6 +113,25 @@ static bool EraseVolume(const char* volume, RecoveryUI* ui) {
   return (result == 0);
 }
 
+// Erases the given volumes, formatting the ones on fixed block devices in parallel. Logical volumes
+// are erased one at a time on the calling thread, since mapping them goes through the shared
+// device-mapper state.
+static bool EraseVolumes(const std::vector<const char*>& volumes, RecoveryUI* ui) {
+  std::vector<std::future<bool>> results;
+  bool success = true;
+  for (const auto& volume : volumes) {
+    if (volume_for_mount_point(volume)->fs_mgr_flags.logical) {
+      success &= EraseVolume(volume, ui);
+    } else {
+      results.push_back(std::async(std::launch::async, EraseVolume, volume, ui));
+    }
+  }
+  for (auto& result : results) {
+    success &= result.get();
+  }
+  return success;
+}
+
 bool WipeCache(RecoveryUI* ui, const std::function<bool()>& confirm_func) {
   bool has_cache = volume_for_mount_point("/cache") != nullptr;
   if (!has_cache) {
@@ -142,14 +165,15 @@ bool WipeData(Device* device, bool keep_memtag_mode) {
 
   bool success = device->PreWipeData();
   if (success) {
-    success &= EraseVolume(DATA_ROOT, ui);
+    std::vector<const char*> volumes = { DATA_ROOT };
     bool has_cache = volume_for_mount_point("/cache") != nullptr;
     if (has_cache) {
-      success &= EraseVolume(CACHE_ROOT, ui);
+      volumes.push_back(CACHE_ROOT);
     }
     if (volume_for_mount_point(METADATA_ROOT) != nullptr) {
-      success &= EraseVolume(METADATA_ROOT, ui);
+      volumes.push_back(METADATA_ROOT);
     }
+    success &= EraseVolumes(volumes, ui);
   }
   if (keep_memtag_mode) {
     ui->Print("NOT resetting memtag message as per request...\n");
@@ -21,20 +21,29 @@
 #include <linux/fs.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <ziparchive/zip_archive.h>
 
 #include "bootloader_message/bootloader_message.h"
 #include "install/install.h"
+#include "install/package_metadata.h"
 #include "otautil/package.h"
 #include "recovery_ui/device.h"
 #include "recovery_ui/ui.h"
@@ -90,47 +99,129 @@ std::vector<std::string> GetWipePartitionList(Package* wipe_package) {
   return result;
 }
 
+// The partitions are wiped in chunks of this size, so that the progress can be reported between the
+// ioctls.
+static constexpr uint64_t kWipeChunkSize = 1024 * 1024 * 1024;
+
+// Returns the size of the given partition, or 0 on errors.
+static uint64_t GetPartitionSize(const std::string& partition) {
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(partition.c_str(), O_RDONLY)));
+  uint64_t size = 0;
+  if (fd == -1 || ioctl(fd, BLKGETSIZE64, &size) == -1) {
+    PLOG(ERROR) << "Failed to get the size of \"" << partition << "\"";
+    return 0;
+  }
+  return size;
+}
+
+// Returns the sysfs path of the disk that holds the given partition, so that partitions on the
+// same disk (e.g. the same UFS LUN) can be told apart from the ones on another. Falls back to the
+// partition itself if it can't be resolved.
+static std::string GetUnderlyingDevice(const std::string& partition) {
+  struct stat sb;
+  if (stat(partition.c_str(), &sb) == -1 || !S_ISBLK(sb.st_mode)) {
+    return partition;
+  }
+  std::string sysfs_path;
+  if (!android::base::Realpath(android::base::StringPrintf("/sys/dev/block/%u:%u",
+                                                           major(sb.st_rdev), minor(sb.st_rdev)),
+                               &sysfs_path)) {
+    return partition;
+  }
+  if (access((sysfs_path + "/partition").c_str(), F_OK) == 0) {
+    return android::base::Dirname(sysfs_path);
+  }
+  return sysfs_path;
+}
+
 // Secure-wipes a given partition. It uses BLKSECDISCARD, if supported. Otherwise, it goes with
-// BLKDISCARD (if device supports BLKDISCARDZEROES) or BLKZEROOUT.
-static bool SecureWipePartition(const std::string& partition) {
+// BLKDISCARD (if device supports BLKDISCARDZEROES) or BLKZEROOUT. The method is picked on the first
+// chunk and used for the rest. Calls |wiped| with the number of bytes after each chunk.
+static bool SecureWipePartition(const std::string& partition,
+                                const std::function<void(uint64_t)>& wiped) {
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(partition.c_str(), O_WRONLY)));
   if (fd == -1) {
     PLOG(ERROR) << "Failed to open \"" << partition << "\"";
     return false;
   }
 
-  uint64_t range[2] = { 0, 0 };
-  if (ioctl(fd, BLKGETSIZE64, &range[1]) == -1 || range[1] == 0) {
+  uint64_t size = 0;
+  if (ioctl(fd, BLKGETSIZE64, &size) == -1 || size == 0) {
     PLOG(ERROR) << "Failed to get partition size";
     return false;
   }
-  LOG(INFO) << "Secure-wiping \"" << partition << "\" from " << range[0] << " to " << range[1];
-
-  LOG(INFO) << "  Trying BLKSECDISCARD...";
-  if (ioctl(fd, BLKSECDISCARD, &range) == -1) {
-    PLOG(WARNING) << "  Failed";
+  LOG(INFO) << "Secure-wiping \"" << partition << "\" from 0 to " << size;
 
-    // Use BLKDISCARD if it zeroes out blocks, otherwise use BLKZEROOUT.
-    unsigned int zeroes;
-    if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0) {
-      LOG(INFO) << "  Trying BLKDISCARD...";
-      if (ioctl(fd, BLKDISCARD, &range) == -1) {
-        PLOG(ERROR) << "  Failed";
+  unsigned long request = BLKSECDISCARD;
+  for (uint64_t offset = 0; offset < size; offset += kWipeChunkSize) {
+    uint64_t range[2] = { offset, std::min(kWipeChunkSize, size - offset) };
+    if (ioctl(fd, request, &range) == -1) {
+      if (offset != 0 || request != BLKSECDISCARD) {
+        PLOG(ERROR) << "  Failed to wipe \"" << partition << "\" at " << offset;
         return false;
       }
-    } else {
-      LOG(INFO) << "  Trying BLKZEROOUT...";
-      if (ioctl(fd, BLKZEROOUT, &range) == -1) {
+      PLOG(WARNING) << "  BLKSECDISCARD failed on \"" << partition << "\"";
+
+      // Use BLKDISCARD if it zeroes out blocks, otherwise use BLKZEROOUT.
+      unsigned int zeroes;
+      if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0) {
+        LOG(INFO) << "  Trying BLKDISCARD on \"" << partition << "\"...";
+        request = BLKDISCARD;
+      } else {
+        LOG(INFO) << "  Trying BLKZEROOUT on \"" << partition << "\"...";
+        request = BLKZEROOUT;
+      }
+      if (ioctl(fd, request, &range) == -1) {
         PLOG(ERROR) << "  Failed";
         return false;
       }
     }
+    if (wiped) {
+      wiped(range[1]);
+    }
   }
 
-  LOG(INFO) << "  Done";
+  LOG(INFO) << "  Done wiping \"" << partition << "\"";
   return true;
 }
 
+// Wipes the partitions, one thread per underlying disk, since a secure discard keeps a disk busy
+// but leaves the others idle. Partitions on the same disk are wiped one after another.
+static void SecureWipePartitions(const std::vector<std::string>& partitions, RecoveryUI* ui) {
+  std::map<std::string, std::vector<std::string>> groups;
+  uint64_t total_size = 0;
+  for (const auto& partition : partitions) {
+    groups[GetUnderlyingDevice(partition)].push_back(partition);
+    total_size += GetPartitionSize(partition);
+  }
+
+  std::atomic<uint64_t> wiped_size = 0;
+  auto wiped = [&](uint64_t bytes) {
+    uint64_t done = wiped_size.fetch_add(bytes) + bytes;
+    if (ui != nullptr && total_size != 0) {
+      ui->SetProgress(std::min(1.0, static_cast<double>(done) / total_size));
+    }
+  };
+  if (ui != nullptr) {
+    ui->SetProgressType(RecoveryUI::DETERMINATE);
+    ui->ShowProgress(1.0, 0);
+  }
+
+  std::vector<std::thread> threads;
+  for (const auto& [device, group] : groups) {
+    LOG(INFO) << "Wiping " << group.size() << " partition(s) on " << device;
+    threads.emplace_back([&group = group, &wiped]() {
+      for (const auto& partition : group) {
+        // Proceed anyway even if it fails to wipe some partition.
+        SecureWipePartition(partition, wiped);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
 static std::unique_ptr<Package> ReadWipePackage(size_t wipe_package_size) {
   if (wipe_package_size == 0) {
     LOG(ERROR) << "wipe_package_size is zero";
@@ -157,19 +248,17 @@ static bool CheckWipePackage(Package* wipe_package, RecoveryUI* ui) {
     return false;
   }
 
-  ZipArchiveHandle zip = wipe_package->GetZipArchiveHandle();
-  if (!zip) {
-    LOG(ERROR) << "Failed to get ZipArchiveHandle";
+  // Shares the metadata that the install (if any) has read already.
+  const PackageMetadata* metadata = PackageMetadata::Get(wipe_package);
+  if (!metadata) {
     return false;
   }
-
-  std::map<std::string, std::string> metadata;
-  if (!ReadMetadataFromPackage(zip, &metadata)) {
+  if (!metadata->has_values()) {
     LOG(ERROR) << "Failed to parse metadata in the zip file";
     return false;
   }
 
-  return CheckPackageMetadata(metadata, OtaType::BRICK, ui);
+  return CheckPackageMetadata(metadata->values(), OtaType::BRICK, ui);
 }
 
 bool WipeAbDevice(Device* device, size_t wipe_package_size) {
@@ -198,9 +287,6 @@ bool WipeAbDevice(Device* device, Package* wipe_package) {
     return false;
   }
 
-  for (const auto& partition : partition_list) {
-    // Proceed anyway even if it fails to wipe some partition.
-    SecureWipePartition(partition);
-  }
+  SecureWipePartitions(partition_list, ui);
   return true;
 }
@@ -18,12 +18,16 @@ Script to take a set of frames (PNG files) for a recovery animation
 and turn it into a single output image which contains the input frames
 interlaced by row.  Run with the names of all the input frames on the
 command line, in order, followed by the name of the output file.
+
+With --raw, the frames are written to a raw frames (.rrf) file instead, which
+minui maps into memory as is rather than decoding at startup.
 """
 
 from __future__ import print_function
 
 import argparse
 import os.path
+import struct
 import sys
 try:
   import Image
@@ -62,6 +66,28 @@ def interlace(output, inputs):
   out.save(output, pnginfo=meta)
 
 
+def write_raw(output, inputs, fps):
+  """Writes the frames in the raw frames format instead, which minui maps directly.
+
+  The file has a header of the magic "RRF1" followed by little-endian uint32 width, height, frame
+  count, FPS and frame stride, and then the frames as rows of RGBX pixels, each frame padded to
+  the 8-byte aligned stride.
+  """
+  frames = [Image.open(fn).convert("RGB") for fn in inputs]
+  assert len(frames) > 0, "Must have at least one input frame."
+  sizes = set(fr.size for fr in frames)
+  assert len(sizes) == 1, "All input images must have the same size."
+  w, h = sizes.pop()
+
+  frame_size = w * h * 4
+  stride = (frame_size + 7) // 8 * 8
+  with open(output, "wb") as out:
+    out.write(b"RRF1" + struct.pack("<5I", w, h, len(frames), fps, stride))
+    for fr in frames:
+      out.write(fr.convert("RGBX").tobytes())
+      out.write(b"\0" * (stride - frame_size))
+
+
 def deinterlace(output, input):
   # Truncate the output filename extension if it's '.png'.
   if os.path.splitext(output)[1].lower() == '.png':
@@ -99,6 +125,9 @@ def deinterlace(output, input):
 def main(argv):
   parser = argparse.ArgumentParser(description='Parse')
   parser.add_argument('--deinterlace', '-d', action='store_true')
+  parser.add_argument('--raw', action='store_true',
+                      help='Write a raw frames (.rrf) file instead of an interlaced PNG.')
+  parser.add_argument('--fps', type=int, default=20)
   parser.add_argument('--output', '-o', required=True)
   parser.add_argument('input', nargs='+')
   args = parser.parse_args(argv)
@@ -106,6 +135,8 @@ def main(argv):
   if args.deinterlace:
     # args.input is a list, and we only process the first when deinterlacing.
     deinterlace(args.output, args.input[0])
+  elif args.raw:
+    write_raw(args.output, args.input, args.fps)
   else:
     interlace(args.output, args.input)
 
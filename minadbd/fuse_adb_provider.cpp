@@ -20,20 +20,90 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <string>
+
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <lz4.h>
+
 #include "adb.h"
 #include "adb_io.h"
 
+bool FuseAdbDataProvider::ReadReplies(uint8_t* buffer, uint32_t fetch_size) const {
+  if (!compressed_blocks_ || fuse_block_size_ == 0) {
+    return ReadFdExactly(fd_, buffer, fetch_size);
+  }
+
+  for (uint32_t offset = 0; offset < fetch_size; offset += fuse_block_size_) {
+    uint32_t block_size = std::min(fuse_block_size_, fetch_size - offset);
+    char header[9] = {};
+    if (!ReadFdExactly(fd_, header, 8)) {
+      return false;
+    }
+    // The length is zero padded decimal. Check the digits first, as ParseUint() would also take a
+    // "0x" prefixed hex number.
+    uint32_t length;
+    if (!std::all_of(header, header + 8, [](char c) { return c >= '0' && c <= '9'; }) ||
+        !android::base::ParseUint(header, &length) || length == 0 ||
+        length > static_cast<uint32_t>(LZ4_compressBound(block_size))) {
+      fprintf(stderr, "invalid block length from adb host: %s\n", header);
+      errno = EINVAL;
+      return false;
+    }
+
+    if (length == block_size) {
+      if (!ReadFdExactly(fd_, buffer + offset, block_size)) {
+        return false;
+      }
+      continue;
+    }
+    compressed_buffer_.resize(length);
+    if (!ReadFdExactly(fd_, compressed_buffer_.data(), length)) {
+      return false;
+    }
+    if (LZ4_decompress_safe(reinterpret_cast<const char*>(compressed_buffer_.data()),
+                            reinterpret_cast<char*>(buffer + offset), length,
+                            block_size) != static_cast<int>(block_size)) {
+      fprintf(stderr, "failed to decompress the block at offset %u from adb host\n", offset);
+      errno = EINVAL;
+      return false;
+    }
+  }
+  return true;
+}
+
 bool FuseAdbDataProvider::ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                                                uint32_t start_block) const {
-  if (!WriteFdFmt(fd_, "%08u", start_block)) {
-    fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
-    return false;
+  uint32_t blocks = 1;
+  if (fuse_block_size_ != 0 && fetch_size > fuse_block_size_) {
+    blocks = (fetch_size + fuse_block_size_ - 1) / fuse_block_size_;
   }
-
-  if (!ReadFdExactly(fd_, buffer, fetch_size)) {
-    fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
-    return false;
+  std::string requests;
+  if (max_range_blocks_ == 0) {
+    for (uint32_t i = 0; i < blocks; i++) {
+      requests += android::base::StringPrintf("%08u", start_block + i);
+    }
+  } else {
+    for (uint32_t i = 0; i < blocks; i += max_range_blocks_) {
+      requests += android::base::StringPrintf("%08u%08u", start_block + i,
+                                              std::min(max_range_blocks_, blocks - i));
+    }
   }
+  while (true) {
+    if (!WriteFdExactly(fd_, requests.data(), requests.size())) {
+      fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
+    } else if (!ReadReplies(buffer, fetch_size)) {
+      fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+    } else {
+      return true;
+    }
 
-  return true;
+    // Whatever the old connection delivered is dropped, and the whole fetch is sent again.
+    int fd = reconnect_ ? reconnect_() : -1;
+    if (fd == -1) {
+      return false;
+    }
+    fd_ = fd;
+  }
 }
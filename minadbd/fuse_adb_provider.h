@@ -18,13 +18,39 @@
 
 #include <stdint.h>
 
+#include <functional>
+#include <utility>
+#include <vector>
+
 #include "fuse_provider.h"
 
 // This class reads data from adb server.
+//
+// By default each block is requested with its 8-digit block number ("%08u"), and the host replies
+// with the block (cut short at the end of the file). A host that passes |max_range_blocks| when
+// starting the sideload-host service also accepts range requests: the 8-digit start block followed
+// by the 8-digit block count ("%08u%08u"), of up to |max_range_blocks| blocks each, which it
+// answers with the contiguous blocks. Either way, all the requests for a fetch are sent before
+// reading the replies, which come back in request order.
+//
+// A host that also passes |compressed_blocks| frames the reply of each block: its 8-digit length
+// ("%08u") followed by that many bytes. If the length equals the block's (which is only cut short
+// at the end of the file), the bytes are the block as is; otherwise they're the block compressed
+// as one LZ4 block. The blocks are decompressed here, before fuse_sideload checks their hashes.
+//
+// If the connection to the host fails and |reconnect| is given, it's called to wait for the host
+// to come back. It returns the fd of the new connection, on which the failed fetch is sent again,
+// or -1 to give up on the fetch.
 class FuseAdbDataProvider : public FuseDataProvider {
  public:
-  FuseAdbDataProvider(int fd, uint64_t file_size, uint32_t block_size)
-      : FuseDataProvider(file_size, block_size), fd_(fd) {}
+  FuseAdbDataProvider(int fd, uint64_t file_size, uint32_t block_size,
+                      uint32_t max_range_blocks = 0, bool compressed_blocks = false,
+                      std::function<int()> reconnect = nullptr)
+      : FuseDataProvider(file_size, block_size),
+        fd_(fd),
+        max_range_blocks_(max_range_blocks),
+        compressed_blocks_(compressed_blocks),
+        reconnect_(std::move(reconnect)) {}
 
   bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
                             uint32_t start_block) const override;
@@ -34,6 +60,18 @@ class FuseAdbDataProvider : public FuseDataProvider {
   }
 
  private:
-  // The underlying source to read data from (i.e. the one that talks to the host).
-  int fd_;
+  // Reads the replies for |fetch_size| bytes into |buffer|, decompressing the blocks if needed.
+  bool ReadReplies(uint8_t* buffer, uint32_t fetch_size) const;
+
+  // The underlying source to read data from (i.e. the one that talks to the host). Replaced when
+  // the host reconnects.
+  mutable int fd_;
+  // Max number of blocks in a range request, or 0 if the host only takes single block requests.
+  uint32_t max_range_blocks_;
+  // Whether the host sends the blocks framed and possibly compressed.
+  bool compressed_blocks_;
+  // Holds a compressed block while it gets decompressed.
+  mutable std::vector<uint8_t> compressed_buffer_;
+  // Waits for the host to reconnect after a failure, if set.
+  std::function<int()> reconnect_;
 };
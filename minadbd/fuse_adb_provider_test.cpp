@@ -21,8 +21,10 @@
 
 #include <string>
 
+#include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
+#include <lz4.h>
 
 #include "adb_io.h"
 #include "fuse_adb_provider.h"
@@ -67,6 +69,132 @@ TEST(fuse_adb_provider, read_block_adb) {
   ASSERT_EQ(EWOULDBLOCK, errno);
 }
 
+TEST(fuse_adb_provider, read_block_adb_multiple_blocks) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 10, 4);
+
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  // Three blocks, with a short last one.
+  const char expected_data[] = "foobarbaz0";
+  char block_data[sizeof(expected_data)] = {};
+  ASSERT_TRUE(WriteFdExactly(host_socket, expected_data, strlen(expected_data)));
+
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data),
+                                        sizeof(expected_data) - 1, 0));
+
+  // All the blocks are requested at once, and in order.
+  char block_req[25] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, block_req, 24));
+  ASSERT_STREQ("000000000000000100000002", block_req);
+  ASSERT_STREQ(expected_data, block_data);
+
+  char tmp;
+  errno = 0;
+  ASSERT_EQ(-1, read(host_socket, &tmp, 1));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+}
+
+TEST(fuse_adb_provider, read_block_adb_range_requests) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 10, 4, 2);
+
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  const char expected_data[] = "foobarbaz0";
+  char block_data[sizeof(expected_data)] = {};
+  ASSERT_TRUE(WriteFdExactly(host_socket, expected_data, strlen(expected_data)));
+
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data),
+                                        sizeof(expected_data) - 1, 5));
+
+  // Three blocks in two ranges of at most two blocks, all requested at once.
+  char block_req[33] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, block_req, 32));
+  ASSERT_STREQ("00000005000000020000000700000001", block_req);
+  ASSERT_STREQ(expected_data, block_data);
+
+  char tmp;
+  errno = 0;
+  ASSERT_EQ(-1, read(host_socket, &tmp, 1));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+}
+
+TEST(fuse_adb_provider, read_block_adb_compressed_blocks) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 4096 + 10, 4096, 2, true);
+
+  fcntl(host_socket, F_SETFL, O_NONBLOCK);
+
+  // A compressible block, followed by a short last block that's sent as is.
+  std::string expected_data(4096, 'a');
+  expected_data += "foobarbaz0";
+  std::string compressed(LZ4_compressBound(4096), '\0');
+  int compressed_size =
+      LZ4_compress_default(expected_data.data(), compressed.data(), 4096, compressed.size());
+  ASSERT_GT(compressed_size, 0);
+  ASSERT_LT(compressed_size, 4096);
+  compressed.resize(compressed_size);
+
+  std::string reply = android::base::StringPrintf("%08d", compressed_size) + compressed +
+                      "00000010" + expected_data.substr(4096);
+  ASSERT_TRUE(WriteFdExactly(host_socket, reply.data(), reply.size()));
+
+  std::string block_data(expected_data.size(), '\0');
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data.data()),
+                                        block_data.size(), 0));
+  ASSERT_EQ(expected_data, block_data);
+
+  char block_req[17] = {};
+  ASSERT_TRUE(ReadFdExactly(host_socket, block_req, 16));
+  ASSERT_STREQ("0000000000000002", block_req);
+
+  char tmp;
+  errno = 0;
+  ASSERT_EQ(-1, read(host_socket, &tmp, 1));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+}
+
+TEST(fuse_adb_provider, read_block_adb_corrupted_compressed_block) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 4096, 4096, 1, true);
+
+  std::string reply = "00000004" + std::string(4, '\xff');
+  ASSERT_TRUE(WriteFdExactly(host_socket, reply.data(), reply.size()));
+
+  std::string block_data(4096, '\0');
+  ASSERT_FALSE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data.data()),
+                                         block_data.size(), 0));
+}
+
+TEST(fuse_adb_provider, read_block_adb_non_decimal_block_length) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+  FuseAdbDataProvider data(std::move(device_socket), 16, 4096, 1, true);
+
+  // 0x10 would be the right length for the block, were it taken as hex.
+  std::string reply = "0x000010" + std::string(16, 'a');
+  ASSERT_TRUE(WriteFdExactly(host_socket, reply.data(), reply.size()));
+
+  std::string block_data(16, '\0');
+  ASSERT_FALSE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data.data()),
+                                         block_data.size(), 0));
+}
+
 TEST(fuse_adb_provider, read_block_adb_fail_write) {
   android::base::unique_fd device_socket;
   android::base::unique_fd host_socket;
@@ -83,3 +211,52 @@ TEST(fuse_adb_provider, read_block_adb_fail_write) {
   char buf[1];
   ASSERT_FALSE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(buf), 1, 0));
 }
+
+TEST(fuse_adb_provider, read_block_adb_reconnect) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+
+  android::base::unique_fd new_device_socket;
+  android::base::unique_fd new_host_socket;
+  ASSERT_TRUE(
+      android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &new_device_socket, &new_host_socket));
+
+  int reconnects = 0;
+  FuseAdbDataProvider data(device_socket, 10, 4, 0, false, [&]() {
+    reconnects++;
+    return new_device_socket.get();
+  });
+
+  // The host goes away, and comes back on a new connection.
+  host_socket.reset();
+  signal(SIGPIPE, SIG_IGN);
+  fcntl(new_host_socket, F_SETFL, O_NONBLOCK);
+
+  const char expected_data[] = "foobar";
+  char block_data[sizeof(expected_data)] = {};
+  ASSERT_TRUE(WriteFdExactly(new_host_socket, expected_data, strlen(expected_data)));
+
+  ASSERT_TRUE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(block_data),
+                                        sizeof(expected_data) - 1, 2));
+  ASSERT_EQ(1, reconnects);
+
+  // The fetch is sent again in full on the new connection.
+  char block_req[17] = {};
+  ASSERT_TRUE(ReadFdExactly(new_host_socket, block_req, 16));
+  ASSERT_STREQ("0000000200000003", block_req);
+  ASSERT_STREQ(expected_data, block_data);
+}
+
+TEST(fuse_adb_provider, read_block_adb_reconnect_timeout) {
+  android::base::unique_fd device_socket;
+  android::base::unique_fd host_socket;
+  ASSERT_TRUE(android::base::Socketpair(AF_UNIX, SOCK_STREAM, 0, &device_socket, &host_socket));
+
+  FuseAdbDataProvider data(device_socket, 0, 0, 0, false, []() { return -1; });
+  host_socket.reset();
+  signal(SIGPIPE, SIG_IGN);
+
+  char buf[1];
+  ASSERT_FALSE(data.ReadBlockAlignedData(reinterpret_cast<uint8_t*>(buf), 1, 0));
+}
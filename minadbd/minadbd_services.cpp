@@ -16,16 +16,22 @@
 
 #include "minadbd_services.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <string_view>
@@ -45,6 +51,7 @@
 #include "fuse_adb_provider.h"
 #include "fuse_sideload.h"
 #include "minadbd/types.h"
+#include "otautil/live_stats.h"
 #include "recovery_utils/battery_utils.h"
 #include "services.h"
 #include "sysdeps.h"
@@ -65,6 +72,22 @@ void SetSideloadMountPoint(const std::string& path) {
   sideload_mount_point = path;
 }
 
+// Receive buffer size for the sideload-host socket. Holding a whole fuse readahead lets adbd keep
+// draining the USB endpoint into the socket, while the fuse side is still verifying the blocks of
+// the previous response.
+static constexpr int kSideloadSocketBufferSize = 2 * 1024 * 1024;
+
+// How long an ongoing sideload waits for the host to come back after losing the connection. The
+// FUSE mount, and the block hashes and cache behind it, stay up meanwhile; a host that restarts the
+// same sideload-host command resumes it, and only the blocks that are still missing get fetched.
+static constexpr auto kSideloadResumeTimeout = std::chrono::seconds(60);
+
+// Hands the connection of a resuming host over to the ongoing sideload.
+static std::mutex sideload_resume_lock;
+static std::condition_variable sideload_resume_cv;
+static std::string sideload_resume_args;  // Arguments of the ongoing sideload, or empty if none.
+static unique_fd sideload_resume_fd;      // Connection of the resuming host, until it's taken.
+
 static bool WriteCommandToFd(MinadbdCommand cmd, int fd) {
   char message[kMinadbdMessageSize];
   memcpy(message, kMinadbdCommandPrefix, strlen(kMinadbdStatusPrefix));
@@ -97,26 +120,74 @@ static bool WaitForCommandStatus(int fd, MinadbdCommandStatus* status) {
   return true;
 }
 
-static MinadbdErrorCode RunAdbFuseSideload(int sfd, const std::string& args,
+static void SetSideloadSocketBufferSize(int sfd) {
+  // SO_RCVBUFFORCE goes past net.core.rmem_max, but needs CAP_NET_ADMIN. A smaller buffer only
+  // costs throughput.
+  if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUFFORCE, &kSideloadSocketBufferSize,
+                 sizeof(kSideloadSocketBufferSize)) == -1 &&
+      setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &kSideloadSocketBufferSize,
+                 sizeof(kSideloadSocketBufferSize)) == -1) {
+    PLOG(WARNING) << "Failed to set the receive buffer size of the sideload socket";
+  }
+}
+
+// Serves the sideload on |sfd|, which gets replaced by the new connection if the host resumes.
+static MinadbdErrorCode RunAdbFuseSideload(unique_fd& sfd, const std::string& args,
                                            MinadbdCommandStatus* status) {
   auto pieces = android::base::Split(args, ":");
   int64_t file_size;
   int block_size;
-  if (pieces.size() != 2 || !android::base::ParseInt(pieces[0], &file_size) || file_size <= 0 ||
-      !android::base::ParseInt(pieces[1], &block_size) || block_size <= 0) {
+  // Hosts that take range requests pass the max number of blocks per request as the third argument.
+  // Those that can also send LZ4 compressed blocks then pass "lz4" as the fourth one.
+  uint32_t max_range_blocks = 0;
+  bool compressed_blocks = pieces.size() == 4 && pieces[3] == "lz4";
+  if ((pieces.size() < 2 || pieces.size() > 4) ||
+      !android::base::ParseInt(pieces[0], &file_size) || file_size <= 0 ||
+      !android::base::ParseInt(pieces[1], &block_size) || block_size <= 0 ||
+      (pieces.size() >= 3 &&
+       (!android::base::ParseUint(pieces[2], &max_range_blocks) || max_range_blocks == 0)) ||
+      (pieces.size() == 4 && !compressed_blocks)) {
     LOG(ERROR) << "bad sideload-host arguments: " << args;
     return kMinadbdHostCommandArgumentError;
   }
 
-  LOG(INFO) << "sideload-host file size " << file_size << ", block size " << block_size;
+  LOG(INFO) << "sideload-host file size " << file_size << ", block size " << block_size
+            << ", max range blocks " << max_range_blocks << ", compressed blocks "
+            << compressed_blocks;
 
   if (!WriteCommandToFd(MinadbdCommand::kInstall, minadbd_socket)) {
     return kMinadbdSocketIOError;
   }
 
-  auto adb_data_reader = std::make_unique<FuseAdbDataProvider>(sfd, file_size, block_size);
-  if (int result = run_fuse_sideload(std::move(adb_data_reader), sideload_mount_point.c_str());
-      result != 0) {
+  // Only called by the provider, which runs while this thread waits in run_fuse_sideload().
+  auto reconnect = [&sfd]() {
+    std::unique_lock<std::mutex> lock(sideload_resume_lock);
+    LOG(WARNING) << "Lost the sideload host, waiting for it to resume";
+    if (!sideload_resume_cv.wait_for(lock, kSideloadResumeTimeout,
+                                     [] { return sideload_resume_fd != -1; })) {
+      LOG(ERROR) << "Timed out waiting for the sideload host to resume";
+      return -1;
+    }
+    LOG(INFO) << "Resuming the sideload";
+    sfd = std::move(sideload_resume_fd);
+    SetSideloadSocketBufferSize(sfd.get());
+    return sfd.get();
+  };
+
+  SetSideloadSocketBufferSize(sfd.get());
+  auto adb_data_reader = std::make_unique<FuseAdbDataProvider>(
+      sfd.get(), file_size, block_size, max_range_blocks, compressed_blocks, reconnect);
+  {
+    std::lock_guard<std::mutex> lock(sideload_resume_lock);
+    sideload_resume_args = args;
+  }
+  int result = run_fuse_sideload(std::move(adb_data_reader), sideload_mount_point.c_str());
+  {
+    std::lock_guard<std::mutex> lock(sideload_resume_lock);
+    sideload_resume_args.clear();
+    sideload_resume_fd.reset();
+  }
+  if (result != 0) {
     LOG(ERROR) << "Failed to start fuse";
     return kMinadbdFuseStartError;
   }
@@ -129,12 +200,12 @@ static MinadbdErrorCode RunAdbFuseSideload(int sfd, const std::string& args,
   // (i.e. "DONEDONE") regardless of the install result. For rescue mode, we send failure message on
   // install error.
   if (!rescue_mode || *status == MinadbdCommandStatus::kSuccess) {
-    if (!android::base::WriteFully(sfd, kMinadbdServicesExitSuccess,
+    if (!android::base::WriteFully(sfd.get(), kMinadbdServicesExitSuccess,
                                    strlen(kMinadbdServicesExitSuccess))) {
       return kMinadbdHostSocketIOError;
     }
   } else {
-    if (!android::base::WriteFully(sfd, kMinadbdServicesExitFailure,
+    if (!android::base::WriteFully(sfd.get(), kMinadbdServicesExitFailure,
                                    strlen(kMinadbdServicesExitFailure))) {
       return kMinadbdHostSocketIOError;
     }
@@ -171,11 +242,26 @@ static bool WaitForSocketClose(int fd, std::chrono::milliseconds timeout) {
   return false;
 }
 
+// Passes |sfd| to the ongoing sideload, if it's one with the same |args|. Returns false if there's
+// no such sideload to resume.
+static bool ResumeAdbFuseSideload(unique_fd& sfd, const std::string& args) {
+  std::lock_guard<std::mutex> lock(sideload_resume_lock);
+  if (sideload_resume_args.empty() || sideload_resume_args != args) {
+    return false;
+  }
+  sideload_resume_fd = std::move(sfd);
+  sideload_resume_cv.notify_all();
+  return true;
+}
+
 // Sideload service always exits after serving an install command.
 static void SideloadHostService(unique_fd sfd, const std::string& args) {
   using namespace std::chrono_literals;
+  if (ResumeAdbFuseSideload(sfd, args)) {
+    return;
+  }
   MinadbdCommandStatus status;
-  auto error = RunAdbFuseSideload(sfd.get(), args, &status);
+  auto error = RunAdbFuseSideload(sfd, args, &status);
   // No need to wait if the socket is already closed, meaning the other end
   // already exited for some reason.
   if (error != kMinadbdHostSocketIOError) {
@@ -189,8 +275,11 @@ static void SideloadHostService(unique_fd sfd, const std::string& args) {
 
 // Rescue service waits for the next command after an install command.
 static void RescueInstallHostService(unique_fd sfd, const std::string& args) {
+  if (ResumeAdbFuseSideload(sfd, args)) {
+    return;
+  }
   MinadbdCommandStatus status;
-  if (auto result = RunAdbFuseSideload(sfd.get(), args, &status); result != kMinadbdSuccess) {
+  if (auto result = RunAdbFuseSideload(sfd, args, &status); result != kMinadbdSuccess) {
     exit(result);
   }
 }
@@ -305,6 +394,74 @@ static void WipeDeviceService(unique_fd fd, const std::string& args) {
   }
 }
 
+// Streams the live stats of the recovery processes (see StartLiveStats()) and the I/O of the block
+// devices to the host, every |args| milliseconds (1000 by default), until the host goes away. Each
+// frame is a set of "key: value" lines, ended by an empty line. The keys of a process are prefixed
+// with its name (e.g. "updater.phases: bsdiff"), and those of a block device with "disk.<name>."
+// (e.g. "disk.sda.write_mbps: 182.5").
+static void StatsHostService(unique_fd sfd, const std::string& args) {
+  int interval_ms = 1000;
+  if (!args.empty() && !android::base::ParseInt(args, &interval_ms, 100)) {
+    LOG(ERROR) << "Failed to parse the stats interval in " << args;
+    return;
+  }
+  std::map<std::string, DiskIo> last_disks = ReadDiskStats();
+  auto last_time = std::chrono::steady_clock::now();
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - last_time).count();
+
+    std::set<std::string> names;
+    if (std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(kLiveStatsDir), closedir); dir) {
+      dirent* de;
+      while ((de = readdir(dir.get())) != nullptr) {
+        if (de->d_name[0] != '.' && !android::base::EndsWith(de->d_name, ".tmp")) {
+          names.insert(de->d_name);
+        }
+      }
+    }
+    std::string frame;
+    for (const auto& name : names) {
+      std::string content;
+      if (!android::base::ReadFileToString(std::string(kLiveStatsDir) + "/" + name, &content)) {
+        continue;
+      }
+      // Skips the stats of the processes that are gone.
+      std::vector<std::string> lines = android::base::Split(content, "\n");
+      int pid;
+      if (lines.empty() || !android::base::StartsWith(lines[0], "pid: ") ||
+          !android::base::ParseInt(lines[0].substr(5), &pid) || kill(pid, 0) == -1) {
+        continue;
+      }
+      for (const auto& line : lines) {
+        if (!line.empty()) {
+          frame += name + "." + line + "\n";
+        }
+      }
+    }
+    auto mbps = [seconds](uint64_t bytes, uint64_t last_bytes) {
+      return bytes > last_bytes ? (bytes - last_bytes) / seconds / 1e6 : 0;
+    };
+    std::map<std::string, DiskIo> disks = ReadDiskStats();
+    for (const auto& [name, io] : disks) {
+      const DiskIo& last = last_disks[name];
+      frame += android::base::StringPrintf(
+          "disk.%s.read_bytes: %" PRIu64 "\ndisk.%s.write_bytes: %" PRIu64
+          "\ndisk.%s.read_mbps: %.1f\ndisk.%s.write_mbps: %.1f\n",
+          name.c_str(), io.read_bytes, name.c_str(), io.write_bytes, name.c_str(),
+          mbps(io.read_bytes, last.read_bytes), name.c_str(),
+          mbps(io.write_bytes, last.write_bytes));
+    }
+    frame += "\n";
+    if (!android::base::WriteFully(sfd, frame.data(), frame.size())) {
+      return;
+    }
+    last_disks = std::move(disks);
+    last_time = now;
+  }
+}
+
 asocket* daemon_service_to_socket(std::string_view, atransport*) {
   return nullptr;
 }
@@ -321,11 +478,17 @@ unique_fd daemon_service_to_fd(std::string_view name, atransport* /* transport *
     }
     return unique_fd{};
   }
+  if (android::base::ConsumePrefix(&name, "stats:")) {
+    // stats:[<interval-ms>]
+    std::string args(name);
+    return create_service_thread("stats",
+                                 std::bind(StatsHostService, std::placeholders::_1, args));
+  }
 
   // Rescue-specific services.
   if (rescue_mode) {
     if (android::base::ConsumePrefix(&name, "rescue-install:")) {
-      // rescue-install:<file-size>:<block-size>
+      // rescue-install:<file-size>:<block-size>[:<max-range-blocks>[:lz4]]
       std::string args(name);
       return create_service_thread(
           "rescue-install", std::bind(RescueInstallHostService, std::placeholders::_1, args));
@@ -350,7 +513,7 @@ unique_fd daemon_service_to_fd(std::string_view name, atransport* /* transport *
     // (that supports sideload-host).
     exit(kMinadbdAdbVersionError);
   } else if (android::base::ConsumePrefix(&name, "sideload-host:")) {
-    // sideload-host:<file-size>:<block-size>
+    // sideload-host:<file-size>:<block-size>[:<max-range-blocks>[:lz4]]
     std::string args(name);
     return create_service_thread("sideload-host",
                                  std::bind(SideloadHostService, std::placeholders::_1, args));
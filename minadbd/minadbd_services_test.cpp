@@ -125,6 +125,20 @@ TEST_F(MinadbdServicesTest, SideloadHostService_wrong_size_argument) {
               ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
 }
 
+TEST_F(MinadbdServicesTest, SideloadHostService_wrong_range_argument) {
+  ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:4096:4096:abc"),
+              ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
+  ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:4096:4096:0"),
+              ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
+}
+
+TEST_F(MinadbdServicesTest, SideloadHostService_wrong_compression_argument) {
+  ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:4096:4096:16:zip"),
+              ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
+  ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:4096:4096:16:lz4:lz4"),
+              ::testing::ExitedWithCode(kMinadbdHostCommandArgumentError), "");
+}
+
 TEST_F(MinadbdServicesTest, SideloadHostService_wrong_block_size) {
   ASSERT_EXIT(ExecuteCommandAndWaitForExit("sideload-host:10:20"),
               ::testing::ExitedWithCode(kMinadbdFuseStartError), "");
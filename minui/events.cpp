@@ -22,14 +22,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include <android-base/properties.h>
 #include <android-base/strings.h>
@@ -64,6 +70,11 @@ static size_t g_ev_count = 0;
 static size_t g_ev_dev_count = 0;
 static size_t g_ev_misc_count = 0;
 
+// The eventfd that ev_post() signals, and the tasks it has queued for ev_dispatch().
+static std::atomic<int> g_wake_fd{ -1 };
+static std::mutex g_posted_tasks_mutex;
+static std::vector<std::function<void()>> g_posted_tasks;
+
 static bool should_skip_ev_rel() {
   static bool prop = android::base::GetBoolProperty("ro.recovery.skip_ev_rel_input", false);
   return prop;
@@ -150,6 +161,23 @@ static int inotify_cb(int fd, __unused uint32_t epevents) {
   return 0;
 }
 
+static int wake_cb(int fd, __unused uint32_t epevents) {
+  uint64_t count;
+  if (TEMP_FAILURE_RETRY(read(fd, &count, sizeof(count))) != sizeof(count)) {
+    return -1;
+  }
+
+  std::vector<std::function<void()>> tasks;
+  {
+    std::lock_guard<std::mutex> lock(g_posted_tasks_mutex);
+    tasks.swap(g_posted_tasks);
+  }
+  for (const auto& task : tasks) {
+    task();
+  }
+  return 0;
+}
+
 int ev_init(ev_callback input_cb, bool allow_touch_inputs) {
   g_epoll_fd.reset();
 
@@ -208,6 +236,12 @@ int ev_init(ev_callback input_cb, bool allow_touch_inputs) {
   g_allow_touch_inputs = allow_touch_inputs;
   ev_add_fd(std::move(inotify_fd), inotify_cb);
 
+  android::base::unique_fd wake_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  int wake_fd_raw = wake_fd.get();
+  if (wake_fd != -1 && ev_add_fd(std::move(wake_fd), wake_cb) == 0) {
+    g_wake_fd = wake_fd_raw;
+  }
+
   return 0;
 }
 
@@ -234,7 +268,80 @@ int ev_add_fd(android::base::unique_fd&& fd, ev_callback cb) {
   return ret;
 }
 
+void ev_remove_fd(int fd) {
+  for (size_t i = 0; i < g_ev_count; ++i) {
+    if (ev_fdinfo[i].fd == fd) {
+      // The slot isn't reused, as events for it may still be pending in g_polled_events.
+      epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+      ev_fdinfo[i].fd.reset();
+      ev_fdinfo[i].cb = nullptr;
+      return;
+    }
+  }
+}
+
+static bool arm_timer(int fd, std::chrono::milliseconds delay) {
+  itimerspec spec = {};
+  spec.it_value.tv_sec = delay.count() / 1000;
+  spec.it_value.tv_nsec = (delay.count() % 1000) * 1000000;
+  return timerfd_settime(fd, 0, &spec, nullptr) == 0;
+}
+
+int ev_add_timer(std::chrono::milliseconds delay, ev_timer_callback cb) {
+  if (cb == nullptr) {
+    return -1;
+  }
+
+  android::base::unique_fd timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+  if (timer_fd == -1) {
+    return -1;
+  }
+  // A zero it_value would disarm the timer rather than fire it right away.
+  if (!arm_timer(timer_fd, std::max(delay, std::chrono::milliseconds(1)))) {
+    return -1;
+  }
+
+  int timer_fd_raw = timer_fd.get();
+  auto timer_cb = [cb = std::move(cb)](int fd, __unused uint32_t epevents) {
+    uint64_t expirations;
+    if (TEMP_FAILURE_RETRY(read(fd, &expirations, sizeof(expirations))) != sizeof(expirations)) {
+      return -1;
+    }
+    std::chrono::milliseconds next = cb();
+    if (next.count() > 0 && !arm_timer(fd, next)) {
+      return -1;
+    }
+    return 0;
+  };
+  if (ev_add_fd(std::move(timer_fd), std::move(timer_cb)) != 0) {
+    return -1;
+  }
+  return timer_fd_raw;
+}
+
+int ev_post(std::function<void()> task) {
+  int wake_fd = g_wake_fd;
+  if (wake_fd == -1) {
+    return -1;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(g_posted_tasks_mutex);
+    g_posted_tasks.emplace_back(std::move(task));
+  }
+  uint64_t count = 1;
+  if (TEMP_FAILURE_RETRY(write(wake_fd, &count, sizeof(count))) != sizeof(count)) {
+    return -1;
+  }
+  return 0;
+}
+
 void ev_exit(void) {
+  g_wake_fd = -1;
+  {
+    std::lock_guard<std::mutex> lock(g_posted_tasks_mutex);
+    g_posted_tasks.clear();
+  }
   while (g_ev_count > 0) {
     ev_fdinfo[--g_ev_count].fd.reset();
   }
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/frame_damage.h"
+
+#include <string.h>
+
+bool FrameDamage::Init(const GRSurface& frame, size_t num_buffers) {
+  shown_ = GRSurface::Create(frame.width, frame.height, frame.row_bytes, frame.pixel_bytes);
+  if (!shown_) {
+    return false;
+  }
+  memset(shown_->data(), 0, frame.row_bytes * frame.height);
+  frame_ = 0;
+  row_frames_.assign(frame.height, 1);
+  synced_frames_.assign(num_buffers, 0);
+  return true;
+}
+
+size_t FrameDamage::Sync(const GRSurface& frame, uint8_t* buffer, size_t index) {
+  const uint8_t* src = frame.data();
+  uint8_t* shown = shown_->data();
+  size_t row_bytes = frame.row_bytes;
+  size_t height = frame.height;
+
+  uint32_t current = ++frame_;
+  for (size_t y = 0; y < height; ++y) {
+    size_t offset = y * row_bytes;
+    if (memcmp(src + offset, shown + offset, row_bytes) != 0) {
+      memcpy(shown + offset, src + offset, row_bytes);
+      row_frames_[y] = current;
+    }
+  }
+
+  // Writing in long sequential runs is what's fast on write-combined memory, and memcpy() already
+  // does so with the widest stores (NEON on arm64), never reading the destination back.
+  size_t copied = 0;
+  uint32_t synced = synced_frames_[index];
+  for (size_t y = 0; y < height;) {
+    if (row_frames_[y] <= synced) {
+      ++y;
+      continue;
+    }
+    size_t end = y + 1;
+    while (end < height && row_frames_[end] > synced) {
+      ++end;
+    }
+    memcpy(buffer + y * row_bytes, src + y * row_bytes, (end - y) * row_bytes);
+    copied += end - y;
+    y = end;
+  }
+  synced_frames_[index] = current;
+  return copied;
+}
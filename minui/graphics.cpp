@@ -21,12 +21,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <list>
+#include <map>
 #include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include <android-base/properties.h>
 
 #include "graphics_drm.h"
 #include "graphics_fbdev.h"
+#include "graphics_memory.h"
 #include "minui/minui.h"
 
 static GRFont* gr_font = nullptr;
@@ -40,6 +48,14 @@ static uint32_t gr_current = ~0;
 
 // gr_draw is owned by backends.
 static GRSurface* gr_draw = nullptr;
+// The columns that gr_flip() copies, as set by gr_mirror().
+static int mirror_x = 0;
+static int mirror_width = 0;
+static int mirror_dst_x = 0;
+// The screen surface and overscan offsets, while gr_draw points to an overlay.
+static GRSurface* gr_screen = nullptr;
+static int screen_offset_x = 0;
+static int screen_offset_y = 0;
 static GRRotation rotation = GRRotation::NONE;
 static GRRotation touch_rotation = GRRotation::NONE;
 static PixelFormat pixel_format = PixelFormat::UNKNOWN;
@@ -83,48 +99,6 @@ int gr_font_size(const GRFont* font, int* x, int* y) {
   return 0;
 }
 
-// Blends gr_current onto pix value, assumes alpha as most significant byte.
-static inline uint32_t pixel_blend_argb(uint8_t alpha, uint32_t pix) {
-  if (alpha == 255) return gr_current;
-  if (alpha == 0) return pix;
-  uint32_t pix_r = pix & 0xff;
-  uint32_t pix_g = pix & 0xff00;
-  uint32_t pix_b = pix & 0xff0000;
-  uint32_t cur_r = gr_current & 0xff;
-  uint32_t cur_g = gr_current & 0xff00;
-  uint32_t cur_b = gr_current & 0xff0000;
-
-  uint32_t out_r = (pix_r * (255 - alpha) + cur_r * alpha) / 255;
-  uint32_t out_g = (pix_g * (255 - alpha) + cur_g * alpha) / 255;
-  uint32_t out_b = (pix_b * (255 - alpha) + cur_b * alpha) / 255;
-
-  return (out_r & 0xff) | (out_g & 0xff00) | (out_b & 0xff0000) | (gr_current & 0xff000000);
-}
-
-static inline uint32_t pixel_blend_rgba(uint8_t alpha, uint32_t pix) {
-  if (alpha == 255) return gr_current;
-  if (alpha == 0) return pix;
-  uint32_t pix_r = pix & 0xff00;
-  uint32_t pix_g = pix & 0xff0000;
-  uint32_t pix_b = pix & 0xff000000;
-  uint32_t cur_r = gr_current & 0xff00;
-  uint32_t cur_g = gr_current & 0xff0000;
-  uint32_t cur_b = gr_current & 0xff000000;
-
-  uint32_t out_r = (pix_r * (255 - alpha) + cur_r * alpha) / 255;
-  uint32_t out_g = (pix_g * (255 - alpha) + cur_g * alpha) / 255;
-  uint32_t out_b = (pix_b * (255 - alpha) + cur_b * alpha) / 255;
-
-  return (gr_current & 0xff) | (out_r & 0xff00) | (out_g & 0xff0000) | (out_b & 0xff000000);
-}
-
-static inline uint32_t pixel_blend(uint8_t alpha, uint32_t pix) {
-  if (pixel_format == PixelFormat::RGBA) {
-    return pixel_blend_rgba(alpha, pix);
-  }
-  return pixel_blend_argb(alpha, pix);
-}
-
 static inline uint32_t get_alphamask() {
   if (pixel_format == PixelFormat::RGBA) {
     return 0x000000ff;
@@ -143,29 +117,33 @@ static inline uint8_t get_alpha(uint32_t pix) {
   return static_cast<uint8_t>((pix & (gr_current & get_alphamask())) >> get_alpha_shift());
 }
 
-// Increments pixel pointer right, with current rotation.
-static void incr_x(uint32_t** p, int row_pixels) {
-  if (rotation == GRRotation::LEFT) {
-    *p = *p - row_pixels;
-  } else if (rotation == GRRotation::RIGHT) {
-    *p = *p + row_pixels;
-  } else if (rotation == GRRotation::DOWN) {
-    *p = *p - 1;
-  } else {  // GRRotation::NONE
-    *p = *p + 1;
+// The offset from a framebuffer pixel to the one on its right on the screen, with rotation R.
+template <GRRotation R>
+static constexpr int StepX(int row_pixels) {
+  switch (R) {
+    case GRRotation::LEFT:
+      return -row_pixels;
+    case GRRotation::RIGHT:
+      return row_pixels;
+    case GRRotation::DOWN:
+      return -1;
+    default:  // GRRotation::NONE
+      return 1;
   }
 }
 
-// Increments pixel pointer down, with current rotation.
-static void incr_y(uint32_t** p, int row_pixels) {
-  if (rotation == GRRotation::LEFT) {
-    *p = *p + 1;
-  } else if (rotation == GRRotation::RIGHT) {
-    *p = *p - 1;
-  } else if (rotation == GRRotation::DOWN) {
-    *p = *p - row_pixels;
-  } else {  // GRRotation::NONE
-    *p = *p + row_pixels;
+// The offset from a framebuffer pixel to the one below it on the screen, with rotation R.
+template <GRRotation R>
+static constexpr int StepY(int row_pixels) {
+  switch (R) {
+    case GRRotation::LEFT:
+      return 1;
+    case GRRotation::RIGHT:
+      return -1;
+    case GRRotation::DOWN:
+      return -row_pixels;
+    default:  // GRRotation::NONE
+      return row_pixels;
   }
 }
 
@@ -188,22 +166,164 @@ static uint32_t* PixelAt(GRSurface* surface, int x, int y, int row_pixels) {
   return nullptr;
 }
 
+// The draw kernels below are instantiated for each position of the alpha byte in a pixel (0 for
+// RGBA, 3 otherwise) and each rotation, and picked once by SelectDrawKernels(), so that their inner
+// loops don't branch on either.
+
+// Blends gr_current onto a row of |count| screen pixels starting at |dst|, with the coverage of
+// each pixel in |coverage| (scaled by |alpha_current|). Each color channel becomes
+// (pix * (255 - a) + cur * a) / 255, computed two channels at a time in 16-bit lanes, with the
+// division done as (x + 1 + (x >> 8)) >> 8, which is exact for x <= 255 * 255. The byte at
+// |AlphaByte| takes the alpha of gr_current unless the coverage is zero. Without rotation, the
+// compiler vectorizes the loop (NEON or SSE2).
+template <int AlphaByte, GRRotation R>
+static void BlendRow(uint32_t* dst, const uint8_t* coverage, int count, uint8_t alpha_current,
+                     int row_pixels) {
+  constexpr uint32_t kAlphaMask = 0xffu << (AlphaByte * 8);
+  const uint32_t cur = gr_current;
+  const uint32_t cur_even = cur & 0x00ff00ff;
+  const uint32_t cur_odd = (cur >> 8) & 0x00ff00ff;
+  const int step = StepX<R>(row_pixels);
+  for (int i = 0; i < count; ++i) {
+    uint32_t pix = dst[i * step];
+    uint32_t a = coverage[i] * alpha_current;
+    a = (a + 1 + (a >> 8)) >> 8;
+    uint32_t even = (pix & 0x00ff00ff) * (255 - a) + cur_even * a;
+    uint32_t odd = ((pix >> 8) & 0x00ff00ff) * (255 - a) + cur_odd * a;
+    even = ((even + 0x00010001 + ((even >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    odd = (odd + 0x00010001 + ((odd >> 8) & 0x00ff00ff)) & 0xff00ff00;
+    dst[i * step] = ((even | odd) & ~kAlphaMask) | ((a != 0 ? cur : pix) & kAlphaMask);
+  }
+}
+
+template <int AlphaByte, GRRotation R>
 static void TextBlend(const uint8_t* src_p, int src_row_bytes, uint32_t* dst_p, int dst_row_pixels,
                       int width, int height) {
   uint8_t alpha_current = get_alpha(gr_current);
   for (int j = 0; j < height; ++j) {
-    const uint8_t* sx = src_p;
-    uint32_t* px = dst_p;
-    for (int i = 0; i < width; ++i, incr_x(&px, dst_row_pixels)) {
-      uint8_t a = *sx++;
-      if (alpha_current < 255) a = (static_cast<uint32_t>(a) * alpha_current) / 255;
-      *px = pixel_blend(a, *px);
-    }
+    BlendRow<AlphaByte, R>(dst_p, src_p, width, alpha_current, dst_row_pixels);
     src_p += src_row_bytes;
-    incr_y(&dst_p, dst_row_pixels);
+    dst_p += StepY<R>(dst_row_pixels);
+  }
+}
+
+template <int AlphaByte, GRRotation R>
+static void Fill(uint32_t* dst_p, int dst_row_pixels, int width, int height, uint8_t alpha) {
+  // A uniform coverage row, so that BlendRow() applies the fill alpha to every pixel.
+  std::vector<uint8_t> coverage(width, alpha);
+  for (int j = 0; j < height; ++j) {
+    BlendRow<AlphaByte, R>(dst_p, coverage.data(), width, 255, dst_row_pixels);
+    dst_p += StepY<R>(dst_row_pixels);
+  }
+}
+
+template <GRRotation R>
+static void Blit(const uint32_t* src_p, int src_row_pixels, uint32_t* dst_p, int dst_row_pixels,
+                 int width, int height) {
+  for (int j = 0; j < height; ++j) {
+    if (R == GRRotation::NONE) {
+      memcpy(dst_p, src_p, width * sizeof(uint32_t));
+    } else {
+      uint32_t* px = dst_p;
+      for (int i = 0; i < width; ++i, px += StepX<R>(dst_row_pixels)) {
+        *px = src_p[i];
+      }
+    }
+    src_p += src_row_pixels;
+    dst_p += StepY<R>(dst_row_pixels);
+  }
+}
+
+struct DrawKernels {
+  decltype(&TextBlend<3, GRRotation::NONE>) text_blend;
+  decltype(&Fill<3, GRRotation::NONE>) fill;
+  decltype(&Blit<GRRotation::NONE>) blit;
+};
+
+template <int AlphaByte, GRRotation R>
+static constexpr DrawKernels kDrawKernels = {
+  TextBlend<AlphaByte, R>,
+  Fill<AlphaByte, R>,
+  Blit<R>,
+};
+
+template <int AlphaByte>
+static DrawKernels GetDrawKernels(GRRotation rot) {
+  switch (rot) {
+    case GRRotation::LEFT:
+      return kDrawKernels<AlphaByte, GRRotation::LEFT>;
+    case GRRotation::RIGHT:
+      return kDrawKernels<AlphaByte, GRRotation::RIGHT>;
+    case GRRotation::DOWN:
+      return kDrawKernels<AlphaByte, GRRotation::DOWN>;
+    default:  // GRRotation::NONE
+      return kDrawKernels<AlphaByte, GRRotation::NONE>;
   }
 }
 
+static DrawKernels draw_kernels = kDrawKernels<3, GRRotation::NONE>;
+
+// Picks the draw kernels for the current pixel format and rotation.
+static void SelectDrawKernels() {
+  draw_kernels = get_alpha_shift() == 0 ? GetDrawKernels<0>(rotation) : GetDrawKernels<3>(rotation);
+}
+
+// The coverage of recently drawn text lines, assembled from the font glyphs, so that gr_text() can
+// blend a line in one go (in long rows, which vectorize well) instead of glyph by glyph. The most
+// recently used lines are kept, up to kTextLineCacheBytes.
+static constexpr size_t kTextLineCacheBytes = 4 * 1024 * 1024;
+
+using TextLineKey = std::tuple<const GRFont*, bool, std::string>;
+struct TextLine {
+  TextLineKey key;
+  std::unique_ptr<GRSurface> surface;
+};
+static std::list<TextLine> text_lines;  // Most recently used first.
+static std::map<TextLineKey, std::list<TextLine>::iterator> text_line_index;
+static size_t text_lines_bytes = 0;
+
+static void ClearTextLineCache() {
+  text_line_index.clear();
+  text_lines.clear();
+  text_lines_bytes = 0;
+}
+
+// Returns the coverage of |text| (printable characters only) in the given font, or nullptr on
+// errors.
+static const GRSurface* GetTextLine(const GRFont* font, bool bold, const std::string& text) {
+  TextLineKey key(font, bold, text);
+  if (auto it = text_line_index.find(key); it != text_line_index.end()) {
+    text_lines.splice(text_lines.begin(), text_lines, it->second);
+    return it->second->surface.get();
+  }
+
+  size_t width = text.size() * font->char_width;
+  auto surface = GRSurface::Create(width, font->char_height, width, 1);
+  if (!surface) {
+    return nullptr;
+  }
+  const uint8_t* glyphs =
+      font->texture->data() + (bold ? font->char_height * font->texture->row_bytes : 0);
+  for (int j = 0; j < font->char_height; ++j) {
+    uint8_t* dst = surface->data() + j * width;
+    const uint8_t* src = glyphs + j * font->texture->row_bytes;
+    for (size_t i = 0; i < text.size(); ++i) {
+      memcpy(dst + i * font->char_width, src + (text[i] - ' ') * font->char_width,
+             font->char_width);
+    }
+  }
+
+  text_lines_bytes += surface->data_size();
+  text_lines.push_front({ key, std::move(surface) });
+  text_line_index.emplace(std::move(key), text_lines.begin());
+  while (text_lines_bytes > kTextLineCacheBytes && text_lines.size() > 1) {
+    text_lines_bytes -= text_lines.back().surface->data_size();
+    text_line_index.erase(text_lines.back().key);
+    text_lines.pop_back();
+  }
+  return text_lines.front().surface.get();
+}
+
 void gr_text(const GRFont* font, int x, int y, const char* s, bool bold) {
   if (!font || !font->texture || (gr_current & get_alphamask()) == 0) return;
 
@@ -217,24 +337,26 @@ void gr_text(const GRFont* font, int x, int y, const char* s, bool bold) {
   x += overscan_offset_x;
   y += overscan_offset_y;
 
+  // Take the characters up to the first one that doesn't fit on the screen.
+  std::string text;
   unsigned char ch;
-  while ((ch = *s++)) {
-    if (outside(x, y) || outside(x + font->char_width - 1, y + font->char_height - 1)) break;
+  for (int cx = x; (ch = *s++); cx += font->char_width) {
+    if (outside(cx, y) || outside(cx + font->char_width - 1, y + font->char_height - 1)) break;
 
     if (ch < ' ' || ch > '~') {
       ch = '?';
     }
+    text.push_back(ch);
+  }
+  if (text.empty()) return;
 
-    int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
-    const uint8_t* src_p = font->texture->data() + ((ch - ' ') * font->char_width) +
-                           (bold ? font->char_height * font->texture->row_bytes : 0);
-    uint32_t* dst_p = PixelAt(gr_draw, x, y, row_pixels);
-
-    TextBlend(src_p, font->texture->row_bytes, dst_p, row_pixels, font->char_width,
-              font->char_height);
+  const GRSurface* line = GetTextLine(font, bold, text);
+  if (line == nullptr) return;
 
-    x += font->char_width;
-  }
+  int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
+  uint32_t* dst_p = PixelAt(gr_draw, x, y, row_pixels);
+  draw_kernels.text_blend(line->data(), line->row_bytes, dst_p, row_pixels, line->width,
+                          line->height);
 }
 
 void gr_texticon(int x, int y, const GRSurface* icon) {
@@ -253,7 +375,7 @@ void gr_texticon(int x, int y, const GRSurface* icon) {
   int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
   const uint8_t* src_p = icon->data();
   uint32_t* dst_p = PixelAt(gr_draw, x, y, row_pixels);
-  TextBlend(src_p, icon->row_bytes, dst_p, row_pixels, icon->width, icon->height);
+  draw_kernels.text_blend(src_p, icon->row_bytes, dst_p, row_pixels, icon->width, icon->height);
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
@@ -298,14 +420,7 @@ void gr_fill(int x1, int y1, int x2, int y2) {
   uint32_t* p = PixelAt(gr_draw, x1, y1, row_pixels);
   uint8_t alpha = get_alpha(gr_current);
   if (alpha > 0) {
-    for (int y = y1; y < y2; ++y) {
-      uint32_t* px = p;
-      for (int x = x1; x < x2; ++x) {
-        *px = pixel_blend(alpha, *px);
-        incr_x(&px, row_pixels);
-      }
-      incr_y(&p, row_pixels);
-    }
+    draw_kernels.fill(p, row_pixels, x2 - x1, y2 - y1, alpha);
   }
 }
 
@@ -322,33 +437,12 @@ void gr_blit(const GRSurface* source, int sx, int sy, int w, int h, int dx, int
 
   if (outside(dx, dy) || outside(dx + w - 1, dy + h - 1)) return;
 
-  if (rotation != GRRotation::NONE) {
-    int src_row_pixels = source->row_bytes / source->pixel_bytes;
-    int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
-    const uint32_t* src_py =
-        reinterpret_cast<const uint32_t*>(source->data()) + sy * source->row_bytes / 4 + sx;
-    uint32_t* dst_py = PixelAt(gr_draw, dx, dy, row_pixels);
-
-    for (int y = 0; y < h; y += 1) {
-      const uint32_t* src_px = src_py;
-      uint32_t* dst_px = dst_py;
-      for (int x = 0; x < w; x += 1) {
-        *dst_px = *src_px++;
-        incr_x(&dst_px, row_pixels);
-      }
-      src_py += src_row_pixels;
-      incr_y(&dst_py, row_pixels);
-    }
-  } else {
-    const uint8_t* src_p = source->data() + sy * source->row_bytes + sx * source->pixel_bytes;
-    uint8_t* dst_p = gr_draw->data() + dy * gr_draw->row_bytes + dx * gr_draw->pixel_bytes;
-
-    for (int i = 0; i < h; ++i) {
-      memcpy(dst_p, src_p, w * source->pixel_bytes);
-      src_p += source->row_bytes;
-      dst_p += gr_draw->row_bytes;
-    }
-  }
+  int src_row_pixels = source->row_bytes / source->pixel_bytes;
+  int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
+  const uint32_t* src_p =
+      reinterpret_cast<const uint32_t*>(source->data()) + sy * src_row_pixels + sx;
+  uint32_t* dst_p = PixelAt(gr_draw, dx, dy, row_pixels);
+  draw_kernels.blit(src_p, src_row_pixels, dst_p, row_pixels, w, h);
 }
 
 unsigned int gr_get_width(const GRSurface* surface) {
@@ -383,15 +477,99 @@ int gr_init_font(const char* name, GRFont** dest) {
   font->char_width = font->texture->width / 96;
   font->char_height = font->texture->height / 2;
 
+  // The new font may take the address of one that's gone.
+  ClearTextLineCache();
+
   *dest = font;
 
   return 0;
 }
 
+// Copies the columns [x, x + width) of gr_draw, over its full height, to dst_x, clipped to the
+// screen.
+static void CopyColumns(int x, int width, int dst_x) {
+  x += overscan_offset_x;
+  dst_x += overscan_offset_x;
+  if (x < 0) {
+    width += x;
+    dst_x -= x;
+    x = 0;
+  }
+  if (dst_x < 0) {
+    width += dst_x;
+    x -= dst_x;
+    dst_x = 0;
+  }
+  int screen_width = gr_fb_width_real();
+  int screen_height = gr_fb_height_real();
+  width = std::min({ width, screen_width - x, screen_width - dst_x });
+  if (width <= 0 || x == dst_x) return;
+
+  int row_pixels = gr_draw->row_bytes / gr_draw->pixel_bytes;
+  for (int y = 0; y < screen_height; ++y) {
+    if (rotation == GRRotation::NONE) {
+      memmove(PixelAt(gr_draw, dst_x, y, row_pixels), PixelAt(gr_draw, x, y, row_pixels),
+              width * sizeof(uint32_t));
+      continue;
+    }
+    // A rotated row isn't contiguous; copy away from the overlap, if any.
+    for (int i = 0; i < width; ++i) {
+      int col = dst_x > x ? width - 1 - i : i;
+      *PixelAt(gr_draw, dst_x + col, y, row_pixels) = *PixelAt(gr_draw, x + col, y, row_pixels);
+    }
+  }
+}
+
+void gr_mirror(int x, int width, int dst_x) {
+  mirror_x = x;
+  mirror_width = width;
+  mirror_dst_x = dst_x;
+}
+
 void gr_flip() {
+  if (mirror_width > 0 && gr_draw) {
+    CopyColumns(mirror_x, mirror_width, mirror_dst_x);
+  }
   gr_draw = gr_backend->Flip();
 }
 
+int gr_overlay_init(int width, int height) {
+  // Overlays are drawn unrotated; the planes could rotate them, but not all of them can.
+  if (!gr_backend || rotation != GRRotation::NONE || width <= 0 || height <= 0) return -1;
+  return gr_backend->InitOverlay(width, height);
+}
+
+void gr_overlay_begin(int overlay) {
+  GRSurface* surface = gr_backend->OverlaySurface(overlay);
+  if (surface == nullptr || gr_screen != nullptr) {
+    printf("gr_overlay_begin: invalid overlay %d\n", overlay);
+    return;
+  }
+  gr_screen = gr_draw;
+  screen_offset_x = std::exchange(overscan_offset_x, 0);
+  screen_offset_y = std::exchange(overscan_offset_y, 0);
+  gr_draw = surface;
+}
+
+void gr_overlay_end() {
+  if (gr_screen == nullptr) return;
+  gr_draw = std::exchange(gr_screen, nullptr);
+  overscan_offset_x = screen_offset_x;
+  overscan_offset_y = screen_offset_y;
+}
+
+void gr_overlay_show(int overlay, int x, int y) {
+  gr_backend->SetOverlay(overlay, true, x + overscan_offset_x, y + overscan_offset_y);
+}
+
+void gr_overlay_hide(int overlay) {
+  gr_backend->SetOverlay(overlay, false, 0, 0);
+}
+
+void gr_flip_overlays() {
+  if (gr_backend) gr_backend->FlipOverlays();
+}
+
 std::unique_ptr<MinuiBackend> create_backend(GraphicsBackend backend) {
   switch (backend) {
     case GraphicsBackend::DRM:
@@ -407,22 +585,10 @@ int gr_init() {
   return gr_init(default_backends);
 }
 
-int gr_init(std::initializer_list<GraphicsBackend> backends) {
-  // pixel_format needs to be set before loading any resources or initializing backends.
-  std::string format = android::base::GetProperty("ro.minui.pixel_format", "");
-  if (format == "ABGR_8888") {
-    pixel_format = PixelFormat::ABGR;
-  } else if (format == "RGBX_8888") {
-    pixel_format = PixelFormat::RGBX;
-  } else if (format == "ARGB_8888") {
-    pixel_format = PixelFormat::ARGB;
-  } else if (format == "BGRA_8888") {
-    pixel_format = PixelFormat::BGRA;
-  } else if (format == "RGBA_8888") {
-    pixel_format = PixelFormat::RGBA;
-  } else {
-    pixel_format = PixelFormat::UNKNOWN;
-  }
+// Sets the pixel format and loads the fonts, which need to come before initializing the backend.
+static void InitPixelFormatAndFonts(PixelFormat format) {
+  pixel_format = format;
+  SelectDrawKernels();
 
   int ret = gr_init_font("font", &gr_font);
   if (ret != 0) {
@@ -434,22 +600,10 @@ int gr_init(std::initializer_list<GraphicsBackend> backends) {
     printf("Failed to init menu font: %d. Falling back to system font\n", ret);
     gr_font_menu = gr_font;
   }
+}
 
-  std::unique_ptr<MinuiBackend> minui_backend;
-  for (GraphicsBackend backend : backends) {
-    minui_backend = create_backend(backend);
-    if (!minui_backend) {
-      printf("gr_init: minui_backend %d is a nullptr\n", backend);
-      continue;
-    }
-    gr_draw = minui_backend->Init();
-    if (gr_draw) break;
-  }
-
-  if (!gr_draw) {
-    return -1;
-  }
-
+// Takes the backend that gr_draw was initialized from, and sets up the screen on it.
+static int InitScreen(std::unique_ptr<MinuiBackend> minui_backend) {
   gr_backend = minui_backend.release();
 
   int overscan_percent = android::base::GetIntProperty("ro.minui.overscan_percent", 0);
@@ -494,12 +648,61 @@ int gr_init(std::initializer_list<GraphicsBackend> backends) {
   return 0;
 }
 
+static PixelFormat GetPixelFormatProperty() {
+  std::string format = android::base::GetProperty("ro.minui.pixel_format", "");
+  if (format == "ABGR_8888") {
+    return PixelFormat::ABGR;
+  } else if (format == "RGBX_8888") {
+    return PixelFormat::RGBX;
+  } else if (format == "ARGB_8888") {
+    return PixelFormat::ARGB;
+  } else if (format == "BGRA_8888") {
+    return PixelFormat::BGRA;
+  } else if (format == "RGBA_8888") {
+    return PixelFormat::RGBA;
+  }
+  return PixelFormat::UNKNOWN;
+}
+
+int gr_init(std::initializer_list<GraphicsBackend> backends) {
+  InitPixelFormatAndFonts(GetPixelFormatProperty());
+
+  std::unique_ptr<MinuiBackend> minui_backend;
+  for (GraphicsBackend backend : backends) {
+    minui_backend = create_backend(backend);
+    if (!minui_backend) {
+      printf("gr_init: minui_backend %d is a nullptr\n", backend);
+      continue;
+    }
+    gr_draw = minui_backend->Init();
+    if (gr_draw) break;
+  }
+
+  if (!gr_draw) {
+    return -1;
+  }
+  return InitScreen(std::move(minui_backend));
+}
+
+int gr_init_offscreen(size_t width, size_t height, PixelFormat format) {
+  InitPixelFormatAndFonts(format);
+
+  auto minui_backend = std::make_unique<MinuiBackendMemory>(width, height);
+  gr_draw = minui_backend->Init();
+  if (!gr_draw) {
+    return -1;
+  }
+  return InitScreen(std::move(minui_backend));
+}
+
 void gr_exit() {
   delete gr_backend;
   gr_backend = nullptr;
 
   delete gr_font;
   gr_font = nullptr;
+
+  ClearTextLineCache();
 }
 
 int gr_fb_width() {
@@ -546,6 +749,7 @@ void gr_fb_blank(bool blank, int index) {
 
 void gr_rotate(GRRotation rot) {
   rotation = rot;
+  SelectDrawKernels();
 }
 
 void gr_rotate_touch(GRRotation rot) {
@@ -43,6 +43,25 @@ class MinuiBackend {
   // Return true if the device supports multiple connectors.
   virtual bool HasMultipleConnectors() = 0;
 
+  // Sets up a hardware overlay plane for a surface of the given size, and returns its index, or -1
+  // if there's none left. Backends without overlay planes keep the default.
+  virtual int InitOverlay(size_t /* width */, size_t /* height */) {
+    return -1;
+  }
+
+  // Returns the surface to draw the next contents of the given overlay into.
+  virtual GRSurface* OverlaySurface(int /* overlay */) {
+    return nullptr;
+  }
+
+  // Has the next FlipOverlays() show the contents drawn into the given overlay's surface since the
+  // last one, with its top-left corner at (x, y) of the display; or hide it, if |visible| is false.
+  virtual void SetOverlay(int /* overlay */, bool /* visible */, int /* x */, int /* y */) {}
+
+  // Applies the updates made by SetOverlay() since the last call, all at once, without flipping
+  // the screen.
+  virtual void FlipOverlays() {}
+
   // Device cleanup when drawing is done.
   virtual ~MinuiBackend() = default;
 };
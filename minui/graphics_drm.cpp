@@ -20,10 +20,12 @@
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 
 #include <android-base/macros.h>
@@ -76,24 +78,28 @@ static int drm_format_to_bpp(uint32_t format) {
   }
 }
 
-std::unique_ptr<GRSurfaceDrm> GRSurfaceDrm::Create(int drm_fd, int width, int height) {
-  uint32_t format;
+// Returns the DRM format of the buffers, for the pixel format of minui.
+static uint32_t DrmFormat() {
   PixelFormat pixel_format = gr_pixel_format();
   // PixelFormat comes in byte order, whereas DRM_FORMAT_* uses little-endian
   // (external/libdrm/include/drm/drm_fourcc.h). Note that although drm_fourcc.h also defines a
   // macro of DRM_FORMAT_BIG_ENDIAN, it doesn't seem to be actually supported (see the discussion
   // in https://lists.freedesktop.org/archives/amd-gfx/2017-May/008560.html).
   if (pixel_format == PixelFormat::ABGR) {
-    format = DRM_FORMAT_RGBA8888;
+    return DRM_FORMAT_RGBA8888;
   } else if (pixel_format == PixelFormat::BGRA) {
-    format = DRM_FORMAT_ARGB8888;
+    return DRM_FORMAT_ARGB8888;
   } else if (pixel_format == PixelFormat::RGBX) {
-    format = DRM_FORMAT_XBGR8888;
+    return DRM_FORMAT_XBGR8888;
   } else if (pixel_format == PixelFormat::ARGB) {
-    format = DRM_FORMAT_BGRA8888;
+    return DRM_FORMAT_BGRA8888;
   } else {
-    format = DRM_FORMAT_RGB565;
+    return DRM_FORMAT_RGB565;
   }
+}
+
+std::unique_ptr<GRSurfaceDrm> GRSurfaceDrm::Create(int drm_fd, int width, int height) {
+  uint32_t format = DrmFormat();
 
   drm_mode_create_dumb create_dumb = {};
   create_dumb.height = height;
@@ -170,7 +176,7 @@ void MinuiBackendDrm::Blank(bool blank) {
 }
 
 void MinuiBackendDrm::Blank(bool blank, DrmConnector index) {
-  const auto* drmInterface = &drm[DRM_MAIN];
+  auto* drmInterface = &drm[DRM_MAIN];
 
   switch (index) {
     case DRM_MAIN:
@@ -189,12 +195,25 @@ void MinuiBackendDrm::Blank(bool blank, DrmConnector index) {
     return;
   }
 
+  WaitForPageFlip(&drmInterface->flip_pending);
+
   if (blank) {
     DrmDisableCrtc(drm_fd, drmInterface->monitor_crtc);
   } else {
+    // Show the latest shadow contents, and move on to the next buffer for drawing.
+    SyncCurrentBuffer(index);
     DrmEnableCrtc(drm_fd, drmInterface->monitor_crtc,
                   drmInterface->GRSurfaceDrms[drmInterface->current_buffer],
                   &drmInterface->monitor_connector->connector_id);
+    drmInterface->current_buffer = (drmInterface->current_buffer + 1) % kNumBuffers;
+
+    // Disabling the CRTC took its planes off as well; the next FlipOverlays() puts them back.
+    if (index == DRM_MAIN) {
+      for (auto& overlay : overlays) {
+        overlay.on_screen = false;
+        overlay.pending = overlay.visible;
+      }
+    }
 
     active_display = index;
   }
@@ -387,15 +406,21 @@ GRSurface* MinuiBackendDrm::Init() {
       int width = drm[i].monitor_crtc->mode.hdisplay;
       int height = drm[i].monitor_crtc->mode.vdisplay;
 
-      drm[i].GRSurfaceDrms[0] = GRSurfaceDrm::Create(drm_fd, width, height);
-      drm[i].GRSurfaceDrms[1] = GRSurfaceDrm::Create(drm_fd, width, height);
-      if (!drm[i].GRSurfaceDrms[0] || !drm[i].GRSurfaceDrms[1]) {
-        fprintf(stderr, "Failed to create GRSurfaceDrm, drm index=%d\n", i);
-        drmModeFreeResources(res);
-        return nullptr;
+      for (auto& surface : drm[i].GRSurfaceDrms) {
+        surface = GRSurfaceDrm::Create(drm_fd, width, height);
+        if (!surface) {
+          fprintf(stderr, "Failed to create GRSurfaceDrm, drm index=%d\n", i);
+          drmModeFreeResources(res);
+          return nullptr;
+        }
       }
 
       drm[i].current_buffer = 0;
+      if (!CreateShadow(i)) {
+        fprintf(stderr, "Failed to create the shadow surface, drm index=%d\n", i);
+        drmModeFreeResources(res);
+        return nullptr;
+      }
     }
   }
 
@@ -404,12 +429,31 @@ GRSurface* MinuiBackendDrm::Init() {
   drmModeFreeResources(res);
 
   // We will likely encounter errors in the backend functions (i.e. Flip) if EnableCrtc fails.
-  if (!DrmEnableCrtc(drm_fd, drm[DRM_MAIN].monitor_crtc, drm[DRM_MAIN].GRSurfaceDrms[1],
+  if (!DrmEnableCrtc(drm_fd, drm[DRM_MAIN].monitor_crtc,
+                     drm[DRM_MAIN].GRSurfaceDrms[kNumBuffers - 1],
                      &drm[DRM_MAIN].monitor_connector->connector_id)) {
     return nullptr;
   }
 
-  return drm[DRM_MAIN].GRSurfaceDrms[0].get();
+  return drm[DRM_MAIN].shadow.get();
+}
+
+bool MinuiBackendDrm::CreateShadow(int index) {
+  DrmInterface* display = &drm[index];
+  const auto& buffer = display->GRSurfaceDrms[0];
+  display->shadow =
+      GRSurface::Create(buffer->width, buffer->height, buffer->row_bytes, buffer->pixel_bytes);
+  if (!display->shadow) {
+    return false;
+  }
+  memset(display->shadow->data(), 0, buffer->row_bytes * buffer->height);
+  return display->damage.Init(*display->shadow, kNumBuffers);
+}
+
+void MinuiBackendDrm::SyncCurrentBuffer(int index) {
+  DrmInterface* display = &drm[index];
+  display->damage.Sync(*display->shadow, display->GRSurfaceDrms[display->current_buffer]->data(),
+                       display->current_buffer);
 }
 
 static void page_flip_complete(__unused int fd,
@@ -420,24 +464,8 @@ static void page_flip_complete(__unused int fd,
   *static_cast<bool*>(user_data) = false;
 }
 
-GRSurface* MinuiBackendDrm::Flip() {
-  GRSurface* surface = NULL;
-  DrmInterface* current_drm = &drm[active_display];
-  bool ongoing_flip = true;
-
-  if (!current_drm->monitor_connector) {
-    fprintf(stderr, "Unsupported. active_display = %d\n", active_display);
-    return nullptr;
-  }
-
-  if (drmModePageFlip(drm_fd, current_drm->monitor_crtc->crtc_id,
-                      current_drm->GRSurfaceDrms[current_drm->current_buffer]->fb_id,
-                      DRM_MODE_PAGE_FLIP_EVENT, &ongoing_flip) != 0) {
-    fprintf(stderr, "Failed to drmModePageFlip, active_display=%d", active_display);
-    return nullptr;
-  }
-
-  while (ongoing_flip) {
+void MinuiBackendDrm::WaitForPageFlip(bool* flip_pending) {
+  while (*flip_pending) {
     struct pollfd fds = {
       .fd = drm_fd,
       .events = POLLIN
@@ -458,15 +486,231 @@ GRSurface* MinuiBackendDrm::Flip() {
       break;
     }
   }
+  *flip_pending = false;
+}
 
-  current_drm->current_buffer = 1 - current_drm->current_buffer;
-  surface = current_drm->GRSurfaceDrms[current_drm->current_buffer].get();
-  return surface;
+GRSurface* MinuiBackendDrm::Flip() {
+  DrmInterface* current_drm = &drm[active_display];
+
+  if (!current_drm->monitor_connector) {
+    fprintf(stderr, "Unsupported. active_display = %d\n", active_display);
+    return nullptr;
+  }
+
+  // The current buffer is neither on screen nor pending a flip, so it can be updated while the
+  // previous flip completes.
+  SyncCurrentBuffer(active_display);
+
+  // Only one flip can be queued at a time. This only waits when drawing faster than the display
+  // refreshes.
+  WaitForPageFlip(&current_drm->flip_pending);
+
+  if (drmModePageFlip(drm_fd, current_drm->monitor_crtc->crtc_id,
+                      current_drm->GRSurfaceDrms[current_drm->current_buffer]->fb_id,
+                      DRM_MODE_PAGE_FLIP_EVENT, &current_drm->flip_pending) != 0) {
+    fprintf(stderr, "Failed to drmModePageFlip, active_display=%d", active_display);
+    return nullptr;
+  }
+  current_drm->flip_pending = true;
+
+  // The next buffer in the ring went off screen when the previous flip completed, so it's free to
+  // be synced by the next Flip(). minui keeps drawing into the shadow surface.
+  current_drm->current_buffer = (current_drm->current_buffer + 1) % kNumBuffers;
+  return current_drm->shadow.get();
+}
+
+static constexpr const char* kOverlayProperties[] = {
+  "FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H", "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+};
+
+// Looks up the properties of the given plane by the names in |names|, putting their ids into
+// |property_ids| (0 for the missing ones). Returns the value of its "type" property, or -1 if it
+// has none.
+static int64_t GetPlaneProperties(int fd, uint32_t plane_id, const char* const* names,
+                                  size_t count, uint32_t* property_ids) {
+  int64_t type = -1;
+  drmModeObjectProperties* properties =
+      drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+  if (!properties) {
+    return type;
+  }
+  for (uint32_t i = 0; i < properties->count_props; i++) {
+    drmModePropertyRes* property = drmModeGetProperty(fd, properties->props[i]);
+    if (!property) continue;
+    if (strcmp(property->name, "type") == 0) {
+      type = properties->prop_values[i];
+    }
+    for (size_t j = 0; j < count; j++) {
+      if (strcmp(property->name, names[j]) == 0) {
+        property_ids[j] = property->prop_id;
+      }
+    }
+    drmModeFreeProperty(property);
+  }
+  drmModeFreeObjectProperties(properties);
+  return type;
+}
+
+uint32_t MinuiBackendDrm::FindOverlayPlane(uint32_t crtc_id, uint32_t* property_ids) {
+  // Planes name the CRTCs they can be used with by index.
+  int crtc_index = -1;
+  if (drmModeRes* res = drmModeGetResources(drm_fd); res) {
+    for (int i = 0; i < res->count_crtcs; i++) {
+      if (res->crtcs[i] == crtc_id) crtc_index = i;
+    }
+    drmModeFreeResources(res);
+  }
+  drmModePlaneRes* plane_res = drmModeGetPlaneResources(drm_fd);
+  if (crtc_index == -1 || !plane_res) {
+    if (plane_res) drmModeFreePlaneResources(plane_res);
+    return 0;
+  }
+
+  uint32_t format = DrmFormat();
+  uint32_t found = 0;
+  for (uint32_t i = 0; i < plane_res->count_planes && found == 0; i++) {
+    drmModePlane* plane = drmModeGetPlane(drm_fd, plane_res->planes[i]);
+    if (!plane) continue;
+    bool usable = (plane->possible_crtcs & (1u << crtc_index)) && plane->crtc_id == 0 &&
+                  std::find(plane->formats, plane->formats + plane->count_formats, format) !=
+                      plane->formats + plane->count_formats &&
+                  std::none_of(overlays.begin(), overlays.end(), [plane](const Overlay& overlay) {
+                    return overlay.plane_id == plane->plane_id;
+                  });
+    if (usable &&
+        GetPlaneProperties(drm_fd, plane->plane_id, kOverlayProperties, OVERLAY_PROPERTY_MAX,
+                           property_ids) == DRM_PLANE_TYPE_OVERLAY &&
+        std::find(property_ids, property_ids + OVERLAY_PROPERTY_MAX, 0) ==
+            property_ids + OVERLAY_PROPERTY_MAX) {
+      found = plane->plane_id;
+    }
+    drmModeFreePlane(plane);
+  }
+  drmModeFreePlaneResources(plane_res);
+  return found;
+}
+
+int MinuiBackendDrm::InitOverlay(size_t width, size_t height) {
+  DrmInterface* display = &drm[DRM_MAIN];
+  if (!display->monitor_crtc) {
+    return -1;
+  }
+  // Overlay planes are only listed to clients that take universal planes, and atomic commits
+  // update them together with their positions.
+  if (drmSetClientCap(drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0 ||
+      drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1) != 0) {
+    fprintf(stderr, "No atomic modesetting, overlays unavailable\n");
+    return -1;
+  }
+
+  Overlay overlay;
+  overlay.plane_id = FindOverlayPlane(display->monitor_crtc->crtc_id, overlay.property_ids);
+  if (overlay.plane_id == 0) {
+    fprintf(stderr, "No overlay plane left for %zu x %zu\n", width, height);
+    return -1;
+  }
+  for (auto& surface : overlay.GRSurfaceDrms) {
+    surface = GRSurfaceDrm::Create(drm_fd, width, height);
+    if (!surface) {
+      fprintf(stderr, "Failed to create the overlay buffers\n");
+      return -1;
+    }
+  }
+  const auto& buffer = overlay.GRSurfaceDrms[0];
+  overlay.shadow =
+      GRSurface::Create(buffer->width, buffer->height, buffer->row_bytes, buffer->pixel_bytes);
+  if (!overlay.shadow || !overlay.damage.Init(*overlay.shadow, kNumBuffers)) {
+    fprintf(stderr, "Failed to create the overlay shadow surface\n");
+    return -1;
+  }
+  memset(overlay.shadow->data(), 0, buffer->row_bytes * buffer->height);
+
+  printf("Overlay %zu (%zu x %zu) on plane %u\n", overlays.size(), width, height,
+         overlay.plane_id);
+  overlays.push_back(std::move(overlay));
+  return overlays.size() - 1;
+}
+
+GRSurface* MinuiBackendDrm::OverlaySurface(int overlay) {
+  if (overlay < 0 || overlay >= overlays.size()) {
+    return nullptr;
+  }
+  return overlays[overlay].shadow.get();
+}
+
+void MinuiBackendDrm::SetOverlay(int overlay, bool visible, int x, int y) {
+  if (overlay < 0 || overlay >= overlays.size()) {
+    fprintf(stderr, "Invalid overlay %d\n", overlay);
+    return;
+  }
+  auto& update = overlays[overlay];
+  update.pending = visible || update.on_screen;
+  update.visible = visible;
+  update.x = x;
+  update.y = y;
+}
+
+void MinuiBackendDrm::FlipOverlays() {
+  // The overlays are on the main display; they wait for it to be the active one again.
+  DrmInterface* display = &drm[DRM_MAIN];
+  if (active_display != DRM_MAIN ||
+      std::none_of(overlays.begin(), overlays.end(),
+                   [](const Overlay& overlay) { return overlay.pending; })) {
+    return;
+  }
+
+  drmModeAtomicReq* req = drmModeAtomicAlloc();
+  if (!req) {
+    fprintf(stderr, "Failed to drmModeAtomicAlloc\n");
+    return;
+  }
+  for (auto& overlay : overlays) {
+    if (!overlay.pending) continue;
+    const uint32_t* ids = overlay.property_ids;
+    overlay.pending = false;
+    overlay.on_screen = overlay.visible;
+    if (!overlay.visible) {
+      drmModeAtomicAddProperty(req, overlay.plane_id, ids[FB_ID], 0);
+      drmModeAtomicAddProperty(req, overlay.plane_id, ids[CRTC_ID], 0);
+      continue;
+    }
+
+    // As in Flip(), the current buffer is neither on screen nor pending.
+    const auto& buffer = overlay.GRSurfaceDrms[overlay.current_buffer];
+    overlay.damage.Sync(*overlay.shadow, buffer->data(), overlay.current_buffer);
+    overlay.current_buffer = (overlay.current_buffer + 1) % kNumBuffers;
+
+    uint64_t values[OVERLAY_PROPERTY_MAX] = {};
+    values[FB_ID] = buffer->fb_id;
+    values[CRTC_ID] = display->monitor_crtc->crtc_id;
+    // The source rectangle is in 16.16 fixed point.
+    values[SRC_W] = static_cast<uint64_t>(buffer->width) << 16;
+    values[SRC_H] = static_cast<uint64_t>(buffer->height) << 16;
+    // CRTC_X and CRTC_Y are signed.
+    values[CRTC_X] = static_cast<uint64_t>(static_cast<int64_t>(overlay.x));
+    values[CRTC_Y] = static_cast<uint64_t>(static_cast<int64_t>(overlay.y));
+    values[CRTC_W] = buffer->width;
+    values[CRTC_H] = buffer->height;
+    for (int i = 0; i < OVERLAY_PROPERTY_MAX; i++) {
+      drmModeAtomicAddProperty(req, overlay.plane_id, ids[i], values[i]);
+    }
+  }
+
+  // Only one flip can be queued at a time, be it of the screen or the overlays.
+  WaitForPageFlip(&display->flip_pending);
+  if (drmModeAtomicCommit(drm_fd, req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+                          &display->flip_pending) != 0) {
+    perror("Failed to drmModeAtomicCommit");
+  } else {
+    display->flip_pending = true;
+  }
+  drmModeAtomicFree(req);
 }
 
 MinuiBackendDrm::~MinuiBackendDrm() {
   for (int i = 0; i < DRM_MAX; i++) {
     if (drm[i].monitor_connector) {
+      WaitForPageFlip(&drm[i].flip_pending);
       DrmDisableCrtc(drm_fd, drm[i].monitor_crtc);
       drmModeFreeCrtc(drm[i].monitor_crtc);
       drmModeFreeConnector(drm[i].monitor_connector);
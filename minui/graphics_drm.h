@@ -20,11 +20,13 @@
 #include <stdint.h>
 
 #include <memory>
+#include <vector>
 
 #include <xf86drmMode.h>
 
 #include "graphics.h"
 #include "minui/minui.h"
+#include "private/frame_damage.h"
 
 class GRSurfaceDrm : public GRSurface {
  public:
@@ -61,22 +63,82 @@ class MinuiBackendDrm : public MinuiBackend {
   void Blank(bool) override;
   void Blank(bool blank, DrmConnector index) override;
   bool HasMultipleConnectors() override;
+  int InitOverlay(size_t width, size_t height) override;
+  GRSurface* OverlaySurface(int overlay) override;
+  void SetOverlay(int overlay, bool visible, int x, int y) override;
+  void FlipOverlays() override;
 
  private:
   void DrmDisableCrtc(int drm_fd, drmModeCrtc* crtc);
+  // Waits for the page flip queued by the last Flip() on the given display, if any.
+  void WaitForPageFlip(bool* flip_pending);
   bool DrmEnableCrtc(int drm_fd, drmModeCrtc* crtc, const std::unique_ptr<GRSurfaceDrm>& surface,
                      uint32_t* conntcors);
   void DisableNonMainCrtcs(int fd, drmModeRes* resources, drmModeCrtc* main_crtc);
   bool FindAndSetMonitor(int fd, drmModeRes* resources);
+  // Allocates the shadow surface of the given display, once its buffers have been created.
+  bool CreateShadow(int index);
+  // Copies the rows of the shadow surface that the current buffer is missing into it.
+  void SyncCurrentBuffer(int index);
+  // Returns a free overlay plane of the given CRTC that takes the pixel format of the buffers, and
+  // the ids of its properties, or 0 if there's none.
+  uint32_t FindOverlayPlane(uint32_t crtc_id, uint32_t* property_ids);
+
+  // Triple buffering: one buffer on screen, one waiting for its flip, and one to draw into. Flip()
+  // then returns without waiting for the vblank, unless the previous flip is still pending.
+  static constexpr int kNumBuffers = 3;
 
   struct DrmInterface {
-    std::unique_ptr<GRSurfaceDrm> GRSurfaceDrms[2];
+    std::unique_ptr<GRSurfaceDrm> GRSurfaceDrms[kNumBuffers];
+    // The buffer being drawn into. The one before it (in a ring) is on screen, or about to be if
+    // flip_pending is set.
     int current_buffer{ 0 };
+    bool flip_pending{ false };
     drmModeCrtc* monitor_crtc{ nullptr };
     drmModeConnector* monitor_connector{ nullptr };
     uint32_t selected_mode{ 0 };
+
+    // Dumb buffers are usually write-combined (or uncached) memory, which is very slow to read, and
+    // blending reads every pixel it writes. So minui draws into |shadow|, which is cached memory
+    // laid out as the buffers, and only the changed rows get streamed into the buffers.
+    std::unique_ptr<GRSurface> shadow;
+    FrameDamage damage;
   } drm[DRM_MAX];
 
+  // The plane properties that FlipOverlays() sets, by name; see kOverlayProperties.
+  enum OverlayProperty {
+    FB_ID,
+    CRTC_ID,
+    SRC_X,
+    SRC_Y,
+    SRC_W,
+    SRC_H,
+    CRTC_X,
+    CRTC_Y,
+    CRTC_W,
+    CRTC_H,
+    OVERLAY_PROPERTY_MAX,
+  };
+
+  // An overlay plane of the main display, which gets updated by atomic commits. It has its own
+  // buffers and shadow surface, used in the same way as those of the screen.
+  struct Overlay {
+    uint32_t plane_id{ 0 };
+    uint32_t property_ids[OVERLAY_PROPERTY_MAX]{};
+    std::unique_ptr<GRSurfaceDrm> GRSurfaceDrms[kNumBuffers];
+    int current_buffer{ 0 };
+    std::unique_ptr<GRSurface> shadow;
+    FrameDamage damage;
+    // The update requested by SetOverlay() for the next FlipOverlays(), if |pending|.
+    bool pending{ false };
+    bool visible{ false };
+    int x{ 0 };
+    int y{ 0 };
+    // Whether the plane is enabled, as of the last FlipOverlays().
+    bool on_screen{ false };
+  };
+  std::vector<Overlay> overlays;
+
   int drm_fd{ -1 };
   DrmConnector active_display = DRM_MAIN;
 };
@@ -59,8 +59,17 @@ bool MinuiBackendFbdev::HasMultipleConnectors() {
 void MinuiBackendFbdev::SetDisplayedFramebuffer(size_t n) {
   if (n > 1 || !double_buffered) return;
 
-  vi.yres_virtual = gr_framebuffer[0]->height * 2;
   vi.yoffset = n * gr_framebuffer[0]->height;
+  if (pan_display) {
+    if (ioctl(fb_fd, FBIOPAN_DISPLAY, &vi) == 0) {
+      displayed_buffer = n;
+      return;
+    }
+    perror("FBIOPAN_DISPLAY failed, falling back to FBIOPUT_VSCREENINFO");
+    pan_display = false;
+  }
+
+  vi.yres_virtual = gr_framebuffer[0]->height * 2;
   vi.bits_per_pixel = gr_framebuffer[0]->pixel_bytes * 8;
   if (ioctl(fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
     perror("active fb swap failed");
@@ -136,12 +145,18 @@ GRSurface* MinuiBackendFbdev::Init() {
     // buffer consists of a memcpy from the buffer we allocated to the framebuffer.
     memory_buffer.resize(gr_framebuffer[1]->height * gr_framebuffer[1]->row_bytes);
     gr_framebuffer[1]->buffer_ = memory_buffer.data();
+    if (!damage.Init(*gr_framebuffer[1], 1)) {
+      fprintf(stderr, "Failed to allocate the frame damage tracking\n");
+      return nullptr;
+    }
   }
 
   gr_draw = gr_framebuffer[1].get();
   memset(gr_draw->buffer_, 0, gr_draw->height * gr_draw->row_bytes);
   fb_fd = std::move(fd);
+  // The first one sets up the virtual resolution for both buffers; flips only pan from then on.
   SetDisplayedFramebuffer(0);
+  pan_display = double_buffered;
 
   printf("framebuffer: %d (%zu x %zu)\n", fb_fd.get(), gr_draw->width, gr_draw->height);
   Blank(false);
@@ -156,8 +171,8 @@ GRSurface* MinuiBackendFbdev::Flip() {
     gr_draw = gr_framebuffer[displayed_buffer].get();
     SetDisplayedFramebuffer(1 - displayed_buffer);
   } else {
-    // Copy from the in-memory surface to the framebuffer.
-    memcpy(gr_framebuffer[0]->buffer_, gr_draw->buffer_, gr_draw->height * gr_draw->row_bytes);
+    // Copy the rows that changed from the in-memory surface to the framebuffer.
+    damage.Sync(*gr_draw, gr_framebuffer[0]->buffer_, 0);
   }
   return gr_draw;
 }
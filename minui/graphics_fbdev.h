@@ -27,6 +27,7 @@
 
 #include "graphics.h"
 #include "minui/minui.h"
+#include "private/frame_damage.h"
 
 class GRSurfaceFbdev : public GRSurface {
  public:
@@ -66,7 +67,12 @@ class MinuiBackendFbdev : public MinuiBackend {
   // Points to the current surface (i.e. one of the two gr_framebuffer's).
   GRSurfaceFbdev* gr_draw{ nullptr };
   bool double_buffered;
+  // Whether to flip with FBIOPAN_DISPLAY, which only moves the scanout offset, rather than setting
+  // the whole screen info with FBIOPUT_VSCREENINFO. Cleared if the driver doesn't support it.
+  bool pan_display{ false };
   std::vector<uint8_t> memory_buffer;
+  // Without double buffering, the rows of memory_buffer to copy to the framebuffer.
+  FrameDamage damage;
   size_t displayed_buffer{ 0 };
   fb_var_screeninfo vi;
   android::base::unique_fd fb_fd;
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "graphics_memory.h"
+
+#include <stdio.h>
+#include <string.h>
+
+GRSurface* MinuiBackendMemory::Init() {
+  for (auto& surface : surfaces_) {
+    surface = GRSurface::Create(width_, height_, width_ * 4, 4);
+    if (!surface) {
+      printf("Failed to allocate a %zux%zu surface in memory\n", width_, height_);
+      return nullptr;
+    }
+    memset(surface->data(), 0, surface->data_size());
+  }
+  current_ = 0;
+  return surfaces_[current_].get();
+}
+
+GRSurface* MinuiBackendMemory::Flip() {
+  current_ = 1 - current_;
+  return surfaces_[current_].get();
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+
+#include "graphics.h"
+#include "minui/minui.h"
+
+// A backend that draws into surfaces in memory instead of a display, e.g. to measure the drawing
+// on a device without one. Flip() only swaps the two surfaces, as a double-buffered display would.
+class MinuiBackendMemory : public MinuiBackend {
+ public:
+  MinuiBackendMemory(size_t width, size_t height) : width_(width), height_(height) {}
+  ~MinuiBackendMemory() override = default;
+
+  GRSurface* Init() override;
+  GRSurface* Flip() override;
+  void Blank(bool) override {}
+  void Blank(bool, DrmConnector) override {}
+  bool HasMultipleConnectors() override {
+    return false;
+  }
+
+ private:
+  size_t width_;
+  size_t height_;
+  std::unique_ptr<GRSurface> surfaces_[2];
+  size_t current_{ 0 };
+};
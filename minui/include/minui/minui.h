@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <string>
@@ -118,6 +119,10 @@ enum class GraphicsBackend : int {
 int gr_init();
 // Supports backend selection for minui client.
 int gr_init(std::initializer_list<GraphicsBackend> backends);
+// Initializes the graphics on a |width| x |height| screen in memory instead of a display, drawn in
+// |format|, e.g. to measure the drawing on a device without one. Returns 0 on success, or -1 on
+// error.
+int gr_init_offscreen(size_t width, size_t height, PixelFormat format);
 
 // Frees the allocated resources. The function is idempotent, and safe to be called if gr_init()
 // didn't finish successfully.
@@ -132,10 +137,31 @@ int gr_overscan_offset_y();
 GRRotation gr_touch_rotation();
 
 void gr_flip();
+// Has gr_flip() copy the columns [x, x + width) of each frame, over its full height, to dst_x of
+// the same frame first (in the coordinates of the drawing functions), e.g. for stereo displays that
+// show the same image to both eyes, so that it only needs to be drawn once. The source is read as
+// before the copy, even where the two overlap. A width of 0 turns it off.
+void gr_mirror(int x, int width, int dst_x);
 void gr_fb_blank(bool blank);
 void gr_fb_blank(bool blank, int index);
 bool gr_has_multiple_connectors();
 
+// Hardware overlays: surfaces that the display composites above the screen, so that an element
+// that changes on its own (e.g. a progress bar) can be updated without flipping the screen.
+// gr_overlay_init() sets one up for a surface of the given size, and returns its index, or -1 if
+// the backend has no (more) overlay planes, or the screen is rotated.
+int gr_overlay_init(int width, int height);
+// Directs the drawing functions into the given overlay, at (0, 0) its top-left corner, until
+// gr_overlay_end(). Each update of an overlay must redraw all of it.
+void gr_overlay_begin(int overlay);
+void gr_overlay_end();
+// Has the next gr_flip_overlays() show the given overlay, as drawn since the last one, with its
+// top-left corner at (x, y) of the screen; or hide it.
+void gr_overlay_show(int overlay, int x, int y);
+void gr_overlay_hide(int overlay);
+// Applies the updates made to the overlays since the last call, all at once.
+void gr_flip_overlays();
+
 // Clears entire surface to current color.
 void gr_clear();
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -177,10 +203,20 @@ struct input_event;
 using ev_callback = std::function<int(int fd, uint32_t epevents)>;
 using ev_set_key_callback = std::function<int(int code, int value)>;
 using ev_set_sw_callback = std::function<int(int code, int value)>;
+// Returns the delay until the timer should fire again, or zero to stop it.
+using ev_timer_callback = std::function<std::chrono::milliseconds()>;
 
 int ev_init(ev_callback input_cb, bool allow_touch_inputs = false);
 void ev_exit();
 int ev_add_fd(android::base::unique_fd&& fd, ev_callback cb);
+// Stops watching |fd|, which is closed. Must be called from the thread that calls ev_dispatch().
+void ev_remove_fd(int fd);
+// Adds a timer that calls |cb| from ev_dispatch() after |delay|, and then again after each delay
+// that |cb| returns. Returns the timer fd, which ev_remove_fd() takes, or -1 on error.
+int ev_add_timer(std::chrono::milliseconds delay, ev_timer_callback cb);
+// Queues |task| to run from ev_dispatch(), waking up ev_wait(). Unlike the other ev_* functions,
+// this is safe to call from any thread. Returns 0 on success, or -1 if ev_init() hasn't succeeded.
+int ev_post(std::function<void()> task);
 void ev_iterate_available_keys(const std::function<void(int)>& key_detected);
 void ev_iterate_touch_inputs(const std::function<void(int)>& touch_device_detected,
                              const std::function<void(int)>& key_detected);
@@ -211,7 +247,9 @@ bool matches_locale(const std::string& prefix, const std::string& locale);
 // interpreted as an alpha mask used to render text in the current
 // color (with gr_text() or gr_texticon()).
 //
-// All these functions load PNG images from "/res/images/${name}.png".
+// All these functions load PNG images from "/res/images/${name}.png". The display surface
+// functions first look for a pre-decoded "/res/images/${name}.rrf" file (written by
+// `interlace-frames.py --raw`), whose frames are mapped into memory instead of decoded.
 
 // Load a single display surface from a PNG image.
 int res_create_display_surface(const char* name, GRSurface** pSurface);
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "minui/minui.h"
+
+// Tracks the rows of a frame that minui draws into in memory, so that only the changed ones get
+// copied to the (slow, usually write-combined or uncached) display buffers by the backends. The
+// changes are found by comparing against a copy of the frame as of the previous Sync(), which only
+// reads cached memory, and also catches a redraw of a whole frame that changes a few rows, which is
+// how the recovery UI usually updates.
+class FrameDamage {
+ public:
+  // Starts tracking frames of the layout of |frame|, to be copied into |num_buffers| buffers (which
+  // get used in turns, e.g. by page flipping). Every row counts as changed by the first Sync(), so
+  // that each buffer gets fully written once, whatever it starts with. Returns false on error.
+  bool Init(const GRSurface& frame, size_t num_buffers);
+
+  // Finds the rows of |frame| that changed since the previous call, and copies the ones that buffer
+  // |index| is missing (as of its own previous Sync()) into |buffer|, which has the same layout.
+  // Adjacent rows get merged into one copy. Returns the number of rows copied.
+  size_t Sync(const GRSurface& frame, uint8_t* buffer, size_t index);
+
+ private:
+  std::unique_ptr<GRSurface> shown_;
+  // The number of Sync() calls, and for each row, the one that last changed it.
+  uint32_t frame_{ 0 };
+  std::vector<uint32_t> row_frames_;
+  // Buffer i holds the frame as of Sync() number synced_frames_[i].
+  std::vector<uint32_t> synced_frames_;
+};
@@ -24,22 +24,48 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <regex>
 #include <string>
 #include <vector>
 
+#include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <png.h>
 
 #include "minui/minui.h"
 
 static std::string g_resource_dir{ "/res/images" };
 
+// The sub-images of a localized text image, each a row of metadata (see
+// res_create_localized_alpha_surface()) followed by the |height| rows of the text.
+struct LocaleImage {
+  std::string locale;
+  png_uint_32 y;  // The metadata row.
+  png_uint_32 width;
+  png_uint_32 height;
+};
+
+struct LocaleIndex {
+  std::vector<LocaleImage> images;
+  bool complete = false;  // Whether |images| covers the whole PNG, or only the first ones of it.
+};
+
+// The locale indexes of the localized text images, to find a sub-image without parsing the metadata
+// rows again. Guarded by g_locale_indexes_lock, as the images may get loaded concurrently.
+static std::mutex g_locale_indexes_lock;
+static std::map<std::string, LocaleIndex> g_locale_indexes;
+
 std::unique_ptr<GRSurface> GRSurface::Create(size_t width, size_t height, size_t row_bytes,
                                              size_t pixel_bytes) {
   if (width == 0 || row_bytes == 0 || height == 0 || pixel_bytes == 0) return nullptr;
@@ -59,7 +85,7 @@ std::unique_ptr<GRSurface> GRSurface::Create(size_t width, size_t height, size_t
 std::unique_ptr<GRSurface> GRSurface::Clone() const {
   auto result = GRSurface::Create(width, height, row_bytes, pixel_bytes);
   if (!result) return nullptr;
-  memcpy(result->data(), data(), data_size_);
+  memcpy(result->data(), data(), row_bytes * height);
   return result;
 }
 
@@ -151,54 +177,47 @@ PngHandler::~PngHandler() {
 // 'width' is the number of pixels in the row.
 static void TransformRgbToDraw(const uint8_t* input_row, uint8_t* output_row, int channels,
                                int width) {
+  // Each output pixel is assembled as a (little-endian) word, with the pixel format test out of the
+  // loops, which the compiler then vectorizes (NEON or SSE2).
   const uint8_t* ip = input_row;
-  uint8_t* op = output_row;
-  PixelFormat pixel_format = gr_pixel_format();
+  uint32_t* op = reinterpret_cast<uint32_t*>(output_row);
+  bool alpha_first = gr_pixel_format() == PixelFormat::RGBA;
 
   switch (channels) {
     case 1:
       // expand gray level to RGBX
-      for (int x = 0; x < width; ++x) {
-        if (pixel_format == PixelFormat::RGBA) {
-          *op++ = 0xff;
-          *op++ = *ip;
-          *op++ = *ip;
-          *op++ = *ip;
-        } else {
-          *op++ = *ip;
-          *op++ = *ip;
-          *op++ = *ip;
-          *op++ = 0xff;
+      if (alpha_first) {
+        for (int x = 0; x < width; ++x) {
+          op[x] = 0xffu | ip[x] * 0x01010100u;
+        }
+      } else {
+        for (int x = 0; x < width; ++x) {
+          op[x] = ip[x] * 0x00010101u | 0xff000000u;
         }
-        ip++;
       }
       break;
 
     case 3:
-      for (int x = 0; x < width; ++x) {
-        // expand RGBA to RGBX
-        if (pixel_format == PixelFormat::RGBA) {
-            *op++ = 0xff;
-            *op++ = *ip++;
-            *op++ = *ip++;
-            *op++ = *ip++;
-        } else {
-            *op++ = *ip++;
-            *op++ = *ip++;
-            *op++ = *ip++;
-            *op++ = 0xff;
+      // expand RGBA to RGBX
+      if (alpha_first) {
+        for (int x = 0; x < width; ++x) {
+          op[x] = 0xffu | ip[3 * x] << 8 | ip[3 * x + 1] << 16 |
+                  static_cast<uint32_t>(ip[3 * x + 2]) << 24;
+        }
+      } else {
+        for (int x = 0; x < width; ++x) {
+          op[x] = ip[3 * x] | ip[3 * x + 1] << 8 | ip[3 * x + 2] << 16 | 0xff000000u;
         }
       }
       break;
 
     case 4:
-      if (pixel_format == PixelFormat::RGBA) {
+      if (alpha_first) {
+        // RGBA to ARGB: the alpha byte moves to the front.
         for (int x = 0; x < width; ++x) {
-            *op++ = *(ip + 3);
-            *op++ = *ip++;
-            *op++ = *ip++;
-            *op++ = *ip++;
-            ip++;
+          uint32_t pixel;
+          memcpy(&pixel, ip + 4 * x, sizeof(pixel));
+          op[x] = (pixel << 8) | (pixel >> 24);
         }
       } else {
         // copy RGBA to RGBX
@@ -208,9 +227,141 @@ static void TransformRgbToDraw(const uint8_t* input_row, uint8_t* output_row, in
   }
 }
 
+// A display surface whose pixels are mapped from a raw frames file (see LoadRawFrames() below)
+// instead of being decoded into memory. The pages are read in from the file when the frame is first
+// drawn, and can be dropped again by the kernel under memory pressure. All the frames of a file
+// share one mapping, which is unmapped with the last of them.
+class GRSurfaceMapped : public GRSurface {
+ public:
+  GRSurfaceMapped(size_t width, size_t height, std::shared_ptr<uint8_t> mapping, size_t offset)
+      : GRSurface(width, height, width * 4, 4), mapping_(std::move(mapping)), offset_(offset) {}
+
+  uint8_t* data() override {
+    return mapping_.get() + offset_;
+  }
+
+ private:
+  std::shared_ptr<uint8_t> mapping_;
+  size_t offset_;
+};
+
+// The header of a raw frames file, as written by `interlace-frames.py --raw`. The header is
+// followed by |frames| frames, each |frame_stride| bytes apart, of |height| rows of |width| RGBX
+// pixels. All the fields are little-endian.
+struct RawFramesHeader {
+  char magic[4];
+  uint32_t width;
+  uint32_t height;
+  uint32_t frames;
+  uint32_t fps;
+  uint32_t frame_stride;
+};
+
+static constexpr char kRawFramesMagic[4] = { 'R', 'R', 'F', '1' };
+
+// Loads the frames of the raw frames file '/res/images/<name>.rrf', or '<name>' if it ends in
+// ".rrf". When the framebuffer takes RGBX byte order, the frames are mapped from the file as is;
+// otherwise they are converted into memory. Returns 0 on success, -1 if there is no such file (so
+// the caller can fall back to the PNG), or another negative value on error.
+static int LoadRawFrames(const std::string& name, int* frames, int* fps,
+                         std::vector<std::unique_ptr<GRSurface>>* surfaces) {
+  std::string res_path = g_resource_dir + "/" + name + ".rrf";
+  android::base::unique_fd fd(open(res_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1 && android::base::EndsWith(name, ".rrf")) {
+    fd.reset(open(name.c_str(), O_RDONLY | O_CLOEXEC));
+  }
+  if (fd == -1) {
+    return -1;
+  }
+
+  RawFramesHeader header;
+  if (!android::base::ReadFully(fd, &header, sizeof(header))) {
+    return -2;
+  }
+  if (memcmp(header.magic, kRawFramesMagic, sizeof(kRawFramesMagic)) != 0) {
+    return -3;
+  }
+  size_t frame_size = static_cast<size_t>(header.width) * 4 * header.height;
+  if (header.width == 0 || header.height == 0 || header.frames == 0 || header.fps == 0 ||
+      header.frame_stride < frame_size ||
+      header.frame_stride % GRSurface::kSurfaceDataAlignment != 0 ||
+      header.frames > std::numeric_limits<int>::max()) {
+    return -10;
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    return -2;
+  }
+  size_t map_size = sizeof(header) + static_cast<size_t>(header.frame_stride) * header.frames;
+  if (static_cast<uint64_t>(sb.st_size) < map_size) {
+    return -9;
+  }
+
+  // A private writable mapping, since GRSurface::data() hands out a mutable pointer; the file
+  // itself is never written.
+  void* addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    return -8;
+  }
+  std::shared_ptr<uint8_t> mapping(static_cast<uint8_t*>(addr),
+                                   [map_size](uint8_t* p) { munmap(p, map_size); });
+
+  // ARGB and BGRA are drawn in BGRX byte order, and RGBA in XRGB; see TransformRgbToDraw().
+  PixelFormat pixel_format = gr_pixel_format();
+  bool swap_bgr = pixel_format == PixelFormat::ARGB || pixel_format == PixelFormat::BGRA;
+  bool alpha_first = pixel_format == PixelFormat::RGBA;
+
+  surfaces->clear();
+  for (uint32_t i = 0; i < header.frames; ++i) {
+    size_t offset = sizeof(header) + static_cast<size_t>(header.frame_stride) * i;
+    if (!swap_bgr && !alpha_first) {
+      surfaces->emplace_back(
+          std::make_unique<GRSurfaceMapped>(header.width, header.height, mapping, offset));
+      continue;
+    }
+
+    auto surface = GRSurface::Create(header.width, header.height, header.width * 4, 4);
+    if (!surface) {
+      return -8;
+    }
+    const uint8_t* ip = mapping.get() + offset;
+    uint8_t* op = surface->data();
+    for (size_t n = 0; n < static_cast<size_t>(header.width) * header.height; ++n, ip += 4) {
+      if (alpha_first) {
+        *op++ = 0xff;
+        *op++ = ip[0];
+        *op++ = ip[1];
+        *op++ = ip[2];
+      } else {
+        *op++ = ip[2];
+        *op++ = ip[1];
+        *op++ = ip[0];
+        *op++ = 0xff;
+      }
+    }
+    surfaces->emplace_back(std::move(surface));
+  }
+
+  *frames = header.frames;
+  *fps = header.fps;
+  return 0;
+}
+
 int res_create_display_surface(const char* name, GRSurface** pSurface) {
   *pSurface = nullptr;
 
+  // A single-frame raw frames file takes precedence over the PNG.
+  std::vector<std::unique_ptr<GRSurface>> raw_frames;
+  int raw_frame_count;
+  int raw_fps;
+  if (int result = LoadRawFrames(name, &raw_frame_count, &raw_fps, &raw_frames); result != -1) {
+    if (result < 0) return result;
+    if (raw_frame_count != 1) return -10;
+    *pSurface = raw_frames[0].release();
+    return 0;
+  }
+
   PngHandler png_handler(name);
   if (!png_handler) return png_handler.error_code();
 
@@ -230,8 +381,8 @@ int res_create_display_surface(const char* name, GRSurface** pSurface) {
     png_set_swap_alpha(png_ptr);
   }
 
+  std::vector<uint8_t> p_row(width * 4);
   for (png_uint_32 y = 0; y < height; ++y) {
-    std::vector<uint8_t> p_row(width * 4);
     png_read_row(png_ptr, p_row.data(), nullptr);
     TransformRgbToDraw(p_row.data(), surface->data() + y * surface->row_bytes,
                        png_handler.channels(), width);
@@ -247,6 +398,19 @@ int res_create_multi_display_surface(const char* name, int* frames, int* fps,
   *pSurface = nullptr;
   *frames = -1;
 
+  // The pre-decoded raw frames file takes precedence over the interlaced PNG.
+  std::vector<std::unique_ptr<GRSurface>> raw_frames;
+  if (int result = LoadRawFrames(name, frames, fps, &raw_frames); result != -1) {
+    if (result < 0) return result;
+    auto surface = static_cast<GRSurface**>(calloc(*frames, sizeof(GRSurface*)));
+    if (!surface) return -8;
+    for (int i = 0; i < *frames; ++i) {
+      surface[i] = raw_frames[i].release();
+    }
+    *pSurface = surface;
+    return 0;
+  }
+
   PngHandler png_handler(name);
   if (!png_handler) return png_handler.error_code();
 
@@ -272,6 +436,7 @@ int res_create_multi_display_surface(const char* name, int* frames, int* fps,
 
   int result = 0;
   GRSurface** surface = nullptr;
+  std::vector<uint8_t> p_row(width * 4);
   if (*frames <= 0 || *fps <= 0) {
     printf("bad number of frames (%d) and/or FPS (%d)\n", *frames, *fps);
     result = -10;
@@ -305,7 +470,6 @@ int res_create_multi_display_surface(const char* name, int* frames, int* fps,
   }
 
   for (png_uint_32 y = 0; y < height; ++y) {
-    std::vector<uint8_t> p_row(width * 4);
     png_read_row(png_ptr, p_row.data(), nullptr);
     int frame = y % *frames;
     uint8_t* out_row = surface[frame]->data() + (y / *frames) * surface[frame]->row_bytes;
@@ -357,6 +521,8 @@ int res_create_alpha_surface(const char* name, GRSurface** pSurface) {
 
 void res_set_resource_dir(const std::string& dirname) {
   g_resource_dir = dirname;
+  std::lock_guard<std::mutex> lock(g_locale_indexes_lock);
+  g_locale_indexes.clear();
 }
 
 // This function tests if a locale string stored in PNG (prefix) matches
@@ -387,6 +553,114 @@ bool matches_locale(const std::string& prefix, const std::string& locale) {
   return std::regex_match(locale, loc_regex);
 }
 
+// Parses the "Locales" text chunk that image_generator writes (ahead of the image data), which
+// lists the sub-images as "<locale>:<y>:<width>:<height>" entries separated by commas.
+static bool ParseLocaleIndex(const PngHandler& png_handler, LocaleIndex* index) {
+  png_textp text;
+  int num_text;
+  if (!png_get_text(png_handler.png_ptr(), png_handler.info_ptr(), &text, &num_text)) {
+    return false;
+  }
+  for (int i = 0; i < num_text; ++i) {
+    if (!text[i].key || strcmp(text[i].key, "Locales") != 0 || !text[i].text) continue;
+
+    LocaleIndex result;
+    png_uint_32 next = 0;
+    for (const auto& entry : android::base::Split(text[i].text, ",")) {
+      std::vector<std::string> fields = android::base::Split(entry, ":");
+      LocaleImage image;
+      if (fields.size() != 4 || !android::base::ParseUint(fields[1], &image.y) ||
+          !android::base::ParseUint(fields[2], &image.width) ||
+          !android::base::ParseUint(fields[3], &image.height)) {
+        printf("Invalid locale index entry \"%s\"\n", entry.c_str());
+        return false;
+      }
+      // The sub-images must be in order, and within the image.
+      if (image.y < next || image.width > png_handler.width() ||
+          image.height >= png_handler.height() - image.y) {
+        printf("Locale index entry \"%s\" is out of place\n", entry.c_str());
+        return false;
+      }
+      image.locale = fields[0];
+      next = image.y + 1 + image.height;
+      result.images.push_back(std::move(image));
+    }
+    result.complete = true;
+    *index = std::move(result);
+    return true;
+  }
+  return false;
+}
+
+// Returns the index of the localized text image |name|, as far as it's known: the cached one, or
+// the one from its text chunk.
+static LocaleIndex GetLocaleIndex(const std::string& name, const PngHandler& png_handler) {
+  {
+    std::lock_guard<std::mutex> lock(g_locale_indexes_lock);
+    auto it = g_locale_indexes.find(name);
+    if (it != g_locale_indexes.end()) return it->second;
+  }
+  LocaleIndex index;
+  if (ParseLocaleIndex(png_handler, &index)) {
+    std::lock_guard<std::mutex> lock(g_locale_indexes_lock);
+    g_locale_indexes[name] = index;
+  }
+  return index;
+}
+
+static void CacheLocaleIndex(const std::string& name, const LocaleIndex& index) {
+  std::lock_guard<std::mutex> lock(g_locale_indexes_lock);
+  LocaleIndex& cached = g_locale_indexes[name];
+  if (index.complete || index.images.size() > cached.images.size()) {
+    cached = index;
+  }
+}
+
+// Parses the metadata rows of the sub-images past the ones in |index|, adding them to |index|,
+// until one of them matches |locale| (if not null), and returns its position in |index|. The rows
+// of the PNG must not have been read yet; on a match, they have been read up to the metadata row
+// of the matching sub-image. Returns -1 if no sub-image matches, or -8 if one overruns the image.
+static int ScanLocaleIndex(const PngHandler& png_handler, const char* locale, LocaleIndex* index) {
+  png_structp png_ptr = png_handler.png_ptr();
+  png_uint_32 height = png_handler.height();
+
+  png_uint_32 y = 0;
+  if (!index->images.empty()) {
+    const LocaleImage& last = index->images.back();
+    y = last.y + 1 + last.height;
+  }
+  for (png_uint_32 i = 0; i < y; ++i) {
+    png_read_row(png_ptr, nullptr, nullptr);
+  }
+
+  std::vector<uint8_t> row(png_handler.width());
+  for (; y < height; ++y) {
+    png_read_row(png_ptr, row.data(), nullptr);
+    int w = (row[1] << 8) | row[0];
+    int h = (row[3] << 8) | row[2];
+    __unused int len = row[4];
+    char* loc = reinterpret_cast<char*>(&row[5]);
+
+    // We need to include one additional line for the metadata of the localized image.
+    if (y + 1 + h > height) {
+      printf("Read exceeds the image boundary, y %u, h %d, height %u\n", y, h, height);
+      return -8;
+    }
+
+    index->images.push_back({ loc, y, static_cast<png_uint_32>(w), static_cast<png_uint_32>(h) });
+    if (locale != nullptr && matches_locale(loc, locale)) {
+      return index->images.size() - 1;
+    }
+
+    for (int i = 0; i < h; ++i, ++y) {
+      png_read_row(png_ptr, row.data(), nullptr);
+    }
+  }
+
+  index->complete = true;
+  return -1;
+}
+
 std::vector<std::string> get_locales_in_png(const std::string& png_name) {
   PngHandler png_handler(png_name);
   if (!png_handler) {
@@ -398,20 +672,18 @@ std::vector<std::string> get_locales_in_png(const std::string& png_name) {
     return {};
   }
 
+  LocaleIndex index = GetLocaleIndex(png_name, png_handler);
+  if (!index.complete) {
+    ScanLocaleIndex(png_handler, nullptr, &index);
+    CacheLocaleIndex(png_name, index);
+  }
+
   std::vector<std::string> result;
-  std::vector<uint8_t> row(png_handler.width());
-  for (png_uint_32 y = 0; y < png_handler.height(); ++y) {
-    png_read_row(png_handler.png_ptr(), row.data(), nullptr);
-    int h = (row[3] << 8) | row[2];
-    std::string loc(reinterpret_cast<char*>(&row[5]));
-    if (!loc.empty()) {
-      result.push_back(loc);
-    }
-    for (int i = 0; i < h; ++i, ++y) {
-      png_read_row(png_handler.png_ptr(), row.data(), nullptr);
+  for (const auto& image : index.images) {
+    if (!image.locale.empty()) {
+      result.push_back(image.locale);
     }
   }
-
   return result;
 }
 
@@ -432,45 +704,52 @@ int res_create_localized_alpha_surface(const char* name,
 
   png_structp png_ptr = png_handler.png_ptr();
   png_uint_32 width = png_handler.width();
-  png_uint_32 height = png_handler.height();
-
-  for (png_uint_32 y = 0; y < height; ++y) {
-    std::vector<uint8_t> row(width);
-    png_read_row(png_ptr, row.data(), nullptr);
-    int w = (row[1] << 8) | row[0];
-    int h = (row[3] << 8) | row[2];
-    __unused int len = row[4];
-    char* loc = reinterpret_cast<char*>(&row[5]);
 
-    // We need to include one additional line for the metadata of the localized image.
-    if (y + 1 + h > height) {
-      printf("Read exceeds the image boundary, y %u, h %d, height %u\n", y, h, height);
-      return -8;
+  // Looks up the sub-image in the index first, and only parses the metadata rows past the indexed
+  // ones. The rows before the sub-image still need to be inflated, but not copied out.
+  LocaleIndex index = GetLocaleIndex(name, png_handler);
+  auto match = std::find_if(index.images.begin(), index.images.end(), [locale](const auto& image) {
+    return matches_locale(image.locale, locale);
+  });
+  const LocaleImage* image = nullptr;
+  if (match != index.images.end()) {
+    image = &*match;
+    for (png_uint_32 y = 0; y <= image->y; ++y) {
+      png_read_row(png_ptr, nullptr, nullptr);
     }
+  } else if (!index.complete) {
+    int found = ScanLocaleIndex(png_handler, locale, &index);
+    if (found == -8) return -8;
+    CacheLocaleIndex(name, index);
+    if (found >= 0) image = &index.images[found];
+  }
+  if (image == nullptr) {
+    return -10;
+  }
 
-    if (matches_locale(loc, locale)) {
-      printf("  %20s: %s (%d x %d @ %d)\n", name, loc, w, h, y);
+  printf("  %20s: %s (%u x %u @ %u)\n", name, image->locale.c_str(), image->width, image->height,
+         image->y);
 
-      auto surface = GRSurface::Create(w, h, w, 1);
-      if (!surface) {
-        return -9;
-      }
-
-      for (int i = 0; i < h; ++i, ++y) {
-        png_read_row(png_ptr, row.data(), nullptr);
-        memcpy(surface->data() + i * w, row.data(), w);
-      }
+  auto surface = GRSurface::Create(image->width, image->height, image->width, 1);
+  if (!surface) {
+    return -9;
+  }
 
-      *pSurface = surface.release();
-      return 0;
+  // A row is as wide as the image, which may be wider than the text.
+  if (image->width == width) {
+    for (png_uint_32 i = 0; i < image->height; ++i) {
+      png_read_row(png_ptr, surface->data() + i * image->width, nullptr);
     }
-
-    for (int i = 0; i < h; ++i, ++y) {
+  } else {
+    std::vector<uint8_t> row(width);
+    for (png_uint_32 i = 0; i < image->height; ++i) {
       png_read_row(png_ptr, row.data(), nullptr);
+      memcpy(surface->data() + i * image->width, row.data(), image->width);
     }
   }
 
-  return -10;
+  *pSurface = surface.release();
+  return 0;
 }
 
 void res_free_surface(GRSurface* surface) {
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/dir_lister.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+
+DirectoryLister::~DirectoryLister() {
+  Cancel();
+}
+
+bool DirectoryLister::Matches(const std::string& name) const {
+  return std::any_of(suffixes_.begin(), suffixes_.end(), [&name](const std::string& suffix) {
+    return android::base::EndsWithIgnoreCase(name, suffix);
+  });
+}
+
+void DirectoryLister::List(const std::string& path, std::function<void()> on_update) {
+  Cancel();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  files_.clear();
+  dirs_.clear();
+  complete_ = false;
+  error_ = false;
+  version_ = 0;
+  shown_version_ = 0;
+
+  // Stat before reading, so that a change while scanning invalidates the cached listing.
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1) {
+    PLOG(ERROR) << "error opening " << path;
+    complete_ = true;
+    error_ = true;
+    return;
+  }
+
+  if (auto it = cache_.find(path); it != cache_.end()) {
+    CacheEntry& entry = it->second;
+    if (entry.ino == st.st_ino && entry.mtime.tv_sec == st.st_mtim.tv_sec &&
+        entry.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+      files_ = entry.files;
+      dirs_ = entry.dirs;
+      complete_ = true;
+      entry.last_used = ++cache_clock_;
+      return;
+    }
+    cache_.erase(it);
+  }
+
+  cancelled_ = false;
+  thread_ = std::thread(&DirectoryLister::Scan, this, path, st.st_ino, st.st_mtim,
+                        std::move(on_update));
+}
+
+void DirectoryLister::Scan(std::string path, ino_t ino, timespec mtime,
+                           std::function<void()> on_update) {
+  std::unique_ptr<DIR, decltype(&closedir)> d(opendir(path.c_str()), closedir);
+  if (!d) {
+    PLOG(ERROR) << "error opening " << path;
+  }
+
+  std::vector<std::string> files;
+  std::vector<std::string> dirs;
+  auto last_update = std::chrono::steady_clock::now();
+  // Hands the entries found since the last batch over to Get(), and asks for them to be picked up
+  // if the interval has passed.
+  auto flush = [&](bool force) {
+    auto now = std::chrono::steady_clock::now();
+    if (!force && now - last_update < kUpdateInterval) {
+      return;
+    }
+    bool notify;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!files.empty() || !dirs.empty()) {
+        files_.insert(files_.end(), files.begin(), files.end());
+        dirs_.insert(dirs_.end(), dirs.begin(), dirs.end());
+        version_++;
+      }
+      notify = shown_version_ < version_;
+    }
+    files.clear();
+    dirs.clear();
+    last_update = now;
+    if (notify && on_update) on_update();
+  };
+
+  dirent* de;
+  while (d && !cancelled_ && (de = readdir(d.get())) != nullptr) {
+    std::string name(de->d_name);
+    unsigned char type = de->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (fstatat(dirfd(d.get()), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+      }
+    }
+
+    if (type == DT_DIR) {
+      // Skip "." and ".." entries.
+      if (name == "." || name == "..") continue;
+      dirs.push_back(name + "/");
+    } else if (type == DT_REG && Matches(name)) {
+      files.push_back(std::move(name));
+    }
+    flush(false);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_.insert(files_.end(), files.begin(), files.end());
+    dirs_.insert(dirs_.end(), dirs.begin(), dirs.end());
+    files.clear();
+    dirs.clear();
+    complete_ = true;
+    error_ = !d;
+    version_++;
+    if (d && !cancelled_) {
+      AddToCache(path, CacheEntry{ ino, mtime, files_, dirs_, 0 });
+    }
+  }
+  cv_.notify_all();
+
+  // Keep asking until the complete listing has been picked up, in case a request got lost.
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!cancelled_ && shown_version_ < version_) {
+    lock.unlock();
+    if (on_update) on_update();
+    lock.lock();
+    cv_.wait_for(lock, kUpdateInterval,
+                 [this] { return cancelled_ || shown_version_ >= version_; });
+  }
+}
+
+void DirectoryLister::AddToCache(const std::string& path, CacheEntry entry) {
+  if (cache_.size() >= kMaxCachedDirectories) {
+    auto oldest = std::min_element(cache_.begin(), cache_.end(), [](const auto& a, const auto& b) {
+      return a.second.last_used < b.second.last_used;
+    });
+    cache_.erase(oldest);
+  }
+  entry.last_used = ++cache_clock_;
+  cache_[path] = std::move(entry);
+}
+
+DirectoryLister::Snapshot DirectoryLister::Get(std::chrono::milliseconds wait) {
+  Snapshot snapshot;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, wait, [this] { return complete_; });
+    snapshot.files = files_;
+    snapshot.dirs = dirs_;
+    snapshot.complete = complete_;
+    snapshot.error = error_;
+    shown_version_ = version_;
+  }
+  cv_.notify_all();
+
+  std::sort(snapshot.files.begin(), snapshot.files.end());
+  std::sort(snapshot.dirs.begin(), snapshot.dirs.end());
+  return snapshot;
+}
+
+void DirectoryLister::Cancel() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
@@ -18,12 +18,18 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <string>
+#include <thread>
+
+#include <android-base/unique_fd.h>
 
 #include <selinux/label.h>
 #include <selinux/selinux.h>
@@ -176,3 +182,46 @@ int dirUnlinkHierarchy(const char* path) {
   /* delete target directory */
   return rmdir(path);
 }
+
+// How often WaitForCondition() rechecks without an event, or without inotify at all.
+static constexpr std::chrono::milliseconds kWaitRecheckInterval{ 50 };
+static constexpr std::chrono::milliseconds kWaitPollInterval{ 5 };
+
+bool WaitForCondition(const std::string& dir, std::chrono::milliseconds timeout,
+                      const std::function<bool()>& done) {
+  // The watch is set up before the first check, so that no change can slip in between.
+  android::base::unique_fd inotify_fd(inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
+  if (inotify_fd != -1 &&
+      inotify_add_watch(inotify_fd.get(), dir.c_str(),
+                        IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_TO) == -1) {
+    inotify_fd.reset();
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (!done()) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      return false;
+    }
+    auto wait = std::min(std::chrono::ceil<std::chrono::milliseconds>(deadline - now),
+                         inotify_fd == -1 ? kWaitPollInterval : kWaitRecheckInterval);
+    if (inotify_fd == -1) {
+      std::this_thread::sleep_for(wait);
+      continue;
+    }
+    struct pollfd pfd = { inotify_fd.get(), POLLIN, 0 };
+    if (poll(&pfd, 1, static_cast<int>(wait.count())) > 0) {
+      // Only the wakeup matters; drains the events.
+      char events[4096];
+      while (read(inotify_fd.get(), events, sizeof(events)) > 0) {
+      }
+    }
+  }
+  return true;
+}
+
+bool WaitForPath(const std::string& path, std::chrono::milliseconds timeout) {
+  auto pos = path.rfind('/');
+  std::string dir = (pos == std::string::npos) ? "." : (pos == 0 ? "/" : path.substr(0, pos));
+  return WaitForCondition(dir, timeout, [&path]() { return access(path.c_str(), F_OK) == 0; });
+}
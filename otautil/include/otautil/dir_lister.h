@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Lists a directory on a background thread, so that a menu can show the entries found so far
+// instead of blocking until a large directory (e.g. on a slow SD card or USB stick) has been read
+// in full. Only the subdirectories and the regular files with one of the given suffixes are kept,
+// going by d_type and falling back to a stat where the filesystem doesn't fill it in. The complete
+// listings are cached by the mtime of the directory, so going back to a directory shows it at once.
+// One directory is listed at a time; not thread-safe, except for the update callback.
+class DirectoryLister {
+ public:
+  struct Snapshot {
+    std::vector<std::string> files;  // Sorted.
+    std::vector<std::string> dirs;   // Sorted, each with a trailing '/'; without "." and "..".
+    bool complete = false;
+    bool error = false;  // The directory couldn't be read; only set along with |complete|.
+  };
+
+  // How often |on_update| is called at most while entries keep arriving.
+  static constexpr std::chrono::milliseconds kUpdateInterval{ 500 };
+  static constexpr size_t kMaxCachedDirectories = 32;
+
+  explicit DirectoryLister(std::vector<std::string> suffixes) : suffixes_(std::move(suffixes)) {}
+  ~DirectoryLister();
+
+  DirectoryLister(const DirectoryLister&) = delete;
+  DirectoryLister& operator=(const DirectoryLister&) = delete;
+
+  // Starts listing |path|, cancelling the previous listing. |on_update| is called on the lister
+  // thread when there are entries not returned by Get() yet, until Get() has returned the complete
+  // listing. A repeated call goes out if one gets lost (e.g. when the menu flushed its pending keys
+  // as it came up). Nothing is called for a cached directory, which is complete right away.
+  void List(const std::string& path, std::function<void()> on_update);
+
+  // Returns the entries found so far, after waiting up to |wait| for the listing to complete.
+  Snapshot Get(std::chrono::milliseconds wait = std::chrono::milliseconds(0));
+
+  // Stops the current listing, if any. Its entries are only cached if it had completed.
+  void Cancel();
+
+ private:
+  struct CacheEntry {
+    ino_t ino;
+    timespec mtime;
+    std::vector<std::string> files;
+    std::vector<std::string> dirs;
+    uint64_t last_used;
+  };
+
+  void Scan(std::string path, ino_t ino, timespec mtime, std::function<void()> on_update);
+  bool Matches(const std::string& name) const;
+  void AddToCache(const std::string& path, CacheEntry entry);
+
+  const std::vector<std::string> suffixes_;
+
+  std::thread thread_;
+  std::atomic<bool> cancelled_{ false };
+
+  // Guards the listing in progress below, which the lister thread fills in, and the cache.
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::string> files_;
+  std::vector<std::string> dirs_;
+  bool complete_ = false;
+  bool error_ = false;
+  // Bumped for every batch of entries; |shown_version_| is the one that Get() returned last.
+  uint64_t version_ = 0;
+  uint64_t shown_version_ = 0;
+
+  std::map<std::string, CacheEntry> cache_;
+  uint64_t cache_clock_ = 0;
+};
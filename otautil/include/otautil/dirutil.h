@@ -21,6 +21,8 @@
 #include <sys/stat.h>  // mode_t
 #include <utime.h>     // utime/utimbuf
 
+#include <chrono>
+#include <functional>
 #include <string>
 
 struct selabel_handle;
@@ -45,4 +47,14 @@ int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_fil
 // rm -rf <path>
 int dirUnlinkHierarchy(const char* path);
 
+// Waits up to |timeout| for |done| to return true. Instead of polling, it's checked again whenever
+// an entry of the directory |dir| gets created, removed or changed (e.g. in /dev/block, as ueventd
+// creates the device nodes), plus every 50ms for the changes that don't show up in |dir|. Returns
+// the last result of |done|.
+bool WaitForCondition(const std::string& dir, std::chrono::milliseconds timeout,
+                      const std::function<bool()>& done);
+
+// Waits up to |timeout| for |path| to exist. Returns whether it does.
+bool WaitForPath(const std::string& path, std::chrono::milliseconds timeout);
+
 #endif  // OTAUTIL_DIRUTIL_H_
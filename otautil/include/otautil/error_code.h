@@ -50,6 +50,7 @@ enum CauseCode : int {
   kPatchApplicationFailure,
   kHashTreeComputationFailure,
   kEioFailure,
+  kFecComputationFailure,
   kVendorFailure = 200
 };
 
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// The live stats of a process (recovery, the update binary, fuse) get published while it runs, for
+// the "stats" service of minadbd to stream to the host. They are the running phases (see
+// ScopedPhase), the storage I/O of the process, the CPU time of each thread, the use of the memory
+// budget, and the counters set with SetLiveCounter(), as "key: value" lines. Once a second, they
+// get written to a file named after the process in kLiveStatsDir.
+static constexpr const char* kLiveStatsDir = "/tmp/live_stats";
+
+// Starts publishing the live stats of the process as |name|. Only the first call of a process
+// starts it (a forked child may start its own).
+void StartLiveStats(const std::string& name);
+
+// Sets the live counter |name| (e.g. "fuse_cache_hits") to |value|. Thread-safe.
+void SetLiveCounter(const std::string& name, uint64_t value);
+
+// Returns the live stats of the process, as they get published.
+std::vector<std::string> FormatLiveStats();
+
+// The I/O of a block device so far, from /proc/diskstats.
+struct DiskIo {
+  uint64_t read_bytes = 0;
+  uint64_t write_bytes = 0;
+};
+
+// Returns the I/O of the block devices in |diskstats| that have been used, by device name.
+std::map<std::string, DiskIo> ReadDiskStats(const std::string& diskstats = "/proc/diskstats");
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// The memory that the caches and the buffers of a process (recovery, the update binary) may take,
+// shared by all of them, so that their sizes add up to what the device has instead of each being
+// sized from the free memory on its own. The budget starts out as the free memory less
+// kReservedMemory, or as what the parent process has left of its own budget (see Export()), so
+// that the update binary doesn't count the memory that recovery holds (e.g. the package copied
+// into memory) again.
+//
+// Thread-safe.
+class MemoryBudget {
+ public:
+  // When a reservation doesn't fit, the shrinkable reservations of the lower priorities get shrunk
+  // to make room for it. Memory pressure only shrinks the caches.
+  enum class Priority {
+    kCache,     // Makes things faster; may be dropped at any time.
+    kBuffer,    // Sized for the throughput of a pipeline.
+    kRequired,  // Needed in full for the work to be done this way at all.
+  };
+
+  // The bytes of free memory that the budget leaves to the kernel and to the rest of the process.
+  static constexpr uint64_t kReservedMemory = 128 * 1024 * 1024;
+  // The environment variable that Export() hands the budget down in.
+  static constexpr const char* kEnvironmentVariable = "RECOVERY_MEMORY_BUDGET";
+
+  // The bytes of the budget that an owner holds, until it's destroyed.
+  class Reservation {
+   public:
+    ~Reservation();
+
+    Reservation(const Reservation&) = delete;
+    Reservation& operator=(const Reservation&) = delete;
+
+    // The bytes the owner may use. A shrinkable reservation gets shrunk when the budget reclaims
+    // it, which the owner should check at its next chance, and give the memory back.
+    uint64_t size() const {
+      return size_;
+    }
+
+    // Gives back the bytes above |size|.
+    void Shrink(uint64_t size);
+
+   private:
+    friend class MemoryBudget;
+
+    Reservation(MemoryBudget* budget, std::string name, Priority priority, uint64_t min_size,
+                bool shrinkable, uint64_t size);
+
+    MemoryBudget* const budget_;
+    const std::string name_;
+    const Priority priority_;
+    const uint64_t min_size_;
+    const bool shrinkable_;
+    // Only changes under the mutex of the budget.
+    std::atomic<uint64_t> size_;
+  };
+
+  explicit MemoryBudget(uint64_t limit) : limit_(limit) {}
+
+  // Returns the budget of the process.
+  static MemoryBudget& Get();
+
+  // Reserves |max_size| bytes for |name|, or as much as there is down to |min_size|, after
+  // shrinking the shrinkable reservations of lower priorities to their minimum sizes as needed. A
+  // shrinkable reservation may be shrunk later on down to |min_size|. Returns nullptr if not even
+  // |min_size| bytes fit.
+  std::unique_ptr<Reservation> Reserve(const std::string& name, uint64_t max_size,
+                                       uint64_t min_size, Priority priority, bool shrinkable);
+
+  // Shrinks the shrinkable caches by |fraction| of what they hold above their minimum sizes, e.g.
+  // under memory pressure. Returns the bytes reclaimed.
+  uint64_t ReclaimCaches(double fraction);
+
+  // Starts a thread that reclaims half of the caches whenever the PSI trigger on |pressure_file|
+  // reports memory stalls. Returns false if the kernel doesn't support PSI triggers. The budget
+  // must outlive the thread, i.e. must be Get().
+  bool MonitorPressure(const std::string& pressure_file = "/proc/pressure/memory");
+
+  // Sets kEnvironmentVariable to the bytes not reserved, for the child processes to start their
+  // budgets from.
+  void Export() const;
+
+  uint64_t limit() const {
+    return limit_;
+  }
+
+  // The bytes not reserved.
+  uint64_t available() const;
+
+ private:
+  // Shrinks the shrinkable reservations below |priority| by up to |bytes|, the lowest priority
+  // first. Returns the bytes reclaimed. Requires mutex_.
+  uint64_t Reclaim(uint64_t bytes, Priority priority);
+  // Returns the bytes that Reclaim() could get. Requires mutex_.
+  uint64_t Reclaimable(Priority priority) const;
+  // Requires mutex_.
+  void Resize(Reservation* reservation, uint64_t size);
+
+  const uint64_t limit_;
+  mutable std::mutex mutex_;
+  uint64_t reserved_ = 0;
+  std::list<Reservation*> reservations_;
+};
@@ -22,12 +22,16 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <ziparchive/zip_archive.h>
 
 #include "otautil/verifier.h"
 
+// The parsed metadata of a package, which libinstall defines (see install/package_metadata.h).
+class PackageMetadata;
+
 enum class PackageType {
   kMemory,
   kFile,
@@ -56,7 +60,18 @@ class Package : public VerifierInterface {
   // Updates the progress in fraction during package verification.
   void SetProgress(float progress) override;
 
+  // The parsed metadata of the package, which is kept with it so that it's read only once. It may
+  // be shared with another package of the same content (e.g. a copy in memory).
+  const std::shared_ptr<const PackageMetadata>& GetMetadata() const {
+    return metadata_;
+  }
+  void SetMetadata(std::shared_ptr<const PackageMetadata> metadata) {
+    metadata_ = std::move(metadata);
+  }
+
  protected:
   // An optional function to update the progress.
   std::function<void(float)> set_progress_;
+  // The parsed metadata, if it has been read.
+  std::shared_ptr<const PackageMetadata> metadata_;
 };
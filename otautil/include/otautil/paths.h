@@ -48,6 +48,13 @@ class Paths {
     last_command_file_ = last_command_file;
   }
 
+  std::string partition_check_record() const {
+    return partition_check_record_;
+  }
+  void set_partition_check_record(const std::string& check_record) {
+    partition_check_record_ = check_record;
+  }
+
   std::string resource_dir() const {
     return resource_dir_;
   }
@@ -76,6 +83,27 @@ class Paths {
     temporary_log_file_ = log_file;
   }
 
+  std::string temporary_trace_file() const {
+    return temporary_trace_file_;
+  }
+  void set_temporary_trace_file(const std::string& trace_file) {
+    temporary_trace_file_ = trace_file;
+  }
+
+  std::string temporary_startup_trace_file() const {
+    return temporary_startup_trace_file_;
+  }
+  void set_temporary_startup_trace_file(const std::string& startup_trace_file) {
+    temporary_startup_trace_file_ = startup_trace_file;
+  }
+
+  std::string temporary_io_trace_file() const {
+    return temporary_io_trace_file_;
+  }
+  void set_temporary_io_trace_file(const std::string& io_trace_file) {
+    temporary_io_trace_file_ = io_trace_file;
+  }
+
   std::string temporary_update_binary() const {
     return temporary_update_binary_;
   }
@@ -99,6 +127,10 @@ class Paths {
   // Path to the last command file.
   std::string last_command_file_;
 
+  // Path to the record of the partitions that passed a full check by applypatch --check, which
+  // lets the checks on the following boots skip reading them in full.
+  std::string partition_check_record_;
+
   // Path to the resource dir;
   std::string resource_dir_;
 
@@ -111,6 +143,15 @@ class Paths {
   // Path to the temporary log file while under recovery.
   std::string temporary_log_file_;
 
+  // Path to the temporary file that contains the trace of the update (see otautil/trace.h).
+  std::string temporary_trace_file_;
+
+  // Path to the temporary file that contains the trace of the recovery startup.
+  std::string temporary_startup_trace_file_;
+
+  // Path to the temporary block I/O trace of the updater, if ro.updater.io_trace is on.
+  std::string temporary_io_trace_file_;
+
   // Path to the temporary update binary while installing a non-A/B package.
   std::string temporary_update_binary_;
 };
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// The totals of a phase of an install (e.g. a kind of transfer list command), over all the times
+// it ran. The CPU time and the I/O are those of the whole process while the phase ran, so nested or
+// concurrent phases each count them in full.
+struct PhaseStats {
+  uint64_t count = 0;
+  uint64_t wall_us = 0;
+  uint64_t cpu_us = 0;
+  uint64_t read_bytes = 0;   // Storage reads, from /proc/self/io.
+  uint64_t write_bytes = 0;  // Storage writes (i.e. pages dirtied), from /proc/self/io.
+  uint64_t fsyncs = 0;       // As counted by CountFsync().
+};
+
+// Adds the time and the I/O from its construction to its destruction to the phase |name|.
+// Thread-safe.
+class ScopedPhase {
+ public:
+  explicit ScopedPhase(std::string name);
+  ~ScopedPhase();
+
+  ScopedPhase(const ScopedPhase&) = delete;
+  ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+ private:
+  struct Snapshot {
+    uint64_t wall_us;
+    uint64_t cpu_us;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t fsyncs;
+  };
+  static Snapshot TakeSnapshot();
+
+  std::string name_;
+  Snapshot start_;
+};
+
+// Counts an fsync(2), fdatasync(2) or syncfs(2) towards the running phases. The kernel doesn't
+// account for them, so the callers that sync do this.
+void CountFsync();
+
+// Returns the stats of the phases so far, by name.
+std::map<std::string, PhaseStats> GetPhaseStats();
+
+// Returns the names of the phases that are running, sorted.
+std::vector<std::string> GetRunningPhases();
+
+// Returns the stats of the phases so far as lines of last_install, e.g. "phase_<name>_wall_ms: 12",
+// which ParseRecoveryUpdateMetrics() picks up. The lines with |prefix| prepended are suitable for
+// the "log" command of the updater.
+std::vector<std::string> FormatPhaseStats(const std::string& prefix = "");
+
+// Drops the stats of all the phases.
+void ClearPhaseStats();
@@ -20,6 +20,7 @@
 
 #include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -33,7 +34,7 @@ class RangeSet {
 
   // Parses the given string into a RangeSet. Returns the parsed RangeSet, or an empty RangeSet on
   // errors.
-  static RangeSet Parse(const std::string& range_text);
+  static RangeSet Parse(std::string_view range_text);
 
   // Appends the given Range to the current RangeSet.
   bool PushBack(Range range);
@@ -175,3 +176,32 @@ class SortedRangeSet : public RangeSet {
   // + 10) in a range represented by this SortedRangeSet.
   size_t GetOffsetInRangeSet(size_t old_offset) const;
 };
+
+// A RangeSet along with the index of the first block held by each of its ranges, which turns the
+// lookups by block index into binary searches. RangeSet::GetBlockNumber() and GetSubRanges() walk
+// the ranges instead, which adds up when they're called for many blocks of a large RangeSet (e.g.
+// the block map of a package).
+class RangeSetIndex {
+ public:
+  RangeSetIndex() = default;
+
+  explicit RangeSetIndex(RangeSet ranges);
+
+  const RangeSet& ranges() const {
+    return ranges_;
+  }
+
+  // Same as RangeSet::GetBlockNumber().
+  size_t GetBlockNumber(size_t idx) const;
+
+  // Same as RangeSet::GetSubRanges().
+  std::optional<RangeSet> GetSubRanges(size_t start_index, size_t num_of_blocks) const;
+
+ private:
+  // Returns the position of the range that holds the |idx|-th block, which must be in bound.
+  size_t FindRange(size_t idx) const;
+
+  RangeSet ranges_;
+  // The index of the first block held by each range in |ranges_|, in ascending order.
+  std::vector<size_t> offsets_;
+};
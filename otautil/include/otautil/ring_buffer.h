@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+// A bounded single-producer, single-consumer byte queue. The producer and the consumer exchange
+// data through the head and tail counters only, without taking a lock; the mutex and the condition
+// variable are used solely to park a side that finds the buffer full (or empty), and are only
+// touched by the other side if someone is actually parked.
+//
+// Both sides access the buffer memory in place: the producer asks for writable space with
+// GetWritable() and publishes it with Commit(), while the consumer gets the readable data with
+// GetReadable() and releases it with Consume(). The returned spans are contiguous, so they may be
+// shorter than the total amount of space (or data) when they would wrap around.
+class RingBuffer {
+ public:
+  explicit RingBuffer(size_t capacity);
+
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  // Producer side.
+  // Waits until there's free space, and sets |data| to the beginning of it. Returns its size, or 0
+  // if the queue has been aborted.
+  size_t GetWritable(uint8_t** data);
+
+  // Publishes the first |size| bytes of the space returned by the last GetWritable().
+  void Commit(size_t size);
+
+  // Copies |size| bytes into the queue, waiting for space as needed. Returns false if the queue has
+  // been aborted.
+  bool Write(const uint8_t* data, size_t size);
+
+  // Marks the end of the data. The consumer gets the remaining data, and then sees the end.
+  void Close();
+
+  // Consumer side.
+  // Waits until there's data, and sets |data| to the beginning of it. Returns its size, or 0 if
+  // the queue has been closed (or aborted) and no data is left.
+  size_t GetReadable(const uint8_t** data);
+
+  // Releases the first |size| bytes of the data returned by the last GetReadable().
+  void Consume(size_t size);
+
+  // Either side.
+  // Makes any waiting (and future) calls on both sides return immediately; the buffered data is
+  // dropped.
+  void Abort();
+
+  bool closed() const {
+    return closed_.load();
+  }
+
+  bool aborted() const {
+    return aborted_.load();
+  }
+
+ private:
+  // Parks the calling side until |ready| returns true, or the queue is aborted.
+  template <typename Pred>
+  void Wait(std::atomic<bool>* waiting, Pred ready);
+
+  // Wakes up the other side if it's parked in Wait().
+  void Notify(const std::atomic<bool>& waiting);
+
+  const size_t capacity_;
+  std::unique_ptr<uint8_t[]> data_;
+
+  // The total number of bytes that have been consumed (head_) and committed (tail_). Both only ever
+  // increase; the position in data_ is the counter modulo capacity_.
+  std::atomic<size_t> head_{ 0 };
+  std::atomic<size_t> tail_{ 0 };
+  std::atomic<bool> closed_{ false };
+  std::atomic<bool> aborted_{ false };
+
+  // Set by the producer (consumer) while it's parked waiting for space (data).
+  std::atomic<bool> producer_waiting_{ false };
+  std::atomic<bool> consumer_waiting_{ false };
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
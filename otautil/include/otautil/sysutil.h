@@ -18,6 +18,7 @@
 
 #include <sys/types.h>
 
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -37,7 +38,7 @@ class BlockMapData {
   //   30 33                                               # ... block range 2
   //
   // Each block range represents a half-open interval; the line "30 33" reprents the blocks
-  // [30, 31, 32].
+  // [30, 31, 32]. Ranges that continue where the previous one ends are merged on parsing.
   static BlockMapData ParseBlockMapFile(const std::string& block_map_path);
 
   explicit operator bool() const {
@@ -54,23 +55,24 @@ class BlockMapData {
     return block_size_;
   }
   RangeSet block_ranges() const {
-    return block_ranges_;
+    return block_ranges_.ranges();
   }
 
+  // Returns the ranges on the block device that hold |num_blocks| blocks of the file, starting from
+  // the |start_block|-th (0-based) one. The range holding |start_block| is found with a binary
+  // search. Returns std::nullopt if the blocks are out of bound.
+  std::optional<RangeSet> GetSubRanges(size_t start_block, size_t num_blocks) const;
+
  private:
   BlockMapData() = default;
 
   BlockMapData(const std::string& path, uint64_t file_size, uint32_t block_size,
-               RangeSet block_ranges)
-      : path_(path),
-        file_size_(file_size),
-        block_size_(block_size),
-        block_ranges_(std::move(block_ranges)) {}
+               RangeSet block_ranges);
 
   std::string path_;
   uint64_t file_size_ = 0;
   uint32_t block_size_ = 0;
-  RangeSet block_ranges_;
+  RangeSetIndex block_ranges_;
 };
 
 /*
@@ -82,10 +84,18 @@ class MemMapping {
   // Map a file into a private, read-only memory segment. If 'filename' begins with an '@'
   // character, it is a map of blocks to be mapped, otherwise it is treated as an ordinary file.
   bool MapFile(const std::string& filename);
+  // Maps the blocks in |ranges| of the open file (or block device) |fd| into a private, read-only
+  // memory segment, one after another in the order of |ranges|. |fd| may be closed afterwards.
+  bool MapBlockRanges(int fd, const RangeSet& ranges, uint32_t block_size);
   size_t ranges() const {
     return ranges_.size();
   };
 
+  // Gives the kernel |advice| (one of the MADV_* values) on how the pages of the |size| bytes at
+  // |offset| of the data are going to be accessed. It's only a hint, and failures are logged and
+  // otherwise ignored. Returns whether the advice was taken.
+  bool Advise(uint64_t offset, uint64_t size, int advice) const;
+
   unsigned char* addr;  // start of data
   size_t length;        // length of data
 
@@ -97,6 +107,9 @@ class MemMapping {
 
   bool MapBlockFile(const std::string& filename);
   bool MapFD(int fd);
+  // Maps |ranges| of |fd| into a contiguous segment of |blocks| blocks of |block_size|, which the
+  // ranges need to fill exactly.
+  bool MapRanges(int fd, const RangeSet& ranges, uint32_t block_size, uint64_t blocks);
 
   std::vector<MappedRange> ranges_;
 };
@@ -108,6 +121,10 @@ class MemMapping {
 // Triggers a shutdown.
 bool Shutdown(std::string_view target);
 
+// Returns the memory that's free or easily reclaimed (MemFree, plus Buffers and Cached from
+// /proc/meminfo), in bytes. Returns 0 if it can't be read.
+uint64_t GetFreeMemory();
+
 // Returns a null-terminated char* array, where the elements point to the C-strings in the given
 // vector, plus an additional nullptr at the end. This is a helper function that facilitates
 // calling C functions (such as getopt(3)) that expect an array of C-strings.
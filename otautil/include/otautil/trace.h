@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// The kinds of events in the trace. The names in the trace file come from kTraceEventNames in
+// trace.cpp, which must be kept in sync.
+enum class TraceEvent : uint16_t {
+  kCommand,    // A transfer list command; the arg is the command index.
+  kRead,       // A read of the block device; the arg is the number of bytes.
+  kWrite,      // A write of the block device; the arg is the number of bytes.
+  kStashLoad,  // Loading a stash, from memory or from disk.
+  kStashSave,  // Saving a stash; the arg is the number of blocks.
+  kHash,       // Hashing data for verification; the arg is the number of bytes.
+  kStartup,    // A stage of the recovery startup; the arg is the stage (see recovery_main.cpp).
+  kCount,
+};
+
+// Records an event that started at |start_ns| (from MonotonicTimeNs()) and ends now, into a fixed
+// size ring in memory that keeps the latest events. It takes a clock read and a few stores, with no
+// formatting or allocation, so it's cheap enough for the hot paths. Thread-safe.
+void RecordTraceEvent(TraceEvent event, uint64_t start_ns, uint64_t arg);
+
+// Returns the time of CLOCK_MONOTONIC in nanoseconds, which the trace events use.
+uint64_t MonotonicTimeNs();
+
+// Records the event that spans the lifetime of the object.
+class ScopedTrace {
+ public:
+  ScopedTrace(TraceEvent event, uint64_t arg)
+      : event_(event), arg_(arg), start_ns_(MonotonicTimeNs()) {}
+  ~ScopedTrace() {
+    RecordTraceEvent(event_, start_ns_, arg_);
+  }
+
+ private:
+  TraceEvent event_;
+  uint64_t arg_;
+  uint64_t start_ns_;
+};
+
+// Writes the recorded events to |path| in the JSON trace event format, which chrome://tracing and
+// Perfetto load. Returns false on errors.
+bool WriteTraceFile(const std::string& path);
+
+// Returns the durations in nanoseconds of the recorded |event|s that are still in the ring, oldest
+// first.
+std::vector<uint64_t> GetTraceDurations(TraceEvent event);
+
+// Drops all the recorded events, e.g. to look at a single run with GetTraceDurations(). Not safe
+// against concurrent RecordTraceEvent() calls.
+void ClearTrace();
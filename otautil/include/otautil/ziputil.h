@@ -48,10 +48,24 @@
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
+ * Files are inflated by several threads, in no particular order. The
+ * filesystem of dest_path is synced once all of them are written.
+ *
+ * If skip_unchanged is true, files that already hold the contents of their
+ * entries (see FileMatchesZipEntry()) are left alone, apart from their
+ * timestamps. Their SELinux labels are not reapplied.
+ *
  * Returns true on success, false on failure.
  */
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
-                             struct selabel_handle* sehnd);
+                             struct selabel_handle* sehnd, bool skip_unchanged = false);
+
+/*
+ * Returns true if path is a regular file with the size and the CRC32 of
+ * entry. Reading a file back is much cheaper than rewriting and syncing it,
+ * which makes this worthwhile for repeated installs of the same files.
+ */
+bool FileMatchesZipEntry(const std::string& path, const ZipEntryCommon& entry);
 
 #endif  // _OTAUTIL_ZIPUTIL_H
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/live_stats.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include "otautil/memory_budget.h"
+#include "otautil/phase_stats.h"
+
+static constexpr auto kLiveStatsInterval = std::chrono::seconds(1);
+
+static std::mutex live_lock;
+static std::map<std::string, uint64_t> live_counters;
+// The process that publishes the stats, if any.
+static pid_t live_pid = 0;
+
+void SetLiveCounter(const std::string& name, uint64_t value) {
+  std::lock_guard<std::mutex> lock(live_lock);
+  live_counters[name] = value;
+}
+
+// Appends the counters of |file| (lines of "key: value", e.g. /proc/self/io) that are in |keys|.
+static void AppendProcCounters(const std::string& file, const std::vector<std::string>& keys,
+                               std::vector<std::string>* lines) {
+  std::string content;
+  if (!android::base::ReadFileToString(file, &content)) {
+    return;
+  }
+  for (const auto& line : android::base::Split(content, "\n")) {
+    for (const auto& key : keys) {
+      if (android::base::StartsWith(line, key + ":")) {
+        lines->push_back(line);
+      }
+    }
+  }
+}
+
+// Appends the CPU time of each thread of the process, e.g. "cpu_ms_1234_updater: 120".
+static void AppendThreadCpu(std::vector<std::string>* lines) {
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir("/proc/self/task"), closedir);
+  if (!dir) {
+    return;
+  }
+  long ticks_per_second = sysconf(_SC_CLK_TCK);
+  dirent* de;
+  while ((de = readdir(dir.get())) != nullptr) {
+    if (de->d_name[0] == '.') {
+      continue;
+    }
+    std::string stat;
+    std::string stat_path = std::string("/proc/self/task/") + de->d_name + "/stat";
+    if (!android::base::ReadFileToString(stat_path, &stat)) {
+      continue;
+    }
+    // "<tid> (<comm>) <state> ...", where utime and stime are the 14th and the 15th fields.
+    size_t open = stat.find('(');
+    size_t close = stat.rfind(')');
+    if (open == std::string::npos || close == std::string::npos || close < open) {
+      continue;
+    }
+    std::string comm = stat.substr(open + 1, close - open - 1);
+    std::replace(comm.begin(), comm.end(), ' ', '_');
+    std::vector<std::string> fields = android::base::Split(stat.substr(close + 2), " ");
+    uint64_t utime, stime;
+    if (fields.size() < 13 || !android::base::ParseUint(fields[11], &utime) ||
+        !android::base::ParseUint(fields[12], &stime)) {
+      continue;
+    }
+    lines->push_back(std::string("cpu_ms_") + de->d_name + "_" + comm + ": " +
+                     std::to_string((utime + stime) * 1000 / ticks_per_second));
+  }
+}
+
+std::vector<std::string> FormatLiveStats() {
+  std::vector<std::string> lines;
+  lines.push_back("pid: " + std::to_string(getpid()));
+  lines.push_back("phases: " + android::base::Join(GetRunningPhases(), ","));
+  AppendProcCounters("/proc/self/io", { "read_bytes", "write_bytes" }, &lines);
+  AppendThreadCpu(&lines);
+  const MemoryBudget& budget = MemoryBudget::Get();
+  lines.push_back("memory_budget_bytes: " + std::to_string(budget.limit()));
+  lines.push_back("memory_budget_available_bytes: " + std::to_string(budget.available()));
+  std::lock_guard<std::mutex> lock(live_lock);
+  for (const auto& [name, value] : live_counters) {
+    lines.push_back(name + ": " + std::to_string(value));
+  }
+  return lines;
+}
+
+void StartLiveStats(const std::string& name) {
+  {
+    std::lock_guard<std::mutex> lock(live_lock);
+    if (live_pid == getpid()) {
+      return;
+    }
+    live_pid = getpid();
+  }
+  if (mkdir(kLiveStatsDir, 0755) == -1 && errno != EEXIST) {
+    PLOG(WARNING) << "Not publishing the live stats; failed to create " << kLiveStatsDir;
+    return;
+  }
+  std::string path = std::string(kLiveStatsDir) + "/" + name;
+  std::thread([path]() {
+    std::string tmp_path = path + ".tmp";
+    while (true) {
+      std::string content = android::base::Join(FormatLiveStats(), "\n") + "\n";
+      if (!android::base::WriteStringToFile(content, tmp_path) ||
+          rename(tmp_path.c_str(), path.c_str()) == -1) {
+        PLOG(WARNING) << "Stopped publishing the live stats to " << path;
+        return;
+      }
+      std::this_thread::sleep_for(kLiveStatsInterval);
+    }
+  }).detach();
+}
+
+std::map<std::string, DiskIo> ReadDiskStats(const std::string& diskstats) {
+  std::map<std::string, DiskIo> disks;
+  std::string content;
+  if (!android::base::ReadFileToString(diskstats, &content)) {
+    return disks;
+  }
+  // "<major> <minor> <name> <reads> <reads merged> <sectors read> <ms reading> <writes>
+  // <writes merged> <sectors written> ...", in sectors of 512 bytes.
+  for (const auto& line : android::base::Split(content, "\n")) {
+    std::vector<std::string> fields = android::base::Tokenize(line, " ");
+    uint64_t sectors_read, sectors_written;
+    if (fields.size() < 10 || !android::base::ParseUint(fields[5], &sectors_read) ||
+        !android::base::ParseUint(fields[9], &sectors_written)) {
+      continue;
+    }
+    if (sectors_read == 0 && sectors_written == 0) {
+      continue;
+    }
+    disks[fields[2]] = { sectors_read * 512, sectors_written * 512 };
+  }
+  return disks;
+}
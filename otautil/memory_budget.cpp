@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/memory_budget.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/unique_fd.h>
+
+#include "otautil/sysutil.h"
+
+// The PSI trigger of MonitorPressure(): some task stalled on memory for 100 ms within a second.
+static constexpr char kPressureTrigger[] = "some 100000 1000000";
+
+MemoryBudget::Reservation::Reservation(MemoryBudget* budget, std::string name, Priority priority,
+                                       uint64_t min_size, bool shrinkable, uint64_t size)
+    : budget_(budget),
+      name_(std::move(name)),
+      priority_(priority),
+      min_size_(min_size),
+      shrinkable_(shrinkable),
+      size_(size) {}
+
+MemoryBudget::Reservation::~Reservation() {
+  std::lock_guard<std::mutex> lock(budget_->mutex_);
+  budget_->Resize(this, 0);
+  budget_->reservations_.remove(this);
+}
+
+void MemoryBudget::Reservation::Shrink(uint64_t size) {
+  std::lock_guard<std::mutex> lock(budget_->mutex_);
+  if (size < size_) {
+    budget_->Resize(this, size);
+  }
+}
+
+MemoryBudget& MemoryBudget::Get() {
+  static MemoryBudget* budget = []() {
+    uint64_t limit;
+    if (const char* value = getenv(kEnvironmentVariable);
+        value != nullptr && android::base::ParseUint(value, &limit)) {
+      LOG(INFO) << "Memory budget of " << limit << " bytes, from the parent process";
+      return new MemoryBudget(limit);
+    }
+    uint64_t free_memory = GetFreeMemory();
+    limit = free_memory > kReservedMemory ? free_memory - kReservedMemory : 0;
+    LOG(INFO) << "Memory budget of " << limit << " bytes, of " << free_memory << " bytes free";
+    return new MemoryBudget(limit);
+  }();
+  return *budget;
+}
+
+uint64_t MemoryBudget::available() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return limit_ > reserved_ ? limit_ - reserved_ : 0;
+}
+
+void MemoryBudget::Resize(Reservation* reservation, uint64_t size) {
+  reserved_ -= reservation->size_;
+  reserved_ += size;
+  reservation->size_ = size;
+}
+
+uint64_t MemoryBudget::Reclaimable(Priority priority) const {
+  uint64_t reclaimable = 0;
+  for (const auto* reservation : reservations_) {
+    if (reservation->shrinkable_ && reservation->priority_ < priority) {
+      reclaimable += reservation->size_ - reservation->min_size_;
+    }
+  }
+  return reclaimable;
+}
+
+uint64_t MemoryBudget::Reclaim(uint64_t bytes, Priority priority) {
+  uint64_t reclaimed = 0;
+  for (auto level = Priority::kCache; level < priority && reclaimed < bytes;
+       level = static_cast<Priority>(static_cast<int>(level) + 1)) {
+    for (auto* reservation : reservations_) {
+      if (!reservation->shrinkable_ || reservation->priority_ != level) {
+        continue;
+      }
+      uint64_t take = std::min(reservation->size_ - reservation->min_size_, bytes - reclaimed);
+      if (take > 0) {
+        LOG(INFO) << "Reclaiming " << take << " bytes of the memory budget from "
+                  << reservation->name_;
+        Resize(reservation, reservation->size_ - take);
+        reclaimed += take;
+      }
+    }
+  }
+  return reclaimed;
+}
+
+std::unique_ptr<MemoryBudget::Reservation> MemoryBudget::Reserve(const std::string& name,
+                                                                 uint64_t max_size,
+                                                                 uint64_t min_size,
+                                                                 Priority priority,
+                                                                 bool shrinkable) {
+  min_size = std::min(min_size, max_size);
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t available = limit_ > reserved_ ? limit_ - reserved_ : 0;
+  if (available < max_size) {
+    uint64_t reclaimable = Reclaimable(priority);
+    if (available + reclaimable < min_size) {
+      LOG(INFO) << "No room in the memory budget for the " << min_size << " bytes of " << name
+                << "; " << available << " bytes available";
+      return nullptr;
+    }
+    available += Reclaim(max_size - available, priority);
+  }
+  uint64_t size = std::min(max_size, available);
+  if (size < max_size) {
+    LOG(INFO) << "Reserving " << size << " bytes of the memory budget for " << name << ", of "
+              << max_size << " bytes asked for";
+  }
+  std::unique_ptr<Reservation> reservation(
+      new Reservation(this, name, priority, min_size, shrinkable, 0));
+  Resize(reservation.get(), size);
+  reservations_.push_back(reservation.get());
+  return reservation;
+}
+
+uint64_t MemoryBudget::ReclaimCaches(double fraction) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t reclaimed = 0;
+  for (auto* reservation : reservations_) {
+    if (!reservation->shrinkable_ || reservation->priority_ != Priority::kCache) {
+      continue;
+    }
+    uint64_t take = static_cast<uint64_t>((reservation->size_ - reservation->min_size_) * fraction);
+    Resize(reservation, reservation->size_ - take);
+    reclaimed += take;
+  }
+  return reclaimed;
+}
+
+bool MemoryBudget::MonitorPressure(const std::string& pressure_file) {
+  android::base::unique_fd fd(open(pressure_file.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC));
+  if (fd == -1) {
+    PLOG(INFO) << "Not monitoring the memory pressure; failed to open " << pressure_file;
+    return false;
+  }
+  // The trigger is written including the terminating null.
+  if (!android::base::WriteFully(fd, kPressureTrigger, sizeof(kPressureTrigger))) {
+    PLOG(INFO) << "Not monitoring the memory pressure; failed to set the trigger on "
+               << pressure_file;
+    return false;
+  }
+  std::thread([this, fd = std::move(fd)]() {
+    struct pollfd pfd = { .fd = fd.get(), .events = POLLPRI };
+    while (TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) > 0) {
+      if (pfd.revents & POLLERR) {
+        LOG(WARNING) << "Stopped monitoring the memory pressure";
+        return;
+      }
+      if (pfd.revents & POLLPRI) {
+        if (uint64_t reclaimed = ReclaimCaches(0.5); reclaimed > 0) {
+          LOG(INFO) << "Reclaimed " << reclaimed << " bytes of caches under memory pressure";
+        }
+      }
+    }
+  }).detach();
+  return true;
+}
+
+void MemoryBudget::Export() const {
+  setenv(kEnvironmentVariable, std::to_string(available()).c_str(), 1);
+}
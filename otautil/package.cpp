@@ -17,14 +17,24 @@
 #include "otautil/package.h"
 
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 
 #include "otautil/error_code.h"
+#include "otautil/phase_stats.h"
 #include "otautil/sysutil.h"
 
 // This class wraps the package in memory, i.e. a memory mapped package, or a package loaded
@@ -77,12 +87,121 @@ class MemoryPackage : public Package {
   ZipArchiveHandle zip_handle_;
 };
 
+// The package is hashed in pieces of this size, with up to kHashPieceCount of them read ahead of
+// the slowest hasher. Bigger reads used to pay off while reading and hashing took turns (16MiB beat
+// 1MiB by 60% for an 89MiB incremental OTA on a Nexus 5X, http://b/28135231); with the reads
+// overlapping the hashing, a few smaller buffers do as well.
+static constexpr uint64_t kHashPieceSize = 8 * MiB;
+static constexpr size_t kHashPieceCount = 3;
+
+// Returns the piece of |size| bytes at |offset|, reading it into |buffer| if needed, or nullptr on
+// errors.
+using ReadPieceFn = std::function<const uint8_t*(uint64_t offset, uint64_t size, uint8_t* buffer)>;
+
+// Feeds the |length| bytes at |start| to each of the |hashers|, in order. The pieces come from
+// |read_piece| on a separate thread, so that the reads overlap with the hashing. If |use_buffers|
+// is set, each piece is read into one of kHashPieceCount preallocated buffers, which gets reused
+// once all the hashers are done with it. With multiple hashers (e.g. SHA-1 and SHA-256), each runs
+// on its own thread, with the first one on the calling thread. Returns false if any read fails.
+static bool HashPieces(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
+                       uint64_t length, const ReadPieceFn& read_piece, bool use_buffers) {
+  if (hashers.empty() || length == 0) {
+    return true;
+  }
+
+  uint64_t num_pieces = (length + kHashPieceSize - 1) / kHashPieceSize;
+  std::vector<std::vector<uint8_t>> buffers;
+  if (use_buffers) {
+    for (size_t i = 0; i < std::min<uint64_t>(num_pieces, kHashPieceCount); i++) {
+      buffers.emplace_back(std::min(length, kHashPieceSize));
+    }
+  }
+
+  struct Piece {
+    const uint8_t* data;
+    uint64_t size;
+  };
+  Piece pieces[kHashPieceCount];
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint64_t produced = 0;
+  bool failed = false;
+  // The number of pieces that each hasher is done with.
+  std::vector<uint64_t> consumed(hashers.size(), 0);
+
+  std::thread reader([&]() {
+    for (uint64_t i = 0; i < num_pieces; i++) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] {
+          return i - *std::min_element(consumed.begin(), consumed.end()) < kHashPieceCount;
+        });
+      }
+
+      uint64_t offset = i * kHashPieceSize;
+      uint64_t size = std::min(kHashPieceSize, length - offset);
+      uint8_t* buffer = use_buffers ? buffers[i % kHashPieceCount].data() : nullptr;
+      const uint8_t* data = read_piece(start + offset, size, buffer);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (data == nullptr) {
+        failed = true;
+        cv.notify_all();
+        return;
+      }
+      pieces[i % kHashPieceCount] = { data, size };
+      produced = i + 1;
+      cv.notify_all();
+    }
+  });
+
+  auto hash = [&](size_t index) {
+    for (uint64_t i = 0; i < num_pieces; i++) {
+      Piece piece;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return failed || produced > i; });
+        if (produced <= i) {
+          return;
+        }
+        piece = pieces[i % kHashPieceCount];
+      }
+
+      hashers[index](piece.data, piece.size);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      consumed[index] = i + 1;
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < hashers.size(); i++) {
+    threads.emplace_back(hash, i);
+  }
+  hash(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  reader.join();
+
+  return !failed;
+}
+
 void Package::SetProgress(float progress) {
   if (set_progress_) {
     set_progress_(progress);
   }
 }
 
+// The small reads of a FilePackage (the signature footer and the EOCD, the metadata, the keys...)
+// are served from a cache of aligned blocks, so that each costs at most one large pread. This
+// matters through FUSE and on slow SD cards, where each read has a high fixed cost. Reads of at
+// least a block (e.g. the pieces of UpdateHashAtOffset()) go straight to the fd.
+static constexpr uint64_t kReadCacheBlockSize = 64 * 1024;
+static constexpr uint64_t kReadCacheBlocks = 16;
+
 class FilePackage : public Package {
  public:
   FilePackage(android::base::unique_fd&& fd, uint64_t file_size, const std::string& path,
@@ -110,15 +229,38 @@ class FilePackage : public Package {
                           uint64_t length) override;
 
  private:
+  // Serves a read of less than kReadCacheBlockSize bytes from the block cache.
+  bool ReadCached(uint8_t* buffer, uint64_t byte_count, uint64_t offset);
+  // Reads up to |count| blocks from block |first| on into the cache, with a single pread.
+  bool FillCache(uint64_t first, uint64_t count);
+
   android::base::unique_fd fd_;  // The underlying fd to the open package.
   uint64_t package_size_;
   std::string path_;  // The physical path to the package.
 
   ZipArchiveHandle zip_handle_;
+
+  struct CachedBlock {
+    std::vector<uint8_t> data;
+    uint64_t last_use;
+  };
+
+  // Guards the block cache; the reads of UpdateHashAtOffset() come from another thread.
+  std::mutex cache_lock_;
+  // The cached blocks by index, up to kReadCacheBlocks of them.
+  std::map<uint64_t, CachedBlock> cache_;
+  uint64_t cache_clock_ = 0;
+  // Where the previous small read ended, to detect the sequential runs.
+  uint64_t next_read_offset_ = 0;
+  // How many blocks a cache miss reads; doubles along a sequential run.
+  uint64_t read_ahead_blocks_ = 1;
 };
 
+
 std::unique_ptr<Package> Package::CreateMemoryPackage(
     const std::string& path, const std::function<void(float)>& set_progress) {
+  // For a block map ("@/cache/recovery/block.map"), this is where uncrypt's map gets loaded.
+  ScopedPhase phase("package_map");
   std::unique_ptr<MemMapping> mmap = std::make_unique<MemMapping>();
   if (!mmap->MapFile(path)) {
     LOG(ERROR) << "failed to map file";
@@ -191,10 +333,29 @@ bool MemoryPackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>&
     return false;
   }
 
-  for (const auto& hasher : hashers) {
-    hasher(addr_ + start, length);
+  if (!map_) {
+    auto map = [this](uint64_t offset, uint64_t /* size */, uint8_t* /* buffer */) {
+      return addr_ + offset;
+    };
+    return HashPieces(hashers, start, length, map, false);
   }
-  return true;
+
+  // The range gets read through once, front to back; lets the kernel read ahead aggressively, and
+  // asks for the next piece while the current one is being hashed.
+  map_->Advise(start, length, MADV_SEQUENTIAL);
+  uint64_t end = start + length;
+  bool result = HashPieces(
+      hashers, start, length,
+      [this, end](uint64_t offset, uint64_t size, uint8_t* /* buffer */) {
+        if (offset + size < end) {
+          map_->Advise(offset + size, std::min(kHashPieceSize, end - offset - size),
+                       MADV_WILLNEED);
+        }
+        return addr_ + offset;
+      },
+      false);
+  map_->Advise(start, length, MADV_NORMAL);
+  return result;
 }
 
 ZipArchiveHandle MemoryPackage::GetZipArchiveHandle() {
@@ -202,6 +363,11 @@ ZipArchiveHandle MemoryPackage::GetZipArchiveHandle() {
     return zip_handle_;
   }
 
+  // The lookups of the central directory, and of the entries through it, jump around the package;
+  // reading ahead of them only wastes memory.
+  if (map_) {
+    map_->Advise(0, package_size_, MADV_RANDOM);
+  }
   if (auto err = OpenArchiveFromMemory(const_cast<uint8_t*>(addr_), package_size_, path_.c_str(),
                                        &zip_handle_);
       err != 0) {
@@ -231,6 +397,10 @@ bool FilePackage::ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64
     return false;
   }
 
+  if (byte_count < kReadCacheBlockSize) {
+    return ReadCached(buffer, byte_count, offset);
+  }
+
   if (!android::base::ReadFullyAtOffset(fd_.get(), buffer, byte_count, offset)) {
     PLOG(ERROR) << "Failed to read " << byte_count << " bytes data at offset " << offset;
     return false;
@@ -239,6 +409,64 @@ bool FilePackage::ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64
   return true;
 }
 
+bool FilePackage::ReadCached(uint8_t* buffer, uint64_t byte_count, uint64_t offset) {
+  if (byte_count == 0) {
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(cache_lock_);
+  if (offset == next_read_offset_) {
+    read_ahead_blocks_ = std::min(read_ahead_blocks_ * 2, kReadCacheBlocks);
+  } else {
+    read_ahead_blocks_ = 1;
+  }
+  next_read_offset_ = offset + byte_count;
+
+  uint64_t last = (offset + byte_count - 1) / kReadCacheBlockSize;
+  for (uint64_t block = offset / kReadCacheBlockSize; block <= last; block++) {
+    auto it = cache_.find(block);
+    if (it == cache_.end()) {
+      if (!FillCache(block, std::max(last - block + 1, read_ahead_blocks_))) {
+        return false;
+      }
+      it = cache_.find(block);
+    }
+    it->second.last_use = ++cache_clock_;
+
+    uint64_t block_start = block * kReadCacheBlockSize;
+    uint64_t begin = std::max(offset, block_start) - block_start;
+    uint64_t end = std::min(offset + byte_count - block_start, kReadCacheBlockSize);
+    CHECK_LE(end, it->second.data.size());
+    memcpy(buffer, it->second.data.data() + begin, end - begin);
+    buffer += end - begin;
+  }
+  return true;
+}
+
+bool FilePackage::FillCache(uint64_t first, uint64_t count) {
+  uint64_t start = first * kReadCacheBlockSize;
+  uint64_t size = std::min(count * kReadCacheBlockSize, package_size_ - start);
+  std::vector<uint8_t> data(size);
+  if (!android::base::ReadFullyAtOffset(fd_.get(), data.data(), size, start)) {
+    PLOG(ERROR) << "Failed to read " << size << " bytes data at offset " << start;
+    return false;
+  }
+
+  for (uint64_t pos = 0; pos < size; pos += kReadCacheBlockSize) {
+    if (cache_.size() >= kReadCacheBlocks) {
+      auto oldest = std::min_element(cache_.begin(), cache_.end(), [](auto& a, auto& b) {
+        return a.second.last_use < b.second.last_use;
+      });
+      cache_.erase(oldest);
+    }
+    uint64_t block_size = std::min(kReadCacheBlockSize, size - pos);
+    cache_[first + pos / kReadCacheBlockSize] = CachedBlock{
+      std::vector<uint8_t>(data.begin() + pos, data.begin() + pos + block_size), ++cache_clock_
+    };
+  }
+  return true;
+}
+
 bool FilePackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers,
                                      uint64_t start, uint64_t length) {
   if (length > package_size_ || start > package_size_ - length) {
@@ -247,21 +475,12 @@ bool FilePackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& ha
     return false;
   }
 
-  uint64_t so_far = 0;
-  while (so_far < length) {
-    uint64_t read_size = std::min<uint64_t>(length - so_far, 16 * MiB);
-    std::vector<uint8_t> buffer(read_size);
-    if (!ReadFullyAtOffset(buffer.data(), read_size, start + so_far)) {
-      return false;
-    }
-
-    for (const auto& hasher : hashers) {
-      hasher(buffer.data(), read_size);
-    }
-    so_far += read_size;
-  }
-
-  return true;
+  return HashPieces(
+      hashers, start, length,
+      [this](uint64_t offset, uint64_t size, uint8_t* buffer) -> const uint8_t* {
+        return ReadFullyAtOffset(buffer, size, offset) ? buffer : nullptr;
+      },
+      true);
 }
 
 ZipArchiveHandle FilePackage::GetZipArchiveHandle() {
@@ -19,10 +19,14 @@
 constexpr const char kDefaultCacheLogDirectory[] = "/cache/recovery";
 constexpr const char kDefaultCacheTempSource[] = "/cache/saved.file";
 constexpr const char kDefaultLastCommandFile[] = "/cache/recovery/last_command";
+constexpr const char kDefaultPartitionCheckRecord[] = "/metadata/ota/partition_checks";
 constexpr const char kDefaultResourceDirectory[] = "/res/images";
 constexpr const char kDefaultStashDirectoryBase[] = "/cache/recovery";
 constexpr const char kDefaultTemporaryInstallFile[] = "/tmp/last_install";
 constexpr const char kDefaultTemporaryLogFile[] = "/tmp/recovery.log";
+constexpr const char kDefaultTemporaryTraceFile[] = "/tmp/update_trace.json";
+constexpr const char kDefaultTemporaryIoTraceFile[] = "/tmp/update_io_trace";
+constexpr const char kDefaultTemporaryStartupTraceFile[] = "/tmp/recovery_startup_trace.json";
 constexpr const char kDefaultTemporaryUpdateBinary[] = "/tmp/update-binary";
 
 Paths& Paths::Get() {
@@ -34,8 +38,12 @@ Paths::Paths()
     : cache_log_directory_(kDefaultCacheLogDirectory),
       cache_temp_source_(kDefaultCacheTempSource),
       last_command_file_(kDefaultLastCommandFile),
+      partition_check_record_(kDefaultPartitionCheckRecord),
       resource_dir_(kDefaultResourceDirectory),
       stash_directory_base_(kDefaultStashDirectoryBase),
       temporary_install_file_(kDefaultTemporaryInstallFile),
       temporary_log_file_(kDefaultTemporaryLogFile),
+      temporary_trace_file_(kDefaultTemporaryTraceFile),
+      temporary_startup_trace_file_(kDefaultTemporaryStartupTraceFile),
+      temporary_io_trace_file_(kDefaultTemporaryIoTraceFile),
       temporary_update_binary_(kDefaultTemporaryUpdateBinary) {}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/phase_stats.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+
+static std::mutex phase_lock;
+static std::map<std::string, PhaseStats> phase_stats;
+// The number of instances of each phase that are running.
+static std::map<std::string, size_t> running_phases;
+static std::atomic<uint64_t> fsync_count{ 0 };
+
+static uint64_t ClockUs(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Reads the storage I/O of the process so far. The file stays open, since every command of a
+// transfer list takes two reads; /proc regenerates the content on each read from offset 0.
+static void ReadProcessIo(uint64_t* read_bytes, uint64_t* write_bytes) {
+  static int fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+  *read_bytes = 0;
+  *write_bytes = 0;
+  char buf[512];
+  ssize_t n = (fd == -1) ? -1 : pread(fd, buf, sizeof(buf) - 1, 0);
+  if (n <= 0) {
+    return;
+  }
+  buf[n] = '\0';
+  if (const char* p = strstr(buf, "\nread_bytes: "); p != nullptr) {
+    sscanf(p, "\nread_bytes: %" SCNu64, read_bytes);
+  }
+  if (const char* p = strstr(buf, "\nwrite_bytes: "); p != nullptr) {
+    sscanf(p, "\nwrite_bytes: %" SCNu64, write_bytes);
+  }
+}
+
+ScopedPhase::Snapshot ScopedPhase::TakeSnapshot() {
+  Snapshot snapshot;
+  snapshot.wall_us = ClockUs(CLOCK_MONOTONIC);
+  snapshot.cpu_us = ClockUs(CLOCK_PROCESS_CPUTIME_ID);
+  ReadProcessIo(&snapshot.read_bytes, &snapshot.write_bytes);
+  snapshot.fsyncs = fsync_count.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+ScopedPhase::ScopedPhase(std::string name) : name_(std::move(name)), start_(TakeSnapshot()) {
+  std::lock_guard<std::mutex> lock(phase_lock);
+  running_phases[name_]++;
+}
+
+ScopedPhase::~ScopedPhase() {
+  Snapshot end = TakeSnapshot();
+  std::lock_guard<std::mutex> lock(phase_lock);
+  if (auto it = running_phases.find(name_); --it->second == 0) {
+    running_phases.erase(it);
+  }
+  PhaseStats& stats = phase_stats[name_];
+  stats.count++;
+  stats.wall_us += end.wall_us - start_.wall_us;
+  stats.cpu_us += end.cpu_us - start_.cpu_us;
+  // The I/O counters may be unavailable, in which case both ends read 0.
+  stats.read_bytes += end.read_bytes - start_.read_bytes;
+  stats.write_bytes += end.write_bytes - start_.write_bytes;
+  stats.fsyncs += end.fsyncs - start_.fsyncs;
+}
+
+void CountFsync() {
+  fsync_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::map<std::string, PhaseStats> GetPhaseStats() {
+  std::lock_guard<std::mutex> lock(phase_lock);
+  return phase_stats;
+}
+
+std::vector<std::string> GetRunningPhases() {
+  std::lock_guard<std::mutex> lock(phase_lock);
+  std::vector<std::string> names;
+  for (const auto& [name, count] : running_phases) {
+    names.push_back(name);
+  }
+  return names;
+}
+
+std::vector<std::string> FormatPhaseStats(const std::string& prefix) {
+  std::vector<std::string> lines;
+  for (const auto& [name, stats] : GetPhaseStats()) {
+    std::pair<const char*, uint64_t> values[] = {
+      { "count", stats.count },
+      { "wall_ms", stats.wall_us / 1000 },
+      { "cpu_ms", stats.cpu_us / 1000 },
+      { "read_kib", stats.read_bytes / 1024 },
+      { "write_kib", stats.write_bytes / 1024 },
+      { "fsyncs", stats.fsyncs },
+    };
+    for (const auto& [key, value] : values) {
+      lines.push_back(android::base::StringPrintf("%sphase_%s_%s: %" PRIu64, prefix.c_str(),
+                                                  name.c_str(), key, value));
+    }
+  }
+  return lines;
+}
+
+void ClearPhaseStats() {
+  std::lock_guard<std::mutex> lock(phase_lock);
+  phase_stats.clear();
+}
@@ -16,18 +16,20 @@
 
 #include "otautil/rangeset.h"
 
+#include <ctype.h>
 #include <limits.h>
 #include <stddef.h>
 
 #include <algorithm>
+#include <charconv>
+#include <iterator>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
-#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
-#include <android-base/strings.h>
 
 RangeSet::RangeSet(std::vector<Range>&& pairs) {
   blocks_ = 0;
@@ -44,15 +46,40 @@ RangeSet::RangeSet(std::vector<Range>&& pairs) {
   }
 }
 
-RangeSet RangeSet::Parse(const std::string& range_text) {
-  std::vector<std::string> pieces = android::base::Split(range_text, ",");
-  if (pieces.size() < 3) {
+// Parses |token| in place into |*value|, no greater than INT_MAX. Accepts what
+// android::base::ParseUint() does for the range text, i.e. leading whitespace and a "0x" prefix.
+static bool ParseRangeToken(std::string_view token, size_t* value) {
+  while (!token.empty() && isspace(static_cast<unsigned char>(token.front()))) {
+    token.remove_prefix(1);
+  }
+  int base = 10;
+  if (token.size() > 2 && token[0] == '0' && (token[1] == 'x' || token[1] == 'X')) {
+    base = 16;
+    token.remove_prefix(2);
+  }
+  const char* last = token.data() + token.size();
+  auto [ptr, ec] = std::from_chars(token.data(), last, *value, base);
+  return ec == std::errc() && ptr == last && *value <= static_cast<size_t>(INT_MAX);
+}
+
+// Returns the text up to the next comma in |*text|, and drops it along with the comma.
+static std::string_view NextRangeToken(std::string_view* text) {
+  size_t comma = text->find(',');
+  std::string_view token = text->substr(0, comma);
+  text->remove_prefix(comma == std::string_view::npos ? text->size() : comma + 1);
+  return token;
+}
+
+RangeSet RangeSet::Parse(std::string_view range_text) {
+  size_t tokens = std::count(range_text.cbegin(), range_text.cend(), ',');
+  if (tokens < 2) {
     LOG(ERROR) << "Invalid range text: " << range_text;
     return {};
   }
 
+  std::string_view remaining = range_text;
   size_t num;
-  if (!android::base::ParseUint(pieces[0], &num, static_cast<size_t>(INT_MAX))) {
+  if (!ParseRangeToken(NextRangeToken(&remaining), &num)) {
     LOG(ERROR) << "Failed to parse the number of tokens: " << range_text;
     return {};
   }
@@ -64,22 +91,26 @@ RangeSet RangeSet::Parse(const std::string& range_text) {
     LOG(ERROR) << "Number of tokens must be even: " << range_text;
     return {};
   }
-  if (num != pieces.size() - 1) {
+  if (num != tokens) {
     LOG(ERROR) << "Mismatching number of tokens: " << range_text;
     return {};
   }
 
-  std::vector<Range> pairs;
+  // Push the ranges straight into the result, which makes its vector the only allocation.
+  RangeSet result;
+  result.ranges_.reserve(num / 2);
   for (size_t i = 0; i < num; i += 2) {
     size_t first;
     size_t second;
-    if (!android::base::ParseUint(pieces[i + 1], &first, static_cast<size_t>(INT_MAX)) ||
-        !android::base::ParseUint(pieces[i + 2], &second, static_cast<size_t>(INT_MAX))) {
+    if (!ParseRangeToken(NextRangeToken(&remaining), &first) ||
+        !ParseRangeToken(NextRangeToken(&remaining), &second)) {
+      return {};
+    }
+    if (!result.PushBack({ first, second })) {
       return {};
     }
-    pairs.emplace_back(first, second);
   }
-  return RangeSet(std::move(pairs));
+  return result;
 }
 
 bool RangeSet::PushBack(Range range) {
@@ -170,18 +201,56 @@ size_t RangeSet::GetBlockNumber(size_t idx) const {
   return 0;  // Unreachable, but to make compiler happy.
 }
 
+// Up to this many pairs of ranges, Overlaps() compares every range against every other, which
+// beats sorting them.
+static constexpr size_t kPairwiseOverlapLimit = 64;
+
+// Returns whether any range of |a| overlaps any range of |b|, both of which are sorted by their
+// starts. Ranges within one set may overlap each other.
+static bool SortedRangesOverlap(const std::vector<Range>& a, const std::vector<Range>& b) {
+  auto it_a = a.cbegin();
+  auto it_b = b.cbegin();
+  while (it_a != a.cend() && it_b != b.cend()) {
+    // A range that ends before the other one starts can't reach any of the later ranges either.
+    if (it_a->second <= it_b->first) {
+      ++it_a;
+    } else if (it_b->second <= it_a->first) {
+      ++it_b;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
 // RangeSet has half-closed half-open bounds. For example, "3,5" contains blocks 3 and 4. So "3,5"
 // and "5,7" are not overlapped.
 bool RangeSet::Overlaps(const RangeSet& other) const {
-  for (const auto& [begin, end] : ranges_) {
-    for (const auto& [other_begin, other_end] : other.ranges_) {
-      // [begin, end) vs [other_begin, other_end)
-      if (!(other_begin >= end || begin >= other_end)) {
-        return true;
+  if (ranges_.size() * other.ranges_.size() <= kPairwiseOverlapLimit) {
+    for (const auto& [begin, end] : ranges_) {
+      for (const auto& [other_begin, other_end] : other.ranges_) {
+        // [begin, end) vs [other_begin, other_end)
+        if (!(other_begin >= end || begin >= other_end)) {
+          return true;
+        }
       }
     }
+    return false;
   }
-  return false;
+
+  // Sweep both sets in the order of the starts, which is linear once they're sorted. The ranges
+  // in transfer lists usually are, so the copies are rarely made.
+  auto sorted = [](const std::vector<Range>& ranges, std::vector<Range>* copy) {
+    if (std::is_sorted(ranges.cbegin(), ranges.cend())) {
+      return &ranges;
+    }
+    *copy = ranges;
+    std::sort(copy->begin(), copy->end());
+    return const_cast<const std::vector<Range>*>(copy);
+  };
+  std::vector<Range> copy;
+  std::vector<Range> other_copy;
+  return SortedRangesOverlap(*sorted(ranges_, &copy), *sorted(other.ranges_, &other_copy));
 }
 
 std::optional<RangeSet> RangeSet::GetSubRanges(size_t start_index, size_t num_of_blocks) const {
@@ -279,8 +348,13 @@ void SortedRangeSet::Insert(size_t start, size_t len) {
 }
 
 bool SortedRangeSet::Overlaps(size_t start, size_t len) const {
-  RangeSet rs({ { start / kBlockSize, (start + len - 1) / kBlockSize + 1 } });
-  return Overlaps(rs);
+  size_t begin = start / kBlockSize;
+  size_t end = (start + len - 1) / kBlockSize + 1;
+  // The ranges are mutually exclusive and sorted, so the only candidate is the last one that
+  // starts before |end|.
+  auto it = std::partition_point(ranges_.cbegin(), ranges_.cend(),
+                                 [end](const Range& range) { return range.first < end; });
+  return it != ranges_.cbegin() && std::prev(it)->second > begin;
 }
 
 // Given an offset of the file, checks if the corresponding block (by considering the file as
@@ -313,3 +387,51 @@ size_t SortedRangeSet::GetOffsetInRangeSet(size_t old_offset) const {
                << " exceeds the limit of current RangeSet: " << ToString();
   return 0;
 }
+
+RangeSetIndex::RangeSetIndex(RangeSet ranges) : ranges_(std::move(ranges)) {
+  offsets_.reserve(ranges_.size());
+  size_t offset = 0;
+  for (const auto& [start, end] : ranges_) {
+    offsets_.push_back(offset);
+    offset += end - start;
+  }
+}
+
+size_t RangeSetIndex::FindRange(size_t idx) const {
+  // The last range that starts at or before |idx|.
+  return std::upper_bound(offsets_.cbegin(), offsets_.cend(), idx) - offsets_.cbegin() - 1;
+}
+
+size_t RangeSetIndex::GetBlockNumber(size_t idx) const {
+  CHECK_LT(idx, ranges_.blocks()) << "Out of bound index " << idx
+                                  << " (total blocks: " << ranges_.blocks() << ")";
+  size_t i = FindRange(idx);
+  return ranges_[i].first + (idx - offsets_[i]);
+}
+
+std::optional<RangeSet> RangeSetIndex::GetSubRanges(size_t start_index,
+                                                    size_t num_of_blocks) const {
+  size_t end_index = start_index + num_of_blocks;
+  if (start_index > end_index || end_index > ranges_.blocks()) {
+    LOG(ERROR) << "Failed to get the sub ranges for start_index " << start_index
+               << " num_of_blocks " << num_of_blocks
+               << " total number of blocks the range contains is " << ranges_.blocks();
+    return std::nullopt;
+  }
+
+  RangeSet result;
+  if (num_of_blocks == 0) {
+    return result;
+  }
+
+  for (size_t i = FindRange(start_index), index = start_index; index < end_index; ++i) {
+    const auto& [range_start, range_end] = ranges_[i];
+    size_t first = range_start + (index - offsets_[i]);
+    size_t count = std::min(end_index - index, range_end - first);
+    if (!result.PushBack({ first, first + count })) {
+      return std::nullopt;
+    }
+    index += count;
+  }
+  return result;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/ring_buffer.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include <android-base/logging.h>
+
+RingBuffer::RingBuffer(size_t capacity) : capacity_(capacity), data_(new uint8_t[capacity]) {
+  CHECK_GT(capacity, static_cast<size_t>(0));
+}
+
+// The waiting flag and the counters are accessed with sequentially consistent ordering: a side
+// sets its flag before checking the counters, while the other side updates the counters before
+// checking the flag. So either the waiter sees the update, or the updater sees the waiter (and
+// takes the mutex to wake it up).
+template <typename Pred>
+void RingBuffer::Wait(std::atomic<bool>* waiting, Pred ready) {
+  if (ready() || aborted_) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  waiting->store(true);
+  cv_.wait(lock, [this, &ready] { return ready() || aborted_; });
+  waiting->store(false);
+}
+
+void RingBuffer::Notify(const std::atomic<bool>& waiting) {
+  if (waiting.load()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_all();
+  }
+}
+
+size_t RingBuffer::GetWritable(uint8_t** data) {
+  Wait(&producer_waiting_, [this] { return tail_.load() - head_.load() < capacity_; });
+  if (aborted_) {
+    return 0;
+  }
+
+  // Only the producer updates tail_, and head_ may only grow in the meantime.
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  size_t free_space = capacity_ - (tail - head_.load());
+  size_t offset = tail % capacity_;
+  *data = data_.get() + offset;
+  return std::min(free_space, capacity_ - offset);
+}
+
+void RingBuffer::Commit(size_t size) {
+  if (size == 0) {
+    return;
+  }
+  tail_.store(tail_.load(std::memory_order_relaxed) + size);
+  Notify(consumer_waiting_);
+}
+
+bool RingBuffer::Write(const uint8_t* data, size_t size) {
+  while (size > 0) {
+    uint8_t* space;
+    size_t space_size = GetWritable(&space);
+    if (space_size == 0) {
+      return false;
+    }
+    size_t write_now = std::min(size, space_size);
+    memcpy(space, data, write_now);
+    Commit(write_now);
+
+    data += write_now;
+    size -= write_now;
+  }
+  return true;
+}
+
+void RingBuffer::Close() {
+  closed_.store(true);
+  Notify(consumer_waiting_);
+}
+
+size_t RingBuffer::GetReadable(const uint8_t** data) {
+  Wait(&consumer_waiting_, [this] { return tail_.load() != head_.load() || closed_; });
+  if (aborted_) {
+    return 0;
+  }
+
+  // Only the consumer updates head_, and tail_ may only grow in the meantime.
+  size_t head = head_.load(std::memory_order_relaxed);
+  size_t available = tail_.load() - head;
+  size_t offset = head % capacity_;
+  *data = data_.get() + offset;
+  return std::min(available, capacity_ - offset);
+}
+
+void RingBuffer::Consume(size_t size) {
+  if (size == 0) {
+    return;
+  }
+  head_.store(head_.load(std::memory_order_relaxed) + size);
+  Notify(producer_waiting_);
+}
+
+void RingBuffer::Abort() {
+  aborted_.store(true);
+  std::lock_guard<std::mutex> lock(mutex_);
+  cv_.notify_all();
+}
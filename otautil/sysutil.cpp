@@ -19,13 +19,16 @@
 #include <errno.h>  // TEMP_FAILURE_RETRY
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <limits>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -76,7 +79,7 @@ BlockMapData BlockMapData::ParseBlockMapFile(const std::string& block_map_path)
     return {};
   }
 
-  RangeSet ranges;
+  std::vector<Range> ranges;
   uint64_t remaining_blocks = blocks;
   for (size_t i = 0; i < range_count; ++i) {
     const std::string& line = lines[i + 3];
@@ -90,7 +93,13 @@ BlockMapData BlockMapData::ParseBlockMapFile(const std::string& block_map_path)
       LOG(ERROR) << "Invalid range: " << start << " " << end;
       return {};
     }
-    ranges.PushBack({ start, end });
+    // uncrypt already extends a range while FIBMAP returns consecutive blocks, but keep the ranges
+    // canonical regardless of the writer, so that readers issue one I/O per physical extent.
+    if (!ranges.empty() && ranges.back().second == start) {
+      ranges.back().second = end;
+    } else {
+      ranges.emplace_back(start, end);
+    }
     remaining_blocks -= range_blocks;
   }
 
@@ -99,7 +108,53 @@ BlockMapData BlockMapData::ParseBlockMapFile(const std::string& block_map_path)
     return {};
   }
 
-  return BlockMapData(block_dev, file_size, blksize, std::move(ranges));
+  return BlockMapData(block_dev, file_size, blksize, RangeSet(std::move(ranges)));
+}
+
+BlockMapData::BlockMapData(const std::string& path, uint64_t file_size, uint32_t block_size,
+                           RangeSet block_ranges)
+    : path_(path),
+      file_size_(file_size),
+      block_size_(block_size),
+      block_ranges_(std::move(block_ranges)) {}
+
+std::optional<RangeSet> BlockMapData::GetSubRanges(size_t start_block, size_t num_blocks) const {
+  return block_ranges_.GetSubRanges(start_block, num_blocks);
+}
+
+// Large files are mapped at a huge page boundary, so that the kernel can back them with
+// transparent huge pages where the filesystem supports it (fewer TLB misses and page table pages
+// when scanning multi-GiB packages).
+static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+// Maps the |size| bytes of |fd| read-only at a kHugePageSize boundary, and asks for huge pages.
+// Returns MAP_FAILED if the address space can't be reserved.
+static void* MapHugePageAligned(int fd, size_t size) {
+  size_t reserve_size = size + kHugePageSize;
+  void* reserve = mmap(nullptr, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (reserve == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  auto reserve_start = reinterpret_cast<uintptr_t>(reserve);
+  auto start = (reserve_start + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  void* addr =
+      mmap(reinterpret_cast<void*>(start), size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+  if (addr == MAP_FAILED) {
+    munmap(reserve, reserve_size);
+    return MAP_FAILED;
+  }
+  // Gives back the slack around the mapping.
+  if (start > reserve_start) {
+    munmap(reserve, start - reserve_start);
+  }
+  auto page_mask = static_cast<uintptr_t>(getpagesize()) - 1;
+  auto mapped_end = (start + size + page_mask) & ~page_mask;
+  if (reserve_start + reserve_size > mapped_end) {
+    munmap(reinterpret_cast<void*>(mapped_end), reserve_start + reserve_size - mapped_end);
+  }
+  // Not all the kernels and filesystems support huge pages for files, which is fine.
+  madvise(addr, size, MADV_HUGEPAGE);
+  return addr;
 }
 
 bool MemMapping::MapFD(int fd) {
@@ -109,7 +164,13 @@ bool MemMapping::MapFD(int fd) {
     return false;
   }
 
-  void* memPtr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  void* memPtr = MAP_FAILED;
+  if (static_cast<uint64_t>(sb.st_size) >= kHugePageSize) {
+    memPtr = MapHugePageAligned(fd, sb.st_size);
+  }
+  if (memPtr == MAP_FAILED) {
+    memPtr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
   if (memPtr == MAP_FAILED) {
     PLOG(ERROR) << "mmap(" << sb.st_size << ", R, PRIVATE, " << fd << ", 0) failed";
     return false;
@@ -134,33 +195,59 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
     return false;
   }
 
-  // Reserve enough contiguous address space for the whole file.
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(block_map_data.path().c_str(), O_RDONLY)));
+  if (fd == -1) {
+    PLOG(ERROR) << "failed to open block device " << block_map_data.path();
+    return false;
+  }
+
   uint32_t blksize = block_map_data.block_size();
   uint64_t blocks = ((block_map_data.file_size() - 1) / blksize) + 1;
-  void* reserve = mmap(nullptr, blocks * blksize, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
-  if (reserve == MAP_FAILED) {
-    PLOG(ERROR) << "failed to reserve address space";
+  if (!MapRanges(fd, block_map_data.block_ranges(), blksize, blocks)) {
     return false;
   }
+  length = block_map_data.file_size();
 
-  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(block_map_data.path().c_str(), O_RDONLY)));
-  if (fd == -1) {
-    PLOG(ERROR) << "failed to open block device " << block_map_data.path();
-    munmap(reserve, blocks * blksize);
+  LOG(INFO) << "mmapped " << block_map_data.block_ranges().size() << " ranges";
+
+  return true;
+}
+
+bool MemMapping::MapBlockRanges(int fd, const RangeSet& ranges, uint32_t block_size) {
+  if (!ranges) {
+    LOG(ERROR) << "No ranges to map";
+    return false;
+  }
+  if (!MapRanges(fd, ranges, block_size, ranges.blocks())) {
+    return false;
+  }
+  length = static_cast<size_t>(ranges.blocks()) * block_size;
+  return true;
+}
+
+bool MemMapping::MapRanges(int fd, const RangeSet& ranges, uint32_t block_size, uint64_t blocks) {
+  // Reserve enough contiguous address space for all the blocks.
+  void* reserve = mmap(nullptr, blocks * block_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (reserve == MAP_FAILED) {
+    PLOG(ERROR) << "failed to reserve address space";
     return false;
   }
 
   ranges_.clear();
 
   auto next = static_cast<unsigned char*>(reserve);
-  size_t remaining_size = blocks * blksize;
-  for (const auto& [start, end] : block_map_data.block_ranges()) {
-    size_t range_size = (end - start) * blksize;
+  size_t remaining_size = blocks * block_size;
+  for (const auto& [start, end] : ranges) {
+    size_t range_size = (end - start) * block_size;
+    if (range_size > remaining_size) {
+      break;
+    }
     void* range_start = mmap(next, range_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
-                             static_cast<off_t>(start) * blksize);
+                             static_cast<off_t>(start) * block_size);
     if (range_start == MAP_FAILED) {
       PLOG(ERROR) << "failed to map range " << start << ": " << end;
-      munmap(reserve, blocks * blksize);
+      munmap(reserve, blocks * block_size);
+      ranges_.clear();
       return false;
     }
     ranges_.emplace_back(MappedRange{ range_start, range_size });
@@ -170,15 +257,12 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
   }
   if (remaining_size != 0) {
     LOG(ERROR) << "Invalid ranges: remaining_size " << remaining_size;
-    munmap(reserve, blocks * blksize);
+    munmap(reserve, blocks * block_size);
+    ranges_.clear();
     return false;
   }
 
   addr = static_cast<unsigned char*>(reserve);
-  length = block_map_data.file_size();
-
-  LOG(INFO) << "mmapped " << block_map_data.block_ranges().size() << " ranges";
-
   return true;
 }
 
@@ -210,6 +294,24 @@ bool MemMapping::MapFile(const std::string& fn) {
   return true;
 }
 
+bool MemMapping::Advise(uint64_t offset, uint64_t size, int advice) const {
+  if (ranges_.empty() || offset >= length || size == 0) {
+    return false;
+  }
+  size = std::min<uint64_t>(size, length - offset);
+  // The start needs to be page aligned; the kernel rounds up the length.
+  auto page_mask = static_cast<uintptr_t>(getpagesize()) - 1;
+  auto start = reinterpret_cast<uintptr_t>(addr) + offset;
+  auto aligned_start = start & ~page_mask;
+  if (madvise(reinterpret_cast<void*>(aligned_start), size + (start - aligned_start), advice) ==
+      -1) {
+    PLOG(WARNING) << "madvise(" << advice << ") of " << size << " bytes at " << offset
+                  << " failed";
+    return false;
+  }
+  return true;
+}
+
 MemMapping::~MemMapping() {
   for (const auto& range : ranges_) {
     if (munmap(range.addr, range.length) == -1) {
@@ -238,6 +340,26 @@ bool Shutdown(std::string_view target) {
   return android::base::SetProperty(ANDROID_RB_PROPERTY, cmd);
 }
 
+uint64_t GetFreeMemory() {
+  std::string meminfo;
+  if (!android::base::ReadFileToString("/proc/meminfo", &meminfo)) {
+    PLOG(ERROR) << "Failed to read /proc/meminfo";
+    return 0;
+  }
+  uint64_t mem = 0;
+  for (const auto& line : android::base::Split(meminfo, "\n")) {
+    auto pos = line.find(':');
+    if (pos == std::string::npos) {
+      continue;
+    }
+    std::string key = line.substr(0, pos);
+    if (key == "MemFree" || key == "Buffers" || key == "Cached") {
+      mem += strtoull(line.c_str() + pos + 1, nullptr, 0) * 1024;
+    }
+  }
+  return mem;
+}
+
 std::vector<char*> StringVectorToNullTerminatedArray(const std::vector<std::string>& args) {
   std::vector<char*> result(args.size());
   std::transform(args.cbegin(), args.cend(), result.begin(),
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/trace.h"
+
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/threads.h>
+
+static constexpr const char* kTraceEventNames[] = {
+  "command", "read", "write", "stash_load", "stash_save", "hash", "startup",
+};
+static_assert(sizeof(kTraceEventNames) / sizeof(kTraceEventNames[0]) ==
+                  static_cast<size_t>(TraceEvent::kCount),
+              "Mismatching number of trace event names");
+
+struct TraceEntry {
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint64_t arg;
+  uint32_t tid;
+  TraceEvent event;
+};
+
+// The ring of the latest events, which lives in the bss and so only takes memory once it's used.
+// 16Ki events make 512KiB, which covers several thousand transfer list commands.
+static constexpr size_t kTraceRingSize = 16384;
+static TraceEntry trace_ring[kTraceRingSize];
+// The number of events ever recorded; the next one goes to trace_ring[next_entry % kTraceRingSize].
+static std::atomic<uint64_t> next_entry{ 0 };
+
+uint64_t MonotonicTimeNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void RecordTraceEvent(TraceEvent event, uint64_t start_ns, uint64_t arg) {
+  uint64_t now = MonotonicTimeNs();
+  // An entry that's overwritten while WriteTraceFile() reads it may come out torn, which is fine
+  // for a best-effort trace.
+  uint64_t index = next_entry.fetch_add(1, std::memory_order_relaxed);
+  TraceEntry& entry = trace_ring[index % kTraceRingSize];
+  entry.start_ns = start_ns;
+  entry.duration_ns = now - start_ns;
+  entry.arg = arg;
+  entry.tid = android::base::GetThreadId();
+  entry.event = event;
+}
+
+bool WriteTraceFile(const std::string& path) {
+  uint64_t end = next_entry.load();
+  uint64_t begin = end > kTraceRingSize ? end - kTraceRingSize : 0;
+
+  // The timestamps are in microseconds, as the format expects.
+  std::string content = "{\"traceEvents\":[";
+  pid_t pid = getpid();
+  for (uint64_t i = begin; i < end; i++) {
+    const TraceEntry& entry = trace_ring[i % kTraceRingSize];
+    if (entry.event >= TraceEvent::kCount) {
+      continue;
+    }
+    content += android::base::StringPrintf(
+        "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%" PRIu32 ",\"ts\":%.3f,\"dur\":%.3f,"
+        "\"args\":{\"arg\":%" PRIu64 "}}",
+        i == begin ? "" : ",", kTraceEventNames[static_cast<size_t>(entry.event)], pid, entry.tid,
+        entry.start_ns / 1000.0, entry.duration_ns / 1000.0, entry.arg);
+  }
+  content += "]}\n";
+
+  if (!android::base::WriteStringToFile(content, path)) {
+    PLOG(ERROR) << "Failed to write the trace to " << path;
+    return false;
+  }
+  LOG(INFO) << "Wrote " << (end - begin) << " trace events to " << path;
+  return true;
+}
+
+std::vector<uint64_t> GetTraceDurations(TraceEvent event) {
+  uint64_t end = next_entry.load();
+  uint64_t begin = end > kTraceRingSize ? end - kTraceRingSize : 0;
+
+  std::vector<uint64_t> durations;
+  for (uint64_t i = begin; i < end; i++) {
+    const TraceEntry& entry = trace_ring[i % kTraceRingSize];
+    if (entry.event == event) {
+      durations.push_back(entry.duration_ns);
+    }
+  }
+  return durations;
+}
+
+void ClearTrace() {
+  next_entry.store(0);
+}
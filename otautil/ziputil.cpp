@@ -18,24 +18,99 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <atomic>
+#include <set>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
 #include <selinux/label.h>
 #include <selinux/selinux.h>
 #include <ziparchive/zip_archive.h>
+#include <zlib.h>
 
 #include "otautil/dirutil.h"
+#include "otautil/phase_stats.h"
 
 static constexpr mode_t UNZIP_DIRMODE = 0755;
 static constexpr mode_t UNZIP_FILEMODE = 0644;
 
+// Upper bound of the number of threads that inflate files in ExtractPackageRecursive().
+static constexpr size_t kMaxExtractThreads = 4;
+
+// The size of the reads when comparing an existing file against an entry.
+static constexpr size_t kCompareBufferSize = 64 * 1024;
+
+bool FileMatchesZipEntry(const std::string& path, const ZipEntryCommon& entry) {
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+      static_cast<uint64_t>(sb.st_size) != entry.uncompressed_length) {
+    return false;
+  }
+
+  std::vector<uint8_t> buffer(kCompareBufferSize);
+  uLong crc = crc32(0L, Z_NULL, 0);
+  while (true) {
+    ssize_t n = TEMP_FAILURE_RETRY(read(fd, buffer.data(), buffer.size()));
+    if (n == -1) {
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    crc = crc32(crc, buffer.data(), n);
+  }
+  return crc == entry.crc32;
+}
+
+// Extracts |entry| to |path|, whose directory must exist. The file is not fsync'd.
+static bool ExtractFile(ZipArchiveHandle zip, const ZipEntry& entry, const std::string& path,
+                        const struct utimbuf* timestamp, struct selabel_handle* sehnd) {
+  // The fscreate context is per thread, so the workers don't step on each other.
+  char* secontext = NULL;
+  if (sehnd) {
+    selabel_lookup(sehnd, &secontext, path.c_str(), UNZIP_FILEMODE);
+    setfscreatecon(secontext);
+  }
+  android::base::unique_fd fd(
+      open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, UNZIP_FILEMODE));
+  if (fd == -1) {
+    PLOG(ERROR) << "Can't create target file \"" << path << "\"";
+    return false;
+  }
+  if (secontext) {
+    freecon(secontext);
+    setfscreatecon(NULL);
+  }
+
+  ZipEntry file_entry = entry;
+  int err = ExtractEntryToFile(zip, &file_entry, fd);
+  if (err != 0) {
+    LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
+    return false;
+  }
+
+  if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
+    PLOG(ERROR) << "Error touching \"" << path << "\"";
+    return false;
+  }
+
+  LOG(INFO) << "Extracted file \"" << path << "\"";
+  return true;
+}
+
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
-                             struct selabel_handle* sehnd) {
+                             struct selabel_handle* sehnd, bool skip_unchanged) {
   if (!zip_path.empty() && zip_path[0] == '/') {
     LOG(ERROR) << "ExtractPackageRecursive(): zip_path must be a relative path " << zip_path;
     return false;
@@ -62,9 +137,10 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
   }
 
   std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
+  std::vector<std::pair<ZipEntry, std::string>> files;
+  std::set<std::string> created_dirs;
   ZipEntry entry;
   std::string name;
-  int extractCount = 0;
   while (Next(cookie, &entry, &name) == 0) {
     CHECK_LE(prefix_path.size(), name.size());
     std::string path = target_dir + name.substr(prefix_path.size());
@@ -73,46 +149,62 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
       continue;
     }
 
-    if (mkdir_recursively(path.c_str(), UNZIP_DIRMODE, true, sehnd, timestamp) != 0) {
+    // Create the directories up front, once per directory, so that the workers below only deal
+    // with files.
+    if (created_dirs.insert(path.substr(0, path.rfind('/'))).second &&
+        mkdir_recursively(path.c_str(), UNZIP_DIRMODE, true, sehnd, timestamp) != 0) {
       LOG(ERROR) << "failed to create dir for " << path;
       return false;
     }
+    files.emplace_back(entry, std::move(path));
+  }
 
-    char* secontext = NULL;
-    if (sehnd) {
-      selabel_lookup(sehnd, &secontext, path.c_str(), UNZIP_FILEMODE);
-      setfscreatecon(secontext);
-    }
-    android::base::unique_fd fd(open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, UNZIP_FILEMODE));
-    if (fd == -1) {
-      PLOG(ERROR) << "Can't create target file \"" << path << "\"";
-      return false;
-    }
-    if (secontext) {
-      freecon(secontext);
-      setfscreatecon(NULL);
-    }
-
-    int err = ExtractEntryToFile(zip, &entry, fd);
-    if (err != 0) {
-      LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
-      return false;
-    }
-
-    if (fsync(fd) != 0) {
-      PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << path << "\"";
-      return false;
+  // Inflate the files in parallel. Individual files aren't fsync'd; the whole destination
+  // filesystem is synced once at the end instead.
+  std::atomic<size_t> next_file{ 0 };
+  std::atomic<size_t> skipped_files{ 0 };
+  std::atomic<bool> failed{ false };
+  auto extract_files = [&]() {
+    for (size_t i = next_file++; i < files.size() && !failed; i = next_file++) {
+      const auto& [file_entry, path] = files[i];
+      if (skip_unchanged && FileMatchesZipEntry(path, file_entry)) {
+        if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
+          PLOG(ERROR) << "Error touching \"" << path << "\"";
+          failed = true;
+        }
+        skipped_files++;
+        continue;
+      }
+      if (!ExtractFile(zip, file_entry, path, timestamp, sehnd)) {
+        failed = true;
+      }
     }
+  };
+  size_t jobs = std::min<size_t>(
+      { std::thread::hardware_concurrency(), kMaxExtractThreads, files.size() });
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < jobs; ++i) {
+    workers.emplace_back(extract_files);
+  }
+  extract_files();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  if (failed) {
+    return false;
+  }
 
-    if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
-      PLOG(ERROR) << "Error touching \"" << path << "\"";
+  if (skipped_files < files.size()) {
+    android::base::unique_fd dest_fd(
+        open(dest_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    CountFsync();
+    if (dest_fd == -1 || syncfs(dest_fd) != 0) {
+      PLOG(ERROR) << "Error syncing \"" << dest_path << "\"";
       return false;
     }
-
-    LOG(INFO) << "Extracted file \"" << path << "\"";
-    ++extractCount;
   }
 
-  LOG(INFO) << "Extracted " << extractCount << " file(s)";
+  LOG(INFO) << "Extracted " << (files.size() - skipped_files) << " file(s), skipped "
+            << skipped_files << " unchanged";
   return true;
 }
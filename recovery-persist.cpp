@@ -83,6 +83,15 @@ static bool file_exists(const char* filename) {
   return access(filename, R_OK) == 0;
 }
 
+size_t file_size(const char* path) {
+    struct stat st {};
+    if (stat(path, &st) < 0) {
+        return 0;
+    }
+
+    return st.st_size;
+}
+
 static bool rotated = false;
 
 ssize_t logsave(
@@ -97,7 +106,8 @@ ssize_t logsave(
 
     std::string buffer(buf, len);
 
-    {
+    // Only read the existing copy back if it could match, i.e. it has the same size.
+    if (file_size(destination.c_str()) == len) {
         std::string content;
         android::base::ReadFileToString(destination, &content);
 
@@ -116,15 +126,6 @@ ssize_t logsave(
     return android::base::WriteStringToFile(buffer, destination.c_str());
 }
 
-size_t file_size(const char* path) {
-    struct stat st {};
-    if (stat(path, &st) < 0) {
-        return 0;
-    }
-
-    return st.st_size;
-}
-
 bool compare_file(const char* file1, const char* file2) {
     if (!file_exists(file1) || !file_exists(file2)) {
         return false;
@@ -151,6 +152,7 @@ bool compare_file(const char* file1, const char* file2) {
         if (memcmp(buf1.data(), buf2.data(), bytes_to_read) != 0) {
             return false;
         }
+        bytes_remain -= bytes_to_read;
     }
     return true;
 }
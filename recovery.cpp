@@ -34,6 +34,7 @@
 #include <memory>
 #include <regex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -52,13 +53,16 @@
 #include "install/adb_install.h"
 #include "install/fuse_install.h"
 #include "install/install.h"
+#include "install/package_metadata.h"
 #include "install/snapshot_utils.h"
 #include "install/wipe_data.h"
 #include "install/wipe_device.h"
 #include "otautil/boot_state.h"
 #include "otautil/error_code.h"
+#include "otautil/live_stats.h"
 #include "otautil/package.h"
 #include "otautil/paths.h"
+#include "otautil/phase_stats.h"
 #include "otautil/sysutil.h"
 #include "recovery_ui/screen_ui.h"
 #include "recovery_ui/ui.h"
@@ -91,7 +95,11 @@ static bool save_current_log = false;
  *   /cache/recovery/log - OUTPUT - combined log file from recovery run(s)
  *
  * The arguments which may be supplied in the recovery.command file:
- *   --update_package=path - verify install an OTA package file
+ *   --update_package=path - verify install an OTA package file, which may also be an http:// URL
+ *       for a network sideload. When it's given more than once, the packages get installed in
+ *       order, as a queue
+ *   --update_package_list=path - queue the packages listed in the file, one path per line (blank
+ *       lines and lines starting with '#' are skipped), after any --update_package ones
  *   --install_with_fuse - install the update package with FUSE. This allows installation of large
  *       packages on LP32 builds. Since the mmap will otherwise fail due to out of memory.
  *   --wipe_data - erase user data (and cache), then reboot
@@ -101,6 +109,8 @@ static bool save_current_log = false;
  *   --show_text - show the recovery text menu, used by some bootloader (e.g. http://b/36872519).
  *   --set_encrypted_filesystem=on|off - enables / diasables encrypted fs
  *   --just_exit - do nothing; exit and reboot
+ *   --headless - don't initialize the screen; report the install status to the log instead (also
+ *       enabled by ro.boot.recovery.headless=true)
  *
  * After completing, we remove /cache/recovery/command and reboot.
  * Arguments may also be supplied in the bootloader control block (BCB).
@@ -650,7 +660,9 @@ change_menu:
       case Device::MOUNT_SYSTEM: {
         static bool mounted = false;
         if (!mounted) {
-          // For Virtual A/B, set up the snapshot devices (if exist).
+          // For Virtual A/B, set up the snapshot devices (if exist), once the merge that may be
+          // mapping them is done.
+          WaitForSnapshotMerge(ui);
           if (!logical_partitions_mapped() && !CreateSnapshotPartitions()) {
             ui->Print("Virtual A/B: snapshot partitions creation failed.\n");
             break;
@@ -708,6 +720,116 @@ static void set_retry_bootloader_message(int retry_count, const std::vector<std:
   }
 }
 
+// Sets the packages that the BCB asks to install to |packages|, e.g. to leave out the ones of the
+// queue that have been installed. The retry count gets reset to 1 for the next package.
+static void set_package_queue_bootloader_message(const std::vector<std::string>& packages,
+                                                 std::vector<std::string>* args) {
+  std::vector<std::string> options;
+  for (const auto& arg : *args) {
+    if (!android::base::StartsWith(arg, "--update_package") &&
+        !android::base::StartsWith(arg, "--retry_count")) {
+      options.push_back(arg);
+    }
+  }
+  for (const auto& package : packages) {
+    options.push_back("--update_package=" + package);
+  }
+  *args = options;
+  set_retry_bootloader_message(1, *args);
+}
+
+// Appends the packages listed in |list_path| to |packages|.
+static bool read_package_list(const std::string& list_path, std::vector<std::string>* packages) {
+  if (ensure_path_mounted(list_path) != 0) {
+    LOG(ERROR) << "Failed to mount " << list_path;
+    return false;
+  }
+  std::string content;
+  if (!android::base::ReadFileToString(list_path, &content)) {
+    PLOG(ERROR) << "Failed to read the package list " << list_path;
+    return false;
+  }
+  for (const auto& line : android::base::Split(content, "\n")) {
+    std::string package = android::base::Trim(line);
+    if (!package.empty() && package[0] != '#') {
+      packages->push_back(package);
+    }
+  }
+  return true;
+}
+
+// A package of the queue that gets ready while the one before it installs: it's mapped and its
+// metadata gets read in the background.
+struct PreparedPackage {
+  std::string path;
+  std::unique_ptr<Package> package;
+  std::thread metadata_reader;
+
+  ~PreparedPackage() {
+    if (metadata_reader.joinable()) {
+      metadata_reader.join();
+    }
+  }
+};
+
+// Starts getting |path| ready to install. Only the block map packages get prepared: the install
+// unmounts the volumes other than /tmp and /cache (see setup_install_mounts()), and a block map
+// package reads the block device instead of a file on them.
+static std::unique_ptr<PreparedPackage> PreparePackage(const std::string& path, RecoveryUI* ui) {
+  if (path.empty() || path[0] != '@') {
+    return nullptr;
+  }
+  bool should_use_fuse = false;
+  if (!SetupPackageMount(path, &should_use_fuse)) {
+    return nullptr;
+  }
+  auto prepared = std::make_unique<PreparedPackage>();
+  prepared->path = path;
+  prepared->package = Package::CreateMemoryPackage(
+      path, std::bind(&RecoveryUI::SetProgress, ui, std::placeholders::_1));
+  if (!prepared->package) {
+    return nullptr;
+  }
+  prepared->metadata_reader = std::thread([package = prepared->package.get()]() {
+    ScopedPhase phase("metadata");
+    PackageMetadata::Get(package);
+  });
+  return prepared;
+}
+
+// Installs the package at |path|, or |prepared| if it's been prepared ahead.
+static InstallResult install_update_package(const std::string& path,
+                                            std::unique_ptr<PreparedPackage> prepared,
+                                            bool install_with_fuse, bool should_wipe_cache,
+                                            int retry_count, Device* device) {
+  auto ui = device->GetUI();
+  if (prepared && !install_with_fuse) {
+    prepared->metadata_reader.join();
+    return InstallPackage(prepared->package.get(), path, should_wipe_cache, retry_count, device);
+  }
+  prepared.reset();
+
+  bool should_use_fuse = false;
+  if (!SetupPackageMount(path, &should_use_fuse)) {
+    LOG(INFO) << "Failed to set up the package access, skipping installation";
+    return INSTALL_ERROR;
+  }
+  if (install_with_fuse || should_use_fuse) {
+    LOG(INFO) << "Installing package " << path << " with fuse";
+    return InstallWithFuseFromPath(path, device);
+  }
+  if (auto memory_package = Package::CreateMemoryPackage(
+          path, std::bind(&RecoveryUI::SetProgress, ui, std::placeholders::_1));
+      memory_package != nullptr) {
+    return InstallPackage(memory_package.get(), path, should_wipe_cache, retry_count, device);
+  }
+  // We may fail to memory map the package on 32 bit builds for packages with 2GiB+ size.
+  // In such cases, we will try to install the package with fuse. This is not the default
+  // installation method because it introduces a layer of indirection from the kernel space.
+  LOG(WARNING) << "Failed to memory map package " << path << "; falling back to install with fuse";
+  return InstallWithFuseFromPath(path, device);
+}
+
 static bool bootreason_in_blocklist() {
   std::string bootreason = android::base::GetProperty("ro.boot.bootreason", "");
   if (!bootreason.empty()) {
@@ -742,6 +864,7 @@ static void log_failure_code(ErrorCode code, const std::string& update_package)
 Device::BuiltinAction start_recovery(Device* device, const std::vector<std::string>& args) {
   static constexpr struct option OPTIONS[] = {
     { "fastboot", no_argument, nullptr, 0 },
+    { "headless", no_argument, nullptr, 0 },
     { "install_with_fuse", no_argument, nullptr, 0 },
     { "just_exit", no_argument, nullptr, 'x' },
     { "locale", required_argument, nullptr, 0 },
@@ -755,6 +878,7 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
     { "sideload", no_argument, nullptr, 0 },
     { "sideload_auto_reboot", no_argument, nullptr, 0 },
     { "update_package", required_argument, nullptr, 0 },
+    { "update_package_list", required_argument, nullptr, 0 },
     { "wipe_ab", no_argument, nullptr, 0 },
     { "wipe_cache", no_argument, nullptr, 0 },
     { "wipe_data", no_argument, nullptr, 0 },
@@ -764,6 +888,8 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
   };
 
   const char* update_package = nullptr;
+  std::vector<std::string> update_packages;
+  std::string update_package_list;
   bool install_with_fuse = false;  // memory map the update package by default.
   bool should_wipe_data = false;
   bool should_prompt_and_wipe_data = false;
@@ -800,7 +926,8 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
         std::string option = OPTIONS[option_index].name;
         if (option == "install_with_fuse") {
           install_with_fuse = true;
-        } else if (option == "locale" || option == "fastboot" || option == "reason") {
+        } else if (option == "locale" || option == "fastboot" || option == "headless" ||
+                   option == "reason") {
           // Handled in recovery_main.cpp
         } else if (option == "prompt_and_wipe_data") {
           should_prompt_and_wipe_data = true;
@@ -818,7 +945,9 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
         } else if (option == "shutdown_after") {
           shutdown_after = true;
         } else if (option == "update_package") {
-          update_package = optarg;
+          update_packages.push_back(optarg);
+        } else if (option == "update_package_list") {
+          update_package_list = optarg;
         } else if (option == "wipe_ab") {
           should_wipe_ab = true;
         } else if (option == "wipe_cache") {
@@ -839,6 +968,13 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
   }
   optind = 1;
 
+  if (!update_package_list.empty() && !read_package_list(update_package_list, &update_packages)) {
+    LOG(ERROR) << "Skipping the packages of " << update_package_list;
+  }
+  if (!update_packages.empty()) {
+    update_package = update_packages.front().c_str();
+  }
+
   printf("stage is [%s]\n", device->GetStage().value_or("").c_str());
   printf("reason is [%s]\n", device->GetReason().value_or("").c_str());
 
@@ -871,6 +1007,8 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
 
   ui->ResetKeyInterruptStatus();
   device->StartRecovery();
+  StartPendingSnapshotMerge();
+  StartLiveStats("recovery");
 
   printf("Command:");
   for (const auto& arg : args) {
@@ -909,27 +1047,36 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
         set_retry_bootloader_message(retry_count + 1, args);
       }
 
-      bool should_use_fuse = false;
-      if (!SetupPackageMount(update_package, &should_use_fuse)) {
-        LOG(INFO) << "Failed to set up the package access, skipping installation";
-        status = INSTALL_ERROR;
-      } else if (install_with_fuse || should_use_fuse) {
-        LOG(INFO) << "Installing package " << update_package << " with fuse";
-        status = InstallWithFuseFromPath(update_package, device);
-      } else if (auto memory_package = Package::CreateMemoryPackage(
-                     update_package,
-                     std::bind(&RecoveryUI::SetProgress, ui, std::placeholders::_1));
-                 memory_package != nullptr) {
-        status = InstallPackage(memory_package.get(), update_package, should_wipe_cache,
-                                retry_count, device);
-      } else {
-        // We may fail to memory map the package on 32 bit builds for packages with 2GiB+ size.
-        // In such cases, we will try to install the package with fuse. This is not the default
-        // installation method because it introduces a layer of indirection from the kernel space.
-        LOG(WARNING) << "Failed to memory map package " << update_package
-                     << "; falling back to install with fuse";
-        status = InstallWithFuseFromPath(update_package, device);
+      // The packages of a queue get installed in order, each one getting prepared while the one
+      // before it installs. Once one is installed, the BCB only asks for the rest, so that a
+      // retry resumes the queue where it stopped. The cache only gets wiped after the last one,
+      // since the queued packages may be on /cache.
+      std::vector<std::string> queue_args = args;
+      std::unique_ptr<PreparedPackage> prepared;
+      for (size_t i = 0; i < update_packages.size(); i++) {
+        const std::string& path = update_packages[i];
+        if (update_packages.size() > 1) {
+          ui->Print("Installing package %zu of %zu\n", i + 1, update_packages.size());
+        }
+        bool last = i + 1 == update_packages.size();
+        std::unique_ptr<PreparedPackage> current = std::move(prepared);
+        if (!last && !install_with_fuse) {
+          prepared = PreparePackage(update_packages[i + 1], ui);
+        }
+        status = install_update_package(path, std::move(current), install_with_fuse,
+                                        should_wipe_cache && last, retry_count, device);
+        if (status != INSTALL_SUCCESS) {
+          update_package = path.c_str();
+          break;
+        }
+        if (!last) {
+          set_package_queue_bootloader_message(
+              std::vector<std::string>(update_packages.begin() + i + 1, update_packages.end()),
+              &queue_args);
+          retry_count = 0;
+        }
       }
+      prepared.reset();
       if (status != INSTALL_SUCCESS) {
         ui->Print("Installation aborted.\n");
 
@@ -939,7 +1086,7 @@ Device::BuiltinAction start_recovery(Device* device, const std::vector<std::stri
         if (status == INSTALL_RETRY && retry_count < RETRY_LIMIT) {
           copy_logs(save_current_log);
           retry_count += 1;
-          set_retry_bootloader_message(retry_count, args);
+          set_retry_bootloader_message(retry_count, queue_args);
           // Print retry count on screen.
           ui->Print("Retry attempt %d\n", retry_count);
 
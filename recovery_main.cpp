@@ -40,6 +40,7 @@
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <bootloader_message/bootloader_message.h>
@@ -55,6 +56,7 @@
 #include "otautil/boot_state.h"
 #include "otautil/paths.h"
 #include "otautil/sysutil.h"
+#include "otautil/trace.h"
 #include "recovery.h"
 #include "recovery_ui/device.h"
 #include "recovery_ui/stub_ui.h"
@@ -343,7 +345,66 @@ static void redirect_stdio(const char* filename) {
   }
 }
 
+// The stages of the startup, which are the args of their TraceEvent::kStartup events.
+enum class StartupStage : uint64_t {
+  kLogging,
+  kVolumeTable,
+  kArgs,
+  kDevice,
+  kUi,
+  kSelinux,  // Runs concurrently with the stages from kVolumeTable to kUi.
+  kSetup,
+  kCount,
+};
+
+static constexpr const char* kStartupStageNames[] = {
+  "logging", "volume_table", "args", "device", "ui", "selinux", "setup",
+};
+static_assert(sizeof(kStartupStageNames) / sizeof(kStartupStageNames[0]) ==
+                  static_cast<size_t>(StartupStage::kCount),
+              "Mismatching number of startup stage names");
+
+// Records the stages of the startup into the trace ring (see otautil/trace.h), and sums them up in
+// the log once the startup is done.
+class StartupTimeline {
+ public:
+  StartupTimeline() : start_ns_(MonotonicTimeNs()), stage_start_ns_(start_ns_) {}
+
+  // Records |stage| as ending now, having started at the end of the previous one.
+  void EndStage(StartupStage stage) {
+    Record(stage, stage_start_ns_);
+    stage_start_ns_ = MonotonicTimeNs();
+  }
+
+  // Records |stage| as having started at |start_ns|, and ending now. Each stage must be recorded
+  // once, and only those from EndStage() need to be on the main thread.
+  void Record(StartupStage stage, uint64_t start_ns) {
+    RecordTraceEvent(TraceEvent::kStartup, start_ns, static_cast<uint64_t>(stage));
+    durations_ns_[static_cast<size_t>(stage)] = MonotonicTimeNs() - start_ns;
+  }
+
+  // Logs the time taken by each stage, and writes out the trace.
+  void Finish() {
+    std::string summary;
+    for (size_t i = 0; i < static_cast<size_t>(StartupStage::kCount); i++) {
+      summary += android::base::StringPrintf(" %s %.1fms", kStartupStageNames[i],
+                                             durations_ns_[i] / 1e6);
+    }
+    LOG(INFO) << android::base::StringPrintf("Startup took %.1fms:",
+                                             (MonotonicTimeNs() - start_ns_) / 1e6)
+              << summary;
+    WriteTraceFile(Paths::Get().temporary_startup_trace_file());
+  }
+
+ private:
+  uint64_t start_ns_;
+  uint64_t stage_start_ns_;
+  uint64_t durations_ns_[static_cast<size_t>(StartupStage::kCount)] = {};
+};
+
 int main(int argc, char** argv) {
+  StartupTimeline timeline;
+
   // We don't have logcat yet under recovery; so we'll print error on screen and log to stdout
   // (which is redirected to recovery.log) as we used to do.
   android::base::InitLogging(argv, &UiLogger);
@@ -366,8 +427,19 @@ int main(int argc, char** argv) {
   // redirect_stdio should be called only in non-sideload mode. Otherwise we may have two logger
   // instances with different timestamps.
   redirect_stdio(Paths::Get().temporary_log_file().c_str());
+  timeline.EndStage(StartupStage::kLogging);
+
+  // The file contexts take a while to load, but aren't needed until the UI is up; load them
+  // meanwhile.
+  selabel_handle* sehandle = nullptr;
+  std::thread selinux_thread([&sehandle, &timeline]() {
+    uint64_t start_ns = MonotonicTimeNs();
+    sehandle = selinux_android_file_context_handle();
+    timeline.Record(StartupStage::kSelinux, start_ns);
+  });
 
   load_volume_table();
+  timeline.EndStage(StartupStage::kVolumeTable);
 
   std::string stage;
   std::vector<std::string> args = get_args(argc, argv, &stage);
@@ -375,6 +447,7 @@ int main(int argc, char** argv) {
 
   static constexpr struct option OPTIONS[] = {
     { "fastboot", no_argument, nullptr, 0 },
+    { "headless", no_argument, nullptr, 0 },
     { "locale", required_argument, nullptr, 0 },
     { "reason", required_argument, nullptr, 0 },
     { "show_text", no_argument, nullptr, 't' },
@@ -383,6 +456,9 @@ int main(int argc, char** argv) {
 
   bool show_text = false;
   bool fastboot = false;
+  // A headless install (e.g. a factory or lab install) never initializes the screen, and only
+  // reports its status to the log.
+  bool headless = android::base::GetBoolProperty("ro.boot.recovery.headless", false);
   std::string locale;
   std::string reason;
 
@@ -406,6 +482,8 @@ int main(int argc, char** argv) {
           locale = optarg;
         } else if (option == "reason") {
           reason = optarg;
+        } else if (option == "headless") {
+          headless = true;
         } else if (option == "fastboot" &&
                    (android::base::GetBoolProperty("ro.boot.dynamic_partitions", false) ||
                     android::base::GetBoolProperty("ro.fastbootd.available", false))) {
@@ -427,6 +505,7 @@ int main(int argc, char** argv) {
       locale = DEFAULT_LOCALE;
     }
   }
+  timeline.EndStage(StartupStage::kArgs);
 
   static constexpr const char* kDefaultLibRecoveryUIExt = "librecovery_ui_ext.so";
   // Intentionally not calling dlclose(3) to avoid potential gotchas (e.g. `make_device` may have
@@ -453,10 +532,14 @@ int main(int argc, char** argv) {
     printf("Loading make_device from %s\n", kDefaultLibRecoveryUIExt);
     device = (*make_device_func)();
   }
+  timeline.EndStage(StartupStage::kDevice);
 
   if (android::base::GetBoolProperty("ro.boot.quiescent", false)) {
     printf("Quiescent recovery mode.\n");
     device->ResetUI(new StubRecoveryUI());
+  } else if (headless) {
+    printf("Headless recovery mode.\n");
+    device->ResetUI(new HeadlessRecoveryUI());
   } else {
     if (!device->GetUI()->Init(locale)) {
       printf("Failed to initialize UI; using stub UI instead.\n");
@@ -496,11 +579,12 @@ int main(int argc, char** argv) {
 
   ui->SetBackground(RecoveryUI::NONE);
   if (show_text) ui->ShowText(true);
+  timeline.EndStage(StartupStage::kUi);
 
   LOG(INFO) << "Starting recovery (pid " << getpid() << ") on " << ctime(&start);
   LOG(INFO) << "locale is [" << locale << "]";
 
-  auto sehandle = selinux_android_file_context_handle();
+  selinux_thread.join();
   selinux_android_set_sehandle(sehandle);
   if (!sehandle) {
     ui->Print("Warning: No file_contexts\n");
@@ -517,6 +601,8 @@ int main(int argc, char** argv) {
     copy_userdata_files();
     android::base::SetProperty("service.adb.root", "1");
   }
+  timeline.EndStage(StartupStage::kSetup);
+  timeline.Finish();
 
   while (true) {
     // We start adbd in recovery for the device with userdebug build or a unlocked bootloader.
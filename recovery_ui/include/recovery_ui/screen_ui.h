@@ -20,9 +20,13 @@
 #include <stdio.h>
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -31,6 +35,15 @@
 // From minui/minui.h.
 class GRSurface;
 
+// From otautil/sysutil.h.
+class MemMapping;
+
+// From healthd/BatteryMonitor.h.
+struct healthd_config;
+namespace android {
+class BatteryMonitor;
+}  // namespace android
+
 enum class UIElement {
   BATTERY_LOW,
   HEADER,
@@ -280,6 +293,54 @@ class MenuDrawFunctions : public DrawInterface {
   const DrawInterface& wrappee_;
 };
 
+// Splits a file into the pages of the file viewer, |rows| lines of up to |cols| characters each,
+// wrapped the way the text screen wraps them. The file is mapped rather than read, and the pages
+// are indexed on a background thread: the first page can be shown right away, and a page that's
+// been indexed is looked up without going through the file again.
+class FilePager {
+ public:
+  FilePager(size_t rows, size_t cols);
+  ~FilePager();
+
+  // Maps |filename| and starts indexing it. Returns false if it can't be mapped.
+  bool Open(const std::string& filename);
+
+  // The bytes of the file.
+  size_t size() const {
+    return size_;
+  }
+
+  // Returns whether the file has a |page|-th (0-based) page, waiting until it's indexed or the
+  // file runs out. An empty file has one empty page.
+  bool HasPage(size_t page);
+  // Returns the number of pages, waiting until they've all been indexed.
+  size_t PageCount();
+  // Returns the text of |page|, which HasPage() has found.
+  std::string_view GetPage(size_t page);
+  // Returns the offset where |page|, which HasPage() has found, ends.
+  size_t PageEnd(size_t page);
+
+ private:
+  void IndexThreadLoop();
+
+  const size_t rows_;
+  const size_t cols_;
+
+  std::unique_ptr<MemMapping> map_;
+  const char* data_{ nullptr };
+  size_t size_{ 0 };
+
+  std::mutex mutex_;
+  // Notified whenever a page gets indexed, and once the indexing is done.
+  std::condition_variable cv_;
+  // The offsets where the pages start.
+  std::vector<size_t> pages_;
+  bool indexed_{ false };
+
+  std::atomic<bool> index_thread_stopped_{ false };
+  std::thread index_thread_;
+};
+
 // Implementation of RecoveryUI appropriate for devices with a screen
 // (shows an icon + a progress bar, text logging, menu, etc.)
 class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
@@ -359,6 +420,9 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   // Whether we should blank and unblank screen on init to workaround device specific issues
   bool blank_unblank_on_init_;
 
+  // Initializes minui on the display, waiting for it to come up. Returns false on timeout.
+  virtual bool InitGraphics();
+
   virtual bool InitTextParams();
 
   virtual bool LoadWipeDataMenuText();
@@ -401,18 +465,44 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   virtual void update_progress_locked();
 
   const GRSurface* GetCurrentFrame() const;
+  // Returns frames[index], decoding it from names[index] first if it hasn't been loaded yet.
+  const GRSurface* GetFrame(std::vector<std::unique_ptr<GRSurface>>& frames,
+                            const std::vector<std::string>& names, size_t index) const;
   const GRSurface* GetCurrentText() const;
 
+  void InitBattMonitor();
+  std::chrono::milliseconds PollBattMonitor();
   void BattMonitorThreadLoop();
+  bool IsAnimating_locked() const;
   void ProgressThreadLoop();
 
-  virtual void ShowFile(FILE*);
+  // Pages through |pager| until the user leaves the viewer.
+  virtual void ShowPages(FilePager* pager);
+  // Puts |page| on the text screen, with the cursor on the last row for the prompt.
+  void ShowPage(std::string_view page);
   virtual void PrintV(const char*, bool, va_list);
-  void PutChar(char);
+  bool DrainPendingText_locked();
   void ClearText();
 
   virtual void LoadAnimation();
-  std::unique_ptr<GRSurface> LoadBitmap(const std::string& filename);
+  // A hardware overlay from gr_overlay_init() for an element of the given size; the index is -1 if
+  // there's none.
+  struct Overlay {
+    int index{ -1 };
+    int width{ 0 };
+    int height{ 0 };
+  };
+  // Sets up the hardware overlays that draw_foreground_locked() puts the animation and the progress
+  // bar on, if the graphics backend has any. Subclasses that draw them in other ways keep none.
+  virtual void InitOverlays();
+  // Draws a foreground element of the given size with |draw|, which takes the position to draw
+  // at: onto |overlay| shown at (x, y), if it has the same size, or otherwise onto the screen at
+  // (x, y). Returns true in the former case.
+  bool DrawForegroundElement(const Overlay& overlay, int x, int y, int width, int height,
+                             const std::function<void(int, int)>& draw) const;
+  // Takes the overlays off the screen, by the next gr_flip_overlays().
+  void HideOverlays_locked();
+  std::unique_ptr<GRSurface> LoadBitmap(const std::string& filename) const;
   std::unique_ptr<GRSurface> LoadLocalizedBitmap(const std::string& filename);
 
   int PixelsFromDp(int dp) const;
@@ -471,11 +561,14 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   std::unique_ptr<GRSurface> fastbootd_logo_;
 
   // current_icon_ points to one of the frames in intro_frames_ or loop_frames_, indexed by
-  // current_frame_, or error_icon_.
+  // current_frame_, or error_icon_. The frames are decoded lazily from the resource names in
+  // intro_frame_names_ and loop_frame_names_, so an entry may be nullptr until first use.
   Icon current_icon_;
   std::unique_ptr<GRSurface> error_icon_;
-  std::vector<std::unique_ptr<GRSurface>> intro_frames_;
-  std::vector<std::unique_ptr<GRSurface>> loop_frames_;
+  mutable std::vector<std::unique_ptr<GRSurface>> intro_frames_;
+  mutable std::vector<std::unique_ptr<GRSurface>> loop_frames_;
+  std::vector<std::string> intro_frame_names_;
+  std::vector<std::string> loop_frame_names_;
   size_t current_frame_;
   bool intro_done_;
 
@@ -485,13 +578,36 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
   std::unique_ptr<GRSurface> stage_marker_empty_;
   std::unique_ptr<GRSurface> stage_marker_fill_;
 
+  Overlay animation_overlay_;
+  Overlay progress_overlay_;
+  // Whether the last draw_foreground_locked() drew anything onto the screen, rather than only onto
+  // the overlays.
+  bool foreground_on_screen_{ true };
+
   ProgressType progressBarType;
 
   float progressScopeStart, progressScopeSize, progress;
   double progressScopeTime, progressScopeDuration;
 
-  // true when both graphics pages are the same (except for the progress bar).
-  bool pagesIdentical;
+  // The number of graphics pages that still need a full redraw after the background changed. Once
+  // it's zero, all the pages are the same (except for the progress bar). The minui backends use up
+  // to kGraphicsPages pages.
+  static constexpr int kGraphicsPages = 3;
+  int pagesToRedraw;
+
+  // true when the text buffer has changed since the last full redraw, which ProgressThreadLoop()
+  // then catches up on. Prints that come in quick succession only redraw once per frame.
+  bool text_dirty_{ false };
+  // When the screen was last redrawn in full.
+  double last_redraw_time_{ 0 };
+
+  // Prints that PrintV() has formatted but not yet moved into text_, newest first. Pushed without
+  // a lock, and drained by DrainPendingText_locked() under updateMutex.
+  struct PendingText {
+    std::string text;
+    PendingText* next{ nullptr };
+  };
+  std::atomic<PendingText*> pending_text_{ nullptr };
 
   size_t text_cols_, text_rows_;
 
@@ -512,6 +628,9 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
 
   std::thread progress_thread_;
   std::atomic<bool> progress_thread_stopped_{ false };
+  // Wakes up ProgressThreadLoop() when something it animates may have changed. Waited on with
+  // updateMutex.
+  std::condition_variable progress_cv_;
 
   int stage, max_stage;
 
@@ -526,6 +645,13 @@ class ScreenRecoveryUI : public RecoveryUI, public DrawInterface {
 
   std::mutex updateMutex;
 
+  // The battery is polled by a timer on the input thread's event loop, or by
+  // batt_monitor_thread_ if the event loop couldn't be set up.
+  std::unique_ptr<healthd_config> batt_config_;
+  std::unique_ptr<android::BatteryMonitor> batt_monitor_;
+  int batt_monitor_retry_count_{ 0 };
+  bool batt_monitor_on_event_loop_{ false };
+  int batt_monitor_timer_fd_{ -1 };
   std::thread batt_monitor_thread_;
   std::atomic<bool> batt_monitor_thread_stopped_{ false };
   int32_t batt_capacity_;
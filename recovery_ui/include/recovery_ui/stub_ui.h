@@ -18,6 +18,7 @@
 #define RECOVERY_STUB_UI_H
 
 #include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -87,4 +88,33 @@ class StubRecoveryUI : public RecoveryUI {
   }
 };
 
+// Stub UI for the headless installs (e.g. factory or lab installs driven via adb or the BCB), which
+// never initializes minui, but reports the status of the install to the log instead, as lines of
+// "status: <key> <value>".
+class HeadlessRecoveryUI : public StubRecoveryUI {
+ public:
+  HeadlessRecoveryUI() = default;
+
+  void SetBackground(Icon icon) override;
+  void SetSystemUpdateText(bool security_update) override;
+
+  void SetProgressType(ProgressType type) override;
+  void ShowProgress(float portion, float seconds) override;
+  void SetProgress(float fraction) override;
+
+  void SetStage(int current, int max) override;
+
+ private:
+  // Reports the overall progress, if it has changed by a percent. Should be called with
+  // progress_lock_ locked.
+  void ReportProgressLocked();
+
+  std::mutex progress_lock_;
+  ProgressType progress_type_{ EMPTY };
+  float progress_scope_start_{ 0 };
+  float progress_scope_size_{ 0 };
+  float progress_{ 0 };
+  int reported_percent_{ -1 };
+};
+
 #endif  // RECOVERY_STUB_UI_H
@@ -25,6 +25,8 @@ class VrRecoveryUI : public ScreenRecoveryUI {
  public:
   VrRecoveryUI();
 
+  bool Init(const std::string& locale) override;
+
  protected:
   // Pixel offsets to move drawing functions to visible range.
   // Can vary per device depending on screen size and lens distortion.
@@ -40,6 +42,9 @@ class VrRecoveryUI : public ScreenRecoveryUI {
   void DrawFill(int x, int y, int w, int h) const override;
   void DrawTextIcon(int x, int y, const GRSurface* surface) const override;
   int DrawTextLine(int x, int y, const std::string& line, bool bold) const override;
+
+  // Everything is drawn twice, once for each eye, so the foreground stays on the screen.
+  void InitOverlays() override {}
 };
 
 #endif  // RECOVERY_VR_UI_H
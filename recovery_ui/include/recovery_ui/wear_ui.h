@@ -56,6 +56,9 @@ class WearRecoveryUI : public ScreenRecoveryUI {
 
   void LoadAnimation() override;
 
+  // The progress frames and the circle layout are drawn onto the screen.
+  void InitOverlays() override {}
+
   bool IsWearable() override;
 
   void SetProgress(float fraction) override;
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -30,7 +31,10 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
 #include <thread>
@@ -50,6 +54,7 @@
 
 #include "minui/minui.h"
 #include "otautil/paths.h"
+#include "otautil/sysutil.h"
 #include "recovery_ui/device.h"
 #include "recovery_ui/ui.h"
 
@@ -398,7 +403,7 @@ ScreenRecoveryUI::ScreenRecoveryUI()
       progressScopeStart(0),
       progressScopeSize(0),
       progress(0),
-      pagesIdentical(false),
+      pagesToRedraw(kGraphicsPages),
       text_cols_(0),
       text_rows_(0),
       text_(nullptr),
@@ -420,22 +425,49 @@ ScreenRecoveryUI::~ScreenRecoveryUI() {
   if (batt_monitor_thread_.joinable()) {
     batt_monitor_thread_.join();
   }
+  // The timer may fire until it's removed, so wait for the event loop to remove it.
+  if (batt_monitor_on_event_loop_) {
+    std::promise<void> removed;
+    if (ev_post([this, &removed] {
+          if (batt_monitor_timer_fd_ != -1) ev_remove_fd(batt_monitor_timer_fd_);
+          removed.set_value();
+        }) == 0) {
+      removed.get_future().wait();
+    }
+  }
 
-  progress_thread_stopped_ = true;
+  {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    progress_thread_stopped_ = true;
+  }
+  progress_cv_.notify_all();
   if (progress_thread_.joinable()) {
     progress_thread_.join();
   }
+  // Frees any prints that never made it into the text buffer.
+  DrainPendingText_locked();
   // No-op if gr_init() (via Init()) was not called or had failed.
   gr_exit();
 }
 
 const GRSurface* ScreenRecoveryUI::GetCurrentFrame() const {
   if (current_icon_ == INSTALLING_UPDATE || current_icon_ == ERASING) {
-    return intro_done_ ? loop_frames_[current_frame_].get() : intro_frames_[current_frame_].get();
+    return intro_done_ ? GetFrame(loop_frames_, loop_frame_names_, current_frame_)
+                       : GetFrame(intro_frames_, intro_frame_names_, current_frame_);
   }
   return error_icon_.get();
 }
 
+const GRSurface* ScreenRecoveryUI::GetFrame(std::vector<std::unique_ptr<GRSurface>>& frames,
+                                            const std::vector<std::string>& names,
+                                            size_t index) const {
+  // Frames not yet decoded by the progress thread are loaded on first use.
+  if (!frames[index]) {
+    frames[index] = LoadBitmap(names[index]);
+  }
+  return frames[index].get();
+}
+
 const GRSurface* ScreenRecoveryUI::GetCurrentText() const {
   switch (current_icon_) {
     case ERASING:
@@ -500,7 +532,7 @@ int ScreenRecoveryUI::GetProgressBaseline() const {
 // Clear the screen and draw the currently selected background icon (if any).
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::draw_background_locked() {
-  pagesIdentical = false;
+  pagesToRedraw = kGraphicsPages;
   gr_color(0, 0, 0, 255);
   gr_clear();
   if (current_icon_ != NONE) {
@@ -524,9 +556,27 @@ void ScreenRecoveryUI::draw_background_locked() {
   }
 }
 
-// Draws the animation and progress bar (if any) on the screen. Does not flip pages. Should only be
-// called with updateMutex locked.
+bool ScreenRecoveryUI::DrawForegroundElement(const Overlay& overlay, int x, int y, int width,
+                                             int height,
+                                             const std::function<void(int, int)>& draw) const {
+  if (overlay.index != -1 && overlay.width == width && overlay.height == height) {
+    gr_overlay_begin(overlay.index);
+    draw(0, 0);
+    gr_overlay_end();
+    gr_overlay_show(overlay.index, x, y);
+    return true;
+  }
+  if (overlay.index != -1) {
+    gr_overlay_hide(overlay.index);
+  }
+  draw(x, y);
+  return false;
+}
+
+// Draws the animation and progress bar (if any) on the screen, or on their hardware overlays. Does
+// not flip pages. Should only be called with updateMutex locked.
 void ScreenRecoveryUI::draw_foreground_locked() {
+  foreground_on_screen_ = false;
   if (current_icon_ != NONE) {
     const auto& frame = GetCurrentFrame();
     int frame_width = gr_get_width(frame);
@@ -534,8 +584,19 @@ void ScreenRecoveryUI::draw_foreground_locked() {
     int frame_x = (ScreenWidth() - frame_width) / 2;
     int frame_y = GetAnimationBaseline();
     if (frame_x >= 0 && frame_y >= 0 && (frame_x + frame_width) < ScreenWidth() &&
-        (frame_y + frame_height) < ScreenHeight())
-      DrawSurface(frame, 0, 0, frame_width, frame_height, frame_x, frame_y);
+        (frame_y + frame_height) < ScreenHeight()) {
+      auto draw_frame = [&](int x, int y) {
+        DrawSurface(frame, 0, 0, frame_width, frame_height, x, y);
+      };
+      if (!DrawForegroundElement(animation_overlay_, frame_x, frame_y, frame_width, frame_height,
+                                 draw_frame)) {
+        foreground_on_screen_ = true;
+      }
+    } else if (animation_overlay_.index != -1) {
+      gr_overlay_hide(animation_overlay_.index);
+    }
+  } else if (animation_overlay_.index != -1) {
+    gr_overlay_hide(animation_overlay_.index);
   }
 
   if (progressBarType != EMPTY) {
@@ -545,34 +606,40 @@ void ScreenRecoveryUI::draw_foreground_locked() {
     int progress_x = (ScreenWidth() - width) / 2;
     int progress_y = GetProgressBaseline();
 
-    // Erase behind the progress bar (in case this was a progress-only update)
-    gr_color(0, 0, 0, 255);
-    DrawFill(progress_x, progress_y, width, height);
+    auto draw_progress = [&](int x, int y) {
+      // Erase behind the progress bar (in case this was a progress-only update)
+      gr_color(0, 0, 0, 255);
+      DrawFill(x, y, width, height);
 
-    if (progressBarType == DETERMINATE) {
-      float p = progressScopeStart + progress * progressScopeSize;
-      int pos = static_cast<int>(p * width);
+      if (progressBarType == DETERMINATE) {
+        float p = progressScopeStart + progress * progressScopeSize;
+        int pos = static_cast<int>(p * width);
 
-      if (rtl_locale_) {
-        // Fill the progress bar from right to left.
-        if (pos > 0) {
-          DrawSurface(progress_bar_fill_.get(), width - pos, 0, pos, height,
-                      progress_x + width - pos, progress_y);
-        }
-        if (pos < width - 1) {
-          DrawSurface(progress_bar_empty_.get(), 0, 0, width - pos, height, progress_x, progress_y);
-        }
-      } else {
-        // Fill the progress bar from left to right.
-        if (pos > 0) {
-          DrawSurface(progress_bar_fill_.get(), 0, 0, pos, height, progress_x, progress_y);
-        }
-        if (pos < width - 1) {
-          DrawSurface(progress_bar_empty_.get(), pos, 0, width - pos, height, progress_x + pos,
-                      progress_y);
+        if (rtl_locale_) {
+          // Fill the progress bar from right to left.
+          if (pos > 0) {
+            DrawSurface(progress_bar_fill_.get(), width - pos, 0, pos, height, x + width - pos, y);
+          }
+          if (pos < width - 1) {
+            DrawSurface(progress_bar_empty_.get(), 0, 0, width - pos, height, x, y);
+          }
+        } else {
+          // Fill the progress bar from left to right.
+          if (pos > 0) {
+            DrawSurface(progress_bar_fill_.get(), 0, 0, pos, height, x, y);
+          }
+          if (pos < width - 1) {
+            DrawSurface(progress_bar_empty_.get(), pos, 0, width - pos, height, x + pos, y);
+          }
         }
       }
+    };
+    if (!DrawForegroundElement(progress_overlay_, progress_x, progress_y, width, height,
+                               draw_progress)) {
+      foreground_on_screen_ = true;
     }
+  } else if (progress_overlay_.index != -1) {
+    gr_overlay_hide(progress_overlay_.index);
   }
 }
 
@@ -662,7 +729,9 @@ void ScreenRecoveryUI::SelectAndShowBackgroundText(const std::vector<std::string
     text_y += gr_get_height(p.second.get());
   }
   // Update the whole screen.
+  HideOverlays_locked();
   gr_flip();
+  gr_flip_overlays();
 }
 
 void ScreenRecoveryUI::CheckBackgroundTextImages() {
@@ -806,6 +875,7 @@ void ScreenRecoveryUI::draw_screen_locked() {
     return;
   }
 
+  HideOverlays_locked();
   gr_color(0, 0, 0, 255);
   gr_clear();
 
@@ -921,76 +991,114 @@ void ScreenRecoveryUI::draw_battery_capacity_locked() {
 // Redraw everything on the screen and flip the screen (make it visible).
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::update_screen_locked() {
+  DrainPendingText_locked();
   draw_screen_locked();
+  pagesToRedraw = std::max(pagesToRedraw - 1, 0);
   gr_flip();
+  gr_flip_overlays();
+  text_dirty_ = false;
+  last_redraw_time_ = now();
 }
 
 // Updates only the progress bar, if possible, otherwise redraws the screen.
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::update_progress_locked() {
-  if (show_text || !pagesIdentical) {
+  if (show_text || pagesToRedraw > 0) {
+    int pages = pagesToRedraw;
+    DrainPendingText_locked();
     draw_screen_locked();  // Must redraw the whole screen
-    pagesIdentical = true;
+    pagesToRedraw = std::max(pages - 1, 0);
+    text_dirty_ = false;
+    last_redraw_time_ = now();
   } else {
     draw_foreground_locked();  // Draw only the progress bar and overlays
+    // With the hardware overlays, the screen itself stays the same.
+    if (!foreground_on_screen_) {
+      gr_flip_overlays();
+      return;
+    }
   }
   gr_flip();
+  gr_flip_overlays();
 }
 
 #define BATT_MONITOR_INIT_RETRY_MAX 10
-void ScreenRecoveryUI::BattMonitorThreadLoop() {
-  using aidl::android::hardware::health::BatteryStatus;
+void ScreenRecoveryUI::InitBattMonitor() {
   using android::hardware::health::InitHealthdConfig;
 
-  auto config = std::make_unique<healthd_config>();
-  InitHealthdConfig(config.get());
-
-  auto batt_monitor = std::make_unique<android::BatteryMonitor>();
-  batt_monitor->init(config.get());
-  int retry_count = 0;
+  batt_config_ = std::make_unique<healthd_config>();
+  InitHealthdConfig(batt_config_.get());
 
-  while (!batt_monitor_thread_stopped_) {
-    bool redraw = false;
-    {
-      std::lock_guard<std::mutex> lg(updateMutex);
-
-      auto charge_status = static_cast<BatteryStatus>(batt_monitor->getChargeStatus());
-      // Treat unknown status as on charger.
-      bool charging = (charge_status != BatteryStatus::DISCHARGING &&
-                       charge_status != BatteryStatus::NOT_CHARGING &&
-                       charge_status != BatteryStatus::FULL);
-      if (charging_ != charging) {
-        charging_ = charging;
-        redraw = true;
-      }
+  batt_monitor_ = std::make_unique<android::BatteryMonitor>();
+  batt_monitor_->init(batt_config_.get());
+  batt_monitor_retry_count_ = 0;
+}
 
-      android::BatteryProperty prop;
-      android::status_t status = batt_monitor->getProperty(android::BATTERY_PROP_CAPACITY, &prop);
-      // If we can't read battery percentage, it may be a device without battery. In this
-      // situation, use 100 as a fake battery percentage.
-      if (status != android::OK) {
-        prop.valueInt64 = 100;
-        if (retry_count++ < BATT_MONITOR_INIT_RETRY_MAX) {
-          LOG(WARNING) << "Retry count for reinitialization:" << retry_count;
-          if (redraw) update_screen_locked();
-
-          // Try reinit
-          batt_monitor->init(config.get());
-          std::this_thread::sleep_for(100ms);
-          continue;
-        }
-      }
+// Reads the battery status and redraws the screen if it changed. Returns the delay until the next
+// poll.
+std::chrono::milliseconds ScreenRecoveryUI::PollBattMonitor() {
+  using aidl::android::hardware::health::BatteryStatus;
 
-      int32_t batt_capacity = static_cast<int32_t>(prop.valueInt64);
-      if (batt_capacity_ != batt_capacity) {
-        batt_capacity_ = batt_capacity;
-        redraw = true;
-      }
+  bool redraw = false;
+  std::lock_guard<std::mutex> lg(updateMutex);
 
+  auto charge_status = static_cast<BatteryStatus>(batt_monitor_->getChargeStatus());
+  // Treat unknown status as on charger.
+  bool charging = (charge_status != BatteryStatus::DISCHARGING &&
+                   charge_status != BatteryStatus::NOT_CHARGING &&
+                   charge_status != BatteryStatus::FULL);
+  if (charging_ != charging) {
+    charging_ = charging;
+    redraw = true;
+  }
+
+  android::BatteryProperty prop;
+  android::status_t status = batt_monitor_->getProperty(android::BATTERY_PROP_CAPACITY, &prop);
+  // If we can't read battery percentage, it may be a device without battery. In this
+  // situation, use 100 as a fake battery percentage.
+  if (status != android::OK) {
+    prop.valueInt64 = 100;
+    if (batt_monitor_retry_count_++ < BATT_MONITOR_INIT_RETRY_MAX) {
+      LOG(WARNING) << "Retry count for reinitialization:" << batt_monitor_retry_count_;
       if (redraw) update_screen_locked();
+
+      // Try reinit
+      batt_monitor_->init(batt_config_.get());
+      return 100ms;
     }
-    std::this_thread::sleep_for(5s);
   }
+
+  int32_t batt_capacity = static_cast<int32_t>(prop.valueInt64);
+  if (batt_capacity_ != batt_capacity) {
+    batt_capacity_ = batt_capacity;
+    redraw = true;
+  }
+
+  if (redraw) update_screen_locked();
+  return 5s;
+}
+
+void ScreenRecoveryUI::BattMonitorThreadLoop() {
+  InitBattMonitor();
+  while (!batt_monitor_thread_stopped_) {
+    std::this_thread::sleep_for(PollBattMonitor());
+  }
+}
+
+// Returns whether ProgressThreadLoop() has anything to update: the installation animation, a
+// progress bar moving on a timer, or prints held back by PrintV(). Should only be called with
+// updateMutex locked.
+bool ScreenRecoveryUI::IsAnimating_locked() const {
+  if ((current_icon_ == INSTALLING_UPDATE || current_icon_ == ERASING) && !show_text) {
+    return true;
+  }
+  if (progressBarType == DETERMINATE && progressScopeDuration > 0 && progress < 1.0) {
+    return true;
+  }
+  if (pending_text_.load(std::memory_order_relaxed) != nullptr) {
+    return true;
+  }
+  return text_dirty_ && show_text;
 }
 
 void ScreenRecoveryUI::ProgressThreadLoop() {
@@ -998,8 +1106,18 @@ void ScreenRecoveryUI::ProgressThreadLoop() {
   while (!progress_thread_stopped_) {
     double start = now();
     bool redraw = false;
+    std::vector<std::unique_ptr<GRSurface>>* prefetch_frames = nullptr;
+    const std::vector<std::string>* prefetch_names = nullptr;
+    size_t prefetch_index = 0;
     {
-      std::lock_guard<std::mutex> lg(updateMutex);
+      // Sleep until there is something to animate, rather than waking up every frame for
+      // nothing, e.g. while the text screen is up.
+      std::unique_lock<std::mutex> lock(updateMutex);
+      // A print queued while this thread holds the lock but hasn't started waiting yet can't be
+      // noticed until the next wakeup, so recheck once a second.
+      progress_cv_.wait_for(lock, 1s,
+                            [this] { return progress_thread_stopped_ || IsAnimating_locked(); });
+      if (progress_thread_stopped_) break;
 
       // update the installation animation, if active
       // skip this if we have a text overlay (too expensive to update)
@@ -1030,7 +1148,38 @@ void ScreenRecoveryUI::ProgressThreadLoop() {
         }
       }
 
+      // catch up on the prints that were held back
+      if (DrainPendingText_locked()) {
+        text_dirty_ = true;
+      }
+      if (text_dirty_ && show_text) {
+        redraw = true;
+      }
+
       if (redraw) update_progress_locked();
+
+      // Pick the frame that will be shown next, so it can be decoded ahead of time.
+      if (current_icon_ == INSTALLING_UPDATE || current_icon_ == ERASING) {
+        if (!intro_done_ && current_frame_ + 1 < intro_frames_.size()) {
+          prefetch_frames = &intro_frames_;
+          prefetch_names = &intro_frame_names_;
+          prefetch_index = current_frame_ + 1;
+        } else {
+          prefetch_frames = &loop_frames_;
+          prefetch_names = &loop_frame_names_;
+          prefetch_index = intro_done_ ? (current_frame_ + 1) % loop_frames_.size() : 0;
+        }
+        if ((*prefetch_frames)[prefetch_index]) prefetch_frames = nullptr;
+      }
+    }
+
+    // Decode outside the lock, so that a PNG decode doesn't hold up the UI.
+    if (prefetch_frames != nullptr) {
+      auto frame = LoadBitmap((*prefetch_names)[prefetch_index]);
+      std::lock_guard<std::mutex> lg(updateMutex);
+      if (!(*prefetch_frames)[prefetch_index]) {
+        (*prefetch_frames)[prefetch_index] = std::move(frame);
+      }
     }
 
     double end = now();
@@ -1041,7 +1190,7 @@ void ScreenRecoveryUI::ProgressThreadLoop() {
   }
 }
 
-std::unique_ptr<GRSurface> ScreenRecoveryUI::LoadBitmap(const std::string& filename) {
+std::unique_ptr<GRSurface> ScreenRecoveryUI::LoadBitmap(const std::string& filename) const {
   GRSurface* surface;
   if (auto result = res_create_display_surface(filename.c_str(), &surface); result < 0) {
     LOG(ERROR) << "Failed to load bitmap " << filename << " (error " << result << ")";
@@ -1065,6 +1214,27 @@ std::unique_ptr<GRSurface> ScreenRecoveryUI::LoadLocalizedBitmap(const std::stri
   return nullptr;
 }
 
+// The decoding of the resources by Init() is mostly CPU bound (inflating and converting the PNGs).
+static constexpr size_t kResourceLoadThreads = 4;
+
+// Runs the functions in |fns| on up to |threads| threads, the calling one included.
+static void RunConcurrently(const std::vector<std::function<void()>>& fns, size_t threads) {
+  std::atomic<size_t> next{ 0 };
+  auto run = [&]() {
+    for (size_t i = next++; i < fns.size(); i = next++) {
+      fns[i]();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < std::min(threads, fns.size()); t++) {
+    workers.emplace_back(run);
+  }
+  run();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
 static char** Alloc2d(size_t rows, size_t cols) {
   char** result = new char*[rows];
   for (size_t i = 0; i < rows; ++i) {
@@ -1106,7 +1276,7 @@ bool ScreenRecoveryUI::LoadWipeDataMenuText() {
   return true;
 }
 
-static bool InitGraphics() {
+bool ScreenRecoveryUI::InitGraphics() {
   // Timeout is same as init wait for file default of 5 seconds and is arbitrary
   const unsigned timeout = 500;  // 10ms increments
   for (auto retry = timeout; retry > 0; --retry) {
@@ -1155,35 +1325,46 @@ bool ScreenRecoveryUI::Init(const std::string& locale) {
   // Set up the locale info.
   SetLocale(locale);
 
-  error_icon_ = LoadBitmap("icon_error");
-
-  progress_bar_empty_ = LoadBitmap("progress_empty");
-  progress_bar_fill_ = LoadBitmap("progress_fill");
-  stage_marker_empty_ = LoadBitmap("stage_empty");
-  stage_marker_fill_ = LoadBitmap("stage_fill");
-
-  erasing_text_ = LoadLocalizedBitmap("erasing_text");
-  no_command_text_ = LoadLocalizedBitmap("no_command_text");
-  error_text_ = LoadLocalizedBitmap("error_text");
-
-  default_logo = LoadBitmap("logo_image");
-  back_icon_ = LoadBitmap("ic_back");
-  back_icon_sel_ = LoadBitmap("ic_back_sel");
-  if (android::base::GetBoolProperty("ro.boot.dynamic_partitions", false) ||
-      android::base::GetBoolProperty("ro.fastbootd.available", false)) {
-    fastbootd_logo_ = LoadBitmap("fastbootd");
-  }
-
   // Background text for "installing_update" could be "installing update" or
   // "installing security update". It will be set after Init() according to the commands in BCB.
   installing_text_.reset();
 
-  LoadWipeDataMenuText();
-
-  LoadAnimation();
-
-  // Keep the battery capacity updated.
-  batt_monitor_thread_ = std::thread(&ScreenRecoveryUI::BattMonitorThreadLoop, this);
+  // The resources are independent of each other, and get decoded concurrently.
+  bool load_fastbootd_logo = android::base::GetBoolProperty("ro.boot.dynamic_partitions", false) ||
+                             android::base::GetBoolProperty("ro.fastbootd.available", false);
+  std::vector<std::function<void()>> loads = {
+    [this] { error_icon_ = LoadBitmap("icon_error"); },
+    [this] { progress_bar_empty_ = LoadBitmap("progress_empty"); },
+    [this] { progress_bar_fill_ = LoadBitmap("progress_fill"); },
+    [this] { stage_marker_empty_ = LoadBitmap("stage_empty"); },
+    [this] { stage_marker_fill_ = LoadBitmap("stage_fill"); },
+    [this] { erasing_text_ = LoadLocalizedBitmap("erasing_text"); },
+    [this] { no_command_text_ = LoadLocalizedBitmap("no_command_text"); },
+    [this] { error_text_ = LoadLocalizedBitmap("error_text"); },
+    [this] { default_logo = LoadBitmap("logo_image"); },
+    [this] { back_icon_ = LoadBitmap("ic_back"); },
+    [this] { back_icon_sel_ = LoadBitmap("ic_back_sel"); },
+    [this, load_fastbootd_logo] {
+      if (load_fastbootd_logo) fastbootd_logo_ = LoadBitmap("fastbootd");
+    },
+    [this] { LoadWipeDataMenuText(); },
+    [this] { LoadAnimation(); },
+  };
+  RunConcurrently(loads, kResourceLoadThreads);
+  InitOverlays();
+
+  // Keep the battery capacity updated, from the input thread's event loop if there is one.
+  auto start_batt_monitor = [this] {
+    InitBattMonitor();
+    batt_monitor_timer_fd_ = ev_add_timer(PollBattMonitor(), [this] { return PollBattMonitor(); });
+    if (batt_monitor_timer_fd_ == -1) {
+      PLOG(ERROR) << "Failed to add the battery monitor timer";
+    }
+  };
+  batt_monitor_on_event_loop_ = ev_post(start_batt_monitor) == 0;
+  if (!batt_monitor_on_event_loop_) {
+    batt_monitor_thread_ = std::thread(&ScreenRecoveryUI::BattMonitorThreadLoop, this);
+  }
 
   // Keep the progress bar updated, even when the process is otherwise busy.
   progress_thread_ = std::thread(&ScreenRecoveryUI::ProgressThreadLoop, this);
@@ -1198,6 +1379,24 @@ std::string ScreenRecoveryUI::GetLocale() const {
   return locale_;
 }
 
+void ScreenRecoveryUI::InitOverlays() {
+  auto init = [](const GRSurface* surface, Overlay* overlay) {
+    if (surface == nullptr) return;
+    overlay->width = gr_get_width(surface);
+    overlay->height = gr_get_height(surface);
+    overlay->index = gr_overlay_init(overlay->width, overlay->height);
+  };
+  // The frames after the first one aren't decoded yet, but they are of the same size.
+  init(loop_frames_[0].get(), &animation_overlay_);
+  init(progress_bar_empty_.get(), &progress_overlay_);
+}
+
+void ScreenRecoveryUI::HideOverlays_locked() {
+  for (const auto& overlay : { animation_overlay_, progress_overlay_ }) {
+    if (overlay.index != -1) gr_overlay_hide(overlay.index);
+  }
+}
+
 void ScreenRecoveryUI::LoadAnimation() {
   std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(Paths::Get().resource_dir().c_str()),
                                                 closedir);
@@ -1225,17 +1424,16 @@ void ScreenRecoveryUI::LoadAnimation() {
   std::sort(intro_frame_names.begin(), intro_frame_names.end());
   std::sort(loop_frame_names.begin(), loop_frame_names.end());
 
+  // Only the first loop frame is decoded here, since the layout depends on its size. The rest are
+  // decoded by the progress thread ahead of being shown, or on first use.
   intro_frames_.clear();
-  intro_frames_.reserve(intro_frames);
-  for (const auto& frame_name : intro_frame_names) {
-    intro_frames_.emplace_back(LoadBitmap(frame_name));
-  }
+  intro_frames_.resize(intro_frames);
+  intro_frame_names_ = std::move(intro_frame_names);
 
   loop_frames_.clear();
-  loop_frames_.reserve(loop_frames);
-  for (const auto& frame_name : loop_frame_names) {
-    loop_frames_.emplace_back(LoadBitmap(frame_name));
-  }
+  loop_frames_.resize(loop_frames);
+  loop_frame_names_ = std::move(loop_frame_names);
+  loop_frames_[0] = LoadBitmap(loop_frame_names_[0]);
 }
 
 void ScreenRecoveryUI::SetBackground(Icon icon) {
@@ -1243,6 +1441,7 @@ void ScreenRecoveryUI::SetBackground(Icon icon) {
 
   current_icon_ = icon;
   update_screen_locked();
+  progress_cv_.notify_all();
 }
 
 void ScreenRecoveryUI::SetProgressType(ProgressType type) {
@@ -1254,6 +1453,7 @@ void ScreenRecoveryUI::SetProgressType(ProgressType type) {
   progressScopeSize = 0;
   progress = 0;
   update_progress_locked();
+  progress_cv_.notify_all();
 }
 
 void ScreenRecoveryUI::ShowProgress(float portion, float seconds) {
@@ -1265,6 +1465,7 @@ void ScreenRecoveryUI::ShowProgress(float portion, float seconds) {
   progressScopeDuration = seconds;
   progress = 0;
   update_progress_locked();
+  progress_cv_.notify_all();
 }
 
 void ScreenRecoveryUI::SetProgress(float fraction) {
@@ -1288,17 +1489,28 @@ void ScreenRecoveryUI::SetStage(int current, int max) {
   max_stage = max;
 }
 
-void ScreenRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap) {
-  std::string str;
-  android::base::StringAppendV(&str, fmt, ap);
+// Moves the prints queued by PrintV() into the text buffer, oldest first. Returns whether there
+// was anything to move. Should only be called with updateMutex locked.
+bool ScreenRecoveryUI::DrainPendingText_locked() {
+  PendingText* head = pending_text_.exchange(nullptr, std::memory_order_acquire);
+  if (head == nullptr) {
+    return false;
+  }
 
-  if (copy_to_stdout) {
-    fputs(str.c_str(), stdout);
+  // The queue is pushed at the head, so reverse it to get the prints back in order.
+  PendingText* reversed = nullptr;
+  while (head != nullptr) {
+    PendingText* next = head->next;
+    head->next = reversed;
+    reversed = head;
+    head = next;
   }
 
-  std::lock_guard<std::mutex> lg(updateMutex);
-  if (text_rows_ > 0 && text_cols_ > 0) {
-    for (const char* ptr = str.c_str(); *ptr != '\0'; ++ptr) {
+  while (reversed != nullptr) {
+    std::unique_ptr<PendingText> entry(reversed);
+    reversed = entry->next;
+    if (text_rows_ == 0 || text_cols_ == 0) continue;
+    for (const char* ptr = entry->text.c_str(); *ptr != '\0'; ++ptr) {
       if (*ptr == '\n' || text_col_ >= text_cols_) {
         text_[text_row_][text_col_] = '\0';
         text_col_ = 0;
@@ -1307,7 +1519,46 @@ void ScreenRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap)
       if (*ptr != '\n') text_[text_row_][text_col_++] = *ptr;
     }
     text_[text_row_][text_col_] = '\0';
-    update_screen_locked();
+  }
+  return true;
+}
+
+void ScreenRecoveryUI::PrintV(const char* fmt, bool copy_to_stdout, va_list ap) {
+  auto entry = std::make_unique<PendingText>();
+  android::base::StringAppendV(&entry->text, fmt, ap);
+
+  if (copy_to_stdout) {
+    fputs(entry->text.c_str(), stdout);
+  }
+
+  // Queue the text without taking updateMutex, so that a print doesn't wait for a redraw that's
+  // in progress. Whoever holds the lock drains the queue before drawing the text, or else
+  // ProgressThreadLoop() picks it up.
+  PendingText* raw_entry = entry.release();
+  raw_entry->next = pending_text_.load(std::memory_order_relaxed);
+  while (!pending_text_.compare_exchange_weak(raw_entry->next, raw_entry,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed)) {
+  }
+
+  std::unique_lock<std::mutex> lock(updateMutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    progress_cv_.notify_all();
+    return;
+  }
+  if (DrainPendingText_locked()) {
+    // Nothing to redraw while the text isn't shown; ShowText() will redraw the whole screen. A
+    // redraw shortly after the previous one is left to ProgressThreadLoop(), so that a burst of
+    // prints costs one frame rather than one each.
+    if (!show_text) {
+      return;
+    }
+    if (now() - last_redraw_time_ < 1.0 / animation_fps_) {
+      text_dirty_ = true;
+      progress_cv_.notify_all();
+    } else {
+      update_screen_locked();
+    }
   }
 }
 
@@ -1325,17 +1576,9 @@ void ScreenRecoveryUI::PrintOnScreenOnly(const char* fmt, ...) {
   va_end(ap);
 }
 
-void ScreenRecoveryUI::PutChar(char ch) {
-  std::lock_guard<std::mutex> lg(updateMutex);
-  if (ch != '\n') text_[text_row_][text_col_++] = ch;
-  if (ch == '\n' || text_col_ >= text_cols_) {
-    text_col_ = 0;
-    ++text_row_;
-  }
-}
-
 void ScreenRecoveryUI::ClearText() {
   std::lock_guard<std::mutex> lg(updateMutex);
+  DrainPendingText_locked();
   text_col_ = 0;
   text_row_ = 0;
   for (size_t i = 0; i < text_rows_; ++i) {
@@ -1343,73 +1586,164 @@ void ScreenRecoveryUI::ClearText() {
   }
 }
 
-void ScreenRecoveryUI::ShowFile(FILE* fp) {
-  std::vector<off_t> offsets;
-  offsets.push_back(ftello(fp));
-  ClearText();
+FilePager::FilePager(size_t rows, size_t cols)
+    : rows_(std::max<size_t>(rows, 1)), cols_(std::max<size_t>(cols, 1)) {}
+
+FilePager::~FilePager() {
+  index_thread_stopped_ = true;
+  if (index_thread_.joinable()) {
+    index_thread_.join();
+  }
+}
 
+bool FilePager::Open(const std::string& filename) {
   struct stat sb;
-  fstat(fileno(fp), &sb);
+  if (stat(filename.c_str(), &sb) == -1) {
+    return false;
+  }
+  // There's nothing to map in an empty file, which still shows as an empty page.
+  if (sb.st_size > 0) {
+    map_ = std::make_unique<MemMapping>();
+    if (!map_->MapFile(filename)) {
+      return false;
+    }
+    data_ = reinterpret_cast<const char*>(map_->addr);
+    size_ = map_->length;
+    map_->Advise(0, size_, MADV_SEQUENTIAL);
+  }
+  pages_.push_back(0);
+  index_thread_ = std::thread(&FilePager::IndexThreadLoop, this);
+  return true;
+}
+
+void FilePager::IndexThreadLoop() {
+  size_t row = 0;
+  size_t col = 0;
+  for (size_t i = 0; i < size_ && !index_thread_stopped_; i++) {
+    if (data_[i] != '\n') ++col;
+    if (data_[i] == '\n' || col >= cols_) {
+      col = 0;
+      ++row;
+    }
+    // A page that fills up at the end of the file isn't followed by an empty one.
+    if (row == rows_ && i + 1 < size_) {
+      row = 0;
+      std::lock_guard<std::mutex> lock(mutex_);
+      pages_.push_back(i + 1);
+      cv_.notify_all();
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  indexed_ = true;
+  cv_.notify_all();
+}
+
+bool FilePager::HasPage(size_t page) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, page] { return page < pages_.size() || indexed_; });
+  return page < pages_.size();
+}
+
+size_t FilePager::PageCount() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return indexed_; });
+  return pages_.size();
+}
+
+size_t FilePager::PageEnd(size_t page) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // The page ends where the next one starts, which the indexing may not have got to yet.
+  cv_.wait(lock, [this, page] { return page + 1 < pages_.size() || indexed_; });
+  return page + 1 < pages_.size() ? pages_[page + 1] : size_;
+}
+
+std::string_view FilePager::GetPage(size_t page) {
+  size_t end = PageEnd(page);
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::string_view(data_ + pages_[page], end - pages_[page]);
+}
+
+void ScreenRecoveryUI::ShowPage(std::string_view page) {
+  std::lock_guard<std::mutex> lg(updateMutex);
+  DrainPendingText_locked();
+  for (size_t i = 0; i < text_rows_; ++i) {
+    memset(text_[i], 0, text_cols_ + 1);
+  }
+  // Wraps the lines the way FilePager does, with the page filling all the rows but the last.
+  size_t row = 0;
+  size_t col = 0;
+  for (char ch : page) {
+    if (row + 1 >= text_rows_) break;
+    if (ch != '\n') text_[row][col++] = ch;
+    if (ch == '\n' || col >= text_cols_) {
+      col = 0;
+      ++row;
+    }
+  }
+  text_col_ = 0;
+  text_row_ = text_rows_ > 0 ? text_rows_ - 1 : 0;
+}
 
-  bool show_prompt = false;
+void ScreenRecoveryUI::ShowPages(FilePager* pager) {
+  size_t page = 0;
+  bool redraw = true;
   while (true) {
-    if (show_prompt) {
+    if (redraw) {
+      ShowPage(pager->GetPage(page));
+      size_t end = pager->PageEnd(page);
       PrintOnScreenOnly("--(%d%% of %d bytes)--",
-                        static_cast<int>(100 * (double(ftello(fp)) / double(sb.st_size))),
-                        static_cast<int>(sb.st_size));
+                        pager->size() == 0
+                            ? 100
+                            : static_cast<int>(100 * (double(end) / double(pager->size()))),
+                        static_cast<int>(pager->size()));
       Redraw();
-      while (show_prompt) {
-        show_prompt = false;
-        InputEvent evt = WaitInputEvent();
-        if (evt.type() == EventType::EXTRA) {
-          if (evt.key() == static_cast<int>(KeyError::INTERRUPTED)) {
-            return;
-          }
-        }
-        if (evt.type() != EventType::KEY) {
-          show_prompt = true;
-          continue;
-        }
-        if (evt.key() == KEY_POWER || evt.key() == KEY_ENTER || evt.key() == KEY_BACKSPACE ||
-            evt.key() == KEY_BACK || evt.key() == KEY_HOME || evt.key() == KEY_HOMEPAGE) {
-          return;
-        } else if (evt.key() == KEY_UP || evt.key() == KEY_VOLUMEUP || evt.key() == KEY_SCROLLUP) {
-          if (offsets.size() <= 1) {
-            show_prompt = true;
-          } else {
-            offsets.pop_back();
-            fseek(fp, offsets.back(), SEEK_SET);
-          }
-        } else {
-          if (feof(fp)) {
-            return;
-          }
-          offsets.push_back(ftello(fp));
-        }
-      }
-      ClearText();
+      redraw = false;
     }
 
-    int ch = getc(fp);
-    if (ch == EOF) {
-      while (text_row_ < text_rows_ - 1) PutChar('\n');
-      show_prompt = true;
+    InputEvent evt = WaitInputEvent();
+    if (evt.type() == EventType::EXTRA) {
+      if (evt.key() == static_cast<int>(KeyError::INTERRUPTED)) {
+        return;
+      }
+    }
+    if (evt.type() != EventType::KEY) {
+      continue;
+    }
+    if (evt.key() == KEY_POWER || evt.key() == KEY_ENTER || evt.key() == KEY_BACKSPACE ||
+        evt.key() == KEY_BACK || evt.key() == KEY_HOME || evt.key() == KEY_HOMEPAGE) {
+      return;
+    } else if (evt.key() == KEY_UP || evt.key() == KEY_VOLUMEUP || evt.key() == KEY_SCROLLUP ||
+               evt.key() == KEY_PAGEUP) {
+      if (page > 0) {
+        --page;
+        redraw = true;
+      }
+    } else if (evt.key() == KEY_END) {
+      size_t last = pager->PageCount() - 1;
+      redraw = page != last;
+      page = last;
     } else {
-      PutChar(ch);
-      if (text_col_ == 0 && text_row_ >= text_rows_ - 1) {
-        show_prompt = true;
+      if (!pager->HasPage(page + 1)) {
+        return;
       }
+      ++page;
+      redraw = true;
     }
   }
 }
 
 void ScreenRecoveryUI::ShowFile(const std::string& filename) {
-  std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(filename.c_str(), "re"), fclose);
-  if (!fp) {
+  FilePager pager(text_rows_ > 0 ? text_rows_ - 1 : 0, text_cols_);
+  if (!pager.Open(filename)) {
     Print("  Unable to open %s: %s\n", filename.c_str(), strerror(errno));
     return;
   }
 
+  // Prints queued so far belong to the log, not the file viewer.
+  {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    DrainPendingText_locked();
+  }
   char** old_text = text_;
   size_t old_text_col = text_col_;
   size_t old_text_row = text_row_;
@@ -1418,7 +1752,7 @@ void ScreenRecoveryUI::ShowFile(const std::string& filename) {
   text_ = file_viewer_text_;
   ClearText();
 
-  ShowFile(fp.get());
+  ShowPages(&pager);
 
   text_ = old_text;
   text_col_ = old_text_col;
@@ -1698,6 +2032,7 @@ void ScreenRecoveryUI::ShowText(bool visible) {
   show_text = visible;
   if (show_text) show_text_ever = true;
   update_screen_locked();
+  progress_cv_.notify_all();
 }
 
 void ScreenRecoveryUI::Redraw() {
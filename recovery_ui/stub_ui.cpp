@@ -36,3 +36,61 @@ size_t StubRecoveryUI::ShowMenu(const std::vector<std::string>& /* headers */,
   }
   LOG(FATAL) << "Unreachable key selected in ShowMenu of stub UI";
 }
+
+void HeadlessRecoveryUI::SetBackground(Icon icon) {
+  static constexpr const char* kIconNames[] = { "none", "installing", "erasing", "no_command",
+                                                "error" };
+  if (icon >= NONE && icon <= ERROR) {
+    LOG(INFO) << "status: state " << kIconNames[icon];
+  }
+}
+
+void HeadlessRecoveryUI::SetSystemUpdateText(bool security_update) {
+  LOG(INFO) << "status: update " << (security_update ? "security" : "system");
+}
+
+void HeadlessRecoveryUI::SetProgressType(ProgressType type) {
+  std::lock_guard<std::mutex> lock(progress_lock_);
+  progress_type_ = type;
+  progress_scope_start_ = 0;
+  progress_scope_size_ = 0;
+  progress_ = 0;
+  reported_percent_ = -1;
+  if (type == DETERMINATE) {
+    ReportProgressLocked();
+  }
+}
+
+void HeadlessRecoveryUI::ShowProgress(float portion, float /* seconds */) {
+  std::lock_guard<std::mutex> lock(progress_lock_);
+  progress_type_ = DETERMINATE;
+  progress_scope_start_ += progress_scope_size_;
+  progress_scope_size_ = portion;
+  progress_ = 0;
+  ReportProgressLocked();
+}
+
+void HeadlessRecoveryUI::SetProgress(float fraction) {
+  std::lock_guard<std::mutex> lock(progress_lock_);
+  if (fraction < 0.0) fraction = 0.0;
+  if (fraction > 1.0) fraction = 1.0;
+  if (progress_type_ == DETERMINATE && fraction > progress_) {
+    progress_ = fraction;
+    ReportProgressLocked();
+  }
+}
+
+void HeadlessRecoveryUI::SetStage(int current, int max) {
+  if (current >= 0 && max > 0) {
+    LOG(INFO) << "status: stage " << current << "/" << max;
+  }
+}
+
+void HeadlessRecoveryUI::ReportProgressLocked() {
+  int percent = static_cast<int>((progress_scope_start_ + progress_ * progress_scope_size_) * 100);
+  if (percent > 100) percent = 100;
+  if (percent != reported_percent_) {
+    reported_percent_ = percent;
+    LOG(INFO) << "status: progress " << percent;
+  }
+}
@@ -97,11 +97,13 @@ RecoveryUI::RecoveryUI()
 }
 
 RecoveryUI::~RecoveryUI() {
-  ev_exit();
   input_thread_stopped_ = true;
+  // Wake up the input thread, which otherwise blocks until the next event.
+  ev_post([] {});
   if (input_thread_.joinable()) {
     input_thread_.join();
   }
+  ev_exit();
 }
 
 void RecoveryUI::OnTouchDeviceDetected(int fd) {
@@ -235,10 +237,13 @@ bool RecoveryUI::Init(const std::string& /* locale */) {
     LOG(INFO) << "Screensaver disabled";
   }
 
-  // Create a separate thread that handles input events.
-  input_thread_ = std::thread([this]() {
+  // Create a separate thread that handles input events, as well as the timers and tasks that
+  // other components add through ev_add_timer() and ev_post(). It only wakes up for those, or
+  // every 500ms if there's no way to wake it up for shutdown.
+  int timeout = ev_post([] {}) == 0 ? -1 : 500;
+  input_thread_ = std::thread([this, timeout]() {
     while (!this->input_thread_stopped_) {
-      if (!ev_wait(500)) {
+      if (!ev_wait(timeout)) {
         ev_dispatch();
       }
     }
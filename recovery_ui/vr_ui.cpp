@@ -26,6 +26,17 @@ VrRecoveryUI::VrRecoveryUI()
     : stereo_offset_(
           android::base::GetIntProperty("ro.recovery.ui.stereo_offset", kDefaultStereoOffset)) {}
 
+bool VrRecoveryUI::Init(const std::string& locale) {
+  if (!ScreenRecoveryUI::Init(locale)) {
+    return false;
+  }
+  // Everything gets drawn once, for the left eye, and copied to the right eye by gr_flip(). An
+  // element at x of an eye shows at x + stereo_offset_ on the left, and at
+  // x - stereo_offset_ + ScreenWidth() on the right.
+  gr_mirror(2 * stereo_offset_, ScreenWidth(), ScreenWidth());
+  return true;
+}
+
 int VrRecoveryUI::ScreenWidth() const {
   return gr_fb_width() / 2;
 }
@@ -37,36 +48,28 @@ int VrRecoveryUI::ScreenHeight() const {
 void VrRecoveryUI::DrawSurface(const GRSurface* surface, int sx, int sy, int w, int h, int dx,
                                int dy) const {
   gr_blit(surface, sx, sy, w, h, dx + stereo_offset_, dy);
-  gr_blit(surface, sx, sy, w, h, dx - stereo_offset_ + ScreenWidth(), dy);
 }
 
 void VrRecoveryUI::DrawTextIcon(int x, int y, const GRSurface* surface) const {
   gr_texticon(x + stereo_offset_, y, surface);
-  gr_texticon(x - stereo_offset_ + ScreenWidth(), y, surface);
 }
 
 int VrRecoveryUI::DrawTextLine(int x, int y, const std::string& line, bool bold) const {
   gr_text(gr_sys_font(), x + stereo_offset_, y, line.c_str(), bold);
-  gr_text(gr_sys_font(), x - stereo_offset_ + ScreenWidth(), y, line.c_str(), bold);
   return char_height_ + 4;
 }
 
 int VrRecoveryUI::DrawHorizontalRule(int y) const {
   y += 4;
   gr_fill(margin_width_ + stereo_offset_, y, ScreenWidth() - margin_width_ + stereo_offset_, y + 2);
-  gr_fill(ScreenWidth() + margin_width_ - stereo_offset_, y,
-          gr_fb_width() - margin_width_ - stereo_offset_, y + 2);
   return y + 4;
 }
 
 void VrRecoveryUI::DrawHighlightBar(int /* x */, int y, int /* width */, int height) const {
   gr_fill(margin_width_ + stereo_offset_, y, ScreenWidth() - margin_width_ + stereo_offset_,
           y + height);
-  gr_fill(ScreenWidth() + margin_width_ - stereo_offset_, y,
-          gr_fb_width() - margin_width_ - stereo_offset_, y + height);
 }
 
 void VrRecoveryUI::DrawFill(int x, int y, int w, int h) const {
   gr_fill(x + stereo_offset_, y, w, h);
-  gr_fill(x - stereo_offset_ + ScreenWidth(), y, w, h);
 }
@@ -93,7 +93,7 @@ bool WearRecoveryUI::Init(const std::string& locale) {
 // Should only be called with updateMutex locked.
 // TODO merge drawing routines with screen_ui
 void WearRecoveryUI::draw_background_locked() {
-  pagesIdentical = false;
+  pagesToRedraw = kGraphicsPages;
   gr_color(0, 0, 0, 255);
   gr_fill(0, 0, gr_fb_width(), gr_fb_height());
 
@@ -22,8 +22,10 @@
 #include <string.h>
 #include <sys/klog.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <map>
 #include <memory>
 #include <string>
 
@@ -44,6 +46,9 @@ constexpr const char* LOG_FILE = "/cache/recovery/log";
 constexpr const char* LAST_INSTALL_FILE = "/cache/recovery/last_install";
 constexpr const char* LAST_KMSG_FILE = "/cache/recovery/last_kmsg";
 constexpr const char* LAST_LOG_FILE = "/cache/recovery/last_log";
+constexpr const char* LAST_TRACE_FILE = "/cache/recovery/last_trace.json";
+constexpr const char* LAST_IO_TRACE_FILE = "/cache/recovery/last_io_trace";
+constexpr const char* LAST_STARTUP_TRACE_FILE = "/cache/recovery/last_startup_trace.json";
 
 constexpr const char* LAST_KMSG_FILTER = "recovery/last_kmsg";
 constexpr const char* LAST_LOG_FILTER = "recovery/last_log";
@@ -171,30 +176,44 @@ void copy_log_file_to_pmsg(const std::string& source, const std::string& destina
   __pmsg_write(destination, content);
 }
 
-// How much of the temp log we have copied to the copy in cache.
-static off_t tmplog_offset = 0;
+// How much of the temp log we have copied to each of its copies in cache.
+static std::map<std::string, off_t> tmplog_offsets;
 
 void reset_tmplog_offset() {
-  tmplog_offset = 0;
+  tmplog_offsets.clear();
 }
 
-static void copy_log_file(const std::string& source, const std::string& destination, bool append) {
+// Copies |source| to |destination|, either appending to it or replacing it. With |incremental|,
+// only the part of |source| that's new since the last copy is appended, which suits the temp log as
+// it only ever grows. A replaced destination is then only replaced the first time, and again if it
+// no longer holds the earlier copies (e.g. it's been removed).
+static void copy_log_file(const std::string& source, const std::string& destination, bool append,
+                          bool incremental = false) {
+  off_t offset = 0;
+  if (incremental) {
+    if (auto it = tmplog_offsets.find(destination); it != tmplog_offsets.end()) {
+      struct stat sb;
+      if (append || (stat(destination.c_str(), &sb) == 0 && sb.st_size == it->second)) {
+        offset = it->second;
+        append = true;
+      }
+    }
+  }
+
   FILE* dest_fp = fopen_path(destination, append ? "ae" : "we", logging_sehandle);
   if (dest_fp == nullptr) {
     PLOG(ERROR) << "Can't open " << destination;
   } else {
     FILE* source_fp = fopen(source.c_str(), "re");
     if (source_fp != nullptr) {
-      if (append) {
-        fseeko(source_fp, tmplog_offset, SEEK_SET);  // Since last write
-      }
+      fseeko(source_fp, offset, SEEK_SET);  // Since last write
       char buf[4096];
       size_t bytes;
       while ((bytes = fread(buf, 1, sizeof(buf), source_fp)) != 0) {
         fwrite(buf, 1, bytes, dest_fp);
       }
-      if (append) {
-        tmplog_offset = ftello(source_fp);
+      if (incremental) {
+        tmplog_offsets[destination] = ftello(source_fp);
       }
       check_and_fclose(source_fp, source);
     }
@@ -224,9 +243,22 @@ void copy_logs(bool save_current_log) {
   rotate_logs(LAST_LOG_FILE, LAST_KMSG_FILE);
 
   // Copy logs to cache so the system can find out what happened.
-  copy_log_file(Paths::Get().temporary_log_file(), LOG_FILE, true);
-  copy_log_file(Paths::Get().temporary_log_file(), LAST_LOG_FILE, false);
+  copy_log_file(Paths::Get().temporary_log_file(), LOG_FILE, true, true);
+  copy_log_file(Paths::Get().temporary_log_file(), LAST_LOG_FILE, false, true);
   copy_log_file(Paths::Get().temporary_install_file(), LAST_INSTALL_FILE, false);
+  // Only installs leave a trace behind.
+  if (access(Paths::Get().temporary_trace_file().c_str(), F_OK) == 0) {
+    copy_log_file(Paths::Get().temporary_trace_file(), LAST_TRACE_FILE, false);
+    chmod(LAST_TRACE_FILE, 0640);
+  }
+  if (access(Paths::Get().temporary_startup_trace_file().c_str(), F_OK) == 0) {
+    copy_log_file(Paths::Get().temporary_startup_trace_file(), LAST_STARTUP_TRACE_FILE, false);
+    chmod(LAST_STARTUP_TRACE_FILE, 0640);
+  }
+  if (access(Paths::Get().temporary_io_trace_file().c_str(), F_OK) == 0) {
+    copy_log_file(Paths::Get().temporary_io_trace_file(), LAST_IO_TRACE_FILE, false);
+    chmod(LAST_IO_TRACE_FILE, 0640);
+  }
   save_kernel_log(LAST_KMSG_FILE);
   chmod(LOG_FILE, 0600);
   chown(LOG_FILE, AID_SYSTEM, AID_SYSTEM);
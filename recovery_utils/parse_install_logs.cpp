@@ -33,6 +33,7 @@ constexpr const char* OTA_SIDELOAD_METRICS = "ota_sideload";
 // time_total: 101
 // bytes_written_vendor: 51074
 // bytes_stashed_vendor: 200
+// phase_cmd_bsdiff_wall_ms: 5310
 std::map<std::string, int64_t> ParseRecoveryUpdateMetrics(const std::vector<std::string>& lines) {
   constexpr unsigned int kMiB = 1024 * 1024;
   std::optional<int64_t> bytes_written_in_mib;
@@ -72,6 +73,8 @@ std::map<std::string, int64_t> ParseRecoveryUpdateMetrics(const std::vector<std:
       metrics.emplace("ota_non_ab_error_code", parsed_num);
     } else if (android::base::StartsWith(line, "cause")) {
       metrics.emplace("ota_non_ab_cause_code", parsed_num);
+    } else if (android::base::StartsWith(line, "phase_")) {
+      metrics.emplace("ota_" + line.substr(0, num_index), parsed_num);
     }
   }
 
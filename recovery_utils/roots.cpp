@@ -20,19 +20,31 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <sys/mount.h>
+#include <linux/fs.h>
+#include <endian.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <blkid/blkid.h>
 #include <ext4_utils/ext4_utils.h>
@@ -63,20 +75,114 @@ static Fstab fstab;
 
 constexpr const char* CACHE_ROOT = "/cache";
 
+// Runs |work| for 0 to |count| - 1, on up to |max_threads| threads including the calling one.
+static void RunInParallel(size_t count, size_t max_threads,
+                          const std::function<void(size_t)>& work) {
+  std::atomic<size_t> next{ 0 };
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      work(i);
+    }
+  };
+  size_t jobs = std::min<size_t>({ std::thread::hardware_concurrency(), max_threads, count });
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < jobs; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+}
+
+static constexpr size_t kMaxProbeThreads = 4;
+static constexpr size_t kMaxMountThreads = 4;
+
+// The filesystem types detected by block device, or "" where the detection failed, so that each
+// device is probed once. format_volume() drops the entry of the device that it formats.
+static std::mutex fs_type_cache_mutex;
+static std::map<std::string, std::string> fs_type_cache;
+
+// ext4 and f2fs, which the alternative fstab entries of a mount point pick between, both keep their
+// superblocks at 1KiB into the device.
+static constexpr off_t kSuperblockOffset = 1024;
+static constexpr uint32_t kF2fsMagic = 0xF2F52010;
+static constexpr size_t kExtMagicOffset = 0x38;
+static constexpr uint16_t kExtMagic = 0xEF53;
+static constexpr size_t kExtFeatureIncompatOffset = 0x60;
+// The incompatible features that only ext4 has: extents, 64bit and flex_bg.
+static constexpr uint32_t kExt4OnlyFeaturesIncompat = 0x0040 | 0x0080 | 0x0200;
+
+// Returns the filesystem type of |blk_device|, or "" if it can't be told. ext4 and f2fs are told
+// apart from a single read of the superblock; blkid, which probes for every type that it knows,
+// only gets asked about anything else.
+static std::string ProbeFsType(const std::string& blk_device) {
+  android::base::unique_fd fd(open(blk_device.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    return "";
+  }
+  uint8_t sb[1024];
+  if (android::base::ReadFullyAtOffset(fd, sb, sizeof(sb), kSuperblockOffset)) {
+    uint32_t f2fs_magic;
+    memcpy(&f2fs_magic, sb, sizeof(f2fs_magic));
+    if (le32toh(f2fs_magic) == kF2fsMagic) {
+      return "f2fs";
+    }
+    uint16_t ext_magic;
+    uint32_t ext_incompat;
+    memcpy(&ext_magic, sb + kExtMagicOffset, sizeof(ext_magic));
+    memcpy(&ext_incompat, sb + kExtFeatureIncompatOffset, sizeof(ext_incompat));
+    if (le16toh(ext_magic) == kExtMagic && (le32toh(ext_incompat) & kExt4OnlyFeaturesIncompat)) {
+      return "ext4";
+    }
+  }
+  fd.reset();
+
+  std::string fs_type;
+  if (char* detected_fs_type = blkid_get_tag_value(nullptr, "TYPE", blk_device.c_str())) {
+    fs_type = detected_fs_type;
+    free(detected_fs_type);
+  }
+  return fs_type;
+}
+
+static std::string DetectFsType(const std::string& blk_device) {
+  {
+    std::lock_guard<std::mutex> lock(fs_type_cache_mutex);
+    if (auto it = fs_type_cache.find(blk_device); it != fs_type_cache.end()) {
+      return it->second;
+    }
+  }
+  std::string fs_type = ProbeFsType(blk_device);
+  std::lock_guard<std::mutex> lock(fs_type_cache_mutex);
+  fs_type_cache.emplace(blk_device, fs_type);
+  return fs_type;
+}
+
+static bool HasAlternativeEntries(const std::string& mount_point) {
+  return std::count_if(fstab.begin(), fstab.end(), [&mount_point](const FstabEntry& entry) {
+           return entry.mount_point == mount_point;
+         }) > 1;
+}
+
 FstabEntry* fstab_entry_for_mount_point_detect_fs(const std::string& path) {
   FstabEntry* found = android::fs_mgr::GetEntryForMountPoint(&fstab, path);
   if (found == nullptr) {
     return nullptr;
   }
+  // With a single entry there's nothing to pick, so don't probe.
+  if (!HasAlternativeEntries(path)) {
+    return found;
+  }
 
-  if (char* detected_fs_type = blkid_get_tag_value(nullptr, "TYPE", found->blk_device.c_str())) {
+  std::string detected_fs_type = DetectFsType(found->blk_device);
+  if (!detected_fs_type.empty()) {
     for (auto& entry : fstab) {
       if (entry.mount_point == path && entry.fs_type == detected_fs_type) {
         found = &entry;
         break;
       }
     }
-    free(detected_fs_type);
   }
 
   return found;
@@ -95,6 +201,17 @@ void load_volume_table() {
       .length = 0,
   });
 
+  // Probe the devices of the mount points with alternative entries up front, all at once.
+  std::vector<std::string> probe_devices;
+  for (const auto& entry : fstab) {
+    const FstabEntry* first = android::fs_mgr::GetEntryForMountPoint(&fstab, entry.mount_point);
+    if (first == &entry && HasAlternativeEntries(entry.mount_point)) {
+      probe_devices.push_back(entry.blk_device);
+    }
+  }
+  RunInParallel(probe_devices.size(), kMaxProbeThreads,
+                [&probe_devices](size_t i) { DetectFsType(probe_devices[i]); });
+
   Fstab fake_fstab;
   std::cout << "recovery filesystem table" << std::endl << "=========================" << std::endl;
   for (size_t i = 0; i < fstab.size(); ++i) {
@@ -183,6 +300,13 @@ static int exec_cmd(const std::vector<std::string>& args) {
   return WEXITSTATUS(status);
 }
 
+// Returns whether discarded blocks of the given device read back as zeroes.
+static bool discard_zeroes_data(const std::string& blk_device) {
+  android::base::unique_fd fd(open(blk_device.c_str(), O_RDONLY | O_CLOEXEC));
+  unsigned int zeroes = 0;
+  return fd != -1 && ioctl(fd.get(), BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0;
+}
+
 static int64_t get_file_size(int fd, uint64_t reserve_len) {
   struct stat buf;
   int ret = fstat(fd, &buf);
@@ -228,6 +352,10 @@ int format_volume(const std::string& volume, const std::string& directory) {
     LOG(ERROR) << "format_volume: fs_type \"" << v->fs_type << "\" unsupported";
     return -1;
   }
+  {
+    std::lock_guard<std::mutex> lock(fs_type_cache_mutex);
+    fs_type_cache.erase(v->blk_device);
+  }
 
   bool needs_casefold = false;
 
@@ -290,6 +418,13 @@ int format_volume(const std::string& volume, const std::string& directory) {
       mke2fs_args.push_back("extent");
     }
 
+    // mke2fs only honors the last -E, so all the extended options go in one. It discards the
+    // whole device first, and leaves zeroing the inode tables to the kernel after the first mount.
+    // The journal doesn't need zeroing either if the discard already did that.
+    std::vector<std::string> extended_opts = { "discard", "lazy_itable_init=1" };
+    if (discard_zeroes_data(v->blk_device)) {
+      extended_opts.push_back("lazy_journal_init=1");
+    }
     int raid_stride = v->logical_blk_size / kBlockSize;
     int raid_stripe_width = v->erase_blk_size / kBlockSize;
     // stride should be the max of 8KB and logical block size
@@ -297,10 +432,11 @@ int format_volume(const std::string& volume, const std::string& directory) {
       raid_stride = 8192 / kBlockSize;
     }
     if (v->erase_blk_size != 0 && v->logical_blk_size != 0) {
-      mke2fs_args.push_back("-E");
-      mke2fs_args.push_back(
+      extended_opts.push_back(
           android::base::StringPrintf("stride=%d,stripe-width=%d", raid_stride, raid_stripe_width));
     }
+    mke2fs_args.push_back("-E");
+    mke2fs_args.push_back(android::base::Join(extended_opts, ","));
     mke2fs_args.push_back(v->blk_device);
     if (length != 0) {
       mke2fs_args.push_back(std::to_string(length / kBlockSize));
@@ -374,25 +510,69 @@ int setup_install_mounts() {
     LOG(ERROR) << "can't set up install mounts: no fstab loaded";
     return -1;
   }
+
+  // Only the volumes that are mounted need unmounting, and /proc/mounts tells them all at once.
+  android::fs_mgr::Fstab mounted_fstab;
+  if (!android::fs_mgr::ReadFstabFromFile("/proc/mounts", &mounted_fstab)) {
+    LOG(ERROR) << "Failed to read /proc/mounts";
+    return -1;
+  }
+  std::set<std::string> mounted;
+  for (const auto& entry : mounted_fstab) {
+    mounted.insert(entry.mount_point);
+  }
+
+  struct MountTask {
+    std::string mount_point;
+    bool mount;
+  };
+  std::vector<MountTask> tasks;
+  std::set<std::string> seen;
   for (const FstabEntry& entry : fstab) {
-    // We don't want to do anything with "/".
-    if (entry.mount_point == "/") {
+    // We don't want to do anything with "/", or repeat the alternative entries of a mount point.
+    if (entry.mount_point == "/" || !seen.insert(entry.mount_point).second) {
       continue;
     }
+    bool mount = entry.mount_point == "/tmp" || entry.mount_point == "/cache";
+    if (!mount && mounted.count(entry.mount_point) == 0) {
+      continue;
+    }
+    tasks.push_back({ entry.mount_point, mount });
+  }
 
-    if (entry.mount_point == "/tmp" || entry.mount_point == "/cache") {
-      if (ensure_path_mounted(entry.mount_point) != 0) {
-        LOG(ERROR) << "Failed to mount " << entry.mount_point;
-        return -1;
-      }
-    } else {
-      if (ensure_path_unmounted(entry.mount_point) != 0) {
-        LOG(ERROR) << "Failed to unmount " << entry.mount_point;
-        return -1;
+  std::atomic<bool> failed{ false };
+  auto run = [&tasks, &failed](size_t i) {
+    const MountTask& task = tasks[i];
+    if (task.mount) {
+      if (ensure_path_mounted(task.mount_point) != 0) {
+        LOG(ERROR) << "Failed to mount " << task.mount_point;
+        failed = true;
       }
+    } else if (ensure_path_unmounted(task.mount_point) != 0) {
+      LOG(ERROR) << "Failed to unmount " << task.mount_point;
+      failed = true;
     }
+  };
+
+  // The volumes go concurrently, except for the nested ones (e.g. one mounted under another), which
+  // keep the fstab order once the others are done.
+  auto nested = [](const std::string& a, const std::string& b) {
+    return android::base::StartsWith(b, a + "/") || android::base::StartsWith(a, b + "/");
+  };
+  std::vector<size_t> independent;
+  std::vector<size_t> dependent;
+  for (size_t i = 0; i < tasks.size(); i++) {
+    bool has_nested = std::any_of(tasks.begin(), tasks.end(), [&](const MountTask& other) {
+      return nested(tasks[i].mount_point, other.mount_point);
+    });
+    (has_nested ? dependent : independent).push_back(i);
   }
-  return 0;
+  RunInParallel(independent.size(), kMaxMountThreads,
+                [&](size_t i) { run(independent[i]); });
+  for (size_t i = 0; i < dependent.size() && !failed; i++) {
+    run(dependent[i]);
+  }
+  return failed ? -1 : 0;
 }
 
 bool HasCache() {
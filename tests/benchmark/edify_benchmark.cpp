@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks parsing and evaluating updater-scripts of 1000 to 20000 generated statements, in the
+// shapes that the OTA generator emits: the device and fingerprint asserts, getprop() checks
+// guarding abort(), ifelse() and if-then-else on the slot and the build type, and concatenations.
+// getprop() reads from a mock runtime, so the evaluation doesn't touch the device. The builtins and
+// the install functions are registered by main() in updater_benchmark.cpp.
+//
+// Besides the time and the script bytes per second, each run reports the allocations per
+// iteration, and peak_bytes, the most heap that an iteration had in use on top of what it started
+// with (e.g. the AST for the parse). They're counted by the global operator new and delete of the
+// benchmark binary, which count for every benchmark but are only looked at here.
+
+#include <malloc.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+
+#include "edify/expr.h"
+#include "updater/updater.h"
+#include "updater/updater_runtime.h"
+
+static std::atomic<uint64_t> allocations{ 0 };
+static std::atomic<int64_t> heap_bytes{ 0 };
+static std::atomic<int64_t> peak_heap_bytes{ 0 };
+
+void* operator new(size_t size) {
+  void* ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  int64_t bytes = heap_bytes.fetch_add(malloc_usable_size(ptr), std::memory_order_relaxed) +
+                  malloc_usable_size(ptr);
+  int64_t peak = peak_heap_bytes.load(std::memory_order_relaxed);
+  while (bytes > peak &&
+         !peak_heap_bytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  if (ptr == nullptr) return;
+  heap_bytes.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+  free(ptr);
+}
+
+// Collects the allocations of the iterations over the lifetime of the tracker.
+class HeapTracker {
+ public:
+  explicit HeapTracker(benchmark::State& state) : state_(state) {}
+
+  // Starts counting an iteration, to be followed by Stop().
+  void Start() {
+    start_allocations_ = allocations.load();
+    start_bytes_ = heap_bytes.load();
+    peak_heap_bytes = start_bytes_;
+  }
+
+  void Stop() {
+    total_allocations_ += allocations.load() - start_allocations_;
+    peak_bytes_ = std::max(peak_bytes_, peak_heap_bytes.load() - start_bytes_);
+  }
+
+  ~HeapTracker() {
+    double iterations = std::max<double>(1, state_.iterations());
+    state_.counters["allocs"] = total_allocations_ / iterations;
+    state_.counters["peak_bytes"] = peak_bytes_;
+  }
+
+ private:
+  benchmark::State& state_;
+  uint64_t start_allocations_{ 0 };
+  int64_t start_bytes_{ 0 };
+  uint64_t total_allocations_{ 0 };
+  int64_t peak_bytes_{ 0 };
+};
+
+static constexpr const char* kFingerprint =
+    "google/device/device:14/ABC1.234567.001/1234:user/release-keys";
+
+// Answers getprop() with the properties of the device that the scripts are generated for.
+class MockRuntime : public UpdaterRuntime {
+ public:
+  MockRuntime() : UpdaterRuntime(nullptr) {}
+
+  std::string GetProperty(const std::string_view key,
+                          const std::string_view default_value) const override {
+    auto it = properties_.find(std::string(key));
+    return it == properties_.end() ? std::string(default_value) : it->second;
+  }
+
+ private:
+  const std::map<std::string, std::string> properties_{
+    { "ro.boot.slot_suffix", "_a" },         { "ro.build.fingerprint", kFingerprint },
+    { "ro.build.product", "device" },        { "ro.debuggable", "0" },
+    { "ro.product.device", "device" },
+  };
+};
+
+// Returns an updater-script of |statements| statements, which all evaluate without aborting.
+static std::string GenerateScript(size_t statements) {
+  std::string script;
+  for (size_t i = 0; i < statements; i++) {
+    switch (i % 5) {
+      case 0:
+        script += R"(assert(getprop("ro.product.device") == "device" || )"
+                  R"(getprop("ro.build.product") == "device");)";
+        break;
+      case 1:
+        script += android::base::StringPrintf(
+            R"(getprop("ro.build.fingerprint") == "google/device/device:13/ABC1.%06zu/1:user/)"
+            R"(release-keys" || getprop("ro.build.fingerprint") == "%s" || abort("E3001: Package )"
+            R"(expects build fingerprint of %zu; this device has " + )"
+            R"(getprop("ro.build.fingerprint") + ".");)",
+            i, kFingerprint, i);
+        break;
+      case 2:
+        script += android::base::StringPrintf(
+            R"(ifelse(getprop("ro.boot.slot_suffix") == "_a", )"
+            R"(concat("/dev/block/by-name/system", "_a"), )"
+            R"(concat("/dev/block/by-name/system", "_b")) != "" || )"
+            R"(abort("E1001: Failed to find the block device %zu.");)",
+            i);
+        break;
+      case 3:
+        script += android::base::StringPrintf(
+            R"(if getprop("ro.debuggable") == "1" then concat("debug ", "%zu") )"
+            R"(else concat("user ", "%zu") endif;)",
+            i, i);
+        break;
+      case 4:
+        script += android::base::StringPrintf(
+            R"("apex/" + "com.android.module%zu" + ".apex" == concat("apex/com.android.module", )"
+            R"("%zu", ".apex") || abort("E1002: Mismatched path %zu.");)",
+            i, i, i);
+        break;
+    }
+    script += "\n";
+  }
+  return script;
+}
+
+// Args: the statements of the script.
+static void BM_EdifyParse(benchmark::State& state) {
+  std::string script = GenerateScript(state.range(0));
+  HeapTracker tracker(state);
+  for (auto _ : state) {
+    std::unique_ptr<Expr> root;
+    int error_count = 0;
+    tracker.Start();
+    int error = ParseString(script, &root, &error_count);
+    tracker.Stop();
+    if (error != 0 || error_count != 0) {
+      state.SkipWithError("Failed to parse the script");
+      break;
+    }
+    state.PauseTiming();
+    root.reset();
+    state.ResumeTiming();
+  }
+  state.SetBytesProcessed(state.iterations() * script.size());
+}
+
+// Args: the statements of the script.
+static void BM_EdifyEvaluate(benchmark::State& state) {
+  std::string script = GenerateScript(state.range(0));
+  std::unique_ptr<Expr> root;
+  int error_count = 0;
+  if (ParseString(script, &root, &error_count) != 0 || error_count != 0) {
+    state.SkipWithError("Failed to parse the script");
+    return;
+  }
+  Updater updater(std::make_unique<MockRuntime>());
+
+  HeapTracker tracker(state);
+  for (auto _ : state) {
+    State edify_state(script, &updater);
+    std::string result;
+    tracker.Start();
+    bool evaluated = Evaluate(&edify_state, root, &result);
+    tracker.Stop();
+    if (!evaluated) {
+      state.SkipWithError("Failed to evaluate the script");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * script.size());
+}
+
+BENCHMARK(BM_EdifyParse)->ArgName("statements")->Arg(1000)->Arg(5000)->Arg(20000);
+BENCHMARK(BM_EdifyEvaluate)->ArgName("statements")->Arg(1000)->Arg(5000)->Arg(20000);
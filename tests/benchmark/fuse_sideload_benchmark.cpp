@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks reading the package through run_fuse_sideload(), on top of emulated providers that
+// add the latency, bandwidth limit and jitter of the real transports to every round trip. Each run
+// reports the provider round trips and bytes, and the share of the reads that didn't need a round
+// trip of their own (i.e. were served from the block cache or the readahead).
+//
+// It needs /dev/fuse and the permission to mount, as the sideload tests do.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "fuse_provider.h"
+#include "fuse_sideload.h"
+
+static constexpr uint32_t kFuseBlockSize = 4096;
+static constexpr uint64_t kPackageSize = 64 * 1024 * 1024;
+
+// The cost of a round trip to the provider: the latency, plus the transfer at the bandwidth, plus
+// a uniformly distributed jitter.
+struct TransportProfile {
+  const char* name;
+  uint32_t latency_us;
+  uint32_t bandwidth_mbps;  // In MB/s.
+  uint32_t jitter_us;
+  bool concurrent_reads;
+};
+
+static constexpr TransportProfile kTransportProfiles[] = {
+  { "usb2_adb", 1000, 35, 500, false },
+  { "usb3_adb", 250, 200, 100, false },
+  { "sdcard", 1500, 40, 1000, true },
+  { "block_map", 100, 400, 50, true },
+};
+
+// The counters of the provider, which runs in the child process of run_fuse_sideload(); they live
+// in a shared mapping.
+struct ProviderStats {
+  std::atomic<uint64_t> round_trips;
+  std::atomic<uint64_t> bytes;
+};
+
+// Fills |buffer| with the content of the package at |offset|, a pattern that the readers can
+// check without keeping a copy.
+static void FillPackageData(uint8_t* buffer, size_t size, uint64_t offset) {
+  for (size_t i = 0; i < size; i++) {
+    uint64_t pos = offset + i;
+    buffer[i] = static_cast<uint8_t>((pos >> 12) * 31 + pos);
+  }
+}
+
+class EmulatedDataProvider : public FuseDataProvider {
+ public:
+  EmulatedDataProvider(const TransportProfile& profile, ProviderStats* stats)
+      : FuseDataProvider(kPackageSize, kFuseBlockSize), profile_(profile), stats_(stats) {}
+
+  bool ReadBlockAlignedData(uint8_t* buffer, uint32_t fetch_size,
+                            uint32_t start_block) const override {
+    static thread_local std::mt19937 rng(std::random_device{}());
+    std::uniform_int_distribution<uint32_t> jitter(0, profile_.jitter_us);
+    auto cost = std::chrono::microseconds(profile_.latency_us + jitter(rng) +
+                                          fetch_size / profile_.bandwidth_mbps);
+    auto deadline = std::chrono::steady_clock::now() + cost;
+
+    FillPackageData(buffer, fetch_size, static_cast<uint64_t>(start_block) * fuse_block_size_);
+    stats_->round_trips++;
+    stats_->bytes += fetch_size;
+    std::this_thread::sleep_until(deadline);
+    return true;
+  }
+
+  bool Valid() const override {
+    return true;
+  }
+
+  bool SupportsConcurrentReads() const override {
+    return profile_.concurrent_reads;
+  }
+
+ private:
+  const TransportProfile& profile_;
+  ProviderStats* stats_;
+};
+
+enum class AccessPattern {
+  kSequential,  // Streams the whole package, as verifying the signature does.
+  kZipSeeks,    // Finds the central directory at the end, then reads entries at random offsets.
+  kConcurrent,  // Streams the four quarters of the package on four threads.
+};
+
+static bool ReadAndCheck(int fd, uint64_t offset, size_t size, std::vector<uint8_t>* buffer,
+                         std::vector<uint8_t>* expected) {
+  buffer->resize(size);
+  expected->resize(size);
+  if (!android::base::ReadFullyAtOffset(fd, buffer->data(), size, offset)) {
+    PLOG(ERROR) << "Failed to read " << size << " bytes at " << offset;
+    return false;
+  }
+  FillPackageData(expected->data(), size, offset);
+  return *buffer == *expected;
+}
+
+// Reads [begin, end) of the package in 1MiB reads.
+static bool ReadSequentially(const std::string& package, uint64_t begin, uint64_t end) {
+  static constexpr size_t kReadSize = 1024 * 1024;
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+  std::vector<uint8_t> buffer;
+  std::vector<uint8_t> expected;
+  for (uint64_t offset = begin; offset < end; offset += kReadSize) {
+    size_t size = std::min<uint64_t>(kReadSize, end - offset);
+    if (fd == -1 || !ReadAndCheck(fd, offset, size, &buffer, &expected)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the bytes read from the package.
+static uint64_t RunAccessPattern(AccessPattern pattern, const std::string& package) {
+  switch (pattern) {
+    case AccessPattern::kSequential:
+      return ReadSequentially(package, 0, kPackageSize) ? kPackageSize : 0;
+
+    case AccessPattern::kZipSeeks: {
+      // The end of central directory record search, the central directory, then 64 entries that
+      // are 64KiB each, at fixed pseudo-random offsets.
+      static constexpr size_t kTailSize = 64 * 1024;
+      static constexpr size_t kCentralDirectorySize = 256 * 1024;
+      static constexpr size_t kEntries = 64;
+      static constexpr size_t kEntrySize = 64 * 1024;
+      android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+      std::vector<uint8_t> buffer;
+      std::vector<uint8_t> expected;
+      if (fd == -1 || !ReadAndCheck(fd, kPackageSize - kTailSize, kTailSize, &buffer, &expected) ||
+          !ReadAndCheck(fd, kPackageSize - kTailSize - kCentralDirectorySize,
+                        kCentralDirectorySize, &buffer, &expected)) {
+        return 0;
+      }
+      std::mt19937 rng(0);
+      std::uniform_int_distribution<uint64_t> offset(0, kPackageSize - kEntrySize);
+      for (size_t i = 0; i < kEntries; i++) {
+        if (!ReadAndCheck(fd, offset(rng), kEntrySize, &buffer, &expected)) {
+          return 0;
+        }
+      }
+      return kTailSize + kCentralDirectorySize + kEntries * kEntrySize;
+    }
+
+    case AccessPattern::kConcurrent: {
+      static constexpr size_t kReaders = 4;
+      std::atomic<bool> success{ true };
+      std::vector<std::thread> readers;
+      for (size_t i = 0; i < kReaders; i++) {
+        readers.emplace_back([&, i]() {
+          uint64_t begin = kPackageSize / kReaders * i;
+          if (!ReadSequentially(package, begin, begin + kPackageSize / kReaders)) {
+            success = false;
+          }
+        });
+      }
+      for (auto& reader : readers) {
+        reader.join();
+      }
+      return success ? kPackageSize : 0;
+    }
+  }
+  return 0;
+}
+
+// Serves the package with run_fuse_sideload() in a child process, and waits for it to show up
+// under |mount_point|. Returns the pid of the child, or -1 on errors.
+static pid_t StartFuseSideload(const TransportProfile& profile, ProviderStats* stats,
+                               const std::string& mount_point) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    auto provider = std::make_unique<EmulatedDataProvider>(profile, stats);
+    _exit(run_fuse_sideload(std::move(provider), mount_point.c_str()) == 0 ? EXIT_SUCCESS
+                                                                           : EXIT_FAILURE);
+  }
+  if (pid == -1) {
+    PLOG(ERROR) << "Failed to fork";
+    return -1;
+  }
+
+  std::string package = mount_point + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  for (size_t i = 0; i < 1000; i++) {
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      return pid;
+    }
+    int status;
+    if (waitpid(pid, &status, WNOHANG) != 0) {
+      LOG(ERROR) << "run_fuse_sideload() exited early";
+      return -1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  LOG(ERROR) << "Timed out waiting for the fuse-provided package";
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  return -1;
+}
+
+static bool StopFuseSideload(const std::string& mount_point, pid_t pid) {
+  std::string exit_flag = mount_point + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  struct stat sb;
+  stat(exit_flag.c_str(), &sb);
+  int status;
+  return TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+// Args: the transport (index into kTransportProfiles) and the AccessPattern.
+static void BM_FuseSideload(benchmark::State& state) {
+  const TransportProfile& profile = kTransportProfiles[state.range(0)];
+  auto pattern = static_cast<AccessPattern>(state.range(1));
+  state.SetLabel(profile.name);
+
+  void* mapping = mmap(nullptr, sizeof(ProviderStats), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    state.SkipWithError("Failed to map the provider stats");
+    return;
+  }
+  auto stats = new (mapping) ProviderStats{};
+
+  uint64_t round_trips = 0;
+  uint64_t provider_bytes = 0;
+  uint64_t read_bytes = 0;
+  for (auto _ : state) {
+    // Every iteration gets a fresh mount, so that the caches start out cold.
+    state.PauseTiming();
+    TemporaryDir mount_point;
+    stats->round_trips = 0;
+    stats->bytes = 0;
+    pid_t pid = StartFuseSideload(profile, stats, mount_point.path);
+    if (pid == -1) {
+      state.SkipWithError("Failed to start the fuse sideload");
+      break;
+    }
+    state.ResumeTiming();
+
+    uint64_t bytes = RunAccessPattern(
+        pattern, std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME);
+
+    state.PauseTiming();
+    round_trips += stats->round_trips;
+    provider_bytes += stats->bytes;
+    read_bytes += bytes;
+    bool stopped = StopFuseSideload(mount_point.path, pid);
+    state.ResumeTiming();
+    if (bytes == 0 || !stopped) {
+      state.SkipWithError("Failed to read the package through fuse");
+      break;
+    }
+  }
+
+  double iterations = std::max<double>(1, state.iterations());
+  state.SetBytesProcessed(read_bytes);
+  state.counters["round_trips"] = round_trips / iterations;
+  state.counters["provider_bytes"] = provider_bytes / iterations;
+  // Without any caching or readahead, every block read would take a round trip.
+  uint64_t block_reads = read_bytes / kFuseBlockSize;
+  double trips_per_block = block_reads == 0 ? 1 : static_cast<double>(round_trips) / block_reads;
+  state.counters["hit_rate"] = 1 - std::min<double>(1, trips_per_block);
+  munmap(mapping, sizeof(ProviderStats));
+}
+
+static void FuseSideloadArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({ "transport", "pattern" });
+  for (int64_t transport = 0; transport < static_cast<int64_t>(std::size(kTransportProfiles));
+       transport++) {
+    for (auto pattern :
+         { AccessPattern::kSequential, AccessPattern::kZipSeeks, AccessPattern::kConcurrent }) {
+      b->Args({ transport, static_cast<int64_t>(pattern) });
+    }
+  }
+}
+
+BENCHMARK(BM_FuseSideload)
+    ->Apply(FuseSideloadArgs)
+    ->Iterations(3)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks imgdiff and ApplyImagePatch() over a corpus of source / target pairs, in image mode,
+// zip mode, and zip mode split with a block limit. Each case reports the patch size and the peak
+// RSS next to the time; run with --benchmark_out=<file> --benchmark_out_format=json for the
+// results in a form that can be tracked over time.
+//
+// The corpus defaults to the pairs in testdata. --corpus=<dir> takes every pair of
+// <name>.src and <name>.tgt in <dir> instead, e.g. real APKs and boot images. The pairs that start
+// with a zip local file header run in the zip modes, and the others in image mode.
+// --block_limit=<blocks> sets the limit of the split mode, which defaults to a quarter of the
+// target.
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <applypatch/imgdiff.h>
+#include <applypatch/imgpatch.h>
+#include <benchmark/benchmark.h>
+
+#include "common/test_constants.h"
+
+using namespace std::string_literals;
+
+static constexpr size_t kBlockSize = 4096;
+
+enum class DiffMode {
+  kImage,
+  kZip,
+  kZipSplit,
+};
+
+struct CorpusPair {
+  std::string name;
+  std::string source_file;
+  std::string target_file;
+  std::string source;
+  std::string target;
+};
+
+static size_t block_limit_arg = 0;
+
+static bool IsZip(const std::string& content) {
+  return android::base::StartsWith(content, "PK\x03\x04");
+}
+
+static bool LoadPair(const std::string& name, const std::string& source_file,
+                     const std::string& target_file, std::vector<CorpusPair>* corpus) {
+  CorpusPair pair{ name, source_file, target_file, "", "" };
+  if (!android::base::ReadFileToString(source_file, &pair.source) ||
+      !android::base::ReadFileToString(target_file, &pair.target)) {
+    PLOG(ERROR) << "Failed to read " << name;
+    return false;
+  }
+  corpus->push_back(std::move(pair));
+  return true;
+}
+
+static bool LoadCorpus(const std::string& dir, std::vector<CorpusPair>* corpus) {
+  if (dir.empty()) {
+    return LoadPair("deflate", from_testdata_base("deflate_src.zip"),
+                    from_testdata_base("deflate_tgt.zip"), corpus) &&
+           LoadPair("gzipped", from_testdata_base("gzipped_source"),
+                    from_testdata_base("gzipped_target"), corpus);
+  }
+
+  std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir.c_str()), closedir);
+  if (!d) {
+    PLOG(ERROR) << "Failed to open " << dir;
+    return false;
+  }
+  std::vector<std::string> names;
+  while (dirent* de = readdir(d.get())) {
+    std::string_view file_name = de->d_name;
+    if (android::base::ConsumeSuffix(&file_name, ".src") &&
+        access((dir + "/" + std::string(file_name) + ".tgt").c_str(), R_OK) == 0) {
+      names.emplace_back(file_name);
+    }
+  }
+  std::sort(names.begin(), names.end());
+  for (const auto& name : names) {
+    std::string prefix = dir + "/" + name;
+    if (!LoadPair(name, prefix + ".src", prefix + ".tgt", corpus)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The outputs of a run of imgdiff. In the split mode, the pieces are in |debug_dir| as src-<i> and
+// patch-<i>.
+struct PatchFiles {
+  TemporaryFile patch;
+  TemporaryFile split_info;
+  TemporaryDir debug_dir;
+};
+
+static int GeneratePatch(const CorpusPair& pair, DiffMode mode, PatchFiles* files) {
+  std::vector<std::string> args{ "imgdiff" };
+  if (mode != DiffMode::kImage) {
+    args.emplace_back("-z");
+  }
+  if (mode == DiffMode::kZipSplit) {
+    size_t block_limit = block_limit_arg;
+    if (block_limit == 0) {
+      block_limit = std::max<size_t>(1, pair.target.size() / kBlockSize / 4);
+    }
+    args.push_back("--block-limit=" + std::to_string(block_limit));
+    args.push_back("--split-info="s + files->split_info.path);
+    args.push_back("--debug-dir="s + files->debug_dir.path);
+  }
+  args.push_back(pair.source_file);
+  args.push_back(pair.target_file);
+  args.push_back(files->patch.path);
+
+  std::vector<const char*> argv;
+  for (const auto& arg : args) {
+    argv.push_back(arg.c_str());
+  }
+  return imgdiff(argv.size(), argv.data());
+}
+
+// Applies the patch in |files|, and returns the size of the target or -1 on errors.
+static ssize_t ApplyPatch(const CorpusPair& pair, DiffMode mode, const PatchFiles& files) {
+  ssize_t target_size = 0;
+  auto apply = [&target_size](const std::string& source, const std::string& patch) {
+    return ApplyImagePatch(reinterpret_cast<const unsigned char*>(source.data()), source.size(),
+                           reinterpret_cast<const unsigned char*>(patch.data()), patch.size(),
+                           [&target_size](const unsigned char*, size_t len) {
+                             target_size += len;
+                             return len;
+                           });
+  };
+
+  if (mode != DiffMode::kZipSplit) {
+    std::string patch;
+    if (!android::base::ReadFileToString(files.patch.path, &patch) ||
+        apply(pair.source, patch) != 0) {
+      return -1;
+    }
+    return target_size;
+  }
+
+  for (size_t i = 0;; i++) {
+    std::string source;
+    std::string patch;
+    std::string prefix = files.debug_dir.path;
+    if (!android::base::ReadFileToString(prefix + "/src-" + std::to_string(i), &source)) {
+      return i == 0 ? -1 : target_size;
+    }
+    if (!android::base::ReadFileToString(prefix + "/patch-" + std::to_string(i), &patch) ||
+        apply(source, patch) != 0) {
+      return -1;
+    }
+  }
+}
+
+// Runs |fn| in a child process, and returns its peak RSS in KiB, or -1 if it fails. The benchmarks
+// themselves run in this process, whose peak covers all the cases so far. The child's peak starts
+// from what this process has resident at the fork, i.e. mostly the corpus.
+static long MeasurePeakRssKib(const std::function<bool()>& fn) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    PLOG(ERROR) << "Failed to fork";
+    return -1;
+  }
+  if (pid == 0) {
+    _exit(fn() ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  int status;
+  rusage usage;
+  if (TEMP_FAILURE_RETRY(wait4(pid, &status, 0, &usage)) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != EXIT_SUCCESS) {
+    return -1;
+  }
+  return usage.ru_maxrss;
+}
+
+static void BM_Imgdiff(benchmark::State& state, const CorpusPair* pair, DiffMode mode) {
+  PatchFiles files;
+  for (auto _ : state) {
+    if (GeneratePatch(*pair, mode, &files) != 0) {
+      state.SkipWithError("imgdiff failed");
+      return;
+    }
+  }
+
+  state.SetBytesProcessed(state.iterations() * pair->target.size());
+  state.counters["source_bytes"] = pair->source.size();
+  state.counters["target_bytes"] = pair->target.size();
+  std::string patch;
+  if (android::base::ReadFileToString(files.patch.path, &patch)) {
+    state.counters["patch_bytes"] = patch.size();
+  }
+  state.counters["peak_rss_kib"] = MeasurePeakRssKib([&]() {
+    PatchFiles child_files;
+    return GeneratePatch(*pair, mode, &child_files) == 0;
+  });
+}
+
+static void BM_Imgpatch(benchmark::State& state, const CorpusPair* pair, DiffMode mode) {
+  PatchFiles files;
+  if (GeneratePatch(*pair, mode, &files) != 0) {
+    state.SkipWithError("imgdiff failed");
+    return;
+  }
+
+  for (auto _ : state) {
+    ssize_t target_size = ApplyPatch(*pair, mode, files);
+    if (target_size != static_cast<ssize_t>(pair->target.size())) {
+      state.SkipWithError("ApplyImagePatch failed");
+      return;
+    }
+  }
+
+  state.SetBytesProcessed(state.iterations() * pair->target.size());
+  state.counters["target_bytes"] = pair->target.size();
+  state.counters["peak_rss_kib"] =
+      MeasurePeakRssKib([&]() { return ApplyPatch(*pair, mode, files) >= 0; });
+}
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv, android::base::StderrLogger);
+  // imgdiff logs every chunk, which would dominate the output.
+  android::base::SetMinimumLogSeverity(android::base::WARNING);
+
+  // Take out the arguments of our own before benchmark::Initialize() sees them.
+  std::string corpus_dir;
+  int new_argc = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (android::base::ConsumePrefix(&arg, "--corpus=")) {
+      corpus_dir = arg;
+    } else if (android::base::ConsumePrefix(&arg, "--block_limit=")) {
+      if (!android::base::ParseUint(std::string(arg), &block_limit_arg)) {
+        LOG(ERROR) << "Invalid block limit: " << arg;
+        return 1;
+      }
+    } else {
+      argv[new_argc++] = argv[i];
+    }
+  }
+  argc = new_argc;
+
+  static std::vector<CorpusPair> corpus;
+  if (!LoadCorpus(corpus_dir, &corpus)) {
+    return 1;
+  }
+
+  for (const auto& pair : corpus) {
+    std::vector<std::pair<const char*, DiffMode>> modes{ { "image", DiffMode::kImage } };
+    if (IsZip(pair.source) && IsZip(pair.target)) {
+      modes = { { "zip", DiffMode::kZip }, { "zip_split", DiffMode::kZipSplit } };
+    }
+    for (const auto& [mode_name, mode] : modes) {
+      std::string suffix = "/" + pair.name + "/" + mode_name;
+      benchmark::RegisterBenchmark(("BM_Imgdiff" + suffix).c_str(), BM_Imgdiff, &pair, mode)
+          ->Unit(benchmark::kMillisecond);
+      benchmark::RegisterBenchmark(("BM_Imgpatch" + suffix).c_str(), BM_Imgpatch, &pair, mode)
+          ->Unit(benchmark::kMillisecond);
+    }
+  }
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
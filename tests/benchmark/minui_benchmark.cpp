@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks the minui drawing functions on an offscreen screen in memory (gr_init_offscreen()),
+// so that they can be measured without a display, in each PixelFormat and GRRotation. Each
+// benchmark reports the time_per_pixel of the pixels that each call covers; BM_DrawScreen, which
+// draws a whole ScreenRecoveryUI frame with a menu over a full log, reports the fps too.
+//
+// The font and the animation come from testdata; the other recovery images are missing, and their
+// parts of the frame aren't drawn. Note that gr_text() renders each line once into its text line
+// cache, so the repeated calls measure blending the cached line.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "common/test_constants.h"
+#include "minui/minui.h"
+#include "otautil/paths.h"
+#include "private/resources.h"
+#include "recovery_ui/screen_ui.h"
+
+static constexpr size_t kScreenWidth = 1080;
+static constexpr size_t kScreenHeight = 1920;
+
+static constexpr const char* kPixelFormatNames[] = { "UNKNOWN", "ABGR", "RGBX",
+                                                     "BGRA",    "ARGB", "RGBA" };
+static constexpr const char* kRotationNames[] = { "NONE", "RIGHT", "DOWN", "LEFT" };
+
+static const std::vector<std::string> kMenuHeaders{ "Android Recovery",
+                                                    "generic/device/device:14/ABC1.234567.001" };
+static const std::vector<std::string> kMenuItems{
+  "Reboot system now",      "Reboot to bootloader",      "Enter fastboot",
+  "Apply update from ADB",  "Apply update from SD card", "Wipe data/factory reset",
+  "Wipe cache partition",   "Mount /system",             "View recovery logs",
+  "Run graphics test",      "Run locale test",           "Power off",
+};
+
+// Sets up the offscreen screen for the format and the rotation in the first two args.
+class OffscreenGraphics {
+ public:
+  explicit OffscreenGraphics(benchmark::State& state) {
+    state.SetLabel(std::string(kPixelFormatNames[state.range(0)]) + "/" +
+                   kRotationNames[state.range(1)]);
+    res_set_resource_dir(from_testdata_base(""));
+    if (gr_init_offscreen(kScreenWidth, kScreenHeight, static_cast<PixelFormat>(state.range(0))) !=
+        0) {
+      state.SkipWithError("Failed to initialize the offscreen graphics");
+      return;
+    }
+    initialized_ = true;
+    gr_rotate(static_cast<GRRotation>(state.range(1)));
+  }
+
+  ~OffscreenGraphics() {
+    gr_exit();
+  }
+
+  bool initialized() const {
+    return initialized_;
+  }
+
+ private:
+  bool initialized_{ false };
+};
+
+// Reports the time per pixel, for the |pixels| that each iteration draws.
+static void SetPixelsPerIteration(benchmark::State& state, size_t pixels) {
+  state.counters["time_per_pixel"] =
+      benchmark::Counter(pixels, benchmark::Counter::kIsIterationInvariantRate |
+                                     benchmark::Counter::kInvert);
+}
+
+// Returns a surface of random pixels (or alpha values, for a |pixel_bytes| of 1).
+static std::unique_ptr<GRSurface> CreateRandomSurface(size_t width, size_t height,
+                                                      size_t pixel_bytes) {
+  auto surface = GRSurface::Create(width, height, width * pixel_bytes, pixel_bytes);
+  std::mt19937 rng(0);
+  for (size_t i = 0; i < surface->data_size(); i++) {
+    surface->data()[i] = static_cast<uint8_t>(rng());
+  }
+  return surface;
+}
+
+// Args: the format, the rotation, whether the line is a long one that spans the screen, and bold.
+static void BM_Text(benchmark::State& state) {
+  OffscreenGraphics graphics(state);
+  if (!graphics.initialized()) return;
+  const GRFont* font = gr_sys_font();
+  if (font == nullptr) {
+    state.SkipWithError("Failed to load the font");
+    return;
+  }
+
+  std::string text = "Reboot system now";
+  if (state.range(2)) {
+    text.clear();
+    for (int i = 0; i < gr_fb_width() / font->char_width; i++) {
+      text += static_cast<char>('!' + i % ('~' - '!' + 1));
+    }
+  }
+  bool bold = state.range(3) != 0;
+  gr_color(255, 255, 255, 255);
+  for (auto _ : state) {
+    gr_text(font, 0, 0, text.c_str(), bold);
+  }
+  SetPixelsPerIteration(state, gr_measure(font, text.c_str()) * font->char_height);
+}
+
+// Args: the format, the rotation, and the alpha of the color.
+static void BM_Fill(benchmark::State& state) {
+  OffscreenGraphics graphics(state);
+  if (!graphics.initialized()) return;
+
+  gr_color(0, 128, 255, state.range(2));
+  for (auto _ : state) {
+    gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+  }
+  SetPixelsPerIteration(state, gr_fb_width() * gr_fb_height());
+}
+
+// Args: the format and the rotation.
+static void BM_Blit(benchmark::State& state) {
+  OffscreenGraphics graphics(state);
+  if (!graphics.initialized()) return;
+
+  auto source = CreateRandomSurface(512, 512, 4);
+  for (auto _ : state) {
+    gr_blit(source.get(), 0, 0, source->width, source->height, 0, 0);
+  }
+  SetPixelsPerIteration(state, source->width * source->height);
+}
+
+// Args: the format and the rotation.
+static void BM_TextIcon(benchmark::State& state) {
+  OffscreenGraphics graphics(state);
+  if (!graphics.initialized()) return;
+
+  // The size of a localized text image, e.g. installing_text.
+  auto icon = CreateRandomSurface(800, 200, 1);
+  gr_color(255, 255, 255, 255);
+  for (auto _ : state) {
+    gr_texticon(0, 0, icon.get());
+  }
+  SetPixelsPerIteration(state, icon->width * icon->height);
+}
+
+class OffscreenScreenRecoveryUI : public ScreenRecoveryUI {
+ public:
+  OffscreenScreenRecoveryUI(PixelFormat format, GRRotation rotation)
+      : format_(format), rotation_(rotation) {}
+
+  // Shows the main menu over a log that fills the text buffer.
+  void SetUpFrame() {
+    ShowText(true);
+    for (size_t i = 0; i < 2 * text_rows_; i++) {
+      Print("[%6zu.%03zu] Verifying update package... %zu%%\n", i / 10, i % 10 * 100, i % 101);
+    }
+    std::lock_guard<std::mutex> lg(updateMutex);
+    DrainPendingText_locked();
+    menu_ = CreateMenu(kMenuHeaders, kMenuItems, 0);
+  }
+
+  void DrawScreen() {
+    std::lock_guard<std::mutex> lg(updateMutex);
+    draw_screen_locked();
+  }
+
+ protected:
+  bool InitGraphics() override {
+    if (gr_init_offscreen(kScreenWidth, kScreenHeight, format_) != 0) {
+      return false;
+    }
+    gr_rotate(rotation_);
+    return true;
+  }
+
+ private:
+  const PixelFormat format_;
+  const GRRotation rotation_;
+};
+
+// Args: the format and the rotation.
+static void BM_DrawScreen(benchmark::State& state) {
+  state.SetLabel(std::string(kPixelFormatNames[state.range(0)]) + "/" +
+                 kRotationNames[state.range(1)]);
+  std::string testdata_dir = from_testdata_base("");
+  Paths::Get().set_resource_dir(testdata_dir);
+  res_set_resource_dir(testdata_dir);
+
+  OffscreenScreenRecoveryUI ui(static_cast<PixelFormat>(state.range(0)),
+                               static_cast<GRRotation>(state.range(1)));
+  if (!ui.Init("en-US")) {
+    state.SkipWithError("Failed to initialize the UI");
+    return;
+  }
+  ui.SetUpFrame();
+  for (auto _ : state) {
+    ui.DrawScreen();
+  }
+  SetPixelsPerIteration(state, gr_fb_width() * gr_fb_height());
+  state.counters["fps"] = benchmark::Counter(1, benchmark::Counter::kIsIterationInvariantRate);
+}
+
+// Runs |b| in each format and rotation, followed by each of |extra_args|, if any.
+static void FormatAndRotationArgs(benchmark::internal::Benchmark* b,
+                                  const std::vector<std::vector<int64_t>>& extra_args = { {} }) {
+  for (int64_t format = 0; format < static_cast<int64_t>(std::size(kPixelFormatNames)); format++) {
+    for (int64_t rotation = 0; rotation < static_cast<int64_t>(std::size(kRotationNames));
+         rotation++) {
+      for (const auto& extra : extra_args) {
+        std::vector<int64_t> args{ format, rotation };
+        args.insert(args.end(), extra.begin(), extra.end());
+        b->Args(args);
+      }
+    }
+  }
+}
+
+static void TextArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({ "format", "rotation", "long", "bold" });
+  FormatAndRotationArgs(b, { { 0, 0 }, { 0, 1 }, { 1, 0 }, { 1, 1 } });
+}
+
+static void FillArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({ "format", "rotation", "alpha" });
+  FormatAndRotationArgs(b, { { 255 }, { 128 } });
+}
+
+static void SurfaceArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({ "format", "rotation" });
+  FormatAndRotationArgs(b);
+}
+
+BENCHMARK(BM_Text)->Apply(TextArgs);
+BENCHMARK(BM_Fill)->Apply(FillArgs);
+BENCHMARK(BM_Blit)->Apply(SurfaceArgs);
+BENCHMARK(BM_TextIcon)->Apply(SurfaceArgs);
+BENCHMARK(BM_DrawScreen)->Apply(SurfaceArgs)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks UpdateVerifier::ReadBlocks(), which holds up marking the boot successful, on
+// generated care maps that cover 7/8 of a partition image in 1 to 16384 extents. The image is a
+// file, read either directly or through a dm-delay device (on a loop device) that adds a fixed
+// latency to every request, like slow storage; dm-delay needs root. Each run sweeps one of the
+// threads, the read size or the I/O mode (O_DIRECT or buffered reads that drop the pages) at a
+// time, through the ro.update_verifier.* properties that the verifier reads.
+//
+// Each iteration verifies the whole care map with a cold page cache, and reports the throughput
+// of the cared blocks, boot_critical_time (the wall time of the verification) and the CPU time of
+// all the threads.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <libdm/dm.h>
+#include <libdm/loop_control.h>
+
+#include "otautil/rangeset.h"
+#include "update_verifier/update_verifier.h"
+
+using namespace std::chrono_literals;
+
+static constexpr size_t kBlockSize = 4096;
+static constexpr const char* kDelayDeviceName = "update_verifier_benchmark";
+
+// Reads the blocks of the partition with a verifier that only sees the given properties.
+class UpdateVerifierBenchmark {
+ public:
+  static bool ReadBlocks(const RangeSet& ranges, const std::string& device,
+                         const std::map<std::string, std::string>& properties) {
+    UpdateVerifier verifier;
+    verifier.set_property_reader([&properties](const std::string& id) {
+      auto it = properties.find(id);
+      return it == properties.end() ? "" : it->second;
+    });
+    return verifier.ReadBlocks({ { "system", ranges } }, { { "system", device } }, 0, nullptr,
+                               nullptr);
+  }
+};
+
+// The dm-delay target, which passes the reads on to |device| after |delay_ms|.
+class DmTargetDelay : public android::dm::DmTarget {
+ public:
+  DmTargetDelay(uint64_t start, uint64_t length, const std::string& device, uint32_t delay_ms)
+      : DmTarget(start, length), device_(device), delay_ms_(delay_ms) {}
+
+  std::string name() const override {
+    return "delay";
+  }
+
+ protected:
+  std::string GetParameterString() const override {
+    return device_ + " 0 " + std::to_string(delay_ms_);
+  }
+
+ private:
+  std::string device_;
+  uint32_t delay_ms_;
+};
+
+// A partition image of |size_mb| with data in every block, and the device to read it from.
+class PartitionImage {
+ public:
+  // Returns an empty string on success, or the reason otherwise.
+  std::string Create(size_t size_mb, uint32_t delay_ms) {
+    struct statvfs vfs;
+    if (statvfs(image_.path, &vfs) == -1 ||
+        static_cast<uint64_t>(vfs.f_bavail) * vfs.f_frsize < (size_mb + 64) * 1024 * 1024) {
+      return "Not enough space for the image";
+    }
+    std::vector<uint8_t> buffer(1024 * 1024);
+    std::mt19937 rng(size_mb);
+    for (auto& b : buffer) {
+      b = static_cast<uint8_t>(rng());
+    }
+    for (size_t i = 0; i < size_mb; i++) {
+      if (!android::base::WriteFully(image_.fd, buffer.data(), buffer.size())) {
+        return "Failed to write the image";
+      }
+    }
+    fsync(image_.fd);
+    device_ = image_.path;
+    if (delay_ms == 0) {
+      return "";
+    }
+
+    loop_ = std::make_unique<android::dm::LoopDevice>(image_.fd, 10s);
+    if (!loop_->valid()) {
+      return "Failed to set up the loop device";
+    }
+    android::dm::DmTable table;
+    table.Emplace<DmTargetDelay>(0, size_mb * 2048, loop_->device(), delay_ms);
+    table.set_readonly(true);
+    auto& dm = android::dm::DeviceMapper::Instance();
+    dm.DeleteDeviceIfExists(kDelayDeviceName);
+    if (!dm.CreateDevice(kDelayDeviceName, table, &device_, 10s)) {
+      return "Failed to create the dm-delay device";
+    }
+    delay_device_ = true;
+    return "";
+  }
+
+  ~PartitionImage() {
+    if (delay_device_) {
+      android::dm::DeviceMapper::Instance().DeleteDevice(kDelayDeviceName);
+    }
+  }
+
+  // Drops the image from the page cache, under the dm device too.
+  void DropCaches() {
+    android::base::unique_fd fd(open(device_.c_str(), O_RDONLY));
+    if (fd != -1) {
+      posix_fadvise(fd.get(), 0, 0, POSIX_FADV_DONTNEED);
+    }
+    posix_fadvise(image_.fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+
+  const std::string& device() const {
+    return device_;
+  }
+
+ private:
+  TemporaryFile image_;
+  std::unique_ptr<android::dm::LoopDevice> loop_;
+  std::string device_;
+  bool delay_device_{ false };
+};
+
+// Returns the image of |size_mb| read with |delay_ms|, or nullptr with the reason in |error|. The
+// image is kept for the benchmarks that follow with the same one, as writing it takes a while.
+static PartitionImage* GetPartitionImage(size_t size_mb, uint32_t delay_ms, std::string* error) {
+  static std::unique_ptr<PartitionImage> image;
+  static std::pair<size_t, uint32_t> image_args;
+  if (image && image_args == std::make_pair(size_mb, delay_ms)) {
+    return image.get();
+  }
+  image.reset();
+  auto new_image = std::make_unique<PartitionImage>();
+  *error = new_image->Create(size_mb, delay_ms);
+  if (!error->empty()) {
+    return nullptr;
+  }
+  image = std::move(new_image);
+  image_args = { size_mb, delay_ms };
+  return image.get();
+}
+
+// Returns the care map of 7/8 of the |blocks| of a partition, in |extents| extents spread evenly
+// over it.
+static RangeSet CareMapRanges(size_t blocks, size_t extents) {
+  std::vector<std::pair<size_t, size_t>> ranges;
+  size_t stride = blocks / extents;
+  for (size_t i = 0; i < extents; i++) {
+    ranges.emplace_back(i * stride, i * stride + stride - stride / 8);
+  }
+  return RangeSet(std::move(ranges));
+}
+
+static uint64_t ProcessCpuMicros() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec +
+         usage.ru_stime.tv_usec;
+}
+
+// Args: the size of the partition in MiB, the extents of the care map, the threads, the size of
+// each read in KiB, whether to use O_DIRECT, and the latency that dm-delay adds (0 for none).
+static void BM_ReadBlocks(benchmark::State& state) {
+  size_t size_mb = state.range(0);
+  uint32_t delay_ms = state.range(5);
+  state.SetLabel(delay_ms == 0 ? "file" : android::base::StringPrintf("dm-delay %ums", delay_ms));
+
+  std::string error;
+  PartitionImage* image = GetPartitionImage(size_mb, delay_ms, &error);
+  if (image == nullptr) {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+  RangeSet ranges = CareMapRanges(size_mb * 1024 * 1024 / kBlockSize, state.range(1));
+  std::map<std::string, std::string> properties = {
+    { "ro.update_verifier.threads", std::to_string(state.range(2)) },
+    { "ro.update_verifier.read_kb", std::to_string(state.range(3)) },
+    { "ro.update_verifier.direct_io", state.range(4) ? "true" : "false" },
+  };
+
+  uint64_t cpu_micros = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    image->DropCaches();
+    uint64_t cpu_start = ProcessCpuMicros();
+    state.ResumeTiming();
+
+    bool read = UpdateVerifierBenchmark::ReadBlocks(ranges, image->device(), properties);
+
+    state.PauseTiming();
+    cpu_micros += ProcessCpuMicros() - cpu_start;
+    state.ResumeTiming();
+    if (!read) {
+      state.SkipWithError("Failed to read the blocks");
+      break;
+    }
+  }
+
+  double iterations = std::max<double>(1, state.iterations());
+  state.SetBytesProcessed(state.iterations() * ranges.blocks() * kBlockSize);
+  state.counters["boot_critical_time"] =
+      benchmark::Counter(1, benchmark::Counter::kIsIterationInvariantRate |
+                                benchmark::Counter::kInvert);
+  state.counters["cpu_ms"] = cpu_micros / 1000.0 / iterations;
+}
+
+static void ReadBlocksArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({ "size_mb", "extents", "threads", "read_kb", "direct", "delay_ms" });
+  // The defaults of update_verifier: 8 threads, reads of 4 MiB with O_DIRECT.
+  for (int64_t delay_ms : { 0, 2 }) {
+    for (int64_t threads : { 1, 2, 4, 8, 16, 32 }) {
+      b->Args({ 1024, 64, threads, 4096, 1, delay_ms });
+    }
+    for (int64_t read_kb : { 64, 256, 1024, 16384 }) {
+      b->Args({ 1024, 64, 8, read_kb, 1, delay_ms });
+    }
+    b->Args({ 1024, 64, 8, 4096, 0, delay_ms });
+    for (int64_t extents : { 1, 1024, 16384 }) {
+      b->Args({ 1024, extents, 8, 4096, 1, delay_ms });
+    }
+  }
+  for (int64_t size_mb : { 256, 4096 }) {
+    b->Args({ size_mb, 64, 8, 4096, 1, 0 });
+  }
+}
+
+BENCHMARK(BM_ReadBlocks)
+    ->Apply(ReadBlocksArgs)
+    ->Iterations(3)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
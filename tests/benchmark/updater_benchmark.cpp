@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks block_image_update() on synthetic transfer lists, which are generated with a given
+// mix of commands, fragmentation of the ranges, share of the sources going through the stash, and
+// amount of change in the bsdiff targets (i.e. the patch sizes).
+//
+// Besides the throughput, each run reports the read / write syscalls (from /proc/self/io), the
+// peak RSS, and the percentiles of the per-command latencies (from the updater trace).
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <benchmark/benchmark.h>
+#include <bsdiff/bsdiff.h>
+#include <openssl/sha.h>
+#include <ziparchive/zip_writer.h>
+
+#include "edify/expr.h"
+#include "otautil/paths.h"
+#include "otautil/print_sha1.h"
+#include "otautil/rangeset.h"
+#include "otautil/trace.h"
+#include "updater/blockimg.h"
+#include "updater/install.h"
+#include "updater/updater.h"
+#include "updater/updater_runtime.h"
+
+static constexpr size_t kBlockSize = 4096;
+// Each command writes 64 blocks (256KiB), and a transfer list has 128 commands. The image holds
+// the sources in its first half and the targets in its second half, so the sources stay intact
+// and every command can be generated independently.
+static constexpr size_t kCommandBlocks = 64;
+static constexpr size_t kCommands = 128;
+static constexpr size_t kHalfBlocks = kCommandBlocks * kCommands;
+
+// The share of each command kind in a transfer list, in percent.
+struct CommandMix {
+  int new_percent;
+  int move_percent;
+  int bsdiff_percent;
+  int zero_percent;
+};
+
+static constexpr CommandMix kCommandMixes[] = {
+  { 100, 0, 0, 0 },    // 0: new only.
+  { 0, 100, 0, 0 },    // 1: move only.
+  { 0, 0, 100, 0 },    // 2: bsdiff only.
+  { 25, 25, 40, 10 },  // 3: a mix close to the incremental OTAs.
+};
+
+struct SyntheticUpdate {
+  std::string image;  // The source image.
+  std::vector<std::string> transfer_list;
+  std::string new_data;
+  std::string patch_data;
+  size_t target_blocks = 0;
+};
+
+static std::string GetSha1(const std::string& content) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(content.data()), content.size(), digest);
+  return print_sha1(digest);
+}
+
+static std::string RandomBlocks(size_t blocks, std::mt19937* rng) {
+  std::string data(blocks * kBlockSize, '\0');
+  std::uniform_int_distribution<int> byte(0, 255);
+  for (auto& c : data) {
+    c = static_cast<char>(byte(*rng));
+  }
+  return data;
+}
+
+// Returns |fragments| ranges that take kCommandBlocks blocks in total, from the shuffled |slots| of
+// a half of the image that starts at |base|.
+static RangeSet TakeRanges(std::vector<size_t>* slots, size_t fragments, size_t base) {
+  size_t slot_blocks = kCommandBlocks / fragments;
+  std::vector<Range> ranges;
+  for (size_t i = 0; i < fragments; i++) {
+    size_t start = base + slots->back() * slot_blocks;
+    slots->pop_back();
+    ranges.emplace_back(start, start + slot_blocks);
+  }
+  return RangeSet(std::move(ranges));
+}
+
+static std::string ReadRanges(const std::string& image, const RangeSet& ranges) {
+  std::string data;
+  for (const auto& [begin, end] : ranges) {
+    data.append(image, begin * kBlockSize, (end - begin) * kBlockSize);
+  }
+  return data;
+}
+
+static SyntheticUpdate GenerateUpdate(const CommandMix& mix, size_t fragments, int stash_percent,
+                                      size_t changed_bytes_per_block) {
+  CHECK_EQ(0u, kCommandBlocks % fragments);
+  std::mt19937 rng(fragments * 1000 + stash_percent);
+
+  SyntheticUpdate update;
+  update.image = RandomBlocks(kHalfBlocks * 2, &rng);
+
+  size_t slot_count = kHalfBlocks / (kCommandBlocks / fragments);
+  std::vector<size_t> source_slots(slot_count);
+  for (size_t i = 0; i < slot_count; i++) {
+    source_slots[i] = i;
+  }
+  std::vector<size_t> target_slots = source_slots;
+  std::shuffle(source_slots.begin(), source_slots.end(), rng);
+  std::shuffle(target_slots.begin(), target_slots.end(), rng);
+
+  std::discrete_distribution<int> kind(
+      { static_cast<double>(mix.new_percent), static_cast<double>(mix.move_percent),
+        static_cast<double>(mix.bsdiff_percent), static_cast<double>(mix.zero_percent) });
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_int_distribution<size_t> offset(0, kBlockSize - 1);
+  std::uniform_int_distribution<int> byte(0, 255);
+
+  // All the stashes are saved upfront and stay alive until their use, which maximizes the stash
+  // pressure for the given share.
+  std::vector<std::string> stashes;
+  std::vector<std::string> commands;
+  std::string source_blocks = std::to_string(kCommandBlocks);
+  std::string stash_locs = RangeSet({ { 0, kCommandBlocks } }).ToString();
+  for (size_t i = 0; i < kCommands; i++) {
+    RangeSet target = TakeRanges(&target_slots, fragments, kHalfBlocks);
+    update.target_blocks += kCommandBlocks;
+    int command_kind = kind(rng);
+    if (command_kind == 0) {
+      commands.push_back("new " + target.ToString());
+      update.new_data += RandomBlocks(kCommandBlocks, &rng);
+      continue;
+    }
+    if (command_kind == 3) {
+      commands.push_back("zero " + target.ToString());
+      continue;
+    }
+
+    RangeSet source = TakeRanges(&source_slots, fragments, 0);
+    std::string source_data = ReadRanges(update.image, source);
+    std::string source_hash = GetSha1(source_data);
+    std::string source_arg = source_blocks + " " + source.ToString();
+    bool stashed = percent(rng) < stash_percent;
+    if (stashed) {
+      stashes.push_back("stash " + source_hash + " " + source.ToString());
+      source_arg = source_blocks + " - " + source_hash + ":" + stash_locs;
+    }
+
+    if (command_kind == 1) {
+      commands.push_back("move " + source_hash + " " + target.ToString() + " " + source_arg);
+    } else {
+      std::string target_data = source_data;
+      for (size_t block = 0; block < kCommandBlocks; block++) {
+        for (size_t j = 0; j < changed_bytes_per_block; j++) {
+          target_data[block * kBlockSize + offset(rng)] = static_cast<char>(byte(rng));
+        }
+      }
+      TemporaryFile patch_file;
+      CHECK_EQ(0, bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(source_data.data()),
+                                 source_data.size(),
+                                 reinterpret_cast<const uint8_t*>(target_data.data()),
+                                 target_data.size(), patch_file.path, nullptr));
+      std::string patch;
+      CHECK(android::base::ReadFileToString(patch_file.path, &patch));
+      commands.push_back(android::base::StringPrintf(
+          "bsdiff %zu %zu %s %s %s %s", update.patch_data.size(), patch.size(),
+          source_hash.c_str(), GetSha1(target_data).c_str(), target.ToString().c_str(),
+          source_arg.c_str()));
+      update.patch_data += patch;
+    }
+    if (stashed) {
+      commands.push_back("free " + source_hash);
+    }
+  }
+
+  update.transfer_list = {
+    "4",
+    std::to_string(update.target_blocks),
+    std::to_string(stashes.size()),
+    std::to_string(stashes.size() * kCommandBlocks),
+  };
+  update.transfer_list.insert(update.transfer_list.end(), stashes.begin(), stashes.end());
+  update.transfer_list.insert(update.transfer_list.end(), commands.begin(), commands.end());
+  return update;
+}
+
+static bool BuildUpdatePackage(const SyntheticUpdate& update, const std::string& image_file,
+                               int fd) {
+  std::string script = R"(block_image_update(")" + image_file +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  std::pair<const char*, std::string> entries[] = {
+    { "META-INF/com/google/android/updater-script", script },
+    { "transfer_list", android::base::Join(update.transfer_list, '\n') },
+    { "new_data", update.new_data },
+    { "patch_data", update.patch_data },
+  };
+
+  FILE* zip_file_ptr = fdopen(fd, "wb");
+  ZipWriter zip_writer(zip_file_ptr);
+  for (const auto& [name, content] : entries) {
+    // All the entries are written as STORED, as in the real packages.
+    if (zip_writer.StartEntry(name, 0) != 0 ||
+        (!content.empty() && zip_writer.WriteBytes(content.data(), content.size()) != 0) ||
+        zip_writer.FinishEntry() != 0) {
+      fclose(zip_file_ptr);
+      return false;
+    }
+  }
+  return zip_writer.Finish() == 0 && fclose(zip_file_ptr) == 0;
+}
+
+// Returns the read and write syscalls of the process so far, or zeros if the kernel doesn't do
+// task I/O accounting.
+static std::pair<uint64_t, uint64_t> GetSyscallCounts() {
+  std::string content;
+  std::pair<uint64_t, uint64_t> counts{ 0, 0 };
+  if (!android::base::ReadFileToString("/proc/self/io", &content)) {
+    return counts;
+  }
+  for (const auto& line : android::base::Split(content, "\n")) {
+    unsigned long long value;
+    if (sscanf(line.c_str(), "syscr: %llu", &value) == 1) {
+      counts.first = value;
+    } else if (sscanf(line.c_str(), "syscw: %llu", &value) == 1) {
+      counts.second = value;
+    }
+  }
+  return counts;
+}
+
+static double Percentile(std::vector<uint64_t>* values, double percentile) {
+  if (values->empty()) {
+    return 0;
+  }
+  size_t index = std::min(values->size() - 1, static_cast<size_t>(values->size() * percentile));
+  std::nth_element(values->begin(), values->begin() + index, values->end());
+  return (*values)[index];
+}
+
+// Args: command mix (index into kCommandMixes), ranges per command, share of the sources that go
+// through the stash in percent, and bytes changed per block in the bsdiff targets.
+static void BM_BlockImageUpdate(benchmark::State& state) {
+  const CommandMix& mix = kCommandMixes[state.range(0)];
+  SyntheticUpdate update =
+      GenerateUpdate(mix, state.range(1), state.range(2), static_cast<size_t>(state.range(3)));
+
+  TemporaryFile image_file;
+  TemporaryFile package_file;
+  if (!BuildUpdatePackage(update, image_file.path, package_file.release())) {
+    state.SkipWithError("Failed to build the update package");
+    return;
+  }
+
+  TemporaryDir stash_base;
+  TemporaryFile last_command;
+  TemporaryFile saved_source;
+  TemporaryFile trace_file;
+  Paths::Get().set_stash_directory_base(stash_base.path);
+  Paths::Get().set_last_command_file(last_command.path);
+  Paths::Get().set_cache_temp_source(saved_source.path);
+  Paths::Get().set_temporary_trace_file(trace_file.path);
+  std::string updated_marker =
+      std::string(stash_base.path) + "/" + GetSha1(image_file.path) + ".UPDATED";
+
+  uint64_t read_syscalls = 0;
+  uint64_t write_syscalls = 0;
+  std::vector<uint64_t> command_latencies;
+  for (auto _ : state) {
+    state.PauseTiming();
+    if (!android::base::WriteStringToFile(update.image, image_file.path) ||
+        !android::base::RemoveFileIfExists(last_command.path) ||
+        !android::base::RemoveFileIfExists(updated_marker)) {
+      state.SkipWithError("Failed to reset the image");
+      break;
+    }
+    Updater updater(std::make_unique<UpdaterRuntime>(nullptr));
+    TemporaryFile command_pipe;
+    if (!updater.Init(command_pipe.release(), package_file.path, false)) {
+      state.SkipWithError("Failed to initialize the updater");
+      break;
+    }
+    ClearTrace();
+    auto syscalls_before = GetSyscallCounts();
+    state.ResumeTiming();
+
+    bool success = updater.RunUpdate() && updater.GetResult() == "t";
+
+    state.PauseTiming();
+    auto syscalls_after = GetSyscallCounts();
+    read_syscalls += syscalls_after.first - syscalls_before.first;
+    write_syscalls += syscalls_after.second - syscalls_before.second;
+    auto latencies = GetTraceDurations(TraceEvent::kCommand);
+    command_latencies.insert(command_latencies.end(), latencies.begin(), latencies.end());
+    state.ResumeTiming();
+    if (!success) {
+      state.SkipWithError("block_image_update() failed");
+      break;
+    }
+  }
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double iterations = std::max<double>(1, state.iterations());
+  state.SetBytesProcessed(state.iterations() * update.target_blocks * kBlockSize);
+  state.counters["commands"] = update.transfer_list.size() - 4;
+  state.counters["patch_bytes"] = update.patch_data.size();
+  state.counters["read_syscalls"] = read_syscalls / iterations;
+  state.counters["write_syscalls"] = write_syscalls / iterations;
+  // ru_maxrss is in KiB, and covers the whole process, including the generation of the update.
+  state.counters["peak_rss_kib"] = usage.ru_maxrss;
+  state.counters["cmd_p50_us"] = Percentile(&command_latencies, 0.5) / 1000;
+  state.counters["cmd_p90_us"] = Percentile(&command_latencies, 0.9) / 1000;
+  state.counters["cmd_p99_us"] = Percentile(&command_latencies, 0.99) / 1000;
+  state.counters["cmd_max_us"] = Percentile(&command_latencies, 1.0) / 1000;
+}
+
+static void BlockImageUpdateArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({ "mix", "fragments", "stash_pct", "changed_bytes" });
+  for (int64_t mix = 0; mix < static_cast<int64_t>(std::size(kCommandMixes)); mix++) {
+    for (int64_t fragments : { 1, 8, 64 }) {
+      b->Args({ mix, fragments, 0, 16 });
+    }
+  }
+  // Stash pressure and patch sizes, on the mixed workload.
+  for (int64_t stash_percent : { 50, 100 }) {
+    b->Args({ 3, 8, stash_percent, 16 });
+  }
+  for (int64_t changed_bytes : { 0, 256, 4096 }) {
+    b->Args({ 2, 8, 0, changed_bytes });
+  }
+}
+
+BENCHMARK(BM_BlockImageUpdate)->Apply(BlockImageUpdateArgs)->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv, android::base::StderrLogger);
+  // The updater logs every command, which would dominate the output.
+  android::base::SetMinimumLogSeverity(android::base::WARNING);
+
+  RegisterBuiltins();
+  RegisterInstallFunctions();
+  RegisterBlockImageFunctions();
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
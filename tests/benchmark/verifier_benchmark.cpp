@@ -0,0 +1,524 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks verify_file() on whole-file signed packages, generated and signed with throwaway keys
+// (verify_file() only looks at the signature footer, not at the zip entries). Each iteration goes
+// from opening the package to the verdict.
+//
+// BM_VerifyFileStore covers the packages of 10MiB to 4GiB on each backing store: mapped or read
+// from a file on tmpfs, mapped through a block map of scattered extents, and read through the
+// sideload fuse, as the sdcard and adb installs do. The stores need the space for the package
+// (twice for the block map); the sizes that don't fit are skipped. The fuse needs /dev/fuse and
+// the permission to mount.
+//
+// BM_VerifyFileKeys covers key sets of 1 to 50 certificates, SHA-1 only, SHA-256 only or mixed, on
+// a 10MiB package in memory. The package is signed with the last key of the set, or with none of
+// them for the rejected verdict, which tries every key. Note that verify_file() tries the key that
+// verified the last package first, so the accepted verdicts after the first iteration don't go
+// through the other keys.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <openssl/bn.h>
+#include <openssl/nid.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+
+#include "fuse_provider.h"
+#include "fuse_sideload.h"
+#include "otautil/package.h"
+#include "otautil/verifier.h"
+
+static constexpr uint32_t kBlockSize = 4096;
+// The block map extents are this many blocks (256KiB), laid out in a shuffled order.
+static constexpr size_t kExtentBlocks = 64;
+static constexpr size_t kKeyBenchmarkPackageSize = 10 * MiB;
+
+enum class Store {
+  kMemory,    // A MemoryPackage mapping a file on tmpfs.
+  kFile,      // A FilePackage reading a file on tmpfs.
+  kBlockMap,  // A MemoryPackage mapping the extents of a block map.
+  kFuse,      // A FilePackage reading through the sideload fuse.
+};
+
+static const char* StoreName(Store store) {
+  switch (store) {
+    case Store::kMemory:
+      return "memory";
+    case Store::kFile:
+      return "file";
+    case Store::kBlockMap:
+      return "block_map";
+    case Store::kFuse:
+      return "fuse";
+  }
+  return "";
+}
+
+enum class KeySet {
+  kSha1,    // RSA keys with SHA-1.
+  kSha256,  // RSA keys with SHA-256.
+  kMixed,   // Alternating SHA-1 and SHA-256 keys, ending with a SHA-256 one.
+};
+
+static std::unique_ptr<RSA, RSADeleter> GenerateKey() {
+  std::unique_ptr<RSA, RSADeleter> rsa(RSA_new());
+  std::unique_ptr<BIGNUM, decltype(&BN_free)> exponent(BN_new(), BN_free);
+  CHECK(rsa && exponent && BN_set_word(exponent.get(), RSA_F4));
+  CHECK(RSA_generate_key_ex(rsa.get(), 2048, exponent.get(), nullptr));
+  return rsa;
+}
+
+// The key that signs the packages, and one that stands in for all the other keys of a set.
+static RSA* SignerKey() {
+  static RSA* key = GenerateKey().release();
+  return key;
+}
+
+static RSA* OtherKey() {
+  static RSA* key = GenerateKey().release();
+  return key;
+}
+
+static Certificate MakeCertificate(RSA* key, int hash_len) {
+  CHECK(RSA_up_ref(key));
+  return Certificate(hash_len, Certificate::KEY_TYPE_RSA, std::unique_ptr<RSA, RSADeleter>(key),
+                     nullptr);
+}
+
+// Returns the |count| certificates of |key_set|, with the signer last unless |signer| is false.
+static std::vector<Certificate> MakeKeySet(KeySet key_set, size_t count, bool signer) {
+  std::vector<Certificate> certs;
+  for (size_t i = 0; i < count; i++) {
+    int hash_len = SHA256_DIGEST_LENGTH;
+    if (key_set == KeySet::kSha1 || (key_set == KeySet::kMixed && (count - i) % 2 == 0)) {
+      hash_len = SHA_DIGEST_LENGTH;
+    }
+    certs.push_back(MakeCertificate(signer && i == count - 1 ? SignerKey() : OtherKey(), hash_len));
+  }
+  return certs;
+}
+
+// Returns the DER encoding of an element with |tag| and |content|.
+static std::string Der(uint8_t tag, const std::string& content) {
+  std::string length;
+  if (content.size() < 0x80) {
+    length.push_back(static_cast<char>(content.size()));
+  } else {
+    for (size_t size = content.size(); size > 0; size >>= 8) {
+      length.insert(length.begin(), static_cast<char>(size & 0xff));
+    }
+    length.insert(length.begin(), static_cast<char>(0x80 | length.size()));
+  }
+  return static_cast<char>(tag) + length + content;
+}
+
+// Wraps |signature| in the PKCS#7 SignedData that the signing tool puts in the archive comment,
+// with only the fields that verify_file() looks at filled in.
+static std::string WrapSignature(const std::string& signature) {
+  // 1.2.840.113549.1.7.2
+  static constexpr uint8_t kSignedDataOid[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7,
+                                                0x0d, 0x01, 0x07, 0x02 };
+  std::string version = Der(0x02, std::string(1, '\x01'));
+  std::string signer_info = Der(0x30, version + Der(0x30, "") + Der(0x30, "") + Der(0x30, "") +
+                                      Der(0x04, signature));
+  std::string signed_data = Der(0x30, version + Der(0x31, "") + Der(0x30, "") + Der(0xa0, "") +
+                                      Der(0x31, signer_info));
+  std::string oid(reinterpret_cast<const char*>(kSignedDataOid), sizeof(kSignedDataOid));
+  return Der(0x30, Der(0x06, oid) + Der(0xa0, signed_data));
+}
+
+// Fills |buffer| with the content of the package at |offset|.
+static void FillPackageData(uint8_t* buffer, size_t size, uint64_t offset) {
+  for (size_t i = 0; i < size; i++) {
+    uint64_t pos = offset + i;
+    buffer[i] = static_cast<uint8_t>((pos >> 12) * 31 + pos);
+  }
+}
+
+// Generates a package of |size| bytes, signed by SignerKey() with the digest of |hash_nid|, and
+// hands its content to |write| piece by piece. Returns false if |write| fails.
+template <typename WriteFunc>
+static bool GeneratePackage(uint64_t size, int hash_nid, WriteFunc&& write) {
+  // The archive comment is the signature, then the footer of "(signature start) $ff $ff (comment
+  // size)". Only the size of the signature needs to be known up front.
+  static constexpr size_t kEocdHeaderSize = 22;
+  static constexpr size_t kFooterSize = 6;
+  size_t comment_size =
+      WrapSignature(std::string(RSA_size(SignerKey()), '\0')).size() + kFooterSize;
+  CHECK_GT(size, kEocdHeaderSize + comment_size);
+  uint64_t data_size = size - kEocdHeaderSize - comment_size;
+
+  SHA_CTX sha1_ctx;
+  SHA256_CTX sha256_ctx;
+  SHA1_Init(&sha1_ctx);
+  SHA256_Init(&sha256_ctx);
+  std::vector<uint8_t> buffer(MiB);
+  for (uint64_t offset = 0; offset < data_size; offset += buffer.size()) {
+    size_t piece = std::min<uint64_t>(buffer.size(), data_size - offset);
+    FillPackageData(buffer.data(), piece, offset);
+    SHA1_Update(&sha1_ctx, buffer.data(), piece);
+    SHA256_Update(&sha256_ctx, buffer.data(), piece);
+    if (!write(buffer.data(), piece)) {
+      return false;
+    }
+  }
+
+  // The end of central directory record, of which everything but the comment size is signed.
+  std::string eocd = "PK\x05\x06" + std::string(16, '\0');
+  SHA1_Update(&sha1_ctx, eocd.data(), eocd.size());
+  SHA256_Update(&sha256_ctx, eocd.data(), eocd.size());
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  size_t digest_size = SHA256_DIGEST_LENGTH;
+  if (hash_nid == NID_sha1) {
+    SHA1_Final(digest, &sha1_ctx);
+    digest_size = SHA_DIGEST_LENGTH;
+  } else {
+    SHA256_Final(digest, &sha256_ctx);
+  }
+
+  std::string signature(RSA_size(SignerKey()), '\0');
+  unsigned int signature_size;
+  CHECK(RSA_sign(hash_nid, digest, digest_size, reinterpret_cast<uint8_t*>(signature.data()),
+                 &signature_size, SignerKey()));
+  std::string comment = WrapSignature(signature);
+  size_t signature_start = comment.size() + kFooterSize;
+  comment += { static_cast<char>(signature_start & 0xff), static_cast<char>(signature_start >> 8),
+               '\xff', '\xff', static_cast<char>(comment_size & 0xff),
+               static_cast<char>(comment_size >> 8) };
+  CHECK_EQ(comment_size, comment.size());
+  eocd += { static_cast<char>(comment_size & 0xff), static_cast<char>(comment_size >> 8) };
+  eocd += comment;
+  return write(reinterpret_cast<const uint8_t*>(eocd.data()), eocd.size());
+}
+
+// A package of a given size on a given store, which stays around for the runs of the same
+// arguments. The fuse store reads the package file through a fresh mount on every iteration.
+class StoredPackage {
+ public:
+  ~StoredPackage() {
+    Clear();
+  }
+
+  // Sets up the package of |size| bytes for |store|, if it isn't already. Returns false with
+  // |error| set if it can't be.
+  bool Prepare(Store store, uint64_t size, std::string* error);
+
+  // Returns the path to open the package from (the block map prefixed with '@' for the block map
+  // store), or for the fuse store the package that serves as the source of the fuse.
+  const std::string& path() const {
+    return path_;
+  }
+
+ private:
+  void Clear();
+  bool WriteFile(const std::string& path, uint64_t size);
+  bool WriteBlockMap(uint64_t size);
+
+  std::unique_ptr<TemporaryDir> dir_;
+  bool tmpfs_mounted_ = false;
+  Store store_ = Store::kMemory;
+  uint64_t size_ = 0;
+  std::string path_;
+};
+
+void StoredPackage::Clear() {
+  if (dir_) {
+    unlink((std::string(dir_->path) + "/package.zip").c_str());
+    unlink((std::string(dir_->path) + "/device").c_str());
+    unlink((std::string(dir_->path) + "/block.map").c_str());
+    if (tmpfs_mounted_) {
+      umount2(dir_->path, MNT_DETACH);
+    }
+  }
+  dir_.reset();
+  tmpfs_mounted_ = false;
+  size_ = 0;
+  path_.clear();
+}
+
+bool StoredPackage::WriteFile(const std::string& path, uint64_t size) {
+  android::base::unique_fd fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  return fd != -1 && GeneratePackage(size, NID_sha256, [&](const uint8_t* data, size_t length) {
+           return android::base::WriteFully(fd, data, length);
+         });
+}
+
+// Writes the package into the shuffled extents of a device file, and the block map of them.
+bool StoredPackage::WriteBlockMap(uint64_t size) {
+  std::string package = std::string(dir_->path) + "/package.zip";
+  std::string device = std::string(dir_->path) + "/device";
+  if (!WriteFile(package, size)) {
+    return false;
+  }
+  uint64_t blocks = (size + kBlockSize - 1) / kBlockSize;
+  size_t extents = (blocks + kExtentBlocks - 1) / kExtentBlocks;
+  std::vector<size_t> slots(extents);
+  std::iota(slots.begin(), slots.end(), 0);
+  std::shuffle(slots.begin(), slots.end(), std::mt19937(0));
+
+  android::base::unique_fd package_fd(open(package.c_str(), O_RDONLY | O_CLOEXEC));
+  android::base::unique_fd device_fd(
+      open(device.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  if (package_fd == -1 || device_fd == -1) {
+    return false;
+  }
+  std::string block_map = android::base::StringPrintf(
+      "%s\n%" PRIu64 " %u\n%zu\n", device.c_str(), size, kBlockSize, extents);
+  std::vector<uint8_t> buffer(kExtentBlocks * kBlockSize);
+  for (size_t i = 0; i < extents; i++) {
+    uint64_t first = i * kExtentBlocks;
+    uint64_t count = std::min<uint64_t>(kExtentBlocks, blocks - first);
+    std::fill(buffer.begin(), buffer.end(), 0);
+    size_t length = std::min<uint64_t>(count * kBlockSize, size - first * kBlockSize);
+    uint64_t start = slots[i] * kExtentBlocks;
+    if (!android::base::ReadFullyAtOffset(package_fd, buffer.data(), length, first * kBlockSize) ||
+        !android::base::WriteFullyAtOffset(device_fd, buffer.data(), count * kBlockSize,
+                                           start * kBlockSize)) {
+      return false;
+    }
+    block_map += android::base::StringPrintf("%" PRIu64 " %" PRIu64 "\n", start, start + count);
+  }
+  // Only the device holds the package from here on.
+  unlink(package.c_str());
+  path_ = std::string(dir_->path) + "/block.map";
+  if (!android::base::WriteStringToFile(block_map, path_)) {
+    return false;
+  }
+  path_ = "@" + path_;
+  return true;
+}
+
+bool StoredPackage::Prepare(Store store, uint64_t size, std::string* error) {
+  // The memory and file stores share the package file.
+  auto kind = [](Store s) { return s == Store::kBlockMap ? s : Store::kMemory; };
+  if (dir_ && size_ == size && kind(store_) == kind(store)) {
+    store_ = store;
+    return true;
+  }
+  Clear();
+
+  dir_ = std::make_unique<TemporaryDir>();
+  uint64_t needed = size * (store == Store::kBlockMap ? 2 : 1) + 64 * MiB;
+  std::string tmpfs_options = android::base::StringPrintf("size=%" PRIu64, needed);
+  tmpfs_mounted_ = mount("tmpfs", dir_->path, "tmpfs", 0, tmpfs_options.c_str()) == 0;
+  struct statvfs sb;
+  if (statvfs(dir_->path, &sb) != 0 ||
+      static_cast<uint64_t>(sb.f_bavail) * sb.f_frsize < needed) {
+    *error = "Not enough space for the package";
+    Clear();
+    return false;
+  }
+
+  store_ = store;
+  size_ = size;
+  path_ = std::string(dir_->path) + "/package.zip";
+  bool written = store == Store::kBlockMap ? WriteBlockMap(size) : WriteFile(path_, size);
+  if (!written) {
+    PLOG(ERROR) << "Failed to write the package";
+    *error = "Failed to write the package";
+    Clear();
+    return false;
+  }
+  if (!tmpfs_mounted_) {
+    LOG(WARNING) << "Failed to mount tmpfs; the package is on " << dir_->path << " instead";
+  }
+  return true;
+}
+
+// Serves |source| with run_fuse_sideload() in a child process, and waits for it to show up under
+// |mount_point|. Returns the pid of the child, or -1 on errors.
+static pid_t StartFuseSideload(const std::string& source, const std::string& mount_point) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    auto provider = FuseFileDataProvider::CreateFromFile(source, kBlockSize);
+    _exit(provider && run_fuse_sideload(std::move(provider), mount_point.c_str()) == 0
+              ? EXIT_SUCCESS
+              : EXIT_FAILURE);
+  }
+  if (pid == -1) {
+    PLOG(ERROR) << "Failed to fork";
+    return -1;
+  }
+
+  std::string package = mount_point + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  for (size_t i = 0; i < 1000; i++) {
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      return pid;
+    }
+    int status;
+    if (waitpid(pid, &status, WNOHANG) != 0) {
+      LOG(ERROR) << "run_fuse_sideload() exited early";
+      return -1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  LOG(ERROR) << "Timed out waiting for the fuse-provided package";
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  return -1;
+}
+
+static bool StopFuseSideload(const std::string& mount_point, pid_t pid) {
+  std::string exit_flag = mount_point + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  struct stat sb;
+  stat(exit_flag.c_str(), &sb);
+  int status;
+  return TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+// Args: the Store and the package size in MiB.
+static void BM_VerifyFileStore(benchmark::State& state) {
+  static StoredPackage stored_package;
+  auto store = static_cast<Store>(state.range(0));
+  uint64_t size = static_cast<uint64_t>(state.range(1)) * MiB;
+  state.SetLabel(StoreName(store));
+
+  std::string error;
+  if (!stored_package.Prepare(store, size, &error)) {
+    state.SkipWithError(error.c_str());
+    return;
+  }
+  std::vector<Certificate> keys = MakeKeySet(KeySet::kSha256, 1, true);
+
+  for (auto _ : state) {
+    std::unique_ptr<Package> package;
+    std::unique_ptr<TemporaryDir> mount_point;
+    pid_t pid = -1;
+    switch (store) {
+      case Store::kMemory:
+      case Store::kBlockMap:
+        package = Package::CreateMemoryPackage(stored_package.path(), nullptr);
+        break;
+      case Store::kFile:
+        package = Package::CreateFilePackage(stored_package.path(), nullptr);
+        break;
+      case Store::kFuse: {
+        // Every iteration gets a fresh mount, so that the caches start out cold.
+        state.PauseTiming();
+        mount_point = std::make_unique<TemporaryDir>();
+        pid = StartFuseSideload(stored_package.path(), mount_point->path);
+        state.ResumeTiming();
+        if (pid == -1) {
+          state.SkipWithError("Failed to start the fuse sideload");
+          return;
+        }
+        std::string fuse_path = std::string(mount_point->path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+        package = Package::CreateFilePackage(fuse_path, nullptr);
+        break;
+      }
+    }
+
+    int result = package ? verify_file(package.get(), keys) : VERIFY_FAILURE;
+
+    if (pid != -1) {
+      state.PauseTiming();
+      package.reset();
+      bool stopped = StopFuseSideload(mount_point->path, pid);
+      state.ResumeTiming();
+      if (!stopped) {
+        state.SkipWithError("Failed to stop the fuse sideload");
+        return;
+      }
+    }
+    if (result != VERIFY_SUCCESS) {
+      state.SkipWithError("Failed to verify the package");
+      return;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+
+static void VerifyFileStoreArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({ "store", "size_mb" });
+  // Grouped by size, so that the memory and file stores share the package.
+  for (int64_t size_mb : { 10, 100, 1024, 4096 }) {
+    for (auto store : { Store::kMemory, Store::kFile, Store::kBlockMap, Store::kFuse }) {
+      b->Args({ static_cast<int64_t>(store), size_mb });
+    }
+  }
+}
+
+BENCHMARK(BM_VerifyFileStore)
+    ->Apply(VerifyFileStoreArgs)
+    ->Iterations(3)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Args: the KeySet, the number of certificates and whether the package is signed by one of them.
+static void BM_VerifyFileKeys(benchmark::State& state) {
+  auto key_set = static_cast<KeySet>(state.range(0));
+  size_t count = state.range(1);
+  bool accepted = state.range(2) != 0;
+  static constexpr const char* kKeySetNames[] = { "sha1", "sha256", "mixed" };
+  state.SetLabel(kKeySetNames[state.range(0)]);
+
+  // The mixed key set ends with a SHA-256 key, and verifying it needs both digests.
+  std::vector<uint8_t> content;
+  content.reserve(kKeyBenchmarkPackageSize);
+  GeneratePackage(kKeyBenchmarkPackageSize, key_set == KeySet::kSha1 ? NID_sha1 : NID_sha256,
+                  [&](const uint8_t* data, size_t length) {
+                    content.insert(content.end(), data, data + length);
+                    return true;
+                  });
+  std::vector<Certificate> keys = MakeKeySet(key_set, count, accepted);
+
+  for (auto _ : state) {
+    auto package = Package::CreateMemoryPackage(content, nullptr);
+    int result = package ? verify_file(package.get(), keys) : VERIFY_FAILURE;
+    if (result != (accepted ? VERIFY_SUCCESS : VERIFY_FAILURE)) {
+      state.SkipWithError("Unexpected verdict");
+      return;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * kKeyBenchmarkPackageSize);
+}
+
+static void VerifyFileKeysArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({ "key_set", "certificates", "accepted" });
+  for (auto key_set : { KeySet::kSha1, KeySet::kSha256, KeySet::kMixed }) {
+    for (int64_t count : { 1, 2, 10, 50 }) {
+      for (int64_t accepted : { 1, 0 }) {
+        b->Args({ static_cast<int64_t>(key_set), count, accepted });
+      }
+    }
+  }
+}
+
+BENCHMARK(BM_VerifyFileKeys)->Apply(VerifyFileKeysArgs)->Unit(benchmark::kMillisecond);
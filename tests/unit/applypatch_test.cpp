@@ -32,6 +32,7 @@
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
@@ -104,6 +105,38 @@ TEST_F(ApplyPatchTest, CheckPartition_Mismatching) {
   ASSERT_FALSE(CheckPartition(Partition(source_file, source_size + 1, source_sha1)));
 }
 
+TEST_F(ApplyPatchTest, CheckPartitionWithRecord) {
+  TemporaryFile record_file;
+  Paths::Get().set_partition_check_record(record_file.path);
+  TemporaryFile copy_file;
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(source_file, &content));
+  ASSERT_TRUE(android::base::WriteStringToFile(content, copy_file.path));
+  Partition copy(copy_file.path, source_size, source_sha1);
+
+  // The first check reads it in full, and records the outcome.
+  ASSERT_TRUE(CheckPartitionWithRecord(copy));
+  std::string record;
+  ASSERT_TRUE(android::base::ReadFileToString(record_file.path, &record));
+  ASSERT_TRUE(android::base::StartsWith(record, copy_file.path + " "s));
+
+  // A change outside of the sampled blocks goes unnoticed until the next full check...
+  content[5000] ^= 0xff;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, copy_file.path));
+  ASSERT_FALSE(CheckPartition(copy));
+  ASSERT_TRUE(CheckPartitionWithRecord(copy));
+
+  // ... while one in a sampled block calls for a full check, which fails and drops the record.
+  content[0] ^= 0xff;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, copy_file.path));
+  ASSERT_FALSE(CheckPartitionWithRecord(copy));
+  ASSERT_TRUE(android::base::ReadFileToString(record_file.path, &record));
+  ASSERT_EQ("", record);
+
+  // A different expected hash isn't answered from the record either.
+  ASSERT_FALSE(CheckPartitionWithRecord(Partition(source_file, source_size, bad_sha1_a)));
+}
+
 TEST_F(ApplyPatchTest, PatchPartitionCheck) {
   ASSERT_TRUE(PatchPartitionCheck(target_partition, source_partition));
 
@@ -142,6 +175,7 @@ TEST_F(ApplyPatchTest, PatchPartition) {
   Value bonus(Value::Type::BLOB, std::string(bonus_fc.data.cbegin(), bonus_fc.data.cend()));
 
   ASSERT_TRUE(PatchPartition(target_partition, source_partition, patch, &bonus, false));
+  ASSERT_TRUE(CheckPartition(target_partition));
 }
 
 // Tests patching an eMMC target without a separate bonus file (i.e. recovery-from-boot patch has
@@ -152,6 +186,30 @@ TEST_F(ApplyPatchTest, PatchPartitionWithoutBonusFile) {
   Value patch(Value::Type::BLOB, std::string(patch_fc.data.cbegin(), patch_fc.data.cend()));
 
   ASSERT_TRUE(PatchPartition(target_partition, source_partition, patch, nullptr, false));
+  ASSERT_TRUE(CheckPartition(target_partition));
+}
+
+TEST_F(ApplyPatchTest, FlashPartition_DifferingBlocks) {
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(source_file, &content));
+
+  // Only some of the blocks differ from the source.
+  TemporaryFile partial_file;
+  std::string partial = content;
+  partial[0] ^= 0xff;
+  partial[5000] ^= 0xff;
+  partial[partial.size() - 1] ^= 0xff;
+  ASSERT_TRUE(android::base::WriteStringToFile(partial, partial_file.path));
+  Partition partial_partition(partial_file.path, source_size, source_sha1);
+  ASSERT_FALSE(CheckPartition(partial_partition));
+  ASSERT_TRUE(FlashPartition(partial_partition, source_file));
+  ASSERT_TRUE(CheckPartition(partial_partition));
+
+  // Past the end of the partition, nothing can be read to compare with.
+  TemporaryFile empty_file;
+  Partition empty_partition(empty_file.path, source_size, source_sha1);
+  ASSERT_TRUE(FlashPartition(empty_partition, source_file));
+  ASSERT_TRUE(CheckPartition(empty_partition));
 }
 
 class FreeCacheTest : public ::testing::Test {
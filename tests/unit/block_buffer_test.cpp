@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <gtest/gtest.h>
+
+#include "private/block_buffer.h"
+
+static bool IsAligned(const BlockBuffer& buffer) {
+  return reinterpret_cast<uintptr_t>(buffer.data()) % kBlockBufferAlignment == 0;
+}
+
+TEST(BlockBufferTest, Alignment) {
+  BlockBuffer buffer(1);
+  ASSERT_TRUE(IsAligned(buffer));
+
+  // Stays aligned as it grows.
+  for (size_t size : { 4096, 4097, 65536, 1048576 }) {
+    buffer.resize(size);
+    ASSERT_TRUE(IsAligned(buffer)) << size;
+  }
+
+  BlockBuffer copy(buffer);
+  ASSERT_TRUE(IsAligned(copy));
+  ASSERT_EQ(buffer, copy);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "private/block_io.h"
+
+class BlockIoTest : public ::testing::TestWithParam<BlockIo::Type> {
+ protected:
+  void SetUp() override {
+    io_ = BlockIo::Create(GetParam());
+    ASSERT_NE(nullptr, io_);
+    if (io_->type() != GetParam()) {
+      GTEST_LOG_(INFO) << "Falling back to synchronous block I/O";
+    }
+
+    for (size_t i = 0; i < 300; i++) {
+      content_ += std::string(4096, 'a' + i % 26);
+    }
+    ASSERT_TRUE(android::base::WriteStringToFile(content_, file_.path));
+  }
+
+  std::unique_ptr<BlockIo> io_;
+  TemporaryFile file_;
+  std::string content_;
+};
+
+TEST_P(BlockIoTest, Read) {
+  // More extents than the queue depth of the io_uring backend.
+  std::vector<Extent> extents;
+  std::string expected;
+  for (size_t i = 0; i < 150; i++) {
+    off64_t offset = 2 * i * 4096 + i;
+    extents.emplace_back(offset, 4096 + i);
+    expected += content_.substr(offset, 4096 + i);
+  }
+
+  std::vector<uint8_t> buffer(expected.size());
+  ASSERT_TRUE(io_->Read(file_.fd, extents, buffer.data()));
+  ASSERT_EQ(expected, std::string(buffer.cbegin(), buffer.cend()));
+}
+
+TEST_P(BlockIoTest, Read_PastEnd) {
+  std::vector<uint8_t> buffer(8192);
+  ASSERT_FALSE(io_->Read(file_.fd, { { content_.size() - 4096, 8192 } }, buffer.data()));
+}
+
+TEST_P(BlockIoTest, Read_AfterError) {
+  // A failed read among many in flight must not leave any of them to the next call.
+  std::vector<Extent> extents;
+  for (size_t i = 0; i < 150; i++) {
+    extents.emplace_back(i == 20 ? content_.size() : i * 4096, 4096);
+  }
+  std::vector<uint8_t> buffer(150 * 4096);
+  ASSERT_FALSE(io_->Read(file_.fd, extents, buffer.data()));
+
+  std::vector<uint8_t> small_buffer(8192);
+  ASSERT_TRUE(io_->Read(file_.fd, { { 4096, 8192 } }, small_buffer.data()));
+  ASSERT_EQ(content_.substr(4096, 8192), std::string(small_buffer.cbegin(), small_buffer.cend()));
+}
+
+TEST_P(BlockIoTest, Write) {
+  std::string data = std::string(4096, 'x') + std::string(8192, 'y') + std::string(10, 'z');
+  std::vector<Extent> extents{ { 8192, 4096 }, { 0, 8192 }, { 4096 * 300, 10 } };
+  ASSERT_TRUE(io_->Write(file_.fd, extents, reinterpret_cast<const uint8_t*>(data.data())));
+
+  std::string expected = std::string(8192, 'y') + std::string(4096, 'x') +
+                         content_.substr(3 * 4096) + std::string(10, 'z');
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(file_.path, &content));
+  ASSERT_EQ(expected, content);
+}
+
+TEST_P(BlockIoTest, Write_AfterError) {
+  // A failed write among many in flight must not leave any of them to land after the call.
+  std::vector<Extent> extents;
+  for (size_t i = 0; i < 150; i++) {
+    extents.emplace_back(i == 20 ? -8192 : static_cast<off64_t>(i) * 4096, 4096);
+  }
+  std::string data(150 * 4096, 'x');
+  ASSERT_FALSE(io_->Write(file_.fd, extents, reinterpret_cast<const uint8_t*>(data.data())));
+
+  // Neither the completions nor the entries of the failed call may count towards the next one.
+  extents[20].first = 20 * 4096;
+  std::string new_data(150 * 4096, 'y');
+  ASSERT_TRUE(io_->Write(file_.fd, extents, reinterpret_cast<const uint8_t*>(new_data.data())));
+  std::vector<uint8_t> buffer(new_data.size());
+  ASSERT_TRUE(io_->Read(file_.fd, { { 0, buffer.size() } }, buffer.data()));
+  ASSERT_EQ(new_data, std::string(buffer.cbegin(), buffer.cend()));
+}
+
+TEST_P(BlockIoTest, Write_BadFd) {
+  std::string data(4096, 'x');
+  ASSERT_FALSE(io_->Write(-1, { { 0, 4096 } }, reinterpret_cast<const uint8_t*>(data.data())));
+  ASSERT_EQ(EBADF, errno);
+}
+
+INSTANTIATE_TEST_CASE_P(BlockIoTest, BlockIoTest,
+                        ::testing::Values(BlockIo::Type::SYNC, BlockIo::Type::IO_URING));
+
+TEST(BlockIoTypeTest, ParseType) {
+  BlockIo::Type type;
+  ASSERT_TRUE(BlockIo::ParseType("sync", &type));
+  ASSERT_EQ(BlockIo::Type::SYNC, type);
+  ASSERT_TRUE(BlockIo::ParseType("io_uring", &type));
+  ASSERT_EQ(BlockIo::Type::IO_URING, type);
+  ASSERT_FALSE(BlockIo::ParseType("aio", &type));
+}
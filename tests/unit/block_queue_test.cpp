@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "private/block_queue.h"
+
+// Lays out a disk sda with the partition sda5, and dm-0 on top of sda5, the way sysfs does.
+class BlockQueueTunerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    base_ = dir_.path;
+    disk_ = base_ + "/sda";
+    partition_ = disk_ + "/sda5";
+    dm_ = base_ + "/dm-0";
+    for (const auto& dir : { disk_, disk_ + "/queue", partition_, dm_, dm_ + "/queue",
+                             dm_ + "/slaves" }) {
+      ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+    }
+    ASSERT_EQ(0, symlink("../../sda/sda5", (dm_ + "/slaves/sda5").c_str()));
+    SetSetting(disk_ + "/queue", "read_ahead_kb", "512");
+    SetSetting(disk_ + "/queue", "nr_requests", "64");
+    SetSetting(disk_ + "/queue", "scheduler", "mq-deadline kyber [bfq] none");
+    SetSetting(dm_ + "/queue", "read_ahead_kb", "128");
+  }
+
+  void SetSetting(const std::string& queue, const std::string& name, const std::string& value) {
+    ASSERT_TRUE(android::base::WriteStringToFile(value + "\n", queue + "/" + name));
+  }
+
+  std::string GetSetting(const std::string& queue, const std::string& name) {
+    std::string value;
+    EXPECT_TRUE(android::base::ReadFileToString(queue + "/" + name, &value));
+    return android::base::Trim(value);
+  }
+
+  TemporaryDir dir_;
+  std::string base_;
+  std::string disk_;
+  std::string partition_;
+  std::string dm_;
+};
+
+TEST_F(BlockQueueTunerTest, FindQueues) {
+  ASSERT_EQ(std::vector<std::string>{ disk_ + "/queue" }, BlockQueueTuner::FindQueues(disk_));
+  ASSERT_EQ(std::vector<std::string>{ disk_ + "/queue" },
+            BlockQueueTuner::FindQueues(partition_));
+  std::vector<std::string> dm_queues{ dm_ + "/queue", disk_ + "/queue" };
+  ASSERT_EQ(dm_queues, BlockQueueTuner::FindQueues(dm_));
+}
+
+TEST_F(BlockQueueTunerTest, ParseProfile) {
+  std::vector<BlockQueueTuner::Setting> profile;
+  ASSERT_TRUE(BlockQueueTuner::ParseProfile("read_ahead_kb=64,scheduler=none", &profile));
+  ASSERT_EQ(2u, profile.size());
+  ASSERT_EQ("scheduler", profile[1].name);
+  ASSERT_EQ("none", profile[1].value);
+
+  ASSERT_TRUE(BlockQueueTuner::ParseProfile("", &profile));
+  ASSERT_TRUE(profile.empty());
+  ASSERT_FALSE(BlockQueueTuner::ParseProfile("read_ahead_kb", &profile));
+  ASSERT_FALSE(BlockQueueTuner::ParseProfile("../../x=1", &profile));
+}
+
+TEST_F(BlockQueueTunerTest, TuneAndRestore) {
+  BlockQueueTuner tuner(base_);
+  tuner.SetProfile(BlockAccess::kSequential,
+                   { { "read_ahead_kb", "2048" }, { "scheduler", "none" }, { "missing", "1" } });
+  tuner.SetProfile(BlockAccess::kRandom, { { "read_ahead_kb", "64" }, { "nr_requests", "256" } });
+
+  std::vector<std::string> applied{ "block_queue_dm-0_read_ahead_kb: 2048",
+                                    "block_queue_sda_read_ahead_kb: 2048" };
+  ASSERT_EQ(applied, tuner.TuneDevice("/dev/block/system", dm_, BlockAccess::kSequential));
+  ASSERT_EQ("2048", GetSetting(dm_ + "/queue", "read_ahead_kb"));
+  ASSERT_EQ("none", GetSetting(disk_ + "/queue", "scheduler"));
+
+  // Switching profiles only reports the settings that are new.
+  applied = { "block_queue_sda_nr_requests: 256" };
+  ASSERT_EQ(applied, tuner.TuneDevice("/dev/block/system", dm_, BlockAccess::kRandom));
+  ASSERT_EQ("64", GetSetting(disk_ + "/queue", "read_ahead_kb"));
+
+  // The disk is shared with another device, and stays tuned until it's done too.
+  tuner.TuneDevice("/dev/block/vendor", partition_, BlockAccess::kSequential);
+  tuner.Restore("/dev/block/system");
+  ASSERT_EQ("128", GetSetting(dm_ + "/queue", "read_ahead_kb"));
+  ASSERT_EQ("2048", GetSetting(disk_ + "/queue", "read_ahead_kb"));
+
+  tuner.Restore("/dev/block/vendor");
+  ASSERT_EQ("512", GetSetting(disk_ + "/queue", "read_ahead_kb"));
+  ASSERT_EQ("64", GetSetting(disk_ + "/queue", "nr_requests"));
+  ASSERT_EQ("bfq", GetSetting(disk_ + "/queue", "scheduler"));
+}
+
+TEST_F(BlockQueueTunerTest, NotBlockDevice) {
+  BlockQueueTuner tuner(base_);
+  TemporaryFile file;
+  ASSERT_TRUE(tuner.Tune(file.path, BlockAccess::kSequential).empty());
+  tuner.Restore(file.path);
+  ASSERT_EQ("512", GetSetting(disk_ + "/queue", "read_ahead_kb"));
+}
@@ -118,3 +118,39 @@ TEST(BootloaderMessageTest, update_bootloader_message_recovery_options_long) {
   ASSERT_EQ(std::string(sizeof(boot.reserved), '\0'),
             std::string(boot.reserved, sizeof(boot.reserved)));
 }
+
+TEST(BootloaderMessageTest, MiscStore_staged_writes) {
+  TemporaryFile temp_misc;
+  std::string content(64 * 1024, 'a');
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_misc.path));
+
+  MiscStore store;
+  std::string err;
+  ASSERT_TRUE(store.Open(temp_misc.path, &err)) << err;
+  std::string buffer(8, '\0');
+  ASSERT_TRUE(store.Read(buffer.data(), buffer.size(), 100, &err)) << err;
+  ASSERT_EQ("aaaaaaaa", buffer);
+
+  // The writes are only visible through the store, until they're committed.
+  store.Write("bbbb", 4, 102);
+  store.Write("cc", 2, 20000);
+  store.Write("dd", 2, 104);
+  ASSERT_TRUE(store.Read(buffer.data(), buffer.size(), 100, &err)) << err;
+  ASSERT_EQ("aabbddaa", buffer);
+  // A read across what's staged, and what isn't loaded yet.
+  ASSERT_TRUE(store.Read(buffer.data(), buffer.size(), 19996, &err)) << err;
+  ASSERT_EQ("aaaaccaa", buffer);
+
+  std::string on_disk;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_misc.path, &on_disk));
+  ASSERT_EQ(content, on_disk);
+
+  ASSERT_TRUE(store.Commit(&err)) << err;
+  content.replace(102, 4, "bbdd");
+  content.replace(20000, 2, "cc");
+  ASSERT_TRUE(android::base::ReadFileToString(temp_misc.path, &on_disk));
+  ASSERT_EQ(content, on_disk);
+
+  // Reading past the end fails, as it did through the device.
+  ASSERT_FALSE(store.Read(buffer.data(), buffer.size(), content.size() - 4, &err));
+}
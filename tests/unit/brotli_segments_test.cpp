@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <brotli/encode.h>
+#include <gtest/gtest.h>
+
+#include "private/brotli_segments.h"
+
+// Compresses the |segments| independently, and appends the results to |data| and |index|.
+static void CompressSegments(const std::vector<std::string>& segments, std::string* data,
+                             std::string* index) {
+  *index = "1\n";
+  for (const auto& segment : segments) {
+    std::string compressed(BrotliEncoderMaxCompressedSize(segment.size()), '\0');
+    size_t compressed_size = compressed.size();
+    ASSERT_TRUE(BrotliEncoderCompress(
+        BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE, segment.size(),
+        reinterpret_cast<const uint8_t*>(segment.data()), &compressed_size,
+        reinterpret_cast<uint8_t*>(compressed.data())));
+    data->append(compressed, 0, compressed_size);
+    *index += android::base::StringPrintf("%zu %zu\n", compressed_size, segment.size());
+  }
+}
+
+TEST(BrotliSegmentsTest, ParseBrotliSegmentIndex) {
+  std::vector<CompressedSegment> segments;
+  std::string err;
+  ASSERT_TRUE(ParseBrotliSegmentIndex("1\n10 4096\n20 8192\n", 30, &segments, &err)) << err;
+  ASSERT_EQ(2u, segments.size());
+  ASSERT_EQ(0u, segments[0].offset);
+  ASSERT_EQ(10u, segments[0].compressed_size);
+  ASSERT_EQ(4096u, segments[0].size);
+  ASSERT_EQ(10u, segments[1].offset);
+  ASSERT_EQ(20u, segments[1].compressed_size);
+  ASSERT_EQ(8192u, segments[1].size);
+}
+
+TEST(BrotliSegmentsTest, ParseBrotliSegmentIndex_InvalidInput) {
+  std::vector<CompressedSegment> segments;
+  std::string err;
+  // Unknown version.
+  ASSERT_FALSE(ParseBrotliSegmentIndex("2\n10 4096\n", 10, &segments, &err));
+  // Malformed lines.
+  ASSERT_FALSE(ParseBrotliSegmentIndex("1\n10\n", 10, &segments, &err));
+  ASSERT_FALSE(ParseBrotliSegmentIndex("1\n10 abc\n", 10, &segments, &err));
+  ASSERT_FALSE(ParseBrotliSegmentIndex("1\n0 4096\n", 0, &segments, &err));
+  // Not adding up to the compressed size.
+  ASSERT_FALSE(ParseBrotliSegmentIndex("1\n10 4096\n", 11, &segments, &err));
+  ASSERT_FALSE(ParseBrotliSegmentIndex("1\n10 4096\n10 4096\n", 15, &segments, &err));
+}
+
+TEST(BrotliSegmentsTest, DecompressBrotliSegments) {
+  std::vector<std::string> segments;
+  std::string expected;
+  for (size_t i = 0; i < 20; i++) {
+    std::string segment;
+    for (size_t j = 0; j < 4096 * (i % 3 + 1); j++) {
+      segment += static_cast<char>('a' + (i * j) % 26);
+    }
+    segments.push_back(segment);
+    expected += segment;
+  }
+
+  std::string data;
+  std::string index;
+  CompressSegments(segments, &data, &index);
+  std::vector<CompressedSegment> parsed;
+  std::string err;
+  ASSERT_TRUE(ParseBrotliSegmentIndex(index, data.size(), &parsed, &err)) << err;
+
+  for (size_t threads : { 1, 3, 8 }) {
+    std::string result;
+    ASSERT_TRUE(DecompressBrotliSegments(reinterpret_cast<const uint8_t*>(data.data()), parsed,
+                                         threads, [&result](const uint8_t* data, size_t size) {
+                                           result.append(reinterpret_cast<const char*>(data), size);
+                                           return true;
+                                         }));
+    ASSERT_EQ(expected, result);
+  }
+}
+
+TEST(BrotliSegmentsTest, DecompressBrotliSegments_Failures) {
+  std::string data;
+  std::string index;
+  CompressSegments({ std::string(4096, 'a'), std::string(4096, 'b') }, &data, &index);
+  std::vector<CompressedSegment> segments;
+  std::string err;
+  ASSERT_TRUE(ParseBrotliSegmentIndex(index, data.size(), &segments, &err)) << err;
+
+  // The sink fails.
+  ASSERT_FALSE(DecompressBrotliSegments(reinterpret_cast<const uint8_t*>(data.data()), segments, 2,
+                                        [](const uint8_t*, size_t) { return false; }));
+
+  // Mismatching uncompressed size.
+  segments[1].size = 8192;
+  auto sink = [](const uint8_t*, size_t) { return true; };
+  ASSERT_FALSE(
+      DecompressBrotliSegments(reinterpret_cast<const uint8_t*>(data.data()), segments, 2, sink));
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <bzlib.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <brotli/encode.h>
+#include <bsdiff/bsdiff.h>
+#include <gtest/gtest.h>
+
+#include "applypatch/applypatch.h"
+
+// The compressor types of the BSDF2 streams.
+static constexpr char kNone = 0;
+static constexpr char kBz2 = 1;
+static constexpr char kBrotli = 2;
+
+struct Control {
+  int64_t diff_size;
+  int64_t extra_size;
+  int64_t seek;
+};
+
+static void AppendOfftin(int64_t value, std::string* out) {
+  uint64_t y = value < 0 ? -value : value;
+  for (int i = 0; i < 8; i++) {
+    uint8_t byte = y & 0xFF;
+    if (i == 7 && value < 0) byte |= 0x80;
+    out->push_back(static_cast<char>(byte));
+    y >>= 8;
+  }
+}
+
+static std::string Compress(char type, const std::string& data) {
+  if (type == kBz2) {
+    std::string out(data.size() * 1.01 + 600, '\0');
+    unsigned int out_size = out.size();
+    EXPECT_EQ(BZ_OK, BZ2_bzBuffToBuffCompress(out.data(), &out_size, const_cast<char*>(data.data()),
+                                              data.size(), 9, 0, 0));
+    out.resize(out_size);
+    return out;
+  }
+  if (type == kBrotli) {
+    size_t out_size = BrotliEncoderMaxCompressedSize(data.size());
+    std::string out(out_size, '\0');
+    EXPECT_TRUE(BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW,
+                                      BROTLI_DEFAULT_MODE, data.size(),
+                                      reinterpret_cast<const uint8_t*>(data.data()), &out_size,
+                                      reinterpret_cast<uint8_t*>(out.data())));
+    out.resize(out_size);
+    return out;
+  }
+  return data;
+}
+
+// Builds a BSDF2 patch of the given streams, or a BSDIFF40 one if |types| is empty.
+static std::string MakePatch(const std::string& types, const std::vector<Control>& controls,
+                             const std::string& diff, const std::string& extra, int64_t new_size) {
+  std::string ctrl;
+  for (const auto& control : controls) {
+    AppendOfftin(control.diff_size, &ctrl);
+    AppendOfftin(control.extra_size, &ctrl);
+    AppendOfftin(control.seek, &ctrl);
+  }
+  std::string streams_types = types.empty() ? std::string(3, kBz2) : types;
+  std::string compressed_ctrl = Compress(streams_types[0], ctrl);
+  std::string compressed_diff = Compress(streams_types[1], diff);
+  std::string patch = types.empty() ? "BSDIFF40" : "BSDF2" + types;
+  AppendOfftin(compressed_ctrl.size(), &patch);
+  AppendOfftin(compressed_diff.size(), &patch);
+  AppendOfftin(new_size, &patch);
+  return patch + compressed_ctrl + compressed_diff + Compress(streams_types[2], extra);
+}
+
+static int ApplyPatch(const std::string& old_data, const std::string& patch,
+                      std::string* new_data) {
+  new_data->clear();
+  return ApplyBSDiffPatchStreams(
+      reinterpret_cast<const unsigned char*>(old_data.data()), old_data.size(),
+      reinterpret_cast<const unsigned char*>(patch.data()), patch.size(),
+      [new_data](const unsigned char* data, size_t size) {
+        new_data->append(reinterpret_cast<const char*>(data), size);
+        return size;
+      });
+}
+
+static std::string RandomData(size_t size) {
+  std::string data(size, '\0');
+  std::generate(data.begin(), data.end(), []() { return static_cast<char>(rand() % 256); });
+  return data;
+}
+
+TEST(BSPatchStreamsTest, Formats) {
+  std::string old_data = RandomData(4096);
+  // Takes the old data at 100, then at 4000 running off the end of it, and then before the start.
+  std::vector<Control> controls = {
+    { 200, 10, 3700 },
+    { 1000, 0, -6000 },
+    { 300, 5000, 0 },
+  };
+  std::string diff = RandomData(1500);
+  std::string extra = RandomData(5010);
+  std::string expected;
+  for (size_t i = 0; i < 200; i++) expected += static_cast<char>(diff[i] + old_data[i]);
+  expected += extra.substr(0, 10);
+  for (size_t i = 0; i < 1000; i++) {
+    expected += static_cast<char>(diff[200 + i] + (3900 + i < 4096 ? old_data[3900 + i] : 0));
+  }
+  expected += diff.substr(1200, 300) + extra.substr(10);
+
+  for (const std::string& types :
+       { std::string(), std::string{ kBz2, kBz2, kBz2 }, std::string{ kBrotli, kBrotli, kBrotli },
+         std::string{ kNone, kNone, kNone }, std::string{ kNone, kBrotli, kBz2 } }) {
+    std::string patch = MakePatch(types, controls, diff, extra, expected.size());
+    std::string new_data;
+    ASSERT_EQ(0, ApplyPatch(old_data, patch, &new_data));
+    ASSERT_EQ(expected, new_data);
+  }
+}
+
+TEST(BSPatchStreamsTest, RoundTrip) {
+  std::string old_data = RandomData(3 * 1024 * 1024);
+  std::string new_data = old_data;
+  for (size_t i = 0; i < 2000; i++) {
+    new_data[rand() % new_data.size()] = static_cast<char>(rand() % 256);
+  }
+  new_data.insert(1024 * 1024, RandomData(70000));
+
+  TemporaryFile patch_file;
+  ASSERT_EQ(0, bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(old_data.data()), old_data.size(),
+                              reinterpret_cast<const uint8_t*>(new_data.data()), new_data.size(),
+                              patch_file.path, nullptr));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  std::string patched;
+  ASSERT_EQ(0, ApplyPatch(old_data, patch, &patched));
+  ASSERT_EQ(new_data, patched);
+}
+
+TEST(BSPatchStreamsTest, UnsupportedFormat) {
+  std::string new_data;
+  ASSERT_EQ(-1, ApplyPatch("old", "BSDIFF41" + std::string(24, '\0'), &new_data));
+  ASSERT_EQ(-1, ApplyPatch("old", "BSDF2\x01\x01\x03" + std::string(24, '\0'), &new_data));
+  // Too short.
+  ASSERT_EQ(-1, ApplyPatch("old", "BSDIFF40", &new_data));
+}
+
+TEST(BSPatchStreamsTest, CorruptPatch) {
+  std::string old_data = RandomData(4096);
+  std::string diff = RandomData(100);
+  std::string extra = RandomData(100);
+  std::string new_data;
+
+  for (const std::string& types : { std::string(), std::string{ kNone, kBrotli, kNone } }) {
+    // The control stream runs out.
+    ASSERT_EQ(2, ApplyPatch(old_data, MakePatch(types, { { 100, 50, 0 } }, diff, extra, 300),
+                            &new_data));
+    // The diff stream runs out.
+    ASSERT_EQ(2, ApplyPatch(old_data, MakePatch(types, { { 200, 0, 0 } }, diff, extra, 200),
+                            &new_data));
+    // A control entry past the end of the target.
+    ASSERT_EQ(2, ApplyPatch(old_data, MakePatch(types, { { 100, 100, 0 } }, diff, extra, 150),
+                            &new_data));
+    ASSERT_EQ(2, ApplyPatch(old_data, MakePatch(types, { { -1, 100, 0 } }, diff, extra, 99),
+                            &new_data));
+  }
+
+  // A truncated compressed stream, which ends before the data that's needed.
+  std::string patch =
+      MakePatch(std::string{ kNone, kNone, kBz2 }, { { 100, 100, 0 } }, diff, extra, 200);
+  patch.resize(patch.size() - 60);
+  ASSERT_EQ(2, ApplyPatch(old_data, patch, &new_data));
+}
+
+TEST(BSPatchStreamsTest, SinkFailure) {
+  std::string old_data = RandomData(4096);
+  std::string patch = MakePatch("", { { 4096, 0, 0 } }, std::string(4096, '\0'), "", 4096);
+  ASSERT_EQ(1, ApplyBSDiffPatchStreams(
+                   reinterpret_cast<const unsigned char*>(old_data.data()), old_data.size(),
+                   reinterpret_cast<const unsigned char*>(patch.data()), patch.size(),
+                   [](const unsigned char*, size_t) { return 0; }));
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <bsdiff/bsdiff.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "otautil/print_sha1.h"
+#include "otautil/rangeset.h"
+#include "private/command_pipeline.h"
+#include "private/commands.h"
+
+static std::string GetSha1(std::string_view content) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(content.data()), content.size(), digest);
+  return print_sha1(digest);
+}
+
+class CommandPipelineTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Block i is filled with the letter 'a' + i.
+    for (size_t i = 0; i < kBlocks; i++) {
+      image_ += std::string(kBlockSize, 'a' + i);
+    }
+    ASSERT_TRUE(android::base::WriteStringToFile(image_, image_file_.path));
+  }
+
+  TransferList ParseTransferList(const std::vector<std::string>& commands) {
+    std::vector<std::string> lines{ "4", "8", "0", "0" };
+    lines.insert(lines.end(), commands.cbegin(), commands.cend());
+    std::string err;
+    TransferList transfer_list = TransferList::Parse(android::base::Join(lines, '\n'), &err);
+    EXPECT_TRUE(static_cast<bool>(transfer_list)) << err;
+    return transfer_list;
+  }
+
+  std::string Blocks(size_t begin, size_t end) const {
+    return image_.substr(begin * kBlockSize, (end - begin) * kBlockSize);
+  }
+
+  // Generates the bsdiff patch that turns |source| into |target|.
+  static std::string GenerateBsdiff(const std::string& source, const std::string& target) {
+    TemporaryFile patch_file;
+    EXPECT_EQ(0, bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(source.data()), source.size(),
+                                reinterpret_cast<const uint8_t*>(target.data()), target.size(),
+                                patch_file.path, nullptr));
+    std::string patch;
+    EXPECT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+    return patch;
+  }
+
+  static constexpr size_t kBlockSize = 4096;
+  static constexpr size_t kBlocks = 8;
+
+  TemporaryFile image_file_;
+  std::string image_;
+};
+
+TEST_F(CommandPipelineTest, TakeSourceBlocks) {
+  TransferList transfer_list = ParseTransferList({
+      "move 1234 2,4,6 2 2,0,2",
+      "zero 2,6,7",
+      "stash 5678 4,2,3,7,8",
+  });
+  CommandPipeline pipeline(image_file_.fd, transfer_list, 1024 * 1024);
+  ASSERT_FALSE(pipeline.Plans(0));
+  ASSERT_TRUE(pipeline.Start());
+  ASSERT_TRUE(pipeline.Plans(0));
+  ASSERT_FALSE(pipeline.Plans(1));
+  ASSERT_TRUE(pipeline.Plans(2));
+
+  std::vector<uint8_t> buffer(2 * kBlockSize);
+  pipeline.Advance(0);
+  ASSERT_TRUE(pipeline.TakeSourceBlocks(0, RangeSet({ { 0, 2 } }), buffer.data()));
+  ASSERT_EQ(Blocks(0, 2), std::string(buffer.cbegin(), buffer.cend()));
+
+  pipeline.Advance(2);
+  ASSERT_TRUE(pipeline.TakeSourceBlocks(2, RangeSet({ { 2, 3 }, { 7, 8 } }), buffer.data()));
+  ASSERT_EQ(Blocks(2, 3) + Blocks(7, 8), std::string(buffer.cbegin(), buffer.cend()));
+
+  // The data can only be taken once.
+  ASSERT_FALSE(pipeline.TakeSourceBlocks(2, RangeSet({ { 2, 3 }, { 7, 8 } }), buffer.data()));
+  ASSERT_EQ(2u, pipeline.hits());
+}
+
+TEST_F(CommandPipelineTest, TakeSourceBlocks_MismatchingRanges) {
+  TransferList transfer_list = ParseTransferList({
+      "move 1234 2,4,6 2 2,0,2",
+  });
+  CommandPipeline pipeline(image_file_.fd, transfer_list, 1024 * 1024);
+  ASSERT_TRUE(pipeline.Start());
+
+  std::vector<uint8_t> buffer(2 * kBlockSize);
+  ASSERT_FALSE(pipeline.TakeSourceBlocks(0, RangeSet({ { 1, 3 } }), buffer.data()));
+  ASSERT_FALSE(pipeline.TakeSourceBlocks(1, RangeSet({ { 0, 2 } }), buffer.data()));
+  ASSERT_EQ(0u, pipeline.hits());
+  ASSERT_EQ(2u, pipeline.misses());
+}
+
+TEST_F(CommandPipelineTest, SkipSourcesWrittenByEarlierCommands) {
+  // The second command reads block 1, which is written by the first command. The pipeline must not
+  // read it ahead.
+  TransferList transfer_list = ParseTransferList({
+      "zero 2,1,2",
+      "move 1234 2,4,6 2 2,0,2",
+      "move 5678 2,6,8 2 2,2,4",
+  });
+  CommandPipeline pipeline(image_file_.fd, transfer_list, 1024 * 1024);
+  ASSERT_TRUE(pipeline.Start());
+
+  std::vector<uint8_t> buffer(2 * kBlockSize);
+  ASSERT_FALSE(pipeline.TakeSourceBlocks(1, RangeSet({ { 0, 2 } }), buffer.data()));
+  ASSERT_TRUE(pipeline.TakeSourceBlocks(2, RangeSet({ { 2, 4 } }), buffer.data()));
+  ASSERT_EQ(Blocks(2, 4), std::string(buffer.cbegin(), buffer.cend()));
+}
+
+TEST_F(CommandPipelineTest, Budget) {
+  TransferList transfer_list = ParseTransferList({
+      "move 1234 2,4,6 2 2,0,2",
+      "move 5678 2,6,8 2 2,2,4",
+  });
+
+  // Nothing fits into a budget of one block.
+  CommandPipeline small_pipeline(image_file_.fd, transfer_list, kBlockSize);
+  ASSERT_FALSE(small_pipeline.Start());
+
+  // A budget of two blocks can hold one command at a time; the second command gets read after the
+  // first one is consumed.
+  CommandPipeline pipeline(image_file_.fd, transfer_list, 2 * kBlockSize);
+  ASSERT_TRUE(pipeline.Start());
+  std::vector<uint8_t> buffer(2 * kBlockSize);
+  ASSERT_TRUE(pipeline.TakeSourceBlocks(0, RangeSet({ { 0, 2 } }), buffer.data()));
+  ASSERT_TRUE(pipeline.TakeSourceBlocks(1, RangeSet({ { 2, 4 } }), buffer.data()));
+  ASSERT_EQ(Blocks(2, 4), std::string(buffer.cbegin(), buffer.cend()));
+}
+
+TEST_F(CommandPipelineTest, TakePatchedBlocks) {
+  std::string source = Blocks(0, 2);
+  std::string target = Blocks(1, 2) + Blocks(0, 1);
+  std::string patch = GenerateBsdiff(source, target);
+  TransferList transfer_list = ParseTransferList({
+      android::base::StringPrintf("bsdiff 0 %zu %s %s 2,4,6 2 2,0,2", patch.size(),
+                                  GetSha1(source).c_str(), GetSha1(target).c_str()),
+  });
+  CommandPipeline pipeline(image_file_.fd, transfer_list, 1024 * 1024);
+  pipeline.EnablePatching(reinterpret_cast<const uint8_t*>(patch.data()), 2);
+  ASSERT_TRUE(pipeline.Start());
+
+  std::vector<uint8_t> buffer(2 * kBlockSize);
+  ASSERT_TRUE(pipeline.TakeSourceBlocks(0, RangeSet({ { 0, 2 } }), buffer.data()));
+  BlockBuffer output;
+  ASSERT_TRUE(pipeline.TakePatchedBlocks(0, &output));
+  ASSERT_EQ(target, std::string(output.cbegin(), output.cend()));
+  ASSERT_EQ(1u, pipeline.patched());
+
+  // The result can only be taken once.
+  ASSERT_FALSE(pipeline.TakePatchedBlocks(0, &output));
+}
+
+TEST_F(CommandPipelineTest, TakePatchedBlocks_HashMismatch) {
+  std::string source = Blocks(0, 2);
+  std::string target = Blocks(1, 2) + Blocks(0, 1);
+  std::string patch = GenerateBsdiff(source, target);
+  // Neither a source nor a target hash mismatch should produce a result.
+  TransferList transfer_list = ParseTransferList({
+      android::base::StringPrintf("bsdiff 0 %zu %s %s 2,4,6 2 2,0,2", patch.size(),
+                                  GetSha1(target).c_str(), GetSha1(target).c_str()),
+      android::base::StringPrintf("bsdiff 0 %zu %s %s 2,6,8 2 2,0,2", patch.size(),
+                                  GetSha1(source).c_str(), GetSha1(source).c_str()),
+  });
+  CommandPipeline pipeline(image_file_.fd, transfer_list, 1024 * 1024);
+  pipeline.EnablePatching(reinterpret_cast<const uint8_t*>(patch.data()), 2);
+  ASSERT_TRUE(pipeline.Start());
+
+  std::vector<uint8_t> buffer(2 * kBlockSize);
+  BlockBuffer output;
+  ASSERT_TRUE(pipeline.TakeSourceBlocks(0, RangeSet({ { 0, 2 } }), buffer.data()));
+  ASSERT_FALSE(pipeline.TakePatchedBlocks(0, &output));
+  ASSERT_TRUE(pipeline.TakeSourceBlocks(1, RangeSet({ { 0, 2 } }), buffer.data()));
+  ASSERT_FALSE(pipeline.TakePatchedBlocks(1, &output));
+  ASSERT_EQ(0u, pipeline.patched());
+}
+
+TEST_F(CommandPipelineTest, TakePatchedBlocks_NotEnabled) {
+  std::string source = Blocks(0, 2);
+  std::string target = Blocks(1, 2) + Blocks(0, 1);
+  std::string patch = GenerateBsdiff(source, target);
+  TransferList transfer_list = ParseTransferList({
+      android::base::StringPrintf("bsdiff 0 %zu %s %s 2,4,6 2 2,0,2", patch.size(),
+                                  GetSha1(source).c_str(), GetSha1(target).c_str()),
+  });
+  CommandPipeline pipeline(image_file_.fd, transfer_list, 1024 * 1024);
+  ASSERT_TRUE(pipeline.Start());
+
+  std::vector<uint8_t> buffer(2 * kBlockSize);
+  BlockBuffer output;
+  ASSERT_TRUE(pipeline.TakeSourceBlocks(0, RangeSet({ { 0, 2 } }), buffer.data()));
+  ASSERT_FALSE(pipeline.TakePatchedBlocks(0, &output));
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/parseint.h>
+#include <gtest/gtest.h>
+
+#include "private/command_stats.h"
+
+TEST(LatencyHistogramTest, Percentile) {
+  LatencyHistogram histogram;
+  ASSERT_EQ(0u, histogram.Percentile(50));
+
+  for (uint64_t i = 1; i <= 10000; i++) {
+    histogram.Record(i);
+  }
+  ASSERT_EQ(10000u, histogram.count());
+  ASSERT_EQ(10000u, histogram.max());
+  // Each value is known within 1/16th.
+  for (double percentile : { 1.0, 50.0, 90.0, 99.0 }) {
+    uint64_t expected = percentile * 100;
+    uint64_t value = histogram.Percentile(percentile);
+    ASSERT_LE(expected, value) << percentile;
+    ASSERT_GE(expected + expected / 16, value) << percentile;
+  }
+  ASSERT_EQ(10000u, histogram.Percentile(100));
+}
+
+TEST(LatencyHistogramTest, ToString) {
+  LatencyHistogram histogram;
+  histogram.Record(3);
+  histogram.Record(3);
+  histogram.Record(17);
+  histogram.Record(1000);
+  // 17 is in [16, 17], and 1000 in [992, 1023].
+  ASSERT_EQ("3:2 17:1 1023:1", histogram.ToString());
+  ASSERT_EQ(1000u, histogram.Percentile(100));
+}
+
+TEST(CommandStatsTest, SubPhases) {
+  CommandStats stats;
+  // Not attributed to any command.
+  { CommandStats::ScopedSubPhase read(CommandSubPhase::kRead); }
+  {
+    CommandStats::ScopedCommand command(&stats, Command::Type::BSDIFF);
+    CommandStats::ScopedSubPhase patch(CommandSubPhase::kPatch);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    CommandStats::ScopedSubPhase write(CommandSubPhase::kWrite);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  std::map<std::string, uint64_t> values;
+  for (const auto& line : stats.FormatForInstallLog("system")) {
+    size_t pos = line.find(": ");
+    ASSERT_NE(std::string::npos, pos) << line;
+    ASSERT_TRUE(android::base::ParseUint(line.substr(pos + 2), &values[line.substr(0, pos)]))
+        << line;
+  }
+  ASSERT_EQ(1u, values.at("latency_system_bsdiff_count"));
+  ASSERT_LE(25000u, values.at("latency_system_bsdiff_max_us"));
+  // Sleeping takes no CPU time.
+  ASSERT_GT(20u, values.at("latency_system_bsdiff_cpu_ms"));
+  ASSERT_EQ(0u, values.at("latency_system_bsdiff_read_ms"));
+  ASSERT_EQ(0u, values.at("latency_system_bsdiff_fsync_ms"));
+  // The write within the patch only counts as a write.
+  ASSERT_LE(5u, values.at("latency_system_bsdiff_patch_ms"));
+  ASSERT_GT(20u, values.at("latency_system_bsdiff_patch_ms"));
+  ASSERT_LE(20u, values.at("latency_system_bsdiff_write_ms"));
+  ASSERT_EQ(values.end(), values.find("latency_system_move_count"));
+}
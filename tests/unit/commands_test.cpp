@@ -35,6 +35,7 @@ TEST(CommandsTest, ParseType) {
   ASSERT_EQ(Command::Type::STASH, Command::ParseType("stash"));
   ASSERT_EQ(Command::Type::FREE, Command::ParseType("free"));
   ASSERT_EQ(Command::Type::COMPUTE_HASH_TREE, Command::ParseType("compute_hash_tree"));
+  ASSERT_EQ(Command::Type::COMPUTE_FEC, Command::ParseType("compute_fec"));
 }
 
 TEST(CommandsTest, ParseType_InvalidCommand) {
@@ -356,6 +357,29 @@ TEST(CommandsTest, Parse_COMPUTE_HASH_TREE) {
   ASSERT_EQ(PatchInfo(), command.patch());
 }
 
+TEST(CommandsTest, Parse_COMPUTE_FEC) {
+  const std::string input{ "compute_fec 2,130,133 2,0,130 2 unknown-fec-hash" };
+  std::string err;
+  Command command = Command::Parse(input, 10, &err);
+  ASSERT_TRUE(command);
+
+  ASSERT_EQ(Command::Type::COMPUTE_FEC, command.type());
+  ASSERT_EQ(10, command.index());
+  ASSERT_EQ(input, command.cmdline());
+
+  FecInfo expected_info(RangeSet({ { 130, 133 } }), RangeSet({ { 0, 130 } }), 2,
+                        "unknown-fec-hash");
+  ASSERT_EQ(expected_info, command.fec_info());
+  ASSERT_EQ(HashTreeInfo(), command.hash_tree_info());
+  ASSERT_EQ(TargetInfo(), command.target());
+  ASSERT_EQ(SourceInfo(), command.source());
+
+  // The FEC data needs to be contiguous, and the roots in the range of RS(255, 255 - roots).
+  ASSERT_FALSE(Command::Parse("compute_fec 4,130,131,140,142 2,0,130 2 hash", 0, &err));
+  ASSERT_FALSE(Command::Parse("compute_fec 2,130,133 2,0,130 0 hash", 0, &err));
+  ASSERT_FALSE(Command::Parse("compute_fec 2,130,133 2,0,130 255 hash", 0, &err));
+}
+
 TEST(CommandsTest, Parse_InvalidNumberOfArgs) {
   Command::abort_allowed_ = true;
 
@@ -364,6 +388,7 @@ TEST(CommandsTest, Parse_InvalidNumberOfArgs) {
   std::vector<std::string> inputs{
     "abort foo",
     "bsdiff",
+    "compute_fec 2,0,1 2,1,2 2",
     "compute_hash_tree, 2,0,1 2,0,1 unknown-algorithm unknown-salt",
     "erase",
     "erase 4,3,5,10,12 hash1",
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <zlib.h>
+
+#include <gtest/gtest.h>
+
+#include "applypatch/deflate_backend.h"
+
+// A backend that always deflates at level 1, which only matches zlib when level 1 is asked for.
+static int Level1DeflateInit(z_stream* strm, int /* level */, int method, int window_bits,
+                             int mem_level, int strategy) {
+  return deflateInit2(strm, 1, method, window_bits, mem_level, strategy);
+}
+
+static const DeflateBackend kLevel1Backend = {
+  "level1", Level1DeflateInit, deflate, deflateReset, deflateEnd,
+};
+
+TEST(DeflateBackendTest, SelectDeflateBackend) {
+  const DeflateBackend* zlib_backend = GetZlibDeflateBackend();
+  ASSERT_EQ(zlib_backend, SelectDeflateBackend(6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+
+  RegisterDeflateBackend(&kLevel1Backend);
+
+  // The candidate is only picked for the parameters where its output matches zlib's.
+  ASSERT_EQ(&kLevel1Backend, SelectDeflateBackend(1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+  ASSERT_EQ(zlib_backend, SelectDeflateBackend(6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+  ASSERT_EQ(zlib_backend, SelectDeflateBackend(9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+
+  // The choices are cached.
+  ASSERT_EQ(&kLevel1Backend, SelectDeflateBackend(1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+  ASSERT_EQ(zlib_backend, SelectDeflateBackend(6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+}
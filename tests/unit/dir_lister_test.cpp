@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "otautil/dir_lister.h"
+
+using namespace std::chrono_literals;
+
+class DirectoryListerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(android::base::WriteStringToFile("", dir_.path + std::string("/b.zip")));
+    ASSERT_TRUE(android::base::WriteStringToFile("", dir_.path + std::string("/A.ZIP")));
+    ASSERT_TRUE(android::base::WriteStringToFile("", dir_.path + std::string("/c.map")));
+    ASSERT_TRUE(android::base::WriteStringToFile("", dir_.path + std::string("/notes.txt")));
+    ASSERT_EQ(0, mkdir((dir_.path + std::string("/sub")).c_str(), 0755));
+    ASSERT_EQ(0, symlink("b.zip", (dir_.path + std::string("/link.zip")).c_str()));
+  }
+
+  // Sets the mtime of the directory to |seconds|, so that a change is noticed regardless of the
+  // timestamp granularity.
+  void SetDirMtime(time_t seconds) {
+    timeval times[2] = { { seconds, 0 }, { seconds, 0 } };
+    ASSERT_EQ(0, utimes(dir_.path, times));
+  }
+
+  TemporaryDir dir_;
+};
+
+TEST_F(DirectoryListerTest, List) {
+  DirectoryLister lister({ ".zip", ".map" });
+  lister.List(dir_.path, nullptr);
+  DirectoryLister::Snapshot snapshot = lister.Get(10s);
+  ASSERT_TRUE(snapshot.complete);
+  ASSERT_FALSE(snapshot.error);
+  // Symlinks and the files without a matching suffix are left out.
+  ASSERT_EQ((std::vector<std::string>{ "A.ZIP", "b.zip", "c.map" }), snapshot.files);
+  ASSERT_EQ((std::vector<std::string>{ "sub/" }), snapshot.dirs);
+}
+
+TEST_F(DirectoryListerTest, List_missing) {
+  DirectoryLister lister({ ".zip" });
+  lister.List(dir_.path + std::string("/missing"), nullptr);
+  DirectoryLister::Snapshot snapshot = lister.Get();
+  ASSERT_TRUE(snapshot.complete);
+  ASSERT_TRUE(snapshot.error);
+  ASSERT_TRUE(snapshot.files.empty());
+}
+
+TEST_F(DirectoryListerTest, Update) {
+  DirectoryLister lister({ ".zip" });
+  std::atomic<int> updates{ 0 };
+  lister.List(dir_.path, [&updates]() { updates++; });
+
+  // The lister keeps asking until the complete listing is picked up.
+  while (updates == 0) {
+    std::this_thread::sleep_for(1ms);
+  }
+  ASSERT_TRUE(lister.Get(10s).complete);
+  lister.Cancel();
+  int seen = updates;
+  ASSERT_GE(seen, 1);
+  std::this_thread::sleep_for(2 * DirectoryLister::kUpdateInterval);
+  ASSERT_EQ(seen, updates);
+}
+
+TEST_F(DirectoryListerTest, Cache) {
+  SetDirMtime(1000);
+  DirectoryLister lister({ ".zip" });
+  lister.List(dir_.path, nullptr);
+  ASSERT_EQ(2U, lister.Get(10s).files.size());
+
+  // An unchanged directory comes from the cache, complete right away; with the mtime kept, even a
+  // new file isn't noticed.
+  ASSERT_TRUE(android::base::WriteStringToFile("", dir_.path + std::string("/d.zip")));
+  SetDirMtime(1000);
+  lister.List(dir_.path, nullptr);
+  DirectoryLister::Snapshot snapshot = lister.Get();
+  ASSERT_TRUE(snapshot.complete);
+  ASSERT_EQ(2U, snapshot.files.size());
+
+  // A changed mtime invalidates it.
+  SetDirMtime(2000);
+  lister.List(dir_.path, nullptr);
+  snapshot = lister.Get(10s);
+  ASSERT_TRUE(snapshot.complete);
+  ASSERT_EQ((std::vector<std::string>{ "A.ZIP", "b.zip", "d.zip" }), snapshot.files);
+}
+
+TEST_F(DirectoryListerTest, Cancel) {
+  DirectoryLister lister({ ".zip" });
+  lister.List(dir_.path, nullptr);
+  lister.Cancel();
+  // Cancelling again, or without a listing, is fine.
+  lister.Cancel();
+  DirectoryLister other({ ".zip" });
+  other.Cancel();
+}
@@ -18,7 +18,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <string>
+#include <thread>
 
 #include <android-base/file.h>
 #include <gtest/gtest.h>
@@ -139,3 +141,35 @@ TEST(DirUtilTest, unlink_smoke) {
   // Verify it's gone.
   ASSERT_EQ(-1, access((path + "/a").c_str(), F_OK));
 }
+
+TEST(DirUtilTest, WaitForPath) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/node";
+  ASSERT_FALSE(WaitForPath(path, std::chrono::milliseconds(10)));
+
+  // The file shows up while waiting; the wait ends on the inotify event, well before the timeout.
+  std::thread creator([&path]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ASSERT_TRUE(android::base::WriteStringToFile("", path));
+  });
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(WaitForPath(path, std::chrono::seconds(10)));
+  ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+  creator.join();
+
+  ASSERT_TRUE(WaitForPath(path, std::chrono::milliseconds(0)));
+}
+
+TEST(DirUtilTest, WaitForCondition) {
+  TemporaryDir td;
+  int checks = 0;
+  ASSERT_TRUE(WaitForCondition(td.path, std::chrono::seconds(1), [&checks]() {
+    return ++checks == 3;
+  }));
+  ASSERT_EQ(3, checks);
+
+  // A missing directory falls back to polling.
+  checks = 0;
+  ASSERT_TRUE(WaitForCondition(std::string(td.path) + "/missing", std::chrono::seconds(1),
+                               [&checks]() { return ++checks == 3; }));
+}
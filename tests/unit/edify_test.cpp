@@ -106,6 +106,30 @@ TEST_F(EdifyTest, precedence) {
     expect("(ab == a) + b", "b");
 }
 
+TEST_F(EdifyTest, constant_folding) {
+  // Operators on literals are folded at parse time, keeping the location of the whole expression.
+  std::string script = "x; a + \"b\" + c == abc";
+  std::unique_ptr<Expr> e;
+  int error_count = 0;
+  ASSERT_EQ(0, ParseString(script, &e, &error_count));
+  ASSERT_EQ(0, error_count);
+  ASSERT_EQ(2u, e->argv.size());
+  const auto& folded = e->argv[1];
+  ASSERT_EQ(Literal, folded->fn);
+  ASSERT_EQ("t", folded->name);
+  ASSERT_EQ("a + \"b\" + c == abc", script.substr(folded->start, folded->end - folded->start));
+
+  // Anything with a function call is left to the evaluation.
+  ASSERT_EQ(0, ParseString("concat(a) + b", &e, &error_count));
+  ASSERT_EQ(ConcatFn, e->fn);
+
+  expect("a + b != ab", "");
+  expect("a + b != a", "t");
+  expect("concat(a, \"\" + b) == ab", "t");
+  expect("assert(a + b == ab)", "");
+  expect("assert(a + b == b)", nullptr);
+}
+
 TEST_F(EdifyTest, substring) {
     // substring function
     expect("is_substring(cad, abracadabra)", "t");
@@ -132,6 +156,22 @@ TEST_F(EdifyTest, if_statement) {
     expect("if \"\"; t then yes endif", "yes");
 }
 
+TEST_F(EdifyTest, parallel) {
+  expect("parallel(a)", "a");
+  expect("parallel(a, b + c, concat(d, e))", "de");
+  expect("parallel(a; b, \"\")", "");
+  expect("parallel(a, abort(), c)", nullptr);
+
+  std::string script = "parallel(a, assert(a == c), b)";
+  std::unique_ptr<Expr> e;
+  int error_count = 0;
+  ASSERT_EQ(0, ParseString(script, &e, &error_count));
+  State state(script, nullptr);
+  std::string result;
+  ASSERT_FALSE(Evaluate(&state, e, &result));
+  ASSERT_EQ("assert failed: a == c", state.errmsg);
+}
+
 TEST_F(EdifyTest, comparison) {
     // numeric comparisons
     expect("less_than_int(3, 14)", "t");
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <fec/io.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "otautil/rangeset.h"
+#include "private/fec_encoder.h"
+
+extern "C" {
+#include <fec.h>
+}
+
+static constexpr size_t kBlockSize = 4096;
+
+// Encodes |image| one codeword at a time, the way libfec's encoder interleaves the bytes.
+static std::vector<uint8_t> ReferenceFec(const std::string& image, int roots) {
+  int rsn = 255 - roots;
+  uint64_t rounds = (image.size() / kBlockSize + rsn - 1) / rsn;
+  std::vector<uint8_t> fec(rounds * roots * kBlockSize);
+  std::vector<uint8_t> data(rsn);
+  void* rs = init_rs_char(8, 0x11d, 0, 1, roots, 0);
+  for (uint64_t i = 0; i < rounds * kBlockSize; i++) {
+    for (int j = 0; j < rsn; j++) {
+      uint64_t offset = i + j * rounds * kBlockSize;
+      data[j] = offset < image.size() ? image[offset] : 0;
+    }
+    encode_rs_char(rs, data.data(), fec.data() + i * roots);
+  }
+  free_rs_char(rs);
+  return fec;
+}
+
+class FecEncoderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    std::mt19937 rng(0);
+    content_.resize(1200 * kBlockSize);
+    for (auto& c : content_) {
+      c = static_cast<char>(rng());
+    }
+    ASSERT_TRUE(android::base::WriteStringToFile(content_, file_.path));
+    fd_.reset(open(file_.path, O_RDONLY));
+    ASSERT_NE(-1, fd_.get());
+
+    // The image is laid out in two extents, 1000 blocks in total.
+    ranges_ = RangeSet({ { 10, 510 }, { 700, 1200 } });
+    image_ = content_.substr(10 * kBlockSize, 500 * kBlockSize) +
+             content_.substr(700 * kBlockSize, 500 * kBlockSize);
+  }
+
+  TemporaryFile file_;
+  android::base::unique_fd fd_;
+  std::string content_;
+  RangeSet ranges_;
+  std::string image_;
+};
+
+TEST_F(FecEncoderTest, GetFecSize) {
+  ASSERT_EQ(2 * kBlockSize, GetFecSize(253, 2));
+  ASSERT_EQ(4 * kBlockSize, GetFecSize(254, 2));
+  ASSERT_EQ(0u, GetFecSize(253, 0));
+  ASSERT_EQ(0u, GetFecSize(253, 255));
+}
+
+TEST_F(FecEncoderTest, EncodeFec) {
+  for (int roots : { 2, 24 }) {
+    std::vector<uint8_t> expected = ReferenceFec(image_, roots);
+    ASSERT_EQ(GetFecSize(ranges_.blocks(), roots), expected.size());
+    for (size_t threads : { 1, 3, 8 }) {
+      std::vector<uint8_t> fec;
+      ASSERT_TRUE(EncodeFec(fd_.get(), ranges_, roots, threads, &fec));
+      ASSERT_EQ(expected, fec) << roots << " roots, " << threads << " threads";
+    }
+  }
+}
+
+TEST_F(FecEncoderTest, EncodeFec_Errors) {
+  std::vector<uint8_t> fec;
+  errno = 0;
+  ASSERT_FALSE(EncodeFec(fd_.get(), ranges_, 0, 1, &fec));
+  ASSERT_EQ(EINVAL, errno);
+
+  // Past the end of the file.
+  ASSERT_FALSE(EncodeFec(fd_.get(), RangeSet({ { 1100, 1300 } }), 2, 4, &fec));
+}
+
+TEST_F(FecEncoderTest, AppendFecHeader) {
+  std::vector<uint8_t> fec;
+  ASSERT_TRUE(EncodeFec(fd_.get(), ranges_, 2, 4, &fec));
+  std::vector<uint8_t> data = fec;
+  AppendFecHeader(ranges_.blocks(), 2, &fec);
+  ASSERT_EQ(data.size() + kBlockSize, fec.size());
+  ASSERT_TRUE(std::equal(data.begin(), data.end(), fec.begin()));
+
+  fec_header header;
+  memcpy(&header, fec.data() + data.size(), sizeof(header));
+  ASSERT_EQ(FEC_MAGIC, header.magic);
+  ASSERT_EQ(sizeof(header), header.size);
+  ASSERT_EQ(2u, header.roots);
+  ASSERT_EQ(data.size(), header.fec_size);
+  ASSERT_EQ(image_.size(), header.inp_size);
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(data.data(), data.size(), digest);
+  ASSERT_EQ(0, memcmp(digest, header.hash, sizeof(digest)));
+
+  // The copy at the end of the block.
+  ASSERT_EQ(0, memcmp(fec.data() + data.size(), fec.data() + fec.size() - sizeof(header),
+                      sizeof(header)));
+}
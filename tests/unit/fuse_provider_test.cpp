@@ -14,15 +14,21 @@
  * limitations under the License.
  */
 
+#include <netinet/in.h>
 #include <stdint.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
@@ -102,3 +108,187 @@ TEST(FuseBlockMapTest, ReadBlockAlignedData_large_fuse_block) {
   std::string expected = content.substr(16384, 4096) + content.substr(24576, 15904);
   ASSERT_EQ(std::vector<uint8_t>(expected.begin(), expected.end()), result);
 }
+
+TEST(FuseBlockMapTest, ReadBlockAlignedData_partial_block_in_own_range) {
+  std::string content;
+  for (char c = 0; c < 10; c++) {
+    content += std::string(4096, c);
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  // The partial block at the end of the file lives in a range of its own.
+  std::vector<std::string> lines = {
+    temp_file.path, "16484 4096", "2", "0 4", "9 10",
+  };
+  TemporaryFile block_map;
+  ASSERT_TRUE(android::base::WriteStringToFile(android::base::Join(lines, '\n'), block_map.path));
+
+  auto block_map_data = FuseBlockDataProvider::CreateFromBlockMap(block_map.path, 4096);
+  ASSERT_TRUE(block_map_data);
+
+  std::vector<uint8_t> result(16484);
+  ASSERT_TRUE(block_map_data->ReadBlockAlignedData(result.data(), 16484, 0));
+  std::string expected = content.substr(0, 16384) + content.substr(36864, 100);
+  ASSERT_EQ(std::vector<uint8_t>(expected.begin(), expected.end()), result);
+
+  result.resize(100);
+  ASSERT_TRUE(block_map_data->ReadBlockAlignedData(result.data(), 100, 4));
+  ASSERT_EQ(std::vector<uint8_t>(content.begin() + 36864, content.begin() + 36964), result);
+}
+
+// Serves |content| on a loopback port, answering range requests on keep-alive connections like a
+// static file server does. Without |ranges|, it sends the whole content with a 200 instead.
+class RangeServer {
+ public:
+  RangeServer(std::string content, bool ranges) : content_(std::move(content)), ranges_(ranges) {
+    listen_fd_.reset(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listen_fd_.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+        listen(listen_fd_.get(), 8) == 0 &&
+        getsockname(listen_fd_.get(), reinterpret_cast<sockaddr*>(&addr), &addr_len) == 0) {
+      port_ = ntohs(addr.sin_port);
+    }
+    accept_thread_ = std::thread([this]() {
+      int fd;
+      while ((fd = accept4(listen_fd_.get(), nullptr, nullptr, SOCK_CLOEXEC)) != -1) {
+        std::lock_guard<std::mutex> lock(lock_);
+        connection_threads_.emplace_back(&RangeServer::Serve, this, android::base::unique_fd(fd));
+      }
+    });
+  }
+
+  ~RangeServer() {
+    shutdown(listen_fd_.get(), SHUT_RDWR);
+    accept_thread_.join();
+    for (auto& thread : connection_threads_) {
+      thread.join();
+    }
+  }
+
+  std::string url() const {
+    return android::base::StringPrintf("http://127.0.0.1:%d/package.zip", port_);
+  }
+
+  int requests() const {
+    return requests_;
+  }
+
+ private:
+  // Answers the requests on |fd| until the client closes it.
+  void Serve(android::base::unique_fd fd) {
+    std::string pending;
+    while (true) {
+      size_t header_end;
+      while ((header_end = pending.find("\r\n\r\n")) == std::string::npos) {
+        char chunk[4096];
+        ssize_t n = TEMP_FAILURE_RETRY(recv(fd.get(), chunk, sizeof(chunk), 0));
+        if (n <= 0) {
+          return;
+        }
+        pending.append(chunk, n);
+      }
+      std::string request = pending.substr(0, header_end);
+      pending.erase(0, header_end + 4);
+      requests_++;
+
+      std::string response;
+      size_t range = request.find("Range: bytes=");
+      unsigned long long first;
+      unsigned long long last;
+      if (!ranges_ || range == std::string::npos ||
+          sscanf(request.c_str() + range, "Range: bytes=%llu-%llu", &first, &last) != 2) {
+        response = android::base::StringPrintf("HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n",
+                                               content_.size()) +
+                   content_;
+      } else {
+        response = android::base::StringPrintf(
+                       "HTTP/1.1 206 Partial Content\r\nContent-Length: %llu\r\n"
+                       "Content-Range: bytes %llu-%llu/%zu\r\n\r\n",
+                       last - first + 1, first, last, content_.size()) +
+                   content_.substr(first, last - first + 1);
+      }
+      if (!android::base::WriteFully(fd.get(), response.data(), response.size())) {
+        return;
+      }
+    }
+  }
+
+  const std::string content_;
+  const bool ranges_;
+  android::base::unique_fd listen_fd_;
+  int port_ = 0;
+  std::atomic<int> requests_{ 0 };
+  std::thread accept_thread_;
+  std::mutex lock_;
+  std::vector<std::thread> connection_threads_;
+};
+
+TEST(FuseHttpTest, ParseUrl) {
+  std::string host;
+  std::string port;
+  std::string path;
+  ASSERT_TRUE(FuseHttpDataProvider::ParseUrl("http://server/ota/package.zip", &host, &port, &path));
+  ASSERT_EQ("server", host);
+  ASSERT_EQ("80", port);
+  ASSERT_EQ("/ota/package.zip", path);
+
+  ASSERT_TRUE(FuseHttpDataProvider::ParseUrl("http://10.0.0.1:8000", &host, &port, &path));
+  ASSERT_EQ("10.0.0.1", host);
+  ASSERT_EQ("8000", port);
+  ASSERT_EQ("/", path);
+
+  ASSERT_TRUE(FuseHttpDataProvider::ParseUrl("http://[fe80::1]:8080/a.zip", &host, &port, &path));
+  ASSERT_EQ("fe80::1", host);
+  ASSERT_EQ("8080", port);
+  ASSERT_EQ("/a.zip", path);
+
+  ASSERT_FALSE(FuseHttpDataProvider::ParseUrl("https://server/a.zip", &host, &port, &path));
+  ASSERT_FALSE(FuseHttpDataProvider::ParseUrl("/sdcard/a.zip", &host, &port, &path));
+  ASSERT_FALSE(FuseHttpDataProvider::ParseUrl("http:///a.zip", &host, &port, &path));
+  ASSERT_FALSE(FuseHttpDataProvider::ParseUrl("http://server:99999/a.zip", &host, &port, &path));
+  ASSERT_FALSE(FuseHttpDataProvider::ParseUrl("http://[fe80::1/a.zip", &host, &port, &path));
+}
+
+TEST(FuseHttpTest, ReadBlockAlignedData) {
+  // Large enough to get a fetch split across all the connections, with a partial last block.
+  std::string content;
+  for (size_t i = 0; i < 1100; i++) {
+    content += std::string(4096, static_cast<char>('a' + i % 26));
+  }
+  content += std::string(100, 'z');
+  RangeServer server(content, true);
+
+  auto provider = FuseHttpDataProvider::CreateFromUrl(server.url(), 4096);
+  ASSERT_TRUE(provider);
+  ASSERT_TRUE(provider->Valid());
+  ASSERT_EQ(content.size(), provider->file_size());
+
+  std::vector<uint8_t> result(4096);
+  ASSERT_TRUE(provider->ReadBlockAlignedData(result.data(), 4096, 3));
+  ASSERT_EQ(std::vector<uint8_t>(content.begin() + 12288, content.begin() + 16384), result);
+
+  // Split into four parts, the last one with the partial block.
+  result.resize(content.size() - 4096);
+  ASSERT_TRUE(provider->ReadBlockAlignedData(result.data(), result.size(), 1));
+  ASSERT_EQ(std::vector<uint8_t>(content.begin() + 4096, content.end()), result);
+
+  // The connections are kept alive between the fetches, instead of one for each of the requests.
+  ASSERT_TRUE(provider->ReadBlockAlignedData(result.data(), result.size(), 1));
+  ASSERT_EQ(std::vector<uint8_t>(content.begin() + 4096, content.end()), result);
+  ASSERT_EQ(1 + 1 + 4 + 4, server.requests());
+  ASSERT_LE(static_cast<FuseHttpDataProvider*>(provider.get())->connections_made(),
+            FuseHttpDataProvider::kMaxConnections);
+
+  ASSERT_FALSE(provider->ReadBlockAlignedData(result.data(), 4096, 1100));
+  provider->Close();
+}
+
+TEST(FuseHttpTest, CreateFromUrl_no_ranges) {
+  RangeServer server(std::string(8192, 'a'), false);
+  ASSERT_EQ(nullptr, FuseHttpDataProvider::CreateFromUrl(server.url(), 4096));
+}
@@ -14,15 +14,21 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
 
 #include "fuse_provider.h"
 #include "fuse_sideload.h"
@@ -54,7 +60,7 @@ TEST(SideloadTest, run_fuse_sideload_wrong_parameters) {
   ASSERT_EQ(-1, run_fuse_sideload(std::move(provider_large_block)));
 
   auto provider_too_many_blocks =
-      std::make_unique<FuseTestDataProvider>(((1 << 18) + 1) * 4096, 4096);
+      std::make_unique<FuseTestDataProvider>(((1ULL << 24) + 1) * 4096, 4096);
   ASSERT_EQ(-1, run_fuse_sideload(std::move(provider_too_many_blocks)));
 }
 
@@ -110,3 +116,183 @@ TEST(SideloadTest, run_fuse_sideload) {
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+// Serves |path| with run_fuse_sideload() in a child process, and waits for the package to show up
+// under |mount_point|.
+static void StartFuseSideload(const std::string& path, const std::string& mount_point,
+                              pid_t* pid) {
+  auto provider = std::make_unique<FuseFileDataProvider>(path, 4096);
+  ASSERT_TRUE(provider->Valid());
+  *pid = fork();
+  if (*pid == 0) {
+    ASSERT_EQ(0, run_fuse_sideload(std::move(provider), mount_point.c_str()));
+    _exit(EXIT_SUCCESS);
+  }
+
+  std::string package = mount_point + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  int status;
+  static constexpr int kSideloadInstallTimeout = 10;
+  for (int i = 0; i < kSideloadInstallTimeout; ++i) {
+    ASSERT_NE(-1, waitpid(*pid, &status, WNOHANG));
+
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) {
+      break;
+    }
+
+    if (errno == ENOENT && i < kSideloadInstallTimeout - 1) {
+      sleep(1);
+      continue;
+    }
+    FAIL() << "Timed out waiting for the fuse-provided package.";
+  }
+}
+
+// Stops the run_fuse_sideload() started by StartFuseSideload().
+static void StopFuseSideload(const std::string& mount_point, pid_t pid) {
+  std::string exit_flag = mount_point + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+  struct stat sb;
+  ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
+
+  int status;
+  waitpid(pid, &status, 0);
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+}
+
+TEST(SideloadTest, run_fuse_sideload_readahead) {
+  // Large enough to span several readahead windows, with a partial last block.
+  std::string content;
+  for (size_t i = 0; i < 1000; i++) {
+    content += std::string(4096, static_cast<char>('a' + i % 26));
+  }
+  content += std::string(100, 'z');
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(temp_file.path, mount_point.path, &pid));
+
+  // A read from the middle of the file, followed by a sequential read of the whole file.
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  android::base::unique_fd package_fd(open(package.c_str(), O_RDONLY));
+  ASSERT_NE(-1, package_fd.get());
+  std::string middle(10000, '\0');
+  ASSERT_TRUE(android::base::ReadFullyAtOffset(package_fd, middle.data(), middle.size(), 2000000));
+  ASSERT_EQ(content.substr(2000000, middle.size()), middle);
+  package_fd.reset();
+
+  std::string content_via_fuse;
+  ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+  ASSERT_EQ(content, content_via_fuse);
+
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+}
+
+TEST(SideloadTest, run_fuse_sideload_concurrent_reads) {
+  std::string content;
+  for (size_t i = 0; i < 2000; i++) {
+    content += std::string(4096, static_cast<char>('a' + i % 26));
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(temp_file.path, mount_point.path, &pid));
+
+  // Each thread streams a different part of the file, while the others are being read.
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  constexpr size_t kThreads = 4;
+  constexpr size_t kPartSize = 2000 * 4096 / kThreads;
+  std::vector<std::string> parts(kThreads);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kThreads; i++) {
+    threads.emplace_back([&, i]() {
+      android::base::unique_fd package_fd(open(package.c_str(), O_RDONLY));
+      std::string part(kPartSize, '\0');
+      for (size_t offset = 0; offset < kPartSize; offset += 10000) {
+        size_t size = std::min<size_t>(10000, kPartSize - offset);
+        if (!android::base::ReadFullyAtOffset(package_fd, part.data() + offset, size,
+                                              i * kPartSize + offset)) {
+          return;
+        }
+      }
+      parts[i] = std::move(part);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(content, android::base::Join(parts, ""));
+
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+}
+
+TEST(SideloadTest, parse_access_order_hints) {
+  std::vector<uint32_t> blocks;
+  ASSERT_TRUE(parse_access_order_hints("# metadata\n8192 100\n0 4097\n\n4097 4095\n", 16384,
+                                       4096, &blocks));
+  // The ranges that follow on from each other share the boundary block.
+  ASSERT_EQ((std::vector<uint32_t>{ 2, 0, 1 }), blocks);
+
+  ASSERT_FALSE(parse_access_order_hints("0\n", 16384, 4096, &blocks));
+  ASSERT_FALSE(parse_access_order_hints("16000 1000\n", 16384, 4096, &blocks));
+  ASSERT_FALSE(parse_access_order_hints("0 0\n", 16384, 4096, &blocks));
+  ASSERT_TRUE(blocks.empty());
+}
+
+TEST(SideloadTest, run_fuse_sideload_access_order_hints) {
+  // A package of a stored payload, read back to front, as the access order entry hints.
+  static constexpr const char* kPayloadName = "payload";
+  static constexpr size_t kPayloadOffset = 30 + 7;  // The local header, and the name.
+  static constexpr size_t kChunkSize = 8192;
+  static constexpr size_t kChunks = 300;
+  std::string payload;
+  for (size_t i = 0; i < kChunks; i++) {
+    payload += std::string(kChunkSize, static_cast<char>('a' + i % 26));
+  }
+  std::string hints;
+  for (size_t i = kChunks; i > 0; i--) {
+    hints += std::to_string(kPayloadOffset + (i - 1) * kChunkSize) + " " +
+             std::to_string(kChunkSize) + "\n";
+  }
+
+  TemporaryFile temp_file;
+  FILE* zip_file = fdopen(temp_file.release(), "w");
+  ZipWriter writer(zip_file);
+  ASSERT_EQ(0, writer.StartEntry(kPayloadName, 0));
+  ASSERT_EQ(0, writer.WriteBytes(payload.data(), payload.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.StartEntry(FUSE_SIDELOAD_ACCESS_ORDER_ENTRY, 0));
+  ASSERT_EQ(0, writer.WriteBytes(hints.data(), hints.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(temp_file.path, &handle));
+  ZipEntry64 entry;
+  ASSERT_EQ(0, FindEntry(handle, kPayloadName, &entry));
+  ASSERT_EQ(kPayloadOffset, entry.offset);
+  CloseArchive(handle);
+
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(temp_file.path, mount_point.path, &pid));
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  android::base::unique_fd package_fd(open(package.c_str(), O_RDONLY));
+  ASSERT_NE(-1, package_fd.get());
+  for (size_t i = kChunks; i > 0; i--) {
+    std::string chunk(kChunkSize, '\0');
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(package_fd, chunk.data(), chunk.size(),
+                                                 kPayloadOffset + (i - 1) * kChunkSize));
+    ASSERT_EQ(payload.substr((i - 1) * kChunkSize, kChunkSize), chunk);
+  }
+  package_fd.reset();
+
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+}
@@ -14,9 +14,12 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
 #include <stdio.h>
 
 #include <algorithm>
+#include <map>
+#include <memory>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -25,6 +28,7 @@
 #include <android-base/memory.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <applypatch/applypatch.h>
 #include <applypatch/imgdiff.h>
 #include <applypatch/imgdiff_image.h>
 #include <applypatch/imgpatch.h>
@@ -32,6 +36,7 @@
 #include <ziparchive/zip_writer.h>
 
 #include "common/test_constants.h"
+#include "edify/expr.h"
 
 using android::base::get_unaligned;
 
@@ -248,6 +253,188 @@ TEST(ImgdiffTest, zip_mode_smoke_compressed) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_many_small_deflate_entries) {
+  // Generate 16 random entries. Applying the patch reuses the same zlib state and buffers across
+  // all the deflate chunks.
+  std::vector<std::string> contents;
+  for (size_t i = 0; i < 16; i++) {
+    std::string content;
+    generate_n(back_inserter(content), 1024 + i * 97, []() { return rand() % 256; });
+    contents.push_back(content);
+  }
+
+  // Construct src and tgt zip files, where the target changes every other entry.
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  for (size_t i = 0; i < contents.size(); i++) {
+    std::string name = "file" + std::to_string(i) + ".txt";
+    ASSERT_EQ(0, src_writer.StartEntry(name.c_str(), ZipWriter::kCompress));
+    ASSERT_EQ(0, src_writer.WriteBytes(contents[i].data(), contents[i].size()));
+    ASSERT_EQ(0, src_writer.FinishEntry());
+
+    std::string tgt_content = contents[i] + (i % 2 == 0 ? "extra contents" : "");
+    ASSERT_EQ(0, tgt_writer.StartEntry(name.c_str(), ZipWriter::kCompress));
+    ASSERT_EQ(0, tgt_writer.WriteBytes(tgt_content.data(), tgt_content.size()));
+    ASSERT_EQ(0, tgt_writer.FinishEntry());
+  }
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  // Compute patch.
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  // Verify.
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  size_t num_normal;
+  size_t num_raw;
+  size_t num_deflate;
+  verify_patch_header(patch, &num_normal, &num_raw, &num_deflate);
+  ASSERT_EQ(contents.size(), num_deflate);
+
+  verify_patched_image(src, patch, tgt);
+
+  // Applying the chunks on multiple threads should give the same target.
+  std::string patched;
+  Value patch_value(Value::Type::BLOB, patch);
+  ASSERT_EQ(0, ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
+                               patch_value,
+                               [&](const unsigned char* data, size_t len) {
+                                 patched.append(reinterpret_cast<const char*>(data), len);
+                                 return len;
+                               },
+                               nullptr, 4));
+  ASSERT_EQ(tgt, patched);
+}
+
+// Writes a zip of the deflated |entries| to |path|.
+static void write_zip(const std::string& path,
+                      const std::vector<std::pair<std::string, std::string>>& entries) {
+  FILE* file_ptr = fopen(path.c_str(), "wb");
+  ASSERT_NE(nullptr, file_ptr);
+  ZipWriter writer(file_ptr);
+  for (const auto& [name, content] : entries) {
+    ASSERT_EQ(0, writer.StartEntry(name.c_str(), ZipWriter::kCompress));
+    ASSERT_EQ(0, writer.WriteBytes(content.data(), content.size()));
+    ASSERT_EQ(0, writer.FinishEntry());
+  }
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(file_ptr));
+}
+
+TEST(ImgdiffTest, zip_mode_renamed_and_identical_entries) {
+  std::vector<std::string> contents;
+  for (size_t i = 0; i < 3; i++) {
+    std::string content;
+    generate_n(back_inserter(content), 4096 * (i + 1), []() { return 'a' + rand() % 16; });
+    contents.push_back(content);
+  }
+
+  // The target renames the first entry, keeps the second one, and changes the third one.
+  TemporaryFile src_file;
+  write_zip(src_file.path, { { "lib/old.so", contents[0] },
+                             { "same.txt", contents[1] },
+                             { "c.txt", contents[2] } });
+  TemporaryFile tgt_file;
+  write_zip(tgt_file.path, { { "lib/new.so", contents[0] },
+                             { "same.txt", contents[1] },
+                             { "c.txt", contents[2] + "extra contents" } });
+
+  ZipModeImage src_image(true);
+  ASSERT_TRUE(src_image.Initialize(src_file.path));
+  ZipModeImage tgt_image(false);
+  ASSERT_TRUE(tgt_image.Initialize(tgt_file.path));
+  ASSERT_TRUE(ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image));
+
+  // The renamed entry is matched by its contents; being byte-identical, it's a copy of the source
+  // entry, as is the unchanged one.
+  std::map<std::string, const ImageChunk*> chunks;
+  for (const auto& chunk : tgt_image) {
+    chunks[chunk.GetEntryName()] = &chunk;
+  }
+  ASSERT_EQ(1U, chunks.count("lib/new.so"));
+  ASSERT_EQ("lib/old.so", chunks["lib/new.so"]->GetSourceEntryName());
+  ASSERT_EQ(CHUNK_NORMAL, chunks["lib/new.so"]->GetType());
+  ASSERT_TRUE(chunks["lib/new.so"]->IsCopy());
+  ASSERT_EQ(1U, chunks.count("same.txt"));
+  ASSERT_TRUE(chunks["same.txt"]->IsCopy());
+  ASSERT_EQ(1U, chunks.count("c.txt"));
+  ASSERT_EQ(CHUNK_DEFLATE, chunks["c.txt"]->GetType());
+  ASSERT_FALSE(chunks["c.txt"]->IsCopy());
+
+  TemporaryFile patch_file;
+  ASSERT_TRUE(ZipModeImage::GeneratePatches(tgt_image, src_image, patch_file.path));
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  verify_patched_image(src, patch, tgt);
+}
+
+TEST(ImgdiffTest, zip_mode_find_chunks_by_content) {
+  std::vector<std::string> contents;
+  for (size_t i = 0; i < 4; i++) {
+    std::string content;
+    generate_n(back_inserter(content), 4096 * (i + 1), []() { return 'a' + rand() % 16; });
+    contents.push_back(content);
+  }
+
+  // Two source entries share the contents; the first one in the zip order gets matched.
+  TemporaryFile src_file;
+  write_zip(src_file.path, { { "a.txt", contents[0] },
+                             { "b.txt", contents[0] },
+                             { "c.txt", contents[1] },
+                             { "d.txt", contents[2] } });
+  TemporaryFile tgt_file;
+  write_zip(tgt_file.path, { { "x.txt", contents[0] },
+                             { "y.txt", contents[1] },
+                             { "z.txt", contents[3] },
+                             { "w.txt", contents[2] + "extra contents" } });
+
+  ZipModeImage src_image(true);
+  ASSERT_TRUE(src_image.Initialize(src_file.path));
+  ZipModeImage tgt_image(false);
+  ASSERT_TRUE(tgt_image.Initialize(tgt_file.path));
+
+  std::vector<const ImageChunk*> tgt_chunks;
+  for (const auto& chunk : tgt_image) {
+    if (chunk.GetType() == CHUNK_DEFLATE) {
+      tgt_chunks.push_back(&chunk);
+    }
+  }
+  ASSERT_EQ(4U, tgt_chunks.size());
+  std::vector<ImageChunk*> matches = src_image.FindChunksByContent(tgt_chunks, 4);
+  ASSERT_EQ(4U, matches.size());
+  ASSERT_NE(nullptr, matches[0]);
+  ASSERT_EQ("a.txt", matches[0]->GetEntryName());
+  ASSERT_NE(nullptr, matches[1]);
+  ASSERT_EQ("c.txt", matches[1]->GetEntryName());
+  ASSERT_EQ(nullptr, matches[2]);
+  ASSERT_EQ(nullptr, matches[3]);
+
+  // The single lookups agree, with the hashes cached from above.
+  ASSERT_EQ(matches[0], src_image.FindChunkByContent(*tgt_chunks[0]));
+  ASSERT_EQ(nullptr, src_image.FindChunkByContent(*tgt_chunks[3]));
+}
+
 TEST(ImgdiffTest, zip_mode_empty_target) {
   TemporaryFile src_file;
   FILE* src_file_ptr = fdopen(src_file.release(), "wb");
@@ -287,6 +474,175 @@ TEST(ImgdiffTest, zip_mode_empty_target) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_jobs) {
+  // Construct src and tgt zip files with a few entries, both stored and compressed.
+  std::vector<std::string> random_data(6);
+  for (auto& data : random_data) {
+    generate_n(back_inserter(data), 4096 * 4, []() { return rand() % 256; });
+  }
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  for (size_t i = 0; i < random_data.size(); i++) {
+    ASSERT_EQ(0, src_writer.StartEntry(("file" + std::to_string(i)).c_str(),
+                                       i % 2 == 0 ? ZipWriter::kCompress : 0));
+    ASSERT_EQ(0, src_writer.WriteBytes(random_data[i].data(), random_data[i].size()));
+    ASSERT_EQ(0, src_writer.FinishEntry());
+  }
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  for (size_t i = 0; i < random_data.size(); i++) {
+    ASSERT_EQ(0, tgt_writer.StartEntry(("file" + std::to_string(i)).c_str(),
+                                       i % 2 == 0 ? ZipWriter::kCompress : 0));
+    const std::string tgt_content = random_data[i] + "extra contents " + std::to_string(i);
+    ASSERT_EQ(0, tgt_writer.WriteBytes(tgt_content.data(), tgt_content.size()));
+    ASSERT_EQ(0, tgt_writer.FinishEntry());
+  }
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  // Compute the patch serially, and then with a few jobs.
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  TemporaryFile jobs_patch_file;
+  std::vector<const char*> jobs_args = {
+    "imgdiff", "-z", "--jobs=4", src_file.path, tgt_file.path, jobs_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(jobs_args.size(), jobs_args.data()));
+
+  // The patches should be identical regardless of the number of jobs.
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  std::string jobs_patch;
+  ASSERT_TRUE(android::base::ReadFileToString(jobs_patch_file.path, &jobs_patch));
+  ASSERT_EQ(patch, jobs_patch);
+
+  // Verify.
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  verify_patched_image(src, jobs_patch, tgt);
+}
+
+TEST(ImgdiffTest, zip_mode_sa_cache_dir) {
+  // Construct src and tgt zip files whose entries don't match, so that they get diffed against the
+  // pseudo source.
+  std::string random_data;
+  generate_n(back_inserter(random_data), 4096 * 4, []() { return rand() % 256; });
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  ASSERT_EQ(0, src_writer.StartEntry("src.txt", ZipWriter::kCompress));
+  ASSERT_EQ(0, src_writer.WriteBytes(random_data.data(), random_data.size()));
+  ASSERT_EQ(0, src_writer.FinishEntry());
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  ASSERT_EQ(0, tgt_writer.StartEntry("tgt.txt", 0));
+  const std::string tgt_content = random_data + "extra contents";
+  ASSERT_EQ(0, tgt_writer.WriteBytes(tgt_content.data(), tgt_content.size()));
+  ASSERT_EQ(0, tgt_writer.FinishEntry());
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  verify_patched_image(src, patch, tgt);
+
+  // The first run stores the suffix array, and the second one reuses it. The patches should match
+  // each other, and apply just like the one without the cache.
+  TemporaryDir cache_dir;
+  std::string cache_dir_arg = android::base::StringPrintf("--sa-cache-dir=%s", cache_dir.path);
+  std::string cached_patches[2];
+  for (auto& cached_patch : cached_patches) {
+    TemporaryFile cached_patch_file;
+    std::vector<const char*> cached_args = {
+      "imgdiff", "-z", cache_dir_arg.c_str(), src_file.path, tgt_file.path, cached_patch_file.path,
+    };
+    ASSERT_EQ(0, imgdiff(cached_args.size(), cached_args.data()));
+    ASSERT_TRUE(android::base::ReadFileToString(cached_patch_file.path, &cached_patch));
+    verify_patched_image(src, cached_patch, tgt);
+
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(cache_dir.path), closedir);
+    ASSERT_NE(nullptr, dir);
+    size_t num_files = 0;
+    while (dirent* de = readdir(dir.get())) {
+      if (de->d_name[0] != '.') {
+        ASSERT_TRUE(android::base::EndsWith(de->d_name, ".sa"));
+        num_files++;
+      }
+    }
+    ASSERT_EQ(1U, num_files);
+  }
+  ASSERT_EQ(cached_patches[0], cached_patches[1]);
+}
+
+TEST(ImgdiffTest, lazy_deflate_chunk) {
+  // Compress some data with the default parameters of the deflate chunks.
+  std::string random_data;
+  generate_n(back_inserter(random_data), 4096 * 4, []() { return 'a' + rand() % 4; });
+  std::vector<uint8_t> uncompressed(random_data.begin(), random_data.end());
+
+  z_stream strm = {};
+  ASSERT_EQ(Z_OK, deflateInit2(&strm, 6, ImageChunk::METHOD, ImageChunk::WINDOWBITS,
+                               ImageChunk::MEMLEVEL, ImageChunk::STRATEGY));
+  std::vector<uint8_t> content(deflateBound(&strm, uncompressed.size()));
+  strm.next_in = uncompressed.data();
+  strm.avail_in = uncompressed.size();
+  strm.next_out = content.data();
+  strm.avail_out = content.size();
+  ASSERT_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+  content.resize(content.size() - strm.avail_out);
+  deflateEnd(&strm);
+  uint32_t crc = crc32(0, uncompressed.data(), uncompressed.size());
+
+  // The chunk inflates its data on demand to be reconstructed.
+  ImageChunk chunk(CHUNK_DEFLATE, 0, &content, content.size(), "a");
+  chunk.SetLazyUncompressedData(uncompressed.size(), crc);
+  ASSERT_EQ(uncompressed.size(), chunk.DataLengthForPatch());
+  ASSERT_TRUE(chunk.ReconstructDeflateChunk());
+  ASSERT_EQ(6, chunk.GetCompressLevel());
+
+  // And to be diffed, which should give the same patch as with the data in memory.
+  ImageChunk eager_chunk(CHUNK_DEFLATE, 0, &content, content.size(), "a");
+  eager_chunk.SetUncompressedData(uncompressed);
+  std::vector<uint8_t> patch_data;
+  ASSERT_TRUE(ImageChunk::MakePatch(chunk, eager_chunk, &patch_data, nullptr));
+  std::vector<uint8_t> eager_patch_data;
+  ASSERT_TRUE(ImageChunk::MakePatch(eager_chunk, eager_chunk, &eager_patch_data, nullptr));
+  ASSERT_EQ(eager_patch_data, patch_data);
+
+  // A mismatching CRC gets rejected.
+  ImageChunk corrupted_chunk(CHUNK_DEFLATE, 0, &content, content.size(), "a");
+  corrupted_chunk.SetLazyUncompressedData(uncompressed.size(), crc + 1);
+  ASSERT_FALSE(corrupted_chunk.ReconstructDeflateChunk());
+  ASSERT_FALSE(ImageChunk::MakePatch(corrupted_chunk, eager_chunk, &patch_data, nullptr));
+}
+
 TEST(ImgdiffTest, zip_mode_smoke_trailer_zeros) {
   // Generate 1 block of random data.
   std::string random_data;
@@ -490,6 +846,102 @@ TEST(ImgdiffTest, image_mode_merge_chunks) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgdiffTest, image_mode_jobs) {
+  std::string gzipped_source;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_source"), &gzipped_source));
+  std::string gzipped_target;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("gzipped_target"), &gzipped_target));
+
+  // Two gzipped chunks, with normal chunks around them.
+  std::string filler;
+  generate_n(back_inserter(filler), 65536, []() { return 'a' + rand() % 16; });
+  const std::string src = "abcdefg" + gzipped_source + filler + gzipped_source + "hijk";
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  filler[1000] = 'x';
+  const std::string tgt = "abcdefgxyz" + gzipped_target + filler + gzipped_target + "hijklm";
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  // The chunks diffed concurrently give the same patch.
+  TemporaryFile patch_file_jobs;
+  std::vector<const char*> args_jobs = {
+    "imgdiff", "--jobs=4", src_file.path, tgt_file.path, patch_file_jobs.path,
+  };
+  ASSERT_EQ(0, imgdiff(args_jobs.size(), args_jobs.data()));
+  std::string patch_jobs;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file_jobs.path, &patch_jobs));
+  ASSERT_EQ(patch, patch_jobs);
+
+  size_t num_normal;
+  size_t num_raw;
+  size_t num_deflate;
+  verify_patch_header(patch, &num_normal, &num_raw, &num_deflate);
+  ASSERT_EQ(2U, num_deflate);
+  verify_patched_image(src, patch, tgt);
+}
+
+TEST(ImgdiffTest, image_mode_raw_compression) {
+  std::string src;
+  generate_n(back_inserter(src), 65536, []() { return rand() % 256; });
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+
+  // A target that doesn't diff against the source, but compresses well by itself.
+  std::string block;
+  generate_n(back_inserter(block), 32768, []() { return rand() % 256; });
+  const std::string tgt = block + block;
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  ASSERT_EQ("IMGDIFF2", patch.substr(0, 8));
+
+  for (const std::string codec : { "brotli", "zstd", "auto" }) {
+    std::string option = "--raw-compression=" + codec;
+    TemporaryFile compressed_file;
+    std::vector<const char*> args_compressed = {
+      "imgdiff", option.c_str(), src_file.path, tgt_file.path, compressed_file.path,
+    };
+    ASSERT_EQ(0, imgdiff(args_compressed.size(), args_compressed.data()));
+    std::string compressed;
+    ASSERT_TRUE(android::base::ReadFileToString(compressed_file.path, &compressed));
+    ASSERT_EQ("IMGDIFF3", compressed.substr(0, 8));
+    ASSERT_EQ(CHUNK_RAW_COMPRESSED, get_unaligned<int32_t>(compressed.data() + 12));
+    ASSERT_LT(compressed.size(), patch.size());
+    verify_patched_image(src, compressed, tgt);
+  }
+
+  // Nothing is stored compressed if it doesn't save anything.
+  TemporaryFile random_file;
+  std::string random;
+  generate_n(back_inserter(random), 65536, []() { return rand() % 256; });
+  ASSERT_TRUE(android::base::WriteStringToFile(random, random_file.path));
+  std::vector<const char*> args_random = {
+    "imgdiff", "--raw-compression=auto", src_file.path, random_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args_random.size(), args_random.data()));
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  ASSERT_EQ("IMGDIFF2", patch.substr(0, 8));
+  verify_patched_image(src, patch, random);
+}
+
 TEST(ImgdiffTest, image_mode_spurious_magic) {
   // src: "abcdefgh" + '0x1f8b0b00' + some bytes.
   const std::vector<char> src_data = { 'a',    'b',    'c',    'd',    'e',    'f',    'g',
@@ -799,6 +1251,52 @@ TEST(ImgdiffTest, zip_mode_split_image_smoke) {
   ASSERT_EQ("2,30,34", split_src_ranges[3].ToString());
 }
 
+TEST(ImgdiffTest, zip_mode_split_image_keeps_sources) {
+  std::vector<uint8_t> content;
+  content.reserve(4096 * 20);
+  uint8_t n = 0;
+  generate_n(back_inserter(content), 4096 * 20, [&n]() { return n++ / 4096; });
+
+  // The source of "x" ends in the middle of the block where the source of "y" starts.
+  ZipModeImage tgt_image(false, 4096 * 10);
+  std::vector<ImageChunk> tgt_chunks = ConstructImageChunks(content, { { "p", 4096 * 6 },
+                                                                       { "x", 14336 },
+                                                                       { "y", 10240 },
+                                                                       { "q", 4096 * 4 },
+                                                                       { "CD", 200 } });
+  tgt_image.Initialize(std::move(tgt_chunks),
+                       std::vector<uint8_t>(content.begin(), content.begin() + 65736));
+
+  ZipModeImage src_image(true, 4096 * 10);
+  std::vector<ImageChunk> src_chunks = ConstructImageChunks(content, { { "p", 4096 * 6 },
+                                                                       { "x", 14336 },
+                                                                       { "y", 10240 },
+                                                                       { "q", 4096 * 4 },
+                                                                       { "CD", 5000 } });
+  src_image.Initialize(std::move(src_chunks),
+                       std::vector<uint8_t>(content.begin(), content.begin() + 70536));
+
+  std::vector<ZipModeImage> split_tgt_images;
+  std::vector<ZipModeImage> split_src_images;
+  std::vector<SortedRangeSet> split_src_ranges;
+  std::vector<size_t> predicted_patch_sizes;
+  ZipModeImage::SplitZipModeImageWithLimit(tgt_image, src_image, &split_tgt_images,
+                                           &split_src_images, &split_src_ranges,
+                                           &predicted_patch_sizes);
+
+  // Filling up the first split with "p" and "x" would trim the source of "y" in the second one.
+  // With "x" and "y" in the same split instead, both keep their sources.
+  // src_piece 1: p 6 blocks
+  // src_piece 2: x 4 blocks, y 2 blocks, q 4 blocks; CD 2 blocks
+  ASSERT_EQ(static_cast<size_t>(2), split_tgt_images.size());
+  ASSERT_EQ("2,0,6", split_src_ranges[0].ToString());
+  ASSERT_EQ("2,6,18", split_src_ranges[1].ToString());
+  ASSERT_EQ(static_cast<size_t>(24576), split_tgt_images[0][0].DataLengthForPatch());
+
+  // The chunks that keep their sources are predicted to diff down to a quarter of their size.
+  ASSERT_EQ((std::vector<size_t>{ 6144, 3584 + 2560 + 4096 + 200 }), predicted_patch_sizes);
+}
+
 TEST(ImgdiffTest, zip_mode_store_large_apk) {
   // Construct src and tgt zip files with limit = 10 blocks.
   //     src              tgt
@@ -843,6 +1341,67 @@ TEST(ImgdiffTest, zip_mode_store_large_apk) {
   GenerateAndCheckSplitTarget(debug_dir.path, 4, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_store_large_apk_jobs) {
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_store_entry(
+      { { "a", 3, 'a' }, { "b", 3, 'b' }, { "c", 8, 'c' }, { "d", 12, 'd' }, { "e", 3, 'e' } },
+      &tgt_writer);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_store_entry({ { "d", 12, 'd' }, { "c", 8, 'c' }, { "b", 3, 'b' }, { "a", 3, 'a' } },
+                        &src_writer);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  // Compute the patch serially, and then with the split pieces diffed concurrently. The memory
+  // limit is smaller than a single piece, so the pieces get diffed one at a time regardless.
+  TemporaryFile patch_file;
+  TemporaryFile split_info_file;
+  std::string split_info_arg = android::base::StringPrintf("--split-info=%s", split_info_file.path);
+  std::vector<const char*> args = {
+    "imgdiff", "-z", "--block-limit=10", split_info_arg.c_str(),
+    src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  for (const char* memory_limit : { "--memory-limit=0", "--memory-limit=1" }) {
+    TemporaryFile jobs_patch_file;
+    TemporaryFile jobs_split_info_file;
+    TemporaryDir debug_dir;
+    std::string jobs_split_info_arg =
+        android::base::StringPrintf("--split-info=%s", jobs_split_info_file.path);
+    std::string debug_dir_arg = android::base::StringPrintf("--debug-dir=%s", debug_dir.path);
+    std::vector<const char*> jobs_args = {
+      "imgdiff", "-z", "--block-limit=10", "--jobs=4", memory_limit, jobs_split_info_arg.c_str(),
+      debug_dir_arg.c_str(), src_file.path, tgt_file.path, jobs_patch_file.path,
+    };
+    ASSERT_EQ(0, imgdiff(jobs_args.size(), jobs_args.data()));
+
+    // The patch and the split info should come out in the same order.
+    std::string patch;
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+    std::string jobs_patch;
+    ASSERT_TRUE(android::base::ReadFileToString(jobs_patch_file.path, &jobs_patch));
+    ASSERT_EQ(patch, jobs_patch);
+
+    std::string split_info;
+    ASSERT_TRUE(android::base::ReadFileToString(split_info_file.path, &split_info));
+    std::string jobs_split_info;
+    ASSERT_TRUE(android::base::ReadFileToString(jobs_split_info_file.path, &jobs_split_info));
+    ASSERT_EQ(split_info, jobs_split_info);
+
+    std::string tgt;
+    ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+    GenerateAndCheckSplitTarget(debug_dir.path, 4, tgt);
+  }
+}
+
 TEST(ImgdiffTest, zip_mode_deflate_large_apk) {
   // Src and tgt zip files are constructed as follows.
   //     src               tgt
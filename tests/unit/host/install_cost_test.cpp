@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "private/io_trace.h"
+#include "updater/install_cost.h"
+
+static IoTraceRecord Record(IoTraceOp op, uint32_t file, uint32_t batch, uint32_t length) {
+  IoTraceRecord record{};
+  record.op = op;
+  record.file = file;
+  record.batch = batch;
+  record.length = length;
+  return record;
+}
+
+TEST(InstallCostTest, AddIoTrace) {
+  IoTrace trace;
+  trace.files = { "/tmp/images/system.img", "stash/0123", "stash/4567" };
+  trace.records = {
+    // A read of two extents.
+    Record(IoTraceOp::kRead, 0, 0, 4096),
+    Record(IoTraceOp::kRead, 0, 0, 8192),
+    Record(IoTraceOp::kWrite, 1, 1, 4096),
+    Record(IoTraceOp::kWrite, 2, 2, 4096),
+    Record(IoTraceOp::kFsync, 1, 3, 0),
+    Record(IoTraceOp::kWrite, 0, 4, 12288),
+    Record(IoTraceOp::kRead, 2, 5, 4096),
+  };
+
+  InstallCost cost;
+  cost.AddIoTrace(trace);
+  std::map<std::string, uint64_t> expected = {
+    { "io_system.img_read_bytes", 12288 }, { "io_system.img_read_ops", 1 },
+    { "io_system.img_write_bytes", 12288 }, { "io_system.img_write_ops", 1 },
+    { "io_stash_write_bytes", 8192 },       { "io_stash_write_ops", 2 },
+    { "io_stash_fsyncs", 1 },               { "io_stash_read_bytes", 4096 },
+    { "io_stash_read_ops", 1 },
+  };
+  ASSERT_EQ(expected, cost.values());
+}
+
+TEST(InstallCostTest, AddCommandPipe) {
+  InstallCost cost;
+  cost.AddCommandPipe(
+      "ui_print Patching system image...\n"
+      "set_progress 0.5000\n"
+      "log bytes_written_system.img: 81920\n"
+      "log latency_system.img_bsdiff_count: 3\n"
+      "log latency_system.img_bsdiff_p50_us: 1500\n"
+      "log latency_system.img_bsdiff_cpu_ms: 12\n"
+      "log latency_system.img_bsdiff_patch_ms: 20\n"
+      "log bytes_stashed_system.img: 8192\n"
+      "log phase_block_image_update_ms: 100\n"
+      "log bytes_written_system.img: 4096\n");
+  std::map<std::string, uint64_t> expected = {
+    { "bytes_written_system.img", 86016 },
+    { "bytes_stashed_system.img", 8192 },
+    { "latency_system.img_bsdiff_count", 3 },
+    { "latency_system.img_bsdiff_cpu_ms", 12 },
+  };
+  ASSERT_EQ(expected, cost.values());
+}
+
+TEST(InstallCostTest, ToString_Parse) {
+  InstallCost cost;
+  cost.Set("io_system.img_read_bytes", 4096);
+  cost.Set("cpu_ms", 250);
+  cost.Set("bytes_stashed_system.img", 0);
+  std::string content = cost.ToString();
+  ASSERT_EQ("bytes_stashed_system.img: 0\ncpu_ms: 250\nio_system.img_read_bytes: 4096\n", content);
+
+  InstallCost parsed;
+  ASSERT_TRUE(InstallCost::Parse("# The baseline.\n" + content, &parsed));
+  ASSERT_EQ(cost.values(), parsed.values());
+
+  ASSERT_FALSE(InstallCost::Parse("cpu_ms 250\n", &parsed));
+  ASSERT_FALSE(InstallCost::Parse("cpu_ms: -1\n", &parsed));
+}
+
+TEST(InstallCostTest, FindRegressions) {
+  InstallCost baseline;
+  baseline.Set("io_system.img_read_bytes", 4096);
+  baseline.Set("io_system.img_write_ops", 10);
+  baseline.Set("cpu_ms", 1000);
+  baseline.Set("latency_system.img_move_cpu_ms", 2);
+  baseline.Set("peak_rss_kb", 100000);
+
+  InstallCost cost;
+  cost.Set("io_system.img_read_bytes", 8192);
+  cost.Set("io_system.img_write_ops", 9);
+  // Within 10%, or within kMeasurementSlack.
+  cost.Set("cpu_ms", 1090);
+  cost.Set("latency_system.img_move_cpu_ms", 8);
+  cost.Set("peak_rss_kb", 120000);
+  cost.Set("io_stash_write_bytes", 4096);
+
+  std::vector<std::string> expected = {
+    "io_stash_write_bytes: 0 -> 4096 (new)",
+    "io_system.img_read_bytes: 4096 -> 8192 (+100.0%)",
+    "peak_rss_kb: 100000 -> 120000 (+20.0%)",
+  };
+  ASSERT_EQ(expected, cost.FindRegressions(baseline, 10));
+  ASSERT_TRUE(baseline.FindRegressions(baseline, 0).empty());
+
+  // Without tolerance, the CPU time counts too.
+  ASSERT_EQ(4u, cost.FindRegressions(baseline, 0).size());
+}
+
+TEST(InstallCostTest, IsMeasurement) {
+  ASSERT_TRUE(InstallCost::IsMeasurement("cpu_ms"));
+  ASSERT_TRUE(InstallCost::IsMeasurement("peak_rss_kb"));
+  ASSERT_TRUE(InstallCost::IsMeasurement("latency_system.img_bsdiff_cpu_ms"));
+  ASSERT_FALSE(InstallCost::IsMeasurement("latency_system.img_bsdiff_count"));
+  ASSERT_FALSE(InstallCost::IsMeasurement("io_system.img_read_bytes"));
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <divsufsort.h>
+#include <divsufsort64.h>
+#include <gtest/gtest.h>
+
+#include "applypatch/suffix_array_cache.h"
+#include "applypatch/suffix_sort.h"
+
+// Returns the length of the longest prefix of |target| that occurs in |text|.
+static size_t LongestPrefix(const std::string& text, const std::string& target) {
+  size_t longest = 0;
+  for (size_t pos = 0; pos < text.size(); pos++) {
+    size_t length = 0;
+    while (pos + length < text.size() && length < target.size() &&
+           text[pos + length] == target[length]) {
+      length++;
+    }
+    longest = std::max(longest, length);
+  }
+  return longest;
+}
+
+static void CheckSearchPrefix(const CachedSuffixArrayIndex& index, const std::string& text,
+                              const std::string& target) {
+  size_t length;
+  uint64_t pos;
+  index.SearchPrefix(reinterpret_cast<const uint8_t*>(target.data()), target.size(), &length, &pos);
+  ASSERT_EQ(LongestPrefix(text, target), length) << target;
+  ASSERT_LE(pos + length, text.size());
+  ASSERT_EQ(target.substr(0, length), text.substr(pos, length));
+}
+
+TEST(SuffixArrayCacheTest, SearchPrefix) {
+  std::string text;
+  for (size_t i = 0; i < 2000; i++) {
+    text.push_back('a' + rand() % 4);
+  }
+  TemporaryDir cache_dir;
+  auto index = CachedSuffixArrayIndex::Create(
+      cache_dir.path, reinterpret_cast<const uint8_t*>(text.data()), text.size());
+  ASSERT_NE(nullptr, index);
+
+  for (size_t i = 0; i < 200; i++) {
+    size_t start = rand() % text.size();
+    std::string target = text.substr(start, rand() % 64);
+    // Mutate some of the targets so that they only partially match.
+    if (i % 2 == 0 && !target.empty()) {
+      target[rand() % target.size()] = 'e';
+    }
+    CheckSearchPrefix(*index, text, target);
+  }
+  CheckSearchPrefix(*index, text, "");
+  CheckSearchPrefix(*index, text, "zzz");
+}
+
+TEST(SuffixArrayCacheTest, ReuseCache) {
+  std::string text = "abracadabra, abracadabra";
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(text.data());
+  TemporaryDir cache_dir;
+  ASSERT_NE(nullptr, CachedSuffixArrayIndex::Create(cache_dir.path, data, text.size()));
+
+  std::string path = CachedSuffixArrayIndex::CachePath(cache_dir.path, data, text.size());
+  struct stat sb;
+  ASSERT_EQ(0, stat(path.c_str(), &sb));
+  std::string cached;
+  ASSERT_TRUE(android::base::ReadFileToString(path, &cached));
+
+  // The cached index gets mapped as is, without being rebuilt.
+  auto index = CachedSuffixArrayIndex::Create(cache_dir.path, data, text.size());
+  ASSERT_NE(nullptr, index);
+  CheckSearchPrefix(*index, text, "cadabra");
+  std::string reused;
+  ASSERT_TRUE(android::base::ReadFileToString(path, &reused));
+  ASSERT_EQ(cached, reused);
+
+  // A different text gets its own cache file.
+  std::string other = "abracadabra";
+  ASSERT_NE(path,
+            CachedSuffixArrayIndex::CachePath(
+                cache_dir.path, reinterpret_cast<const uint8_t*>(other.data()), other.size()));
+}
+
+TEST(SuffixArrayCacheTest, RebuildMalformedCache) {
+  std::string text = "the quick brown fox jumps over the lazy dog";
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(text.data());
+  TemporaryDir cache_dir;
+  std::string path = CachedSuffixArrayIndex::CachePath(cache_dir.path, data, text.size());
+  ASSERT_TRUE(android::base::WriteStringToFile("garbage", path));
+
+  auto index = CachedSuffixArrayIndex::Create(cache_dir.path, data, text.size());
+  ASSERT_NE(nullptr, index);
+  CheckSearchPrefix(*index, text, "the lazy cat");
+
+  // Truncated ones get rebuilt too.
+  std::string cached;
+  ASSERT_TRUE(android::base::ReadFileToString(path, &cached));
+  ASSERT_TRUE(android::base::WriteStringToFile(cached.substr(0, cached.size() - 1), path));
+  index = CachedSuffixArrayIndex::Create(cache_dir.path, data, text.size());
+  ASSERT_NE(nullptr, index);
+  CheckSearchPrefix(*index, text, "over the");
+  std::string rebuilt;
+  ASSERT_TRUE(android::base::ReadFileToString(path, &rebuilt));
+  ASSERT_EQ(cached, rebuilt);
+}
+
+// Sorts the suffixes of |text| on 1 and on |threads| threads, which must agree.
+template <typename T>
+static void CheckSortSuffixes(const std::string& text, size_t threads) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(text.data());
+  std::vector<T> expected(text.size());
+  ASSERT_TRUE(SortSuffixes(data, text.size(), expected.data(), 1));
+  std::vector<T> sa(text.size());
+  ASSERT_TRUE(SortSuffixes(data, text.size(), sa.data(), threads));
+  ASSERT_EQ(expected, sa);
+  for (size_t i = 1; i < sa.size(); i++) {
+    ASSERT_LT(text.compare(sa[i - 1], std::string::npos, text, sa[i], std::string::npos), 0);
+  }
+}
+
+TEST(SuffixArrayCacheTest, SortSuffixes) {
+  std::string random;
+  for (size_t i = 0; i < 20000; i++) {
+    random.push_back('a' + rand() % 4);
+  }
+  // Long runs and repeats take many rounds of doubling; the zeros share the bucket with the short
+  // suffixes.
+  std::string repetitive = std::string(5000, '\0') + random.substr(0, 1000) +
+                           std::string(3000, '\0') + random.substr(0, 1000) + "x";
+  for (const auto& text : { std::string(), std::string("a"), std::string("abracadabra"),
+                            std::string(100, '\0'), random, repetitive }) {
+    for (size_t threads : { 2, 5 }) {
+      CheckSortSuffixes<saidx_t>(text, threads);
+      CheckSortSuffixes<saidx64_t>(text, threads);
+    }
+  }
+}
+
+TEST(SuffixArrayCacheTest, CreateInMemory) {
+  std::string text;
+  for (size_t i = 0; i < 5000; i++) {
+    text.push_back('a' + rand() % 4);
+  }
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(text.data());
+  auto index = CachedSuffixArrayIndex::CreateInMemory(data, text.size(), 4);
+  ASSERT_NE(nullptr, index);
+  for (size_t i = 0; i < 100; i++) {
+    CheckSearchPrefix(*index, text, text.substr(rand() % text.size(), rand() % 64));
+  }
+
+  // The index sorted on several threads is the same as the one built on a single thread.
+  TemporaryDir cache_dir;
+  ASSERT_NE(nullptr, CachedSuffixArrayIndex::Create(cache_dir.path, data, text.size(), 1));
+  std::string path = CachedSuffixArrayIndex::CachePath(cache_dir.path, data, text.size());
+  std::string cached;
+  ASSERT_TRUE(android::base::ReadFileToString(path, &cached));
+  ASSERT_EQ(0, unlink(path.c_str()));
+  ASSERT_NE(nullptr, CachedSuffixArrayIndex::Create(cache_dir.path, data, text.size(), 4));
+  std::string sorted_in_parallel;
+  ASSERT_TRUE(android::base::ReadFileToString(path, &sorted_in_parallel));
+  ASSERT_EQ(cached, sorted_in_parallel);
+}
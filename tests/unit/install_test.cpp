@@ -32,6 +32,7 @@
 #include <ziparchive/zip_writer.h>
 
 #include "install/install.h"
+#include "install/package_metadata.h"
 #include "install/wipe_device.h"
 #include "otautil/paths.h"
 #include "private/setup_commands.h"
@@ -85,6 +86,31 @@ TEST(InstallTest, read_metadata_from_package_no_entry) {
   CloseArchive(zip);
 }
 
+TEST(InstallTest, package_metadata_read_once) {
+  TemporaryFile temp_file;
+  BuildZipArchive({ { "META-INF/com/android/metadata", "ota-type=BRICK\npre-device=foo\n" } },
+                  temp_file.release(), kCompressDeflated);
+  auto package = Package::CreateFilePackage(temp_file.path, nullptr);
+  ASSERT_NE(nullptr, package);
+
+  const PackageMetadata* metadata = PackageMetadata::Get(package.get());
+  ASSERT_NE(nullptr, metadata);
+  ASSERT_TRUE(metadata->has_values());
+  ASSERT_EQ("BRICK", metadata->ota_type());
+  ASSERT_EQ("foo", metadata->GetValue("pre-device"));
+  ASSERT_EQ("", metadata->GetValue("serialno"));
+  ASSERT_EQ(nullptr, metadata->ota_metadata());
+
+  // The later lookups get the same metadata, which may also be shared with a copy of the package.
+  ASSERT_EQ(metadata, PackageMetadata::Get(package.get()));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  auto memory_package =
+      Package::CreateMemoryPackage(std::vector<uint8_t>(content.begin(), content.end()), nullptr);
+  memory_package->SetMetadata(package->GetMetadata());
+  ASSERT_EQ(metadata, PackageMetadata::Get(memory_package.get()));
+}
+
 TEST(InstallTest, read_wipe_ab_partition_list) {
   std::vector<std::string> partition_list = {
     "/dev/block/bootdevice/by-name/system_a", "/dev/block/bootdevice/by-name/system_b",
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "private/io_trace.h"
+
+class IoTraceTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    IoTracer::Get().Clear();
+  }
+
+  void TearDown() override {
+    IoTracer::Get().Clear();
+  }
+};
+
+TEST_F(IoTraceTest, Disabled) {
+  IoTracer& tracer = IoTracer::Get();
+  ASSERT_EQ(IoTracer::kNoFile, tracer.FileId("/dev/block/system"));
+  std::vector<Extent> extents = { { 0, 4096 } };
+  { ScopedIoTrace io_trace(IoTraceOp::kRead, 0, extents); }
+
+  // Nothing gets written.
+  TemporaryDir temp_dir;
+  std::string path = std::string(temp_dir.path) + "/io_trace";
+  ASSERT_TRUE(tracer.Write(path));
+  ASSERT_FALSE(android::base::ReadFileToString(path, nullptr));
+}
+
+TEST_F(IoTraceTest, WriteAndRead) {
+  IoTracer& tracer = IoTracer::Get();
+  tracer.Enable();
+  uint32_t device = tracer.FileId("/dev/block/system");
+  uint32_t stash = tracer.FileId("stash/abcd");
+  ASSERT_EQ(0u, device);
+  ASSERT_EQ(1u, stash);
+  ASSERT_EQ(device, tracer.FileId("/dev/block/system"));
+
+  std::vector<Extent> reads = { { 8192, 4096 }, { 40960, 8192 } };
+  { ScopedIoTrace io_trace(IoTraceOp::kRead, device, reads); }
+  std::vector<Extent> writes = { { 0, 12288 } };
+  { ScopedIoTrace io_trace(IoTraceOp::kWrite, stash, writes); }
+  { ScopedIoTrace io_trace(IoTraceOp::kFsync, stash); }
+  // Not recorded.
+  { ScopedIoTrace io_trace(IoTraceOp::kWrite, IoTracer::kNoFile, writes); }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(tracer.Write(temp_file.path));
+
+  IoTrace trace;
+  ASSERT_TRUE(ReadIoTrace(temp_file.path, &trace));
+  ASSERT_EQ((std::vector<std::string>{ "/dev/block/system", "stash/abcd" }), trace.files);
+  ASSERT_EQ(4u, trace.records.size());
+
+  const auto& records = trace.records;
+  ASSERT_EQ(IoTraceOp::kRead, records[0].op);
+  ASSERT_EQ(device, records[0].file);
+  ASSERT_EQ(8192u, records[0].offset);
+  ASSERT_EQ(4096u, records[0].length);
+  ASSERT_EQ(40960u, records[1].offset);
+  ASSERT_EQ(8192u, records[1].length);
+  // The extents of an operation share the batch and the timing.
+  ASSERT_EQ(records[0].batch, records[1].batch);
+  ASSERT_EQ(records[0].start_ns, records[1].start_ns);
+  ASSERT_EQ(records[0].tid, records[1].tid);
+
+  ASSERT_EQ(IoTraceOp::kWrite, records[2].op);
+  ASSERT_EQ(stash, records[2].file);
+  ASSERT_EQ(12288u, records[2].length);
+  ASSERT_NE(records[1].batch, records[2].batch);
+  ASSERT_LE(records[1].start_ns, records[2].start_ns);
+
+  ASSERT_EQ(IoTraceOp::kFsync, records[3].op);
+  ASSERT_EQ(0u, records[3].length);
+}
+
+TEST_F(IoTraceTest, ReadInvalid) {
+  TemporaryFile temp_file;
+  IoTrace trace;
+  ASSERT_TRUE(android::base::WriteStringToFile("not a trace", temp_file.path));
+  ASSERT_FALSE(ReadIoTrace(temp_file.path, &trace));
+
+  // Truncated records.
+  IoTracer& tracer = IoTracer::Get();
+  tracer.Enable();
+  std::vector<Extent> extents = { { 0, 4096 } };
+  { ScopedIoTrace io_trace(IoTraceOp::kRead, tracer.FileId("/dev/block/vendor"), extents); }
+  ASSERT_TRUE(tracer.Write(temp_file.path));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  ASSERT_TRUE(ReadIoTrace(temp_file.path, &trace));
+  ASSERT_TRUE(android::base::WriteStringToFile(content.substr(0, content.size() - 1),
+                                               temp_file.path));
+  ASSERT_FALSE(ReadIoTrace(temp_file.path, &trace));
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "otautil/live_stats.h"
+#include "otautil/phase_stats.h"
+
+TEST(LiveStatsTest, FormatLiveStats) {
+  SetLiveCounter("test_counter", 42);
+  std::vector<std::string> lines;
+  {
+    ScopedPhase phase("live_stats_test");
+    lines = FormatLiveStats();
+  }
+  ClearPhaseStats();
+
+  auto has_line = [&lines](const std::string& line) {
+    return std::find(lines.begin(), lines.end(), line) != lines.end();
+  };
+  ASSERT_TRUE(has_line("pid: " + std::to_string(getpid())));
+  ASSERT_TRUE(has_line("phases: live_stats_test"));
+  ASSERT_TRUE(has_line("test_counter: 42"));
+  ASSERT_TRUE(std::any_of(lines.begin(), lines.end(), [](const std::string& line) {
+    return android::base::StartsWith(line, "cpu_ms_" + std::to_string(gettid()) + "_");
+  }));
+}
+
+TEST(LiveStatsTest, ReadDiskStats) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "   7       0 loop0 0 0 0 0 0 0 0 0 0 0 0\n"
+      " 259       0 sda 100 5 2048 30 40 2 4096 50 0 60 80\n"
+      " 259       1 sda1 10 0 8 3 0 0 0 0 0 3 3\n"
+      "garbage\n",
+      temp_file.path));
+  std::map<std::string, DiskIo> disks = ReadDiskStats(temp_file.path);
+  ASSERT_EQ(2u, disks.size());
+  ASSERT_EQ(2048u * 512, disks["sda"].read_bytes);
+  ASSERT_EQ(4096u * 512, disks["sda"].write_bytes);
+  ASSERT_EQ(8u * 512, disks["sda1"].read_bytes);
+  ASSERT_EQ(0u, disks["sda1"].write_bytes);
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "private/load_governor.h"
+
+class LoadGovernorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    thermal_dir_ = std::string(dir_.path) + "/thermal";
+    pressure_dir_ = std::string(dir_.path) + "/pressure";
+    ASSERT_EQ(0, mkdir(thermal_dir_.c_str(), 0755));
+    ASSERT_EQ(0, mkdir(pressure_dir_.c_str(), 0755));
+    AddThermalZone(0, "45000\n");
+    AddThermalZone(1, "52000\n");
+    SetPressure("cpu", 0);
+    SetPressure("io", 0);
+    SetPressure("memory", 0);
+  }
+
+  void AddThermalZone(int index, const std::string& temp) {
+    std::string zone = thermal_dir_ + "/thermal_zone" + std::to_string(index);
+    ASSERT_EQ(0, mkdir(zone.c_str(), 0755));
+    ASSERT_TRUE(android::base::WriteStringToFile(temp, zone + "/temp"));
+  }
+
+  void SetPressure(const std::string& resource, float some_avg10) {
+    std::string content = "some avg10=" + std::to_string(some_avg10) +
+                          " avg60=0.00 avg300=0.00 total=1234\n"
+                          "full avg10=99.00 avg60=0.00 avg300=0.00 total=1234\n";
+    ASSERT_TRUE(android::base::WriteStringToFile(content, pressure_dir_ + "/" + resource));
+  }
+
+  TemporaryDir dir_;
+  std::string thermal_dir_;
+  std::string pressure_dir_;
+};
+
+TEST_F(LoadGovernorTest, Sample) {
+  AddThermalZone(2, "60\n");
+  SetPressure("io", 12.5);
+  LoadGovernor governor(thermal_dir_, pressure_dir_);
+  LoadGovernor::Load load = governor.Sample();
+  // Whole degrees are taken as such.
+  ASSERT_EQ(60000, load.temperature);
+  ASSERT_FLOAT_EQ(0, load.cpu_pressure);
+  ASSERT_FLOAT_EQ(12.5, load.io_pressure);
+  ASSERT_FLOAT_EQ(0, load.memory_pressure);
+}
+
+TEST_F(LoadGovernorTest, Sample_missing) {
+  LoadGovernor governor(thermal_dir_ + "/missing", pressure_dir_ + "/missing");
+  LoadGovernor::Load load = governor.Sample();
+  ASSERT_EQ(-1, load.temperature);
+  ASSERT_FLOAT_EQ(0, load.cpu_pressure);
+  ASSERT_EQ(8U, governor.Threads("test threads", 8));
+  ASSERT_EQ(64U, governor.Budget("test budget", 64, 16));
+}
+
+TEST_F(LoadGovernorTest, IgnoreLoad) {
+  AddThermalZone(2, "95000\n");
+  SetPressure("memory", 60);
+  LoadGovernor governor(thermal_dir_, pressure_dir_);
+  ASSERT_EQ(1U, governor.Threads("test threads", 8));
+  governor.IgnoreLoad();
+  ASSERT_EQ(-1, governor.Sample().temperature);
+  ASSERT_EQ(8U, governor.Threads("test threads", 8));
+  ASSERT_EQ(64U, governor.Budget("test budget", 64, 16));
+}
+
+TEST_F(LoadGovernorTest, Threads) {
+  LoadGovernor governor(thermal_dir_, pressure_dir_);
+  ASSERT_EQ(8U, governor.Threads("test threads", 8));
+  ASSERT_EQ(1U, governor.Threads("test threads", 0));
+}
+
+TEST_F(LoadGovernorTest, ThreadScale) {
+  LoadGovernor::Load load;
+  ASSERT_FLOAT_EQ(1, LoadGovernor::ThreadScale(load));
+
+  // Halfway between the soft and the hard limits.
+  load.temperature = (LoadGovernor::kSoftTemperature + LoadGovernor::kHardTemperature) / 2;
+  ASSERT_FLOAT_EQ(0.5, LoadGovernor::ThreadScale(load));
+
+  // The most limiting one counts.
+  load.cpu_pressure = LoadGovernor::kHardPressure;
+  ASSERT_FLOAT_EQ(0, LoadGovernor::ThreadScale(load));
+
+  // Memory pressure only shrinks the budgets.
+  load = {};
+  load.memory_pressure = LoadGovernor::kHardMemoryPressure;
+  ASSERT_FLOAT_EQ(1, LoadGovernor::ThreadScale(load));
+  ASSERT_FLOAT_EQ(0, LoadGovernor::BudgetScale(load));
+}
+
+TEST_F(LoadGovernorTest, Hot) {
+  AddThermalZone(2, std::to_string(LoadGovernor::kHardTemperature) + "\n");
+  LoadGovernor governor(thermal_dir_, pressure_dir_);
+  ASSERT_EQ(1U, governor.Threads("test threads", 8));
+  ASSERT_EQ(64U, governor.Budget("test budget", 64, 16));
+}
+
+TEST_F(LoadGovernorTest, MemoryPressure) {
+  SetPressure("memory",
+              (LoadGovernor::kSoftMemoryPressure + LoadGovernor::kHardMemoryPressure) / 2);
+  LoadGovernor governor(thermal_dir_, pressure_dir_);
+  ASSERT_EQ(8U, governor.Threads("test threads", 8));
+  ASSERT_EQ(32U, governor.Budget("test budget", 64, 16));
+  // Down to the minimum, but no further.
+  ASSERT_EQ(40U, governor.Budget("test budget", 64, 40));
+}
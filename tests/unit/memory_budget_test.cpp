@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "otautil/memory_budget.h"
+
+using Priority = MemoryBudget::Priority;
+
+TEST(MemoryBudgetTest, Reserve) {
+  MemoryBudget budget(100);
+  auto a = budget.Reserve("a", 60, 60, Priority::kBuffer, false);
+  ASSERT_NE(nullptr, a);
+  ASSERT_EQ(60u, a->size());
+  ASSERT_EQ(40u, budget.available());
+
+  // Gets what's left, down to the minimum.
+  auto b = budget.Reserve("b", 60, 20, Priority::kBuffer, false);
+  ASSERT_NE(nullptr, b);
+  ASSERT_EQ(40u, b->size());
+  ASSERT_EQ(0u, budget.available());
+  ASSERT_EQ(nullptr, budget.Reserve("c", 10, 1, Priority::kBuffer, false));
+
+  b->Shrink(30);
+  ASSERT_EQ(30u, b->size());
+  ASSERT_EQ(10u, budget.available());
+  // Shrink() doesn't grow a reservation.
+  b->Shrink(50);
+  ASSERT_EQ(30u, b->size());
+
+  a.reset();
+  ASSERT_EQ(70u, budget.available());
+}
+
+TEST(MemoryBudgetTest, ReclaimLowerPriorities) {
+  MemoryBudget budget(100);
+  auto cache = budget.Reserve("cache", 80, 10, Priority::kCache, true);
+  auto buffer = budget.Reserve("buffer", 20, 20, Priority::kBuffer, true);
+  ASSERT_EQ(80u, cache->size());
+  ASSERT_EQ(20u, buffer->size());
+
+  // The cache gives way, down to its minimum, and the buffer of the same priority doesn't.
+  auto required = budget.Reserve("required", 50, 50, Priority::kRequired, false);
+  ASSERT_NE(nullptr, required);
+  ASSERT_EQ(50u, required->size());
+  ASSERT_EQ(30u, cache->size());
+
+  auto another = budget.Reserve("another", 50, 5, Priority::kBuffer, false);
+  ASSERT_NE(nullptr, another);
+  ASSERT_EQ(20u, another->size());
+  ASSERT_EQ(10u, cache->size());
+  ASSERT_EQ(20u, buffer->size());
+
+  // Nothing can be reclaimed from a priority that's not lower.
+  ASSERT_EQ(nullptr, budget.Reserve("cache2", 10, 10, Priority::kCache, true));
+  ASSERT_EQ(10u, cache->size());
+}
+
+TEST(MemoryBudgetTest, ReclaimCaches) {
+  MemoryBudget budget(100);
+  auto cache = budget.Reserve("cache", 50, 10, Priority::kCache, true);
+  auto fixed = budget.Reserve("fixed", 20, 0, Priority::kCache, false);
+  auto buffer = budget.Reserve("buffer", 20, 0, Priority::kBuffer, true);
+
+  ASSERT_EQ(20u, budget.ReclaimCaches(0.5));
+  ASSERT_EQ(30u, cache->size());
+  ASSERT_EQ(20u, fixed->size());
+  ASSERT_EQ(20u, buffer->size());
+  ASSERT_EQ(30u, budget.available());
+
+  ASSERT_EQ(20u, budget.ReclaimCaches(1));
+  ASSERT_EQ(10u, cache->size());
+}
+
+TEST(MemoryBudgetTest, Export) {
+  MemoryBudget budget(100);
+  auto a = budget.Reserve("a", 30, 30, Priority::kRequired, false);
+  budget.Export();
+  ASSERT_STREQ("70", getenv(MemoryBudget::kEnvironmentVariable));
+  unsetenv(MemoryBudget::kEnvironmentVariable);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "private/block_buffer.h"
+#include "private/memory_stash.h"
+
+TEST(MemoryStashTest, AddFindErase) {
+  MemoryStash stash(8192);
+  ASSERT_TRUE(stash.Fits(8192));
+  ASSERT_FALSE(stash.Fits(8193));
+  ASSERT_EQ(nullptr, stash.Find("a"));
+
+  stash.Add("a", BlockBuffer(4096, 'a'));
+  const BlockBuffer* data = stash.Find("a");
+  ASSERT_NE(nullptr, data);
+  ASSERT_EQ(BlockBuffer(4096, 'a'), *data);
+  ASSERT_EQ(4096u, stash.size());
+
+  // Replacing a stash doesn't count it twice.
+  stash.Add("a", BlockBuffer(8192, 'b'));
+  ASSERT_EQ(8192u, stash.size());
+
+  ASSERT_TRUE(stash.Erase("a"));
+  ASSERT_FALSE(stash.Erase("a"));
+  ASSERT_EQ(nullptr, stash.Find("a"));
+  ASSERT_EQ(0u, stash.size());
+  ASSERT_TRUE(stash.empty());
+}
+
+TEST(MemoryStashTest, SpillOldestFirst) {
+  MemoryStash stash(12288);
+  stash.Add("a", BlockBuffer(4096, 'a'));
+  stash.Add("b", BlockBuffer(4096, 'b'));
+  stash.Add("c", BlockBuffer(4096, 'c'));
+
+  std::vector<std::string> spilled;
+  auto spill = [&spilled](const std::string& id, const BlockBuffer& data) {
+    EXPECT_EQ(BlockBuffer(4096, id[0]), data);
+    spilled.push_back(id);
+    return true;
+  };
+
+  // Room for another 8192 bytes.
+  ASSERT_TRUE(stash.Spill(8192, spill));
+  ASSERT_EQ((std::vector<std::string>{ "a", "b" }), spilled);
+  ASSERT_EQ(nullptr, stash.Find("a"));
+  ASSERT_NE(nullptr, stash.Find("c"));
+  ASSERT_EQ(4096u, stash.size());
+
+  // Nothing to do if it fits already.
+  ASSERT_TRUE(stash.Spill(8192, spill));
+  ASSERT_EQ(2u, spilled.size());
+
+  ASSERT_TRUE(stash.Spill(stash.capacity(), spill));
+  ASSERT_EQ((std::vector<std::string>{ "a", "b", "c" }), spilled);
+  ASSERT_TRUE(stash.empty());
+}
+
+TEST(MemoryStashTest, SpillIf) {
+  MemoryStash stash(12288);
+  stash.Add("a", BlockBuffer(4096, 'a'));
+  stash.Add("b", BlockBuffer(4096, 'b'));
+  stash.Add("c", BlockBuffer(4096, 'c'));
+
+  std::vector<std::string> spilled;
+  ASSERT_TRUE(stash.SpillIf([](const std::string& id) { return id != "b"; },
+                            [&spilled](const std::string& id, const BlockBuffer&) {
+                              spilled.push_back(id);
+                              return true;
+                            }));
+  ASSERT_EQ((std::vector<std::string>{ "a", "c" }), spilled);
+  ASSERT_NE(nullptr, stash.Find("b"));
+  ASSERT_EQ(4096u, stash.size());
+}
+
+TEST(MemoryStashTest, SpillFailure) {
+  MemoryStash stash(8192);
+  stash.Add("a", BlockBuffer(4096, 'a'));
+  stash.Add("b", BlockBuffer(4096, 'b'));
+
+  auto spill = [](const std::string& id, const BlockBuffer&) { return id != "b"; };
+  ASSERT_FALSE(stash.Spill(stash.capacity(), spill));
+
+  // The stash that failed to spill stays in memory.
+  ASSERT_EQ(nullptr, stash.Find("a"));
+  ASSERT_NE(nullptr, stash.Find("b"));
+  ASSERT_EQ(4096u, stash.size());
+}
+
+TEST(MemoryStashTest, Disabled) {
+  MemoryStash stash(0);
+  ASSERT_FALSE(stash.Fits(4096));
+  ASSERT_TRUE(stash.Spill(stash.capacity(), [](const std::string&, const BlockBuffer&) {
+    ADD_FAILURE() << "Nothing to spill";
+    return false;
+  }));
+}
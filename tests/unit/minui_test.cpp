@@ -16,6 +16,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <limits>
 #include <vector>
@@ -23,6 +24,7 @@
 #include <gtest/gtest.h>
 
 #include "minui/minui.h"
+#include "private/frame_damage.h"
 
 TEST(GRSurfaceTest, Create_aligned) {
   auto surface = GRSurface::Create(9, 11, 9, 1);
@@ -52,3 +54,32 @@ TEST(GRSurfaceTest, Clone) {
   ASSERT_EQ(std::vector(image->data(), image->data() + image->data_size()),
             std::vector(image_copy->data(), image_copy->data() + image->data_size()));
 }
+
+TEST(FrameDamageTest, Sync) {
+  auto frame = GRSurface::Create(4, 6, 8, 1);
+  ASSERT_TRUE(frame);
+  memset(frame->data(), 0, 6 * 8);
+  std::vector<uint8_t> buffers[2] = { std::vector<uint8_t>(6 * 8, 0xff),
+                                      std::vector<uint8_t>(6 * 8, 0xff) };
+  auto frame_contents = [&frame]() { return std::vector(frame->data(), frame->data() + 6 * 8); };
+
+  FrameDamage damage;
+  ASSERT_TRUE(damage.Init(*frame, 2));
+  // Each buffer gets fully written once.
+  ASSERT_EQ(6, damage.Sync(*frame, buffers[0].data(), 0));
+  ASSERT_EQ(frame_contents(), buffers[0]);
+  frame->data()[2 * 8 + 5] = 1;
+  ASSERT_EQ(6, damage.Sync(*frame, buffers[1].data(), 1));
+  ASSERT_EQ(frame_contents(), buffers[1]);
+
+  // Buffer 0 misses the changes of the last two frames, and buffer 1 the last one.
+  frame->data()[4 * 8] = 2;
+  ASSERT_EQ(2, damage.Sync(*frame, buffers[0].data(), 0));
+  ASSERT_EQ(frame_contents(), buffers[0]);
+  ASSERT_EQ(1, damage.Sync(*frame, buffers[1].data(), 1));
+  ASSERT_EQ(frame_contents(), buffers[1]);
+
+  // Writing the same contents again isn't a change.
+  frame->data()[4 * 8] = 2;
+  ASSERT_EQ(0, damage.Sync(*frame, buffers[0].data(), 0));
+}
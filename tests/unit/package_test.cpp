@@ -17,6 +17,7 @@
 #include <stdio.h>
 
 #include <functional>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -80,6 +81,37 @@ TEST_F(PackageTest, ReadFullyAtOffset_failure) {
   }
 }
 
+TEST_F(PackageTest, ReadFullyAtOffset_small_reads) {
+  // Runs of small reads, sequential and not, across the cached blocks of a FilePackage.
+  TemporaryFile temp_file;
+  std::string content(2 * 1024 * 1024 + 100, '\0');
+  std::mt19937 rng(0);
+  for (auto& c : content) {
+    c = static_cast<char>(rng());
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  auto package = Package::CreateFilePackage(temp_file.path, nullptr);
+  ASSERT_TRUE(package);
+
+  auto check_read = [&](uint64_t offset, uint64_t size) {
+    std::vector<uint8_t> buffer(size);
+    ASSERT_TRUE(package->ReadFullyAtOffset(buffer.data(), size, offset));
+    ASSERT_EQ(content.substr(offset, size), std::string(buffer.begin(), buffer.end()));
+  };
+  for (uint64_t offset = 0; offset + 1000 <= content.size(); offset += 1000) {
+    check_read(offset, 1000);
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    uint64_t size = rng() % 70000;
+    check_read(rng() % (content.size() - size), size);
+  }
+  check_read(content.size() - 22, 22);
+  check_read(content.size() - 1, 1);
+
+  std::vector<uint8_t> buffer(10);
+  ASSERT_FALSE(package->ReadFullyAtOffset(buffer.data(), 10, content.size() - 5));
+}
+
 TEST_F(PackageTest, UpdateHashAtOffset_sha1_hash) {
   // Check that the hash matches for first half of the file.
   uint64_t hash_size = file_content_.size() / 2;
@@ -99,6 +131,37 @@ TEST_F(PackageTest, UpdateHashAtOffset_sha1_hash) {
   }
 }
 
+TEST_F(PackageTest, UpdateHashAtOffset_multiple_hashers) {
+  // The hashers run on separate threads, and each of them should see all the data in order.
+  uint64_t hash_size = file_content_.size() - 10;
+  std::vector<uint8_t> expected_sha1(SHA_DIGEST_LENGTH);
+  SHA1(reinterpret_cast<uint8_t*>(file_content_.data()) + 5, hash_size, expected_sha1.data());
+  std::vector<uint8_t> expected_sha256(SHA256_DIGEST_LENGTH);
+  SHA256(reinterpret_cast<uint8_t*>(file_content_.data()) + 5, hash_size, expected_sha256.data());
+
+  for (const auto& package : packages_) {
+    SHA_CTX sha1_ctx;
+    SHA1_Init(&sha1_ctx);
+    SHA256_CTX sha256_ctx;
+    SHA256_Init(&sha256_ctx);
+    std::vector<HasherUpdateCallback> hashers{
+      std::bind(&SHA1_Update, &sha1_ctx, std::placeholders::_1, std::placeholders::_2),
+      std::bind(&SHA256_Update, &sha256_ctx, std::placeholders::_1, std::placeholders::_2),
+    };
+    ASSERT_TRUE(package->UpdateHashAtOffset(hashers, 5, hash_size));
+
+    std::vector<uint8_t> calculated_sha1(SHA_DIGEST_LENGTH);
+    SHA1_Final(calculated_sha1.data(), &sha1_ctx);
+    ASSERT_EQ(expected_sha1, calculated_sha1);
+    std::vector<uint8_t> calculated_sha256(SHA256_DIGEST_LENGTH);
+    SHA256_Final(calculated_sha256.data(), &sha256_ctx);
+    ASSERT_EQ(expected_sha256, calculated_sha256);
+
+    // Out of bound read.
+    ASSERT_FALSE(package->UpdateHashAtOffset(hashers, 5, file_content_.size()));
+  }
+}
+
 TEST_F(PackageTest, GetZipArchiveHandle_extract_entry) {
   for (const auto& package : packages_) {
     ZipArchiveHandle zip = package->GetZipArchiveHandle();
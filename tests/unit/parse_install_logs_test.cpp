@@ -72,3 +72,25 @@ TEST(ParseInstallLogsTest, ParseRecoveryUpdateMetrics) {
 
   ASSERT_EQ(expected_result, metrics);
 }
+
+TEST(ParseInstallLogsTest, ParseRecoveryUpdateMetrics_phases) {
+  std::vector<std::string> lines = {
+    "/cache/recovery/ota.zip",
+    "1",
+    "time_total: 300",
+    "phase_cmd_bsdiff_count: 120",
+    "phase_cmd_bsdiff_wall_ms: 5310",
+    "phase_update_binary_fsyncs: 0",
+  };
+
+  auto metrics = ParseRecoveryUpdateMetrics(lines);
+
+  std::map<std::string, int64_t> expected_result = {
+    { "ota_time_total", 300 },
+    { "ota_phase_cmd_bsdiff_count", 120 },
+    { "ota_phase_cmd_bsdiff_wall_ms", 5310 },
+    { "ota_phase_update_binary_fsyncs", 0 },
+  };
+
+  ASSERT_EQ(expected_result, metrics);
+}
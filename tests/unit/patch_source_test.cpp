@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include <memory>
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/mapped_file.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
+
+#include "private/patch_source.h"
+
+class PatchSourceTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    for (size_t i = 0; i < 1024 * 1024; i++) {
+      content_.push_back(static_cast<char>((i * 7) ^ (i >> 11)));
+    }
+
+    FILE* zip_file_ptr = fdopen(zip_file_.release(), "wb");
+    ZipWriter zip_writer(zip_file_ptr);
+    ASSERT_EQ(0, zip_writer.StartEntry("stored.dat", 0));
+    ASSERT_EQ(0, zip_writer.WriteBytes(content_.data(), content_.size()));
+    ASSERT_EQ(0, zip_writer.FinishEntry());
+    ASSERT_EQ(0, zip_writer.StartEntry("compressed.dat", ZipWriter::kCompress));
+    ASSERT_EQ(0, zip_writer.WriteBytes(content_.data(), content_.size()));
+    ASSERT_EQ(0, zip_writer.FinishEntry());
+    ASSERT_EQ(0, zip_writer.Finish());
+    ASSERT_EQ(0, fclose(zip_file_ptr));
+
+    ASSERT_EQ(0, OpenArchive(zip_file_.path, &handle_));
+  }
+
+  void TearDown() override {
+    CloseArchive(handle_);
+  }
+
+  TemporaryFile zip_file_;
+  ZipArchiveHandle handle_;
+  std::string content_;
+};
+
+TEST_F(PatchSourceTest, Stored) {
+  ZipEntry64 entry;
+  ASSERT_EQ(0, FindEntry(handle_, "stored.dat", &entry));
+  android::base::unique_fd fd(open(zip_file_.path, O_RDONLY));
+  auto mapped = android::base::MappedFile::FromFd(fd, 0, entry.offset + content_.size(), PROT_READ);
+  ASSERT_NE(nullptr, mapped);
+
+  auto source = PatchSource::Create(handle_, entry, reinterpret_cast<uint8_t*>(mapped->data()),
+                                    4096);
+  ASSERT_NE(nullptr, source->data());
+
+  std::string patch;
+  ASSERT_TRUE(source->Read(100, 5000, &patch));
+  ASSERT_EQ(content_.substr(100, 5000), patch);
+  ASSERT_TRUE(source->Read(0, 10, &patch));
+  ASSERT_EQ(content_.substr(0, 10), patch);
+  ASSERT_FALSE(source->Read(content_.size() - 1, 2, &patch));
+
+  // Reading in place points into the mapped package.
+  std::string_view view;
+  ASSERT_TRUE(source->ReadInPlace(100, 5000, &view));
+  ASSERT_EQ(content_.substr(100, 5000), view);
+  ASSERT_EQ(reinterpret_cast<const char*>(source->data()) + 100, view.data());
+  ASSERT_FALSE(source->ReadInPlace(content_.size() - 1, 2, &view));
+}
+
+TEST_F(PatchSourceTest, Compressed) {
+  ZipEntry64 entry;
+  ASSERT_EQ(0, FindEntry(handle_, "compressed.dat", &entry));
+  ASSERT_NE(kCompressStored, entry.method);
+
+  // A window smaller than the patches.
+  auto source = PatchSource::Create(handle_, entry, nullptr, 4096);
+  ASSERT_EQ(nullptr, source->data());
+
+  std::string patch;
+  ASSERT_TRUE(source->Read(100, 5000, &patch));
+  ASSERT_EQ(content_.substr(100, 5000), patch);
+  ASSERT_TRUE(source->Read(5100, 0, &patch));
+  ASSERT_TRUE(patch.empty());
+  ASSERT_TRUE(source->Read(500000, 100000, &patch));
+  ASSERT_EQ(content_.substr(500000, 100000), patch);
+
+  // Going back inflates the data again.
+  ASSERT_TRUE(source->Read(10, 20, &patch));
+  ASSERT_EQ(content_.substr(10, 20), patch);
+
+  ASSERT_TRUE(source->Read(content_.size() - 10, 10, &patch));
+  ASSERT_EQ(content_.substr(content_.size() - 10), patch);
+  ASSERT_FALSE(source->Read(content_.size(), 1, &patch));
+
+  std::string_view view;
+  ASSERT_FALSE(source->ReadInPlace(0, 10, &view));
+}
+
+TEST_F(PatchSourceTest, Compressed_Abandoned) {
+  ZipEntry64 entry;
+  ASSERT_EQ(0, FindEntry(handle_, "compressed.dat", &entry));
+
+  // Destroying the source stops the inflation that's blocked on the full window.
+  auto source = PatchSource::Create(handle_, entry, nullptr, 4096);
+  std::string patch;
+  ASSERT_TRUE(source->Read(0, 1, &patch));
+  source.reset();
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "private/pending_syncs.h"
+
+TEST(PendingSyncsTest, SyncAll) {
+  auto& pending_syncs = PendingSyncs::Get();
+  ASSERT_TRUE(pending_syncs.SyncAll());
+  ASSERT_EQ(0u, pending_syncs.size());
+
+  // Files on the same filesystem share one entry, whether or not they exist.
+  TemporaryDir td;
+  std::string file = std::string(td.path) + "/file";
+  ASSERT_TRUE(android::base::WriteStringToFile("data", file));
+  pending_syncs.Add(file);
+  pending_syncs.Add(std::string(td.path) + "/dangling");
+  ASSERT_EQ(1u, pending_syncs.size());
+
+  // A missing directory is ignored.
+  pending_syncs.Add("/doesntexist/file");
+  ASSERT_EQ(1u, pending_syncs.size());
+
+  ASSERT_TRUE(pending_syncs.SyncAll());
+  ASSERT_EQ(0u, pending_syncs.size());
+}
+
+TEST(PendingSyncsTest, SyncDevice) {
+  auto& pending_syncs = PendingSyncs::Get();
+  TemporaryDir td;
+  struct stat sb;
+  ASSERT_EQ(0, stat(td.path, &sb));
+
+  pending_syncs.Add(std::string(td.path) + "/file");
+  ASSERT_EQ(1u, pending_syncs.size());
+
+  // Other devices are left alone.
+  ASSERT_TRUE(pending_syncs.SyncDevice(sb.st_dev + 1));
+  ASSERT_EQ(1u, pending_syncs.size());
+
+  ASSERT_TRUE(pending_syncs.SyncDevice(sb.st_dev));
+  ASSERT_EQ(0u, pending_syncs.size());
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "otautil/phase_stats.h"
+
+TEST(PhaseStatsTest, ScopedPhase) {
+  ClearPhaseStats();
+  for (int i = 0; i < 2; i++) {
+    ScopedPhase phase("sleep");
+    CountFsync();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  CountFsync();
+
+  auto stats = GetPhaseStats();
+  ASSERT_EQ(1u, stats.size());
+  const PhaseStats& sleep = stats.at("sleep");
+  ASSERT_EQ(2u, sleep.count);
+  ASSERT_LE(10000u, sleep.wall_us);
+  ASSERT_GE(sleep.wall_us, sleep.cpu_us);
+  ASSERT_EQ(2u, sleep.fsyncs);
+
+  ClearPhaseStats();
+  ASSERT_TRUE(GetPhaseStats().empty());
+}
+
+TEST(PhaseStatsTest, FormatPhaseStats) {
+  ClearPhaseStats();
+  { ScopedPhase phase("set_metadata"); }
+
+  std::vector<std::string> lines = FormatPhaseStats("log ");
+  ASSERT_EQ(6u, lines.size());
+  ASSERT_EQ("log phase_set_metadata_count: 1", lines[0]);
+  for (const auto& line : lines) {
+    ASSERT_TRUE(android::base::StartsWith(line, "log phase_set_metadata_")) << line;
+  }
+  ASSERT_EQ("log phase_set_metadata_fsyncs: 0", lines.back());
+  ClearPhaseStats();
+}
+
+TEST(PhaseStatsTest, GetRunningPhases) {
+  ASSERT_TRUE(GetRunningPhases().empty());
+  {
+    ScopedPhase outer("update");
+    {
+      ScopedPhase inner("bsdiff");
+      ScopedPhase again("bsdiff");
+      ASSERT_EQ((std::vector<std::string>{ "bsdiff", "update" }), GetRunningPhases());
+    }
+    ASSERT_EQ(std::vector<std::string>{ "update" }, GetRunningPhases());
+  }
+  ASSERT_TRUE(GetRunningPhases().empty());
+  ClearPhaseStats();
+}
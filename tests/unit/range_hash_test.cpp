@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "otautil/rangeset.h"
+#include "private/range_hash.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+class RangeHashTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Large enough to span several reads and wrap around the read-ahead buffer.
+    std::mt19937 rng(0);
+    content_.resize(2048 * kBlockSize);
+    for (auto& c : content_) {
+      c = static_cast<char>(rng());
+    }
+    ASSERT_TRUE(android::base::WriteStringToFile(content_, image_.path));
+  }
+
+  std::string Blocks(const RangeSet& ranges) const {
+    std::string result;
+    for (const auto& [begin, end] : ranges) {
+      result += content_.substr(begin * kBlockSize, (end - begin) * kBlockSize);
+    }
+    return result;
+  }
+
+  TemporaryFile image_;
+  std::string content_;
+};
+
+TEST_F(RangeHashTest, RangeSha1) {
+  RangeSet ranges({ { 5, 6 }, { 10, 1500 }, { 1600, 2048 } });
+  std::string blocks = Blocks(ranges);
+  uint8_t expected[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(blocks.data()), blocks.size(), expected);
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  ASSERT_TRUE(RangeSha1(image_.fd, ranges, kBlockSize, digest));
+  ASSERT_EQ(std::string(expected, expected + SHA_DIGEST_LENGTH),
+            std::string(digest, digest + SHA_DIGEST_LENGTH));
+}
+
+TEST_F(RangeHashTest, RangeSha1_ReadFailure) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  ASSERT_FALSE(RangeSha1(image_.fd, RangeSet({ { 2000, 2050 } }), kBlockSize, digest));
+}
+
+TEST_F(RangeHashTest, RangeSha256Tree) {
+  RangeSet ranges({ { 0, 100 }, { 200, 2048 } });
+  std::string leaves;
+  for (const auto& group : ranges.Split(7)) {
+    std::string blocks = Blocks(group);
+    uint8_t leaf[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(blocks.data()), blocks.size(), leaf);
+    leaves.append(leaf, leaf + SHA256_DIGEST_LENGTH);
+  }
+  uint8_t expected[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(leaves.data()), leaves.size(), expected);
+
+  // The digest doesn't depend on the number of threads.
+  for (size_t threads : { 1, 3, 16 }) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    ASSERT_TRUE(RangeSha256Tree(image_.fd, ranges, 7, kBlockSize, threads, digest));
+    ASSERT_EQ(std::string(expected, expected + SHA256_DIGEST_LENGTH),
+              std::string(digest, digest + SHA256_DIGEST_LENGTH))
+        << "threads: " << threads;
+  }
+}
+
+TEST_F(RangeHashTest, RangeSha256Tree_ReadFailure) {
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  ASSERT_FALSE(RangeSha256Tree(image_.fd, RangeSet({ { 0, 10 }, { 2040, 2050 } }), 4, kBlockSize, 4,
+                               digest));
+}
+
+TEST_F(RangeHashTest, HashTreeLeaves) {
+  RangeSet ranges({ { 3, 900 }, { 1000, 2048 } });
+  std::vector<unsigned char> salt{ 0xaa, 0xbb, 0xcc };
+
+  std::vector<unsigned char> expected;
+  std::string blocks = Blocks(ranges);
+  for (size_t offset = 0; offset < blocks.size(); offset += kBlockSize) {
+    std::string salted(salt.begin(), salt.end());
+    salted += blocks.substr(offset, kBlockSize);
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(salted.data()), salted.size(), digest);
+    expected.insert(expected.end(), digest, digest + SHA256_DIGEST_LENGTH);
+  }
+
+  for (size_t threads : { 1, 4 }) {
+    std::vector<unsigned char> leaves;
+    ASSERT_TRUE(
+        HashTreeLeaves(image_.fd, ranges, kBlockSize, EVP_sha256(), salt, threads, &leaves));
+    ASSERT_EQ(expected, leaves) << "threads: " << threads;
+  }
+}
+
+TEST_F(RangeHashTest, HashTreeLeaves_ReadFailure) {
+  std::vector<unsigned char> leaves;
+  ASSERT_FALSE(HashTreeLeaves(image_.fd, RangeSet({ { 2000, 2050 } }), kBlockSize, EVP_sha256(),
+                              { 0x00 }, 2, &leaves));
+}
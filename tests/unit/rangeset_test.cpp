@@ -17,8 +17,10 @@
 #include <signal.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <limits>
 #include <optional>
+#include <string_view>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -51,6 +53,13 @@ TEST(RangeSetTest, Parse_smoke) {
   // Leading zeros are fine. But android::base::ParseUint() doesn't like trailing zeros like "10 ".
   ASSERT_EQ(rs, RangeSet::Parse(" 2, 1,   10"));
   ASSERT_FALSE(RangeSet::Parse("2,1,10 "));
+
+  // Hex numbers are fine too.
+  ASSERT_EQ(rs, RangeSet::Parse("0x2,1,0xa"));
+
+  // The text doesn't need to be null-terminated.
+  std::string_view text = "4,15,20,1,10,11,12";
+  ASSERT_EQ(rs2, RangeSet::Parse(text.substr(0, 12)));
 }
 
 TEST(RangeSetTest, Parse_InvalidCases) {
@@ -67,6 +76,8 @@ TEST(RangeSetTest, Parse_InvalidCases) {
   // Invalid tokens.
   ASSERT_FALSE(RangeSet::Parse("2,1,10a"));
   ASSERT_FALSE(RangeSet::Parse("2,,10"));
+  ASSERT_FALSE(RangeSet::Parse("2,1,0x"));
+  ASSERT_FALSE(RangeSet::Parse("2,1,2147483648"));
 
   // Empty or negative range.
   ASSERT_FALSE(RangeSet::Parse("2,2,2"));
@@ -124,6 +135,32 @@ TEST(RangeSetTest, Overlaps) {
   ASSERT_FALSE(RangeSet::Parse("2,5,7").Overlaps(RangeSet::Parse("2,3,5")));
 }
 
+TEST(RangeSetTest, Overlaps_many_ranges) {
+  // Enough ranges to take the sweep instead of comparing every pair.
+  std::vector<Range> even;
+  std::vector<Range> odd;
+  for (size_t i = 0; i < 100; i++) {
+    even.emplace_back(i * 20, i * 20 + 10);
+    odd.emplace_back(i * 20 + 10, i * 20 + 20);
+  }
+  RangeSet r1 = RangeSet(std::move(even));
+  ASSERT_FALSE(r1.Overlaps(RangeSet(std::vector<Range>(odd))));
+  ASSERT_FALSE(RangeSet(std::vector<Range>(odd)).Overlaps(r1));
+
+  // Unsorted, with the only overlap at the very end.
+  std::reverse(odd.begin(), odd.end());
+  odd.emplace_back(1985, 1995);
+  ASSERT_TRUE(r1.Overlaps(RangeSet(std::vector<Range>(odd))));
+  ASSERT_TRUE(RangeSet(std::vector<Range>(odd)).Overlaps(r1));
+
+  // A long range that covers the gaps between others.
+  RangeSet wide({ { 0, 1000 }, { 1200, 1210 } });
+  std::vector<Range> high(odd.begin(), odd.begin() + 49);
+  ASSERT_FALSE(wide.Overlaps(RangeSet(std::vector<Range>(high))));
+  high.emplace_back(990, 995);
+  ASSERT_TRUE(wide.Overlaps(RangeSet(std::vector<Range>(high))));
+}
+
 TEST(RangeSetTest, Split) {
   RangeSet rs1 = RangeSet::Parse("2,1,2");
   ASSERT_TRUE(rs1);
@@ -249,6 +286,27 @@ TEST(RangeSetTest, ToString) {
   ASSERT_EQ("6,1,3,4,6,15,22", RangeSet::Parse("6,1,3,4,6,15,22").ToString());
 }
 
+TEST(RangeSetIndexTest, smoke) {
+  RangeSet rs = RangeSet::Parse("8,30,33,1000,1008,2100,2102,5,6");
+  RangeSetIndex index(rs);
+  ASSERT_EQ(rs, index.ranges());
+  for (size_t i = 0; i < rs.blocks(); i++) {
+    ASSERT_EQ(rs.GetBlockNumber(i), index.GetBlockNumber(i)) << i;
+  }
+  ASSERT_EXIT(index.GetBlockNumber(rs.blocks()), ::testing::KilledBySignal(SIGABRT), "");
+
+  for (size_t start = 0; start < rs.blocks(); start++) {
+    for (size_t count = 1; start + count <= rs.blocks(); count++) {
+      ASSERT_EQ(rs.GetSubRanges(start, count), index.GetSubRanges(start, count))
+          << start << ", " << count;
+    }
+  }
+  ASSERT_EQ(RangeSet{}, index.GetSubRanges(1, 0));
+  ASSERT_FALSE(index.GetSubRanges(0, rs.blocks() + 1));
+  ASSERT_FALSE(index.GetSubRanges(rs.blocks() + 1, 0));
+  ASSERT_FALSE(index.GetSubRanges(std::numeric_limits<size_t>::max(), 2));
+}
+
 TEST(RangeSetTest, GetSubRanges_invalid) {
   RangeSet range0({ { 1, 11 }, { 20, 30 } });
   ASSERT_FALSE(range0.GetSubRanges(0, 21));  // too many blocks
@@ -306,6 +364,10 @@ TEST(SortedRangeSetTest, file_range) {
   // rs overlaps block 2-2
   ASSERT_TRUE(rs.Overlaps(4096 * 2 - 1, 10));
   ASSERT_FALSE(rs.Overlaps(4096 * 10, 4096 * 5));
+  ASSERT_FALSE(rs.Overlaps(0, 4096));
+  ASSERT_TRUE(rs.Overlaps(0, 4097));
+  ASSERT_TRUE(rs.Overlaps(4096 * 19, 4096 * 10));
+  ASSERT_FALSE(rs.Overlaps(4096 * 20, 4096 * 10));
 
   ASSERT_EQ(static_cast<size_t>(10), rs.GetOffsetInRangeSet(4106));
   ASSERT_EQ(static_cast<size_t>(40970), rs.GetOffsetInRangeSet(4096 * 16 + 10));
@@ -17,9 +17,13 @@
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <memory>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -86,6 +90,189 @@ TEST(ResourcesTest, res_create_multi_display_surface) {
   free(frames);
 }
 
+// Writes a raw frames file in the format produced by `interlace-frames.py --raw`, with frame |i|
+// filled with the RGBX pixel (i, 2 * i, 3 * i, 0xff).
+static void WriteRawFrames(const std::string& path, uint32_t width, uint32_t height,
+                           uint32_t frames, uint32_t fps) {
+  uint32_t frame_stride = (width * 4 * height + 7) / 8 * 8;
+  std::string content = "RRF1";
+  for (uint32_t field : { width, height, frames, fps, frame_stride }) {
+    content.append(reinterpret_cast<const char*>(&field), sizeof(field));
+  }
+  for (uint32_t i = 0; i < frames; ++i) {
+    std::string frame(frame_stride, '\0');
+    for (uint32_t p = 0; p < width * height; ++p) {
+      frame[p * 4] = i;
+      frame[p * 4 + 1] = 2 * i;
+      frame[p * 4 + 2] = 3 * i;
+      frame[p * 4 + 3] = '\xff';
+    }
+    content += frame;
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(content, path));
+}
+
+TEST(ResourcesTest, res_create_multi_display_surface_raw_frames) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/loop.rrf";
+  WriteRawFrames(path, 3, 5, 4, 15);
+
+  GRSurface** frames;
+  int frame_count;
+  int fps;
+  ASSERT_EQ(0, res_create_multi_display_surface(path.c_str(), &frame_count, &fps, &frames));
+  ASSERT_EQ(4, frame_count);
+  ASSERT_EQ(15, fps);
+
+  for (auto i = 0; i < frame_count; i++) {
+    ASSERT_EQ(3u, frames[i]->width);
+    ASSERT_EQ(5u, frames[i]->height);
+    ASSERT_EQ(12u, frames[i]->row_bytes);
+    const uint8_t* data = frames[i]->data();
+    for (size_t p = 0; p < 3 * 5; ++p) {
+      ASSERT_EQ(i, data[p * 4]);
+      ASSERT_EQ(2 * i, data[p * 4 + 1]);
+      ASSERT_EQ(3 * i, data[p * 4 + 2]);
+      ASSERT_EQ(0xff, data[p * 4 + 3]);
+    }
+    res_free_surface(frames[i]);
+  }
+  free(frames);
+}
+
+TEST(ResourcesTest, res_create_display_surface_raw_frames) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/icon.rrf";
+  WriteRawFrames(path, 7, 2, 1, 20);
+
+  GRSurface* surface;
+  ASSERT_EQ(0, res_create_display_surface(path.c_str(), &surface));
+  ASSERT_EQ(7u, surface->width);
+  ASSERT_EQ(2u, surface->height);
+  auto clone = surface->Clone();
+  ASSERT_NE(nullptr, clone);
+  ASSERT_EQ(0, memcmp(surface->data(), clone->data(), 7 * 4 * 2));
+  res_free_surface(surface);
+
+  // A single display surface can't come from a multi-frame file.
+  WriteRawFrames(path, 7, 2, 3, 20);
+  ASSERT_GT(0, res_create_display_surface(path.c_str(), &surface));
+}
+
+TEST(ResourcesTest, res_create_multi_display_surface_raw_frames_truncated) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/loop.rrf";
+  WriteRawFrames(path, 3, 5, 4, 15);
+  ASSERT_EQ(0, truncate(path.c_str(), 100));
+
+  GRSurface** frames;
+  int frame_count;
+  int fps;
+  ASSERT_GT(0, res_create_multi_display_surface(path.c_str(), &frame_count, &fps, &frames));
+  ASSERT_EQ(nullptr, frames);
+}
+
+// Writes a localized text image of |width| columns, with a sub-image of |height| rows for each of
+// |images|, whose pixels are (i + 1) * 10 for the i-th one. A non-empty |index| is added as the
+// "Locales" text chunk, as image_generator writes it.
+static void WriteLocalizedImage(const std::string& path, png_uint_32 width,
+                                const std::vector<std::pair<std::string, png_uint_32>>& images,
+                                const std::string& index) {
+  std::vector<std::vector<uint8_t>> rows;
+  for (size_t i = 0; i < images.size(); ++i) {
+    const auto& [locale, height] = images[i];
+    std::vector<uint8_t> header(width);
+    header[0] = width & 0xff;
+    header[1] = width >> 8;
+    header[2] = height & 0xff;
+    header[3] = height >> 8;
+    header[4] = locale.size();
+    memcpy(&header[5], locale.c_str(), locale.size() + 1);
+    rows.push_back(header);
+    rows.insert(rows.end(), height, std::vector<uint8_t>(width, (i + 1) * 10));
+  }
+
+  std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(path.c_str(), "wbe"), fclose);
+  ASSERT_NE(nullptr, fp);
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  ASSERT_NE(nullptr, png_ptr);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  ASSERT_NE(nullptr, info_ptr);
+  png_init_io(png_ptr, fp.get());
+  png_set_IHDR(png_ptr, info_ptr, width, rows.size(), 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  if (!index.empty()) {
+    png_text text = {};
+    text.compression = PNG_TEXT_COMPRESSION_NONE;
+    text.key = const_cast<char*>("Locales");
+    text.text = const_cast<char*>(index.c_str());
+    png_set_text(png_ptr, info_ptr, &text, 1);
+  }
+  png_write_info(png_ptr, info_ptr);
+  for (auto& row : rows) {
+    png_write_row(png_ptr, row.data());
+  }
+  png_write_end(png_ptr, nullptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+}
+
+// Checks the sub-images of an image from WriteLocalizedImage(), looked up twice (the second time
+// from the cached index).
+static void CheckLocalizedImage(const std::string& path) {
+  for (int pass = 0; pass < 2; ++pass) {
+    ASSERT_EQ(std::vector<std::string>({ "en", "fr", "zh-CN" }), get_locales_in_png(path));
+
+    for (const auto& [locale, height, value] :
+         std::vector<std::tuple<std::string, size_t, uint8_t>>{
+             { "fr-FR", 3, 20 }, { "zh-Hans-CN", 1, 30 }, { "en-US", 2, 10 } }) {
+      GRSurface* surface;
+      ASSERT_EQ(0, res_create_localized_alpha_surface(path.c_str(), locale.c_str(), &surface));
+      ASSERT_EQ(12u, surface->width);
+      ASSERT_EQ(height, surface->height);
+      for (size_t p = 0; p < 12 * height; ++p) {
+        ASSERT_EQ(value, surface->data()[p]) << locale;
+      }
+      res_free_surface(surface);
+    }
+
+    GRSurface* surface;
+    ASSERT_EQ(-10, res_create_localized_alpha_surface(path.c_str(), "de-DE", &surface));
+    ASSERT_EQ(nullptr, surface);
+  }
+}
+
+TEST(ResourcesTest, res_create_localized_alpha_surface_indexed) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/indexed_text.png";
+  WriteLocalizedImage(path, 12, { { "en", 2 }, { "fr", 3 }, { "zh-CN", 1 } },
+                      "en:0:12:2,fr:3:12:3,zh-CN:7:12:1");
+  CheckLocalizedImage(path);
+}
+
+TEST(ResourcesTest, res_create_localized_alpha_surface_not_indexed) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/plain_text.png";
+  WriteLocalizedImage(path, 12, { { "en", 2 }, { "fr", 3 }, { "zh-CN", 1 } }, "");
+  CheckLocalizedImage(path);
+
+  // The sub-images found so far get cached, and the rest gets scanned for later on.
+  path = std::string(td.path) + "/partial_text.png";
+  WriteLocalizedImage(path, 12, { { "en", 2 }, { "fr", 3 }, { "zh-CN", 1 } }, "");
+  GRSurface* surface;
+  ASSERT_EQ(0, res_create_localized_alpha_surface(path.c_str(), "fr", &surface));
+  res_free_surface(surface);
+  CheckLocalizedImage(path);
+}
+
+TEST(ResourcesTest, res_create_localized_alpha_surface_bad_index) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/bad_index_text.png";
+  // The index is out of order, and gets ignored.
+  WriteLocalizedImage(path, 12, { { "en", 2 }, { "fr", 3 }, { "zh-CN", 1 } },
+                      "en:0:12:2,zh-CN:7:12:1,fr:3:12:3");
+  CheckLocalizedImage(path);
+}
+
 class ResourcesTest : public testing::TestWithParam<std::string> {
  public:
   static std::vector<std::string> png_list;
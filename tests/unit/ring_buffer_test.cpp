@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "otautil/ring_buffer.h"
+
+static std::string ReadAll(RingBuffer* ring) {
+  std::string result;
+  const uint8_t* data;
+  while (size_t size = ring->GetReadable(&data)) {
+    result.append(reinterpret_cast<const char*>(data), size);
+    ring->Consume(size);
+  }
+  return result;
+}
+
+TEST(RingBufferTest, WriteAndRead) {
+  RingBuffer ring(16);
+  ASSERT_TRUE(ring.Write(reinterpret_cast<const uint8_t*>("abcdef"), 6));
+  ring.Close();
+  ASSERT_EQ("abcdef", ReadAll(&ring));
+  ASSERT_TRUE(ring.closed());
+}
+
+TEST(RingBufferTest, WrapAround) {
+  RingBuffer ring(8);
+  ASSERT_TRUE(ring.Write(reinterpret_cast<const uint8_t*>("abcdef"), 6));
+
+  const uint8_t* data;
+  ASSERT_EQ(6u, ring.GetReadable(&data));
+  ring.Consume(4);
+
+  // Only the space up to the end of the buffer is contiguous.
+  uint8_t* space;
+  ASSERT_EQ(2u, ring.GetWritable(&space));
+  ASSERT_TRUE(ring.Write(reinterpret_cast<const uint8_t*>("ghijkl"), 6));
+  ring.Close();
+
+  ASSERT_EQ("efghijkl", ReadAll(&ring));
+}
+
+TEST(RingBufferTest, ProducerConsumer) {
+  std::string expected;
+  for (size_t i = 0; i < 100000; i++) {
+    expected += static_cast<char>('a' + i % 23);
+  }
+
+  RingBuffer ring(37);
+  std::thread producer([&ring, &expected] {
+    // Write in chunks of varying sizes, some of them larger than the capacity.
+    for (size_t pos = 0, chunk = 1; pos < expected.size(); pos += chunk, chunk = chunk % 50 + 1) {
+      size_t size = std::min(chunk, expected.size() - pos);
+      ASSERT_TRUE(ring.Write(reinterpret_cast<const uint8_t*>(expected.data() + pos), size));
+    }
+    ring.Close();
+  });
+
+  ASSERT_EQ(expected, ReadAll(&ring));
+  producer.join();
+}
+
+TEST(RingBufferTest, Abort) {
+  RingBuffer ring(4);
+  std::thread producer([&ring] {
+    // Blocks when the buffer is full, until the consumer aborts.
+    ASSERT_FALSE(ring.Write(reinterpret_cast<const uint8_t*>("abcdefgh"), 8));
+  });
+
+  const uint8_t* data;
+  ASSERT_EQ(4u, ring.GetReadable(&data));
+  ring.Abort();
+  producer.join();
+
+  ASSERT_TRUE(ring.aborted());
+  ASSERT_EQ(0u, ring.GetReadable(&data));
+}
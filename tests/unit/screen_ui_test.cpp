@@ -277,6 +277,49 @@ TEST_F(ScreenUITest, GraphicMenuValidate) {
   ASSERT_FALSE(GraphicMenu::Validate(200, 249, header.get(), items));
 }
 
+TEST(FilePagerTest, Pages) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("ab\ncdefgh\n\nij", temp_file.path));
+
+  // Pages of 3 lines of 4 characters, with "cdefgh" wrapping onto the next line.
+  FilePager pager(3, 4);
+  ASSERT_TRUE(pager.Open(temp_file.path));
+  ASSERT_EQ(13u, pager.size());
+  ASSERT_TRUE(pager.HasPage(1));
+  ASSERT_FALSE(pager.HasPage(2));
+  ASSERT_EQ(2u, pager.PageCount());
+  ASSERT_EQ("ab\ncdefgh\n", pager.GetPage(0));
+  ASSERT_EQ(10u, pager.PageEnd(0));
+  ASSERT_EQ("\nij", pager.GetPage(1));
+  ASSERT_EQ(13u, pager.PageEnd(1));
+}
+
+TEST(FilePagerTest, FullLastPage) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile("abcdefgh", temp_file.path));
+
+  // The file ends right where the second page fills up, which isn't followed by an empty one.
+  FilePager pager(1, 4);
+  ASSERT_TRUE(pager.Open(temp_file.path));
+  ASSERT_EQ(2u, pager.PageCount());
+  ASSERT_EQ("efgh", pager.GetPage(1));
+}
+
+TEST(FilePagerTest, EmptyFile) {
+  TemporaryFile temp_file;
+  FilePager pager(3, 4);
+  ASSERT_TRUE(pager.Open(temp_file.path));
+  ASSERT_EQ(0u, pager.size());
+  ASSERT_EQ(1u, pager.PageCount());
+  ASSERT_EQ("", pager.GetPage(0));
+}
+
+TEST(FilePagerTest, MissingFile) {
+  TemporaryDir temp_dir;
+  FilePager pager(3, 4);
+  ASSERT_FALSE(pager.Open(std::string(temp_dir.path) + "/missing"));
+}
+
 static constexpr int kMagicAction = 101;
 
 enum class KeyCode : int {
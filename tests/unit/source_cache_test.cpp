@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "otautil/rangeset.h"
+#include "private/source_cache.h"
+
+TEST(SourceCacheTest, GetAndPut) {
+  SourceCache cache(8192);
+  std::vector<uint8_t> buffer(4096);
+  ASSERT_FALSE(cache.Get("a", RangeSet({ { 0, 1 } }), buffer.data()));
+
+  std::vector<uint8_t> data(4096, 'a');
+  cache.Put("a", RangeSet({ { 0, 1 } }), data.data(), data.size());
+  ASSERT_TRUE(cache.Get("a", RangeSet({ { 0, 1 } }), buffer.data()));
+  ASSERT_EQ(data, buffer);
+  ASSERT_EQ(4096u, cache.size());
+
+  // Both the hash and the ranges must match.
+  ASSERT_FALSE(cache.Get("a", RangeSet({ { 1, 2 } }), buffer.data()));
+  ASSERT_FALSE(cache.Get("b", RangeSet({ { 0, 1 } }), buffer.data()));
+}
+
+TEST(SourceCacheTest, EvictLeastRecentlyUsed) {
+  SourceCache cache(8192);
+  std::vector<uint8_t> data(4096);
+  std::vector<uint8_t> buffer(4096);
+  cache.Put("a", RangeSet({ { 0, 1 } }), data.data(), data.size());
+  cache.Put("b", RangeSet({ { 1, 2 } }), data.data(), data.size());
+  ASSERT_TRUE(cache.Get("a", RangeSet({ { 0, 1 } }), buffer.data()));
+
+  cache.Put("c", RangeSet({ { 2, 3 } }), data.data(), data.size());
+  ASSERT_TRUE(cache.Get("a", RangeSet({ { 0, 1 } }), buffer.data()));
+  ASSERT_FALSE(cache.Get("b", RangeSet({ { 1, 2 } }), buffer.data()));
+  ASSERT_TRUE(cache.Get("c", RangeSet({ { 2, 3 } }), buffer.data()));
+  ASSERT_EQ(8192u, cache.size());
+
+  // Too large to be cached.
+  std::vector<uint8_t> large(12288);
+  cache.Put("d", RangeSet({ { 3, 6 } }), large.data(), large.size());
+  ASSERT_FALSE(cache.Get("d", RangeSet({ { 3, 6 } }), large.data()));
+  ASSERT_EQ(8192u, cache.size());
+
+  cache.set_capacity(0);
+  ASSERT_EQ(0u, cache.size());
+}
+
+TEST(SourceCacheTest, Invalidate) {
+  SourceCache cache(16384);
+  std::vector<uint8_t> data(8192);
+  std::vector<uint8_t> buffer(8192);
+  cache.Put("a", RangeSet({ { 0, 2 } }), data.data(), data.size());
+  cache.Put("b", RangeSet({ { 4, 6 } }), data.data(), data.size());
+
+  cache.Invalidate(RangeSet({ { 1, 4 } }));
+  ASSERT_FALSE(cache.Get("a", RangeSet({ { 0, 2 } }), buffer.data()));
+  ASSERT_TRUE(cache.Get("b", RangeSet({ { 4, 6 } }), buffer.data()));
+  ASSERT_EQ(8192u, cache.size());
+
+  cache.Clear();
+  ASSERT_FALSE(cache.Get("b", RangeSet({ { 4, 6 } }), buffer.data()));
+  ASSERT_EQ(0u, cache.size());
+}
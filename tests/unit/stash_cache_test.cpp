@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/mman.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/mapped_file.h>
+#include <gtest/gtest.h>
+
+#include "private/stash_cache.h"
+
+class StashCacheTest : public ::testing::Test {
+ protected:
+  // Maps a file of |size| bytes filled with |c|.
+  StashCache::Mapping Map(size_t size, char c) {
+    TemporaryFile temp_file;
+    std::string content(size, c);
+    EXPECT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+    return android::base::MappedFile::FromFd(temp_file.fd, 0, size, PROT_READ);
+  }
+};
+
+TEST_F(StashCacheTest, GetAndErase) {
+  StashCache cache(8192);
+  ASSERT_EQ(nullptr, cache.Get("a"));
+
+  cache.Put("a", Map(4096, 'a'));
+  StashCache::Mapping mapping = cache.Get("a");
+  ASSERT_NE(nullptr, mapping);
+  ASSERT_EQ(4096u, mapping->size());
+  ASSERT_EQ('a', mapping->data()[4095]);
+  ASSERT_EQ(4096u, cache.size());
+
+  cache.Erase("a");
+  ASSERT_EQ(nullptr, cache.Get("a"));
+  ASSERT_EQ(0u, cache.size());
+
+  // The mapping stays valid while it's in use.
+  ASSERT_EQ('a', mapping->data()[0]);
+}
+
+TEST_F(StashCacheTest, EvictLeastRecentlyUsed) {
+  StashCache cache(8192);
+  cache.Put("a", Map(4096, 'a'));
+  cache.Put("b", Map(4096, 'b'));
+  // Touch "a", so that "b" gets evicted for "c".
+  ASSERT_NE(nullptr, cache.Get("a"));
+  cache.Put("c", Map(4096, 'c'));
+
+  ASSERT_NE(nullptr, cache.Get("a"));
+  ASSERT_EQ(nullptr, cache.Get("b"));
+  ASSERT_NE(nullptr, cache.Get("c"));
+  ASSERT_EQ(8192u, cache.size());
+
+  cache.set_capacity(4096);
+  ASSERT_EQ(nullptr, cache.Get("a"));
+  ASSERT_NE(nullptr, cache.Get("c"));
+  ASSERT_EQ(4096u, cache.size());
+
+  cache.Clear();
+  ASSERT_EQ(nullptr, cache.Get("c"));
+  ASSERT_EQ(0u, cache.size());
+}
+
+TEST_F(StashCacheTest, SkipOversizedMapping) {
+  StashCache cache(4096);
+  cache.Put("a", Map(4096, 'a'));
+  cache.Put("b", Map(8192, 'b'));
+  ASSERT_NE(nullptr, cache.Get("a"));
+  ASSERT_EQ(nullptr, cache.Get("b"));
+
+  // A capacity of 0 disables the cache.
+  cache.set_capacity(0);
+  cache.Put("c", Map(4096, 'c'));
+  ASSERT_EQ(nullptr, cache.Get("c"));
+  ASSERT_EQ(0u, cache.size());
+}
+
+TEST_F(StashCacheTest, ReplaceMapping) {
+  StashCache cache(16384);
+  cache.Put("a", Map(4096, 'a'));
+  cache.Put("a", Map(8192, 'b'));
+  StashCache::Mapping mapping = cache.Get("a");
+  ASSERT_NE(nullptr, mapping);
+  ASSERT_EQ('b', mapping->data()[0]);
+  ASSERT_EQ(8192u, cache.size());
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "private/block_buffer.h"
+#include "private/stash_compression.h"
+
+// Four blocks that compress well: a zero block, and some repeated metadata-like records.
+static BlockBuffer CompressibleBlocks() {
+  BlockBuffer blocks(4 * 4096, 0);
+  for (size_t i = 4096; i < blocks.size(); i++) {
+    blocks[i] = static_cast<uint8_t>((i % 64) < 8 ? i / 64 : 0xff);
+  }
+  return blocks;
+}
+
+TEST(StashCompressionTest, RoundTrip) {
+  BlockBuffer blocks = CompressibleBlocks();
+  std::vector<uint8_t> frame;
+  ASSERT_TRUE(CompressStash(blocks.data(), blocks.size(), &frame));
+  ASSERT_LE(frame.size() + 4096, blocks.size());
+
+  BlockBuffer decompressed;
+  ASSERT_TRUE(DecompressStash(frame.data(), frame.size(), &decompressed));
+  ASSERT_EQ(blocks, decompressed);
+}
+
+TEST(StashCompressionTest, Incompressible) {
+  BlockBuffer blocks(2 * 4096);
+  std::mt19937 random(0);
+  for (auto& byte : blocks) {
+    byte = static_cast<uint8_t>(random());
+  }
+  std::vector<uint8_t> frame;
+  ASSERT_FALSE(CompressStash(blocks.data(), blocks.size(), &frame));
+}
+
+TEST(StashCompressionTest, Corrupt) {
+  BlockBuffer blocks = CompressibleBlocks();
+  std::vector<uint8_t> frame;
+  ASSERT_TRUE(CompressStash(blocks.data(), blocks.size(), &frame));
+
+  // The checksums catch a flipped byte anywhere past the frame header.
+  BlockBuffer decompressed;
+  for (size_t i = 16; i < frame.size(); i++) {
+    std::vector<uint8_t> corrupt = frame;
+    corrupt[i] ^= 0x01;
+    ASSERT_FALSE(DecompressStash(corrupt.data(), corrupt.size(), &decompressed)) << i;
+  }
+}
+
+TEST(StashCompressionTest, Truncated) {
+  BlockBuffer blocks = CompressibleBlocks();
+  std::vector<uint8_t> frame;
+  ASSERT_TRUE(CompressStash(blocks.data(), blocks.size(), &frame));
+
+  BlockBuffer decompressed;
+  ASSERT_FALSE(DecompressStash(frame.data(), frame.size() - 1, &decompressed));
+  ASSERT_FALSE(DecompressStash(frame.data(), 4, &decompressed));
+  ASSERT_FALSE(DecompressStash(frame.data(), 0, &decompressed));
+
+  // Trailing garbage isn't accepted either.
+  frame.push_back(0);
+  ASSERT_FALSE(DecompressStash(frame.data(), frame.size(), &decompressed));
+}
+
+TEST(StashCompressionTest, PartialBlock) {
+  // A frame from elsewhere that doesn't hold whole blocks.
+  std::vector<uint8_t> data(4096 + 100, 0);
+  std::vector<uint8_t> frame;
+  CompressStash(data.data(), data.size(), &frame);
+  ASSERT_FALSE(frame.empty());
+
+  BlockBuffer decompressed;
+  ASSERT_FALSE(DecompressStash(frame.data(), frame.size(), &decompressed));
+}
@@ -14,10 +14,14 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+
 #include <string>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
 #include "otautil/rangeset.h"
@@ -50,6 +54,47 @@ TEST(SysUtilTest, ParseBlockMapFile_smoke) {
             block_map_data.block_ranges());
 }
 
+TEST(SysUtilTest, ParseBlockMapFile_coalesced) {
+  std::vector<std::string> content = {
+    "/dev/abc", "49652 4096", "4", "1000 1004", "1004 1008", "2100 2102", "30 33",
+  };
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(android::base::Join(content, '\n'), temp_file.path));
+
+  auto block_map_data = BlockMapData::ParseBlockMapFile(temp_file.path);
+  ASSERT_TRUE(block_map_data);
+  ASSERT_EQ(RangeSet(std::vector<Range>{
+                { 1000, 1008 },
+                { 2100, 2102 },
+                { 30, 33 },
+            }),
+            block_map_data.block_ranges());
+}
+
+TEST(SysUtilTest, BlockMapData_GetSubRanges) {
+  std::vector<std::string> content = {
+    "/dev/abc", "49652 4096", "3", "1000 1008", "2100 2102", "30 33",
+  };
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(android::base::Join(content, '\n'), temp_file.path));
+
+  auto block_map_data = BlockMapData::ParseBlockMapFile(temp_file.path);
+  ASSERT_TRUE(block_map_data);
+  ASSERT_EQ(RangeSet(std::vector<Range>{ { 1000, 1008 }, { 2100, 2102 }, { 30, 33 } }),
+            block_map_data.GetSubRanges(0, 13));
+  ASSERT_EQ(RangeSet(std::vector<Range>{ { 1007, 1008 }, { 2100, 2102 }, { 30, 31 } }),
+            block_map_data.GetSubRanges(7, 4));
+  ASSERT_EQ(RangeSet(std::vector<Range>{ { 2101, 2102 } }), block_map_data.GetSubRanges(9, 1));
+  ASSERT_EQ(RangeSet(std::vector<Range>{ { 31, 33 } }), block_map_data.GetSubRanges(11, 2));
+  ASSERT_EQ(RangeSet(), block_map_data.GetSubRanges(5, 0));
+
+  // Out of bound.
+  ASSERT_FALSE(block_map_data.GetSubRanges(12, 2));
+  ASSERT_FALSE(block_map_data.GetSubRanges(13, 1));
+}
+
 TEST(SysUtilTest, ParseBlockMapFile_invalid_line_count) {
   std::vector<std::string> content = {
     "/dev/abc", "49652 4096", "2", "1000 1008", "2100 2102", "30 33",
@@ -102,6 +147,27 @@ TEST(SysUtilTest, MapFileRegularFile) {
   ASSERT_EQ(1U, mapping.ranges());
 }
 
+TEST(SysUtilTest, MapFileRegularFile_large) {
+  TemporaryFile temp_file1;
+  std::string content(3 * 1024 * 1024 + 123, 'a');
+  content.back() = 'z';
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file1.path));
+
+  // A large file gets mapped at a huge page boundary.
+  MemMapping mapping;
+  ASSERT_TRUE(mapping.MapFile(temp_file1.path));
+  ASSERT_EQ(content.size(), mapping.length);
+  ASSERT_EQ(1U, mapping.ranges());
+  ASSERT_EQ(0U, reinterpret_cast<uintptr_t>(mapping.addr) % (2 * 1024 * 1024));
+  ASSERT_EQ(content, std::string(reinterpret_cast<const char*>(mapping.addr), mapping.length));
+
+  // The advice is clamped to the mapping, and the start doesn't need to be page aligned.
+  ASSERT_TRUE(mapping.Advise(1, content.size(), MADV_SEQUENTIAL));
+  ASSERT_TRUE(mapping.Advise(content.size() - 1, 4096, MADV_WILLNEED));
+  ASSERT_FALSE(mapping.Advise(content.size(), 4096, MADV_WILLNEED));
+  ASSERT_EQ('z', mapping.addr[content.size() - 1]);
+}
+
 TEST(SysUtilTest, MapFileBlockMap) {
   // Create a file that has 10 blocks.
   TemporaryFile package;
@@ -138,13 +204,44 @@ TEST(SysUtilTest, MapFileBlockMap) {
   ASSERT_EQ(file_size, mapping.length);
   ASSERT_EQ(1U, mapping.ranges());
 
-  // Multiple ranges.
+  // Multiple ranges, which are contiguous on the device and get mapped together.
   block_map_content = std::string(package.path) + "\n40960 4096\n3\n0 3\n3 5\n5 10\n";
   ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
 
   ASSERT_TRUE(mapping.MapFile(filename));
   ASSERT_EQ(file_size, mapping.length);
-  ASSERT_EQ(3U, mapping.ranges());
+  ASSERT_EQ(1U, mapping.ranges());
+
+  // Multiple ranges out of order.
+  block_map_content = std::string(package.path) + "\n40960 4096\n3\n5 10\n0 3\n3 5\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+
+  ASSERT_TRUE(mapping.MapFile(filename));
+  ASSERT_EQ(file_size, mapping.length);
+  ASSERT_EQ(2U, mapping.ranges());
+}
+
+TEST(SysUtilTest, MapBlockRanges) {
+  std::string content;
+  for (char c = 'a'; c <= 'j'; c++) {
+    content += std::string(4096, c);
+  }
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+  android::base::unique_fd fd(open(temp_file.path, O_RDONLY));
+  ASSERT_NE(-1, fd.get());
+
+  // The ranges get mapped in their order, not in the order of the blocks.
+  MemMapping mapping;
+  ASSERT_TRUE(mapping.MapBlockRanges(fd.get(), RangeSet({ { 7, 9 }, { 1, 3 } }), 4096));
+  fd.reset();
+  ASSERT_EQ(2u, mapping.ranges());
+  ASSERT_EQ(4 * 4096u, mapping.length);
+  ASSERT_EQ(content.substr(7 * 4096, 2 * 4096) + content.substr(4096, 2 * 4096),
+            std::string(reinterpret_cast<const char*>(mapping.addr), mapping.length));
+
+  MemMapping empty;
+  ASSERT_FALSE(empty.MapBlockRanges(-1, RangeSet(), 4096));
 }
 
 TEST(SysUtilTest, MapFileBlockMapInvalidBlockMap) {
@@ -188,6 +285,10 @@ TEST(SysUtilTest, MapFileBlockMapInvalidBlockMap) {
   ASSERT_FALSE(mapping.MapFile(filename));
 }
 
+TEST(SysUtilTest, GetFreeMemory) {
+  ASSERT_LT(0U, GetFreeMemory());
+}
+
 TEST(SysUtilTest, StringVectorToNullTerminatedArray) {
   std::vector<std::string> args{ "foo", "bar", "baz" };
   auto args_with_nullptr = StringVectorToNullTerminatedArray(args);
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "otautil/trace.h"
+
+TEST(TraceTest, WriteTraceFile) {
+  uint64_t start = MonotonicTimeNs();
+  RecordTraceEvent(TraceEvent::kWrite, start, 4096);
+  { ScopedTrace trace(TraceEvent::kCommand, 42); }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(WriteTraceFile(temp_file.path));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  ASSERT_TRUE(android::base::StartsWith(content, "{\"traceEvents\":["));
+  ASSERT_TRUE(android::base::EndsWith(content, "]}\n"));
+
+  auto write = content.find("{\"name\":\"write\",\"ph\":\"X\"");
+  ASSERT_NE(std::string::npos, write);
+  ASSERT_NE(std::string::npos, content.find("\"args\":{\"arg\":4096}", write));
+  auto command = content.find("{\"name\":\"command\",\"ph\":\"X\"", write);
+  ASSERT_NE(std::string::npos, command);
+  ASSERT_NE(std::string::npos, content.find("\"args\":{\"arg\":42}", command));
+}
+
+TEST(TraceTest, WriteTraceFile_ring_wraps) {
+  // Overflow the ring; only the latest events are kept.
+  for (uint64_t i = 0; i < 20000; i++) {
+    RecordTraceEvent(TraceEvent::kHash, MonotonicTimeNs(), i);
+  }
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(WriteTraceFile(temp_file.path));
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  ASSERT_EQ(std::string::npos, content.find("\"arg\":0}"));
+  ASSERT_NE(std::string::npos, content.find("\"arg\":19999}"));
+}
+
+TEST(TraceTest, GetTraceDurations) {
+  ClearTrace();
+  uint64_t now = MonotonicTimeNs();
+  RecordTraceEvent(TraceEvent::kStashSave, now - 1000, 1);
+  RecordTraceEvent(TraceEvent::kRead, now, 4096);
+  RecordTraceEvent(TraceEvent::kStashSave, now - 2000, 2);
+
+  std::vector<uint64_t> durations = GetTraceDurations(TraceEvent::kStashSave);
+  ASSERT_EQ(2u, durations.size());
+  ASSERT_LE(1000u, durations[0]);
+  ASSERT_LE(2000u, durations[1]);
+  ASSERT_EQ(1u, GetTraceDurations(TraceEvent::kRead).size());
+
+  ClearTrace();
+  ASSERT_TRUE(GetTraceDurations(TraceEvent::kStashSave).empty());
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "otautil/rangeset.h"
+#include "private/commands.h"
+#include "private/transfer_plan.h"
+
+static TransferList ParseTransferList(const std::vector<std::string>& commands) {
+  std::vector<std::string> lines{
+    "4",  // version
+    "8",  // total blocks
+    "1",  // max stashed entries
+    "2",  // max stashed blocks
+  };
+  lines.insert(lines.end(), commands.begin(), commands.end());
+  std::string err;
+  TransferList transfer_list = TransferList::Parse(android::base::Join(lines, '\n'), &err);
+  EXPECT_TRUE(static_cast<bool>(transfer_list)) << err;
+  return transfer_list;
+}
+
+TEST(TransferPlanTest, CanMapSource) {
+  const std::string id = "1d74d1a60332fd38cf9405f1bae67917888da6cb";
+  TransferList transfer_list = ParseTransferList({
+      "bsdiff 0 100 " + id + " " + id + " 2,400,800 400 2,0,400",
+      "imgdiff 0 100 " + id + " " + id + " 2,400,800 400 2,0,400",
+      "move " + id + " 2,300,600 300 2,0,300",
+      // Too small, overlapping the target, and partly stashed.
+      "bsdiff 0 100 " + id + " " + id + " 2,300,310 10 2,0,10",
+      "bsdiff 0 100 " + id + " " + id + " 2,200,500 300 2,0,300",
+      "bsdiff 0 100 " + id + " " + id + " 2,300,600 301 2,0,300 2,0,300 " + id + ":2,300,301",
+  });
+  ASSERT_EQ(6u, transfer_list.commands().size());
+  std::vector<bool> mappable;
+  for (const auto& command : transfer_list.commands()) {
+    mappable.push_back(TransferPlan::CanMapSource(command));
+  }
+  ASSERT_EQ((std::vector<bool>{ true, true, false, false, false, false }), mappable);
+
+  TransferPlan plan = TransferPlan::Analyze(transfer_list);
+  ASSERT_EQ(400u, plan.max_source_blocks);
+  ASSERT_EQ(301u, plan.max_copied_source_blocks);
+}
+
+TEST(TransferPlanTest, Analyze) {
+  const std::string id = "1d74d1a60332fd38cf9405f1bae67917888da6cb";
+  TransferList transfer_list = ParseTransferList({
+      "stash " + id + " 2,0,2",
+      "new 2,10,12",
+      "move " + id + " 2,20,22 2 - " + id + ":2,0,2",
+      "free " + id,
+      "zero 2,0,2",
+      "bsdiff 0 100 " + id + " " + id + " 2,30,32 2 2,10,12",
+  });
+  ASSERT_EQ(6u, transfer_list.commands().size());
+
+  TransferPlan plan = TransferPlan::Analyze(transfer_list);
+  ASSERT_EQ(6u, plan.commands);
+  ASSERT_EQ(2u, plan.max_source_blocks);
+  ASSERT_EQ(2u, plan.max_copied_source_blocks);
+  ASSERT_EQ(2u, plan.max_target_blocks);
+  ASSERT_EQ(2u, plan.max_stash_blocks);
+  ASSERT_EQ(2u, plan.peak_stash_blocks);
+
+  ASSERT_EQ(1u, plan.stashes.size());
+  const TransferPlan::StashLifetime& stash = plan.stashes[0];
+  ASSERT_EQ(id, stash.id);
+  ASSERT_EQ(2u, stash.blocks);
+  ASSERT_EQ(0u, stash.stashed);
+  ASSERT_EQ(2u, stash.last_use);
+  ASSERT_EQ(3u, stash.freed);
+  ASSERT_EQ(&stash, plan.FindStash(0));
+  ASSERT_EQ(nullptr, plan.FindStash(1));
+
+  // The move only reads from the stash.
+  ASSERT_EQ(2u, plan.reads.size());
+  ASSERT_EQ(0u, plan.reads[0].index);
+  ASSERT_EQ(RangeSet({ { 0, 2 } }), plan.reads[0].ranges);
+  ASSERT_EQ(5u, plan.reads[1].index);
+  ASSERT_EQ(RangeSet({ { 10, 12 } }), plan.reads[1].ranges);
+  // The move needs the stash of command 0, and "free" must wait for the move.
+  ASSERT_EQ((std::vector<size_t>{ 0, 2, 3 }), plan.runs);
+
+  ASSERT_EQ(4u, plan.blocks_read);
+  ASSERT_EQ(8u, plan.blocks_written);
+  ASSERT_EQ(2u, plan.new_blocks);
+  ASSERT_EQ(2u, plan.blocks_stashed);
+  ASSERT_EQ(100u, plan.patch_bytes);
+}
+
+TEST(TransferPlanTest, Analyze_PeakStashBlocks) {
+  const std::string id1 = "1d74d1a60332fd38cf9405f1bae67917888da6cb";
+  const std::string id2 = "6ebcf8cf1f6be0bc49e7d4a864214251925d1d15";
+  TransferList transfer_list = ParseTransferList({
+      "stash " + id1 + " 2,0,2",
+      "stash " + id2 + " 2,2,5",
+      "free " + id1,
+      "stash " + id1 + " 2,5,6",
+      "free " + id2,
+  });
+
+  TransferPlan plan = TransferPlan::Analyze(transfer_list);
+  ASSERT_EQ(5u, plan.peak_stash_blocks);
+  ASSERT_EQ(3u, plan.max_stash_blocks);
+  ASSERT_EQ(3u, plan.stashes.size());
+  ASSERT_EQ(TransferPlan::kNever, plan.stashes[2].freed);
+  ASSERT_EQ(&plan.stashes[2], plan.FindStash(3));
+  ASSERT_EQ(6u, plan.blocks_stashed);
+}
+
+TEST(TransferPlanTest, Analyze_RunLength) {
+  std::vector<std::string> commands;
+  for (size_t i = 0; i < TransferPlan::kMaxRunLength + 1; i++) {
+    commands.push_back("zero 2," + std::to_string(i) + "," + std::to_string(i + 1));
+  }
+  TransferPlan plan = TransferPlan::Analyze(ParseTransferList(commands));
+  ASSERT_EQ((std::vector<size_t>{ 0, TransferPlan::kMaxRunLength }), plan.runs);
+  ASSERT_TRUE(plan.reads.empty());
+}
@@ -16,7 +16,11 @@
 
 #include <update_verifier/update_verifier.h>
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <functional>
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -55,6 +59,30 @@ class UpdateVerifierTest : public ::testing::Test {
   void TearDown() override {
     unlink(care_map_pb_.c_str());
     unlink(care_map_txt_.c_str());
+    unlink((care_map_prefix_ + ".progress").c_str());
+    unlink(verifier_.VerifiedStateFile().c_str());
+  }
+
+  std::map<std::string, size_t> LoadVerifiedBlocks() {
+    return verifier_.LoadVerifiedBlocks();
+  }
+
+  bool SaveVerifiedBlocks(const std::map<std::string, size_t>& verified_blocks) {
+    return verifier_.SaveVerifiedBlocks(verified_blocks);
+  }
+
+  // Has the verifier read |properties|, and nothing else.
+  void SetProperties(const std::map<std::string, std::string>& properties) {
+    verifier_.set_property_reader([properties](const std::string& id) {
+      auto it = properties.find(id);
+      return it == properties.end() ? "" : it->second;
+    });
+  }
+
+  bool ReadBlocks(const std::map<std::string, RangeSet>& partitions,
+                  const std::map<std::string, std::string>& dm_block_devices,
+                  const UpdateVerifier::BlocksDoneCallback& blocks_done_callback) {
+    return verifier_.ReadBlocks(partitions, dm_block_devices, 0, nullptr, blocks_done_callback);
   }
 
   // Returns a serialized string of the proto3 message according to the given partition info.
@@ -75,6 +103,14 @@ class UpdateVerifierTest : public ::testing::Test {
       if (partition.find("fingerprint") != partition.end()) {
         info.set_fingerprint(partition.at("fingerprint"));
       }
+      if (partition.find("priority_ranges") != partition.end()) {
+        info.set_priority_ranges(partition.at("priority_ranges"));
+      }
+      if (partition.find("packed_ranges") != partition.end()) {
+        for (const auto& value : android::base::Split(partition.at("packed_ranges"), ",")) {
+          info.add_packed_ranges(std::stoul(value));
+        }
+      }
 
       *result.add_partitions() = info;
     }
@@ -217,3 +253,203 @@ TEST_F(UpdateVerifierTest, verify_image_protobuf_fingerprint_mismatch) {
   ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
   ASSERT_FALSE(verifier_.ParseCareMap());
 }
+
+TEST_F(UpdateVerifierTest, verify_image_protobuf_priority_ranges) {
+  std::vector<std::unordered_map<std::string, std::string>> partitions = {
+    {
+        { "name", "system" },
+        { "ranges", "4,0,5,10,15" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+        { "priority_ranges", "2,10,12" },
+    },
+  };
+
+  std::string proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_TRUE(verifier_.HasPriorityBlocks());
+
+  partitions[0]["priority_ranges"] = "2,12";
+  proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_FALSE(verifier_.ParseCareMap());
+
+  partitions[0].erase("priority_ranges");
+  proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_FALSE(verifier_.HasPriorityBlocks());
+}
+
+TEST_F(UpdateVerifierTest, verify_image_protobuf_packed_ranges) {
+  // Packs "4,0,5,10,15", and deliberately mismatches the text ranges, which must be ignored.
+  std::vector<std::unordered_map<std::string, std::string>> partitions = {
+    {
+        { "name", "system" },
+        { "ranges", "3,0,1" },
+        { "packed_ranges", "0,5,5,5" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+        { "priority_ranges", "2,10,12" },
+    },
+  };
+
+  std::string proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_TRUE(verifier_.HasPriorityBlocks());
+
+  // Odd number of values.
+  partitions[0]["packed_ranges"] = "0,5,5";
+  proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_FALSE(verifier_.ParseCareMap());
+
+  // Empty range.
+  partitions[0]["packed_ranges"] = "0,5,5,0";
+  proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_FALSE(verifier_.ParseCareMap());
+
+  // Past INT_MAX.
+  partitions[0]["packed_ranges"] = "0,5,4294967295,5";
+  proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_FALSE(verifier_.ParseCareMap());
+}
+
+TEST_F(UpdateVerifierTest, verify_image_deferred_verification) {
+  // This test relies on dm-verity support.
+  if (!verity_supported) {
+    GTEST_LOG_(INFO) << "Test skipped on devices without dm-verity support.";
+    return;
+  }
+
+  std::vector<std::unordered_map<std::string, std::string>> partitions = {
+    {
+        { "name", "system" },
+        { "ranges", "2,0,1" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+        { "priority_ranges", "2,0,1" },
+    },
+  };
+
+  std::string proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_TRUE(verifier_.VerifyPriorityPartitions());
+
+  ASSERT_FALSE(verifier_.HasDeferredVerification());
+  ASSERT_TRUE(verifier_.StartDeferredVerification());
+  ASSERT_TRUE(verifier_.HasDeferredVerification());
+  ASSERT_TRUE(verifier_.VerifyDeferredPartitions());
+  ASSERT_FALSE(verifier_.HasDeferredVerification());
+}
+
+TEST_F(UpdateVerifierTest, verify_image_sampled_verification) {
+  // This test relies on dm-verity support.
+  if (!verity_supported) {
+    GTEST_LOG_(INFO) << "Test skipped on devices without dm-verity support.";
+    return;
+  }
+
+  std::vector<std::unordered_map<std::string, std::string>> partitions = {
+    {
+        { "name", "system" },
+        { "ranges", "2,0,1024" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+    },
+  };
+
+  std::string proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_TRUE(verifier_.VerifySampledPartitions(50, 1234));
+  ASSERT_TRUE(verifier_.VerifySampledPartitions(1, 1234));
+}
+
+TEST_F(UpdateVerifierTest, verify_image_verified_on_earlier_boot) {
+  std::vector<std::unordered_map<std::string, std::string>> partitions = {
+    {
+        { "name", "system" },
+        { "ranges", "4,0,100,200,300" },
+        { "id", property_id_ },
+        { "fingerprint", fingerprint_ },
+    },
+  };
+
+  std::string proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_TRUE(LoadVerifiedBlocks().empty());
+
+  std::map<std::string, size_t> verified_blocks = { { "system", 50 } };
+  ASSERT_TRUE(SaveVerifiedBlocks(verified_blocks));
+  ASSERT_EQ(verified_blocks, LoadVerifiedBlocks());
+
+  // All of the partition has been verified, which leaves nothing to read.
+  verified_blocks["system"] = 200;
+  ASSERT_TRUE(SaveVerifiedBlocks(verified_blocks));
+  ASSERT_TRUE(verifier_.VerifyPartitions());
+
+  // The saved blocks are of another care map.
+  partitions[0]["ranges"] = "2,0,100";
+  proto = ConstructProto(partitions);
+  ASSERT_TRUE(android::base::WriteStringToFile(proto, care_map_pb_));
+  ASSERT_TRUE(verifier_.ParseCareMap());
+  ASSERT_TRUE(LoadVerifiedBlocks().empty());
+}
+
+TEST_F(UpdateVerifierTest, verify_image_read_blocks_progress) {
+  // A sparse file stands in for the dm devices, with the system blocks split in three work units.
+  TemporaryFile device;
+  ASSERT_EQ(0, ftruncate(device.fd, 20000 * 4096));
+  std::map<std::string, RangeSet> partitions = {
+    { "system", RangeSet({ { 0, 20000 } }) },
+    { "vendor", RangeSet({ { 100, 200 } }) },
+  };
+  std::map<std::string, std::string> dm_block_devices = {
+    { "system", device.path },
+    { "vendor", device.path },
+  };
+
+  std::map<std::string, std::vector<size_t>> progress;
+  ASSERT_TRUE(ReadBlocks(partitions, dm_block_devices,
+                         [&](const std::string& partition_name, size_t blocks_done) {
+                           progress[partition_name].push_back(blocks_done);
+                         }));
+  ASSERT_EQ(2u, progress.size());
+  ASSERT_EQ(std::vector<size_t>{ 100 }, progress["vendor"]);
+  ASSERT_TRUE(std::is_sorted(progress["system"].begin(), progress["system"].end()));
+  ASSERT_EQ(20000u, progress["system"].back());
+}
+
+TEST_F(UpdateVerifierTest, verify_image_read_options) {
+  TemporaryFile device;
+  ASSERT_EQ(0, ftruncate(device.fd, 300 * 4096));
+  std::map<std::string, RangeSet> partitions = {
+    { "system", RangeSet({ { 0, 7 }, { 10, 300 } }) },
+  };
+  std::map<std::string, std::string> dm_block_devices = {
+    { "system", device.path },
+  };
+
+  // Buffered reads of 2 blocks (the size rounded down to whole blocks) on 3 threads.
+  std::map<std::string, std::string> properties = {
+    { "ro.update_verifier.threads", "3" },
+    { "ro.update_verifier.read_kb", "10" },
+    { "ro.update_verifier.direct_io", "false" },
+  };
+  SetProperties(properties);
+  size_t blocks = 0;
+  ASSERT_TRUE(ReadBlocks(partitions, dm_block_devices,
+                         [&](const std::string&, size_t blocks_done) { blocks = blocks_done; }));
+  ASSERT_EQ(297u, blocks);
+
+  // The blocks past the end of the device fail to read, whatever the options.
+  partitions["system"] = RangeSet({ { 290, 310 } });
+  ASSERT_FALSE(ReadBlocks(partitions, dm_block_devices, nullptr));
+}
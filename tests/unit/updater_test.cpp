@@ -14,17 +14,22 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <memory>
+#include <set>
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -37,9 +42,11 @@
 #include <brotli/encode.h>
 #include <bsdiff/bsdiff.h>
 #include <gtest/gtest.h>
+#include <openssl/sha.h>
 #include <verity/hash_tree_builder.h>
 #include <ziparchive/zip_archive.h>
 #include <ziparchive/zip_writer.h>
+#include <zstd.h>
 
 #include "applypatch/applypatch.h"
 #include "common/test_constants.h"
@@ -49,6 +56,8 @@
 #include "otautil/print_sha1.h"
 #include "otautil/sysutil.h"
 #include "private/commands.h"
+#include "private/fec_encoder.h"
+#include "private/pending_syncs.h"
 #include "updater/blockimg.h"
 #include "updater/install.h"
 #include "updater/updater.h"
@@ -89,13 +98,15 @@ static void expect(const char* expected, const std::string& expr_str, CauseCode
   expect(expected, expr_str, cause_code, &updater);
 }
 
-static void BuildUpdatePackage(const PackageEntries& entries, int fd) {
+// Builds a package of |entries|, writing the ones in |deflated| as DEFLATED and the rest as STORED.
+static void BuildUpdatePackage(const PackageEntries& entries, int fd,
+                               const std::set<std::string>& deflated = {}) {
   FILE* zip_file_ptr = fdopen(fd, "wb");
   ZipWriter zip_writer(zip_file_ptr);
 
   for (const auto& entry : entries) {
-    // All the entries are written as STORED.
-    ASSERT_EQ(0, zip_writer.StartEntry(entry.first.c_str(), 0));
+    size_t flags = deflated.count(entry.first) ? ZipWriter::kCompress : 0;
+    ASSERT_EQ(0, zip_writer.StartEntry(entry.first.c_str(), flags));
     if (!entry.second.empty()) {
       ASSERT_EQ(0, zip_writer.WriteBytes(entry.second.data(), entry.second.size()));
     }
@@ -127,8 +138,7 @@ static Value* BlobToString(const char* name, State* state,
     return ErrorAbort(state, kArgsParsingFailure, "%s() expects a BLOB argument", name);
   }
 
-  args[0]->type = Value::Type::STRING;
-  return args[0].release();
+  return new Value(Value::Type::STRING, std::string(args[0]->view()));
 }
 
 class UpdaterTestBase {
@@ -163,16 +173,24 @@ class UpdaterTestBase {
   void RunBlockImageUpdate(bool is_verify, PackageEntries entries, const std::string& image_file,
                            const std::string& result, CauseCode cause_code = kNoCause) {
     CHECK(entries.find("transfer_list") != entries.end());
-    std::string new_data =
-        entries.find("new_data.br") != entries.end() ? "new_data.br" : "new_data";
+    std::string new_data = "new_data";
+    for (const auto& name : { "new_data.br", "new_data.zst" }) {
+      if (entries.find(name) != entries.end()) new_data = name;
+    }
     std::string script = is_verify ? "block_image_verify" : "block_image_update";
     script += R"((")" + image_file + R"(", package_extract_file("transfer_list"), ")" + new_data +
               R"(", "patch_data"))";
+    RunUpdateScript(std::move(entries), script, result, cause_code);
+  }
+
+  // Runs |script| against a package of |entries|, expecting |result| and |cause_code|.
+  void RunUpdateScript(PackageEntries entries, const std::string& script,
+                       const std::string& result, CauseCode cause_code = kNoCause) {
     entries.emplace(Updater::SCRIPT_NAME, script);
 
     // Build the update package.
     TemporaryFile zip_file;
-    BuildUpdatePackage(entries, zip_file.release());
+    BuildUpdatePackage(entries, zip_file.release(), deflated_entries_);
 
     // Set up the handler, command_pipe, patch offset & length.
     TemporaryFile temp_pipe;
@@ -197,6 +215,8 @@ class UpdaterTestBase {
   TemporaryDir temp_stash_base_;
   std::string last_command_file_;
   std::string image_file_;
+  // The package entries that RunUpdateScript() writes as DEFLATED.
+  std::set<std::string> deflated_entries_;
 
   Updater updater_;
 
@@ -219,6 +239,33 @@ class UpdaterTest : public UpdaterTestBase, public ::testing::Test {
     UpdaterTestBase::TearDown();
   }
 
+  // Writes 3 blocks of new data to image_file_ with two 'new' commands, out of order.
+  void RunNewDataOutOfOrder() {
+    std::vector<std::string> transfer_list{
+      // clang-format off
+      "4",
+      "3",
+      "0",
+      "0",
+      "new 4,0,1,2,3",
+      "new 2,1,2",
+      // clang-format on
+    };
+    std::string block1(4096, '1');
+    std::string block2(4096, '2');
+    std::string block3(4096, '3');
+    PackageEntries entries{
+      { "new_data", block1 + block2 + block3 },
+      { "patch_data", "" },
+      { "transfer_list", android::base::Join(transfer_list, '\n') },
+    };
+    RunBlockImageUpdate(false, entries, image_file_, "t");
+
+    std::string updated;
+    ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+    ASSERT_EQ(block1 + block3 + block2, updated);
+  }
+
   void SetUpdaterCmdPipe(int fd) {
     FILE* cmd_pipe = fdopen(fd, "w");
     ASSERT_NE(nullptr, cmd_pipe);
@@ -229,11 +276,32 @@ class UpdaterTest : public UpdaterTestBase, public ::testing::Test {
     updater_.package_handle_ = handle;
   }
 
+  void SetUpdaterScript(PackageEntries* entries, const std::string& script) {
+    entries->emplace(Updater::SCRIPT_NAME, script);
+  }
+
+  // Returns the previous length.
+  size_t SetUpdaterMappedPackageLength(size_t length) {
+    return std::exchange(updater_.mapped_package_.length, length);
+  }
+
   void FlushUpdaterCommandPipe() const {
     fflush(updater_.cmd_pipe_.get());
   }
 };
 
+TEST(UpdaterRuntimeTest, sehandle_loaded_on_first_use) {
+  int loads = 0;
+  UpdaterRuntime runtime([&loads]() -> struct selabel_handle* {
+    loads++;
+    return nullptr;
+  });
+  ASSERT_EQ(0, loads);
+  ASSERT_EQ(nullptr, runtime.sehandle());
+  ASSERT_EQ(nullptr, runtime.sehandle());
+  ASSERT_EQ(1, loads);
+}
+
 TEST_F(UpdaterTest, getprop) {
     expect(android::base::GetProperty("ro.product.device", "").c_str(),
            "getprop(\"ro.product.device\")",
@@ -337,6 +405,13 @@ TEST_F(UpdaterTest, file_getprop) {
     std::string script6("file_getprop(\"" + std::string(temp_file2.path) +
                        "\", \"ro.product.model\")");
     expect("", script6, kNoCause);
+
+    // The parsed file is cached, but a changed file is read again. The first of the repeated keys
+    // wins.
+    ASSERT_TRUE(android::base::WriteStringToFile("ro.product.name=dalek\nro.product.name=tardis\n",
+                                                 temp_file2.path));
+    expect("dalek", script1, kNoCause);
+    expect("", script2, kNoCause);
 }
 
 TEST_F(UpdaterTest, delete) {
@@ -452,6 +527,40 @@ TEST_F(UpdaterTest, symlink) {
   ASSERT_EQ(0, unlink(src2.c_str()));
 }
 
+TEST_F(UpdaterTest, set_metadata_recursive) {
+  TemporaryDir td;
+  std::string dir = std::string(td.path) + "/b";
+  ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+  std::vector<std::string> files;
+  for (const auto& name : { "/a1", "/a2", "/a3", "/b/c1", "/b/c2", "/b/c3", "/b/c4" }) {
+    files.push_back(td.path + std::string(name));
+    ASSERT_TRUE(android::base::WriteStringToFile("abc", files.back()));
+    ASSERT_EQ(0, chmod(files.back().c_str(), 0600));
+  }
+  // Already in place, so left alone.
+  ASSERT_EQ(0, chmod(files[1].c_str(), 0640));
+
+  std::string script("set_metadata_recursive(\"" + std::string(td.path) + "\", \"uid\", \"" +
+                     std::to_string(getuid()) + "\", \"gid\", \"" + std::to_string(getgid()) +
+                     "\", \"dmode\", \"0750\", \"fmode\", \"0640\")");
+  expect("", script, kNoCause);
+
+  struct stat sb;
+  for (const auto& file : files) {
+    ASSERT_EQ(0, stat(file.c_str(), &sb));
+    ASSERT_EQ(static_cast<mode_t>(0640), sb.st_mode & 07777) << file;
+  }
+  ASSERT_EQ(0, stat(dir.c_str(), &sb));
+  ASSERT_EQ(static_cast<mode_t>(0750), sb.st_mode & 07777);
+  ASSERT_EQ(0, stat(td.path, &sb));
+  ASSERT_EQ(static_cast<mode_t>(0750), sb.st_mode & 07777);
+
+  for (const auto& file : files) {
+    ASSERT_EQ(0, unlink(file.c_str()));
+  }
+  ASSERT_EQ(0, rmdir(dir.c_str()));
+}
+
 TEST_F(UpdaterTest, package_extract_dir) {
   // package_extract_dir expects 2 arguments.
   expect(nullptr, "package_extract_dir()", kArgsParsingFailure);
@@ -596,6 +705,41 @@ TEST_F(UpdaterTest, package_extract_file) {
   expect(nullptr, script, kPackageExtractFileFailure, &updater_);
 }
 
+TEST_F(UpdaterTest, package_extract_partition) {
+  // package_extract_partition expects 2 or 3 arguments.
+  expect(nullptr, "package_extract_partition(\"arg1\")", kArgsParsingFailure);
+  expect(nullptr, "package_extract_partition(\"a\", \"b\", \"c\", \"d\")", kArgsParsingFailure);
+
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+  SetUpdaterOtaPackageHandle(handle);
+
+  TemporaryFile temp_file;
+  std::string script("package_extract_partition(\"a.txt\", \"" + std::string(temp_file.path) +
+                     "\")");
+  expect("t", script, kNoCause, &updater_);
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &data));
+  ASSERT_EQ(kATxtContents, data);
+
+  // With the expected SHA-1.
+  script = "package_extract_partition(\"b.txt\", \"" + std::string(temp_file.path) + "\", \"" +
+           GetSha1(kBTxtContents) + "\")";
+  expect("t", script, kNoCause, &updater_);
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &data));
+  ASSERT_EQ(kBTxtContents, data.substr(0, kBTxtContents.size()));
+
+  // Mismatching SHA-1.
+  script = "package_extract_partition(\"b.txt\", \"" + std::string(temp_file.path) + "\", \"" +
+           GetSha1(kATxtContents) + "\")";
+  expect("", script, kNoCause, &updater_);
+
+  // Missing zip entry.
+  script = "package_extract_partition(\"doesntexist\", \"" + std::string(temp_file.path) + "\")";
+  expect("", script, kNoCause, &updater_);
+}
+
 TEST_F(UpdaterTest, read_file) {
   // read_file() expects one argument.
   expect(nullptr, "read_file()", kArgsParsingFailure);
@@ -697,6 +841,77 @@ TEST_F(UpdaterTest, compute_hash_tree_root_mismatch) {
   RunBlockImageUpdate(false, entries, image_file_, "", kHashTreeComputationFailure);
 }
 
+TEST_F(UpdaterTest, compute_fec_smoke) {
+  std::string data;
+  for (size_t i = 0; i < 300; i++) {
+    data += std::string(4096, static_cast<char>(i * 7));
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(data, image_file_));
+
+  // 300 blocks with 2 roots take two rounds of 253 blocks, i.e. 4 blocks of FEC data, followed by
+  // the header block.
+  std::vector<uint8_t> expected;
+  {
+    android::base::unique_fd fd(open(image_file_.c_str(), O_RDONLY));
+    ASSERT_TRUE(EncodeFec(fd.get(), RangeSet({ { 0, 300 } }), 2, 1, &expected));
+  }
+  AppendFecHeader(300, 2, &expected);
+  ASSERT_EQ(5 * 4096, expected.size());
+  data += std::string(5 * 4096, '\0');
+  ASSERT_TRUE(android::base::WriteStringToFile(data, image_file_));
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(expected.data(), expected.size(), digest);
+  std::string fec_command = "compute_fec 2,300,305 2,0,300 2 " + print_sha1(digest);
+  std::vector<std::string> transfer_list{
+    "4", "5", "0", "5", fec_command,
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, "\n") },
+  };
+
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(305 * 4096, updated.size());
+  ASSERT_EQ(data.substr(0, 300 * 4096), updated.substr(0, 300 * 4096));
+  ASSERT_EQ(std::string(expected.begin(), expected.end()), updated.substr(300 * 4096));
+}
+
+TEST_F(UpdaterTest, compute_fec_mismatch) {
+  std::string data;
+  for (size_t i = 0; i < 300; i++) {
+    data += std::string(4096, static_cast<char>(i * 7));
+  }
+  data += std::string(4 * 4096, '\0');
+  ASSERT_TRUE(android::base::WriteStringToFile(data, image_file_));
+
+  std::vector<std::string> transfer_list{
+    "4",
+    "4",
+    "0",
+    "4",
+    "compute_fec 2,300,304 2,0,300 2 0000000000000000000000000000000000000000",
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, "\n") },
+  };
+
+  RunBlockImageUpdate(false, entries, image_file_, "", kFecComputationFailure);
+
+  // Nothing gets written.
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(data, updated);
+}
+
 TEST_F(UpdaterTest, write_value) {
   // write_value() expects two arguments.
   expect(nullptr, "write_value()", kArgsParsingFailure);
@@ -730,6 +945,42 @@ TEST_F(UpdaterTest, write_value) {
   expect("", script, kNoCause);
 }
 
+TEST_F(UpdaterTest, sync) {
+  expect(nullptr, "sync(\"arg1\")", kArgsParsingFailure);
+
+  // The writes of write_value() are synced at the next barrier.
+  ASSERT_TRUE(PendingSyncs::Get().SyncAll());
+  TemporaryFile temp_file;
+  std::string script("write_value(\"value\", \"" + std::string(temp_file.path) + "\")");
+  expect("t", script, kNoCause);
+  ASSERT_EQ(1u, PendingSyncs::Get().size());
+  expect("t", "sync()", kNoCause);
+  ASSERT_EQ(0u, PendingSyncs::Get().size());
+}
+
+TEST_F(UpdaterTest, unmount_after_package_extract_file) {
+  TemporaryDir mount_point;
+  if (mount("tmpfs", mount_point.path, "tmpfs", 0, nullptr) == -1) {
+    GTEST_SKIP() << "Failed to mount a tmpfs (needs root): " << strerror(errno);
+  }
+
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+  SetUpdaterOtaPackageHandle(handle);
+
+  // The pending sync of the extracted file mustn't keep the filesystem busy.
+  ASSERT_TRUE(PendingSyncs::Get().SyncAll());
+  std::string file = std::string(mount_point.path) + "/a.txt";
+  expect("t", "package_extract_file(\"a.txt\", \"" + file + "\")", kNoCause, &updater_);
+  ASSERT_EQ(1u, PendingSyncs::Get().size());
+  expect(mount_point.path, "unmount(\""s + mount_point.path + "\")", kNoCause, &updater_);
+  ASSERT_EQ(0u, PendingSyncs::Get().size());
+
+  bool still_mounted = umount(mount_point.path) == 0;
+  ASSERT_FALSE(still_mounted);
+}
+
 TEST_F(UpdaterTest, get_stage) {
   // get_stage() expects one argument.
   expect(nullptr, "get_stage()", kArgsParsingFailure);
@@ -810,6 +1061,24 @@ TEST_F(UpdaterTest, set_progress) {
   ASSERT_EQ(2U, android::base::Split(cmd, " ").size());
 }
 
+TEST_F(UpdaterTest, set_progress_coalesced) {
+  TemporaryFile tf;
+  SetUpdaterCmdPipe(tf.release());
+  expect(".1", "set_progress(\".1\")", kNoCause, &updater_);
+  expect(".2", "set_progress(\".2\")", kNoCause, &updater_);
+  expect(".3", "set_progress(\".3\")", kNoCause, &updater_);
+  // Only the latest of the held back updates goes out, ahead of the next message.
+  expect("done", "ui_print(\"done\")", kNoCause, &updater_);
+  FlushUpdaterCommandPipe();
+
+  // A slow run may let .2 out as well, but .3 always comes last, before the ui_print.
+  std::string cmd;
+  ASSERT_TRUE(android::base::ReadFileToString(tf.path, &cmd));
+  ASSERT_TRUE(android::base::StartsWith(cmd, android::base::StringPrintf("set_progress %f\n", .1)));
+  ASSERT_TRUE(android::base::EndsWith(
+      cmd, android::base::StringPrintf("set_progress %f\nui_print done\n", .3)));
+}
+
 TEST_F(UpdaterTest, show_progress) {
   // show_progress() expects two arguments.
   expect(nullptr, "show_progress()", kArgsParsingFailure);
@@ -942,6 +1211,46 @@ TEST_F(UpdaterTest, block_image_update_patch_underrun) {
   RunBlockImageUpdate(false, entries, image_file_, "", kPatchApplicationFailure);
 }
 
+TEST_F(UpdaterTest, block_image_update_patch_mapped_source) {
+  // A source large enough to be mapped from the partition, and a target next to it.
+  std::string source;
+  for (size_t i = 0; i < 400; i++) {
+    source += std::string(4096, static_cast<char>('a' + i % 26));
+  }
+  std::string target = source;
+  for (size_t i = 0; i < target.size(); i += 4096 * 7) {
+    target[i] = 'X';
+  }
+  std::string image = source + std::string(400 * 4096, '\0');
+  ASSERT_TRUE(android::base::WriteStringToFile(image, image_file_));
+
+  TemporaryFile patch_file;
+  ASSERT_EQ(0, bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(source.data()), source.size(),
+                              reinterpret_cast<const uint8_t*>(target.data()), target.size(),
+                              patch_file.path, nullptr));
+  std::string patch_content;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch_content));
+
+  std::vector<std::string> transfer_list{
+    "4",
+    "400",
+    "0",
+    "0",
+    android::base::StringPrintf("bsdiff 0 %zu %s %s 2,400,800 400 2,0,400", patch_content.size(),
+                                GetSha1(source).c_str(), GetSha1(target).c_str()),
+  };
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", patch_content },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(source + target, updated);
+}
+
 TEST_F(UpdaterTest, block_image_update_fail) {
   std::string src_content(4096 * 2, 'e');
   std::string src_hash = GetSha1(src_content);
@@ -978,6 +1287,39 @@ TEST_F(UpdaterTest, block_image_update_fail) {
   ASSERT_EQ(0, rmdir(stash_base.c_str()));
 }
 
+TEST_F(UpdaterTest, block_image_update_memory_stash_source) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block1_hash = GetSha1(block1);
+
+  // Nothing overwrites block 0, so its stash stays in memory for the move that reads it.
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    "1",
+    "1",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3, image_file_));
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_contents));
+  ASSERT_EQ(block1 + block2 + block1, updated_contents);
+}
+
 TEST_F(UpdaterTest, new_data_over_write) {
   std::vector<std::string> transfer_list{
     // clang-format off
@@ -1027,6 +1369,82 @@ TEST_F(UpdaterTest, new_data_short_write) {
   RunBlockImageUpdate(false, entries, image_file_, "t");
 }
 
+TEST_F(UpdaterTest, new_data_stored) {
+  // STORED new data gets written straight from the mapped package.
+  RunNewDataOutOfOrder();
+}
+
+TEST_F(UpdaterTest, new_data_deflated) {
+  // DEFLATED new data goes through the decompressor thread.
+  deflated_entries_ = { "new_data" };
+  RunNewDataOutOfOrder();
+}
+
+TEST_F(UpdaterTest, block_image_update_parallel) {
+  std::string block1(4096, '1');
+  std::string block2(4096, '2');
+  std::string block3(4096, '3');
+  std::string block1_hash = GetSha1(block1);
+  std::string block3_hash = GetSha1(block3);
+
+  // The first partition gets written with new data, while the update of the second one gets
+  // interrupted.
+  std::vector<std::string> transfer_list_new{
+    // clang-format off
+    "4",
+    "1",
+    "0",
+    "0",
+    "new 2,0,1",
+    // clang-format on
+  };
+  std::vector<std::string> transfer_list_fail{
+    // clang-format off
+    "4",
+    "2",
+    "0",
+    "2",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "stash " + block3_hash + " 2,2,3",
+    "abort",
+    // clang-format on
+  };
+
+  TemporaryFile other_image;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(4096, '0'), image_file_));
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3, other_image.path));
+
+  // The first one goes first, should parallel() run them in turn.
+  std::string script =
+      R"(parallel(block_image_update(")" + image_file_ +
+      R"(", package_extract_file("transfer_list_new"), "new_data", "patch_data"),)" +
+      R"(block_image_update(")" + std::string(other_image.path) +
+      R"(", package_extract_file("transfer_list_fail"), "new_data", "patch_data")))";
+  PackageEntries entries{
+    { "new_data", std::string(4096, 'a') },
+    { "patch_data", "" },
+    { "transfer_list_new", android::base::Join(transfer_list_new, '\n') },
+    { "transfer_list_fail", android::base::Join(transfer_list_fail, '\n') },
+  };
+  RunUpdateScript(entries, script, "");
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated));
+  ASSERT_EQ(std::string(4096, 'a'), updated);
+
+  // Under parallel(), each update saves its progress in a last_command file of its own.
+  std::string last_command_content;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file_, &last_command_content));
+  ASSERT_EQ("", last_command_content);
+  std::string other_last_command = last_command_file_ + "." + GetSha1(other_image.path);
+  std::string last_command_actual;
+  ASSERT_TRUE(android::base::ReadFileToString(other_last_command, &last_command_actual));
+  ASSERT_EQ("2\n" + transfer_list_fail[TransferList::kTransferListHeaderLines + 2],
+            last_command_actual);
+  ASSERT_TRUE(android::base::RemoveFileIfExists(other_last_command));
+}
+
 TEST_F(UpdaterTest, brotli_new_data) {
   auto generator = []() { return rand() % 128; };
   // Generate 100 blocks of random data.
@@ -1070,6 +1488,130 @@ TEST_F(UpdaterTest, brotli_new_data) {
   ASSERT_EQ(brotli_new_data, updated_content);
 }
 
+TEST_F(UpdaterTest, brotli_new_data_segments_out_of_package) {
+  std::string new_data(4096 * 10, 'a');
+  size_t encoded_size = BrotliEncoderMaxCompressedSize(new_data.size());
+  std::string encoded_data(encoded_size, 0);
+  ASSERT_TRUE(BrotliEncoderCompress(
+      BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE, new_data.size(),
+      reinterpret_cast<const uint8_t*>(new_data.data()), &encoded_size,
+      reinterpret_cast<uint8_t*>(encoded_data.data())));
+  encoded_data.resize(encoded_size);
+
+  std::vector<std::string> transfer_list = {
+    "4",
+    "10",
+    "0",
+    "0",
+    "new 2,0,10",
+  };
+  std::string script = R"(block_image_update(")" + image_file_ +
+                       R"(", package_extract_file("transfer_list"), "new_data.br", "patch_data"))";
+  PackageEntries entries{
+    { "new_data.br", encoded_data },
+    // A single segment, which decompresses as a single stream as well.
+    { "new_data.br.index", "1\n" + std::to_string(encoded_size) + " 40960\n" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+  SetUpdaterScript(&entries, script);
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+  TemporaryFile temp_pipe;
+  ASSERT_TRUE(updater_.Init(temp_pipe.release(), zip_file.path, false));
+
+  // Cut the mapped package short of the end of the new data. The segments must not be read past
+  // the mapping, but the new data can still be decompressed as a stream.
+  ZipEntry64 new_entry;
+  ASSERT_EQ(0, FindEntry(updater_.GetPackageHandle(), "new_data.br", &new_entry));
+  size_t length = SetUpdaterMappedPackageLength(new_entry.offset + encoded_size - 1);
+  ASSERT_TRUE(updater_.RunUpdate());
+  SetUpdaterMappedPackageLength(length);
+  ASSERT_EQ("t", updater_.GetResult());
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_content));
+  ASSERT_EQ(new_data, updated_content);
+}
+
+TEST_F(UpdaterTest, zstd_new_data) {
+  auto generator = []() { return rand() % 128; };
+  // Generate 100 blocks of random data.
+  std::string zstd_new_data;
+  zstd_new_data.reserve(4096 * 100);
+  generate_n(back_inserter(zstd_new_data), 4096 * 100, generator);
+
+  // Compress it into frames of 10 blocks each.
+  std::string encoded_data;
+  for (size_t offset = 0; offset < zstd_new_data.size(); offset += 4096 * 10) {
+    std::string frame(ZSTD_compressBound(4096 * 10), 0);
+    size_t frame_size =
+        ZSTD_compress(frame.data(), frame.size(), zstd_new_data.data() + offset, 4096 * 10, 3);
+    ASSERT_FALSE(ZSTD_isError(frame_size));
+    encoded_data.append(frame, 0, frame_size);
+  }
+
+  std::vector<std::string> transfer_list = {
+    "4",
+    "100",
+    "0",
+    "0",
+    "new 2,0,1",
+    "new 2,1,2",
+    "new 4,2,50,50,97",
+    "new 2,97,98",
+    "new 2,98,99",
+    "new 2,99,100",
+  };
+
+  PackageEntries entries{
+    { "new_data.zst", std::move(encoded_data) },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // The frames of the stored entry get decompressed in parallel.
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_content));
+  ASSERT_EQ(zstd_new_data, updated_content);
+}
+
+TEST_F(UpdaterTest, zstd_new_data_stream) {
+  auto generator = []() { return rand() % 128; };
+  std::string zstd_new_data;
+  zstd_new_data.reserve(4096 * 10);
+  generate_n(back_inserter(zstd_new_data), 4096 * 10, generator);
+
+  std::string encoded_data(ZSTD_compressBound(zstd_new_data.size()), 0);
+  size_t encoded_size = ZSTD_compress(encoded_data.data(), encoded_data.size(),
+                                      zstd_new_data.data(), zstd_new_data.size(), 3);
+  ASSERT_FALSE(ZSTD_isError(encoded_size));
+  encoded_data.resize(encoded_size);
+
+  std::vector<std::string> transfer_list = {
+    "4",
+    "10",
+    "0",
+    "0",
+    "new 2,0,3",
+    "new 2,3,10",
+  };
+
+  PackageEntries entries{
+    { "new_data.zst", std::move(encoded_data) },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // A deflated entry can only be decompressed as a stream.
+  deflated_entries_ = { "new_data.zst" };
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_content));
+  ASSERT_EQ(zstd_new_data, updated_content);
+}
+
 TEST_F(UpdaterTest, last_command_update) {
   std::string block1(4096, '1');
   std::string block2(4096, '2');
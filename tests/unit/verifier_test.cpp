@@ -246,6 +246,34 @@ TEST(VerifierTest, LoadKeysFromZipfile_multiple_key) {
   VerifyPackageWithCertificates("otasigned_v5.zip", certs);
 }
 
+TEST(VerifierTest, LoadKeysFromZipfile_cached) {
+  TemporaryFile otacerts;
+  BuildCertificateArchive(
+      {
+          from_testdata_base("testkey_v3.x509.pem"),
+          from_testdata_base("testkey_v4.x509.pem"),
+      },
+      otacerts.release());
+
+  // The second load reuses the parsed keys, which must outlive the first result.
+  std::vector<Certificate> certs = LoadKeysFromZipfile(otacerts.path);
+  ASSERT_EQ(2, certs.size());
+  std::vector<Certificate> cached_certs = LoadKeysFromZipfile(otacerts.path);
+  certs.clear();
+  ASSERT_EQ(2, cached_certs.size());
+  VerifyPackageWithCertificates("otasigned_v4.zip", cached_certs);
+  // This now tries the key that verified the previous package first.
+  VerifyPackageWithCertificates("otasigned_v3.zip", cached_certs);
+  VerifyPackageWithCertificates("otasigned_v4.zip", cached_certs);
+
+  // Changing the zipfile invalidates the cache.
+  BuildCertificateArchive({ from_testdata_base("testkey_v5.x509.pem") },
+                          open(otacerts.path, O_WRONLY | O_TRUNC));
+  certs = LoadKeysFromZipfile(otacerts.path);
+  ASSERT_EQ(1, certs.size());
+  VerifyPackageWithCertificates("otasigned_v5.zip", certs);
+}
+
 class VerifierTest : public testing::TestWithParam<std::vector<std::string>> {
  protected:
   void SetUp() override {
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "otautil/print_sha1.h"
+#include "private/commands.h"
+#include "private/verify_ahead.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+class VerifyAheadTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    std::mt19937 rng(42);
+    content_.resize(64 * kBlockSize);
+    for (auto& c : content_) {
+      c = static_cast<char>(rng());
+    }
+    ASSERT_TRUE(android::base::WriteStringToFile(content_, image_.path));
+  }
+
+  // Returns the SHA-1 of the blocks of |ranges| in order.
+  std::string Hash(const std::vector<std::pair<size_t, size_t>>& ranges) const {
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    for (const auto& [begin, end] : ranges) {
+      SHA1_Update(&ctx, content_.data() + begin * kBlockSize, (end - begin) * kBlockSize);
+    }
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1_Final(digest, &ctx);
+    return print_sha1(digest);
+  }
+
+  std::vector<AheadChecks> Check(const std::vector<std::string>& commands, size_t threads,
+                                 size_t batch_blocks, AheadCheckStats* stats = nullptr) {
+    std::string text = "4\n64\n1\n8\n" + android::base::Join(commands, '\n');
+    std::string err;
+    TransferList transfer_list = TransferList::Parse(text, &err);
+    EXPECT_TRUE(transfer_list) << err;
+    android::base::unique_fd fd(open(image_.path, O_RDONLY));
+    return CheckCommandsAhead(fd, transfer_list, kBlockSize, threads, batch_blocks * kBlockSize,
+                              stats);
+  }
+
+  void CheckAll(size_t threads, size_t batch_blocks) {
+    std::string stash_id = Hash({ { 10, 12 } });
+    std::string bad_hash(40, '0');
+    std::vector<std::string> commands = {
+      // 0: The source of a stash.
+      "stash " + stash_id + " 2,10,12",
+      // 1: A move that hasn't been done yet.
+      "move " + Hash({ { 0, 4 } }) + " 2,20,24 4 2,0,4",
+      // 2: A diff that has been done already.
+      "bsdiff 0 0 " + bad_hash + " " + Hash({ { 30, 32 } }) + " 2,30,32 2 2,0,2",
+      // 3: A diff of the source blocks and the stash, in this order.
+      "bsdiff 0 0 " + Hash({ { 40, 42 }, { 10, 12 } }) + " " + bad_hash + " 2,50,54 4 2,40,42 " +
+          "2,0,2 " + stash_id + ":2,2,4",
+      // 4: A source that doesn't match.
+      "imgdiff 0 0 " + bad_hash + " " + bad_hash + " 2,56,58 2 2,44,46",
+      // 5: The stash is gone after this, and can't be checked ahead of time.
+      "free " + stash_id,
+      "move " + stash_id + " 2,60,62 2 - " + stash_id + ":2,0,2",
+      // 7: A move larger than a batch, from reversed ranges.
+      "move " + Hash({ { 8, 12 }, { 0, 8 } }) + " 2,40,52 12 4,8,12,0,8",
+    };
+
+    AheadCheckStats stats;
+    std::vector<AheadChecks> results = Check(commands, threads, batch_blocks, &stats);
+    ASSERT_EQ(commands.size(), results.size());
+    ASSERT_EQ(12U, stats.checks);
+
+    ASSERT_EQ(AheadCheck::kUnknown, results[0].target);
+    ASSERT_EQ(AheadCheck::kMatch, results[0].source);
+    ASSERT_EQ(AheadCheck::kMismatch, results[1].target);
+    ASSERT_EQ(AheadCheck::kMatch, results[1].source);
+    ASSERT_EQ(AheadCheck::kMatch, results[2].target);
+    ASSERT_EQ(AheadCheck::kUnknown, results[2].source);
+    ASSERT_EQ(AheadCheck::kMismatch, results[3].target);
+    ASSERT_EQ(AheadCheck::kMatch, results[3].source);
+    ASSERT_EQ(AheadCheck::kMismatch, results[4].target);
+    ASSERT_EQ(AheadCheck::kUnknown, results[4].source);
+    ASSERT_EQ(AheadCheck::kUnknown, results[5].source);
+    ASSERT_EQ(AheadCheck::kMismatch, results[6].target);
+    ASSERT_EQ(AheadCheck::kUnknown, results[6].source);
+    ASSERT_EQ(AheadCheck::kMismatch, results[7].target);
+    ASSERT_EQ(AheadCheck::kMatch, results[7].source);
+  }
+
+  std::string content_;
+  TemporaryFile image_;
+};
+
+TEST_F(VerifyAheadTest, SingleBatch) {
+  CheckAll(1, 1024);
+}
+
+TEST_F(VerifyAheadTest, SmallBatches) {
+  CheckAll(1, 8);
+  CheckAll(3, 8);
+  CheckAll(4, 1);
+}
+
+TEST_F(VerifyAheadTest, MergedReads) {
+  // The first block of the target is block 3 of the source; the reads of both get merged.
+  std::vector<std::string> commands = {
+    "move " + Hash({ { 0, 4 } }) + " 2,3,7 4 2,0,4",
+  };
+  AheadCheckStats stats;
+  std::vector<AheadChecks> results = Check(commands, 2, 1024, &stats);
+  ASSERT_EQ(AheadCheck::kMismatch, results[0].target);
+  ASSERT_EQ(AheadCheck::kMatch, results[0].source);
+  ASSERT_EQ(1U, stats.batches);
+  ASSERT_EQ(1U, stats.extents);
+  ASSERT_EQ(7 * kBlockSize, stats.bytes);
+}
+
+TEST_F(VerifyAheadTest, ReadError) {
+  // Past the end of the image.
+  std::vector<std::string> commands = {
+    "move " + Hash({ { 0, 4 } }) + " 2,100,104 4 2,0,4",
+  };
+  std::vector<AheadChecks> results = Check(commands, 1, 1024);
+  ASSERT_EQ(AheadCheck::kUnknown, results[0].target);
+  ASSERT_EQ(AheadCheck::kUnknown, results[0].source);
+}
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <utime.h>
 
 #include <string>
 
@@ -189,3 +190,43 @@ TEST(ZipUtilTest, set_timestamp) {
 
   CloseArchive(handle);
 }
+
+TEST(ZipUtilTest, extract_skip_unchanged) {
+  std::string zip_path = from_testdata_base("ziptest_valid.zip");
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_path.c_str(), &handle));
+
+  TemporaryDir td;
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "b", td.path, nullptr, nullptr));
+  std::string path(td.path);
+  std::string file_c = path + "/c.txt";
+  std::string file_d = path + "/d.txt";
+
+  ZipEntry64 entry;
+  ASSERT_EQ(0, FindEntry(handle, "b/c.txt", &entry));
+  ASSERT_TRUE(FileMatchesZipEntry(file_c, entry));
+  ASSERT_FALSE(FileMatchesZipEntry(file_d, entry));
+  ASSERT_FALSE(FileMatchesZipEntry(path + "/doesntexist", entry));
+
+  // Corrupt c.txt while keeping its size, and age d.txt so that rewriting it would be noticed.
+  std::string corrupted(kCTxtContents.size(), 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(corrupted, file_c));
+  ASSERT_FALSE(FileMatchesZipEntry(file_c, entry));
+  struct utimbuf old_time = { 1000, 1000 };
+  ASSERT_EQ(0, utime(file_d.c_str(), &old_time));
+
+  ASSERT_TRUE(ExtractPackageRecursive(handle, "b", td.path, nullptr, nullptr, true));
+
+  // c.txt is extracted again; d.txt is untouched.
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(file_c, &content));
+  ASSERT_EQ(kCTxtContents, content);
+  struct stat sb;
+  ASSERT_EQ(0, stat(file_d.c_str(), &sb));
+  ASSERT_EQ(1000, static_cast<long>(sb.st_mtime));
+
+  ASSERT_EQ(0, unlink(file_c.c_str()));
+  ASSERT_EQ(0, unlink(file_d.c_str()));
+
+  CloseArchive(handle);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <zstd.h>
+
+#include "private/zstd_frames.h"
+
+// Compresses each of |pieces| into a frame of its own, and returns the concatenated frames.
+static std::string CompressFrames(const std::vector<std::string>& pieces) {
+  std::string data;
+  for (const auto& piece : pieces) {
+    std::string frame(ZSTD_compressBound(piece.size()), '\0');
+    size_t frame_size = ZSTD_compress(frame.data(), frame.size(), piece.data(), piece.size(), 3);
+    EXPECT_FALSE(ZSTD_isError(frame_size));
+    data.append(frame, 0, frame_size);
+  }
+  return data;
+}
+
+static const uint8_t* Bytes(const std::string& s) {
+  return reinterpret_cast<const uint8_t*>(s.data());
+}
+
+TEST(ZstdFramesTest, FindZstdFrames) {
+  std::string data = CompressFrames({ std::string(4096, 'a'), "", std::string(10000, 'b') });
+  std::vector<CompressedSegment> frames;
+  std::string err;
+  ASSERT_TRUE(FindZstdFrames(Bytes(data), data.size(), &frames, &err)) << err;
+  ASSERT_EQ(3u, frames.size());
+  ASSERT_EQ(0u, frames[0].offset);
+  ASSERT_EQ(4096u, frames[0].size);
+  ASSERT_EQ(frames[0].compressed_size, frames[1].offset);
+  ASSERT_EQ(0u, frames[1].size);
+  ASSERT_EQ(10000u, frames[2].size);
+  ASSERT_EQ(data.size(), frames[2].offset + frames[2].compressed_size);
+}
+
+TEST(ZstdFramesTest, FindZstdFrames_InvalidInput) {
+  std::vector<CompressedSegment> frames;
+  std::string err;
+  std::string garbage(100, 'x');
+  ASSERT_FALSE(FindZstdFrames(Bytes(garbage), garbage.size(), &frames, &err));
+
+  // Truncated.
+  std::string data = CompressFrames({ std::string(4096, 'a'), std::string(4096, 'b') });
+  ASSERT_FALSE(FindZstdFrames(Bytes(data), data.size() - 1, &frames, &err));
+
+  // A streamed frame that doesn't record its size.
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  std::string input(4096, 'c');
+  std::string output(ZSTD_compressBound(input.size()), '\0');
+  ZSTD_inBuffer in{ input.data(), input.size(), 0 };
+  ZSTD_outBuffer out{ output.data(), output.size(), 0 };
+  ASSERT_FALSE(ZSTD_isError(ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_continue)));
+  ASSERT_EQ(0u, ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end));
+  ZSTD_freeCCtx(cctx);
+  ASSERT_FALSE(FindZstdFrames(Bytes(output), out.pos, &frames, &err));
+}
+
+TEST(ZstdFramesTest, DecompressZstdFrames) {
+  std::vector<std::string> pieces;
+  std::string expected;
+  for (size_t i = 0; i < 20; i++) {
+    std::string piece;
+    for (size_t j = 0; j < 4096 * (i % 3 + 1); j++) {
+      piece += static_cast<char>('a' + (i * j) % 26);
+    }
+    pieces.push_back(piece);
+    expected += piece;
+  }
+  std::string data = CompressFrames(pieces);
+  std::vector<CompressedSegment> frames;
+  std::string err;
+  ASSERT_TRUE(FindZstdFrames(Bytes(data), data.size(), &frames, &err)) << err;
+
+  for (size_t threads : { 1, 3, 8 }) {
+    std::string result;
+    ASSERT_TRUE(DecompressZstdFrames(Bytes(data), frames, threads,
+                                     [&result](const uint8_t* data, size_t size) {
+                                       result.append(reinterpret_cast<const char*>(data), size);
+                                       return true;
+                                     }));
+    ASSERT_EQ(expected, result);
+  }
+
+  // Mismatching uncompressed size.
+  frames[1].size++;
+  ASSERT_FALSE(DecompressZstdFrames(Bytes(data), frames, 2,
+                                    [](const uint8_t*, size_t) { return true; }));
+}
@@ -53,7 +53,14 @@ import java.util.TreeMap;
 import java.util.logging.Level;
 import java.util.logging.Logger;
 
+import javax.imageio.IIOImage;
 import javax.imageio.ImageIO;
+import javax.imageio.ImageTypeSpecifier;
+import javax.imageio.ImageWriteParam;
+import javax.imageio.ImageWriter;
+import javax.imageio.metadata.IIOMetadata;
+import javax.imageio.metadata.IIOMetadataNode;
+import javax.imageio.stream.ImageOutputStream;
 import javax.xml.parsers.DocumentBuilder;
 import javax.xml.parsers.DocumentBuilderFactory;
 import javax.xml.parsers.ParserConfigurationException;
@@ -65,6 +72,8 @@ public class ImageGenerator {
 
     private static final float DEFAULT_FONT_SIZE = 40;
 
+    private static final String PNG_METADATA_FORMAT = "javax_imageio_png_1.0";
+
     private static final Logger LOGGER = Logger.getLogger(ImageGenerator.class.getName());
 
     // This is the canvas we used to draw texts.
@@ -80,6 +89,11 @@ public class ImageGenerator {
     // The current vertical offset in pixels to draw the top edge of new text strings.
     private int mVerticalOffset;
 
+    // The index entries "<locale>:<y>:<width>:<height>" of the localized images drawn so far, where
+    // y is the offset of the metadata line. It's saved as the "Locales" text chunk of the output,
+    // for minui/resources.cpp to find a locale without parsing the metadata lines.
+    private final List<String> mLocaleIndex = new ArrayList<>();
+
     // The font size to draw the texts.
     private final float mFontSize;
 
@@ -567,6 +581,42 @@ public class ImageGenerator {
             int[] pixel = {info.get(i)};
             mBufferedImage.getRaster().setPixel(i, currentImageStart, pixel);
         }
+        mLocaleIndex.add(
+                languageTag + ":" + currentImageStart + ":" + mImageWidth + ":"
+                        + currentImageHeight);
+    }
+
+    /**
+     * Writes the image as a PNG file, with the locale index in its "Locales" text chunk. The text
+     * chunk goes ahead of the image data, so that it's read along with the PNG header.
+     *
+     * @param outputPath the path to write the image file.
+     * @throws IOException if we failed to write the image file.
+     */
+    private void writeImage(String outputPath) throws IOException {
+        ImageWriter writer = ImageIO.getImageWritersByFormatName("png").next();
+        ImageWriteParam param = writer.getDefaultWriteParam();
+        IIOMetadata metadata =
+                writer.getDefaultImageMetadata(
+                        ImageTypeSpecifier.createFromRenderedImage(mBufferedImage), param);
+
+        IIOMetadataNode entry = new IIOMetadataNode("tEXtEntry");
+        entry.setAttribute("keyword", "Locales");
+        entry.setAttribute("value", String.join(",", mLocaleIndex));
+        IIOMetadataNode text = new IIOMetadataNode("tEXt");
+        text.appendChild(entry);
+        IIOMetadataNode root = new IIOMetadataNode(PNG_METADATA_FORMAT);
+        root.appendChild(text);
+        metadata.mergeTree(PNG_METADATA_FORMAT, root);
+
+        File outputFile = new File(outputPath);
+        outputFile.delete();
+        try (ImageOutputStream output = ImageIO.createImageOutputStream(outputFile)) {
+            writer.setOutput(output);
+            writer.write(null, new IIOImage(mBufferedImage, null, metadata), param);
+        } finally {
+            writer.dispose();
+        }
     }
 
     /**
@@ -634,7 +684,7 @@ public class ImageGenerator {
         }
 
         resize(mImageWidth, mVerticalOffset);
-        ImageIO.write(mBufferedImage, "png", new File(outputPath));
+        writeImage(outputPath);
     }
 
     /** Prints the helper message. */
@@ -89,7 +89,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
+#include <linux/xattr.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -97,12 +99,21 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -122,8 +133,13 @@
 using android::fs_mgr::Fstab;
 using android::fs_mgr::ReadDefaultFstab;
 
-static constexpr int WINDOW_SIZE = 5;
 static constexpr int FIBMAP_RETRY_LIMIT = 3;
+static constexpr uint32_t FIEMAP_EXTENT_COUNT = 512;
+static constexpr size_t COPY_BATCH_SIZE = 1024 * 1024;
+static constexpr size_t COPY_BATCH_COUNT = 4;
+// A package with more extents than ro.uncrypt.repack_threshold (0, the default, disables it) gets
+// copied into a freshly allocated file, as long as that leaves REPACK_RESERVED_SPACE free.
+static constexpr uint64_t REPACK_RESERVED_SPACE = 256 * 1024 * 1024;
 
 // uncrypt provides three services: SETUP_BCB, CLEAR_BCB and UNCRYPT.
 //
@@ -240,10 +256,360 @@ static int RetryFibmap(int fd, const std::string& name, int* block, const int he
   return kUncryptIoctlError;
 }
 
+// Gets the physical block ranges of the first |blocks| blocks of the file with FS_IOC_FIEMAP, which
+// returns whole extents per call rather than a block per FIBMAP ioctl. Returns false if the
+// filesystem doesn't support it, or if any part of the file isn't plainly mapped to blocks on the
+// device (holes, delayed allocation, inline or unwritten data); the caller then falls back to
+// FIBMAP, which fsyncs and retries on such blocks.
+static bool GetBlockRangesByFiemap(int fd, const std::string& name, int64_t blksize, int blocks,
+                                   std::vector<int>* ranges) {
+  CHECK(ranges != nullptr);
+  constexpr uint32_t kUnsupportedFlags =
+      FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |
+      FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL |
+      FIEMAP_EXTENT_UNWRITTEN;
+
+  std::vector<uint8_t> buffer(sizeof(struct fiemap) +
+                              FIEMAP_EXTENT_COUNT * sizeof(struct fiemap_extent));
+  auto fm = reinterpret_cast<struct fiemap*>(buffer.data());
+  std::vector<int> result;
+  // Only the first call needs to flush the dirty pages for the whole file.
+  uint32_t fm_flags = FIEMAP_FLAG_SYNC;
+  int64_t next_block = 0;
+  while (next_block < blocks) {
+    std::fill(buffer.begin(), buffer.end(), 0);
+    fm->fm_start = static_cast<uint64_t>(next_block * blksize);
+    fm->fm_length = static_cast<uint64_t>((blocks - next_block) * blksize);
+    fm->fm_flags = fm_flags;
+    fm->fm_extent_count = FIEMAP_EXTENT_COUNT;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+      PLOG(INFO) << "FIEMAP is unavailable on \"" << name << "\", using FIBMAP";
+      return false;
+    }
+    fm_flags = 0;
+
+    if (fm->fm_mapped_extents == 0) {
+      LOG(INFO) << "no extent found for block " << next_block << ", using FIBMAP";
+      return false;
+    }
+    for (uint32_t i = 0; i < fm->fm_mapped_extents && next_block < blocks; ++i) {
+      const struct fiemap_extent& extent = fm->fm_extents[i];
+      if ((extent.fe_flags & kUnsupportedFlags) != 0 ||
+          extent.fe_logical != static_cast<uint64_t>(next_block * blksize) ||
+          extent.fe_physical % blksize != 0 || extent.fe_length % blksize != 0 ||
+          extent.fe_length == 0) {
+        LOG(INFO) << "unsupported extent at block " << next_block << " (flags " << std::hex
+                  << extent.fe_flags << std::dec << "), using FIBMAP";
+        return false;
+      }
+
+      uint64_t start = extent.fe_physical / blksize;
+      uint64_t length = std::min<uint64_t>(extent.fe_length / blksize,
+                                           static_cast<uint64_t>(blocks - next_block));
+      if (start == 0 || start + length > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+        LOG(INFO) << "unsupported extent at block " << next_block << " (physical block " << start
+                  << "), using FIBMAP";
+        return false;
+      }
+
+      if (!result.empty() && static_cast<uint64_t>(result.back()) == start) {
+        result.back() += static_cast<int>(length);
+      } else {
+        result.push_back(static_cast<int>(start));
+        result.push_back(static_cast<int>(start + length));
+      }
+      next_block += length;
+    }
+  }
+
+  *ranges = std::move(result);
+  return true;
+}
+
+// Returns the number of extents of the file, or -1 if FIEMAP can't tell.
+static int CountExtents(int fd, const std::string& name, const struct stat& sb) {
+  std::vector<int> ranges;
+  int blocks = ((sb.st_size - 1) / sb.st_blksize) + 1;
+  if (sb.st_size == 0 || !GetBlockRangesByFiemap(fd, name, sb.st_blksize, blocks, &ranges)) {
+    return -1;
+  }
+  return static_cast<int>(ranges.size() / 2);
+}
+
+// Copies the package at |path| into a file that's allocated at once with fallocate(), which lets
+// the filesystem find contiguous space for it, and renames the copy over the package if it has
+// fewer extents. A fragmented package on aged /data can otherwise have tens of thousands of ranges
+// in its block map, which every later reader of the map pays for. Anything failing leaves the
+// package as it is.
+static void RepackPackage(const std::string& path) {
+  int threshold = android::base::GetIntProperty("ro.uncrypt.repack_threshold", 0);
+  if (threshold <= 0) {
+    return;
+  }
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) != 0) {
+    PLOG(WARNING) << "failed to open " << path << " for repacking";
+    return;
+  }
+  int before = CountExtents(fd, path, sb);
+  if (before <= threshold) {
+    LOG(INFO) << "  " << path << " has " << before << " extents, not repacking";
+    return;
+  }
+  std::string dir_name = android::base::Dirname(path);
+  struct statvfs vfs;
+  if (statvfs(dir_name.c_str(), &vfs) != 0 ||
+      static_cast<uint64_t>(vfs.f_bavail) * vfs.f_frsize <
+          static_cast<uint64_t>(sb.st_size) + REPACK_RESERVED_SPACE) {
+    LOG(INFO) << "  not enough free space to repack " << path << " (" << before << " extents)";
+    return;
+  }
+
+  std::string tmp_path = path + ".repack";
+  unlink(tmp_path.c_str());
+  android::base::unique_fd tmp_fd(
+      open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, sb.st_mode & 07777));
+  if (tmp_fd == -1) {
+    PLOG(WARNING) << "failed to create " << tmp_path;
+    return;
+  }
+  auto abandon = [&tmp_path](const std::string& reason) {
+    PLOG(WARNING) << "not repacking: " << reason;
+    unlink(tmp_path.c_str());
+  };
+  if (fallocate(tmp_fd, 0, 0, sb.st_size) != 0) {
+    return abandon("failed to allocate " + std::to_string(sb.st_size) + " bytes");
+  }
+  std::vector<uint8_t> buffer(COPY_BATCH_SIZE);
+  for (off64_t offset = 0; offset < sb.st_size; offset += buffer.size()) {
+    size_t size = static_cast<size_t>(std::min<off64_t>(buffer.size(), sb.st_size - offset));
+    if (!android::base::ReadFullyAtOffset(fd, buffer.data(), size, offset) ||
+        write_at_offset(buffer.data(), size, tmp_fd, offset) != 0) {
+      return abandon("failed to copy at " + std::to_string(offset));
+    }
+  }
+  if (fsync(tmp_fd) != 0) {
+    return abandon("failed to fsync " + tmp_path);
+  }
+  int after = CountExtents(tmp_fd, tmp_path, sb);
+  if (after == -1 || after >= before) {
+    LOG(INFO) << "  not repacking " << path << ": the copy has " << after << " extents, against "
+              << before;
+    unlink(tmp_path.c_str());
+    return;
+  }
+
+  // The copy takes over the owner and the SELinux label of the package.
+  char context[256];
+  ssize_t context_size = fgetxattr(fd, XATTR_NAME_SELINUX, context, sizeof(context));
+  if (fchown(tmp_fd, sb.st_uid, sb.st_gid) != 0 ||
+      (context_size > 0 && fsetxattr(tmp_fd, XATTR_NAME_SELINUX, context, context_size, 0) != 0)) {
+    return abandon("failed to set the owner or the label of " + tmp_path);
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return abandon("failed to rename " + tmp_path);
+  }
+  android::base::unique_fd dfd(open(dir_name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (dfd == -1 || fsync(dfd) != 0) {
+    PLOG(WARNING) << "failed to fsync " << dir_name;
+  }
+  LOG(INFO) << "  repacked " << path << " from " << before << " into " << after << " extents";
+}
+
+// Copies the decrypted content of the file over its own blocks on the raw device (|wfd|). A reader
+// thread reads the file through the filesystem in batches of COPY_BATCH_SIZE bytes, up to
+// COPY_BATCH_COUNT batches ahead, while the calling thread maps each batch to physical blocks and
+// writes every physically contiguous run with a single write. A block is always read before it gets
+// overwritten. The mapped blocks are added to |ranges| in file order.
+static int CopyDecryptedBlocks(int fd, const std::string& name, int wfd, const struct stat& sb,
+                               int blocks, const std::function<int(int, int*)>& find_block,
+                               std::vector<int>* ranges, int socket) {
+  CHECK(ranges != nullptr);
+  size_t blksize = static_cast<size_t>(sb.st_blksize);
+  int batch_blocks = static_cast<int>(std::max<size_t>(1, COPY_BATCH_SIZE / blksize));
+
+  struct Batch {
+    int first_block;
+    int block_count;
+    std::vector<unsigned char> data;
+  };
+  std::vector<Batch> batches(COPY_BATCH_COUNT);
+  std::deque<Batch*> free_batches;
+  std::deque<Batch*> filled_batches;
+  for (auto& batch : batches) {
+    batch.data.resize(batch_blocks * blksize);
+    free_batches.push_back(&batch);
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool reader_done = false;
+  bool cancelled = false;
+  int read_error = kUncryptNoError;
+
+  std::thread reader([&]() {
+    for (int first_block = 0; first_block < blocks; first_block += batch_blocks) {
+      Batch* batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return cancelled || !free_batches.empty(); });
+        if (cancelled) {
+          break;
+        }
+        batch = free_batches.front();
+        free_batches.pop_front();
+      }
+
+      batch->first_block = first_block;
+      batch->block_count = std::min(batch_blocks, blocks - first_block);
+      size_t to_read = static_cast<size_t>(
+          std::min(static_cast<off64_t>(batch->block_count * blksize),
+                   sb.st_size - static_cast<off64_t>(first_block) * sb.st_blksize));
+      bool success = android::base::ReadFully(fd, batch->data.data(), to_read);
+      if (!success) {
+        PLOG(ERROR) << "failed to read " << name;
+      }
+      // Don't write out stale data past the end of the file.
+      std::fill(batch->data.begin() + to_read, batch->data.begin() + batch->block_count * blksize,
+                0);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!success) {
+        read_error = kUncryptReadError;
+        break;
+      }
+      filled_batches.push_back(batch);
+      cv.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    reader_done = true;
+    cv.notify_all();
+  });
+
+  int error = kUncryptNoError;
+  int last_progress = 0;
+  std::vector<int> physical_blocks(batch_blocks);
+  while (error == kUncryptNoError) {
+    Batch* batch;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return reader_done || !filled_batches.empty(); });
+      if (filled_batches.empty()) {
+        error = read_error;
+        break;
+      }
+      batch = filled_batches.front();
+      filled_batches.pop_front();
+    }
+
+    // Update the status file, progress must be between [0, 99].
+    int progress = static_cast<int>(100 * (double(batch->first_block) / double(blocks)));
+    if (progress > last_progress) {
+      last_progress = progress;
+      write_status_to_socket(progress, socket);
+    }
+
+    for (int i = 0; i < batch->block_count && error == kUncryptNoError; ++i) {
+      error = find_block(batch->first_block + i, &physical_blocks[i]);
+      if (error == kUncryptNoError) {
+        add_block_to_ranges(*ranges, physical_blocks[i]);
+      }
+    }
+    for (int i = 0; i < batch->block_count && error == kUncryptNoError;) {
+      int run = 1;
+      while (i + run < batch->block_count && physical_blocks[i + run] == physical_blocks[i] + run) {
+        ++run;
+      }
+      if (write_at_offset(batch->data.data() + i * blksize, run * blksize, wfd,
+                          static_cast<off64_t>(blksize) * physical_blocks[i]) != 0) {
+        error = kUncryptWriteError;
+      }
+      i += run;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    free_batches.push_back(batch);
+    cv.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled = true;
+    cv.notify_all();
+  }
+  reader.join();
+  return error;
+}
+
+// The first lines of a block map: the block device, the file size and the block size.
+static std::string BlockMapHeader(const std::string& blk_dev, const struct stat& sb) {
+  return android::base::StringPrintf("%s\n%" PRId64 " %" PRId64 "\n", blk_dev.c_str(),
+                                     static_cast<int64_t>(sb.st_size),
+                                     static_cast<int64_t>(sb.st_blksize));
+}
+
+// The rest of a block map: the range count, and the ranges.
+static std::string BlockMapRanges(const std::vector<int>& ranges) {
+  std::string result = android::base::StringPrintf("%zu\n", ranges.size() / 2);
+  for (size_t i = 0; i < ranges.size(); i += 2) {
+    result += android::base::StringPrintf("%d %d\n", ranges[i], ranges[i + 1]);
+  }
+  return result;
+}
+
+// Next to the block map, the fingerprint of the package that it was made for: its path, the block
+// device and whether it's encrypted, and the identity of the file (device, inode, size, mtime and
+// ctime). A request for an unchanged package reuses the map, e.g. for a retried install.
+static std::string BlockMapFingerprintFile(const std::string& map_file) {
+  return map_file + ".fingerprint";
+}
+
+static std::string BlockMapFingerprint(const std::string& path, const std::string& blk_dev,
+                                       bool encrypted, const struct stat& sb) {
+  return android::base::StringPrintf(
+      "%s\n%s\n%d\n%" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64 ".%09ld %" PRId64 ".%09ld\n",
+      path.c_str(), blk_dev.c_str(), encrypted ? 1 : 0, static_cast<uint64_t>(sb.st_dev),
+      static_cast<uint64_t>(sb.st_ino), static_cast<int64_t>(sb.st_size),
+      static_cast<int64_t>(sb.st_mtim.tv_sec), sb.st_mtim.tv_nsec,
+      static_cast<int64_t>(sb.st_ctim.tv_sec), sb.st_ctim.tv_nsec);
+}
+
+// Returns whether |map_file| is the current block map of |path|: its fingerprint matches, and the
+// extents of the file, from FIEMAP, are still the ranges in the map. This costs a stat and a few
+// FIEMAP calls, instead of making the map (and copying the decrypted blocks) again.
+static bool BlockMapIsCurrent(const std::string& path, const std::string& map_file,
+                              const std::string& blk_dev, bool encrypted) {
+  std::string fingerprint;
+  std::string map;
+  struct stat sb;
+  if (!android::base::ReadFileToString(BlockMapFingerprintFile(map_file), &fingerprint) ||
+      !android::base::ReadFileToString(map_file, &map) || stat(path.c_str(), &sb) != 0 ||
+      sb.st_size == 0 || fingerprint != BlockMapFingerprint(path, blk_dev, encrypted, sb)) {
+    return false;
+  }
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY));
+  if (fd == -1) {
+    return false;
+  }
+  int blocks = ((sb.st_size - 1) / sb.st_blksize) + 1;
+  std::vector<int> ranges;
+  if (!GetBlockRangesByFiemap(fd, path, sb.st_blksize, blocks, &ranges)) {
+    return false;
+  }
+  if (map != BlockMapHeader(blk_dev, sb) + BlockMapRanges(ranges)) {
+    LOG(INFO) << "the extents of " << path << " moved since " << map_file << " was made";
+    return false;
+  }
+  return true;
+}
+
 static int ProductBlockMap(const std::string& path, const std::string& map_file,
                            const std::string& blk_dev, bool encrypted, bool f2fs_fs, int socket) {
   std::string err;
-  if (!android::base::RemoveFileIfExists(map_file, &err)) {
+  if (!android::base::RemoveFileIfExists(map_file, &err) ||
+      !android::base::RemoveFileIfExists(BlockMapFingerprintFile(map_file), &err)) {
     LOG(ERROR) << "failed to remove the existing map file " << map_file << ": " << err;
     return kUncryptFileRemoveError;
   }
@@ -273,21 +639,11 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
 
   std::vector<int> ranges;
 
-  std::string s = android::base::StringPrintf("%s\n%" PRId64 " %" PRId64 "\n", blk_dev.c_str(),
-                                              static_cast<int64_t>(sb.st_size),
-                                              static_cast<int64_t>(sb.st_blksize));
-  if (!android::base::WriteStringToFd(s, mapfd)) {
+  if (!android::base::WriteStringToFd(BlockMapHeader(blk_dev, sb), mapfd)) {
     PLOG(ERROR) << "failed to write " << tmp_map_file;
     return kUncryptWriteError;
   }
 
-  std::vector<std::vector<unsigned char>> buffers;
-  if (encrypted) {
-    buffers.resize(WINDOW_SIZE, std::vector<unsigned char>(sb.st_blksize));
-  }
-  int head_block = 0;
-  int head = 0, tail = 0;
-
   android::base::unique_fd fd(open(path.c_str(), O_RDWR));
   if (fd == -1) {
     PLOG(ERROR) << "failed to open " << path << " for reading";
@@ -329,100 +685,70 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
         }
     }
 
-    off64_t pos = 0;
-    int last_progress = 0;
-    while (pos < sb.st_size) {
-        // Update the status file, progress must be between [0, 99].
-        int progress = static_cast<int>(100 * (double(pos) / double(sb.st_size)));
-        if (progress > last_progress) {
-            last_progress = progress;
-            write_status_to_socket(progress, socket);
-        }
-
-        if ((tail+1) % WINDOW_SIZE == head) {
-            // write out head buffer
-            int block = head_block;
-            if (ioctl(fd, FIBMAP, &block) != 0) {
-                PLOG(ERROR) << "failed to find block " << head_block;
-                return kUncryptIoctlError;
-            }
-
-            if (block == 0) {
-                LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-                int error = RetryFibmap(fd, path, &block, head_block);
-                if (error != kUncryptNoError) {
-                    return error;
-                }
-            }
+    std::vector<int> extent_ranges;
+    bool has_extents = GetBlockRangesByFiemap(fd, path, sb.st_blksize, blocks, &extent_ranges);
+    if (has_extents) {
+        LOG(INFO) << "  found " << extent_ranges.size() / 2 << " extents with FIEMAP";
+    }
 
-            add_block_to_ranges(ranges, block);
-            if (encrypted) {
-                if (write_at_offset(buffers[head].data(), sb.st_blksize, wfd,
-                                    static_cast<off64_t>(sb.st_blksize) * block) != 0) {
-                    return kUncryptWriteError;
-                }
+    // Finds the physical block for the |logical|-th block of the file. The lookups are in file
+    // order, so the extent cursor only moves forward.
+    size_t extent = 0;
+    int extent_first_block = 0;
+    auto find_block = [&](int logical, int* block) -> int {
+        if (has_extents) {
+            while (logical - extent_first_block >=
+                   extent_ranges[extent + 1] - extent_ranges[extent]) {
+                extent_first_block += extent_ranges[extent + 1] - extent_ranges[extent];
+                extent += 2;
             }
-            head = (head + 1) % WINDOW_SIZE;
-            ++head_block;
+            *block = extent_ranges[extent] + (logical - extent_first_block);
+            return kUncryptNoError;
         }
 
-        // read next block to tail
-        if (encrypted) {
-            size_t to_read = static_cast<size_t>(
-                    std::min(static_cast<off64_t>(sb.st_blksize), sb.st_size - pos));
-            if (!android::base::ReadFully(fd, buffers[tail].data(), to_read)) {
-                PLOG(ERROR) << "failed to read " << path;
-                return kUncryptReadError;
-            }
-            pos += to_read;
-        } else {
-            // If we're not encrypting; we don't need to actually read
-            // anything, just skip pos forward as if we'd read a
-            // block.
-            pos += sb.st_blksize;
+        *block = logical;
+        if (ioctl(fd, FIBMAP, block) != 0) {
+            PLOG(ERROR) << "failed to find block " << logical;
+            return kUncryptIoctlError;
         }
-        tail = (tail+1) % WINDOW_SIZE;
-    }
 
-    while (head != tail) {
-        // write out head buffer
-        int block = head_block;
-        if (ioctl(fd, FIBMAP, &block) != 0) {
-            PLOG(ERROR) << "failed to find block " << head_block;
-            return kUncryptIoctlError;
+        if (*block == 0) {
+            LOG(ERROR) << "failed to find block " << logical << ", retrying";
+            return RetryFibmap(fd, path, block, logical);
         }
+        return kUncryptNoError;
+    };
 
-        if (block == 0) {
-            LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-            int error = RetryFibmap(fd, path, &block, head_block);
-            if (error != kUncryptNoError) {
-                return error;
-            }
+    if (encrypted) {
+        int error = CopyDecryptedBlocks(fd, path, wfd, sb, blocks, find_block, &ranges, socket);
+        if (error != kUncryptNoError) {
+            return error;
         }
+    } else if (has_extents) {
+        // There's no data to copy, so the extents make up the block map as they are.
+        ranges = std::move(extent_ranges);
+    } else {
+        int last_progress = 0;
+        for (int head_block = 0; head_block < blocks; ++head_block) {
+            // Update the status file, progress must be between [0, 99].
+            int progress = static_cast<int>(100 * (double(head_block) / double(blocks)));
+            if (progress > last_progress) {
+                last_progress = progress;
+                write_status_to_socket(progress, socket);
+            }
 
-        add_block_to_ranges(ranges, block);
-        if (encrypted) {
-            if (write_at_offset(buffers[head].data(), sb.st_blksize, wfd,
-                                static_cast<off64_t>(sb.st_blksize) * block) != 0) {
-                return kUncryptWriteError;
+            int block;
+            if (int error = find_block(head_block, &block); error != kUncryptNoError) {
+                return error;
             }
+            add_block_to_ranges(ranges, block);
         }
-        head = (head + 1) % WINDOW_SIZE;
-        ++head_block;
     }
 
-    if (!android::base::WriteStringToFd(
-            android::base::StringPrintf("%zu\n", ranges.size() / 2), mapfd)) {
+    if (!android::base::WriteStringToFd(BlockMapRanges(ranges), mapfd)) {
         PLOG(ERROR) << "failed to write " << tmp_map_file;
         return kUncryptWriteError;
     }
-    for (size_t i = 0; i < ranges.size(); i += 2) {
-        if (!android::base::WriteStringToFd(
-                android::base::StringPrintf("%d %d\n", ranges[i], ranges[i+1]), mapfd)) {
-            PLOG(ERROR) << "failed to write " << tmp_map_file;
-            return kUncryptWriteError;
-        }
-    }
 
     if (fsync(mapfd) == -1) {
         PLOG(ERROR) << "failed to fsync \"" << tmp_map_file << "\"";
@@ -463,6 +789,14 @@ static int ProductBlockMap(const std::string& path, const std::string& map_file,
         PLOG(ERROR) << "failed to close " << dir_name;
         return kUncryptFileCloseError;
     }
+
+    // Only a complete map gets a fingerprint. It doesn't need to be synced; without one, the map is
+    // just made again. The file is stat'ed again, as pinning it may have changed its ctime.
+    if (struct stat current; fstat(fd, &current) != 0 ||
+        !android::base::WriteStringToFile(BlockMapFingerprint(path, blk_dev, encrypted, current),
+                                          BlockMapFingerprintFile(map_file))) {
+        PLOG(WARNING) << "failed to write the fingerprint of " << map_file;
+    }
     return 0;
 }
 
@@ -497,6 +831,11 @@ static int Uncrypt(const std::string& input_path, const std::string& map_file, i
   // On /data we want to convert the file to a block map so that we can read the package without
   // mounting the partition. On /cache and /sdcard we leave the file alone.
   if (android::base::StartsWith(path, "/data/")) {
+    if (BlockMapIsCurrent(path, map_file, blk_dev, encrypted)) {
+      LOG(INFO) << "block map " << map_file << " is current; reusing it";
+      return 0;
+    }
+    RepackPackage(path);
     LOG(INFO) << "writing block map " << map_file;
     return ProductBlockMap(path, map_file, blk_dev, encrypted, f2fs_fs, socket);
   }
@@ -27,7 +27,25 @@ import sys
 import care_map_pb2
 
 
-def GenerateCareMapProtoFromLegacyFormat(lines, fingerprint_enabled):
+def PackRanges(ranges):
+  """Packs a RangeSet string into (gap, length) pairs, as in packed_ranges."""
+
+  tokens = [int(token) for token in ranges.split(",")]
+  assert tokens[0] == len(tokens) - 1 and tokens[0] % 2 == 0, \
+      "invalid ranges: {}".format(ranges)
+  packed = []
+  end = 0
+  for index in range(1, len(tokens), 2):
+    start = tokens[index]
+    assert start >= end and tokens[index + 1] > start, \
+        "ranges must be sorted and disjoint for packing: {}".format(ranges)
+    packed += [start - end, tokens[index + 1] - start]
+    end = tokens[index + 1]
+  return packed
+
+
+def GenerateCareMapProtoFromLegacyFormat(lines, fingerprint_enabled,
+                                         packed_ranges=False):
   """Constructs a care map proto message from the lines of the input file."""
 
   # Expected format of the legacy care_map.txt:
@@ -50,6 +68,8 @@ def GenerateCareMapProtoFromLegacyFormat(lines, fingerprint_enabled):
     info = care_map_proto.partitions.add()
     info.name = lines[index]
     info.ranges = lines[index + 1]
+    if packed_ranges:
+      info.packed_ranges.extend(PackRanges(info.ranges))
     if fingerprint_enabled:
       info.id = lines[index + 2]
       info.fingerprint = lines[index + 3]
@@ -100,6 +120,10 @@ def main(argv):
                       dest="fingerprint_enabled",
                       help="The 'id' and 'fingerprint' fields are disabled in"
                            " the caremap.")
+  parser.add_argument("--packed_ranges", action="store_true",
+                      help="Also writes the ranges in the packed binary form,"
+                           " which update_verifier reads without parsing"
+                           " text.")
   parser.add_argument("--parse_proto", "-p", action="store_true",
                       help="Parses the input as proto message, and outputs"
                            " the care_map in plain text.")
@@ -118,7 +142,8 @@ def main(argv):
     result = ParseProtoMessage(content, args.fingerprint_enabled).encode()
   else:
     care_map_proto = GenerateCareMapProtoFromLegacyFormat(
-        content.decode().rstrip().splitlines(), args.fingerprint_enabled)
+        content.decode().rstrip().splitlines(), args.fingerprint_enabled,
+        args.packed_ranges)
     result = care_map_proto.SerializeToString()
 
   with open(args.output_file, 'wb') as output:
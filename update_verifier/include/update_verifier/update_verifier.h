@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #include <functional>
 #include <map>
 #include <string>
@@ -46,23 +48,88 @@ class UpdateVerifier {
   // of the pair <partition_name, ranges> into the |partition_map_|.
   bool ParseCareMap();
 
-  // Verifies the new boot by reading all the cared blocks for partitions in |partition_map_|.
+  // Returns true if the partitions were already verified by snapuserd, leaving nothing to read.
+  bool VerifiedBySnapuserd();
+
+  // Verifies the new boot by reading all the cared blocks for partitions in |partition_map_|. The
+  // progress is saved for the current slot as it goes, so that a later boot of the same slot with
+  // the same care map and build skips the blocks already verified.
   bool VerifyPartitions();
 
+  // Returns whether the care map lists the blocks written by the update, which can be verified
+  // ahead of the rest.
+  bool HasPriorityBlocks() const;
+
+  // Verifies the new boot by reading only the blocks written by the update, in |priority_map_|.
+  bool VerifyPriorityPartitions();
+
+  // Verifies the new boot by reading a random sample of about |percent| of the cared blocks for
+  // partitions in |partition_map_|. The sample is picked in chunks, by a generator seeded with
+  // |seed|.
+  bool VerifySampledPartitions(uint32_t percent, uint32_t seed);
+
+  // Saves the progress of a deferred verification of all the cared blocks, with none done yet, so
+  // that VerifyDeferredPartitions() can run after the boot is marked successful.
+  bool StartDeferredVerification();
+
+  // Returns whether there's a deferred verification to run or resume.
+  bool HasDeferredVerification() const;
+
+  // Reads all the cared blocks from where the saved progress says the last run stopped, saving the
+  // progress along the way. The progress is removed once done.
+  bool VerifyDeferredPartitions();
+
  private:
   friend class UpdateVerifierTest;
+  friend class UpdateVerifierBenchmark;
+  // Gets the name of a partition and the number of its blocks from the start that have been read.
+  using BlocksDoneCallback = std::function<void(const std::string&, size_t)>;
+
   // Finds all the dm-enabled partitions, and returns a map of <partition_name, block_device>.
   std::map<std::string, std::string> FindDmPartitions();
 
-  // Returns true if we successfully read the blocks in |ranges| of the |dm_block_device|.
-  bool ReadBlocks(const std::string partition_name, const std::string& dm_block_device,
-                  const RangeSet& ranges);
+  // Finds the dm devices of |partitions| and reads their blocks with ReadBlocks().
+  bool VerifyPartitions(const std::map<std::string, RangeSet>& partitions, size_t first_unit,
+                        const std::function<void(size_t)>& units_done_callback,
+                        const BlocksDoneCallback& blocks_done_callback);
+
+  // Returns true if we successfully read the blocks of all the |partitions|, from their devices in
+  // |dm_block_devices|. The partitions are read at the same time, by threads that share one queue
+  // of work units; the first |first_unit| units are skipped. |units_done_callback|, if set, gets
+  // the number of units from the start of the queue that are done whenever it grows, and
+  // |blocks_done_callback| likewise the blocks from the start of each partition. The callbacks
+  // are called one at a time.
+  bool ReadBlocks(const std::map<std::string, RangeSet>& partitions,
+                  const std::map<std::string, std::string>& dm_block_devices, size_t first_unit,
+                  const std::function<void(size_t)>& units_done_callback,
+                  const BlocksDoneCallback& blocks_done_callback);
+
+  // The file that keeps the verified blocks of the current slot.
+  std::string VerifiedStateFile() const;
+  // Identifies the care map and the build that the verified blocks are of.
+  std::string VerifiedStateKey() const;
+  // Returns the number of the cared blocks from the start of each partition that an earlier boot
+  // verified, or an empty map if it was of another care map or build.
+  std::map<std::string, size_t> LoadVerifiedBlocks() const;
+  // Saves |verified_blocks| for LoadVerifiedBlocks().
+  bool SaveVerifiedBlocks(const std::map<std::string, size_t>& verified_blocks);
+
+  // Reads the unsigned or boolean property |name| with |property_reader_|, or returns
+  // |default_value| if it's unset or malformed.
+  uint64_t GetUintProperty(const std::string& name, uint64_t default_value) const;
+  bool GetBoolProperty(const std::string& name, bool default_value) const;
 
   // Functions to override the care_map_prefix_ and property_reader_, used in test only.
   void set_care_map_prefix(const std::string& prefix);
   void set_property_reader(const std::function<std::string(const std::string&)>& property_reader);
 
   std::map<std::string, RangeSet> partition_map_;
+  // The blocks written by the update, for the partitions whose care map lists them.
+  std::map<std::string, RangeSet> priority_map_;
+  // Identifies the care map (i.e. the build it came with), to match the saved deferred progress.
+  std::string care_map_id_;
+  // The SHA-256 of the care map, in hex, to match the saved verified blocks.
+  std::string care_map_digest_;
   // The path to the care_map excluding the filename extension; default value:
   // "/data/ota_package/care_map"
   std::string care_map_prefix_;
@@ -42,6 +42,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,21 +50,30 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <thread>
 
 #include <BootControlClient.h>
 #include <android-base/chrono_utils.h>
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parsebool.h>
 #include <android-base/parseint.h>
 #include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <android/os/IVold.h>
 #include <binder/BinderService.h>
 #include <binder/Status.h>
 #include <cutils/android_reboot.h>
+#include <openssl/sha.h>
 
 #include "care_map.pb.h"
 
@@ -131,44 +141,216 @@ std::map<std::string, std::string> UpdateVerifier::FindDmPartitions() {
   return dm_block_devices;
 }
 
-bool UpdateVerifier::ReadBlocks(const std::string partition_name,
-                                const std::string& dm_block_device, const RangeSet& ranges) {
-  // RangeSet::Split() splits the ranges into multiple groups with same number of blocks (except for
-  // the last group).
-  size_t thread_num = std::thread::hardware_concurrency() ?: 4;
-  std::vector<RangeSet> groups = ranges.Split(thread_num);
+// Max number of blocks that a reader thread takes at a time. The care-map blocks of the big
+// partitions are split into units of this size (32 MiB), so that the threads keep all the dm
+// devices busy until the end, instead of idling while one big partition finishes.
+static constexpr size_t kWorkUnitBlocks = 8192;
+
+// Default number of reader threads, which can be overridden with ro.update_verifier.threads. The
+// reads are bound by the storage, which serves several of them at once whatever the CPU count.
+static constexpr size_t kDefaultReaderThreads = 8;
+
+// Default size of each read (4 MiB), which can be overridden with ro.update_verifier.read_kb.
+static constexpr size_t kDefaultReadKb = 4096;
+
+// Number of blocks (1 MiB) in each chunk that's picked or skipped as a whole by the sampled
+// verification.
+static constexpr size_t kSampleBlocks = 256;
+
+// Opens |dm_block_device| to read the blocks, which is only done for dm-verity to check them. The
+// data isn't used afterwards, so it's kept out of the page cache at boot: with O_DIRECT if
+// |try_direct| and the device takes it, or otherwise by having the caller drop the pages after each
+// read (|direct| false).
+static android::base::unique_fd OpenForVerification(const std::string& dm_block_device,
+                                                    bool try_direct, bool* direct) {
+  android::base::unique_fd fd;
+  if (try_direct) {
+    fd.reset(TEMP_FAILURE_RETRY(open(dm_block_device.c_str(), O_RDONLY | O_DIRECT)));
+  }
+  *direct = fd != -1;
+  if (fd == -1 && (!try_direct || errno == EINVAL)) {
+    fd.reset(TEMP_FAILURE_RETRY(open(dm_block_device.c_str(), O_RDONLY)));
+  }
+  return fd;
+}
 
-  std::vector<std::future<bool>> threads;
-  for (const auto& group : groups) {
-    auto thread_func = [&group, &dm_block_device, &partition_name]() {
-      android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(dm_block_device.c_str(), O_RDONLY)));
-      if (fd.get() == -1) {
-        PLOG(ERROR) << "Error reading " << dm_block_device << " for partition " << partition_name;
-        return false;
+uint64_t UpdateVerifier::GetUintProperty(const std::string& name, uint64_t default_value) const {
+  uint64_t value;
+  return android::base::ParseUint(property_reader_(name), &value) ? value : default_value;
+}
+
+bool UpdateVerifier::GetBoolProperty(const std::string& name, bool default_value) const {
+  switch (android::base::ParseBool(property_reader_(name))) {
+    case android::base::ParseBoolResult::kTrue:
+      return true;
+    case android::base::ParseBoolResult::kFalse:
+      return false;
+    default:
+      return default_value;
+  }
+}
+
+bool UpdateVerifier::ReadBlocks(const std::map<std::string, RangeSet>& partitions,
+                                const std::map<std::string, std::string>& dm_block_devices,
+                                size_t first_unit,
+                                const std::function<void(size_t)>& units_done_callback,
+                                const BlocksDoneCallback& blocks_done_callback) {
+  struct WorkUnit {
+    const std::string* partition_name;
+    const std::string* dm_block_device;
+    RangeSet ranges;
+    // The position of the unit in the queue of its partition.
+    size_t partition_index;
+  };
+
+  // Splits each partition into work units, and queues them taking one unit from each partition in
+  // turn, so that all the partitions are read from the start.
+  std::vector<std::vector<WorkUnit>> partition_units;
+  size_t total_units = 0;
+  for (const auto& [partition_name, ranges] : partitions) {
+    size_t groups = (ranges.blocks() + kWorkUnitBlocks - 1) / kWorkUnitBlocks;
+    auto& units = partition_units.emplace_back();
+    for (auto& group : ranges.Split(groups)) {
+      units.push_back({ &partition_name, &dm_block_devices.at(partition_name), std::move(group),
+                        partition_units.size() - 1 });
+    }
+    total_units += units.size();
+  }
+  std::vector<WorkUnit> queue;
+  queue.reserve(total_units);
+  // The queue positions of the units of each partition, in their order within the partition.
+  std::vector<std::vector<size_t>> partition_queue(partition_units.size());
+  for (size_t i = 0; queue.size() < total_units; i++) {
+    for (auto& units : partition_units) {
+      if (i < units.size()) {
+        partition_queue[units[i].partition_index].push_back(queue.size());
+        queue.push_back(std::move(units[i]));
       }
+    }
+  }
 
-      static constexpr size_t kBlockSize = 4096;
-      std::vector<uint8_t> buf(1024 * kBlockSize);
+  size_t thread_num = GetUintProperty("ro.update_verifier.threads", kDefaultReaderThreads);
+  first_unit = std::min(first_unit, queue.size());
+  thread_num = std::clamp<size_t>(thread_num, 1, std::max<size_t>(queue.size() - first_unit, 1));
+
+  // Optionally caps the total read rate, so that the verification leaves some of the storage
+  // bandwidth to the rest of the boot. The threads sleep whenever they get ahead of the cap.
+  uint64_t max_bytes_per_sec =
+      GetUintProperty("ro.update_verifier.max_read_mb_per_sec", 0) * 1024 * 1024;
+  auto start_time = std::chrono::steady_clock::now();
+  std::atomic<uint64_t> bytes_read = 0;
+
+  // Each read takes whole blocks, up to 64 MiB. O_DIRECT can be turned off with
+  // ro.update_verifier.direct_io, e.g. to compare the two on a device.
+  static constexpr size_t kBlockSize = 4096;
+  uint64_t read_kb =
+      std::clamp<uint64_t>(GetUintProperty("ro.update_verifier.read_kb", kDefaultReadKb), 4,
+                           64 * 1024);
+  size_t read_size = read_kb / 4 * kBlockSize;
+  bool try_direct = GetBoolProperty("ro.update_verifier.direct_io", true);
+
+  // The units are handed out in order, but may complete out of order. Only the run of units from
+  // the start of the queue that are all done gets reported as done.
+  std::mutex done_lock;
+  std::vector<bool> unit_done(queue.size());
+  std::fill_n(unit_done.begin(), first_unit, true);
+  size_t units_done = first_unit;
+  // Likewise for each partition on its own: the number of its units from the start that are done,
+  // and the blocks they add up to.
+  std::vector<size_t> partition_units_done(partition_queue.size());
+  std::vector<size_t> partition_blocks_done(partition_queue.size());
+
+  std::atomic<size_t> next_unit = units_done;
+  std::atomic<bool> failed = false;
+  auto thread_func = [&]() {
+    // O_DIRECT needs the buffer to be aligned to the logical block size of the device.
+    void* aligned_buf;
+    if (posix_memalign(&aligned_buf, kBlockSize, read_size) != 0) {
+      LOG(ERROR) << "Failed to allocate the read buffer";
+      failed = true;
+      return false;
+    }
+    std::unique_ptr<uint8_t, decltype(&free)> buf(static_cast<uint8_t*>(aligned_buf), free);
 
-      for (const auto& [range_start, range_end] : group) {
-        if (lseek64(fd.get(), static_cast<off64_t>(range_start) * kBlockSize, SEEK_SET) == -1) {
-          PLOG(ERROR) << "lseek to " << range_start << " failed";
+    // Each thread keeps its own fd to every dm device it has read from.
+    struct ReaderFd {
+      android::base::unique_fd fd;
+      bool direct;
+    };
+    std::map<const std::string*, ReaderFd> fds;
+
+    for (size_t i = next_unit++; i < queue.size() && !failed; i = next_unit++) {
+      const auto& unit = queue[i];
+      auto& [fd, direct] = fds[unit.dm_block_device];
+      if (fd == -1) {
+        fd = OpenForVerification(*unit.dm_block_device, try_direct, &direct);
+        if (fd == -1) {
+          PLOG(ERROR) << "Error reading " << *unit.dm_block_device << " for partition "
+                      << *unit.partition_name;
+          failed = true;
           return false;
         }
+      }
 
+      for (const auto& [range_start, range_end] : unit.ranges) {
+        off64_t offset = static_cast<off64_t>(range_start) * kBlockSize;
         size_t remain = (range_end - range_start) * kBlockSize;
         while (remain > 0) {
-          size_t to_read = std::min(remain, 1024 * kBlockSize);
-          if (!android::base::ReadFully(fd.get(), buf.data(), to_read)) {
-            PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end;
+          size_t to_read = std::min(remain, read_size);
+          if (!android::base::ReadFullyAtOffset(fd.get(), buf.get(), to_read, offset)) {
+            PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end
+                        << " on partition " << *unit.partition_name;
+            failed = true;
             return false;
           }
+          if (!direct) {
+            posix_fadvise(fd.get(), offset, to_read, POSIX_FADV_DONTNEED);
+          }
+          offset += to_read;
           remain -= to_read;
+
+          if (max_bytes_per_sec != 0) {
+            uint64_t total = bytes_read += to_read;
+            std::this_thread::sleep_until(
+                start_time + std::chrono::microseconds(total * 1000000 / max_bytes_per_sec));
+          }
         }
       }
-      return true;
-    };
 
+      if (units_done_callback || blocks_done_callback) {
+        std::lock_guard<std::mutex> lock(done_lock);
+        unit_done[i] = true;
+        size_t done = units_done;
+        while (done < queue.size() && unit_done[done]) {
+          done++;
+        }
+        if (done != units_done) {
+          units_done = done;
+          if (units_done_callback) {
+            units_done_callback(done);
+          }
+        }
+
+        size_t partition = unit.partition_index;
+        const auto& positions = partition_queue[partition];
+        size_t& partition_done = partition_units_done[partition];
+        size_t blocks = partition_blocks_done[partition];
+        while (partition_done < positions.size() && unit_done[positions[partition_done]]) {
+          blocks += queue[positions[partition_done++]].ranges.blocks();
+        }
+        if (blocks != partition_blocks_done[partition]) {
+          partition_blocks_done[partition] = blocks;
+          if (blocks_done_callback) {
+            blocks_done_callback(*unit.partition_name, blocks);
+          }
+        }
+      }
+    }
+    return true;
+  };
+
+  std::vector<std::future<bool>> threads;
+  for (size_t i = 0; i < thread_num; i++) {
     threads.emplace_back(std::async(std::launch::async, thread_func));
   }
 
@@ -176,8 +358,8 @@ bool UpdateVerifier::ReadBlocks(const std::string partition_name,
   for (auto& t : threads) {
     ret = t.get() && ret;
   }
-  LOG(INFO) << "Finished reading blocks on partition " << partition_name << " @ " << dm_block_device
-            << " with " << thread_num << " threads.";
+  LOG(INFO) << "Finished reading blocks on " << partitions.size() << " partitions in "
+            << queue.size() << " units with " << thread_num << " threads.";
   return ret;
 }
 
@@ -192,7 +374,7 @@ bool UpdateVerifier::CheckVerificationStatus() {
   return client->QueryUpdateVerification();
 }
 
-bool UpdateVerifier::VerifyPartitions() {
+bool UpdateVerifier::VerifiedBySnapuserd() {
   const bool userspace_snapshots =
       android::base::GetBoolProperty("ro.virtual_ab.userspace.snapshots.enabled", false);
 
@@ -202,29 +384,231 @@ bool UpdateVerifier::VerifyPartitions() {
   }
 
   LOG(INFO) << "Partitions not verified by snapuserd daemon";
+  return false;
+}
 
+bool UpdateVerifier::VerifyPartitions(const std::map<std::string, RangeSet>& partitions,
+                                      size_t first_unit,
+                                      const std::function<void(size_t)>& units_done_callback,
+                                      const BlocksDoneCallback& blocks_done_callback) {
   auto dm_block_devices = FindDmPartitions();
   if (dm_block_devices.empty()) {
     LOG(ERROR) << "No dm-enabled block device is found.";
     return false;
   }
 
-  for (const auto& [partition_name, ranges] : partition_map_) {
+  for (const auto& [partition_name, ranges] : partitions) {
     if (dm_block_devices.find(partition_name) == dm_block_devices.end()) {
       LOG(ERROR) << "Failed to find dm block device for " << partition_name;
       return false;
     }
+  }
+
+  return ReadBlocks(partitions, dm_block_devices, first_unit, units_done_callback,
+                    blocks_done_callback);
+}
+
+std::string UpdateVerifier::VerifiedStateFile() const {
+  return care_map_prefix_ + ".verified" + property_reader_("ro.boot.slot_suffix");
+}
+
+// The verified state file holds the digest of the care map and the build fingerprint on the first
+// line, and then one line for each partition that's been read, with the number of its cared blocks
+// from the start that read back fine.
+std::string UpdateVerifier::VerifiedStateKey() const {
+  return care_map_digest_ + " " + property_reader_("ro.build.fingerprint");
+}
 
-    if (!ReadBlocks(partition_name, dm_block_devices.at(partition_name), ranges)) {
+std::map<std::string, size_t> UpdateVerifier::LoadVerifiedBlocks() const {
+  std::string state_file = VerifiedStateFile();
+  std::string content;
+  if (!android::base::ReadFileToString(state_file, &content)) {
+    return {};
+  }
+  auto lines = android::base::Split(android::base::Trim(content), "\n");
+  if (lines[0] != VerifiedStateKey()) {
+    LOG(INFO) << "Discarding the verified state of another care map or build";
+    return {};
+  }
+  std::map<std::string, size_t> verified_blocks;
+  for (size_t i = 1; i < lines.size(); i++) {
+    auto pieces = android::base::Split(lines[i], " ");
+    size_t blocks;
+    if (pieces.size() != 2 || partition_map_.count(pieces[0]) == 0 ||
+        !android::base::ParseUint(pieces[1], &blocks)) {
+      LOG(WARNING) << "Discarding the malformed verified state in " << state_file;
+      return {};
+    }
+    verified_blocks[pieces[0]] = std::min(blocks, partition_map_.at(pieces[0]).blocks());
+  }
+  return verified_blocks;
+}
+
+bool UpdateVerifier::SaveVerifiedBlocks(const std::map<std::string, size_t>& verified_blocks) {
+  std::string content = VerifiedStateKey() + "\n";
+  for (const auto& [partition_name, blocks] : verified_blocks) {
+    content += partition_name + " " + std::to_string(blocks) + "\n";
+  }
+  // Written to the side and renamed, so that a crash can't leave a partial state behind.
+  std::string state_file = VerifiedStateFile();
+  std::string temp_file = state_file + ".tmp";
+  if (!android::base::WriteStringToFile(content, temp_file) ||
+      rename(temp_file.c_str(), state_file.c_str()) == -1) {
+    PLOG(WARNING) << "Failed to save the verified state to " << state_file;
+    return false;
+  }
+  return true;
+}
+
+bool UpdateVerifier::VerifyPartitions() {
+  // Picks up where an earlier boot of the same slot, care map and build left off, e.g. one that
+  // crashed during the verification or didn't get to mark the slot successful: the partitions it
+  // verified are skipped, and the rest resume after the blocks it got through.
+  std::map<std::string, size_t> verified_blocks = LoadVerifiedBlocks();
+  std::map<std::string, size_t> first_blocks;
+  std::map<std::string, RangeSet> remaining;
+  for (const auto& [partition_name, ranges] : partition_map_) {
+    size_t verified = verified_blocks[partition_name];
+    if (verified == ranges.blocks()) {
+      LOG(INFO) << "Skipping " << partition_name << ", verified on an earlier boot";
+      continue;
+    }
+    if (verified > 0) {
+      LOG(INFO) << "Resuming " << partition_name << " after " << verified << " verified blocks";
+    }
+    auto unverified = ranges.GetSubRanges(verified, ranges.blocks() - verified);
+    if (!unverified) {
+      LOG(ERROR) << "Failed to get the unverified blocks of " << partition_name;
       return false;
     }
+    first_blocks[partition_name] = verified;
+    remaining.emplace(partition_name, std::move(*unverified));
   }
+  if (remaining.empty()) {
+    return true;
+  }
+
+  return VerifyPartitions(remaining, 0, nullptr,
+                          [&](const std::string& partition_name, size_t blocks_done) {
+                            verified_blocks[partition_name] =
+                                first_blocks[partition_name] + blocks_done;
+                            SaveVerifiedBlocks(verified_blocks);
+                          });
+}
 
+bool UpdateVerifier::HasPriorityBlocks() const {
+  return !priority_map_.empty();
+}
+
+bool UpdateVerifier::VerifyPriorityPartitions() {
+  return VerifyPartitions(priority_map_, 0, nullptr, nullptr);
+}
+
+bool UpdateVerifier::VerifySampledPartitions(uint32_t percent, uint32_t seed) {
+  // Sparse corruption is caught unless it misses every sampled chunk: with N corrupted chunks, the
+  // odds of missing all of them are (1 - percent / 100)^N. Small chunks spread the samples out.
+  std::mt19937 random(seed);
+  std::uniform_int_distribution<uint32_t> distribution(0, 99);
+  std::map<std::string, RangeSet> sampled_map;
+  size_t sampled_blocks = 0;
+  size_t total_blocks = 0;
+  for (const auto& [partition_name, ranges] : partition_map_) {
+    RangeSet sampled;
+    for (const auto& [range_start, range_end] : ranges) {
+      for (size_t start = range_start; start < range_end; start += kSampleBlocks) {
+        if (distribution(random) < percent) {
+          sampled.PushBack({ start, std::min(range_end, start + kSampleBlocks) });
+        }
+      }
+    }
+    total_blocks += ranges.blocks();
+    sampled_blocks += sampled.blocks();
+    if (sampled) {
+      sampled_map.emplace(partition_name, std::move(sampled));
+    }
+  }
+
+  LOG(INFO) << "Sampled " << sampled_blocks << " of " << total_blocks << " blocks with seed "
+            << seed;
+  return VerifyPartitions(sampled_map, 0, nullptr, nullptr);
+}
+
+// The progress file holds the care map id on the first line, and the number of work units that
+// are done on the second one.
+bool UpdateVerifier::StartDeferredVerification() {
+  std::string progress = care_map_id_ + "\n0\n";
+  if (!android::base::WriteStringToFile(progress, care_map_prefix_ + ".progress")) {
+    PLOG(ERROR) << "Failed to write the deferred verification progress";
+    return false;
+  }
   return true;
 }
 
+bool UpdateVerifier::HasDeferredVerification() const {
+  return access((care_map_prefix_ + ".progress").c_str(), F_OK) == 0;
+}
+
+bool UpdateVerifier::VerifyDeferredPartitions() {
+  std::string progress_file = care_map_prefix_ + ".progress";
+  std::string content;
+  if (!android::base::ReadFileToString(progress_file, &content)) {
+    PLOG(WARNING) << "Failed to read " << progress_file;
+    return false;
+  }
+
+  // A progress file left by an earlier update starts from zero.
+  auto lines = android::base::Split(android::base::Trim(content), "\n");
+  size_t first_unit = 0;
+  if (lines.size() != 2 || lines[0] != care_map_id_ ||
+      !android::base::ParseUint(lines[1], &first_unit)) {
+    LOG(WARNING) << "Discarding the deferred verification progress that doesn't match the care map";
+    first_unit = 0;
+  }
+  LOG(INFO) << "Deferred verification resuming from work unit " << first_unit;
+
+  bool result = VerifyPartitions(
+      partition_map_, first_unit,
+      [&](size_t units_done) {
+        std::string progress = care_map_id_ + "\n" + std::to_string(units_done) + "\n";
+        if (!android::base::WriteStringToFile(progress, progress_file)) {
+          PLOG(WARNING) << "Failed to save the deferred verification progress";
+        }
+      },
+      nullptr);
+
+  // Either way, there's nothing left to resume: the slot has already been marked successful, and a
+  // corrupted block is up to dm-verity to handle.
+  unlink(progress_file.c_str());
+  return result;
+}
+
+// Decodes the packed_ranges of a care map partition, i.e. (gap, length) pairs. Returns an empty
+// RangeSet on errors.
+template <typename PackedRanges>
+static RangeSet ParsePackedRanges(const PackedRanges& packed_ranges) {
+  if (packed_ranges.size() % 2 != 0) {
+    return {};
+  }
+  std::vector<Range> pairs;
+  pairs.reserve(packed_ranges.size() / 2);
+  uint64_t end = 0;
+  for (int i = 0; i < packed_ranges.size(); i += 2) {
+    uint64_t start = end + packed_ranges.Get(i);
+    end = start + packed_ranges.Get(i + 1);
+    // Same bound as RangeSet::Parse().
+    if (end > INT_MAX) {
+      return {};
+    }
+    pairs.emplace_back(start, end);
+  }
+  return RangeSet(std::move(pairs));
+}
+
 bool UpdateVerifier::ParseCareMap() {
   partition_map_.clear();
+  priority_map_.clear();
+  care_map_id_.clear();
+  care_map_digest_.clear();
 
   std::string care_map_name = care_map_prefix_ + ".pb";
   if (access(care_map_name.c_str(), R_OK) == -1) {
@@ -258,19 +642,34 @@ bool UpdateVerifier::ParseCareMap() {
     return false;
   }
 
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t*>(file_content.data()), file_content.size(), digest);
+  for (uint8_t byte : digest) {
+    care_map_digest_ += android::base::StringPrintf("%02x", byte);
+  }
+
   for (const auto& partition : care_map.partitions()) {
     if (partition.name().empty()) {
       LOG(WARNING) << "Unexpected empty partition name.";
       return false;
     }
-    if (partition.ranges().empty()) {
-      LOG(WARNING) << "Unexpected block ranges for partition " << partition.name();
-      return false;
-    }
-    RangeSet ranges = RangeSet::Parse(partition.ranges());
-    if (!ranges) {
-      LOG(WARNING) << "Error parsing RangeSet string " << partition.ranges();
-      return false;
+    RangeSet ranges;
+    if (partition.packed_ranges_size() > 0) {
+      ranges = ParsePackedRanges(partition.packed_ranges());
+      if (!ranges) {
+        LOG(WARNING) << "Error parsing packed ranges for partition " << partition.name();
+        return false;
+      }
+    } else {
+      if (partition.ranges().empty()) {
+        LOG(WARNING) << "Unexpected block ranges for partition " << partition.name();
+        return false;
+      }
+      ranges = RangeSet::Parse(partition.ranges());
+      if (!ranges) {
+        LOG(WARNING) << "Error parsing RangeSet string " << partition.ranges();
+        return false;
+      }
     }
 
     // Continues to check other partitions if there is a fingerprint mismatch.
@@ -289,6 +688,17 @@ bool UpdateVerifier::ParseCareMap() {
     }
 
     partition_map_.emplace(partition.name(), ranges);
+    care_map_id_ += partition.name() + "=" + partition.fingerprint() + ";";
+
+    // The blocks written by the update are optional, and only used by the deferred verification.
+    if (!partition.priority_ranges().empty()) {
+      RangeSet priority_ranges = RangeSet::Parse(partition.priority_ranges());
+      if (!priority_ranges) {
+        LOG(WARNING) << "Error parsing RangeSet string " << partition.priority_ranges();
+        return false;
+      }
+      priority_map_.emplace(partition.name(), std::move(priority_ranges));
+    }
   }
 
   if (partition_map_.empty()) {
@@ -308,6 +718,25 @@ void UpdateVerifier::set_property_reader(
   property_reader_ = property_reader;
 }
 
+// Opts in to verifying only the blocks that the update wrote before marking the boot successful,
+// if the care map lists them. The rest of the care map gets verified in the background afterwards.
+static constexpr const char* kDeferredVerificationEnabledProperty =
+    "ro.update_verifier.deferred_verification";
+
+// Verifies a random sample of about this percentage of the care map before marking the boot
+// successful, if set between 1 and 99. All of the care map gets verified in the background
+// afterwards.
+static constexpr const char* kSamplePercentProperty = "ro.update_verifier.sample_percent";
+
+// Starts the update_verifier_deferred service (see update_verifier.rc).
+static constexpr const char* kDeferredVerificationProperty = "ota.update_verifier.deferred";
+
+static void StartDeferredVerificationService() {
+  if (!android::base::SetProperty(kDeferredVerificationProperty, "1")) {
+    LOG(WARNING) << "Failed to start the deferred verification";
+  }
+}
+
 static int reboot_device() {
   if (android_reboot(ANDROID_RB_RESTART2, 0, nullptr) == -1) {
     LOG(ERROR) << "Failed to reboot.";
@@ -316,11 +745,31 @@ static int reboot_device() {
   while (true) pause();
 }
 
+// Reads the rest of the care map after the boot has been marked successful, as started via
+// kDeferredVerificationProperty by the first boot, or any later one while there's progress left.
+static int VerifyDeferred() {
+  UpdateVerifier verifier;
+  if (!verifier.ParseCareMap()) {
+    LOG(WARNING) << "Failed to parse the care map file, skipping deferred verification";
+    return 0;
+  }
+  if (!verifier.VerifyDeferredPartitions()) {
+    LOG(ERROR) << "Failed to verify the deferred blocks in care map file.";
+    return 1;
+  }
+  LOG(INFO) << "Finished the deferred verification.";
+  return 0;
+}
+
 int update_verifier(int argc, char** argv) {
   for (int i = 1; i < argc; i++) {
     LOG(INFO) << "Started with arg " << i << ": " << argv[i];
   }
 
+  if (argc == 2 && strcmp(argv[1], "--deferred") == 0) {
+    return VerifyDeferred();
+  }
+
   const auto module = android::hal::BootControlClient::WaitForService();
   if (module == nullptr) {
     LOG(ERROR) << "Error getting bootctrl module.";
@@ -357,13 +806,36 @@ int update_verifier(int argc, char** argv) {
       return reboot_device();
     }
 
+    bool deferred = false;
     if (!skip_verification) {
       UpdateVerifier verifier;
+      uint32_t sample_percent = android::base::GetUintProperty<uint32_t>(kSamplePercentProperty, 0);
       if (!verifier.ParseCareMap()) {
         LOG(WARNING) << "Failed to parse the care map file, skipping verification";
-      } else if (!verifier.VerifyPartitions()) {
-        LOG(ERROR) << "Failed to verify all blocks in care map file.";
-        return reboot_device();
+      } else if (!verifier.VerifiedBySnapuserd()) {
+        // Either the blocks the update wrote, or a sample of all the blocks, can be verified first
+        // to hold up the boot for less. The whole care map is then read in the background.
+        bool partial = false;
+        if (android::base::GetBoolProperty(kDeferredVerificationEnabledProperty, false) &&
+            verifier.HasPriorityBlocks()) {
+          if (!verifier.VerifyPriorityPartitions()) {
+            LOG(ERROR) << "Failed to verify the updated blocks in care map file.";
+            return reboot_device();
+          }
+          partial = true;
+        } else if (sample_percent > 0 && sample_percent < 100) {
+          if (!verifier.VerifySampledPartitions(sample_percent, std::random_device()())) {
+            LOG(ERROR) << "Failed to verify the sampled blocks in care map file.";
+            return reboot_device();
+          }
+          partial = true;
+        }
+
+        deferred = partial && verifier.StartDeferredVerification();
+        if (!deferred && !verifier.VerifyPartitions()) {
+          LOG(ERROR) << "Failed to verify all blocks in care map file.";
+          return reboot_device();
+        }
       }
     }
 
@@ -394,6 +866,13 @@ int update_verifier(int argc, char** argv) {
     } else {
       LOG(INFO) << "Deferred marking slot " << current_slot << " as booted successfully.";
     }
+
+    if (deferred) {
+      StartDeferredVerificationService();
+    }
+  } else if (UpdateVerifier().HasDeferredVerification()) {
+    // A reboot interrupted the deferred verification of this slot.
+    StartDeferredVerificationService();
   }
 
   LOG(INFO) << "Leaving update_verifier.";
@@ -41,6 +41,7 @@ updater_common_static_libraries := \
     libsquashfs_utils \
     libbrotli \
     libbz \
+    liblz4 \
     libziparchive \
     libz \
     libbase \
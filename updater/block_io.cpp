@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/block_io.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+class SyncBlockIo : public BlockIo {
+ public:
+  Type type() const override {
+    return Type::SYNC;
+  }
+
+  bool Read(int fd, const std::vector<Extent>& extents, uint8_t* buffer) override {
+    for (const auto& [offset, size] : extents) {
+      if (!android::base::ReadFullyAtOffset(fd, buffer, size, offset)) {
+        return false;
+      }
+      buffer += size;
+    }
+    return true;
+  }
+
+  bool Write(int fd, const std::vector<Extent>& extents, const uint8_t* buffer) override {
+    for (const auto& [offset, size] : extents) {
+      if (!android::base::WriteFullyAtOffset(fd, buffer, size, offset)) {
+        return false;
+      }
+      buffer += size;
+    }
+    return true;
+  }
+};
+
+// Talks to the kernel with the raw io_uring syscalls, since liburing isn't available to recovery.
+class IoUringBlockIo : public BlockIo {
+ public:
+  // Sets up a ring with room for |entries| requests in flight. Returns nullptr if io_uring isn't
+  // supported.
+  static std::unique_ptr<IoUringBlockIo> Create(unsigned entries);
+
+  ~IoUringBlockIo() override {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+  }
+
+  Type type() const override {
+    return Type::IO_URING;
+  }
+
+  bool Read(int fd, const std::vector<Extent>& extents, uint8_t* buffer) override {
+    return Submit(fd, extents, buffer, false);
+  }
+
+  bool Write(int fd, const std::vector<Extent>& extents, const uint8_t* buffer) override {
+    return Submit(fd, extents, const_cast<uint8_t*>(buffer), true);
+  }
+
+ private:
+  // The remainder of an extent that has yet to be transferred.
+  struct Request {
+    iovec iov;
+    off64_t offset;
+  };
+
+  IoUringBlockIo() = default;
+
+  // Keeps up to sq_entries_ requests in flight until all the |extents| have been transferred. A
+  // short transfer gets resubmitted for the remainder. On errors, waits for the requests in flight
+  // to complete before returning, since they point into |buffer|.
+  bool Submit(int fd, const std::vector<Extent>& extents, uint8_t* buffer, bool write);
+
+  template <typename T>
+  T* SqRing(uint32_t offset) const {
+    return reinterpret_cast<T*>(static_cast<uint8_t*>(sq_ring_) + offset);
+  }
+
+  template <typename T>
+  T* CqRing(uint32_t offset) const {
+    return reinterpret_cast<T*>(static_cast<uint8_t*>(cq_ring_) + offset);
+  }
+
+  android::base::unique_fd ring_fd_;
+  io_uring_params params_{};
+  void* sq_ring_{ MAP_FAILED };
+  size_t sq_ring_size_{ 0 };
+  void* cq_ring_{ MAP_FAILED };
+  size_t cq_ring_size_{ 0 };
+  void* sqes_{ MAP_FAILED };
+  size_t sqes_size_{ 0 };
+};
+
+std::unique_ptr<IoUringBlockIo> IoUringBlockIo::Create(unsigned entries) {
+  std::unique_ptr<IoUringBlockIo> io(new IoUringBlockIo());
+  io->ring_fd_.reset(syscall(__NR_io_uring_setup, entries, &io->params_));
+  if (io->ring_fd_ == -1) {
+    PLOG(WARNING) << "io_uring_setup failed";
+    return nullptr;
+  }
+
+  const io_uring_params& p = io->params_;
+  io->sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  io->cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    io->sq_ring_size_ = io->cq_ring_size_ = std::max(io->sq_ring_size_, io->cq_ring_size_);
+  }
+
+  io->sq_ring_ = mmap(nullptr, io->sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      io->ring_fd_, IORING_OFF_SQ_RING);
+  if (io->sq_ring_ == MAP_FAILED) {
+    PLOG(WARNING) << "Failed to map the io_uring submission queue";
+    return nullptr;
+  }
+  if (single_mmap) {
+    io->cq_ring_ = io->sq_ring_;
+  } else {
+    io->cq_ring_ = mmap(nullptr, io->cq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, io->ring_fd_, IORING_OFF_CQ_RING);
+    if (io->cq_ring_ == MAP_FAILED) {
+      PLOG(WARNING) << "Failed to map the io_uring completion queue";
+      return nullptr;
+    }
+  }
+  io->sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  io->sqes_ = mmap(nullptr, io->sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   io->ring_fd_, IORING_OFF_SQES);
+  if (io->sqes_ == MAP_FAILED) {
+    PLOG(WARNING) << "Failed to map the io_uring submission entries";
+    return nullptr;
+  }
+
+  // Use a fixed mapping between the submission queue slots and the entries.
+  uint32_t* array = io->SqRing<uint32_t>(p.sq_off.array);
+  for (uint32_t i = 0; i < p.sq_entries; i++) {
+    array[i] = i;
+  }
+  return io;
+}
+
+bool IoUringBlockIo::Submit(int fd, const std::vector<Extent>& extents, uint8_t* buffer,
+                            bool write) {
+  std::vector<Request> requests;
+  requests.reserve(extents.size());
+  for (const auto& [offset, size] : extents) {
+    if (size > 0) {
+      requests.push_back({ { buffer, size }, offset });
+    }
+    buffer += size;
+  }
+
+  const uint32_t sq_mask = *SqRing<uint32_t>(params_.sq_off.ring_mask);
+  uint32_t* sq_tail = SqRing<uint32_t>(params_.sq_off.tail);
+  const uint32_t cq_mask = *CqRing<uint32_t>(params_.cq_off.ring_mask);
+  uint32_t* cq_head = CqRing<uint32_t>(params_.cq_off.head);
+  uint32_t* cq_tail = CqRing<uint32_t>(params_.cq_off.tail);
+  io_uring_cqe* cqes = CqRing<io_uring_cqe>(params_.cq_off.cqes);
+  io_uring_sqe* sqes = static_cast<io_uring_sqe*>(sqes_);
+
+  // The requests that are ready to be submitted, i.e. not started yet or resubmitted after a short
+  // transfer.
+  std::vector<size_t> ready(requests.size());
+  for (size_t i = 0; i < ready.size(); i++) {
+    ready[i] = requests.size() - 1 - i;
+  }
+  // The requests that the kernel has taken, and those in the submission queue that it hasn't yet
+  // (io_uring_enter() may take fewer than it was given).
+  size_t in_flight = 0;
+  uint32_t unsubmitted = 0;
+  int error = 0;
+
+  while ((error == 0 && (!ready.empty() || unsubmitted > 0)) || in_flight > 0) {
+    uint32_t tail = *sq_tail;
+    while (error == 0 && !ready.empty() && in_flight + unsubmitted < params_.sq_entries) {
+      size_t index = ready.back();
+      ready.pop_back();
+
+      io_uring_sqe* sqe = &sqes[tail & sq_mask];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<uint64_t>(&requests[index].iov);
+      sqe->len = 1;
+      sqe->off = requests[index].offset;
+      sqe->user_data = index;
+
+      tail++;
+      unsubmitted++;
+    }
+    if (error != 0 && unsubmitted > 0) {
+      // Take back the entries that the kernel hasn't seen, so that they don't get submitted along
+      // with the next call's.
+      tail -= unsubmitted;
+      unsubmitted = 0;
+    }
+    // Make the entries visible to the kernel before the tail update.
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    // Only wait for a completion if the kernel has something to complete.
+    uint32_t min_complete = in_flight + unsubmitted > 0 ? 1 : 0;
+    int ret = TEMP_FAILURE_RETRY(syscall(__NR_io_uring_enter, ring_fd_.get(), unsubmitted,
+                                         min_complete, IORING_ENTER_GETEVENTS, nullptr, 0));
+    if (ret == -1) {
+      // The requests in flight still point into |buffer|, and their completions must not be left
+      // for the next call: stop submitting, and keep reaping until they're all done.
+      PLOG(ERROR) << "io_uring_enter failed with " << in_flight << " requests in flight";
+      error = errno;
+      ret = 0;
+    } else if (ret == 0 && in_flight == 0 && unsubmitted > 0) {
+      // The kernel took nothing and has nothing to complete, which would spin forever.
+      LOG(ERROR) << "io_uring_enter took none of " << unsubmitted << " requests";
+      error = EAGAIN;
+    }
+    in_flight += ret;
+    unsubmitted -= ret;
+
+    uint32_t head = *cq_head;
+    uint32_t available = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    if (error != 0 && in_flight > 0 && head == available) {
+      // Waiting failed too; give the kernel a moment before asking again.
+      usleep(1000);
+    }
+    for (; head != available; head++) {
+      const io_uring_cqe& cqe = cqes[head & cq_mask];
+      Request& request = requests[cqe.user_data];
+      in_flight--;
+      if (cqe.res < 0) {
+        error = -cqe.res;
+      } else if (cqe.res == 0) {
+        // Unexpected end of file.
+        error = ENODATA;
+      } else if (static_cast<size_t>(cqe.res) < request.iov.iov_len) {
+        request.iov.iov_base = static_cast<uint8_t*>(request.iov.iov_base) + cqe.res;
+        request.iov.iov_len -= cqe.res;
+        request.offset += cqe.res;
+        ready.push_back(cqe.user_data);
+      }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+  if (unsubmitted > 0) {
+    __atomic_store_n(sq_tail, *sq_tail - unsubmitted, __ATOMIC_RELEASE);
+  }
+
+  if (error != 0) {
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<BlockIo> BlockIo::Create(Type type, unsigned queue_depth) {
+  if (type == Type::IO_URING) {
+    if (auto io = IoUringBlockIo::Create(queue_depth); io != nullptr) {
+      return io;
+    }
+    LOG(WARNING) << "io_uring is unavailable; falling back to synchronous block I/O";
+  }
+  return std::make_unique<SyncBlockIo>();
+}
+
+bool BlockIo::ParseType(const std::string& name, Type* type) {
+  if (name == "sync") {
+    *type = Type::SYNC;
+  } else if (name == "io_uring") {
+    *type = Type::IO_URING;
+  } else {
+    return false;
+  }
+  return true;
+}
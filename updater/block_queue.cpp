@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/block_queue.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+BlockQueueTuner::BlockQueueTuner(std::string sys_dev_block)
+    : sys_dev_block_(std::move(sys_dev_block)) {
+  profiles_[BlockAccess::kSequential] = DefaultProfile(BlockAccess::kSequential);
+  profiles_[BlockAccess::kRandom] = DefaultProfile(BlockAccess::kRandom);
+}
+
+std::vector<BlockQueueTuner::Setting> BlockQueueTuner::DefaultProfile(BlockAccess access) {
+  // Both keep more requests queued for the storage to merge and reorder, and turn off the
+  // writeback throttling, which holds back the bulk writes in favor of reads that no one waits on.
+  // The long runs read ahead far; the scattered reads only as much as the kernel does by default.
+  switch (access) {
+    case BlockAccess::kSequential:
+      return { { "read_ahead_kb", "2048" }, { "nr_requests", "256" }, { "wbt_lat_usec", "0" } };
+    case BlockAccess::kRandom:
+      return { { "read_ahead_kb", "128" }, { "nr_requests", "256" }, { "wbt_lat_usec", "0" } };
+  }
+  return {};
+}
+
+bool BlockQueueTuner::ParseProfile(const std::string& str, std::vector<Setting>* profile) {
+  profile->clear();
+  for (const auto& item : android::base::Split(str, ",")) {
+    if (item.empty()) {
+      continue;
+    }
+    auto pieces = android::base::Split(item, "=");
+    if (pieces.size() != 2 || pieces[0].empty() || pieces[1].empty() ||
+        pieces[0].find('/') != std::string::npos) {
+      LOG(ERROR) << "Malformed block queue setting \"" << item << "\"";
+      return false;
+    }
+    profile->push_back({ pieces[0], pieces[1] });
+  }
+  return true;
+}
+
+void BlockQueueTuner::SetProfile(BlockAccess access, std::vector<Setting> profile) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  profiles_[access] = std::move(profile);
+}
+
+// Returns the canonical path of |path|, or an empty string if it doesn't exist.
+static std::string RealPath(const std::string& path) {
+  char buf[PATH_MAX];
+  return realpath(path.c_str(), buf) != nullptr ? buf : "";
+}
+
+static bool IsDirectory(const std::string& path) {
+  struct stat sb;
+  return stat(path.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode);
+}
+
+std::vector<std::string> BlockQueueTuner::FindQueues(const std::string& device_dir) {
+  std::vector<std::string> queues;
+  // A partition has none of its own, and queues up on its disk.
+  if (IsDirectory(device_dir + "/queue")) {
+    queues.push_back(device_dir + "/queue");
+  } else if (std::string disk_dir = android::base::Dirname(device_dir);
+             IsDirectory(disk_dir + "/queue")) {
+    queues.push_back(disk_dir + "/queue");
+  }
+
+  // A device-mapper device passes the requests on to the devices under it.
+  std::string slaves_dir = device_dir + "/slaves";
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(slaves_dir.c_str()), closedir);
+  if (dir) {
+    dirent* de;
+    while ((de = readdir(dir.get())) != nullptr) {
+      if (de->d_name[0] == '.') {
+        continue;
+      }
+      std::string slave_dir = RealPath(slaves_dir + "/" + de->d_name);
+      if (slave_dir.empty()) {
+        continue;
+      }
+      for (const auto& queue : FindQueues(slave_dir)) {
+        if (std::find(queues.begin(), queues.end(), queue) == queues.end()) {
+          queues.push_back(queue);
+        }
+      }
+    }
+  }
+  return queues;
+}
+
+// Reads the setting |name| of |queue_dir|. The scheduler is given as the one in brackets of the
+// available ones, e.g. "mq-deadline [none]".
+static bool ReadSetting(const std::string& queue_dir, const std::string& name,
+                        std::string* value) {
+  if (!android::base::ReadFileToString(queue_dir + "/" + name, value)) {
+    return false;
+  }
+  *value = android::base::Trim(*value);
+  if (size_t open = value->find('['); open != std::string::npos) {
+    size_t close = value->find(']', open);
+    if (close == std::string::npos) {
+      return false;
+    }
+    *value = value->substr(open + 1, close - open - 1);
+  }
+  return true;
+}
+
+bool BlockQueueTuner::Apply(const std::string& queue_dir, const Setting& setting) {
+  Queue& queue = queues_[queue_dir];
+  if (queue.rejected.count(setting.name) != 0) {
+    return false;
+  }
+  bool first = queue.original.count(setting.name) == 0;
+  if (first) {
+    std::string original;
+    if (!ReadSetting(queue_dir, setting.name, &original)) {
+      queue.rejected.insert(setting.name);
+      return false;
+    }
+    queue.original[setting.name] = original;
+    queue.current[setting.name] = original;
+  }
+  if (queue.current[setting.name] == setting.value) {
+    return false;
+  }
+  if (!android::base::WriteStringToFile(setting.value, queue_dir + "/" + setting.name)) {
+    PLOG(WARNING) << "Failed to set " << queue_dir << "/" << setting.name << " to "
+                  << setting.value;
+    queue.rejected.insert(setting.name);
+    return false;
+  }
+  if (first) {
+    LOG(INFO) << "Set " << queue_dir << "/" << setting.name << " to " << setting.value << " (was "
+              << queue.original[setting.name] << ")";
+  }
+  queue.current[setting.name] = setting.value;
+  return first;
+}
+
+std::vector<std::string> BlockQueueTuner::Tune(const std::string& path, BlockAccess access) {
+  std::string device_dir;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (devices_.count(path) == 0) {
+      struct stat sb;
+      if (stat(path.c_str(), &sb) == 0 && S_ISBLK(sb.st_mode)) {
+        device_dir = RealPath(sys_dev_block_ + "/" + std::to_string(major(sb.st_rdev)) + ":" +
+                              std::to_string(minor(sb.st_rdev)));
+      }
+      if (device_dir.empty()) {
+        devices_[path] = {};
+      }
+    }
+  }
+  return TuneDevice(path, device_dir, access);
+}
+
+std::vector<std::string> BlockQueueTuner::TuneDevice(const std::string& path,
+                                                     const std::string& device_dir,
+                                                     BlockAccess access) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto [device, inserted] = devices_.emplace(path, std::vector<std::string>());
+  if (inserted) {
+    device->second = FindQueues(device_dir);
+    for (const auto& queue_dir : device->second) {
+      queues_[queue_dir].users++;
+    }
+  }
+
+  std::vector<std::string> applied;
+  for (const auto& queue_dir : device->second) {
+    // "/sys/devices/.../sda/queue" is sda's.
+    std::string device_name = android::base::Basename(android::base::Dirname(queue_dir));
+    for (const auto& setting : profiles_[access]) {
+      int64_t value;
+      if (Apply(queue_dir, setting) && android::base::ParseInt(setting.value, &value)) {
+        applied.push_back("block_queue_" + device_name + "_" + setting.name + ": " + setting.value);
+      }
+    }
+  }
+  return applied;
+}
+
+void BlockQueueTuner::Restore(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto device = devices_.find(path);
+  if (device == devices_.end()) {
+    return;
+  }
+  for (const auto& queue_dir : device->second) {
+    Queue& queue = queues_[queue_dir];
+    if (--queue.users > 0) {
+      continue;
+    }
+    for (const auto& [name, original] : queue.original) {
+      if (queue.current[name] == original) {
+        continue;
+      }
+      if (!android::base::WriteStringToFile(original, queue_dir + "/" + name)) {
+        PLOG(WARNING) << "Failed to restore " << queue_dir << "/" << name << " to " << original;
+      } else {
+        LOG(INFO) << "Restored " << queue_dir << "/" << name << " to " << original;
+      }
+    }
+    queues_.erase(queue_dir);
+  }
+  devices_.erase(device);
+}
@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <linux/fs.h>
 #include <pthread.h>
 #include <stdarg.h>
@@ -26,21 +27,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <functional>
+#include <future>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/mapped_file.h>
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
@@ -51,14 +64,40 @@
 #include <openssl/sha.h>
 #include <verity/hash_tree_builder.h>
 #include <ziparchive/zip_archive.h>
+#include <zstd.h>
 
 #include "edify/expr.h"
 #include "edify/updater_interface.h"
+#include "edify/updater_runtime_interface.h"
 #include "otautil/dirutil.h"
 #include "otautil/error_code.h"
+#include "otautil/live_stats.h"
+#include "otautil/memory_budget.h"
 #include "otautil/paths.h"
+#include "otautil/phase_stats.h"
 #include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
+#include "otautil/ring_buffer.h"
+#include "otautil/sysutil.h"
+#include "otautil/trace.h"
+#include "private/block_buffer.h"
+#include "private/block_io.h"
+#include "private/brotli_segments.h"
+#include "private/command_pipeline.h"
+#include "private/command_stats.h"
+#include "private/fec_encoder.h"
+#include "private/io_trace.h"
+#include "private/load_governor.h"
+#include "private/memory_stash.h"
+#include "private/patch_source.h"
+#include "private/pending_syncs.h"
+#include "private/range_hash.h"
+#include "private/source_cache.h"
+#include "private/stash_cache.h"
+#include "private/stash_compression.h"
+#include "private/transfer_plan.h"
+#include "private/verify_ahead.h"
+#include "private/zstd_frames.h"
 #include "private/commands.h"
 #include "updater/install.h"
 
@@ -76,13 +115,130 @@ static constexpr size_t BLOCKSIZE = 4096;
 static constexpr mode_t STASH_DIRECTORY_MODE = 0700;
 static constexpr mode_t STASH_FILE_MODE = 0600;
 static constexpr mode_t MARKER_DIRECTORY_MODE = 0700;
+// Default memory budget for the source blocks read ahead by the command pipeline.
+static constexpr size_t kDefaultPipelineBufferMb = 32;
+// Upper bound of the default number of threads that apply the patches ahead of time.
+static constexpr size_t kMaxDefaultPatchThreads = 4;
+// Upper bound of the default number of threads that decompress the segments of the new data.
+static constexpr size_t kMaxDefaultDecoderThreads = 4;
+// Upper bound of the default number of threads that hash the leaves of range_sha256_tree(), or the
+// data blocks for compute_hash_tree.
+static constexpr size_t kMaxDefaultHashThreads = 8;
+// Upper bound of the default number of threads that apply the chunks of an imgdiff patch.
+static constexpr size_t kMaxDefaultImagePatchThreads = 4;
+// Upper bound of the default number of threads that block_image_recover() reads the ranges on.
+static constexpr size_t kMaxDefaultRecoverThreads = 4;
+// Upper bound of the default number of threads that block_image_verify() makes the checks ahead of
+// the commands on (see CheckCommandsAhead()).
+static constexpr size_t kMaxDefaultVerifyThreads = 4;
+// Default memory budget for each of these threads.
+static constexpr size_t kDefaultVerifyBatchMb = 16;
+// The number of blocks that block_image_recover() reads at a time.
+static constexpr size_t kRecoverBatchBlocks = 256;
+// Default memory budget for the new data expanded ahead of the 'new' commands.
+static constexpr size_t kDefaultNewDataBufferMb = 8;
+// Default memory budget for the zstd frames of the new data that are decompressed in parallel.
+static constexpr size_t kDefaultZstdFramesBufferMb = 64;
+// Default memory budget for the patch data inflated ahead of the diff commands, if it's compressed.
+static constexpr size_t kDefaultPatchWindowMb = 4;
+// Default memory budget for the stash files kept mapped by stash_cache.
+static constexpr size_t kDefaultStashCacheMb = 64;
+// Default memory budget for the stashes kept in RAM instead of the stash files.
+static constexpr size_t kDefaultStashMemoryMb = 64;
+// Default memory budget for the verified source blocks kept by source_cache.
+static constexpr size_t kDefaultSourceCacheMb = 32;
+// The smallest target that gets hashed on a separate thread, while the source is being loaded.
+static constexpr size_t kMinConcurrentHashBlocks = 64;
+// The smallest move that gets streamed (see StreamMove()), and the chunks it's streamed in.
+static constexpr size_t kMinStreamedMoveBlocks = 1024;
+static constexpr size_t kStreamedMoveChunkBlocks = 256;
+// Default upper bound of the number of commands between two checkpoints of block_image_update.
+static constexpr size_t kDefaultCheckpointInterval = 64;
+// Default budget for the source blocks of the upcoming commands that the kernel is asked to read
+// ahead into the page cache.
+static constexpr size_t kDefaultReadaheadMb = 64;
+
+// The state of the block image functions running on a thread. Each invocation (of e.g.
+// block_image_update()) resets the parts it uses as it starts, and since parallel() evaluates its
+// arguments on separate threads, the updates of independent partitions can run concurrently. The
+// helper threads of an invocation (the CommandPipeline, the hashing and the patching threads) work
+// on their own data and must not touch it.
+struct BlockImageContext {
+  CauseCode failure_type = kNoCause;
+  bool is_retry = false;
+  // The backend for ReadBlocks() / WriteBlocks(); see GetBlockIo().
+  std::unique_ptr<BlockIo> block_io;
+  // The block device in the I/O trace (see ro.updater.io_trace), if it's being recorded.
+  uint32_t io_trace_device = IoTracer::kNoFile;
+  std::unordered_map<std::string, RangeSet> stash_map;
+  // The mappings of the recently loaded stash files. Must be invalidated whenever a stash file gets
+  // deleted or rewritten.
+  StashCache stash_cache{ kDefaultStashCacheMb * 1024 * 1024 };
+  // The stashes that haven't been written to the stash files yet (block_image_update only). They
+  // get spilled to the stash files before any command that may overwrite their source blocks.
+  MemoryStash memory_stash{ kDefaultStashMemoryMb * 1024 * 1024 };
+  // The source blocks that have been read and verified recently, which must be invalidated before
+  // any of the blocks gets written.
+  SourceCache source_cache{ kDefaultSourceCacheMb * 1024 * 1024 };
+  // What the caches and the stashes above hold of the MemoryBudget of the process. The caches
+  // shrink to what the budget leaves them before each command; see ApplyCacheBudgets().
+  std::unique_ptr<MemoryBudget::Reservation> stash_cache_memory;
+  std::unique_ptr<MemoryBudget::Reservation> memory_stash_memory;
+  std::unique_ptr<MemoryBudget::Reservation> source_cache_memory;
+  // Where the progress of the update is saved for resuming it: Paths::last_command_file(), with the
+  // stash base appended when running under parallel(), so that the updates don't overwrite each
+  // other's.
+  std::string last_command_file;
+  // Whether the stash files get written compressed (see ro.updater.stash_compression).
+  bool compress_stash = false;
+  // Set if the space for the stash couldn't be reserved up front, with compression on. The space
+  // is then checked for each stash file as it gets written, by its compressed size.
+  bool check_stash_space = false;
+};
+
+static thread_local BlockImageContext context;
+
+// The space on /cache that the stashes of the updates in progress have asked for, so that
+// concurrent updates don't count the same free space twice.
+static std::mutex stash_space_mutex;
+static size_t stash_space_reserved = 0;
+
+// Holds |bytes| of stash_space_reserved for the lifetime of the object.
+class StashSpaceReservation {
+ public:
+  StashSpaceReservation() = default;
+  ~StashSpaceReservation() {
+    std::lock_guard<std::mutex> lock(stash_space_mutex);
+    stash_space_reserved -= bytes_;
+  }
+
+  StashSpaceReservation(const StashSpaceReservation&) = delete;
+  StashSpaceReservation& operator=(const StashSpaceReservation&) = delete;
 
-static CauseCode failure_type = kNoCause;
-static bool is_retry = false;
-static std::unordered_map<std::string, RangeSet> stash_map;
+  // Makes sure that /cache has room for |bytes| on top of what the other updates have reserved,
+  // and reserves it. Returns false if there isn't enough space.
+  bool Reserve(size_t bytes) {
+    std::lock_guard<std::mutex> lock(stash_space_mutex);
+    if (!CheckAndFreeSpaceOnCache(stash_space_reserved - bytes_ + bytes)) {
+      return false;
+    }
+    stash_space_reserved += bytes - bytes_;
+    bytes_ = bytes;
+    return true;
+  }
+
+ private:
+  size_t bytes_ = 0;
+};
+
+// Returns whether /cache has room for another |bytes| besides what the updates have reserved.
+static bool HasUnreservedStashSpace(size_t bytes) {
+  std::lock_guard<std::mutex> lock(stash_space_mutex);
+  return CheckAndFreeSpaceOnCache(stash_space_reserved + bytes);
+}
 
 static void DeleteLastCommandFile() {
-  const std::string& last_command_file = Paths::Get().last_command_file();
+  const std::string& last_command_file = context.last_command_file;
   if (unlink(last_command_file.c_str()) == -1 && errno != ENOENT) {
     PLOG(ERROR) << "Failed to unlink: " << last_command_file;
   }
@@ -91,7 +247,7 @@ static void DeleteLastCommandFile() {
 // Parse the last command index of the last update and save the result to |last_command_index|.
 // Return true if we successfully read the index.
 static bool ParseLastCommandFile(size_t* last_command_index) {
-  const std::string& last_command_file = Paths::Get().last_command_file();
+  const std::string& last_command_file = context.last_command_file;
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(last_command_file.c_str(), O_RDONLY)));
   if (fd == -1) {
     if (errno != ENOENT) {
@@ -124,15 +280,24 @@ static bool ParseLastCommandFile(size_t* last_command_index) {
   return true;
 }
 
+// Syncs |fd|, counting it towards the running install phase and transfer list command, and
+// recording it in the I/O trace as |trace_file| if given.
+static int Fsync(int fd, uint32_t trace_file = IoTracer::kNoFile) {
+  CountFsync();
+  CommandStats::ScopedSubPhase sub_phase(CommandSubPhase::kFsync);
+  ScopedIoTrace io_trace(IoTraceOp::kFsync, trace_file);
+  return fsync(fd);
+}
+
 static bool FsyncDir(const std::string& dirname) {
   android::base::unique_fd dfd(TEMP_FAILURE_RETRY(open(dirname.c_str(), O_RDONLY | O_DIRECTORY)));
   if (dfd == -1) {
-    failure_type = errno == EIO ? kEioFailure : kFileOpenFailure;
+    context.failure_type = errno == EIO ? kEioFailure : kFileOpenFailure;
     PLOG(ERROR) << "Failed to open " << dirname;
     return false;
   }
-  if (fsync(dfd) == -1) {
-    failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+  if (Fsync(dfd) == -1) {
+    context.failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
     PLOG(ERROR) << "Failed to fsync " << dirname;
     return false;
   }
@@ -141,7 +306,7 @@ static bool FsyncDir(const std::string& dirname) {
 
 // Update the last executed command index in the last_command_file.
 static bool UpdateLastCommandIndex(size_t command_index, const std::string& command_string) {
-  const std::string& last_command_file = Paths::Get().last_command_file();
+  const std::string& last_command_file = context.last_command_file;
   std::string last_command_tmp = last_command_file + ".tmp";
   std::string content = std::to_string(command_index) + "\n" + command_string;
   android::base::unique_fd wfd(
@@ -151,7 +316,7 @@ static bool UpdateLastCommandIndex(size_t command_index, const std::string& comm
     return false;
   }
 
-  if (fsync(wfd) == -1) {
+  if (Fsync(wfd) == -1) {
     PLOG(ERROR) << "Failed to fsync " << last_command_tmp;
     return false;
   }
@@ -194,7 +359,7 @@ bool SetUpdatedMarker(const std::string& marker) {
 
 static bool discard_blocks(int fd, off64_t offset, uint64_t size, bool force = false) {
   // Don't discard blocks unless the update is a retry run or force == true
-  if (!is_retry && !force) {
+  if (!context.is_retry && !force) {
     return true;
   }
 
@@ -213,40 +378,170 @@ static bool discard_blocks(int fd, off64_t offset, uint64_t size, bool force = f
 static bool check_lseek(int fd, off64_t offset, int whence) {
     off64_t rc = TEMP_FAILURE_RETRY(lseek64(fd, offset, whence));
     if (rc == -1) {
-        failure_type = kLseekFailure;
+        context.failure_type = kLseekFailure;
         PLOG(ERROR) << "lseek64 failed";
         return false;
     }
     return true;
 }
 
-static void allocate(size_t size, std::vector<uint8_t>* buffer) {
+static void allocate(size_t size, BlockBuffer* buffer) {
   // If the buffer's big enough, reuse it.
   if (size <= buffer->size()) return;
   buffer->resize(size);
 }
 
+// Returns the number of threads from |prop_name|. If the property is unset or invalid, it's the
+// number of CPUs up to |max_default|, scaled down by LoadGovernor to the load of the device; |what|
+// names them in the log.
+static size_t GetThreadsProperty(UpdaterRuntimeInterface* runtime, const std::string& prop_name,
+                                 size_t max_default, const std::string& what) {
+  std::string threads_prop = runtime->GetProperty(prop_name, "");
+  if (size_t parsed; !threads_prop.empty() && android::base::ParseUint(threads_prop, &parsed)) {
+    return parsed;
+  }
+  if (!threads_prop.empty()) {
+    LOG(WARNING) << "Invalid " << prop_name << ": " << threads_prop;
+  }
+  return LoadGovernor::Get().Threads(
+      what, std::min<size_t>(std::thread::hardware_concurrency(), max_default));
+}
+
+// Returns the memory budget in MiB from |prop_name|. If the property is unset or invalid, it's
+// |default_mb|, shrunk by LoadGovernor under memory pressure to a quarter of it at most.
+static size_t GetBudgetProperty(UpdaterRuntimeInterface* runtime, const std::string& prop_name,
+                                size_t default_mb, const std::string& what) {
+  std::string budget_prop = runtime->GetProperty(prop_name, "");
+  if (size_t parsed; !budget_prop.empty() && android::base::ParseUint(budget_prop, &parsed)) {
+    return parsed;
+  }
+  if (!budget_prop.empty()) {
+    LOG(WARNING) << "Invalid " << prop_name << ": " << budget_prop;
+  }
+  return LoadGovernor::Get().Budget(what + " MiB", default_mb, (default_mb + 3) / 4);
+}
+
+// Reserves |size| bytes of the MemoryBudget of the process for |what| into |reservation|, or as
+// much as the budget has left down to |min_size|; the caches get shrinkable reservations. Returns
+// the bytes reserved, or 0 if not even |min_size| bytes were left.
+static size_t ReserveMemory(std::unique_ptr<MemoryBudget::Reservation>* reservation,
+                            const std::string& what, size_t size, size_t min_size,
+                            MemoryBudget::Priority priority) {
+  reservation->reset();
+  *reservation = MemoryBudget::Get().Reserve(what, size, min_size, priority,
+                                             priority == MemoryBudget::Priority::kCache);
+  return *reservation == nullptr ? 0 : (*reservation)->size();
+}
+
+// Shrinks the caches to what the MemoryBudget has left them, after it has reclaimed memory from
+// them for a higher priority or under memory pressure.
+static void ApplyCacheBudgets() {
+  if (const auto& memory = context.source_cache_memory;
+      memory != nullptr && memory->size() < context.source_cache.capacity()) {
+    context.source_cache.set_capacity(memory->size());
+  }
+  if (const auto& memory = context.stash_cache_memory;
+      memory != nullptr && memory->size() < context.stash_cache.capacity()) {
+    context.stash_cache.set_capacity(memory->size());
+  }
+}
+
+// Returns the number of threads for hashing large ranges of blocks, from ro.updater.hash_threads.
+static size_t GetHashThreads(UpdaterRuntimeInterface* runtime, const std::string& what) {
+  return GetThreadsProperty(runtime, "ro.updater.hash_threads", kMaxDefaultHashThreads,
+                            what + " hash threads");
+}
+
+// Returns the block I/O backend, which is io_uring by default for block_image_update (see
+// ro.updater.block_io), and falls back to synchronous I/O otherwise.
+static BlockIo& GetBlockIo() {
+  if (context.block_io == nullptr) {
+    context.block_io = BlockIo::Create(BlockIo::Type::SYNC);
+  }
+  return *context.block_io;
+}
+
+// Returns the byte extents (offset and size) on the block device covered by |ranges|, with adjacent
+// ranges merged, so that each extent can be read or written with a single call.
+static std::vector<Extent> GetExtents(const RangeSet& ranges) {
+  std::vector<Extent> extents;
+  for (const auto& [begin, end] : ranges) {
+    off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
+    size_t size = (end - begin) * BLOCKSIZE;
+    if (!extents.empty() &&
+        extents.back().first + static_cast<off64_t>(extents.back().second) == offset) {
+      extents.back().second += size;
+    } else {
+      extents.emplace_back(offset, size);
+    }
+  }
+  return extents;
+}
+
+// Discards all the |extents| in one pass, ahead of writing to any of them.
+static bool DiscardExtents(int fd, const std::vector<Extent>& extents) {
+  for (const auto& [offset, size] : extents) {
+    if (!discard_blocks(fd, offset, size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Zeroes |size| bytes at |offset| with BLKZEROOUT, which lets the device (or the kernel) do it
+// without transferring the zeros, and invalidates the page cache of the range. Subsequent reads are
+// guaranteed to return zeros. Returns false if that fails, e.g. for a regular file, in which case
+// the caller should write the zeros by itself.
+static bool ZeroOutExtent(int fd, off64_t offset, uint64_t size) {
+  uint64_t args[2] = { static_cast<uint64_t>(offset), size };
+  return ioctl(fd, BLKZEROOUT, &args) == 0;
+}
+
+// Returns whether the block at |data| is all zeros. memcmp(3) against itself (shifted by one byte)
+// runs at the speed of the vectorized libc routine.
+static bool IsZeroBlock(const uint8_t* data) {
+  return data[0] == 0 && memcmp(data, data + 1, BLOCKSIZE - 1) == 0;
+}
+
+// Returns the number of leading zero blocks in the |blocks| blocks at |data|.
+static size_t CountZeroBlocks(const uint8_t* data, size_t blocks) {
+  size_t count = 0;
+  while (count < blocks && IsZeroBlock(data + count * BLOCKSIZE)) {
+    count++;
+  }
+  return count;
+}
+
 /**
  * RangeSinkWriter reads data from the given FD, and writes them to the destination specified by the
- * given RangeSet.
+ * given RangeSet. Small writes (e.g. from the patchers) are staged and coalesced, and the data is
+ * written at explicit offsets with one pwrite(2) per extent of the target, without seeking. If |fd|
+ * is opened with O_DIRECT, all the data goes through the block aligned staging buffer.
  */
 class RangeSinkWriter {
  public:
-  RangeSinkWriter(int fd, const RangeSet& tgt)
+  RangeSinkWriter(int fd, const RangeSet& tgt, bool direct = false)
       : fd_(fd),
-        tgt_(tgt),
-        next_range_(0),
-        current_range_left_(0),
-        bytes_written_(0) {
+        direct_(direct),
+        extents_(GetExtents(tgt)),
+        total_size_(tgt.blocks() * BLOCKSIZE),
+        next_extent_(0),
+        current_offset_(0),
+        current_extent_left_(0),
+        bytes_written_(0),
+        discarded_(false),
+        zero_out_(true) {
     CHECK_NE(tgt.size(), static_cast<size_t>(0));
+    context.source_cache.Invalidate(tgt);
   };
 
+  // All the data has been received (and flushed to the FD).
   bool Finished() const {
-    return next_range_ == tgt_.size() && current_range_left_ == 0;
+    return bytes_written_ == total_size_;
   }
 
   size_t AvailableSpace() const {
-    return tgt_.blocks() * BLOCKSIZE - bytes_written_;
+    return total_size_ - bytes_written_;
   }
 
   // Return number of bytes written; and 0 indicates a writing failure.
@@ -256,29 +551,31 @@ class RangeSinkWriter {
       return 0;
     }
 
-    size_t written = 0;
-    while (size > 0) {
-      // Move to the next range as needed.
-      if (!SeekToOutputRange()) {
-        break;
+    if (!discarded_) {
+      if (!DiscardExtents(fd_, extents_)) {
+        return 0;
       }
+      discarded_ = true;
+    }
 
-      size_t write_now = size;
-      if (current_range_left_ < write_now) {
-        write_now = current_range_left_;
+    size_t written = std::min(size, AvailableSpace());
+    if (direct_) {
+      if (!StageAligned(data, written)) {
+        return 0;
       }
-
-      if (!android::base::WriteFully(fd_, data, write_now)) {
-        failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-        PLOG(ERROR) << "Failed to write " << write_now << " bytes of data";
-        break;
+    } else if (staged_.size() + written < kStagingSize && written < AvailableSpace()) {
+      staged_.insert(staged_.end(), data, data + written);
+    } else {
+      // Write out the staged data, and then the new data straight from the caller's buffer.
+      if (!staged_.empty()) {
+        if (!Flush(staged_.data(), staged_.size())) {
+          return 0;
+        }
+        staged_.clear();
+      }
+      if (!Flush(data, written)) {
+        return 0;
       }
-
-      data += write_now;
-      size -= write_now;
-
-      current_range_left_ -= write_now;
-      written += write_now;
     }
 
     bytes_written_ += written;
@@ -290,27 +587,101 @@ class RangeSinkWriter {
   }
 
  private:
-  // Set up the output cursor, move to next range if needed.
-  bool SeekToOutputRange() {
-    // We haven't finished the current range yet.
-    if (current_range_left_ != 0) {
-      return true;
-    }
-    // We can't write any more; let the write function return how many bytes have been written
-    // so far.
-    if (next_range_ >= tgt_.size()) {
-      return false;
+  // The amount of data to stage before writing it out.
+  static constexpr size_t kStagingSize = 1024 * 1024;
+  // The shortest run of zero blocks that gets zeroed out with an ioctl instead of being written.
+  static constexpr size_t kMinZeroRunBlocks = 16;
+  static_assert(kStagingSize % BLOCKSIZE == 0, "Staging size must be a multiple of BLOCKSIZE");
+
+  // Stages |size| bytes of |data|, and writes out the staged data whenever the staging buffer fills
+  // up, or once all the data has been received. kStagingSize is a multiple of the block size (and
+  // so is the total size), which keeps each write block aligned for O_DIRECT.
+  bool StageAligned(const uint8_t* data, size_t size) {
+    bool last = size == AvailableSpace();
+    while (size > 0) {
+      size_t stage_now = std::min(size, kStagingSize - staged_.size());
+      staged_.insert(staged_.end(), data, data + stage_now);
+      data += stage_now;
+      size -= stage_now;
+
+      if (staged_.size() == kStagingSize || (last && size == 0)) {
+        if (!Flush(staged_.data(), staged_.size())) {
+          return false;
+        }
+        staged_.clear();
+      }
     }
+    return true;
+  }
 
-    const Range& range = tgt_[next_range_];
-    off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
-    current_range_left_ = (range.second - range.first) * BLOCKSIZE;
-    next_range_++;
+  // Writes |size| bytes of |data| to the target, continuing from where the last call left off.
+  bool Flush(const uint8_t* data, size_t size) {
+    CommandStats::ScopedSubPhase sub_phase(CommandSubPhase::kWrite);
+    // Split the data over the extents, and write all the pieces in one go.
+    std::vector<Extent> pieces;
+    while (size > 0) {
+      // Move to the next extent as needed.
+      if (current_extent_left_ == 0) {
+        CHECK_LT(next_extent_, extents_.size());
+        std::tie(current_offset_, current_extent_left_) = extents_[next_extent_++];
+      }
 
-    if (!discard_blocks(fd_, offset, current_range_left_)) {
-      return false;
+      size_t write_now = std::min(size, current_extent_left_);
+      pieces.emplace_back(current_offset_, write_now);
+      size -= write_now;
+
+      current_offset_ += write_now;
+      current_extent_left_ -= write_now;
     }
-    if (!check_lseek(fd_, offset, SEEK_SET)) {
+
+    return WriteSkippingZeros(pieces, data);
+  }
+
+  // Writes the |pieces| of |data|, except for the long runs of zero blocks, which get zeroed out
+  // with ZeroOutExtent() instead (e.g. the empty areas of fresh images). Falls back to writing
+  // everything if the FD doesn't support that.
+  bool WriteSkippingZeros(const std::vector<Extent>& pieces, const uint8_t* data) {
+    // The pieces (or their tails) to write, which are contiguous in the buffer from pending_data.
+    std::vector<Extent> pending;
+    const uint8_t* pending_data = data;
+    for (const auto& [offset, size] : pieces) {
+      // Only whole blocks can be zeroed out.
+      size_t pos = (BLOCKSIZE - offset % BLOCKSIZE) % BLOCKSIZE;
+      size_t done = 0;
+      while (zero_out_ && pos + kMinZeroRunBlocks * BLOCKSIZE <= size) {
+        size_t zeros = CountZeroBlocks(data + pos, (size - pos) / BLOCKSIZE);
+        if (zeros < kMinZeroRunBlocks) {
+          pos += (zeros + 1) * BLOCKSIZE;
+          continue;
+        }
+        if (!ZeroOutExtent(fd_, offset + pos, zeros * BLOCKSIZE)) {
+          zero_out_ = false;
+          break;
+        }
+        if (pos > done) {
+          pending.emplace_back(offset + done, pos - done);
+        }
+        if (!pending.empty() && !WriteExtents(pending, pending_data)) {
+          return false;
+        }
+        pending.clear();
+        pos += zeros * BLOCKSIZE;
+        done = pos;
+        pending_data = data + done;
+      }
+      if (done < size) {
+        pending.emplace_back(offset + done, size - done);
+      }
+      data += size;
+    }
+    return pending.empty() || WriteExtents(pending, pending_data);
+  }
+
+  bool WriteExtents(const std::vector<Extent>& pieces, const uint8_t* data) {
+    ScopedIoTrace io_trace(IoTraceOp::kWrite, context.io_trace_device, pieces);
+    if (!GetBlockIo().Write(fd_, pieces, data)) {
+      context.failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+      PLOG(ERROR) << "Failed to write data to " << pieces.size() << " extents";
       return false;
     }
     return true;
@@ -318,14 +689,25 @@ class RangeSinkWriter {
 
   // The output file descriptor.
   int fd_;
-  // The destination ranges for the data.
-  const RangeSet& tgt_;
-  // The next range that we should write to.
-  size_t next_range_;
-  // The number of bytes to write before moving to the next range.
-  size_t current_range_left_;
-  // Total bytes written by the writer.
+  // Whether fd_ is opened with O_DIRECT.
+  bool direct_;
+  // The destination extents for the data.
+  const std::vector<Extent> extents_;
+  // The total size of the destination.
+  const size_t total_size_;
+  // The next extent that we should write to.
+  size_t next_extent_;
+  // The offset to write at, and the number of bytes to write before moving to the next extent.
+  off64_t current_offset_;
+  size_t current_extent_left_;
+  // Total bytes received by the writer, including the staged ones.
   size_t bytes_written_;
+  // Whether the destination has been discarded.
+  bool discarded_;
+  // Whether fd_ supports ZeroOutExtent().
+  bool zero_out_;
+  // The received data that has yet to be written.
+  BlockBuffer staged_;
 };
 
 /**
@@ -334,96 +716,58 @@ class RangeSinkWriter {
  * of the archive (it's compressed) without writing it to a temp file, but we can't write each
  * section until it's that transfer's turn to go.
  *
- * To achieve this, we expand the new data from the archive in a background thread, and block that
- * threads 'receive uncompressed data' function until the main thread has reached a point where we
- * want some new data to be written. We signal the background thread with the destination for the
- * data and block the main thread, waiting for the background thread to complete writing that
- * section. Then it signals the main thread to wake up and goes back to blocking waiting for a
- * transfer.
+ * To achieve this, we expand the new data from the archive in a background thread, which pushes the
+ * uncompressed data into a bounded ring buffer. The main thread pulls the data out of the ring
+ * buffer and writes it to the target ranges when it gets to each 'new' transfer. In the meantime,
+ * the background thread keeps expanding ahead until the ring buffer is full, so it doesn't sit idle
+ * while the main thread executes the other commands.
  *
- * NewThreadInfo is the struct used to pass information back and forth between the two threads. When
- * the main thread wants some data written, it sets writer to the destination location and signals
- * the condition. When the background thread is done writing, it clears writer and signals the
- * condition again.
+ * NewThreadInfo is the struct used to pass information back and forth between the two threads.
+ *
+ * New data that's stored uncompressed needs none of this: the 'new' transfers write it straight out
+ * of the mapped package instead.
  */
 struct NewThreadInfo {
   ZipArchiveHandle za;
   ZipEntry64 entry{};
   bool brotli_compressed;
+  bool zstd_compressed;
 
-  std::unique_ptr<RangeSinkWriter> writer;
   BrotliDecoderState* brotli_decoder_state;
-  bool receiver_available;
-
-  pthread_mutex_t mu;
-  pthread_cond_t cv;
+  ZSTD_DCtx* zstd_decoder_state;
+  // Set for the chunked variant of the brotli compressed new data, or for the zstd compressed new
+  // data with multiple frames, in which case the independent segments at segment_data are
+  // decompressed on decoder_threads threads in parallel instead.
+  const uint8_t* segment_data;
+  std::vector<CompressedSegment> segments;
+  size_t decoder_threads;
+  // The uncompressed new data, produced by the background thread and consumed by the main thread.
+  // nullptr for the stored new data.
+  std::unique_ptr<RingBuffer> ring;
+  // The new data in the mapped package if it's stored, and how much of it has been written.
+  const uint8_t* stored_data;
+  size_t stored_size;
+  size_t stored_offset;
 };
 
 static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
-
-  while (size > 0) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the new data receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-    size_t write_now = std::min(size, nti->writer->AvailableSpace());
-    if (nti->writer->Write(data, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
-    }
-
-    data += write_now;
-    size -= write_now;
-
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
-
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
-    }
-  }
-
-  return true;
+  // Fails only if the main thread has aborted the ring buffer, e.g. on errors when performing block
+  // image update.
+  return nti->ring->Write(data, size);
 }
 
 static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
   while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-
-    size_t buffer_size = std::min<size_t>(32768, nti->writer->AvailableSpace());
+    // Decompress straight into the free space of the ring buffer.
+    uint8_t* buffer;
+    size_t buffer_size = nti->ring->GetWritable(&buffer);
     if (buffer_size == 0) {
-      LOG(ERROR) << "No space left in output range";
+      // End the receiver if we encounter an error when performing block image update.
       return false;
     }
-    uint8_t buffer[buffer_size];
     size_t available_in = size;
     size_t available_out = buffer_size;
     uint8_t* next_out = buffer;
@@ -441,23 +785,38 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
     LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
                << size - available_in << ", decoder status " << result;
 
-    size_t write_now = buffer_size - available_out;
-    if (nti->writer->Write(buffer, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
-    }
+    nti->ring->Commit(buffer_size - available_out);
 
     // Update the remaining size. The input data ptr is already updated by brotli decoder function.
     size = available_in;
+  }
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+  return true;
+}
+
+static bool receive_zstd_new_data(const uint8_t* data, size_t size, void* cookie) {
+  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
+  ZSTD_inBuffer in{ data, size, 0 };
+  bool has_more_output = false;
+  while (in.pos < in.size || has_more_output) {
+    // Decompress straight into the free space of the ring buffer.
+    uint8_t* buffer;
+    size_t buffer_size = nti->ring->GetWritable(&buffer);
+    if (buffer_size == 0) {
+      // End the receiver if we encounter an error when performing block image update.
+      return false;
     }
+    ZSTD_outBuffer out{ buffer, buffer_size, 0 };
+    size_t result = ZSTD_decompressStream(nti->zstd_decoder_state, &out, &in);
+    if (ZSTD_isError(result)) {
+      LOG(ERROR) << "Decompression failed with " << ZSTD_getErrorName(result);
+      return false;
+    }
+    nti->ring->Commit(out.pos);
+
+    // The decoder may hold more output than what fitted into the buffer.
+    has_more_output = out.pos == out.size;
   }
 
   return true;
@@ -465,75 +824,171 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
 
 static void* unzip_new_data(void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
-  if (nti->brotli_compressed) {
+  auto sink = [nti](const uint8_t* data, size_t size) { return nti->ring->Write(data, size); };
+  if (!nti->segments.empty() && nti->zstd_compressed) {
+    DecompressZstdFrames(nti->segment_data, nti->segments, nti->decoder_threads, sink);
+  } else if (!nti->segments.empty()) {
+    DecompressBrotliSegments(nti->segment_data, nti->segments, nti->decoder_threads, sink);
+  } else if (nti->brotli_compressed) {
     ProcessZipEntryContents(nti->za, &nti->entry, receive_brotli_new_data, nti);
+  } else if (nti->zstd_compressed) {
+    ProcessZipEntryContents(nti->za, &nti->entry, receive_zstd_new_data, nti);
   } else {
     ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, nti);
   }
-  pthread_mutex_lock(&nti->mu);
-  nti->receiver_available = false;
-  if (nti->writer != nullptr) {
-    pthread_cond_broadcast(&nti->cv);
-  }
-  pthread_mutex_unlock(&nti->mu);
+  // Let the main thread see the end of the data. Any command still expecting new data fails then.
+  nti->ring->Close();
   return nullptr;
 }
 
-static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>* buffer, int fd) {
-  size_t p = 0;
-  for (const auto& [begin, end] : src) {
-    if (!check_lseek(fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      return -1;
-    }
+// Loads the segment index for the chunked variant of the brotli compressed new data, if the package
+// has one. Leaves nti->segments empty if there's no index or it can't be used, in which case the
+// new data is decompressed as a single stream.
+static void LoadBrotliSegments(UpdaterInterface* updater, ZipArchiveHandle za,
+                               const std::string& new_data_fn, const ZipEntry64& new_entry,
+                               NewThreadInfo* nti) {
+  std::string index_fn = new_data_fn + kBrotliSegmentIndexSuffix;
+  ZipEntry64 index_entry;
+  if (FindEntry(za, index_fn, &index_entry) != 0) {
+    return;
+  }
+  // The segments are decompressed straight from the mapped package.
+  if (new_entry.method != kCompressStored) {
+    LOG(WARNING) << new_data_fn << " must be stored to be decompressed in segments";
+    return;
+  }
+  const uint8_t* mapped_package = updater->GetMappedPackageAddress();
+  if (mapped_package == nullptr ||
+      static_cast<uint64_t>(new_entry.offset) + new_entry.uncompressed_length >
+          updater->GetMappedPackageLength()) {
+    LOG(WARNING) << new_data_fn << " must be within the mapped package to be decompressed in "
+                 << "segments";
+    return;
+  }
 
-    size_t size = (end - begin) * BLOCKSIZE;
-    if (!android::base::ReadFully(fd, buffer->data() + p, size)) {
-      failure_type = errno == EIO ? kEioFailure : kFreadFailure;
-      PLOG(ERROR) << "Failed to read " << size << " bytes of data";
-      return -1;
-    }
+  std::string content(index_entry.uncompressed_length, '\0');
+  if (int32_t err = ExtractToMemory(za, &index_entry, reinterpret_cast<uint8_t*>(content.data()),
+                                    content.size());
+      err != 0) {
+    LOG(WARNING) << "Failed to extract " << index_fn << ": " << ErrorCodeString(err);
+    return;
+  }
+  std::string err;
+  if (!ParseBrotliSegmentIndex(content, new_entry.uncompressed_length, &nti->segments, &err)) {
+    LOG(WARNING) << "Failed to parse " << index_fn << ": " << err;
+    nti->segments.clear();
+    return;
+  }
+
+  nti->segment_data = mapped_package + new_entry.offset;
+  nti->decoder_threads = GetThreadsProperty(updater->GetRuntime(), "ro.updater.brotli_threads",
+                                            kMaxDefaultDecoderThreads, "brotli decoder threads");
+  LOG(INFO) << "decompressing " << nti->segments.size() << " segments of " << new_data_fn
+            << " on " << nti->decoder_threads << " threads";
+}
 
-    p += size;
+// Finds the frames of the zstd compressed new data, to decompress them in parallel if there are
+// several, and the memory budget allows. Leaves nti->segments empty otherwise, in which case the
+// new data is decompressed as a single stream.
+static void LoadZstdFrames(UpdaterInterface* updater, const std::string& new_data_fn,
+                           const ZipEntry64& new_entry, NewThreadInfo* nti) {
+  // The frames are decompressed straight from the mapped package.
+  const uint8_t* mapped_package = updater->GetMappedPackageAddress();
+  if (new_entry.method != kCompressStored || mapped_package == nullptr ||
+      static_cast<uint64_t>(new_entry.offset) + new_entry.uncompressed_length >
+          updater->GetMappedPackageLength()) {
+    return;
   }
 
-  return 0;
+  const uint8_t* data = mapped_package + new_entry.offset;
+  std::vector<CompressedSegment> frames;
+  std::string err;
+  if (!FindZstdFrames(data, new_entry.uncompressed_length, &frames, &err)) {
+    LOG(INFO) << "decompressing " << new_data_fn << " as a stream: " << err;
+    return;
+  }
+  if (frames.size() < 2) {
+    return;
+  }
+
+  // Up to 2 frames per thread are held in memory at a time.
+  size_t max_frame_size = 0;
+  for (const auto& frame : frames) {
+    max_frame_size = std::max(max_frame_size, frame.size);
+  }
+  size_t buffer_mb = GetBudgetProperty(updater->GetRuntime(), "ro.updater.zstd_frames_buffer_mb",
+                                       kDefaultZstdFramesBufferMb, "zstd frames buffer");
+  size_t threads = GetThreadsProperty(updater->GetRuntime(), "ro.updater.zstd_threads",
+                                      kMaxDefaultDecoderThreads, "zstd decoder threads");
+  threads = std::min(threads, buffer_mb * 1024 * 1024 / (2 * std::max<size_t>(max_frame_size, 1)));
+  if (threads == 0) {
+    LOG(INFO) << "decompressing " << new_data_fn << " as a stream: frames of up to "
+              << max_frame_size << " bytes exceed the buffer of " << buffer_mb << " MiB";
+    return;
+  }
+
+  nti->segments = std::move(frames);
+  nti->segment_data = data;
+  nti->decoder_threads = threads;
+  LOG(INFO) << "decompressing " << nti->segments.size() << " frames of " << new_data_fn << " on "
+            << nti->decoder_threads << " threads";
 }
 
-static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, int fd) {
-  size_t written = 0;
-  for (const auto& [begin, end] : tgt) {
-    off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
-    size_t size = (end - begin) * BLOCKSIZE;
-    if (!discard_blocks(fd, offset, size)) {
-      return -1;
-    }
+static int ReadBlocks(const RangeSet& src, BlockBuffer* buffer, int fd) {
+  ScopedTrace trace(TraceEvent::kRead, src.blocks() * BLOCKSIZE);
+  CommandStats::ScopedSubPhase sub_phase(CommandSubPhase::kRead);
+  std::vector<Extent> extents = GetExtents(src);
+  ScopedIoTrace io_trace(IoTraceOp::kRead, context.io_trace_device, extents);
+  if (!GetBlockIo().Read(fd, extents, buffer->data())) {
+    context.failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+    PLOG(ERROR) << "Failed to read " << src.blocks() * BLOCKSIZE << " bytes of data";
+    return -1;
+  }
 
-    if (!check_lseek(fd, offset, SEEK_SET)) {
-      return -1;
-    }
+  return 0;
+}
 
-    if (!android::base::WriteFully(fd, buffer.data() + written, size)) {
-      failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-      PLOG(ERROR) << "Failed to write " << size << " bytes of data";
-      return -1;
-    }
+static int WriteBlocks(const RangeSet& tgt, const uint8_t* data, int fd) {
+  ScopedTrace trace(TraceEvent::kWrite, tgt.blocks() * BLOCKSIZE);
+  CommandStats::ScopedSubPhase sub_phase(CommandSubPhase::kWrite);
+  context.source_cache.Invalidate(tgt);
+  std::vector<Extent> extents = GetExtents(tgt);
+  if (!DiscardExtents(fd, extents)) {
+    return -1;
+  }
 
-    written += size;
+  ScopedIoTrace io_trace(IoTraceOp::kWrite, context.io_trace_device, extents);
+  if (!GetBlockIo().Write(fd, extents, data)) {
+    context.failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+    PLOG(ERROR) << "Failed to write " << tgt.blocks() * BLOCKSIZE << " bytes of data";
+    return -1;
   }
 
   return 0;
 }
 
+static int WriteBlocks(const RangeSet& tgt, const BlockBuffer& buffer, int fd) {
+  return WriteBlocks(tgt, buffer.data(), fd);
+}
+
 // Parameters for transfer list command functions
 struct CommandParameters {
-    std::vector<std::string> tokens;
+    // The tokens and the line of the current command, as views into the transfer list.
+    std::vector<std::string_view> tokens;
     size_t cpos;
     std::string cmdname;
-    std::string cmdline;
+    std::string_view cmdline;
     std::string freestash;
     std::string stashbase;
+    // Whether the stash files get mapped (and the mappings cached in stash_cache) instead of read,
+    // from ro.updater.map_stashes. Off by default: a media error in a mapped stash is a SIGBUS that
+    // kills the updater, instead of the EIO that fails the command with kEioFailure and gets the
+    // update retried.
+    bool map_stashes;
     bool canwrite;
     int createdstash;
+    // The space on /cache for the stash, held until the update is done.
+    StashSpaceReservation stash_reservation;
     android::base::unique_fd fd;
     bool foundwrites;
     bool isunresumable;
@@ -542,15 +997,138 @@ struct CommandParameters {
     size_t stashed;
     NewThreadInfo nti;
     pthread_t thread;
-    std::vector<uint8_t> buffer;
-    uint8_t* patch_start;
+    // The source blocks of the current command. Together with tgtbuffer and stashbuffer, these are
+    // sized up front for the largest command (see ReserveBuffers()), and reused across commands.
+    BlockBuffer buffer;
+    // The current contents of the target blocks, to check if the command has been done already.
+    BlockBuffer tgtbuffer;
+    // A stash that's being loaded, before its blocks are moved into place in buffer.
+    BlockBuffer stashbuffer;
+    std::unique_ptr<PatchSource> patch_source;
     bool target_verified;  // The target blocks have expected contents already.
+    size_t cmdindex;
+    // Reads ahead the source blocks for upcoming commands; nullptr if disabled.
+    std::unique_ptr<CommandPipeline> pipeline;
+    // The latencies of the commands by type, which get logged and written to last_install.
+    CommandStats command_stats;
+    // The block device opened with O_DIRECT, for writing the target blocks without going through
+    // the page cache; -1 if disabled. Reads still go through fd.
+    android::base::unique_fd direct_fd;
+    // The source blocks of the current patch, when they're mapped from the partition instead of
+    // copied into buffer (see MapSourceBlocks()); nullptr otherwise.
+    std::unique_ptr<MemMapping> mapped_source;
+    // Whether the sources of the patches may be mapped, from ro.updater.map_patch_sources. Off by
+    // default for the same reason as map_stashes.
+    bool map_sources;
+    // The number of threads that hash the data blocks for compute_hash_tree.
+    size_t hash_threads;
+    // The number of threads that apply the chunks of an imgdiff command.
+    size_t imgpatch_threads;
+    // The parsed commands by index, for batching the checkpoints; empty if the checkpoint is made
+    // after every command instead (see NeedsCheckpoint()).
+    std::vector<const Command*> commands;
+    size_t checkpoint_interval;
+    // The commands executed since the last checkpoint: their count, the last one, and the source
+    // ranges that they would need again if they were to be redone on resume.
+    size_t pending_commands;
+    size_t pending_index;
+    std::string pending_cmdline;
+    SortedRangeSet pending_sources;
+    // The stashes freed since the last checkpoint, which the pending commands may need again.
+    std::vector<std::string> pending_frees;
+    // Worked out from the parsed transfer list; empty if it couldn't be parsed.
+    TransferPlan plan;
+    // The entries of plan.reads that have been handed to the kernel to read ahead, and the number
+    // of blocks they cover, which the budget (in blocks) bounds; see AdviseReads().
+    size_t readahead_blocks_budget;
+    size_t readahead_begin;
+    size_t readahead_end;
+    size_t readahead_blocks;
+    // In verify mode, the outcomes of the checks made ahead of the commands, by command index;
+    // empty if they haven't been made.
+    std::vector<AheadChecks> ahead_checks;
+    // What the block buffers, the pipeline and the new data ring hold of the MemoryBudget.
+    std::vector<std::unique_ptr<MemoryBudget::Reservation>> memory;
 };
 
+// Returns the outcomes of the checks that have been made ahead of the current command, or nullptr.
+static const AheadChecks* FindAheadChecks(const CommandParameters& params) {
+  if (params.canwrite || params.cmdindex >= params.ahead_checks.size()) {
+    return nullptr;
+  }
+  return &params.ahead_checks[params.cmdindex];
+}
+
+// Sizes the block buffers in |params| for the largest command in params.plan, so that they don't
+// need to grow (and copy the data around) as the commands get executed.
+static void ReserveBuffers(CommandParameters& params) {
+  const TransferPlan& plan = params.plan;
+  // The patches whose sources get mapped don't need them in the buffer.
+  size_t source_blocks =
+      params.map_sources ? plan.max_copied_source_blocks : plan.max_source_blocks;
+  LOG(INFO) << "reserving buffers for " << source_blocks << " source, " << plan.max_target_blocks
+            << " target and " << plan.max_stash_blocks << " stashed blocks";
+  size_t size = (source_blocks + plan.max_target_blocks + plan.max_stash_blocks) * BLOCKSIZE;
+  // The commands need the buffers regardless, but the reservation makes the caches give way.
+  ReserveMemory(&params.memory.emplace_back(), "block buffers", size, size,
+                MemoryBudget::Priority::kRequired);
+  allocate(source_blocks * BLOCKSIZE, &params.buffer);
+  allocate(plan.max_target_blocks * BLOCKSIZE, &params.tgtbuffer);
+  allocate(plan.max_stash_blocks * BLOCKSIZE, &params.stashbuffer);
+}
+
+// Hints the kernel to read ahead the source blocks of the commands after |cmdindex|, up to the
+// budget, so the scattered reads of the transfer list overlap with the patching of the current
+// command. The hints are only advisory, so any errors get ignored.
+static void AdviseReads(CommandParameters& params, size_t cmdindex) {
+  const auto& reads = params.plan.reads;
+  while (params.readahead_begin < params.readahead_end &&
+         reads[params.readahead_begin].index < cmdindex) {
+    params.readahead_blocks -= reads[params.readahead_begin++].ranges.blocks();
+  }
+  if (params.readahead_begin == params.readahead_end) {
+    // Nothing in flight; skip past the commands done already (e.g. on resume).
+    while (params.readahead_end < reads.size() && reads[params.readahead_end].index <= cmdindex) {
+      params.readahead_end++;
+    }
+    params.readahead_begin = params.readahead_end;
+  }
+
+  while (params.readahead_end < reads.size()) {
+    const auto& [index, ranges] = reads[params.readahead_end];
+    // Always allow one command, even if it alone exceeds the budget.
+    if (params.readahead_begin != params.readahead_end &&
+        params.readahead_blocks + ranges.blocks() > params.readahead_blocks_budget) {
+      break;
+    }
+    for (const auto& [begin, end] : ranges) {
+      posix_fadvise(params.fd, static_cast<off64_t>(begin) * BLOCKSIZE,
+                    static_cast<off64_t>(end - begin) * BLOCKSIZE, POSIX_FADV_WILLNEED);
+    }
+    params.readahead_blocks += ranges.blocks();
+    params.readahead_end++;
+  }
+}
+
+// Returns the FD to write the target blocks to.
+static int WriteFd(const CommandParameters& params) {
+  return params.direct_fd != -1 ? params.direct_fd.get() : params.fd.get();
+}
+
+// Reads the source blocks |src| of the current command into params.buffer, using the data that has
+// been read ahead by the pipeline if available.
+static int ReadSourceBlocks(CommandParameters& params, const RangeSet& src) {
+  if (params.pipeline != nullptr &&
+      params.pipeline->TakeSourceBlocks(params.cmdindex, src, params.buffer.data())) {
+    return 0;
+  }
+  return ReadBlocks(src, &params.buffer, params.fd);
+}
+
 // Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
 // handled separately).
 static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
-                                              const std::vector<uint8_t>& buffer) {
+                                              const BlockBuffer& buffer) {
   LOG(INFO) << "unexpected contents of source blocks in cmd:\n" << params.cmdline;
   CHECK(params.tokens[0] == "move" || params.tokens[0] == "bsdiff" ||
         params.tokens[0] == "imgdiff");
@@ -602,9 +1180,11 @@ static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
   }
 
   LOG(INFO) << "printing hash in hex for " << src.blocks() << " source blocks";
+  RangeSetIndex src_index(src);
+  RangeSetIndex locs_index(std::move(locs));
   for (size_t i = 0; i < src.blocks(); i++) {
-    size_t block_num = src.GetBlockNumber(i);
-    size_t buffer_index = locs.GetBlockNumber(i);
+    size_t block_num = src_index.GetBlockNumber(i);
+    size_t buffer_index = locs_index.GetBlockNumber(i);
     CHECK_LE((buffer_index + 1) * BLOCKSIZE, buffer.size());
 
     uint8_t digest[SHA_DIGEST_LENGTH];
@@ -616,17 +1196,17 @@ static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
 
 // If the calculated hash for the whole stash doesn't match the stash id, print the SHA-1
 // in hex for each block.
-static void PrintHashForCorruptedStashedBlocks(const std::string& id,
-                                               const std::vector<uint8_t>& buffer,
-                                               const RangeSet& src) {
+static void PrintHashForCorruptedStashedBlocks(const std::string& id, const uint8_t* data,
+                                               size_t size, const RangeSet& src) {
   LOG(INFO) << "printing hash in hex for stash_id: " << id;
-  CHECK_EQ(src.blocks() * BLOCKSIZE, buffer.size());
+  CHECK_LE(src.blocks() * BLOCKSIZE, size);
 
+  RangeSetIndex src_index(src);
   for (size_t i = 0; i < src.blocks(); i++) {
-    size_t block_num = src.GetBlockNumber(i);
+    size_t block_num = src_index.GetBlockNumber(i);
 
     uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + i * BLOCKSIZE, BLOCKSIZE, digest);
+    SHA1(data + i * BLOCKSIZE, BLOCKSIZE, digest);
     std::string hexdigest = print_sha1(digest);
     LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
   }
@@ -635,26 +1215,26 @@ static void PrintHashForCorruptedStashedBlocks(const std::string& id,
 // If the stash file doesn't exist, read the source blocks this stash contains and print the
 // SHA-1 for these blocks.
 static void PrintHashForMissingStashedBlocks(const std::string& id, int fd) {
-  if (stash_map.find(id) == stash_map.end()) {
+  if (context.stash_map.find(id) == context.stash_map.end()) {
     LOG(ERROR) << "No stash saved for id: " << id;
     return;
   }
 
   LOG(INFO) << "print hash in hex for source blocks in missing stash: " << id;
-  const RangeSet& src = stash_map[id];
-  std::vector<uint8_t> buffer(src.blocks() * BLOCKSIZE);
+  const RangeSet& src = context.stash_map[id];
+  BlockBuffer buffer(src.blocks() * BLOCKSIZE);
   if (ReadBlocks(src, &buffer, fd) == -1) {
     LOG(ERROR) << "failed to read source blocks for stash: " << id;
     return;
   }
-  PrintHashForCorruptedStashedBlocks(id, buffer, src);
+  PrintHashForCorruptedStashedBlocks(id, buffer.data(), buffer.size(), src);
 }
 
-static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>& buffer,
-                        const size_t blocks, bool printerror) {
+static int VerifyBlocks(const std::string& expected, const uint8_t* data, const size_t blocks,
+                        bool printerror) {
   uint8_t digest[SHA_DIGEST_LENGTH];
-  const uint8_t* data = buffer.data();
 
+  ScopedTrace trace(TraceEvent::kHash, blocks * BLOCKSIZE);
   SHA1(data, blocks * BLOCKSIZE, digest);
 
   std::string hexdigest = print_sha1(digest);
@@ -670,6 +1250,11 @@ static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>&
   return 0;
 }
 
+static int VerifyBlocks(const std::string& expected, const BlockBuffer& buffer,
+                        const size_t blocks, bool printerror) {
+  return VerifyBlocks(expected, buffer.data(), blocks, printerror);
+}
+
 static std::string GetStashFileName(const std::string& base, const std::string& id,
                                     const std::string& postfix) {
   if (base.empty()) {
@@ -722,6 +1307,8 @@ static void DeleteStash(const std::string& base) {
 
   LOG(INFO) << "deleting stash " << base;
 
+  context.stash_cache.Clear();
+  context.memory_stash.Clear();
   std::string dirname = GetStashFileName(base, "", "");
   EnumerateStash(dirname, DeleteFile);
 
@@ -732,116 +1319,251 @@ static void DeleteStash(const std::string& base) {
   }
 }
 
-static int LoadStash(const CommandParameters& params, const std::string& id, bool verify,
-                     std::vector<uint8_t>* buffer, bool printnoent) {
-  // In verify mode, if source range_set was saved for the given hash, check contents in the source
-  // blocks first. If the check fails, search for the stashed files on /cache as usual.
-  if (!params.canwrite) {
-    if (stash_map.find(id) != stash_map.end()) {
-      const RangeSet& src = stash_map[id];
-      allocate(src.blocks() * BLOCKSIZE, buffer);
+// Deletes the stash file of |id|, in whichever form it has been written.
+static void DeleteStashFile(const std::string& base, const std::string& id) {
+  std::string fn = GetStashFileName(base, id, "");
+  std::string compressed_fn = fn + kCompressedStashSuffix;
+  DeleteFile(access(compressed_fn.c_str(), F_OK) == 0 ? compressed_fn : fn);
+}
 
-      if (ReadBlocks(src, buffer, params.fd) == -1) {
-        LOG(ERROR) << "failed to read source blocks in stash map.";
-        return -1;
-      }
-      if (VerifyBlocks(id, *buffer, src.blocks(), true) != 0) {
-        LOG(ERROR) << "failed to verify loaded source blocks in stash map.";
-        if (!is_retry) {
-          PrintHashForCorruptedStashedBlocks(id, *buffer, src);
-        }
-        return -1;
-      }
-      return 0;
+// The blocks of a stash as loaded by MapStash().
+struct StashFile {
+  // The mapping of the stash file, if it's been mapped. Unset if its blocks have been read or
+  // decompressed into the caller's buffer instead.
+  StashCache::Mapping mapping;
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+};
+
+// Reads the compressed stash file |fn| of |size| bytes, and decompresses it into |buffer|.
+static bool LoadCompressedStash(const std::string& fn, const std::string& id, size_t size,
+                                BlockBuffer* buffer, StashFile* stash) {
+  LOG(INFO) << " loading " << fn;
+
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY)));
+  if (fd == -1) {
+    context.failure_type = errno == EIO ? kEioFailure : kFileOpenFailure;
+    PLOG(ERROR) << "open \"" << fn << "\" failed";
+    return false;
+  }
+
+  std::vector<uint8_t> frame(size);
+  {
+    std::vector<Extent> extents = { { 0, size } };
+    ScopedIoTrace io_trace(IoTraceOp::kRead, IoTracer::Get().FileId("stash/" + id), extents);
+    if (!android::base::ReadFully(fd, frame.data(), size)) {
+      context.failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+      PLOG(ERROR) << "Failed to read " << size << " bytes of " << fn;
+      return false;
     }
   }
 
+  if (!DecompressStash(frame.data(), frame.size(), buffer)) {
+    LOG(ERROR) << "corrupt compressed stash " << fn;
+    return false;
+  }
+  stash->data = buffer->data();
+  stash->size = buffer->size();
+  return true;
+}
+
+// Maps the stash file of |id| read-only, or returns the mapping from stash_cache if it's been
+// loaded recently. Without params.map_stashes, or for a compressed stash file, the stash gets read
+// into |buffer| instead, and isn't cached. Returns false on errors.
+static bool MapStash(const CommandParameters& params, const std::string& id, bool printnoent,
+                     BlockBuffer* buffer, StashFile* stash) {
+  if (StashCache::Mapping mapping = context.stash_cache.Get(id); mapping != nullptr) {
+    stash->data = reinterpret_cast<const uint8_t*>(mapping->data());
+    stash->size = mapping->size();
+    stash->mapping = std::move(mapping);
+    return true;
+  }
+
   std::string fn = GetStashFileName(params.stashbase, id, "");
 
   struct stat sb;
   if (stat(fn.c_str(), &sb) == -1) {
+    if (errno == ENOENT) {
+      std::string compressed_fn = fn + kCompressedStashSuffix;
+      if (stat(compressed_fn.c_str(), &sb) == 0) {
+        return LoadCompressedStash(compressed_fn, id, sb.st_size, buffer, stash);
+      }
+      errno = ENOENT;
+    }
     if (errno != ENOENT || printnoent) {
       PLOG(ERROR) << "stat \"" << fn << "\" failed";
       PrintHashForMissingStashedBlocks(id, params.fd);
     }
-    return -1;
+    return false;
   }
 
   LOG(INFO) << " loading " << fn;
 
   if ((sb.st_size % BLOCKSIZE) != 0) {
     LOG(ERROR) << fn << " size " << sb.st_size << " not multiple of block size " << BLOCKSIZE;
-    return -1;
+    return false;
   }
 
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY)));
   if (fd == -1) {
-    failure_type = errno == EIO ? kEioFailure : kFileOpenFailure;
+    context.failure_type = errno == EIO ? kEioFailure : kFileOpenFailure;
     PLOG(ERROR) << "open \"" << fn << "\" failed";
-    return -1;
+    return false;
+  }
+
+  std::vector<Extent> extents = { { 0, static_cast<size_t>(sb.st_size) } };
+  if (!params.map_stashes) {
+    // An I/O error fails the read with EIO, rather than raising SIGBUS when the mapping is touched.
+    allocate(sb.st_size, buffer);
+    ScopedIoTrace io_trace(IoTraceOp::kRead, IoTracer::Get().FileId("stash/" + id), extents);
+    if (!android::base::ReadFully(fd, buffer->data(), sb.st_size)) {
+      context.failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+      PLOG(ERROR) << "Failed to read " << sb.st_size << " bytes of " << fn;
+      return false;
+    }
+    stash->data = buffer->data();
+    stash->size = sb.st_size;
+    return true;
+  }
+
+  // The pages get read as they're first touched, so the recorded duration is little more than the
+  // mmap.
+  ScopedIoTrace io_trace(IoTraceOp::kRead, IoTracer::Get().FileId("stash/" + id), extents);
+
+  // The mapping stays valid after closing the fd.
+  StashCache::Mapping mapping = android::base::MappedFile::FromFd(fd, 0, sb.st_size, PROT_READ);
+  if (mapping == nullptr) {
+    context.failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+    PLOG(ERROR) << "Failed to map " << sb.st_size << " bytes of " << fn;
+    return false;
+  }
+  context.stash_cache.Put(id, mapping);
+  stash->data = reinterpret_cast<const uint8_t*>(mapping->data());
+  stash->size = mapping->size();
+  stash->mapping = std::move(mapping);
+  return true;
+}
+
+static int LoadStash(const CommandParameters& params, const std::string& id, bool verify,
+                     BlockBuffer* buffer, bool printnoent) {
+  ScopedTrace trace(TraceEvent::kStashLoad, 0);
+  CommandStats::ScopedSubPhase sub_phase(CommandSubPhase::kRead);
+  // In verify mode, if source range_set was saved for the given hash, check contents in the source
+  // blocks first. If the check fails, search for the stashed files on /cache as usual.
+  if (!params.canwrite) {
+    if (context.stash_map.find(id) != context.stash_map.end()) {
+      const RangeSet& src = context.stash_map[id];
+      allocate(src.blocks() * BLOCKSIZE, buffer);
+
+      if (ReadBlocks(src, buffer, params.fd) == -1) {
+        LOG(ERROR) << "failed to read source blocks in stash map.";
+        return -1;
+      }
+      if (VerifyBlocks(id, *buffer, src.blocks(), true) != 0) {
+        LOG(ERROR) << "failed to verify loaded source blocks in stash map.";
+        if (!context.is_retry) {
+          PrintHashForCorruptedStashedBlocks(id, buffer->data(), buffer->size(), src);
+        }
+        return -1;
+      }
+      return 0;
+    }
   }
 
-  allocate(sb.st_size, buffer);
+  if (const BlockBuffer* stash = context.memory_stash.Find(id); stash != nullptr) {
+    // Stashes only get into memory after their contents have been verified.
+    allocate(stash->size(), buffer);
+    memcpy(buffer->data(), stash->data(), stash->size());
+    return 0;
+  }
 
-  if (!android::base::ReadFully(fd, buffer->data(), sb.st_size)) {
-    failure_type = errno == EIO ? kEioFailure : kFreadFailure;
-    PLOG(ERROR) << "Failed to read " << sb.st_size << " bytes of data";
+  StashFile stash;
+  if (!MapStash(params, id, printnoent, buffer, &stash)) {
     return -1;
   }
 
-  size_t blocks = sb.st_size / BLOCKSIZE;
-  if (verify && VerifyBlocks(id, *buffer, blocks, true) != 0) {
-    LOG(ERROR) << "unexpected contents in " << fn;
-    if (stash_map.find(id) == stash_map.end()) {
+  const uint8_t* data = stash.data;
+  size_t blocks = stash.size / BLOCKSIZE;
+  if (verify && VerifyBlocks(id, data, blocks, true) != 0) {
+    LOG(ERROR) << "unexpected contents in stash " << id;
+    if (context.stash_map.find(id) == context.stash_map.end()) {
       LOG(ERROR) << "failed to find source blocks number for stash " << id
                  << " when executing command: " << params.cmdname;
     } else {
-      const RangeSet& src = stash_map[id];
-      PrintHashForCorruptedStashedBlocks(id, *buffer, src);
+      const RangeSet& src = context.stash_map[id];
+      PrintHashForCorruptedStashedBlocks(id, data, stash.size, src);
     }
-    DeleteFile(fn);
+    context.stash_cache.Erase(id);
+    DeleteStashFile(params.stashbase, id);
     return -1;
   }
 
+  // A stash that has been read or decompressed is in |buffer| already.
+  if (stash.mapping != nullptr) {
+    allocate(stash.size, buffer);
+    memcpy(buffer->data(), data, stash.size);
+  }
   return 0;
 }
 
+// Writes the stash file of |id| durably, compressed if enabled and worthwhile. When writing several
+// stashes in a row, |syncdir| can be false to leave the fsync of the stash directory to the caller.
 static int WriteStash(const std::string& base, const std::string& id, int blocks,
-                      const std::vector<uint8_t>& buffer, bool checkspace, bool* exists) {
+                      const BlockBuffer& buffer, bool checkspace, bool* exists, bool syncdir) {
+  ScopedTrace trace(TraceEvent::kStashSave, blocks);
+  CommandStats::ScopedSubPhase sub_phase(CommandSubPhase::kWrite);
   if (base.empty()) {
     return -1;
   }
 
-  if (checkspace && !CheckAndFreeSpaceOnCache(blocks * BLOCKSIZE)) {
-    LOG(ERROR) << "not enough space to write stash";
-    return -1;
-  }
-
-  std::string fn = GetStashFileName(base, id, ".partial");
-  std::string cn = GetStashFileName(base, id, "");
+  std::string raw_cn = GetStashFileName(base, id, "");
+  std::string compressed_cn = raw_cn + kCompressedStashSuffix;
 
   if (exists) {
     struct stat sb;
-    int res = stat(cn.c_str(), &sb);
-
-    if (res == 0) {
-      // The file already exists and since the name is the hash of the contents,
-      // it's safe to assume the contents are identical (accidental hash collisions
-      // are unlikely)
-      LOG(INFO) << " skipping " << blocks << " existing blocks in " << cn;
-      *exists = true;
-      return 0;
+    for (const std::string& cn : { raw_cn, compressed_cn }) {
+      if (stat(cn.c_str(), &sb) == 0) {
+        // The file already exists and since the name is the hash of the contents,
+        // it's safe to assume the contents are identical (accidental hash collisions
+        // are unlikely)
+        LOG(INFO) << " skipping " << blocks << " existing blocks in " << cn;
+        *exists = true;
+        return 0;
+      }
     }
 
     *exists = false;
   }
 
+  // The stash only takes the space of the compressed blocks, and a smaller write. Stashes that
+  // don't compress by at least a block are stored raw, which saves decompressing them.
+  size_t size = blocks * BLOCKSIZE;
+  std::vector<uint8_t> frame;
+  bool compressed = context.compress_stash && CompressStash(buffer.data(), size, &frame);
+  const uint8_t* data = compressed ? frame.data() : buffer.data();
+  if (compressed) {
+    size = frame.size();
+  }
+  const std::string& cn = compressed ? compressed_cn : raw_cn;
+  const std::string& other_cn = compressed ? raw_cn : compressed_cn;
+
+  if (checkspace && !CheckAndFreeSpaceOnCache(size)) {
+    LOG(ERROR) << "not enough space to write stash";
+    return -1;
+  }
+  if (!checkspace && context.check_stash_space && !HasUnreservedStashSpace(size)) {
+    LOG(ERROR) << "not enough space to write stash (" << size << " bytes)";
+    return -1;
+  }
+
+  std::string fn = cn + ".partial";
+
   LOG(INFO) << " writing " << blocks << " blocks to " << cn;
 
   android::base::unique_fd fd(
       TEMP_FAILURE_RETRY(open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE)));
   if (fd == -1) {
-    failure_type = errno == EIO ? kEioFailure : kFileOpenFailure;
+    context.failure_type = errno == EIO ? kEioFailure : kFileOpenFailure;
     PLOG(ERROR) << "failed to create \"" << fn << "\"";
     return -1;
   }
@@ -851,35 +1573,162 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
     return -1;
   }
 
-  if (!android::base::WriteFully(fd, buffer.data(), blocks * BLOCKSIZE)) {
-    failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-    PLOG(ERROR) << "Failed to write " << blocks * BLOCKSIZE << " bytes of data";
-    return -1;
+  uint32_t trace_file = IoTracer::Get().FileId("stash/" + id);
+  {
+    std::vector<Extent> extents = { { 0, size } };
+    ScopedIoTrace io_trace(IoTraceOp::kWrite, trace_file, extents);
+    if (!android::base::WriteFully(fd, data, size)) {
+      context.failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+      PLOG(ERROR) << "Failed to write " << size << " bytes of data";
+      return -1;
+    }
   }
 
-  if (fsync(fd) == -1) {
-    failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+  if (Fsync(fd, trace_file) == -1) {
+    context.failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
     PLOG(ERROR) << "fsync \"" << fn << "\" failed";
     return -1;
   }
 
+  // Any cached mapping of the previous file would keep the old contents alive.
+  context.stash_cache.Erase(id);
   if (rename(fn.c_str(), cn.c_str()) == -1) {
     PLOG(ERROR) << "rename(\"" << fn << "\", \"" << cn << "\") failed";
     return -1;
   }
+  // A previous file of the other form would shadow (or be shadowed by) the new one.
+  if (unlink(other_cn.c_str()) == -1 && errno != ENOENT) {
+    PLOG(ERROR) << "unlink \"" << other_cn << "\" failed";
+    return -1;
+  }
 
   std::string dname = GetStashFileName(base, "", "");
-  if (!FsyncDir(dname)) {
+  if (syncdir && !FsyncDir(dname)) {
     return -1;
   }
 
   return 0;
 }
 
+// Returns whether a command only works on the stash, without writing to the partition.
+static bool IsStashOnlyCommand(Command::Type type) {
+  return type == Command::Type::STASH || type == Command::Type::FREE;
+}
+
+// Returns the access pattern of a command of |type| for tuning the block queues, if it's got one:
+// the verification reads the sources, and an update writes long runs or patches scattered sources.
+static std::optional<BlockAccess> CommandBlockAccess(Command::Type type, bool canwrite) {
+  if (!canwrite) {
+    return BlockAccess::kRandom;
+  }
+  switch (type) {
+    case Command::Type::COMPUTE_FEC:
+    case Command::Type::COMPUTE_HASH_TREE:
+    case Command::Type::ERASE:
+    case Command::Type::NEW:
+    case Command::Type::ZERO:
+      return BlockAccess::kSequential;
+    case Command::Type::BSDIFF:
+    case Command::Type::IMGDIFF:
+    case Command::Type::MOVE:
+    case Command::Type::STASH:
+      return BlockAccess::kRandom;
+    default:
+      return std::nullopt;
+  }
+}
+
+// Writes the oldest in-memory stashes to the stash files until another |size| bytes fit in
+// memory_stash, followed by a single fsync of the stash directory.
+static bool SpillStashes(const std::string& base, size_t size) {
+  bool spilled = false;
+  bool result = context.memory_stash.Spill(size, [&base, &spilled](const std::string& id,
+                                                                   const BlockBuffer& data) {
+    LOG(INFO) << "spilling stash " << id;
+    spilled = true;
+    return WriteStash(base, id, data.size() / BLOCKSIZE, data, false, nullptr, false) == 0;
+  });
+  if (spilled && !FsyncDir(GetStashFileName(base, "", ""))) {
+    return false;
+  }
+  return result;
+}
+
+// Makes all the in-memory stashes durable.
+static bool SpillAllStashes(const std::string& base) {
+  // Making room for the whole budget leaves nothing in memory.
+  return context.memory_stash.empty() || SpillStashes(base, context.memory_stash.capacity());
+}
+
+// Returns the blocks that |command| writes to the partition, or nullptr if none.
+static const RangeSet* WrittenRanges(const Command& command) {
+  switch (command.type()) {
+    case Command::Type::STASH:
+    case Command::Type::FREE:
+      return nullptr;
+    case Command::Type::COMPUTE_HASH_TREE:
+      return &command.hash_tree_info().hash_tree_ranges();
+    case Command::Type::COMPUTE_FEC:
+      return &command.fec_info().fec_ranges();
+    default:
+      return &command.target().ranges();
+  }
+}
+
+// Makes durable the in-memory stashes whose source blocks command |cmdindex| may overwrite. Falls
+// back to SpillAllStashes() if the command hasn't been parsed ahead of time.
+static bool SpillOverwrittenStashes(const CommandParameters& params, size_t cmdindex) {
+  if (context.memory_stash.empty()) {
+    return true;
+  }
+  const Command* command = cmdindex < params.commands.size() ? params.commands[cmdindex] : nullptr;
+  if (command == nullptr) {
+    return SpillAllStashes(params.stashbase);
+  }
+  const RangeSet* target = WrittenRanges(*command);
+  if (target == nullptr) {
+    return true;
+  }
+
+  bool spilled = false;
+  bool result = context.memory_stash.SpillIf(
+      [target](const std::string& id) {
+        auto it = context.stash_map.find(id);
+        return it == context.stash_map.end() || it->second.Overlaps(*target);
+      },
+      [&params, &spilled](const std::string& id, const BlockBuffer& data) {
+        LOG(INFO) << "spilling stash " << id;
+        spilled = true;
+        return WriteStash(params.stashbase, id, data.size() / BLOCKSIZE, data, false, nullptr,
+                          false) == 0;
+      });
+  if (spilled && !FsyncDir(GetStashFileName(params.stashbase, "", ""))) {
+    return false;
+  }
+  return result;
+}
+
+// Reserves |bytes| on /cache for the stash. With compression on, the stash files likely take less
+// than that, so the update goes ahead even if there isn't as much space; each stash file then
+// checks for the space it takes as it gets written.
+static bool ReserveStashSpace(StashSpaceReservation* reservation, size_t bytes) {
+  if (reservation->Reserve(bytes)) {
+    return true;
+  }
+  if (!context.compress_stash) {
+    return false;
+  }
+  LOG(WARNING) << "not enough space to reserve " << bytes << " bytes for the stash, checking the "
+               << "space for each compressed stash file instead";
+  context.check_stash_space = true;
+  return true;
+}
+
 // Creates a directory for storing stash files and checks if the /cache partition
 // hash enough space for the expected amount of blocks we need to store. Returns
 // >0 if we created the directory, zero if it existed already, and <0 of failure.
-static int CreateStash(State* state, size_t maxblocks, const std::string& base) {
+static int CreateStash(State* state, size_t maxblocks, const std::string& base,
+                       StashSpaceReservation* reservation) {
   std::string dirname = GetStashFileName(base, "", "");
   struct stat sb;
   int res = stat(dirname.c_str(), &sb);
@@ -906,7 +1755,7 @@ static int CreateStash(State* state, size_t maxblocks, const std::string& base)
       return -1;
     }
 
-    if (!CheckAndFreeSpaceOnCache(max_stash_size)) {
+    if (!ReserveStashSpace(reservation, max_stash_size)) {
       ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%zu needed)",
                  max_stash_size);
       return -1;
@@ -938,7 +1787,7 @@ static int CreateStash(State* state, size_t maxblocks, const std::string& base)
 
   if (max_stash_size > existing) {
     size_t needed = max_stash_size - existing;
-    if (!CheckAndFreeSpaceOnCache(needed)) {
+    if (!ReserveStashSpace(reservation, needed)) {
       ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%zu more needed)",
                  needed);
       return -1;
@@ -953,16 +1802,25 @@ static int FreeStash(const std::string& base, const std::string& id) {
     return -1;
   }
 
-  DeleteFile(GetStashFileName(base, id, ""));
+  context.stash_cache.Erase(id);
+  DeleteStashFile(base, id);
 
   return 0;
 }
 
+// Frees the stash |id| once the current command is covered by a checkpoint. Until then, the command
+// may have to be redone on resume, and need the stash again.
+static int FreeStashAfterCheckpoint(CommandParameters& params, const std::string& id) {
+  if (params.commands.empty()) {
+    return FreeStash(params.stashbase, id);
+  }
+  params.pending_frees.push_back(id);
+  return 0;
+}
+
 // Source contains packed data, which we want to move to the locations given in locs in the dest
-// buffer. source and dest may be the same buffer.
-static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
-                      const std::vector<uint8_t>& source) {
-  const uint8_t* from = source.data();
+// buffer. source may point into dest.
+static void MoveRange(BlockBuffer& dest, const RangeSet& locs, const uint8_t* from) {
   uint8_t* to = dest.data();
   size_t start = locs.blocks();
   // Must do the movement backward.
@@ -973,6 +1831,41 @@ static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
   }
 }
 
+// Maps the source blocks |src| of a patch from the partition into params.mapped_source, instead of
+// copying them into params.buffer, so that the patch reads them through the page cache, which the
+// kernel can reclaim, and the buffer doesn't need to hold the largest source. Only with
+// ro.updater.map_patch_sources=true, since an I/O error in the mapping raises SIGBUS. Returns true
+// if the blocks have been mapped and match |srchash|; otherwise the caller should load them as
+// usual, e.g. to report what's wrong with them. The target mustn't overlap |src|, as writing it
+// would change the source under the patch.
+static bool MapSourceBlocks(CommandParameters& params, const RangeSet& src,
+                            const std::string& srchash) {
+  if (!params.map_sources || src.blocks() < TransferPlan::kMinMappedSourceBlocks) {
+    return false;
+  }
+  // The pipeline has read them ahead into memory already.
+  if (params.pipeline != nullptr && params.pipeline->Plans(params.cmdindex)) {
+    return false;
+  }
+  auto mapping = std::make_unique<MemMapping>();
+  if (!mapping->MapBlockRanges(params.fd, src, BLOCKSIZE)) {
+    LOG(WARNING) << "Failed to map the source blocks " << src.ToString();
+    return false;
+  }
+  // The hashing reads them all right away.
+  mapping->Advise(0, mapping->length, MADV_WILLNEED);
+  if (VerifyBlocks(srchash, mapping->addr, src.blocks(), false) != 0) {
+    return false;
+  }
+  params.mapped_source = std::move(mapping);
+  return true;
+}
+
+// Returns the source blocks loaded for the current command.
+static const uint8_t* SourceData(const CommandParameters& params) {
+  return params.mapped_source ? params.mapped_source->addr : params.buffer.data();
+}
+
 /**
  * We expect to parse the remainder of the parameter tokens as one of:
  *
@@ -988,66 +1881,115 @@ static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
  * On return, params.buffer is filled with the loaded source data (rearranged and combined with
  * stashed data as necessary). buffer may be reallocated if needed to accommodate the source data.
  * tgt is the target RangeSet for detecting overlaps. Any stashes required are loaded using
- * LoadStash.
+ * LoadStash. If map_source is true, a source from the source image only may get mapped into
+ * params.mapped_source instead (see MapSourceBlocks()).
  */
-static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size_t* src_blocks,
-                            bool* overlap) {
+static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt,
+                            const std::string& srchash, size_t* src_blocks, bool* overlap,
+                            bool* verified, bool map_source) {
   CHECK(src_blocks != nullptr);
   CHECK(overlap != nullptr);
+  CHECK(verified != nullptr);
 
   // <src_block_count>
-  const std::string& token = params.tokens[params.cpos++];
+  const std::string token(params.tokens[params.cpos++]);
   if (!android::base::ParseUint(token, src_blocks)) {
     LOG(ERROR) << "invalid src_block_count \"" << token << "\"";
     return -1;
   }
 
-  allocate(*src_blocks * BLOCKSIZE, &params.buffer);
+  params.mapped_source.reset();
 
   // "-" or <src_range> [<src_loc>]
   if (params.tokens[params.cpos] == "-") {
     // no source ranges, only stashes
     params.cpos++;
+    allocate(*src_blocks * BLOCKSIZE, &params.buffer);
   } else {
     RangeSet src = RangeSet::Parse(params.tokens[params.cpos++]);
     CHECK(static_cast<bool>(src));
     *overlap = src.Overlaps(tgt);
 
-    if (ReadBlocks(src, &params.buffer, params.fd) == -1) {
-      return -1;
+    if (params.cpos >= params.tokens.size() && map_source && !*overlap &&
+        src.blocks() == *src_blocks && MapSourceBlocks(params, src, srchash)) {
+      *verified = true;
+      return 0;
     }
+    allocate(*src_blocks * BLOCKSIZE, &params.buffer);
 
     if (params.cpos >= params.tokens.size()) {
-      // no stashes, only source range
+      // no stashes, only source range, which may have been read and verified already
+      if (src.blocks() != *src_blocks) {
+        return ReadSourceBlocks(params, src);
+      }
+      if (context.source_cache.Get(srchash, src, params.buffer.data())) {
+        *verified = true;
+        return 0;
+      }
+      if (ReadSourceBlocks(params, src) == -1) {
+        return -1;
+      }
+      // The caller reports the unexpected contents, if any.
+      if (VerifyBlocks(srchash, params.buffer, *src_blocks, false) == 0) {
+        context.source_cache.Put(srchash, src, params.buffer.data(), *src_blocks * BLOCKSIZE);
+        *verified = true;
+      }
       return 0;
     }
 
+    if (ReadSourceBlocks(params, src) == -1) {
+      return -1;
+    }
+
     RangeSet locs = RangeSet::Parse(params.tokens[params.cpos++]);
     CHECK(static_cast<bool>(locs));
-    MoveRange(params.buffer, locs, params.buffer);
+    MoveRange(params.buffer, locs, params.buffer.data());
   }
 
   // <[stash_id:stash_range]>
+  std::vector<std::string_view> pieces;
   while (params.cpos < params.tokens.size()) {
     // Each word is a an index into the stash table, a colon, and then a RangeSet describing where
     // in the source block that stashed data should go.
-    std::vector<std::string> tokens = android::base::Split(params.tokens[params.cpos++], ":");
-    if (tokens.size() != 2) {
+    SplitView(params.tokens[params.cpos++], ':', &pieces);
+    if (pieces.size() != 2) {
       LOG(ERROR) << "invalid parameter";
       return -1;
     }
+    const std::string id(pieces[0]);
 
-    std::vector<uint8_t> stash;
-    if (LoadStash(params, tokens[0], false, &stash, true) == -1) {
-      // These source blocks will fail verification if used later, but we
-      // will let the caller decide if this is a fatal failure
-      LOG(ERROR) << "failed to load stash " << tokens[0];
+    RangeSet locs = RangeSet::Parse(pieces[1]);
+    CHECK(static_cast<bool>(locs));
+
+    // In verify mode, LoadStash() may need to read the stashed blocks from the source instead.
+    // Otherwise copy them straight out of the in-memory stash or the mapped stash file (or the one
+    // read into stashbuffer).
+    if (!params.canwrite && context.stash_map.find(id) != context.stash_map.end()) {
+      BlockBuffer& stash = params.stashbuffer;
+      if (LoadStash(params, id, false, &stash, true) == -1) {
+        // These source blocks will fail verification if used later, but we
+        // will let the caller decide if this is a fatal failure
+        LOG(ERROR) << "failed to load stash " << id;
+        continue;
+      }
+      MoveRange(params.buffer, locs, stash.data());
       continue;
     }
 
-    RangeSet locs = RangeSet::Parse(tokens[1]);
-    CHECK(static_cast<bool>(locs));
-    MoveRange(params.buffer, locs, stash);
+    StashFile stash;
+    if (const BlockBuffer* memory = context.memory_stash.Find(id); memory != nullptr) {
+      stash.data = memory->data();
+      stash.size = memory->size();
+    } else if (!MapStash(params, id, true, &params.stashbuffer, &stash)) {
+      LOG(ERROR) << "failed to load stash " << id;
+      continue;
+    }
+    if (stash.size < locs.blocks() * BLOCKSIZE) {
+      LOG(ERROR) << "stash " << id << " has " << stash.size / BLOCKSIZE << " blocks, expected "
+                 << locs.blocks();
+      continue;
+    }
+    MoveRange(params.buffer, locs, stash.data);
   }
 
   return 0;
@@ -1068,8 +2010,9 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
  *        (loads data from both source image and stashes)
  *
  * 'onehash' tells whether to expect separate source and targe block hashes, or if they are both the
- * same and only one hash should be expected. params.isunresumable will be set to true if block
- * verification fails in a way that the update cannot be resumed anymore.
+ * same and only one hash should be expected. 'map_source' allows a source from the source image
+ * only to be mapped instead of loaded (see SourceData()). params.isunresumable will be set to true
+ * if block verification fails in a way that the update cannot be resumed anymore.
  *
  * If the function is unable to load the necessary blocks or their contents don't match the hashes,
  * the return value is -1 and the command should be aborted.
@@ -1080,7 +2023,7 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
  * If the return value is 0, source blocks have expected content and the command can be performed.
  */
 static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t* src_blocks,
-                              bool onehash) {
+                              bool onehash, bool map_source) {
   CHECK(src_blocks != nullptr);
 
   if (params.cpos >= params.tokens.size()) {
@@ -1088,7 +2031,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
     return -1;
   }
 
-  std::string srchash = params.tokens[params.cpos++];
+  std::string srchash(params.tokens[params.cpos++]);
   std::string tgthash;
 
   if (onehash) {
@@ -1098,7 +2041,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
       LOG(ERROR) << "missing target hash";
       return -1;
     }
-    tgthash = params.tokens[params.cpos++];
+    tgthash = std::string(params.tokens[params.cpos++]);
   }
 
   // At least it needs to provide three parameters: <tgt_range>, <src_block_count> and
@@ -1112,23 +2055,58 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
   *tgt = RangeSet::Parse(params.tokens[params.cpos++]);
   CHECK(static_cast<bool>(*tgt));
 
-  std::vector<uint8_t> tgtbuffer(tgt->blocks() * BLOCKSIZE);
-  if (ReadBlocks(*tgt, &tgtbuffer, params.fd) == -1) {
-    return -1;
+  // The checks that have been made ahead of time don't need to be made again, except for the
+  // sources that didn't match, which get loaded below to report what's wrong with them.
+  const AheadChecks* ahead = FindAheadChecks(params);
+  if (ahead != nullptr && ahead->target == AheadCheck::kMatch) {
+    return 1;
+  }
+  bool target_checked = ahead != nullptr && ahead->target == AheadCheck::kMismatch;
+  if (target_checked && ahead->source == AheadCheck::kMatch) {
+    const std::string token(params.tokens[params.cpos]);
+    return android::base::ParseUint(token, src_blocks) ? 0 : -1;
   }
 
-  // Return now if target blocks already have expected content.
-  if (VerifyBlocks(tgthash, tgtbuffer, tgt->blocks(), false) == 0) {
-    return 1;
+  if (!target_checked) {
+    allocate(tgt->blocks() * BLOCKSIZE, &params.tgtbuffer);
+    if (ReadBlocks(*tgt, &params.tgtbuffer, params.fd) == -1) {
+      return -1;
+    }
   }
 
-  // Load source blocks.
+  // Return now if target blocks already have expected content. A large target gets hashed on
+  // another thread while the source blocks are being loaded (and hashed), as that's wasted only if
+  // the command has been done already. Not if the source needs stashes, which may be gone by then.
   bool overlap = false;
-  if (LoadSourceBlocks(params, *tgt, src_blocks, &overlap) == -1) {
-    return -1;
+  bool verified = false;
+  bool source_only =
+      params.cpos + 2 == params.tokens.size() && params.tokens[params.cpos + 1] != "-";
+  if (source_only && !target_checked && tgt->blocks() >= kMinConcurrentHashBlocks) {
+    std::future<bool> target_done = std::async(std::launch::async, [&params, &tgthash, tgt]() {
+      return VerifyBlocks(tgthash, params.tgtbuffer, tgt->blocks(), false) == 0;
+    });
+    int loaded =
+        LoadSourceBlocks(params, *tgt, srchash, src_blocks, &overlap, &verified, map_source);
+    if (target_done.get()) {
+      return 1;
+    }
+    if (loaded == -1) {
+      return -1;
+    }
+  } else {
+    if (!target_checked && VerifyBlocks(tgthash, params.tgtbuffer, tgt->blocks(), false) == 0) {
+      return 1;
+    }
+
+    // Load source blocks.
+    int loaded =
+        LoadSourceBlocks(params, *tgt, srchash, src_blocks, &overlap, &verified, map_source);
+    if (loaded == -1) {
+      return -1;
+    }
   }
 
-  if (VerifyBlocks(srchash, params.buffer, *src_blocks, true) == 0) {
+  if (verified || VerifyBlocks(srchash, params.buffer, *src_blocks, true) == 0) {
     // If source and target blocks overlap, stash the source blocks so we can resume from possible
     // write errors. In verify mode, we can skip stashing because the source blocks won't be
     // overwritten.
@@ -1136,8 +2114,8 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
       LOG(INFO) << "stashing " << *src_blocks << " overlapping blocks to " << srchash;
 
       bool stash_exists = false;
-      if (WriteStash(params.stashbase, srchash, *src_blocks, params.buffer, true,
-                     &stash_exists) != 0) {
+      if (WriteStash(params.stashbase, srchash, *src_blocks, params.buffer, true, &stash_exists,
+                     true) != 0) {
         LOG(ERROR) << "failed to stash overlapping source blocks";
         return -1;
       }
@@ -1169,10 +2147,155 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet* tgt, size_t*
   return -1;
 }
 
+// Returned by StreamMove() for the moves that it doesn't carry out.
+static constexpr int kMoveNotStreamed = 2;
+
+// Carries out a large move of source blocks only (no stashes) that don't overlap the target, by
+// streaming the blocks in chunks: the next chunk gets read on another thread while the current one
+// is hashed and written, instead of reading, hashing and writing all of the blocks in turn. The
+// chunks get written before the source hash is known, which leaves the source blocks intact, and is
+// only done once the update has written to the partition already: a mismatch fails the update just
+// like before, rather than spoiling a partition that a matching package could still update. Returns
+// what LoadSrcTgtVersion3() does, with the blocks written already if it's 0, or kMoveNotStreamed.
+static int StreamMove(CommandParameters& params, RangeSet* tgt, size_t* blocks) {
+  // <hash> <tgt_range> <src_block_count> <src_range>
+  size_t pos = params.cpos;
+  if (!params.canwrite || !params.foundwrites || pos + 4 != params.tokens.size() ||
+      params.tokens[pos + 3] == "-") {
+    return kMoveNotStreamed;
+  }
+  // Anything malformed, or read ahead by the pipeline, is left to LoadSrcTgtVersion3().
+  std::string hash(params.tokens[pos]);
+  RangeSet target = RangeSet::Parse(params.tokens[pos + 1]);
+  RangeSet src = RangeSet::Parse(params.tokens[pos + 3]);
+  size_t src_blocks;
+  if (!target || !src ||
+      !android::base::ParseUint(std::string(params.tokens[pos + 2]), &src_blocks) ||
+      src_blocks != src.blocks() || src_blocks != target.blocks() ||
+      src_blocks < kMinStreamedMoveBlocks || src.Overlaps(target) ||
+      (params.pipeline != nullptr && params.pipeline->Plans(params.cmdindex))) {
+    return kMoveNotStreamed;
+  }
+  params.cpos += 4;
+  *tgt = target;
+  *blocks = src_blocks;
+
+  // The target blocks may have the expected contents already, e.g. when resuming. They get hashed
+  // while the first chunk of the source is being read.
+  allocate(src_blocks * BLOCKSIZE, &params.tgtbuffer);
+  if (ReadBlocks(target, &params.tgtbuffer, params.fd) == -1) {
+    return -1;
+  }
+  std::future<bool> target_done = std::async(std::launch::async, [&params, &hash, src_blocks]() {
+    return VerifyBlocks(hash, params.tgtbuffer, src_blocks, false) == 0;
+  });
+
+  std::vector<RangeSet> src_chunks;
+  std::vector<RangeSet> tgt_chunks;
+  for (size_t start = 0; start < src_blocks; start += kStreamedMoveChunkBlocks) {
+    size_t count = std::min(kStreamedMoveChunkBlocks, src_blocks - start);
+    src_chunks.push_back(*src.GetSubRanges(start, count));
+    tgt_chunks.push_back(*target.GetSubRanges(start, count));
+  }
+
+  // The chunks get read back to back into params.buffer, so that it holds the whole source in the
+  // end, as if loaded by LoadSourceBlocks(). The reader has a backend of its own, as the one of
+  // this thread isn't thread-safe.
+  allocate(src_blocks * BLOCKSIZE, &params.buffer);
+  uint8_t* buffer = params.buffer.data();
+  std::unique_ptr<BlockIo> reader_io = BlockIo::Create(GetBlockIo().type());
+  uint32_t trace_device = context.io_trace_device;
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t chunks_read = 0;
+  int read_errno = 0;
+  bool stop = false;
+  std::thread reader([&, fd = params.fd.get()]() {
+    for (size_t i = 0; i < src_chunks.size(); i++) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stop) return;
+      }
+      ScopedTrace trace(TraceEvent::kRead, src_chunks[i].blocks() * BLOCKSIZE);
+      std::vector<Extent> extents = GetExtents(src_chunks[i]);
+      bool success;
+      {
+        ScopedIoTrace io_trace(IoTraceOp::kRead, trace_device, extents);
+        success = reader_io->Read(fd, extents, buffer + i * kStreamedMoveChunkBlocks * BLOCKSIZE);
+      }
+      int error = errno;
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!success) {
+        read_errno = error != 0 ? error : EIO;
+        cv.notify_all();
+        return;
+      }
+      chunks_read++;
+      cv.notify_all();
+    }
+  });
+
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  int result = 0;
+  for (size_t i = 0; i < src_chunks.size(); i++) {
+    {
+      CommandStats::ScopedSubPhase sub_phase(CommandSubPhase::kRead);
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return chunks_read > i || read_errno != 0; });
+      if (chunks_read <= i) {
+        context.failure_type = read_errno == EIO ? kEioFailure : kFreadFailure;
+        errno = read_errno;
+        PLOG(ERROR) << "Failed to read " << src_chunks[i].blocks() * BLOCKSIZE << " bytes of data";
+        result = -1;
+        break;
+      }
+    }
+
+    const uint8_t* chunk = buffer + i * kStreamedMoveChunkBlocks * BLOCKSIZE;
+    size_t size = src_chunks[i].blocks() * BLOCKSIZE;
+    {
+      ScopedTrace trace(TraceEvent::kHash, size);
+      SHA1_Update(&ctx, chunk, size);
+    }
+    if (i == 0 && target_done.get()) {
+      result = 1;
+      break;
+    }
+    if (WriteBlocks(tgt_chunks[i], chunk, WriteFd(params)) == -1) {
+      result = -1;
+      break;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  reader.join();
+  if (result != 0) {
+    return result;
+  }
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, &ctx);
+  if (std::string hexdigest = print_sha1(digest); hexdigest != hash) {
+    LOG(ERROR) << "failed to verify blocks (expected " << hash << ", read " << hexdigest << ")";
+    LOG(ERROR) << "partition has unexpected contents";
+    PrintHashForCorruptedSourceBlocks(params, params.buffer);
+    params.isunresumable = true;
+    return -1;
+  }
+  return 0;
+}
+
 static int PerformCommandMove(CommandParameters& params) {
   size_t blocks = 0;
   RangeSet tgt;
-  int status = LoadSrcTgtVersion3(params, &tgt, &blocks, true);
+  int status = StreamMove(params, &tgt, &blocks);
+  bool streamed = status != kMoveNotStreamed;
+  if (!streamed) {
+    status = LoadSrcTgtVersion3(params, &tgt, &blocks, true, false);
+  }
 
   if (status == -1) {
     LOG(ERROR) << "failed to read blocks for move";
@@ -1189,10 +2312,12 @@ static int PerformCommandMove(CommandParameters& params) {
   }
 
   if (params.canwrite) {
-    if (status == 0) {
+    if (status == 0 && streamed) {
+      LOG(INFO) << "  moved " << blocks << " blocks";
+    } else if (status == 0) {
       LOG(INFO) << "  moving " << blocks << " blocks";
 
-      if (WriteBlocks(tgt, params.buffer, params.fd) == -1) {
+      if (WriteBlocks(tgt, params.buffer, WriteFd(params)) == -1) {
         return -1;
       }
     } else {
@@ -1201,7 +2326,7 @@ static int PerformCommandMove(CommandParameters& params) {
   }
 
   if (!params.freestash.empty()) {
-    FreeStash(params.stashbase, params.freestash);
+    FreeStashAfterCheckpoint(params, params.freestash);
     params.freestash.clear();
   }
 
@@ -1217,7 +2342,21 @@ static int PerformCommandStash(CommandParameters& params) {
     return -1;
   }
 
-  const std::string& id = params.tokens[params.cpos++];
+  const std::string id(params.tokens[params.cpos++]);
+  // The stash file of a pending free is needed again, as the id gets reused (b/69858743).
+  params.pending_frees.erase(
+      std::remove(params.pending_frees.begin(), params.pending_frees.end(), id),
+      params.pending_frees.end());
+  // A match ahead of time stands for the stash, as LoadStash() would check it in verify mode.
+  const AheadChecks* ahead = FindAheadChecks(params);
+  if (ahead != nullptr && ahead->source == AheadCheck::kMatch &&
+      context.stash_map.find(id) == context.stash_map.end()) {
+    RangeSet src = RangeSet::Parse(params.tokens[params.cpos++]);
+    CHECK(static_cast<bool>(src));
+    context.stash_map[id] = std::move(src);
+    return 0;
+  }
+
   if (LoadStash(params, id, true, &params.buffer, false) == 0) {
     // Stash file already exists and has expected contents. Do not read from source again, as the
     // source may have been already overwritten during a previous attempt.
@@ -1229,26 +2368,50 @@ static int PerformCommandStash(CommandParameters& params) {
 
   size_t blocks = src.blocks();
   allocate(blocks * BLOCKSIZE, &params.buffer);
-  if (ReadBlocks(src, &params.buffer, params.fd) == -1) {
+  bool verified = context.source_cache.Get(id, src, params.buffer.data());
+  if (!verified && ReadSourceBlocks(params, src) == -1) {
     return -1;
   }
-  stash_map[id] = src;
+  context.stash_map[id] = src;
 
-  if (VerifyBlocks(id, params.buffer, blocks, true) != 0) {
+  if (!verified && VerifyBlocks(id, params.buffer, blocks, true) != 0) {
     // Source blocks have unexpected contents. If we actually need this data later, this is an
     // unrecoverable error. However, the command that uses the data may have already completed
     // previously, so the possible failure will occur during source block verification.
     LOG(ERROR) << "failed to load source blocks for stash " << id;
     return 0;
   }
+  if (!verified) {
+    context.source_cache.Put(id, src, params.buffer.data(), blocks * BLOCKSIZE);
+  }
 
   // In verify mode, we don't need to stash any blocks.
   if (!params.canwrite) {
     return 0;
   }
 
+  // Keep the stash in memory if it fits, spilling older ones as needed. It only has to be on disk
+  // once a later command may overwrite the source blocks, or at the next checkpoint; see
+  // SpillOverwrittenStashes(). A stash that outlives the checkpoint interval for sure goes straight
+  // to disk.
+  const TransferPlan::StashLifetime* lifetime = params.plan.FindStash(params.cmdindex);
+  bool long_lived = !params.commands.empty() && lifetime != nullptr &&
+                    lifetime->freed - lifetime->stashed > params.checkpoint_interval;
+  if (!long_lived && context.memory_stash.Fits(blocks * BLOCKSIZE)) {
+    if (!SpillStashes(params.stashbase, blocks * BLOCKSIZE)) {
+      LOG(ERROR) << "failed to spill stashes for " << id;
+      return -1;
+    }
+    LOG(INFO) << "stashing " << blocks << " blocks to " << id << " in memory";
+    ScopedTrace trace(TraceEvent::kStashSave, blocks);
+    context.memory_stash.Add(
+        id, BlockBuffer(params.buffer.begin(), params.buffer.begin() + blocks * BLOCKSIZE));
+    params.stashed += blocks;
+    return 0;
+  }
+
   LOG(INFO) << "stashing " << blocks << " blocks to " << id;
-  int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr);
+  int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr, true);
   if (result == 0) {
     params.stashed += blocks;
   }
@@ -1262,10 +2425,18 @@ static int PerformCommandFree(CommandParameters& params) {
     return -1;
   }
 
-  const std::string& id = params.tokens[params.cpos++];
-  stash_map.erase(id);
+  const std::string id(params.tokens[params.cpos++]);
+  context.stash_map.erase(id);
+
+  if (context.memory_stash.Erase(id)) {
+    // Never made it to the disk.
+    return 0;
+  }
 
-  if (params.createdstash || params.canwrite) {
+  if (params.canwrite) {
+    return FreeStashAfterCheckpoint(params, id);
+  }
+  if (params.createdstash) {
     return FreeStash(params.stashbase, id);
   }
 
@@ -1287,22 +2458,38 @@ static int PerformCommandZero(CommandParameters& params) {
   memset(params.buffer.data(), 0, BLOCKSIZE);
 
   if (params.canwrite) {
-    for (const auto& [begin, end] : tgt) {
-      off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
-      size_t size = (end - begin) * BLOCKSIZE;
-      if (!discard_blocks(params.fd, offset, size)) {
-        return -1;
-      }
-
-      if (!check_lseek(params.fd, offset, SEEK_SET)) {
+    context.source_cache.Invalidate(tgt);
+    std::vector<Extent> extents = GetExtents(tgt);
+    bool zeroed = std::all_of(extents.begin(), extents.end(), [&params](const Extent& extent) {
+      return ZeroOutExtent(WriteFd(params), extent.first, extent.second);
+    });
+    if (!zeroed) {
+      // Not a block device; write the zeros instead.
+      if (!DiscardExtents(params.fd, extents)) {
         return -1;
       }
 
-      for (size_t j = begin; j < end; ++j) {
-        if (!android::base::WriteFully(params.fd, params.buffer.data(), BLOCKSIZE)) {
-          failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-          PLOG(ERROR) << "Failed to write " << BLOCKSIZE << " bytes of data";
-          return -1;
+      // Write each extent with pwritev(2), pointing all the iovecs at the same zeroed block.
+      std::vector<iovec> iov(std::min<size_t>(tgt.blocks(), IOV_MAX),
+                             { params.buffer.data(), BLOCKSIZE });
+      for (auto [offset, size] : extents) {
+        while (size > 0) {
+          int iovcnt = std::min(size / BLOCKSIZE, iov.size());
+          ssize_t written =
+              TEMP_FAILURE_RETRY(pwritev(WriteFd(params), iov.data(), iovcnt, offset));
+          if (written == -1) {
+            context.failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
+            PLOG(ERROR) << "Failed to write " << iovcnt * BLOCKSIZE << " bytes of data";
+            return -1;
+          }
+          // Partial block writes shouldn't happen on a block device.
+          if (written == 0 || written % BLOCKSIZE != 0) {
+            context.failure_type = kFwriteFailure;
+            LOG(ERROR) << "Short write of " << written << " bytes; expected " << iovcnt * BLOCKSIZE;
+            return -1;
+          }
+          offset += written;
+          size -= written;
         }
       }
     }
@@ -1326,24 +2513,42 @@ static int PerformCommandNew(CommandParameters& params) {
   RangeSet tgt = RangeSet::Parse(params.tokens[params.cpos++]);
   CHECK(static_cast<bool>(tgt));
 
-  if (params.canwrite) {
+  if (params.canwrite && params.nti.stored_data != nullptr) {
+    LOG(INFO) << " writing " << tgt.blocks() << " blocks of stored new data";
+
+    // All of it in one go, which gets written out in a single vectored write over the extents.
+    NewThreadInfo& nti = params.nti;
+    size_t size = tgt.blocks() * BLOCKSIZE;
+    if (size > nti.stored_size - nti.stored_offset) {
+      LOG(ERROR) << "missing " << size - (nti.stored_size - nti.stored_offset)
+                 << " bytes of new data";
+      return -1;
+    }
+    RangeSinkWriter writer(WriteFd(params), tgt, params.direct_fd != -1);
+    if (writer.Write(nti.stored_data + nti.stored_offset, size) != size) {
+      LOG(ERROR) << "Failed to write " << size << " bytes.";
+      return -1;
+    }
+    nti.stored_offset += size;
+  } else if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
-    pthread_mutex_lock(&params.nti.mu);
-    params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
-    pthread_cond_broadcast(&params.nti.cv);
+    RangeSinkWriter writer(WriteFd(params), tgt, params.direct_fd != -1);
+    while (!writer.Finished()) {
+      const uint8_t* data;
+      size_t size = params.nti.ring->GetReadable(&data);
+      if (size == 0) {
+        LOG(ERROR) << "missing " << writer.AvailableSpace() << " bytes of new data";
+        return -1;
+      }
 
-    while (params.nti.writer != nullptr) {
-      if (!params.nti.receiver_available) {
-        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - params.nti.writer->BytesWritten())
-                   << " bytes of new data";
-        pthread_mutex_unlock(&params.nti.mu);
+      size_t write_now = std::min(size, writer.AvailableSpace());
+      if (writer.Write(data, write_now) != write_now) {
+        LOG(ERROR) << "Failed to write " << write_now << " bytes.";
         return -1;
       }
-      pthread_cond_wait(&params.nti.cv, &params.nti.mu);
+      params.nti.ring->Consume(write_now);
     }
-
-    pthread_mutex_unlock(&params.nti.mu);
   }
 
   params.written += tgt.blocks();
@@ -1359,20 +2564,20 @@ static int PerformCommandDiff(CommandParameters& params) {
   }
 
   size_t offset;
-  if (!android::base::ParseUint(params.tokens[params.cpos++], &offset)) {
+  if (!android::base::ParseUint(std::string(params.tokens[params.cpos++]), &offset)) {
     LOG(ERROR) << "invalid patch offset";
     return -1;
   }
 
   size_t len;
-  if (!android::base::ParseUint(params.tokens[params.cpos++], &len)) {
+  if (!android::base::ParseUint(std::string(params.tokens[params.cpos++]), &len)) {
     LOG(ERROR) << "invalid patch len";
     return -1;
   }
 
   RangeSet tgt;
   size_t blocks = 0;
-  int status = LoadSrcTgtVersion3(params, &tgt, &blocks, false);
+  int status = LoadSrcTgtVersion3(params, &tgt, &blocks, false, true);
 
   if (status == -1) {
     LOG(ERROR) << "failed to read blocks for diff";
@@ -1390,46 +2595,68 @@ static int PerformCommandDiff(CommandParameters& params) {
 
   if (params.canwrite) {
     if (status == 0) {
-      LOG(INFO) << "patching " << blocks << " blocks to " << tgt.blocks();
-      Value patch_value(
-          Value::Type::BLOB,
-          std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
-
-      RangeSinkWriter writer(params.fd, tgt);
-      if (params.cmdname[0] == 'i') {  // imgdiff
-        if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value,
-                            std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
-                                      std::placeholders::_2),
-                            nullptr) != 0) {
-          LOG(ERROR) << "Failed to apply image patch.";
-          failure_type = kPatchApplicationFailure;
+      LOG(INFO) << "patching " << blocks << (params.mapped_source ? " mapped" : "")
+                << " blocks to " << tgt.blocks();
+      BlockBuffer patched;
+      if (params.pipeline != nullptr &&
+          params.pipeline->TakePatchedBlocks(params.cmdindex, &patched)) {
+        // Already patched (and verified against the target hash) ahead of time by the pipeline.
+        if (WriteBlocks(tgt, patched, WriteFd(params)) == -1) {
           return -1;
         }
       } else {
-        if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value, 0,
-                             std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
-                                       std::placeholders::_2)) != 0) {
-          LOG(ERROR) << "Failed to apply bsdiff patch.";
-          failure_type = kPatchApplicationFailure;
+        // A stored patch.dat is used in place from the mapped package; only a compressed one needs
+        // the patch copied out.
+        std::string patch;
+        std::string_view patch_view;
+        bool in_place = params.patch_source->data() != nullptr;
+        if (in_place ? !params.patch_source->ReadInPlace(offset, len, &patch_view)
+                     : !params.patch_source->Read(offset, len, &patch)) {
+          LOG(ERROR) << "Failed to read the patch at " << offset;
+          context.failure_type = kPatchApplicationFailure;
           return -1;
         }
-      }
+        Value patch_value =
+            in_place ? Value(patch_view) : Value(Value::Type::BLOB, std::move(patch));
+
+        RangeSinkWriter writer(WriteFd(params), tgt, params.direct_fd != -1);
+        CommandStats::ScopedSubPhase patch_phase(CommandSubPhase::kPatch);
+        if (params.cmdname[0] == 'i') {  // imgdiff
+          if (ApplyImagePatch(SourceData(params), blocks * BLOCKSIZE, patch_value,
+                              std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
+                                        std::placeholders::_2),
+                              nullptr, params.imgpatch_threads) != 0) {
+            LOG(ERROR) << "Failed to apply image patch.";
+            context.failure_type = kPatchApplicationFailure;
+            return -1;
+          }
+        } else {
+          if (ApplyBSDiffPatch(SourceData(params), blocks * BLOCKSIZE, patch_value, 0,
+                               std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
+                                         std::placeholders::_2)) != 0) {
+            LOG(ERROR) << "Failed to apply bsdiff patch.";
+            context.failure_type = kPatchApplicationFailure;
+            return -1;
+          }
+        }
 
-      // We expect the output of the patcher to fill the tgt ranges exactly.
-      if (!writer.Finished()) {
-        LOG(ERROR) << "Failed to fully write target blocks (range sink underrun): Missing "
-                   << writer.AvailableSpace() << " bytes";
-        failure_type = kPatchApplicationFailure;
-        return -1;
+        // We expect the output of the patcher to fill the tgt ranges exactly.
+        if (!writer.Finished()) {
+          LOG(ERROR) << "Failed to fully write target blocks (range sink underrun): Missing "
+                     << writer.AvailableSpace() << " bytes";
+          context.failure_type = kPatchApplicationFailure;
+          return -1;
+        }
       }
     } else {
       LOG(INFO) << "skipping " << blocks << " blocks already patched to " << tgt.blocks() << " ["
                 << params.cmdline << "]";
     }
   }
+  params.mapped_source.reset();
 
   if (!params.freestash.empty()) {
-    FreeStash(params.stashbase, params.freestash);
+    FreeStashAfterCheckpoint(params, params.freestash);
     params.freestash.clear();
   }
 
@@ -1464,6 +2691,7 @@ static int PerformCommandErase(CommandParameters& params) {
 
   if (params.canwrite) {
     LOG(INFO) << " erasing " << tgt.blocks() << " blocks";
+    context.source_cache.Invalidate(tgt);
 
     for (const auto& [begin, end] : tgt) {
       off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
@@ -1482,6 +2710,59 @@ static int PerformCommandAbort(CommandParameters&) {
   return -1;
 }
 
+// Computes the hash tree of |source_ranges| with the data blocks hashed on params.hash_threads
+// threads. The upper levels are then the hash tree of the bottom level, which HashTreeBuilder
+// builds as usual. Returns 0 on success, -1 on errors, or 1 if the caller should fall back to the
+// serial computation, i.e. when the bottom level fits in one block, or the result doesn't match.
+static int ComputeHashTreeInParallel(CommandParameters& params, const RangeSet& source_ranges,
+                                     const EVP_MD* hash_function,
+                                     const std::vector<unsigned char>& salt,
+                                     const std::string& expected_root_hash,
+                                     uint64_t write_offset) {
+  std::vector<unsigned char> leaves;
+  if (!HashTreeLeaves(params.fd, source_ranges, BLOCKSIZE, hash_function, salt, params.hash_threads,
+                      &leaves)) {
+    context.failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+    PLOG(ERROR) << "Failed to read data in " << source_ranges.ToString();
+    return -1;
+  }
+  // Pads the bottom level to the block size, like HashTreeBuilder does for each level.
+  leaves.resize((leaves.size() + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE);
+  if (leaves.size() <= BLOCKSIZE) {
+    return 1;
+  }
+
+  HashTreeBuilder builder(BLOCKSIZE, hash_function);
+  if (!builder.Initialize(static_cast<int64_t>(leaves.size()), salt) ||
+      !builder.Update(leaves.data(), leaves.size()) || !builder.BuildHashTree()) {
+    LOG(WARNING) << "Failed to build the upper levels of the hash tree";
+    return 1;
+  }
+
+  size_t upper_size = 0;
+  for (const auto& level : builder.verity_tree()) {
+    upper_size += level.size();
+  }
+  uint64_t tree_size = HashTreeBuilder::CalculateSize(
+      static_cast<uint64_t>(source_ranges.blocks()) * BLOCKSIZE, BLOCKSIZE, builder.hash_size());
+  std::string root_hash_hex = HashTreeBuilder::BytesArrayToString(builder.root_hash());
+  if (upper_size + leaves.size() != tree_size || root_hash_hex != expected_root_hash) {
+    LOG(WARNING) << "Hash tree computed in parallel doesn't match (root hash " << root_hash_hex
+                 << ", " << upper_size + leaves.size() << " of " << tree_size << " bytes)";
+    return 1;
+  }
+
+  // The levels are laid out from the top, so the bottom level goes right after the upper ones.
+  if (params.canwrite && (!builder.WriteHashTreeToFd(params.fd, write_offset) ||
+                          !android::base::WriteFullyAtOffset(params.fd, leaves.data(),
+                                                             leaves.size(),
+                                                             write_offset + upper_size))) {
+    LOG(ERROR) << "Failed to write hash tree to output";
+    return -1;
+  }
+  return 0;
+}
+
 // Computes the hash_tree bytes based on the parameters, checks if the root hash of the tree
 // matches the expected hash and writes the result to the specified range on the block_device.
 // Hash_tree computation arguments:
@@ -1509,26 +2790,36 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
     return -1;
   }
 
-  auto hash_function = HashTreeBuilder::HashFunction(params.tokens[params.cpos++]);
+  auto hash_function = HashTreeBuilder::HashFunction(std::string(params.tokens[params.cpos++]));
   if (hash_function == nullptr) {
     LOG(ERROR) << "Invalid hash algorithm in " << params.cmdline;
     return -1;
   }
 
   std::vector<unsigned char> salt;
-  std::string salt_hex = params.tokens[params.cpos++];
+  std::string salt_hex(params.tokens[params.cpos++]);
   if (salt_hex.empty() || !HashTreeBuilder::ParseBytesArrayFromString(salt_hex, &salt)) {
     LOG(ERROR) << "Failed to parse salt in " << params.cmdline;
     return -1;
   }
 
-  std::string expected_root_hash = params.tokens[params.cpos++];
+  std::string expected_root_hash(params.tokens[params.cpos++]);
   if (expected_root_hash.empty()) {
     LOG(ERROR) << "Invalid root hash in " << params.cmdline;
     return -1;
   }
 
-  // Starts the hash_tree computation.
+  uint64_t write_offset = static_cast<uint64_t>(hash_tree_ranges.GetBlockNumber(0)) * BLOCKSIZE;
+  if (params.canwrite) {
+    context.source_cache.Invalidate(hash_tree_ranges);
+  }
+  int result = ComputeHashTreeInParallel(params, source_ranges, hash_function, salt,
+                                         expected_root_hash, write_offset);
+  if (result != 1) {
+    return result;
+  }
+
+  // Falls back to computing the whole hash_tree with the builder.
   HashTreeBuilder builder(BLOCKSIZE, hash_function);
   if (!builder.Initialize(static_cast<int64_t>(source_ranges.blocks()) * BLOCKSIZE, salt)) {
     LOG(ERROR) << "Failed to initialize hash tree computation, source " << source_ranges.ToString()
@@ -1547,7 +2838,7 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
 
     for (size_t i = begin; i < end; i++) {
       if (!android::base::ReadFully(params.fd, buffer, BLOCKSIZE)) {
-        failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+        context.failure_type = errno == EIO ? kEioFailure : kFreadFailure;
         LOG(ERROR) << "Failed to read data in " << begin << ":" << end;
         return -1;
       }
@@ -1571,7 +2862,6 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
     return -1;
   }
 
-  uint64_t write_offset = static_cast<uint64_t>(hash_tree_ranges.GetBlockNumber(0)) * BLOCKSIZE;
   if (params.canwrite && !builder.WriteHashTreeToFd(params.fd, write_offset)) {
     LOG(ERROR) << "Failed to write hash tree to output";
     return -1;
@@ -1582,6 +2872,181 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
   return 0;
 }
 
+// Computes the verity FEC data of source_ranges on params.hash_threads threads, checks it against
+// the expected SHA-1 and writes it to the specified range on the block_device. The package ships
+// the arguments instead of the data, which is a fraction of the size of the partition. The range
+// holds either the FEC data alone, as AVB lays it out after the hash tree, or one more block for
+// the libfec header, as libfec expects it at the end of the partition.
+// FEC computation arguments:
+//   fec_ranges
+//   source_ranges
+//   roots
+//   fec_hash
+static int PerformCommandComputeFec(CommandParameters& params) {
+  if (params.cpos + 4 != params.tokens.size()) {
+    LOG(ERROR) << "Invalid arguments count in FEC computation " << params.cmdline;
+    return -1;
+  }
+
+  // Expects the FEC data to be contiguous.
+  RangeSet fec_ranges = RangeSet::Parse(params.tokens[params.cpos++]);
+  if (!fec_ranges || fec_ranges.size() != 1) {
+    LOG(ERROR) << "Invalid FEC ranges in " << params.cmdline;
+    return -1;
+  }
+
+  RangeSet source_ranges = RangeSet::Parse(params.tokens[params.cpos++]);
+  if (!source_ranges) {
+    LOG(ERROR) << "Invalid source ranges in " << params.cmdline;
+    return -1;
+  }
+
+  int roots;
+  if (!android::base::ParseInt(std::string(params.tokens[params.cpos++]), &roots, 1, 254)) {
+    LOG(ERROR) << "Invalid FEC roots in " << params.cmdline;
+    return -1;
+  }
+
+  std::string expected_fec_hash(params.tokens[params.cpos++]);
+  if (expected_fec_hash.empty()) {
+    LOG(ERROR) << "Invalid FEC hash in " << params.cmdline;
+    return -1;
+  }
+
+  size_t fec_blocks = GetFecSize(source_ranges.blocks(), roots) / BLOCKSIZE;
+  bool with_header = fec_ranges.blocks() == fec_blocks + 1;
+  if (fec_ranges.blocks() != fec_blocks && !with_header) {
+    LOG(ERROR) << "FEC of " << source_ranges.blocks() << " blocks with " << roots
+               << " roots takes " << fec_blocks << " blocks, not " << fec_ranges.ToString();
+    return -1;
+  }
+
+  std::vector<uint8_t> fec;
+  if (!EncodeFec(params.fd, source_ranges, roots, params.hash_threads, &fec)) {
+    context.failure_type = errno == EIO ? kEioFailure : kFreadFailure;
+    PLOG(ERROR) << "Failed to read data in " << source_ranges.ToString();
+    return -1;
+  }
+  if (with_header) {
+    AppendFecHeader(source_ranges.blocks(), roots, &fec);
+  }
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(fec.data(), fec.size(), digest);
+  if (std::string fec_hash = print_sha1(digest); fec_hash != expected_fec_hash) {
+    LOG(ERROR) << "FEC data doesn't match the expected value. Expected: " << expected_fec_hash
+               << ", actual: " << fec_hash;
+    return -1;
+  }
+
+  if (params.canwrite) {
+    context.source_cache.Invalidate(fec_ranges);
+    off64_t offset = static_cast<off64_t>(fec_ranges.GetBlockNumber(0)) * BLOCKSIZE;
+    if (!android::base::WriteFullyAtOffset(params.fd, fec.data(), fec.size(), offset)) {
+      context.failure_type = kFwriteFailure;
+      PLOG(ERROR) << "Failed to write FEC data to output";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Returns whether the commands executed since the last checkpoint must be made durable before
+// executing |cmdindex|, i.e. a checkpoint is due, or the command may overwrite blocks that the
+// pending commands would need if they were to be redone on resume. The stashes they use don't
+// count, as they're on disk either way, and their frees are deferred to the checkpoint.
+static bool NeedsCheckpoint(const CommandParameters& params, size_t cmdindex) {
+  if (params.pending_commands == 0) {
+    return false;
+  }
+  if (params.commands.empty() || params.pending_commands >= params.checkpoint_interval) {
+    return true;
+  }
+  const Command* command = cmdindex < params.commands.size() ? params.commands[cmdindex] : nullptr;
+  if (command == nullptr) {
+    return true;
+  }
+  const RangeSet* target = WrittenRanges(*command);
+  if (target == nullptr) {
+    return false;
+  }
+  return params.pending_sources.Overlaps(*target);
+}
+
+// Makes the pending commands durable: syncs the block device, saves the last executed command into
+// the last_command_file, and then carries out the frees that were deferred. Returns false if the
+// writes can't be synced.
+static bool CheckpointCommands(CommandParameters& params) {
+  if (params.pending_commands == 0) {
+    return true;
+  }
+
+  if (Fsync(params.fd, context.io_trace_device) == -1) {
+    context.failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+    PLOG(ERROR) << "fsync failed";
+    return false;
+  }
+
+  // The commands up to the checkpoint won't be redone on resume, so neither would the stash
+  // commands that made the in-memory stashes.
+  if (!params.commands.empty() && !SpillAllStashes(params.stashbase)) {
+    LOG(ERROR) << "failed to spill stashes at checkpoint";
+    return false;
+  }
+
+  if (!UpdateLastCommandIndex(params.pending_index, params.pending_cmdline)) {
+    LOG(WARNING) << "Failed to update the last command file.";
+  }
+
+  for (const auto& id : params.pending_frees) {
+    FreeStash(params.stashbase, id);
+  }
+  params.pending_frees.clear();
+  params.pending_sources.Clear();
+  params.pending_commands = 0;
+  return true;
+}
+
+// Merges |ranges| into the pending source ranges, which stay sorted and disjoint so that
+// NeedsCheckpoint() can check them in one sweep however many commands are pending.
+static void AddPendingSources(CommandParameters& params, const RangeSet& ranges) {
+  if (ranges) {
+    std::vector<Range> pairs(ranges.cbegin(), ranges.cend());
+    params.pending_sources.Insert(SortedRangeSet(std::move(pairs)));
+  }
+}
+
+// Adds the just executed command |cmdindex| to the pending ones, to be covered by the next
+// checkpoint.
+static void AddPendingCommand(CommandParameters& params, size_t cmdindex) {
+  params.pending_commands++;
+  params.pending_index = cmdindex;
+  params.pending_cmdline = params.cmdline;
+  if (cmdindex >= params.commands.size() || params.commands[cmdindex] == nullptr) {
+    return;
+  }
+  const Command& command = *params.commands[cmdindex];
+  switch (command.type()) {
+    case Command::Type::MOVE:
+    case Command::Type::BSDIFF:
+    case Command::Type::IMGDIFF:
+      AddPendingSources(params, command.source().ranges());
+      break;
+    case Command::Type::COMPUTE_HASH_TREE:
+      AddPendingSources(params, command.hash_tree_info().source_ranges());
+      break;
+    case Command::Type::COMPUTE_FEC:
+      AddPendingSources(params, command.fec_info().source_ranges());
+      break;
+    case Command::Type::STASH:
+      // An in-memory stash that gets freed before the checkpoint is made again on resume.
+      AddPendingSources(params, command.stash().ranges());
+      break;
+    default:
+      break;
+  }
+}
+
 using CommandFunction = std::function<int(CommandParameters&)>;
 
 using CommandMap = std::unordered_map<Command::Type, CommandFunction>;
@@ -1627,12 +3092,14 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
                                       const std::vector<std::unique_ptr<Expr>>& argv,
                                       const CommandMap& command_map, bool dryrun) {
   CommandParameters params{};
-  stash_map.clear();
+  context.stash_map.clear();
+  context.failure_type = kNoCause;
+  context.is_retry = state->is_retry;
+  context.last_command_file = Paths::Get().last_command_file();
   params.canwrite = !dryrun;
 
   LOG(INFO) << "performing " << (dryrun ? "verification" : "update");
   if (state->is_retry) {
-    is_retry = true;
     LOG(INFO) << "This update is a retry.";
   }
   if (argv.size() != 4) {
@@ -1692,7 +3159,16 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     LOG(ERROR) << name << "(): no file \"" << patch_data_fn->data << "\" in package";
     return StringValue("");
   }
-  params.patch_start = updater->GetMappedPackageAddress() + patch_entry.offset;
+  // The patch data doesn't have to be stored uncompressed; otherwise it's inflated as the diff
+  // commands need it, up to the window ahead.
+  size_t patch_window_mb =
+      GetBudgetProperty(updater->GetRuntime(), "ro.updater.patch_window_mb", kDefaultPatchWindowMb,
+                        std::string(name) + " patch window");
+  params.patch_source = PatchSource::Create(za, patch_entry, updater->GetMappedPackageAddress(),
+                                            patch_window_mb * 1024 * 1024);
+  if (params.patch_source->data() == nullptr) {
+    LOG(INFO) << patch_data_fn->data << " is compressed; inflating it on demand";
+  }
 
   std::string_view new_data(new_data_fn->data);
   ZipEntry64 new_entry;
@@ -1703,22 +3179,123 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
   params.fd.reset(TEMP_FAILURE_RETRY(open(block_device_path.c_str(), O_RDWR)));
   if (params.fd == -1) {
-    failure_type = errno == EIO ? kEioFailure : kFileOpenFailure;
+    context.failure_type = errno == EIO ? kEioFailure : kFileOpenFailure;
     PLOG(ERROR) << "open \"" << block_device_path << "\" failed";
     return StringValue("");
   }
 
+  // Files written earlier in the script to a filesystem on this device may still be in the page
+  // cache, where the block level reads and writes below wouldn't see them.
+  if (struct stat sb; fstat(params.fd, &sb) == 0 && S_ISBLK(sb.st_mode) &&
+      !PendingSyncs::Get().SyncDevice(sb.st_rdev)) {
+    context.failure_type = kFsyncFailure;
+    return StringValue("");
+  }
+
+  // Optionally write the target blocks with O_DIRECT, so that a large update doesn't push
+  // everything else out of the page cache and leave a pile of dirty pages for the final fsync. The
+  // fsync() on params.fd still flushes the device cache for those writes.
+  if (params.canwrite &&
+      updater->GetRuntime()->GetProperty("ro.updater.direct_io", "false") == "true") {
+    params.direct_fd.reset(TEMP_FAILURE_RETRY(open(block_device_path.c_str(), O_RDWR | O_DIRECT)));
+    if (params.direct_fd == -1) {
+      PLOG(WARNING) << "Failed to open \"" << block_device_path
+                    << "\" with O_DIRECT; writing through the page cache";
+    } else {
+      LOG(INFO) << "writing target blocks with O_DIRECT";
+    }
+  }
+
+  // Pick the block I/O backend, which stays in use for the rest of the process (e.g. for the
+  // range_sha1() calls after the update).
+  std::string block_io_prop = updater->GetRuntime()->GetProperty("ro.updater.block_io", "io_uring");
+  BlockIo::Type block_io_type = BlockIo::Type::IO_URING;
+  if (!BlockIo::ParseType(block_io_prop, &block_io_type)) {
+    LOG(WARNING) << "Invalid ro.updater.block_io: " << block_io_prop;
+  }
+  if (context.block_io == nullptr || context.block_io->type() != block_io_type) {
+    context.block_io = BlockIo::Create(block_io_type);
+  }
+
+  // Once on, the I/O trace covers the rest of the script, and gets written at the end of it.
+  if (updater->GetRuntime()->GetProperty("ro.updater.io_trace", "false") == "true") {
+    IoTracer::Get().Enable();
+  }
+  context.io_trace_device = IoTracer::Get().FileId(block_device_path);
+
+  // The mappings may be stale from an earlier call (e.g. the verification of the same partition).
+  // A budget of 0 disables the stash cache, which only holds mappings.
+  context.stash_cache.Clear();
+  params.map_stashes =
+      updater->GetRuntime()->GetProperty("ro.updater.map_stashes", "false") == "true";
+  size_t stash_cache_mb =
+      params.map_stashes
+          ? GetBudgetProperty(updater->GetRuntime(), "ro.updater.stash_cache_mb",
+                              kDefaultStashCacheMb, std::string(name) + " stash cache")
+          : 0;
+  context.stash_cache.set_capacity(ReserveMemory(&context.stash_cache_memory,
+                                                 std::string(name) + " stash cache",
+                                                 stash_cache_mb * 1024 * 1024, 0,
+                                                 MemoryBudget::Priority::kCache));
+
+  params.hash_threads = GetHashThreads(updater->GetRuntime(), name);
+  params.map_sources =
+      updater->GetRuntime()->GetProperty("ro.updater.map_patch_sources", "false") == "true";
+  params.imgpatch_threads = GetThreadsProperty(updater->GetRuntime(), "ro.updater.imgpatch_threads",
+                                               kMaxDefaultImagePatchThreads,
+                                               std::string(name) + " imgpatch threads");
+
+  // The checkpoints can be batched if the commands have been parsed ahead of time. An interval of 0
+  // or 1 makes a checkpoint after every command.
+  params.checkpoint_interval = kDefaultCheckpointInterval;
+  std::string checkpoint_prop =
+      updater->GetRuntime()->GetProperty("ro.updater.checkpoint_interval", "");
+  if (!checkpoint_prop.empty() &&
+      !android::base::ParseUint(checkpoint_prop, &params.checkpoint_interval)) {
+    LOG(WARNING) << "Invalid ro.updater.checkpoint_interval: " << checkpoint_prop;
+    params.checkpoint_interval = kDefaultCheckpointInterval;
+  }
+
+  // Likewise for the in-memory stashes, which also need to be dropped from any earlier call.
+  context.memory_stash.Clear();
+  size_t stash_memory_mb =
+      GetBudgetProperty(updater->GetRuntime(), "ro.updater.stash_memory_mb", kDefaultStashMemoryMb,
+                        std::string(name) + " stash memory");
+  context.memory_stash.set_capacity(ReserveMemory(&context.memory_stash_memory,
+                                                  std::string(name) + " stash memory",
+                                                  stash_memory_mb * 1024 * 1024, 0,
+                                                  MemoryBudget::Priority::kBuffer));
+
+  // Likewise for the cache of the verified source blocks.
+  context.source_cache.Clear();
+  size_t source_cache_mb =
+      GetBudgetProperty(updater->GetRuntime(), "ro.updater.source_cache_mb", kDefaultSourceCacheMb,
+                        std::string(name) + " source cache");
+  context.source_cache.set_capacity(ReserveMemory(&context.source_cache_memory,
+                                                  std::string(name) + " source cache",
+                                                  source_cache_mb * 1024 * 1024, 0,
+                                                  MemoryBudget::Priority::kCache));
+
+  // Compressing the stash files saves space on /cache and stash I/O, for some CPU. The stash files
+  // of either form get loaded regardless, e.g. when resuming an update.
+  context.compress_stash =
+      updater->GetRuntime()->GetProperty("ro.updater.stash_compression", "false") == "true";
+  context.check_stash_space = false;
+
   uint8_t digest[SHA_DIGEST_LENGTH];
   if (!Sha1DevicePath(block_device_path, digest)) {
     return StringValue("");
   }
   params.stashbase = print_sha1(digest);
+  if (state->concurrent) {
+    context.last_command_file += "." + params.stashbase;
+  }
 
   // Possibly do return early on retry, by checking the marker. If the update on this partition has
   // been finished (but interrupted at a later point), there could be leftover on /cache that would
   // fail the no-op retry.
   std::string updated_marker = GetStashFileName(params.stashbase + ".UPDATED", "", "");
-  if (is_retry) {
+  if (context.is_retry) {
     struct stat sb;
     int result = stat(updated_marker.c_str(), &sb);
     if (result == 0) {
@@ -1734,8 +3311,12 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     }
   }
 
+  // The transfer list may point into the mapped package. It's parsed in place: the lines and the
+  // tokens of the commands below are all views into it.
+  std::string_view transfer_list_str = transfer_list_value->view();
   static constexpr size_t kTransferListHeaderLines = 4;
-  std::vector<std::string> lines = android::base::Split(transfer_list_value->data, "\n");
+  std::vector<std::string_view> lines;
+  SplitView(transfer_list_str, '\n', &lines);
   if (lines.size() < kTransferListHeaderLines) {
     ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zu]",
                lines.size());
@@ -1743,7 +3324,7 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   }
 
   // First line in transfer list is the version number.
-  if (!android::base::ParseInt(lines[0], &params.version, 3, 4)) {
+  if (!android::base::ParseInt(std::string(lines[0]), &params.version, 3, 4)) {
     LOG(ERROR) << "unexpected transfer list version [" << lines[0] << "]";
     return StringValue("");
   }
@@ -1752,8 +3333,9 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
   // Second line in transfer list is the total number of blocks we expect to write.
   size_t total_blocks;
-  if (!android::base::ParseUint(lines[1], &total_blocks)) {
-    ErrorAbort(state, kArgsParsingFailure, "unexpected block count [%s]", lines[1].c_str());
+  if (!android::base::ParseUint(std::string(lines[1]), &total_blocks)) {
+    ErrorAbort(state, kArgsParsingFailure, "unexpected block count [%s]",
+               std::string(lines[1]).c_str());
     return StringValue("");
   }
 
@@ -1766,31 +3348,139 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
   // Fourth line is the maximum number of blocks that will be stashed simultaneously
   size_t stash_max_blocks;
-  if (!android::base::ParseUint(lines[3], &stash_max_blocks)) {
+  if (!android::base::ParseUint(std::string(lines[3]), &stash_max_blocks)) {
     ErrorAbort(state, kArgsParsingFailure, "unexpected maximum stash blocks [%s]",
-               lines[3].c_str());
+               std::string(lines[3]).c_str());
     return StringValue("");
   }
 
-  int res = CreateStash(state, stash_max_blocks, params.stashbase);
+  int res = CreateStash(state, stash_max_blocks, params.stashbase, &params.stash_reservation);
   if (res == -1) {
     return StringValue("");
   }
   params.createdstash = res;
 
-  // Set up the new data writer.
-  if (params.canwrite) {
+  // The commands are still executed from the lines above; the parsed transfer list is only used to
+  // plan ahead, so a failure here isn't fatal.
+  std::string transfer_list_err;
+  TransferList transfer_list = TransferList::Parse(transfer_list_str, &transfer_list_err);
+  if (!transfer_list) {
+    LOG(WARNING) << "Failed to parse the transfer list ahead of time: " << transfer_list_err;
+  } else {
+    params.plan = TransferPlan::Analyze(transfer_list);
+    LOG(INFO) << "transfer plan: " << params.plan;
+    size_t memory_stash_capacity = context.memory_stash.capacity();
+    if (params.canwrite && params.plan.peak_stash_blocks * BLOCKSIZE > memory_stash_capacity) {
+      LOG(INFO) << "up to " << params.plan.peak_stash_blocks << " blocks stashed at once; the "
+                << "stashes beyond the " << memory_stash_capacity << "-byte memory budget spill "
+                << "to " << GetStashFileName(params.stashbase, "", "");
+    }
+    ReserveBuffers(params);
+    if (!params.canwrite) {
+      // Nothing gets written in verify mode, so all the checks can be made at once. 0 threads
+      // leave them to the commands.
+      size_t verify_threads =
+          GetThreadsProperty(updater->GetRuntime(), "ro.updater.verify_threads",
+                             kMaxDefaultVerifyThreads, std::string(name) + " verify threads");
+      if (verify_threads > 0) {
+        size_t verify_batch_mb = std::max<size_t>(
+            1, GetBudgetProperty(updater->GetRuntime(), "ro.updater.verify_batch_mb",
+                                 kDefaultVerifyBatchMb, std::string(name) + " verify batch"));
+        ScopedPhase verify_phase("verify_ahead");
+        AheadCheckStats stats;
+        params.ahead_checks = CheckCommandsAhead(params.fd, transfer_list, BLOCKSIZE,
+                                                 verify_threads, verify_batch_mb * 1024 * 1024,
+                                                 &stats);
+        LOG(INFO) << "checked the commands ahead of time: " << stats;
+      }
+    }
+    if (params.canwrite && params.checkpoint_interval > 1 && !transfer_list.commands().empty()) {
+      params.commands.resize(transfer_list.commands().back().index() + 1);
+      for (const auto& command : transfer_list.commands()) {
+        params.commands[command.index()] = &command;
+      }
+    }
+  }
+
+  // Likewise for the read-ahead hints to the kernel, which reach further ahead because they cost no
+  // memory of our own.
+  size_t readahead_mb = GetBudgetProperty(updater->GetRuntime(), "ro.updater.readahead_mb",
+                                          kDefaultReadaheadMb, std::string(name) + " readahead");
+  params.readahead_blocks_budget = readahead_mb * 1024 * 1024 / BLOCKSIZE;
+  // The checks made ahead of time have read the blocks already.
+  if (!params.ahead_checks.empty()) {
+    params.readahead_blocks_budget = 0;
+  }
+
+  // Set up the pipeline that reads ahead the source blocks of the upcoming commands. A budget of 0
+  // disables it.
+  size_t pipeline_buffer_mb =
+      GetBudgetProperty(updater->GetRuntime(), "ro.updater.pipeline_buffer_mb",
+                        kDefaultPipelineBufferMb, std::string(name) + " pipeline buffer");
+  size_t pipeline_buffer_size = 0;
+  if (pipeline_buffer_mb > 0 && transfer_list && params.ahead_checks.empty()) {
+    pipeline_buffer_size =
+        ReserveMemory(&params.memory.emplace_back(), std::string(name) + " pipeline buffer",
+                      pipeline_buffer_mb * 1024 * 1024, 0, MemoryBudget::Priority::kBuffer);
+  }
+  if (pipeline_buffer_size > 0) {
+    params.pipeline =
+        std::make_unique<CommandPipeline>(params.fd, transfer_list, pipeline_buffer_size);
+    if (params.canwrite) {
+      // The number of threads that apply the patches ahead of time. 0 disables it.
+      size_t patch_threads =
+          GetThreadsProperty(updater->GetRuntime(), "ro.updater.patch_threads",
+                             kMaxDefaultPatchThreads, std::string(name) + " patch threads");
+      // Only patches that are in memory can be applied ahead of time.
+      params.pipeline->EnablePatching(params.patch_source->data(), patch_threads);
+    }
+    if (!params.pipeline->Start()) {
+      params.pipeline.reset();
+    }
+  }
+
+  // Set up the new data writer. Stored new data gets written straight from the mapped package.
+  const uint8_t* mapped_package = updater->GetMappedPackageAddress();
+  bool brotli_compressed = android::base::EndsWith(new_data_fn->data, ".br");
+  bool zstd_compressed = android::base::EndsWith(new_data_fn->data, kZstdSuffix);
+  if (params.canwrite && new_entry.method == kCompressStored && !brotli_compressed &&
+      !zstd_compressed && mapped_package != nullptr &&
+      static_cast<uint64_t>(new_entry.offset) + new_entry.uncompressed_length <=
+          updater->GetMappedPackageLength()) {
+    LOG(INFO) << new_data_fn->data << " is stored; writing it from the mapped package";
+    updater->AdvisePackageRead(new_entry.offset, new_entry.uncompressed_length);
+    params.nti.stored_data = mapped_package + new_entry.offset;
+    params.nti.stored_size = new_entry.uncompressed_length;
+  } else if (params.canwrite) {
     params.nti.za = za;
     params.nti.entry = new_entry;
-    params.nti.brotli_compressed = android::base::EndsWith(new_data_fn->data, ".br");
+    updater->AdvisePackageRead(new_entry.offset, new_entry.compressed_length);
+    params.nti.brotli_compressed = brotli_compressed;
+    params.nti.zstd_compressed = zstd_compressed;
     if (params.nti.brotli_compressed) {
-      // Initialize brotli decoder state.
-      params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+      LoadBrotliSegments(updater, za, new_data_fn->data, new_entry, &params.nti);
+      if (params.nti.segments.empty()) {
+        // Initialize brotli decoder state.
+        params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+      }
+    } else if (params.nti.zstd_compressed) {
+      LoadZstdFrames(updater, new_data_fn->data, new_entry, &params.nti);
+      if (params.nti.segments.empty()) {
+        params.nti.zstd_decoder_state = ZSTD_createDCtx();
+      }
     }
-    params.nti.receiver_available = true;
 
-    pthread_mutex_init(&params.nti.mu, nullptr);
-    pthread_cond_init(&params.nti.cv, nullptr);
+    // The amount of new data that the background thread may expand ahead of the 'new' commands. A
+    // budget of 0 keeps a single block, which makes the two threads run mostly in lockstep.
+    size_t new_data_buffer_mb =
+        GetBudgetProperty(updater->GetRuntime(), "ro.updater.new_data_buffer_mb",
+                          kDefaultNewDataBufferMb, std::string(name) + " new data buffer");
+    size_t new_data_buffer_size =
+        ReserveMemory(&params.memory.emplace_back(), std::string(name) + " new data buffer",
+                      new_data_buffer_mb * 1024 * 1024, 0, MemoryBudget::Priority::kBuffer);
+    params.nti.ring =
+        std::make_unique<RingBuffer>(std::max<size_t>(new_data_buffer_size, BLOCKSIZE));
+
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
@@ -1820,17 +3510,47 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     skip_executed_command = false;
   }
 
+  // The in-memory stashes of the "stash" commands since the last command that wrote to the
+  // partition are gone, and so are the stash files freed by the "free" commands after that. Redo
+  // these commands, which is safe since their source blocks haven't been touched yet. Resume from
+  // the command after the last such write.
+  size_t resume_index = 0;
+  if (params.canwrite && skip_executed_command) {
+    size_t executed =
+        std::min(saved_last_command_index + 1, lines.size() - kTransferListHeaderLines);
+    for (size_t i = executed; i > 0; i--) {
+      std::string_view line = lines[kTransferListHeaderLines + i - 1];
+      if (!IsStashOnlyCommand(Command::ParseType(line.substr(0, line.find(' '))))) {
+        resume_index = i;
+        break;
+      }
+    }
+  }
+
   int rc = -1;
 
+  // The progress in the live stats, e.g. "block_system_commands: 120" for .../by-name/system.
+  std::string live_prefix = "block_" + android::base::Basename(block_device_path) + "_";
+  // The access pattern that the block queues are tuned for, once the first command tunes them.
+  std::optional<BlockAccess> block_access;
+
   // Subsequent lines are all individual transfer commands
   for (size_t i = kTransferListHeaderLines; i < lines.size(); i++) {
-    const std::string& line = lines[i];
+    std::string_view line = lines[i];
     if (line.empty()) continue;
 
     size_t cmdindex = i - kTransferListHeaderLines;
-    params.tokens = android::base::Split(line, " ");
+    params.cmdindex = cmdindex;
+    ApplyCacheBudgets();
+    SetLiveCounter(live_prefix + "commands", cmdindex);
+    SetLiveCounter(live_prefix + "written_blocks", params.written);
+    SetLiveCounter(live_prefix + "stash_memory_bytes", context.memory_stash.size());
+    if (params.pipeline != nullptr) {
+      params.pipeline->Advance(cmdindex);
+    }
+    SplitView(line, ' ', &params.tokens);
     params.cpos = 0;
-    params.cmdname = params.tokens[params.cpos++];
+    params.cmdname = std::string(params.tokens[params.cpos++]);
     params.cmdline = line;
     params.target_verified = false;
 
@@ -1851,17 +3571,48 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
     // Skip all commands before the saved last command index when resuming an update, except for
     // "new" command. Because new commands read in the data sequentially.
-    if (params.canwrite && skip_executed_command && cmdindex <= saved_last_command_index &&
+    if (params.canwrite && skip_executed_command && cmdindex < resume_index &&
         cmd_type != Command::Type::NEW) {
       LOG(INFO) << "Skipping already executed command: " << cmdindex
                 << ", last executed command for previous update: " << saved_last_command_index;
       continue;
     }
 
+    // The "new" commands that are redone on resume don't read from the partition.
+    if (params.readahead_blocks_budget > 0 && cmdindex >= resume_index) {
+      AdviseReads(params, cmdindex);
+    }
+
+    // Any command other than "stash" and "free" may overwrite the source blocks of the in-memory
+    // stashes, so they must be on disk first (see resume_index above).
+    if (params.canwrite && !IsStashOnlyCommand(cmd_type) &&
+        !SpillOverwrittenStashes(params, cmdindex)) {
+      LOG(ERROR) << "failed to spill stashes before command [" << line << "]";
+      goto pbiudone;
+    }
+
+    if (params.canwrite && NeedsCheckpoint(params, cmdindex) && !CheckpointCommands(params)) {
+      goto pbiudone;
+    }
+
+    if (auto access = CommandBlockAccess(cmd_type, params.canwrite);
+        access && access != block_access) {
+      for (const auto& setting : updater->GetRuntime()->TuneBlockQueues(block_device_path,
+                                                                        *access)) {
+        updater->WriteToCommandPipe("log " + setting);
+      }
+      block_access = access;
+    }
+
+    ScopedTrace command_trace(TraceEvent::kCommand, cmdindex);
+    ScopedPhase command_phase((params.canwrite ? "cmd_" : "verify_cmd_") + params.cmdname);
+    CommandStats::ScopedCommand command_timer(&params.command_stats, cmd_type);
     if (performer(params) == -1) {
       LOG(ERROR) << "failed to execute command [" << line << "]";
-      if (cmd_type == Command::Type::COMPUTE_HASH_TREE && failure_type == kNoCause) {
-        failure_type = kHashTreeComputationFailure;
+      if (cmd_type == Command::Type::COMPUTE_HASH_TREE && context.failure_type == kNoCause) {
+        context.failure_type = kHashTreeComputationFailure;
+      } else if (cmd_type == Command::Type::COMPUTE_FEC && context.failure_type == kNoCause) {
+        context.failure_type = kFecComputationFailure;
       }
       goto pbiudone;
     }
@@ -1882,16 +3633,12 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     }
 
     if (params.canwrite) {
-      if (fsync(params.fd) == -1) {
-        failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
-        PLOG(ERROR) << "fsync failed";
+      // Without the parsed commands, make a checkpoint after every command.
+      AddPendingCommand(params, cmdindex);
+      if (params.commands.empty() && !CheckpointCommands(params)) {
         goto pbiudone;
       }
 
-      if (!UpdateLastCommandIndex(cmdindex, params.cmdline)) {
-        LOG(WARNING) << "Failed to update the last command file.";
-      }
-
       updater->WriteToCommandPipe(
           android::base::StringPrintf("set_progress %.4f",
                                       static_cast<double>(params.written) / total_blocks),
@@ -1902,19 +3649,40 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   rc = 0;
 
 pbiudone:
-  if (params.canwrite) {
-    pthread_mutex_lock(&params.nti.mu);
-    if (params.nti.receiver_available) {
+  params.command_stats.Log();
+  if (block_access) {
+    updater->GetRuntime()->RestoreBlockQueues(block_device_path);
+  }
+  if (params.pipeline != nullptr) {
+    LOG(INFO) << "read ahead source blocks for " << params.pipeline->hits() << " commands ("
+              << params.pipeline->misses() << " misses), patched " << params.pipeline->patched()
+              << " commands ahead of time";
+    params.pipeline->Stop();
+  }
+
+  // Cover the commands that have been executed (successfully) with a checkpoint, whether or not the
+  // update is done.
+  if (params.canwrite && !CheckpointCommands(params)) {
+    rc = -1;
+  }
+
+  if (params.canwrite && params.nti.stored_data != nullptr) {
+    if (params.nti.stored_offset != params.nti.stored_size) {
+      LOG(WARNING) << (params.nti.stored_size - params.nti.stored_offset)
+                   << " bytes of new data left after executing all commands.";
+    }
+  } else if (params.canwrite) {
+    if (!params.nti.ring->closed()) {
       LOG(WARNING) << "new data receiver is still available after executing all commands.";
     }
-    params.nti.receiver_available = false;
-    pthread_cond_broadcast(&params.nti.cv);
-    pthread_mutex_unlock(&params.nti.mu);
+    params.nti.ring->Abort();
     int ret = pthread_join(params.thread, nullptr);
     if (ret != 0) {
       LOG(WARNING) << "pthread join returned with " << strerror(ret);
     }
+  }
 
+  if (params.canwrite) {
     if (rc == 0) {
       LOG(INFO) << "wrote " << params.written << " blocks; expected " << total_blocks;
       LOG(INFO) << "stashed " << params.stashed << " blocks";
@@ -1925,6 +3693,9 @@ pbiudone:
         updater->WriteToCommandPipe(
             android::base::StringPrintf("log bytes_written_%s: %" PRIu64, partition + 1,
                                         static_cast<uint64_t>(params.written) * BLOCKSIZE));
+        for (const auto& line : params.command_stats.FormatForInstallLog(partition + 1)) {
+          updater->WriteToCommandPipe("log " + line);
+        }
         updater->WriteToCommandPipe(
             android::base::StringPrintf("log bytes_stashed_%s: %" PRIu64, partition + 1,
                                         static_cast<uint64_t>(params.stashed) * BLOCKSIZE),
@@ -1942,15 +3713,12 @@ pbiudone:
         LOG(WARNING) << "Failed to set updated marker; continuing";
       }
     }
-
-    pthread_mutex_destroy(&params.nti.mu);
-    pthread_cond_destroy(&params.nti.cv);
   } else if (rc == 0) {
     LOG(INFO) << "verified partition contents; update may be resumed";
   }
 
-  if (fsync(params.fd) == -1) {
-    failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
+  if (Fsync(params.fd, context.io_trace_device) == -1) {
+    context.failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
     PLOG(ERROR) << "fsync failed";
   }
   // params.fd will be automatically closed because it's a unique_fd.
@@ -1958,6 +3726,9 @@ pbiudone:
   if (params.nti.brotli_decoder_state != nullptr) {
     BrotliDecoderDestroyInstance(params.nti.brotli_decoder_state);
   }
+  if (params.nti.zstd_decoder_state != nullptr) {
+    ZSTD_freeDCtx(params.nti.zstd_decoder_state);
+  }
 
   // Delete the last command file if the update cannot be resumed.
   if (params.isunresumable) {
@@ -1970,8 +3741,8 @@ pbiudone:
     DeleteStash(params.stashbase);
   }
 
-  if (failure_type != kNoCause && state->cause_code == kNoCause) {
-    state->cause_code = failure_type;
+  if (context.failure_type != kNoCause && state->cause_code == kNoCause) {
+    state->cause_code = context.failure_type;
   }
 
   return StringValue(rc == 0 ? "t" : "");
@@ -2028,6 +3799,7 @@ Value* BlockImageVerifyFn(const char* name, State* state,
     // clang-format off
     { Command::Type::ABORT,             PerformCommandAbort },
     { Command::Type::BSDIFF,            PerformCommandDiff },
+    { Command::Type::COMPUTE_FEC,       nullptr },
     { Command::Type::COMPUTE_HASH_TREE, nullptr },
     { Command::Type::ERASE,             nullptr },
     { Command::Type::FREE,              PerformCommandFree },
@@ -2050,6 +3822,7 @@ Value* BlockImageUpdateFn(const char* name, State* state,
     // clang-format off
     { Command::Type::ABORT,             PerformCommandAbort },
     { Command::Type::BSDIFF,            PerformCommandDiff },
+    { Command::Type::COMPUTE_FEC,       PerformCommandComputeFec },
     { Command::Type::COMPUTE_HASH_TREE, PerformCommandComputeHashTree },
     { Command::Type::ERASE,             PerformCommandErase },
     { Command::Type::FREE,              PerformCommandFree },
@@ -2106,32 +3879,72 @@ Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique
   RangeSet rs = RangeSet::Parse(ranges->data);
   CHECK(static_cast<bool>(rs));
 
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  if (!RangeSha1(fd, rs, BLOCKSIZE, digest)) {
+    CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
+    ErrorAbort(state, cause_code, "failed to read %s: %s", block_device_path.c_str(),
+               strerror(errno));
+    return StringValue("");
+  }
 
-  std::vector<uint8_t> buffer(BLOCKSIZE);
-  for (const auto& [begin, end] : rs) {
-    if (!check_lseek(fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      ErrorAbort(state, kLseekFailure, "failed to seek %s: %s", block_device_path.c_str(),
-                 strerror(errno));
-      return StringValue("");
-    }
+  return StringValue(print_sha1(digest));
+}
 
-    for (size_t j = begin; j < end; ++j) {
-      if (!android::base::ReadFully(fd, buffer.data(), BLOCKSIZE)) {
-        CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
-        ErrorAbort(state, cause_code, "failed to read %s: %s", block_device_path.c_str(),
-                   strerror(errno));
-        return StringValue("");
-      }
+// range_sha256_tree(blockdev, ranges, groups)
+//   Returns the tree digest of the given ranges in hex; see RangeSha256Tree(). Unlike range_sha1(),
+//   the groups (the leaves of the tree) are hashed in parallel. The number of threads comes from
+//   ro.updater.hash_threads, and doesn't affect the result.
+Value* RangeSha256TreeFn(const char* name, State* state,
+                         const std::vector<std::unique_ptr<Expr>>& argv) {
+  if (argv.size() != 3) {
+    ErrorAbort(state, kArgsParsingFailure, "%s expects 3 arguments, got %zu", name, argv.size());
+    return StringValue("");
+  }
 
-      SHA1_Update(&ctx, buffer.data(), BLOCKSIZE);
-    }
+  std::vector<std::string> args;
+  if (!ReadArgs(state, argv, &args)) {
+    return nullptr;
   }
-  uint8_t digest[SHA_DIGEST_LENGTH];
-  SHA1_Final(digest, &ctx);
 
-  return StringValue(print_sha1(digest));
+  const std::string& blockdev_filename = args[0];
+  RangeSet rs = RangeSet::Parse(args[1]);
+  if (!rs) {
+    ErrorAbort(state, kArgsParsingFailure, "invalid ranges argument to %s: %s", name,
+               args[1].c_str());
+    return StringValue("");
+  }
+  size_t groups;
+  if (!android::base::ParseUint(args[2], &groups) || groups == 0) {
+    ErrorAbort(state, kArgsParsingFailure, "invalid groups argument to %s: %s", name,
+               args[2].c_str());
+    return StringValue("");
+  }
+
+  auto block_device_path = state->updater->FindBlockDeviceName(blockdev_filename);
+  if (block_device_path.empty()) {
+    LOG(ERROR) << "Block device path for " << blockdev_filename << " not found. " << name
+               << " failed.";
+    return StringValue("");
+  }
+
+  android::base::unique_fd fd(open(block_device_path.c_str(), O_RDONLY));
+  if (fd == -1) {
+    CauseCode cause_code = errno == EIO ? kEioFailure : kFileOpenFailure;
+    ErrorAbort(state, cause_code, "open \"%s\" failed: %s", block_device_path.c_str(),
+               strerror(errno));
+    return StringValue("");
+  }
+
+  size_t threads = GetHashThreads(state->updater->GetRuntime(), name);
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  if (!RangeSha256Tree(fd, rs, groups, BLOCKSIZE, threads, digest)) {
+    CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
+    ErrorAbort(state, cause_code, "failed to read %s: %s", block_device_path.c_str(),
+               strerror(errno));
+    return StringValue("");
+  }
+
+  return StringValue(print_sha1(digest, SHA256_DIGEST_LENGTH));
 }
 
 // This function checks if a device has been remounted R/W prior to an incremental
@@ -2166,6 +3979,7 @@ Value* CheckFirstBlockFn(const char* name, State* state,
     return StringValue("");
   }
 
+  context.io_trace_device = IoTracer::Get().FileId(block_device_path);
   android::base::unique_fd fd(open(block_device_path.c_str(), O_RDONLY));
   if (fd == -1) {
     CauseCode cause_code = errno == EIO ? kEioFailure : kFileOpenFailure;
@@ -2175,7 +3989,7 @@ Value* CheckFirstBlockFn(const char* name, State* state,
   }
 
   RangeSet blk0(std::vector<Range>{ Range{ 0, 1 } });
-  std::vector<uint8_t> block0_buffer(BLOCKSIZE);
+  BlockBuffer block0_buffer(BLOCKSIZE);
 
   if (ReadBlocks(blk0, &block0_buffer, fd) == -1) {
     CauseCode cause_code = errno == EIO ? kEioFailure : kFreadFailure;
@@ -2264,32 +4078,102 @@ Value* BlockImageRecoverFn(const char* name, State* state,
     return StringValue("");
   }
 
-  uint8_t buffer[BLOCKSIZE];
+  // Stay within the data area, libfec validates and corrects metadata.
+  uint64_t data_blocks = (status.data_size + BLOCKSIZE - 1) / BLOCKSIZE;
+  std::vector<Range> data_ranges;
   for (const auto& [begin, end] : rs) {
-    for (size_t j = begin; j < end; ++j) {
-      // Stay within the data area, libfec validates and corrects metadata
-      if (status.data_size <= static_cast<uint64_t>(j) * BLOCKSIZE) {
-        continue;
-      }
+    if (begin < data_blocks) {
+      data_ranges.push_back(Range{ begin, std::min<uint64_t>(end, data_blocks) });
+    }
+  }
+  if (data_ranges.empty()) {
+    LOG(INFO) << "..." << block_device_path << " image recovered successfully.";
+    return StringValue("t");
+  }
 
-      if (fh.pread(buffer, BLOCKSIZE, static_cast<off64_t>(j) * BLOCKSIZE) != BLOCKSIZE) {
-        ErrorAbort(state, kLibfecFailure, "failed to recover %s (block %zu): %s",
-                   block_device_path.c_str(), j, strerror(errno));
-        return StringValue("");
+  // The groups are recovered in parallel, each through its own handle since libfec handles aren't
+  // thread-safe, and read in batches of blocks that libfec checks (and corrects) one by one.
+  size_t threads = std::max<size_t>(
+      1, GetThreadsProperty(state->updater->GetRuntime(), "ro.updater.recover_threads",
+                            kMaxDefaultRecoverThreads, std::string(name) + " threads"));
+  std::vector<RangeSet> groups = RangeSet(std::move(data_ranges)).Split(threads);
+
+  std::mutex error_mutex;
+  std::string error;
+  std::atomic<bool> failed{ false };
+  std::atomic<uint64_t> corrected{ 0 };
+  auto recover_group = [&](const RangeSet& group) {
+    auto fail = [&](const std::string& message) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!failed.exchange(true)) {
+        error = message;
+      }
+    };
+    fec::io group_fh(block_device_path, O_RDWR);
+    fec_status group_status;
+    if (!group_fh || !group_fh.get_status(group_status)) {
+      fail(android::base::StringPrintf("fec_open \"%s\" failed: %s", block_device_path.c_str(),
+                                       strerror(errno)));
+      return;
+    }
+    uint64_t errors_before = group_status.errors;
+
+    std::vector<uint8_t> buffer(kRecoverBatchBlocks * BLOCKSIZE);
+    for (const auto& [begin, end] : group) {
+      for (size_t j = begin; j < end && !failed; j += kRecoverBatchBlocks) {
+        size_t count = std::min<size_t>(kRecoverBatchBlocks, end - j);
+        if (group_fh.pread(buffer.data(), count * BLOCKSIZE, static_cast<off64_t>(j) * BLOCKSIZE) ==
+            static_cast<ssize_t>(count * BLOCKSIZE)) {
+          continue;
+        }
+        // Go over the batch block by block, to tell which one can't be recovered.
+        for (size_t k = j; k < j + count; k++) {
+          if (group_fh.pread(buffer.data(), BLOCKSIZE, static_cast<off64_t>(k) * BLOCKSIZE) !=
+              BLOCKSIZE) {
+            fail(android::base::StringPrintf("failed to recover %s (block %zu): %s",
+                                             block_device_path.c_str(), k, strerror(errno)));
+            return;
+          }
+        }
       }
+    }
 
-      // If we want to be able to recover from a situation where rewriting a corrected
-      // block doesn't guarantee the same data will be returned when re-read later, we
-      // can save a copy of corrected blocks to /cache. Note:
-      //
-      //  1. Maximum space required from /cache is the same as the maximum number of
-      //     corrupted blocks we can correct. For RS(255, 253) and a 2 GiB partition,
-      //     this would be ~16 MiB, for example.
-      //
-      //  2. To find out if this block was corrupted, call fec_get_status after each
-      //     read and check if the errors field value has increased.
+    // If we want to be able to recover from a situation where rewriting a corrected
+    // block doesn't guarantee the same data will be returned when re-read later, we
+    // can save a copy of corrected blocks to /cache. Note:
+    //
+    //  1. Maximum space required from /cache is the same as the maximum number of
+    //     corrupted blocks we can correct. For RS(255, 253) and a 2 GiB partition,
+    //     this would be ~16 MiB, for example.
+    //
+    //  2. To find out if a block was corrupted, call fec_get_status after each
+    //     read and check if the errors field value has increased.
+    if (group_fh.get_status(group_status)) {
+      corrected += group_status.errors - errors_before;
     }
+  };
+
+  std::atomic<size_t> next_group{ 0 };
+  auto worker = [&]() {
+    for (size_t i = next_group++; i < groups.size() && !failed; i = next_group++) {
+      recover_group(groups[i]);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < groups.size(); i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+
+  if (failed) {
+    ErrorAbort(state, kLibfecFailure, "%s", error.c_str());
+    return StringValue("");
   }
+  LOG(INFO) << "Corrected " << corrected << " errors in " << block_device_path << " with "
+            << groups.size() << " threads";
   LOG(INFO) << "..." << block_device_path << " image recovered successfully.";
   return StringValue("t");
 }
@@ -2300,4 +4184,5 @@ void RegisterBlockImageFunctions() {
   RegisterFunction("block_image_recover", BlockImageRecoverFn);
   RegisterFunction("check_first_block", CheckFirstBlockFn);
   RegisterFunction("range_sha1", RangeSha1Fn);
+  RegisterFunction("range_sha256_tree", RangeSha256TreeFn);
 }
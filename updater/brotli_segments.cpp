@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/brotli_segments.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <brotli/decode.h>
+
+bool ParseBrotliSegmentIndex(const std::string& content, size_t compressed_size,
+                             std::vector<CompressedSegment>* segments, std::string* err) {
+  CHECK(segments != nullptr);
+  CHECK(err != nullptr);
+
+  std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
+  if (lines.empty() || lines[0] != "1") {
+    *err = "unsupported segment index version: " + (lines.empty() ? "" : lines[0]);
+    return false;
+  }
+
+  segments->clear();
+  size_t offset = 0;
+  for (size_t i = 1; i < lines.size(); i++) {
+    std::vector<std::string> tokens = android::base::Split(lines[i], " ");
+    CompressedSegment segment{ offset, 0, 0 };
+    if (tokens.size() != 2 || !android::base::ParseUint(tokens[0], &segment.compressed_size) ||
+        !android::base::ParseUint(tokens[1], &segment.size) || segment.compressed_size == 0) {
+      *err = android::base::StringPrintf("invalid segment at line %zu: %s", i + 1,
+                                         lines[i].c_str());
+      return false;
+    }
+    if (segment.compressed_size > compressed_size - offset) {
+      *err = android::base::StringPrintf("segment at line %zu exceeds the compressed size %zu",
+                                         i + 1, compressed_size);
+      return false;
+    }
+    offset += segment.compressed_size;
+    segments->push_back(segment);
+  }
+
+  if (offset != compressed_size) {
+    *err = android::base::StringPrintf("segments cover %zu bytes; expected %zu", offset,
+                                       compressed_size);
+    return false;
+  }
+  return true;
+}
+
+bool DecompressSegments(const uint8_t* data, const std::vector<CompressedSegment>& segments,
+                        size_t num_threads, const SegmentDecoder& decoder,
+                        const std::function<bool(const uint8_t*, size_t)>& sink) {
+  num_threads = std::max<size_t>(num_threads, 1);
+  const size_t window = 2 * num_threads;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  // The following are guarded by mutex.
+  // The next segment for the workers to pick up, and the next one to hand to the sink.
+  size_t next_segment = 0;
+  size_t next_output = 0;
+  bool failed = false;
+  // The decompressed segments that are yet to be handed to the sink.
+  std::map<size_t, std::vector<uint8_t>> outputs;
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&] {
+        return failed || next_segment == segments.size() || next_segment < next_output + window;
+      });
+      if (failed || next_segment == segments.size()) {
+        return;
+      }
+      size_t index = next_segment++;
+      lock.unlock();
+
+      const CompressedSegment& segment = segments[index];
+      std::vector<uint8_t> output(segment.size);
+      bool success =
+          decoder(data + segment.offset, segment.compressed_size, output.data(), output.size());
+      if (!success) {
+        LOG(ERROR) << "Failed to decompress segment " << index;
+      }
+
+      lock.lock();
+      if (success) {
+        outputs.emplace(index, std::move(output));
+      } else {
+        failed = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < std::min(num_threads, segments.size()); i++) {
+    workers.emplace_back(worker);
+  }
+
+  bool success = true;
+  while (true) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] {
+      return failed || next_output == segments.size() || outputs.count(next_output) != 0;
+    });
+    if (failed) {
+      success = false;
+      break;
+    }
+    if (next_output == segments.size()) {
+      break;
+    }
+
+    std::vector<uint8_t> output = std::move(outputs[next_output]);
+    outputs.erase(next_output);
+    lock.unlock();
+
+    // The sink may block for a while (e.g. on a full ring buffer), so call it without the lock.
+    bool sink_result = output.empty() || sink(output.data(), output.size());
+
+    lock.lock();
+    if (!sink_result) {
+      failed = true;
+      success = false;
+      cv.notify_all();
+      break;
+    }
+    next_output++;
+    cv.notify_all();
+  }
+
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  return success;
+}
+
+bool DecompressBrotliSegments(const uint8_t* data, const std::vector<CompressedSegment>& segments,
+                              size_t num_threads,
+                              const std::function<bool(const uint8_t*, size_t)>& sink) {
+  auto decoder = [](const uint8_t* in, size_t compressed_size, uint8_t* out, size_t size) {
+    size_t decoded_size = size;
+    BrotliDecoderResult result = BrotliDecoderDecompress(compressed_size, in, &decoded_size, out);
+    if (result != BROTLI_DECODER_RESULT_SUCCESS || decoded_size != size) {
+      LOG(ERROR) << "Brotli decompression failed (result " << result << ", got " << decoded_size
+                 << " bytes; expected " << size << ")";
+      return false;
+    }
+    return true;
+  };
+  return DecompressSegments(data, segments, num_threads, decoder, sink);
+}
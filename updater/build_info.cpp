@@ -18,7 +18,12 @@
 
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
 #include <set>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -27,6 +32,10 @@
 
 #include "updater/target_files.h"
 
+// Upper bound of the number of threads that extract the images in ParseTargetFile(). Each of them
+// inflates one image at a time, and unsparses it if needed.
+static constexpr size_t kMaxExtractImageThreads = 4;
+
 bool BuildInfo::ParseTargetFile(const std::string_view target_file_path, bool extracted_input) {
   TargetFile target_file(std::string(target_file_path), extracted_input);
   if (!target_file.Open()) {
@@ -42,6 +51,8 @@ bool BuildInfo::ParseTargetFile(const std::string_view target_file_path, bool ex
     return false;
   }
 
+  // Find the image for each partition first, and then extract and unsparse them in parallel.
+  std::vector<std::pair<const FstabInfo*, std::string>> images;
   for (const auto& fstab_info : fstab_info_list) {
     for (const auto& directory : { "IMAGES", "RADIO" }) {
       std::string entry_name = directory + fstab_info.mount_point + ".img";
@@ -49,38 +60,82 @@ bool BuildInfo::ParseTargetFile(const std::string_view target_file_path, bool ex
         LOG(WARNING) << "Failed to find the image entry in the target file: " << entry_name;
         continue;
       }
+      images.emplace_back(&fstab_info, std::move(entry_name));
+      break;
+    }
+  }
+
+  std::vector<TemporaryFile*> image_files;
+  for (size_t i = 0; i < images.size(); i++) {
+    temp_files_.emplace_back(work_dir_);
+    image_files.push_back(&temp_files_.back());
+  }
 
-      temp_files_.emplace_back(work_dir_);
-      auto& image_file = temp_files_.back();
-      if (!target_file.ExtractImage(entry_name, fstab_info, work_dir_, &image_file)) {
+  std::atomic<size_t> next_image{ 0 };
+  std::atomic<bool> failed{ false };
+  auto extract_images = [&]() {
+    for (size_t i = next_image++; i < images.size() && !failed; i = next_image++) {
+      const auto& [fstab_info, entry_name] = images[i];
+      if (!target_file.ExtractImage(entry_name, *fstab_info, work_dir_, image_files[i])) {
         LOG(ERROR) << "Failed to set up source image files.";
-        return false;
+        failed = true;
       }
+    }
+  };
+  size_t jobs = std::min<size_t>(
+      { std::thread::hardware_concurrency(), kMaxExtractImageThreads, images.size() });
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < jobs; ++i) {
+    workers.emplace_back(extract_images);
+  }
+  extract_images();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  if (failed) {
+    return false;
+  }
 
-      std::string mapped_path = image_file.path;
-      // Rename the images to more readable ones if we want to keep the image.
-      if (keep_images_) {
-        mapped_path = work_dir_ + fstab_info.mount_point + ".img";
-        image_file.release();
-        if (rename(image_file.path, mapped_path.c_str()) != 0) {
-          PLOG(ERROR) << "Failed to rename " << image_file.path << " to " << mapped_path;
-          return false;
-        }
+  for (size_t i = 0; i < images.size(); i++) {
+    const FstabInfo& fstab_info = *images[i].first;
+    auto& image_file = *image_files[i];
+    std::string mapped_path = image_file.path;
+    // Rename the images to more readable ones if we want to keep the image.
+    if (keep_images_) {
+      mapped_path = work_dir_ + fstab_info.mount_point + ".img";
+      image_file.release();
+      if (rename(image_file.path, mapped_path.c_str()) != 0) {
+        PLOG(ERROR) << "Failed to rename " << image_file.path << " to " << mapped_path;
+        return false;
       }
+    }
 
-      LOG(INFO) << "Mounted " << fstab_info.mount_point << "\nMapping: " << fstab_info.blockdev_name
-                << " to " << mapped_path;
+    LOG(INFO) << "Mounted " << fstab_info.mount_point << "\nMapping: " << fstab_info.blockdev_name
+              << " to " << mapped_path;
 
-      blockdev_map_.emplace(
-          fstab_info.blockdev_name,
-          FakeBlockDevice(fstab_info.blockdev_name, fstab_info.mount_point, mapped_path));
-      break;
-    }
+    blockdev_map_.emplace(
+        fstab_info.blockdev_name,
+        FakeBlockDevice(fstab_info.blockdev_name, fstab_info.mount_point, mapped_path));
   }
 
   return true;
 }
 
+bool BuildInfo::CopyImages(const std::string_view dir) {
+  for (auto& [name, blockdev] : blockdev_map_) {
+    std::string copy_path = std::string(dir) + blockdev.mount_point + ".img";
+    std::error_code ec;
+    if (!std::filesystem::copy_file(blockdev.mounted_file_path, copy_path,
+                                    std::filesystem::copy_options::overwrite_existing, ec)) {
+      LOG(ERROR) << "Failed to copy " << blockdev.mounted_file_path << " to " << copy_path << ": "
+                 << ec.message();
+      return false;
+    }
+    blockdev.mounted_file_path = std::move(copy_path);
+  }
+  return true;
+}
+
 std::string BuildInfo::GetProperty(const std::string_view key,
                                    const std::string_view default_value) const {
   // The logic to parse the ro.product properties should be in line with the generation script.
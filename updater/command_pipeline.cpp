@@ -0,0 +1,417 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/command_pipeline.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <applypatch/applypatch.h>
+#include <openssl/sha.h>
+
+#include "edify/expr.h"
+#include "otautil/print_sha1.h"
+#include "otautil/rangeset.h"
+#include "private/commands.h"
+
+static std::string Sha1Hex(const uint8_t* data, size_t size) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(data, size, digest);
+  return print_sha1(digest);
+}
+
+CommandPipeline::CommandPipeline(int fd, const TransferList& transfer_list,
+                                 size_t max_buffered_bytes)
+    : fd_(fcntl(fd, F_DUPFD_CLOEXEC, 0)),
+      block_size_(Command().block_size()),
+      max_buffered_bytes_(max_buffered_bytes) {
+  if (fd_ == -1) {
+    PLOG(ERROR) << "Failed to dup " << fd << " for the command pipeline";
+    return;
+  }
+  BuildPlan(transfer_list.commands());
+}
+
+CommandPipeline::~CommandPipeline() {
+  Stop();
+}
+
+void CommandPipeline::BuildPlan(const std::vector<Command>& commands) {
+  // The blocks written by the commands seen so far, as a map from the start of each range to its
+  // end. Ranges in the map are disjoint and never adjacent.
+  std::map<size_t, size_t> written;
+
+  auto overlaps_written = [&written](const RangeSet& ranges) {
+    for (const auto& [begin, end] : ranges) {
+      auto it = written.upper_bound(begin);
+      if (it != written.begin() && std::prev(it)->second > begin) {
+        return true;
+      }
+      if (it != written.end() && it->first < end) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  auto mark_written = [&written](const RangeSet& ranges) {
+    for (auto [begin, end] : ranges) {
+      auto it = written.upper_bound(begin);
+      if (it != written.begin() && std::prev(it)->second >= begin) {
+        --it;
+        begin = it->first;
+        end = std::max(end, it->second);
+        it = written.erase(it);
+      }
+      while (it != written.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = written.erase(it);
+      }
+      written.emplace(begin, end);
+    }
+  };
+
+  for (const auto& command : commands) {
+    const RangeSet* src = nullptr;
+    switch (command.type()) {
+      case Command::Type::MOVE:
+      case Command::Type::BSDIFF:
+      case Command::Type::IMGDIFF:
+        src = &command.source().ranges();
+        break;
+      case Command::Type::STASH:
+        src = &command.stash().ranges();
+        break;
+      default:
+        break;
+    }
+
+    if (src != nullptr && *src) {
+      if (overlaps_written(*src)) {
+        LOG(WARNING) << "Not reading ahead for command " << command.index()
+                     << ", whose source blocks are written by earlier commands";
+      } else if (src->blocks() * block_size_ <= max_buffered_bytes_) {
+        PlanEntry entry{ command.index(), *src, false, command.type(), {}, {}, {}, 0 };
+        const SourceInfo& source = command.source();
+        if ((command.type() == Command::Type::BSDIFF || command.type() == Command::Type::IMGDIFF) &&
+            source.blocks() == src->blocks() && !source.location() && source.stashes().empty()) {
+          entry.patchable = true;
+          entry.patch = command.patch();
+          entry.src_hash = source.hash();
+          entry.tgt_hash = command.target().hash();
+          entry.tgt_blocks = command.target().blocks();
+        }
+        plan_.push_back(std::move(entry));
+      }
+    }
+
+    mark_written(command.target().ranges());
+    if (command.type() == Command::Type::COMPUTE_HASH_TREE) {
+      mark_written(command.hash_tree_info().hash_tree_ranges());
+    } else if (command.type() == Command::Type::COMPUTE_FEC) {
+      mark_written(command.fec_info().fec_ranges());
+    }
+  }
+}
+
+void CommandPipeline::EnablePatching(const uint8_t* patch_data, size_t num_threads) {
+  CHECK(!thread_.joinable());
+  patch_data_ = patch_data;
+  num_workers_ = patch_data == nullptr ? 0 : num_threads;
+}
+
+bool CommandPipeline::Start() {
+  if (fd_ == -1 || plan_.empty() || max_buffered_bytes_ == 0) {
+    return false;
+  }
+
+  LOG(INFO) << "Reading ahead source blocks for " << plan_.size() << " commands, using up to "
+            << max_buffered_bytes_ << " bytes and " << num_workers_ << " patch workers";
+  thread_ = std::thread(&CommandPipeline::ThreadLoop, this);
+  for (size_t i = 0; i < num_workers_; i++) {
+    workers_.emplace_back(&CommandPipeline::WorkerLoop, this);
+  }
+  return true;
+}
+
+void CommandPipeline::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    cv_.notify_all();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffered_.clear();
+  patch_jobs_.clear();
+  buffered_bytes_ = 0;
+}
+
+void CommandPipeline::Advance(size_t index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  AdvanceLocked(index);
+}
+
+void CommandPipeline::AdvanceLocked(size_t index) {
+  if (index < current_index_) {
+    return;
+  }
+  current_index_ = index;
+  for (auto it = buffered_.begin(); it != buffered_.end() && it->first < index;) {
+    buffered_bytes_ -= it->second.data->size();
+    it = buffered_.erase(it);
+  }
+  for (auto it = patch_jobs_.begin(); it != patch_jobs_.end() && it->first < index;) {
+    if (it->second.state == PatchJob::State::RUNNING) {
+      // The worker drops it once done.
+      it->second.abandoned = true;
+      it++;
+      continue;
+    }
+    buffered_bytes_ -= it->second.entry->tgt_blocks * block_size_;
+    it = patch_jobs_.erase(it);
+  }
+  cv_.notify_all();
+}
+
+bool CommandPipeline::Plans(size_t index) const {
+  auto entry = std::lower_bound(
+      plan_.cbegin(), plan_.cend(), index,
+      [](const PlanEntry& plan_entry, size_t value) { return plan_entry.index < value; });
+  return thread_.joinable() && entry != plan_.cend() && entry->index == index;
+}
+
+bool CommandPipeline::TakeSourceBlocks(size_t index, const RangeSet& ranges, uint8_t* buffer) {
+  auto entry = std::lower_bound(
+      plan_.cbegin(), plan_.cend(), index,
+      [](const PlanEntry& plan_entry, size_t value) { return plan_entry.index < value; });
+  if (!thread_.joinable() || entry == plan_.cend() || entry->index != index ||
+      entry->ranges != ranges) {
+    misses_++;
+    return false;
+  }
+  size_t position = entry - plan_.cbegin();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  AdvanceLocked(index);
+  // The thread reads the entries in order, and it skips past everything before |index| now. So if
+  // it hasn't got to |index| yet, it will do so right away; waiting for it is as cheap as reading
+  // the blocks here.
+  cv_.wait(lock, [this, position, index] {
+    return stopped_ || (position < next_entry_ && (!reading_ || reading_index_ != index));
+  });
+
+  auto it = buffered_.find(index);
+  if (it == buffered_.end()) {
+    misses_++;
+    return false;
+  }
+
+  const std::vector<uint8_t>& data = *it->second.data;
+  memcpy(buffer, data.data(), data.size());
+  buffered_bytes_ -= data.size();
+  buffered_.erase(it);
+  cv_.notify_all();
+
+  hits_++;
+  return true;
+}
+
+bool CommandPipeline::TakePatchedBlocks(size_t index, BlockBuffer* output) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = patch_jobs_.find(index);
+  if (it == patch_jobs_.end()) {
+    return false;
+  }
+
+  PatchJob& job = it->second;
+  if (job.state == PatchJob::State::QUEUED) {
+    // No worker has got to it yet; patch the buffered source on the caller thread instead.
+    job.state = PatchJob::State::RUNNING;
+    lock.unlock();
+    bool success = ApplyPatch(*job.entry, *job.source, &job.output);
+    lock.lock();
+    job.state = success ? PatchJob::State::DONE : PatchJob::State::FAILED;
+  } else {
+    // Applying the patch again would only take longer than waiting for the running worker.
+    cv_.wait(lock, [this, &job] { return stopped_ || job.state != PatchJob::State::RUNNING; });
+    if (stopped_) {
+      return false;
+    }
+  }
+
+  bool success = job.state == PatchJob::State::DONE;
+  if (success) {
+    *output = std::move(job.output);
+    patched_++;
+  }
+  buffered_bytes_ -= job.entry->tgt_blocks * block_size_;
+  patch_jobs_.erase(it);
+  cv_.notify_all();
+  return success;
+}
+
+void CommandPipeline::ThreadLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    // Skip the commands that have been executed already.
+    while (next_entry_ < plan_.size() && plan_[next_entry_].index < current_index_) {
+      next_entry_++;
+    }
+    if (next_entry_ == plan_.size()) {
+      break;
+    }
+
+    const PlanEntry& entry = plan_[next_entry_];
+    size_t bytes = entry.ranges.blocks() * block_size_;
+    if (buffered_bytes_ + bytes > max_buffered_bytes_) {
+      cv_.wait(lock);
+      continue;
+    }
+
+    // Reserve the space before dropping the lock.
+    next_entry_++;
+    buffered_bytes_ += bytes;
+    reading_ = true;
+    reading_index_ = entry.index;
+    lock.unlock();
+
+    std::vector<uint8_t> data;
+    bool success = ReadRanges(entry.ranges, &data);
+
+    lock.lock();
+    reading_ = false;
+    if (success && !stopped_ && entry.index >= current_index_) {
+      auto source = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+      buffered_.emplace(entry.index, BufferedEntry{ entry.ranges, source });
+
+      size_t tgt_bytes = entry.tgt_blocks * block_size_;
+      if (num_workers_ > 0 && entry.patchable &&
+          buffered_bytes_ + tgt_bytes <= max_buffered_bytes_) {
+        buffered_bytes_ += tgt_bytes;
+        patch_jobs_.emplace(entry.index,
+                            PatchJob{ PatchJob::State::QUEUED, &entry, source, {}, false });
+      }
+    } else {
+      buffered_bytes_ -= bytes;
+    }
+    cv_.notify_all();
+  }
+}
+
+void CommandPipeline::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // Pick the earliest queued job, since that's the one the caller needs first.
+    auto job = patch_jobs_.end();
+    cv_.wait(lock, [this, &job] {
+      if (stopped_) {
+        return true;
+      }
+      job = std::find_if(patch_jobs_.begin(), patch_jobs_.end(), [](const auto& item) {
+        return item.second.state == PatchJob::State::QUEUED;
+      });
+      return job != patch_jobs_.end();
+    });
+    if (stopped_) {
+      break;
+    }
+
+    size_t index = job->first;
+    PatchJob& patch_job = job->second;
+    patch_job.state = PatchJob::State::RUNNING;
+    lock.unlock();
+
+    // The job stays in the map while RUNNING, so the reference remains valid.
+    BlockBuffer output;
+    bool success = ApplyPatch(*patch_job.entry, *patch_job.source, &output);
+
+    lock.lock();
+    if (patch_job.abandoned) {
+      buffered_bytes_ -= patch_job.entry->tgt_blocks * block_size_;
+      patch_jobs_.erase(index);
+    } else {
+      patch_job.state = success ? PatchJob::State::DONE : PatchJob::State::FAILED;
+      patch_job.output = std::move(output);
+      // The source is no longer needed by the job.
+      patch_job.source.reset();
+    }
+    cv_.notify_all();
+  }
+}
+
+bool CommandPipeline::ApplyPatch(const PlanEntry& entry, const std::vector<uint8_t>& source,
+                                 BlockBuffer* output) const {
+  if (Sha1Hex(source.data(), source.size()) != entry.src_hash) {
+    LOG(WARNING) << "Not patching command " << entry.index << " ahead of time: unexpected source";
+    return false;
+  }
+
+  size_t tgt_size = entry.tgt_blocks * block_size_;
+  output->clear();
+  output->reserve(tgt_size);
+  SinkFn sink = [output, tgt_size](const unsigned char* data, size_t len) -> size_t {
+    // Overrun; let the caller report the error when it applies the patch by itself.
+    if (output->size() + len > tgt_size) {
+      return 0;
+    }
+    output->insert(output->end(), data, data + len);
+    return len;
+  };
+
+  Value patch(std::string_view(reinterpret_cast<const char*>(patch_data_ + entry.patch.offset()),
+                               entry.patch.length()));
+  int result = entry.type == Command::Type::IMGDIFF
+                   ? ApplyImagePatch(source.data(), source.size(), patch, sink, nullptr)
+                   : ApplyBSDiffPatch(source.data(), source.size(), patch, 0, sink);
+  if (result != 0 || output->size() != tgt_size) {
+    return false;
+  }
+  return Sha1Hex(output->data(), output->size()) == entry.tgt_hash;
+}
+
+bool CommandPipeline::ReadRanges(const RangeSet& ranges, std::vector<uint8_t>* buffer) const {
+  buffer->resize(ranges.blocks() * block_size_);
+  size_t pos = 0;
+  for (const auto& [begin, end] : ranges) {
+    size_t size = (end - begin) * block_size_;
+    if (!android::base::ReadFullyAtOffset(fd_, buffer->data() + pos, size,
+                                          static_cast<off64_t>(begin) * block_size_)) {
+      // Leave it to the main thread to report the error, if the blocks are still needed.
+      PLOG(WARNING) << "Failed to read ahead " << size << " bytes at block " << begin;
+      return false;
+    }
+    pos += size;
+  }
+  return true;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/command_stats.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+// The names match the commands in the transfer list.
+static constexpr const char* kCommandTypeNames[] = {
+  "abort", "bsdiff", "compute_fec", "compute_hash_tree", "erase",
+  "free", "imgdiff", "move", "new", "stash", "zero",
+};
+static_assert(sizeof(kCommandTypeNames) / sizeof(kCommandTypeNames[0]) ==
+                  static_cast<size_t>(Command::Type::LAST),
+              "Mismatching number of command type names");
+
+static constexpr const char* kSubPhaseNames[] = { "read", "patch", "write", "fsync" };
+static_assert(sizeof(kSubPhaseNames) / sizeof(kSubPhaseNames[0]) ==
+                  static_cast<size_t>(CommandSubPhase::kCount),
+              "Mismatching number of sub-phase names");
+
+// The stats of the command running on this thread, and the innermost sub-phase within it.
+static thread_local std::array<uint64_t, static_cast<size_t>(CommandSubPhase::kCount)>*
+    current_sub_phases = nullptr;
+static thread_local CommandStats::ScopedSubPhase* current_sub_phase = nullptr;
+
+static uint64_t NowUs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t ThreadCpuUs() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+size_t LatencyHistogram::BucketIndex(uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  // The position of the highest bit picks the power of two, and the kSubBucketBits bits below it
+  // pick the sub-bucket.
+  size_t magnitude = 63 - __builtin_clzll(value);
+  size_t shift = magnitude - kSubBucketBits;
+  size_t index = (shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1));
+  return std::min(index, kBuckets - 1);
+}
+
+uint64_t LatencyHistogram::BucketHighestValue(size_t index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  size_t shift = index / kSubBuckets - 1;
+  uint64_t sub_bucket = index % kSubBuckets;
+  return ((kSubBuckets + sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t value_us) {
+  buckets_[BucketIndex(value_us)]++;
+  count_++;
+  max_ = std::max(max_, value_us);
+}
+
+uint64_t LatencyHistogram::Percentile(double percentile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  // The rank of the value, counting from 1.
+  uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(percentile / 100 * count_ + 0.5));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; i++) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      return std::min(BucketHighestValue(i), max_);
+    }
+  }
+  return max_;
+}
+
+std::string LatencyHistogram::ToString() const {
+  std::string result;
+  for (size_t i = 0; i < kBuckets; i++) {
+    if (buckets_[i] != 0) {
+      result += android::base::StringPrintf("%s%" PRIu64 ":%" PRIu64, result.empty() ? "" : " ",
+                                            BucketHighestValue(i), buckets_[i]);
+    }
+  }
+  return result;
+}
+
+CommandStats::ScopedCommand::ScopedCommand(CommandStats* stats, Command::Type type)
+    : stats_(stats), type_(type), start_us_(NowUs()), start_cpu_us_(ThreadCpuUs()) {
+  current_sub_phases = &stats_->stats_[static_cast<size_t>(type_)].sub_phase_us;
+}
+
+CommandStats::ScopedCommand::~ScopedCommand() {
+  TypeStats& stats = stats_->stats_[static_cast<size_t>(type_)];
+  stats.latency.Record(NowUs() - start_us_);
+  stats.cpu_us += ThreadCpuUs() - start_cpu_us_;
+  current_sub_phases = nullptr;
+}
+
+CommandStats::ScopedSubPhase::ScopedSubPhase(CommandSubPhase phase)
+    : phase_(phase), parent_(current_sub_phase), start_us_(NowUs()) {
+  current_sub_phase = this;
+}
+
+CommandStats::ScopedSubPhase::~ScopedSubPhase() {
+  uint64_t elapsed = NowUs() - start_us_;
+  if (current_sub_phases != nullptr) {
+    (*current_sub_phases)[static_cast<size_t>(phase_)] += elapsed - std::min(elapsed, nested_us_);
+  }
+  if (parent_ != nullptr) {
+    parent_->nested_us_ += elapsed;
+  }
+  current_sub_phase = parent_;
+}
+
+const char* CommandStats::TypeName(size_t type) {
+  return kCommandTypeNames[type];
+}
+
+void CommandStats::Log() const {
+  for (size_t type = 0; type < stats_.size(); type++) {
+    const TypeStats& stats = stats_[type];
+    if (stats.latency.count() == 0) {
+      continue;
+    }
+    std::string sub_phases;
+    for (size_t phase = 0; phase < stats.sub_phase_us.size(); phase++) {
+      sub_phases += android::base::StringPrintf(" %s %.3fs", kSubPhaseNames[phase],
+                                                stats.sub_phase_us[phase] / 1e6);
+    }
+    LOG(INFO) << TypeName(type) << ": " << stats.latency.count() << " commands, latency p50 "
+              << stats.latency.Percentile(50) << "us p90 " << stats.latency.Percentile(90)
+              << "us p99 " << stats.latency.Percentile(99) << "us max " << stats.latency.max()
+              << "us; cpu " << android::base::StringPrintf("%.3fs", stats.cpu_us / 1e6) << ";"
+              << sub_phases << "; histogram (us:count) " << stats.latency.ToString();
+  }
+}
+
+std::vector<std::string> CommandStats::FormatForInstallLog(const std::string& partition) const {
+  std::vector<std::string> lines;
+  for (size_t type = 0; type < stats_.size(); type++) {
+    const TypeStats& stats = stats_[type];
+    if (stats.latency.count() == 0) {
+      continue;
+    }
+    std::string prefix = "latency_" + partition + "_" + TypeName(type) + "_";
+    lines.push_back(prefix + "count: " + std::to_string(stats.latency.count()));
+    lines.push_back(prefix + "p50_us: " + std::to_string(stats.latency.Percentile(50)));
+    lines.push_back(prefix + "p90_us: " + std::to_string(stats.latency.Percentile(90)));
+    lines.push_back(prefix + "p99_us: " + std::to_string(stats.latency.Percentile(99)));
+    lines.push_back(prefix + "max_us: " + std::to_string(stats.latency.max()));
+    lines.push_back(prefix + "cpu_ms: " + std::to_string(stats.cpu_us / 1000));
+    for (size_t phase = 0; phase < stats.sub_phase_us.size(); phase++) {
+      lines.push_back(prefix + kSubPhaseNames[phase] +
+                      "_ms: " + std::to_string(stats.sub_phase_us[phase] / 1000));
+    }
+  }
+  return lines;
+}
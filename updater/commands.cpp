@@ -22,12 +22,12 @@
 #include <functional>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
-#include <android-base/strings.h>
 #include <openssl/sha.h>
 
 #include "otautil/print_sha1.h"
@@ -37,6 +37,20 @@ using namespace std::string_literals;
 
 bool Command::abort_allowed_ = false;
 
+void SplitView(std::string_view str, char delimiter, std::vector<std::string_view>* pieces) {
+  pieces->clear();
+  size_t start = 0;
+  while (true) {
+    size_t end = str.find(delimiter, start);
+    if (end == std::string_view::npos) {
+      pieces->push_back(str.substr(start));
+      return;
+    }
+    pieces->push_back(str.substr(start, end - start));
+    start = end + 1;
+  }
+}
+
 Command::Command(Type type, size_t index, std::string cmdline, HashTreeInfo hash_tree_info)
     : type_(type),
       index_(index),
@@ -45,7 +59,12 @@ Command::Command(Type type, size_t index, std::string cmdline, HashTreeInfo hash
   CHECK(type == Type::COMPUTE_HASH_TREE);
 }
 
-Command::Type Command::ParseType(const std::string& type_str) {
+Command::Command(Type type, size_t index, std::string cmdline, FecInfo fec_info)
+    : type_(type), index_(index), cmdline_(std::move(cmdline)), fec_info_(std::move(fec_info)) {
+  CHECK(type == Type::COMPUTE_FEC);
+}
+
+Command::Type Command::ParseType(std::string_view type_str) {
   if (type_str == "abort") {
     if (!abort_allowed_) {
       LOG(ERROR) << "ABORT disallowed";
@@ -54,6 +73,8 @@ Command::Type Command::ParseType(const std::string& type_str) {
     return Type::ABORT;
   } else if (type_str == "bsdiff") {
     return Type::BSDIFF;
+  } else if (type_str == "compute_fec") {
+    return Type::COMPUTE_FEC;
   } else if (type_str == "compute_hash_tree") {
     return Type::COMPUTE_HASH_TREE;
   } else if (type_str == "erase") {
@@ -78,6 +99,15 @@ bool Command::ParseTargetInfoAndSourceInfo(const std::vector<std::string>& token
                                            const std::string& tgt_hash, TargetInfo* target,
                                            const std::string& src_hash, SourceInfo* source,
                                            std::string* err) {
+  std::vector<std::string_view> views(tokens.cbegin(), tokens.cend());
+  return ParseTargetInfoAndSourceInfo(views.data(), views.size(), tgt_hash, target, src_hash,
+                                      source, err);
+}
+
+bool Command::ParseTargetInfoAndSourceInfo(const std::string_view* tokens, size_t count,
+                                           const std::string& tgt_hash, TargetInfo* target,
+                                           const std::string& src_hash, SourceInfo* source,
+                                           std::string* err) {
   // We expect the given args (in 'tokens' vector) in one of the following formats.
   //
   //    <tgt_ranges> <src_block_count> - <[stash_id:location] ...>
@@ -90,7 +120,7 @@ bool Command::ParseTargetInfoAndSourceInfo(const std::vector<std::string>& token
   //        (loads data from both of source image and stashes)
 
   // At least it needs to provide three args: <tgt_ranges>, <src_block_count> and "-"/<src_ranges>.
-  if (tokens.size() < 3) {
+  if (count < 3) {
     *err = "invalid number of args";
     return false;
   }
@@ -104,7 +134,7 @@ bool Command::ParseTargetInfoAndSourceInfo(const std::vector<std::string>& token
   *target = TargetInfo(tgt_hash, tgt_ranges);
 
   // <src_block_count>
-  const std::string& token = tokens[pos++];
+  const std::string token(tokens[pos++]);
   size_t src_blocks;
   if (!android::base::ParseUint(token, &src_blocks)) {
     *err = "invalid src_block_count \""s + token + "\"";
@@ -124,7 +154,7 @@ bool Command::ParseTargetInfoAndSourceInfo(const std::vector<std::string>& token
       return false;
     }
 
-    if (pos >= tokens.size()) {
+    if (pos >= count) {
       // No stashes, only source ranges.
       SourceInfo result(src_hash, src_ranges, {}, {});
 
@@ -148,10 +178,11 @@ bool Command::ParseTargetInfoAndSourceInfo(const std::vector<std::string>& token
 
   // <[stash_id:stash_location]>
   std::vector<StashInfo> stashes;
-  while (pos < tokens.size()) {
+  std::vector<std::string_view> pairs;
+  while (pos < count) {
     // Each word is a an index into the stash table, a colon, and then a RangeSet describing where
     // in the source block that stashed data should go.
-    std::vector<std::string> pairs = android::base::Split(tokens[pos++], ":");
+    SplitView(tokens[pos++], ':', &pairs);
     if (pairs.size() != 2) {
       *err = "invalid stash info";
       return false;
@@ -161,7 +192,7 @@ bool Command::ParseTargetInfoAndSourceInfo(const std::vector<std::string>& token
       *err = "invalid stash location";
       return false;
     }
-    stashes.emplace_back(pairs[0], stash_location);
+    stashes.emplace_back(std::string(pairs[0]), stash_location);
   }
 
   SourceInfo result(src_hash, src_ranges, src_ranges_location, stashes);
@@ -175,8 +206,9 @@ bool Command::ParseTargetInfoAndSourceInfo(const std::vector<std::string>& token
   return true;
 }
 
-Command Command::Parse(const std::string& line, size_t index, std::string* err) {
-  std::vector<std::string> tokens = android::base::Split(line, " ");
+Command Command::Parse(std::string_view line, size_t index, std::string* err) {
+  std::vector<std::string_view> tokens;
+  SplitView(line, ' ', &tokens);
   size_t pos = 0;
   // tokens.size() will be 1 at least.
   Type op = ParseType(tokens[pos++]);
@@ -210,13 +242,13 @@ Command Command::Parse(const std::string& line, size_t index, std::string* err)
                                          tokens.size() - pos);
       return {};
     }
-    const std::string& id = tokens[pos++];
+    std::string id(tokens[pos++]);
     RangeSet src_ranges = RangeSet::Parse(tokens[pos++]);
     if (!src_ranges) {
       *err = "invalid token";
       return {};
     }
-    stash_info = StashInfo(id, src_ranges);
+    stash_info = StashInfo(std::move(id), src_ranges);
   } else if (op == Type::FREE) {
     // free <stash_id>
     if (pos + 1 != tokens.size()) {
@@ -224,17 +256,16 @@ Command Command::Parse(const std::string& line, size_t index, std::string* err)
                                          tokens.size() - pos);
       return {};
     }
-    stash_info = StashInfo(tokens[pos++], {});
+    stash_info = StashInfo(std::string(tokens[pos++]), {});
   } else if (op == Type::MOVE) {
     // <hash>
     if (pos + 1 > tokens.size()) {
       *err = "missing hash";
       return {};
     }
-    std::string hash = tokens[pos++];
-    if (!ParseTargetInfoAndSourceInfo(
-            std::vector<std::string>(tokens.cbegin() + pos, tokens.cend()), hash, &target_info,
-            hash, &source_info, err)) {
+    std::string hash(tokens[pos++]);
+    if (!ParseTargetInfoAndSourceInfo(tokens.data() + pos, tokens.size() - pos, hash, &target_info,
+                                      hash, &source_info, err)) {
       return {};
     }
   } else if (op == Type::BSDIFF || op == Type::IMGDIFF) {
@@ -246,18 +277,17 @@ Command Command::Parse(const std::string& line, size_t index, std::string* err)
     }
     size_t offset;
     size_t length;
-    if (!android::base::ParseUint(tokens[pos++], &offset) ||
-        !android::base::ParseUint(tokens[pos++], &length)) {
+    if (!android::base::ParseUint(std::string(tokens[pos++]), &offset) ||
+        !android::base::ParseUint(std::string(tokens[pos++]), &length)) {
       *err = "invalid patch offset/length";
       return {};
     }
     patch_info = PatchInfo(offset, length);
 
-    std::string src_hash = tokens[pos++];
-    std::string dst_hash = tokens[pos++];
-    if (!ParseTargetInfoAndSourceInfo(
-            std::vector<std::string>(tokens.cbegin() + pos, tokens.cend()), dst_hash, &target_info,
-            src_hash, &source_info, err)) {
+    std::string src_hash(tokens[pos++]);
+    std::string dst_hash(tokens[pos++]);
+    if (!ParseTargetInfoAndSourceInfo(tokens.data() + pos, tokens.size() - pos, dst_hash,
+                                      &target_info, src_hash, &source_info, err)) {
       return {};
     }
   } else if (op == Type::ABORT) {
@@ -278,34 +308,70 @@ Command Command::Parse(const std::string& line, size_t index, std::string* err)
     // Expects the hash_tree data to be contiguous.
     RangeSet hash_tree_ranges = RangeSet::Parse(tokens[pos++]);
     if (!hash_tree_ranges || hash_tree_ranges.size() != 1) {
-      *err = "invalid hash tree ranges in: " + line;
+      *err = "invalid hash tree ranges in: "s + std::string(line);
       return {};
     }
 
     RangeSet source_ranges = RangeSet::Parse(tokens[pos++]);
     if (!source_ranges) {
-      *err = "invalid source ranges in: " + line;
+      *err = "invalid source ranges in: "s + std::string(line);
       return {};
     }
 
-    std::string hash_algorithm = tokens[pos++];
-    std::string salt_hex = tokens[pos++];
-    std::string root_hash = tokens[pos++];
+    std::string hash_algorithm(tokens[pos++]);
+    std::string salt_hex(tokens[pos++]);
+    std::string root_hash(tokens[pos++]);
     if (hash_algorithm.empty() || salt_hex.empty() || root_hash.empty()) {
-      *err = "invalid hash tree arguments in " + line;
+      *err = "invalid hash tree arguments in "s + std::string(line);
       return {};
     }
 
     HashTreeInfo hash_tree_info(std::move(hash_tree_ranges), std::move(source_ranges),
                                 std::move(hash_algorithm), std::move(salt_hex),
                                 std::move(root_hash));
-    return Command(op, index, line, std::move(hash_tree_info));
+    return Command(op, index, std::string(line), std::move(hash_tree_info));
+  } else if (op == Type::COMPUTE_FEC) {
+    // <fec_ranges> <source_ranges> <roots> <fec_hash>
+    if (pos + 4 != tokens.size()) {
+      *err = android::base::StringPrintf("invalid number of args: %zu (expected 4)",
+                                         tokens.size() - pos);
+      return {};
+    }
+
+    // Expects the FEC data to be contiguous, like the hash tree.
+    RangeSet fec_ranges = RangeSet::Parse(tokens[pos++]);
+    if (!fec_ranges || fec_ranges.size() != 1) {
+      *err = "invalid FEC ranges in: "s + std::string(line);
+      return {};
+    }
+
+    RangeSet source_ranges = RangeSet::Parse(tokens[pos++]);
+    if (!source_ranges) {
+      *err = "invalid source ranges in: "s + std::string(line);
+      return {};
+    }
+
+    int roots;
+    if (!android::base::ParseInt(std::string(tokens[pos++]), &roots, 1, 254)) {
+      *err = "invalid FEC roots in: "s + std::string(line);
+      return {};
+    }
+
+    std::string fec_hash(tokens[pos++]);
+    if (fec_hash.empty()) {
+      *err = "invalid FEC hash in: "s + std::string(line);
+      return {};
+    }
+
+    FecInfo fec_info(std::move(fec_ranges), std::move(source_ranges), roots, std::move(fec_hash));
+    return Command(op, index, std::string(line), std::move(fec_info));
   } else {
     *err = "invalid op";
     return {};
   }
 
-  return Command(op, index, line, patch_info, target_info, source_info, stash_info);
+  return Command(op, index, std::string(line), patch_info, std::move(target_info),
+                 std::move(source_info), std::move(stash_info));
 }
 
 bool SourceInfo::Overlaps(const TargetInfo& target) const {
@@ -359,9 +425,10 @@ bool SourceInfo::ReadAll(
 void SourceInfo::DumpBuffer(const std::vector<uint8_t>& buffer, size_t block_size) const {
   LOG(INFO) << "Dumping hashes in hex for " << ranges_.blocks() << " source blocks";
 
-  const RangeSet& location = location_ ? location_ : RangeSet({ Range{ 0, ranges_.blocks() } });
+  RangeSetIndex ranges(ranges_);
+  RangeSetIndex location(location_ ? location_ : RangeSet({ Range{ 0, ranges_.blocks() } }));
   for (size_t i = 0; i < ranges_.blocks(); i++) {
-    size_t block_num = ranges_.GetBlockNumber(i);
+    size_t block_num = ranges.GetBlockNumber(i);
     size_t buffer_index = location.GetBlockNumber(i);
     CHECK_LE((buffer_index + 1) * block_size, buffer.size());
 
@@ -401,52 +468,55 @@ std::ostream& operator<<(std::ostream& os, const SourceInfo& source) {
   return os;
 }
 
-TransferList TransferList::Parse(const std::string& transfer_list_str, std::string* err) {
+TransferList TransferList::Parse(std::string_view transfer_list_str, std::string* err) {
   TransferList result{};
 
-  std::vector<std::string> lines = android::base::Split(transfer_list_str, "\n");
+  std::vector<std::string_view> lines;
+  SplitView(transfer_list_str, '\n', &lines);
   if (lines.size() < kTransferListHeaderLines) {
     *err = android::base::StringPrintf("too few lines in the transfer list [%zu]", lines.size());
     return TransferList{};
   }
 
   // First line in transfer list is the version number.
-  if (!android::base::ParseInt(lines[0], &result.version_, 3, 4)) {
-    *err = "unexpected transfer list version ["s + lines[0] + "]";
+  if (!android::base::ParseInt(std::string(lines[0]), &result.version_, 3, 4)) {
+    *err = "unexpected transfer list version ["s + std::string(lines[0]) + "]";
     return TransferList{};
   }
 
   // Second line in transfer list is the total number of blocks we expect to write.
-  if (!android::base::ParseUint(lines[1], &result.total_blocks_)) {
-    *err = "unexpected block count ["s + lines[1] + "]";
+  if (!android::base::ParseUint(std::string(lines[1]), &result.total_blocks_)) {
+    *err = "unexpected block count ["s + std::string(lines[1]) + "]";
     return TransferList{};
   }
 
   // Third line is how many stash entries are needed simultaneously.
-  if (!android::base::ParseUint(lines[2], &result.stash_max_entries_)) {
+  if (!android::base::ParseUint(std::string(lines[2]), &result.stash_max_entries_)) {
     return TransferList{};
   }
 
   // Fourth line is the maximum number of blocks that will be stashed simultaneously.
-  if (!android::base::ParseUint(lines[3], &result.stash_max_blocks_)) {
-    *err = "unexpected maximum stash blocks ["s + lines[3] + "]";
+  if (!android::base::ParseUint(std::string(lines[3]), &result.stash_max_blocks_)) {
+    *err = "unexpected maximum stash blocks ["s + std::string(lines[3]) + "]";
     return TransferList{};
   }
 
   // Subsequent lines are all individual transfer commands.
+  result.commands_.reserve(lines.size() - kTransferListHeaderLines);
   for (size_t i = kTransferListHeaderLines; i < lines.size(); i++) {
-    const std::string& line = lines[i];
+    std::string_view line = lines[i];
     if (line.empty()) continue;
 
     size_t cmdindex = i - kTransferListHeaderLines;
     std::string parsing_error;
     Command command = Command::Parse(line, cmdindex, &parsing_error);
     if (!command) {
-      *err = android::base::StringPrintf("Failed to parse command %zu [%s]: %s", cmdindex,
-                                         line.c_str(), parsing_error.c_str());
+      *err = android::base::StringPrintf("Failed to parse command %zu [%.*s]: %s", cmdindex,
+                                         static_cast<int>(line.size()), line.data(),
+                                         parsing_error.c_str());
       return TransferList{};
     }
-    result.commands_.push_back(command);
+    result.commands_.push_back(std::move(command));
   }
 
   return result;
@@ -121,7 +121,7 @@ Value* UpdateDynamicPartitionsFn(const char* name, State* state,
   }
 
   auto updater_runtime = state->updater->GetRuntime();
-  if (!updater_runtime->UpdateDynamicPartitions(op_list_value->data)) {
+  if (!updater_runtime->UpdateDynamicPartitions(op_list_value->view())) {
     return StringValue("");
   }
 
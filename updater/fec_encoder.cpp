@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/fec_encoder.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <fec/io.h>
+#include <openssl/sha.h>
+
+extern "C" {
+#include <fec.h>
+}
+
+// The symbols of a codeword.
+static constexpr int kFecRsm = 255;
+// The Reed-Solomon code of libfec: symbols of 8 bits, the field generator polynomial 0x11d, and the
+// first consecutive root and the primitive element of the generator polynomial.
+static constexpr int kFecSymbolSize = 8;
+static constexpr int kFecGfPoly = 0x11d;
+static constexpr int kFecFcr = 0;
+static constexpr int kFecPrim = 1;
+// The codewords that a thread encodes at once, which takes as many bytes of each data stripe, i.e.
+// up to (kFecRsm - roots) reads of this size.
+static constexpr size_t kChunkSize = 4 * FEC_BLOCKSIZE;
+
+// Returns the blocks of each data stripe.
+static uint64_t GetFecRounds(uint64_t image_blocks, int rsn) {
+  return (image_blocks + rsn - 1) / rsn;
+}
+
+uint64_t GetFecSize(uint64_t image_blocks, int roots) {
+  if (roots <= 0 || roots >= kFecRsm) {
+    return 0;
+  }
+  return GetFecRounds(image_blocks, kFecRsm - roots) * roots * FEC_BLOCKSIZE;
+}
+
+// Reads the |count| blocks of |image| from its |first| block on into |buffer|. The blocks past the
+// end of the image are zeros.
+static bool ReadImageBlocks(int fd, const RangeSetIndex& image, size_t first, size_t count,
+                            uint8_t* buffer) {
+  size_t image_blocks = image.ranges().blocks();
+  size_t present = first < image_blocks ? std::min(count, image_blocks - first) : 0;
+  memset(buffer + present * FEC_BLOCKSIZE, 0, (count - present) * FEC_BLOCKSIZE);
+  if (present == 0) {
+    return true;
+  }
+  auto ranges = image.GetSubRanges(first, present);
+  if (!ranges) {
+    errno = EINVAL;
+    return false;
+  }
+  for (const auto& [begin, end] : *ranges) {
+    size_t size = (end - begin) * FEC_BLOCKSIZE;
+    if (!android::base::ReadFullyAtOffset(fd, buffer, size,
+                                          static_cast<off64_t>(begin) * FEC_BLOCKSIZE)) {
+      return false;
+    }
+    buffer += size;
+  }
+  return true;
+}
+
+bool EncodeFec(int fd, const RangeSet& ranges, int roots, size_t threads,
+               std::vector<uint8_t>* fec) {
+  uint64_t fec_size = GetFecSize(ranges.blocks(), roots);
+  if (fec_size == 0) {
+    errno = EINVAL;
+    return false;
+  }
+  int rsn = kFecRsm - roots;
+  // The bytes of each data stripe, which is the number of codewords.
+  uint64_t stripe_size = GetFecRounds(ranges.blocks(), rsn) * FEC_BLOCKSIZE;
+  size_t chunks = (stripe_size + kChunkSize - 1) / kChunkSize;
+  fec->resize(fec_size);
+  RangeSetIndex image(ranges);
+
+  std::atomic<size_t> next_chunk{ 0 };
+  std::atomic<int> error{ 0 };
+  auto worker = [&]() {
+    std::unique_ptr<void, decltype(&free_rs_char)> rs(
+        init_rs_char(kFecSymbolSize, kFecGfPoly, kFecFcr, kFecPrim, roots, 0), free_rs_char);
+    if (!rs) {
+      int expected = 0;
+      error.compare_exchange_strong(expected, ENOMEM);
+      return;
+    }
+    // The bytes of the chunk from each stripe, one stripe after another.
+    std::vector<uint8_t> stripes(rsn * kChunkSize);
+    std::vector<uint8_t> codeword(rsn);
+    for (size_t i = next_chunk++; i < chunks && error == 0; i = next_chunk++) {
+      uint64_t start = i * kChunkSize;
+      size_t size = std::min<uint64_t>(kChunkSize, stripe_size - start);
+      for (int k = 0; k < rsn; k++) {
+        if (!ReadImageBlocks(fd, image, (k * stripe_size + start) / FEC_BLOCKSIZE,
+                             size / FEC_BLOCKSIZE, stripes.data() + k * size)) {
+          int expected = 0;
+          error.compare_exchange_strong(expected, errno != 0 ? errno : EIO);
+          return;
+        }
+      }
+      uint8_t* parity = fec->data() + start * roots;
+      for (size_t j = 0; j < size; j++) {
+        for (int k = 0; k < rsn; k++) {
+          codeword[k] = stripes[k * size + j];
+        }
+        encode_rs_char(rs.get(), codeword.data(), parity);
+        parity += roots;
+      }
+    }
+  };
+
+  threads = std::clamp<size_t>(threads, 1, std::max<size_t>(chunks, 1));
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+
+  if (error != 0) {
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+void AppendFecHeader(uint64_t image_blocks, int roots, std::vector<uint8_t>* fec) {
+  fec_header header = {};
+  header.magic = FEC_MAGIC;
+  header.version = FEC_VERSION;
+  header.size = sizeof(header);
+  header.roots = roots;
+  header.fec_size = fec->size();
+  header.inp_size = image_blocks * FEC_BLOCKSIZE;
+  SHA256(fec->data(), fec->size(), header.hash);
+
+  // libfec keeps a copy of the header at the end of the block too.
+  size_t offset = fec->size();
+  fec->resize(offset + FEC_BLOCKSIZE, 0);
+  memcpy(fec->data() + offset, &header, sizeof(header));
+  memcpy(fec->data() + offset + FEC_BLOCKSIZE - sizeof(header), &header, sizeof(header));
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A byte range on a block device (or file), as offset and size.
+using Extent = std::pair<off64_t, size_t>;
+
+// The backend that carries out the block reads and writes of the block image updater. An operation
+// covers a list of extents that map to a contiguous buffer in memory, which lets a backend keep the
+// I/O for all of them in flight at once.
+class BlockIo {
+ public:
+  enum class Type {
+    // pread(2) / pwrite(2), one extent at a time.
+    SYNC,
+    // io_uring, with all the extents of an operation submitted as one batch.
+    IO_URING,
+  };
+
+  virtual ~BlockIo() = default;
+
+  // The number of requests that an io_uring backend keeps in flight by default: deep enough to
+  // keep the storage busy, while the rings stay within a few pages.
+  static constexpr unsigned kDefaultQueueDepth = 64;
+
+  // Creates a backend of the given |type|, with up to |queue_depth| requests in flight where that
+  // applies. Falls back to SYNC if the type isn't supported (e.g. io_uring on older kernels). Never
+  // returns nullptr.
+  static std::unique_ptr<BlockIo> Create(Type type, unsigned queue_depth = kDefaultQueueDepth);
+
+  // Parses the name of a backend ("sync" or "io_uring"). Returns false on unknown names.
+  static bool ParseType(const std::string& name, Type* type);
+
+  virtual Type type() const = 0;
+
+  // Reads |extents| of |fd| into |buffer|, back to back. Returns false and sets errno on errors.
+  virtual bool Read(int fd, const std::vector<Extent>& extents, uint8_t* buffer) = 0;
+
+  // Writes |buffer| to |extents| of |fd|, back to back. Returns false and sets errno on errors.
+  virtual bool Write(int fd, const std::vector<Extent>& extents, const uint8_t* buffer) = 0;
+};
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "edify/updater_runtime_interface.h"
+
+// Tunes the request queues of the block devices that the block image functions update for the bulk
+// I/O of an install, instead of the interactive use that the recovery kernel defaults to, and
+// restores them afterwards. The queues of a device are its own and those it sends the requests on
+// to: the disk of a partition, and the devices under a device-mapper one. A profile of queue
+// settings (files of the queue directory, e.g. "read_ahead_kb") applies per access pattern, and the
+// block image functions switch between them as the commands change, e.g. from the scattered source
+// reads of "bsdiff" to the long writes of "new". Settings that the kernel rejects are left alone.
+//
+// Thread-safe; the block image functions may run concurrently from parallel(), and a queue shared
+// by several of them gets restored once the last one is done.
+class BlockQueueTuner {
+ public:
+  struct Setting {
+    std::string name;
+    std::string value;
+  };
+
+  // Finds the devices of the block device files in |sys_dev_block|, by "<major>:<minor>".
+  explicit BlockQueueTuner(std::string sys_dev_block = "/sys/dev/block");
+
+  // Returns the default profile for |access|.
+  static std::vector<Setting> DefaultProfile(BlockAccess access);
+
+  // Parses a profile of "name=value" settings delimited by ',', e.g.
+  // "read_ahead_kb=2048,scheduler=none". Returns false on malformed ones.
+  static bool ParseProfile(const std::string& str, std::vector<Setting>* profile);
+
+  // Replaces the profile for |access|; an empty one leaves the queues alone.
+  void SetProfile(BlockAccess access, std::vector<Setting> profile);
+
+  // Applies the profile for |access| to the queues of the block device |path|. Files that aren't
+  // block devices (e.g. in tests and simulations) have no queues. Returns the numeric settings that
+  // got applied for the first time, as "block_queue_<device>_<name>: <value>" lines.
+  std::vector<std::string> Tune(const std::string& path, BlockAccess access);
+
+  // Same as above, for the device directory |device_dir| in sysfs.
+  std::vector<std::string> TuneDevice(const std::string& path, const std::string& device_dir,
+                                      BlockAccess access);
+
+  // Restores the settings that Tune() changed for |path|, of the queues that no other tuned device
+  // shares.
+  void Restore(const std::string& path);
+
+  // Returns the queue directories that the requests to the device |device_dir| go through.
+  static std::vector<std::string> FindQueues(const std::string& device_dir);
+
+ private:
+  struct Queue {
+    // The tuned devices that use the queue.
+    size_t users = 0;
+    // The values of the settings before the tuning, and their current ones, by name.
+    std::map<std::string, std::string> original;
+    std::map<std::string, std::string> current;
+    // The settings that the kernel rejected.
+    std::set<std::string> rejected;
+  };
+
+  // Applies |setting| to |queue_dir|. Returns true if it got applied for the first time. Requires
+  // mutex_.
+  bool Apply(const std::string& queue_dir, const Setting& setting);
+
+  const std::string sys_dev_block_;
+
+  std::mutex mutex_;
+  std::map<BlockAccess, std::vector<Setting>> profiles_;
+  // The queues of each tuned device, by the path of the device.
+  std::map<std::string, std::vector<std::string>> devices_;
+  std::map<std::string, Queue> queues_;
+};
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Chunked variant of the brotli compressed new data (e.g. system.new.dat.br). The new data is split
+// into segments that are compressed independently, and concatenated in order. The segments are
+// described by an index entry that sits next to the new data in the package, with the ".index"
+// suffix (e.g. system.new.dat.br.index). The index is a text file, with the format version on its
+// first line, followed by one line per segment:
+//
+//   1
+//   <compressed size> <uncompressed size>
+//   ...
+//
+// Since the segments don't depend on each other, they can be decompressed in parallel.
+
+constexpr const char* kBrotliSegmentIndexSuffix = ".index";
+
+// An independently compressed piece of the new data, i.e. a brotli segment, or a zstd frame (see
+// zstd_frames.h).
+struct CompressedSegment {
+  // Offset and size of the compressed segment in the new data.
+  size_t offset;
+  size_t compressed_size;
+  size_t size;
+};
+
+// Parses the segment index in |content|, for a compressed stream of |compressed_size| bytes.
+// Returns false and sets |err| on errors, including segments not adding up to |compressed_size|.
+bool ParseBrotliSegmentIndex(const std::string& content, size_t compressed_size,
+                             std::vector<CompressedSegment>* segments, std::string* err);
+
+// Decompresses the |compressed_size| bytes at |in| into exactly |size| bytes at |out|. Returns
+// false on errors, after logging them.
+using SegmentDecoder = std::function<bool(const uint8_t* in, size_t compressed_size, uint8_t* out,
+                                          size_t size)>;
+
+// Decompresses the |segments| of |data| with |decoder| on |num_threads| threads, and hands the
+// uncompressed data to |sink| in order, on the calling thread. At most 2 * |num_threads|
+// decompressed segments are held in memory at any time. Returns false if any segment fails to
+// decompress, or the sink returns false.
+bool DecompressSegments(const uint8_t* data, const std::vector<CompressedSegment>& segments,
+                        size_t num_threads, const SegmentDecoder& decoder,
+                        const std::function<bool(const uint8_t*, size_t)>& sink);
+
+// Decompresses the brotli compressed |segments| of |data|, as DecompressSegments() does.
+bool DecompressBrotliSegments(const uint8_t* data, const std::vector<CompressedSegment>& segments,
+                              size_t num_threads,
+                              const std::function<bool(const uint8_t*, size_t)>& sink);
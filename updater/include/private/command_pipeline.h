@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "otautil/rangeset.h"
+#include "private/block_buffer.h"
+#include "private/commands.h"
+
+// CommandPipeline reads the source blocks of upcoming commands in a TransferList on a background
+// thread, while the main thread is still executing the earlier commands. It can also apply the
+// bsdiff/imgdiff patches of the upcoming commands on a pool of worker threads. The main thread
+// remains the only one that writes to the block device, and it still executes (and checkpoints)
+// the commands strictly in order; the pipeline only lets it find the source data, or the patched
+// target data, in memory when it gets to a command.
+//
+// Reading ahead is safe because the creator of the transfer list guarantees that no block is read
+// after it has been written. The pipeline double checks that against the target ranges of the
+// commands in between as it builds its plan, and never reads ahead for a command that violates it.
+// Patches are only applied ahead of time for commands that load all their source blocks from the
+// partition (i.e. no stashes); the workers check the source hash before patching and the target
+// hash afterwards, so a result is never handed out unless it is exactly what the main thread would
+// have produced.
+class CommandPipeline {
+ public:
+  // Reads ahead from |fd| (which is dup'd) for the commands in |transfer_list|, keeping at most
+  // |max_buffered_bytes| of source data in memory.
+  CommandPipeline(int fd, const TransferList& transfer_list, size_t max_buffered_bytes);
+
+  ~CommandPipeline();
+
+  // Lets |num_threads| worker threads apply the bsdiff/imgdiff patches, which are found in
+  // |patch_data|, once the source blocks of the commands have been read ahead. Should be called
+  // before Start().
+  void EnablePatching(const uint8_t* patch_data, size_t num_threads);
+
+  // Starts the read-ahead thread. Returns false if the pipeline can't be used, in which case the
+  // caller should read all the source blocks by itself.
+  bool Start();
+
+  // Stops the read-ahead thread and drops all the buffered data.
+  void Stop();
+
+  // Tells the pipeline that the caller is about to execute the command at |index|. Data buffered
+  // for earlier commands is dropped, and the read-ahead skips past them.
+  void Advance(size_t index);
+
+  // Returns whether the pipeline is running and reads ahead the source blocks of the command at
+  // |index|, i.e. whether TakeSourceBlocks() may find them.
+  bool Plans(size_t index) const;
+
+  // Copies the source blocks of the command at |index| into |buffer|, if they are part of the plan
+  // and match the requested |ranges|, waiting for the read-ahead thread to get to them as needed.
+  // This implies Advance(index). Returns false otherwise, in which case the caller should read the
+  // blocks by itself. |buffer| must be able to hold |ranges.blocks()| blocks.
+  bool TakeSourceBlocks(size_t index, const RangeSet& ranges, uint8_t* buffer);
+
+  // Moves the patched target blocks of the command at |index| into |output|, waiting for a worker
+  // that is currently patching them (or patching the buffered source on the caller thread if no
+  // worker has got to it yet). Returns false if the source of the command hasn't been read ahead
+  // or the patching failed, in which case the caller should apply the patch by itself.
+  bool TakePatchedBlocks(size_t index, BlockBuffer* output);
+
+  size_t hits() const {
+    return hits_;
+  }
+
+  size_t misses() const {
+    return misses_;
+  }
+
+  size_t patched() const {
+    return patched_;
+  }
+
+ private:
+  // One command whose source blocks can be read ahead.
+  struct PlanEntry {
+    size_t index;
+    RangeSet ranges;
+    // Whether the patch of the command can be applied ahead of time. The remaining fields are
+    // only meaningful if so.
+    bool patchable;
+    Command::Type type;
+    PatchInfo patch;
+    std::string src_hash;
+    std::string tgt_hash;
+    size_t tgt_blocks;
+  };
+
+  // The source data that has been read ahead for a command.
+  struct BufferedEntry {
+    RangeSet ranges;
+    std::shared_ptr<const std::vector<uint8_t>> data;
+  };
+
+  // The patching of a command by the workers.
+  struct PatchJob {
+    enum class State {
+      QUEUED,
+      RUNNING,
+      DONE,
+      FAILED,
+    };
+
+    State state;
+    const PlanEntry* entry;
+    std::shared_ptr<const std::vector<uint8_t>> source;
+    BlockBuffer output;
+    // Set if the caller has moved past the command while a worker is still patching it.
+    bool abandoned;
+  };
+
+  // Builds plan_ from the given commands.
+  void BuildPlan(const std::vector<Command>& commands);
+
+  // Implements Advance(), with mutex_ held.
+  void AdvanceLocked(size_t index);
+
+  // The body of the read-ahead thread.
+  void ThreadLoop();
+
+  // The body of the patch workers.
+  void WorkerLoop();
+
+  // Applies the patch of |entry| to |source| and writes the result to |output|. Returns false if
+  // the source or the result doesn't have the expected hash.
+  bool ApplyPatch(const PlanEntry& entry, const std::vector<uint8_t>& source,
+                  BlockBuffer* output) const;
+
+  // Reads |ranges| into |buffer| with pread(2). Returns false on errors.
+  bool ReadRanges(const RangeSet& ranges, std::vector<uint8_t>* buffer) const;
+
+  android::base::unique_fd fd_;
+  size_t block_size_;
+  size_t max_buffered_bytes_;
+
+  // The commands to read ahead for, in execution order.
+  std::vector<PlanEntry> plan_;
+
+  const uint8_t* patch_data_{ nullptr };
+  size_t num_workers_{ 0 };
+
+  std::thread thread_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+
+  // The following fields are guarded by mutex_.
+  // Position in plan_ of the next entry to read ahead.
+  size_t next_entry_{ 0 };
+  // The index of the command that the caller is currently executing.
+  size_t current_index_{ 0 };
+  // The index of the command that is being read by the thread; valid if reading_ is true.
+  size_t reading_index_{ 0 };
+  bool reading_{ false };
+  bool stopped_{ false };
+  // Source data that has been read ahead, keyed by the command index.
+  std::map<size_t, BufferedEntry> buffered_;
+  // The patching of the upcoming commands, keyed by the command index.
+  std::map<size_t, PatchJob> patch_jobs_;
+  // The source bytes buffered, plus the target bytes reserved for the patch jobs.
+  size_t buffered_bytes_{ 0 };
+
+  // Stats, only accessed by the caller thread.
+  size_t hits_{ 0 };
+  size_t misses_{ 0 };
+  size_t patched_{ 0 };
+};
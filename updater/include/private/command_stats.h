@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "private/commands.h"
+
+// A histogram of latencies in microseconds, with log-linear buckets as in HdrHistogram: each power
+// of two is split into kSubBuckets linear buckets, so a recorded value is known within 1/16th (~6%)
+// across the whole range, in a fixed ~4KiB.
+class LatencyHistogram {
+ public:
+  void Record(uint64_t value_us);
+
+  uint64_t count() const {
+    return count_;
+  }
+  uint64_t max() const {
+    return max_;
+  }
+
+  // Returns the value at |percentile| (in [0, 100]), i.e. the highest value of the bucket that it
+  // falls in, capped at the max. Returns 0 if nothing has been recorded.
+  uint64_t Percentile(double percentile) const;
+
+  // Returns the non-empty buckets as "<highest value>:<count>" pairs, e.g. "15:3 127:20 1023:1".
+  std::string ToString() const;
+
+ private:
+  static constexpr size_t kSubBucketBits = 4;
+  static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+  // Values up to 2^40us (~12 days) are told apart, which is far beyond any single command.
+  static constexpr size_t kBuckets = (40 - kSubBucketBits + 1) * kSubBuckets;
+
+  static size_t BucketIndex(uint64_t value);
+  static uint64_t BucketHighestValue(size_t index);
+
+  std::array<uint64_t, kBuckets> buckets_{};
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+};
+
+// Where a transfer list command spends its time, besides the bookkeeping.
+enum class CommandSubPhase {
+  kRead,   // Reading the sources, from the block device or the stashes.
+  kPatch,  // Applying bsdiff / imgdiff patches (the CPU side; the writes count as kWrite).
+  kWrite,  // Writing the targets or the stashes.
+  kFsync,  // Syncing the stashes.
+  kCount,
+};
+
+// The latencies of the transfer list commands of one block_image_update() / block_image_verify(),
+// by command type, and the time they spend in each CommandSubPhase. The sub-phases are attributed
+// through a thread-local, so only the work on the thread that runs the command counts (e.g. not the
+// reads or the patching that the CommandPipeline does ahead of time).
+class CommandStats {
+ public:
+  // Times a command of |type| that runs on this thread for the lifetime of the object.
+  class ScopedCommand {
+   public:
+    ScopedCommand(CommandStats* stats, Command::Type type);
+    ~ScopedCommand();
+
+   private:
+    CommandStats* stats_;
+    Command::Type type_;
+    uint64_t start_us_;
+    uint64_t start_cpu_us_;
+  };
+
+  // Adds the lifetime of the object to |phase| of the command running on this thread, if any. The
+  // time in a nested ScopedSubPhase (e.g. the writes while patching) only counts towards the inner
+  // one.
+  class ScopedSubPhase {
+   public:
+    explicit ScopedSubPhase(CommandSubPhase phase);
+    ~ScopedSubPhase();
+
+    ScopedSubPhase(const ScopedSubPhase&) = delete;
+    ScopedSubPhase& operator=(const ScopedSubPhase&) = delete;
+
+   private:
+    CommandSubPhase phase_;
+    ScopedSubPhase* parent_;
+    uint64_t start_us_;
+    uint64_t nested_us_ = 0;
+  };
+
+  // Logs a line per command type that ran, with the latency percentiles, the CPU time of the
+  // thread that ran the commands, the time in each sub-phase, and the histogram.
+  void Log() const;
+
+  // Returns the lines for last_install, e.g. "latency_system_bsdiff_p99_us: 3500", with |partition|
+  // telling the block_image_update() calls apart.
+  std::vector<std::string> FormatForInstallLog(const std::string& partition) const;
+
+ private:
+  struct TypeStats {
+    LatencyHistogram latency;
+    uint64_t cpu_us = 0;
+    std::array<uint64_t, static_cast<size_t>(CommandSubPhase::kCount)> sub_phase_us{};
+  };
+
+  static const char* TypeName(size_t type);
+
+  std::array<TypeStats, static_cast<size_t>(Command::Type::LAST)> stats_;
+};
@@ -21,12 +21,19 @@
 #include <functional>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <gtest/gtest_prod.h>  // FRIEND_TEST
 
 #include "otautil/rangeset.h"
 
+// Splits |str| at each |delimiter| into |pieces|, like android::base::Split() but with views into
+// |str| instead of copies, so a transfer list with many thousand commands can be tokenized without
+// an allocation per token. |pieces| is cleared first and keeps its capacity, so that it can be
+// reused from one line to the next.
+void SplitView(std::string_view str, char delimiter, std::vector<std::string_view>* pieces);
+
 // Represents the target info used in a Command. TargetInfo contains the ranges of the blocks and
 // the expected hash.
 class TargetInfo {
@@ -139,6 +146,18 @@ class SourceInfo {
     return blocks_;
   }
 
+  const RangeSet& ranges() const {
+    return ranges_;
+  }
+
+  const RangeSet& location() const {
+    return location_;
+  }
+
+  const std::vector<StashInfo>& stashes() const {
+    return stashes_;
+  }
+
   bool operator==(const SourceInfo& other) const {
     return hash_ == other.hash_ && ranges_ == other.ranges_ && location_ == other.location_ &&
            stashes_ == other.stashes_;
@@ -230,6 +249,43 @@ class HashTreeInfo {
   std::string root_hash_;
 };
 
+// The arguments to compute the verity FEC data of blocks on the block device.
+class FecInfo {
+ public:
+  FecInfo() = default;
+
+  FecInfo(RangeSet fec_ranges, RangeSet source_ranges, int roots, std::string fec_hash)
+      : fec_ranges_(std::move(fec_ranges)),
+        source_ranges_(std::move(source_ranges)),
+        roots_(roots),
+        fec_hash_(std::move(fec_hash)) {}
+
+  const RangeSet& fec_ranges() const {
+    return fec_ranges_;
+  }
+  const RangeSet& source_ranges() const {
+    return source_ranges_;
+  }
+
+  int roots() const {
+    return roots_;
+  }
+  const std::string& fec_hash() const {
+    return fec_hash_;
+  }
+
+  bool operator==(const FecInfo& other) const {
+    return fec_ranges_ == other.fec_ranges_ && source_ranges_ == other.source_ranges_ &&
+           roots_ == other.roots_ && fec_hash_ == other.fec_hash_;
+  }
+
+ private:
+  RangeSet fec_ranges_;
+  RangeSet source_ranges_;
+  int roots_{ 0 };
+  std::string fec_hash_;
+};
+
 // Command class holds the info for an update command that performs block-based OTA (BBOTA). Each
 // command consists of one or several args, namely TargetInfo, SourceInfo, StashInfo and PatchInfo.
 // The currently used BBOTA version is v4.
@@ -281,6 +337,11 @@ class HashTreeInfo {
 //      - Computes the hash_tree bytes and writes the result to the specified range on the
 //        block_device.
 //
+//    compute_fec <fec_ranges> <source_ranges> <roots> <fec_hash>
+//      - Computes the verity FEC data of the source_ranges with <roots> parity bytes per codeword,
+//        followed by the libfec header if fec_ranges has room for it, checks it against the SHA-1
+//        fec_hash, and writes it to the specified range on the block_device.
+//
 //    abort
 //      - Abort the current update. Allowed for testing code only.
 //
@@ -289,6 +350,7 @@ class Command {
   enum class Type {
     ABORT,
     BSDIFF,
+    COMPUTE_FEC,
     COMPUTE_HASH_TREE,
     ERASE,
     FREE,
@@ -314,13 +376,15 @@ class Command {
 
   Command(Type type, size_t index, std::string cmdline, HashTreeInfo hash_tree_info);
 
+  Command(Type type, size_t index, std::string cmdline, FecInfo fec_info);
+
   // Parses the given command 'line' into a Command object and returns it. The 'index' is specified
   // by the caller to index the object. On parsing error, it returns an empty Command object that
   // evaluates to false, and the specific error message will be set in 'err'.
-  static Command Parse(const std::string& line, size_t index, std::string* err);
+  static Command Parse(std::string_view line, size_t index, std::string* err);
 
   // Parses the command type from the given string.
-  static Type ParseType(const std::string& type_str);
+  static Type ParseType(std::string_view type_str);
 
   Type type() const {
     return type_;
@@ -354,6 +418,10 @@ class Command {
     return hash_tree_info_;
   }
 
+  const FecInfo& fec_info() const {
+    return fec_info_;
+  }
+
   size_t block_size() const {
     return block_size_;
   }
@@ -380,6 +448,11 @@ class Command {
                                            const std::string& tgt_hash, TargetInfo* target,
                                            const std::string& src_hash, SourceInfo* source,
                                            std::string* err);
+  // Same as above, for the 'count' tokens starting at 'tokens'.
+  static bool ParseTargetInfoAndSourceInfo(const std::string_view* tokens, size_t count,
+                                           const std::string& tgt_hash, TargetInfo* target,
+                                           const std::string& src_hash, SourceInfo* source,
+                                           std::string* err);
 
   // Allows parsing ABORT command, which should be used for testing purpose only.
   static bool abort_allowed_;
@@ -401,6 +474,8 @@ class Command {
   StashInfo stash_;
   // The hash_tree info. Only meaningful for COMPUTE_HASH_TREE.
   HashTreeInfo hash_tree_info_;
+  // The FEC info. Only meaningful for COMPUTE_FEC.
+  FecInfo fec_info_;
   // The unit size of each block to be used in this command.
   size_t block_size_{ 4096 };
 };
@@ -434,7 +509,8 @@ class TransferList {
   TransferList() = default;
 
   // Parses the given input string and returns a TransferList object. Sets error message if any.
-  static TransferList Parse(const std::string& transfer_list_str, std::string* err);
+  // Only the command lines get copied (into Command::cmdline()); the rest is parsed in place.
+  static TransferList Parse(std::string_view transfer_list_str, std::string* err);
 
   int version() const {
     return version_;
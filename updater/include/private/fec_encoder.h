@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "otautil/rangeset.h"
+
+// The verity FEC of an image is what libfec's encoder ("fec --encode") computes: the image is split
+// into the RS(255, 255 - roots) data stripes of |rounds| blocks each, the last one padded with
+// zeros, and the i-th codeword takes the i-th byte of each stripe, so that a run of corrupted
+// blocks spreads over many codewords. The parity of the codewords follows in order, |roots| bytes
+// each.
+
+// Returns the bytes of the FEC data of an image of |image_blocks| blocks of FEC_BLOCKSIZE, without
+// the header block. Returns 0 for invalid |roots|.
+uint64_t GetFecSize(uint64_t image_blocks, int roots);
+
+// Computes the FEC data of the image made of the blocks in |ranges| of |fd| into |fec|. The
+// codewords are split into chunks that get encoded on up to |threads| threads; the result doesn't
+// depend on |threads|. Returns false and sets errno on read errors, or EINVAL for invalid |roots|.
+bool EncodeFec(int fd, const RangeSet& ranges, int roots, size_t threads,
+               std::vector<uint8_t>* fec);
+
+// Appends the FEC_BLOCKSIZE block of the libfec header of the FEC data |fec| of an image of
+// |image_blocks| blocks to |fec|, as libfec expects it at the end of the partition.
+void AppendFecHeader(uint64_t image_blocks, int roots, std::vector<uint8_t>* fec);
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "otautil/trace.h"
+#include "private/block_io.h"
+
+enum class IoTraceOp : uint8_t {
+  kRead,
+  kWrite,
+  kFsync,  // The offset and the length are 0.
+  kCount,
+};
+
+// An extent of a block I/O operation, as stored in the trace file. The extents of one operation
+// (e.g. a ReadBlocks() call) are consecutive and share the batch, so that a replay can submit them
+// together like the updater did.
+struct IoTraceRecord {
+  uint64_t start_ns;     // Since tracing got enabled.
+  uint64_t duration_ns;  // Of the whole operation.
+  uint64_t offset;
+  uint32_t length;
+  uint32_t tid;
+  uint32_t batch;
+  uint32_t file;  // The index into IoTrace::files.
+  IoTraceOp op;
+  uint8_t reserved[7];
+};
+static_assert(sizeof(IoTraceRecord) == 48, "The trace file layout must not change");
+
+// The contents of a trace file. The files are the block devices by path, and the stash files as
+// "stash/<id>".
+struct IoTrace {
+  std::vector<std::string> files;
+  std::vector<IoTraceRecord> records;
+};
+
+// Reads a trace file written by IoTracer::Write(). Returns false on errors.
+bool ReadIoTrace(const std::string& path, IoTrace* trace);
+
+// Records the block I/O of the updater (the reads and the writes of the block devices and of the
+// stash files, and their fsyncs), for io_trace_replay to evaluate other I/O strategies against a
+// real workload. Off by default (see ro.updater.io_trace), in which case recording costs a load.
+// Thread-safe, except for Enable() and Clear().
+class IoTracer {
+ public:
+  static constexpr uint32_t kNoFile = UINT32_MAX;
+
+  static IoTracer& Get();
+
+  // Starts recording, unless it's already on.
+  void Enable();
+  bool enabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  // Returns the index of the file |name| in the trace, or kNoFile if tracing is disabled.
+  uint32_t FileId(const std::string& name);
+
+  // Records an operation on |extents| of |file| that started at |start_ns| (from MonotonicTimeNs())
+  // and ends now. No-op if tracing is disabled or |file| is kNoFile.
+  void Record(IoTraceOp op, uint32_t file, uint64_t start_ns, const std::vector<Extent>& extents);
+
+  // Writes the trace to |path|. Writes nothing if tracing is disabled. Returns false on errors.
+  bool Write(const std::string& path) const;
+
+  // Drops the recorded operations and disables tracing.
+  void Clear();
+
+ private:
+  IoTracer() = default;
+
+  std::atomic<bool> enabled_{ false };
+  mutable std::mutex mutex_;
+  IoTrace trace_;
+  std::map<std::string, uint32_t> file_ids_;
+  uint64_t first_ns_ = 0;
+  uint32_t next_batch_ = 0;
+};
+
+// Records the operation on |extents| of |file| that spans the lifetime of the object. |extents|
+// must outlive it.
+class ScopedIoTrace {
+ public:
+  ScopedIoTrace(IoTraceOp op, uint32_t file, const std::vector<Extent>& extents)
+      : op_(op), file_(file), extents_(&extents), start_ns_(StartNs()) {}
+  // For the operations without extents, i.e. fsyncs.
+  ScopedIoTrace(IoTraceOp op, uint32_t file)
+      : op_(op), file_(file), extents_(nullptr), start_ns_(StartNs()) {}
+
+  ~ScopedIoTrace() {
+    IoTracer::Get().Record(op_, file_, start_ns_,
+                           extents_ != nullptr ? *extents_ : std::vector<Extent>());
+  }
+
+  ScopedIoTrace(const ScopedIoTrace&) = delete;
+  ScopedIoTrace& operator=(const ScopedIoTrace&) = delete;
+
+ private:
+  static uint64_t StartNs() {
+    return IoTracer::Get().enabled() ? MonotonicTimeNs() : 0;
+  }
+
+  IoTraceOp op_;
+  uint32_t file_;
+  const std::vector<Extent>* extents_;
+  uint64_t start_ns_;
+};
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scales the default number of worker threads and the default memory budgets of the block image
+// functions to the load of the device, so that a fixed thread count neither overheats a small SKU
+// nor leaves a large one idle. The load is the maximum temperature of the thermal zones, and the
+// CPU, I/O and memory pressure (the "some avg10" of PSI, in percent of the time stalled). Hot or
+// CPU / I/O bound devices get fewer threads; memory pressure shrinks the budgets instead. Each
+// decision is logged when it changes. Missing thermal zones or PSI files count as no load.
+//
+// Thread-safe; the block image functions may run concurrently from parallel().
+class LoadGovernor {
+ public:
+  struct Load {
+    // The maximum temperature in millidegrees Celsius, or -1 if unknown.
+    int temperature = -1;
+    float cpu_pressure = 0;
+    float io_pressure = 0;
+    float memory_pressure = 0;
+  };
+
+  // Below the soft limits nothing is scaled down; at the hard limits the threads go down to one,
+  // and the budgets to their minimum.
+  static constexpr int kSoftTemperature = 70000;
+  static constexpr int kHardTemperature = 90000;
+  static constexpr float kSoftPressure = 20;
+  static constexpr float kHardPressure = 80;
+  static constexpr float kSoftMemoryPressure = 10;
+  static constexpr float kHardMemoryPressure = 50;
+
+  // How long a sample of the load is reused for.
+  static constexpr std::chrono::milliseconds kSampleInterval{ 1000 };
+
+  // Reads the thermal zones under |thermal_dir| and the PSI files in |pressure_dir|.
+  LoadGovernor(std::string thermal_dir, std::string pressure_dir);
+
+  // Returns the governor for the device, which reads /sys/class/thermal and /proc/pressure.
+  static LoadGovernor& Get();
+
+  // Returns the number of threads, 1 to |max_threads|, for |what| (e.g. "block update hash").
+  size_t Threads(const std::string& what, size_t max_threads);
+
+  // Returns the memory budget, |min_size| to |max_size|, for |what|.
+  size_t Budget(const std::string& what, size_t max_size, size_t min_size);
+
+  // Returns the current load, sampled at most once per kSampleInterval.
+  Load Sample();
+
+  // Takes the load as none from now on, e.g. for the host simulator, whose numbers shouldn't depend
+  // on what else the host is running.
+  void IgnoreLoad();
+
+  // Returns the share, 0 to 1, of the threads or the budgets that |load| leaves.
+  static float ThreadScale(const Load& load);
+  static float BudgetScale(const Load& load);
+
+ private:
+  Load ReadLoad() const;
+  // Logs the decision for |what|, unless it's the same as the last one.
+  void Log(const std::string& what, size_t value, size_t max_value, const Load& load);
+
+  const std::string pressure_dir_;
+  // The temp files of the thermal zones, found once.
+  std::vector<std::string> thermal_paths_;
+
+  std::mutex mutex_;
+  std::chrono::steady_clock::time_point sampled_;
+  bool has_sample_ = false;
+  bool ignore_load_ = false;
+  Load load_;
+  std::map<std::string, size_t> decisions_;
+};
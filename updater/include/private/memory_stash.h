@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "private/block_buffer.h"
+
+// The in-memory tier of the stash. Stashes are kept in RAM up to a budget, and get spilled to the
+// stash files (oldest first) when the budget runs out, or when they need to be durable. A stash
+// that gets freed before that never touches the disk.
+class MemoryStash {
+ public:
+  // Writes the stash |id| to disk. Returns false on errors.
+  using SpillFunction = std::function<bool(const std::string& id, const BlockBuffer& data)>;
+
+  // Keeps up to |capacity| bytes of stashes in memory. A capacity of 0 disables the tier.
+  explicit MemoryStash(size_t capacity) : capacity_(capacity) {}
+
+  // Returns whether a stash of |size| bytes can be kept in memory at all.
+  bool Fits(size_t size) const {
+    return size > 0 && size <= capacity_;
+  }
+
+  // Adds (or replaces) the stash |id|. The caller should Spill() the room for it first.
+  void Add(const std::string& id, BlockBuffer data);
+
+  // Returns the stash |id|, or nullptr if it's not in memory.
+  const BlockBuffer* Find(const std::string& id) const;
+
+  // Drops the stash |id|. Returns false if it's not in memory.
+  bool Erase(const std::string& id);
+
+  // Spills the oldest stashes with |spill| until another |size| bytes fit in the budget. Returns
+  // false if |spill| fails, in which case the stash that failed stays in memory.
+  bool Spill(size_t size, const SpillFunction& spill);
+
+  // Spills the stashes for which |select| returns true, oldest first. Returns false if |spill|
+  // fails.
+  bool SpillIf(const std::function<bool(const std::string& id)>& select,
+               const SpillFunction& spill);
+
+  void Clear();
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  void set_capacity(size_t capacity) {
+    capacity_ = capacity;
+  }
+
+  // Total size of the stashes in memory.
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return stashes_.empty();
+  }
+
+ private:
+  struct Entry {
+    std::list<std::string>::iterator order;
+    BlockBuffer data;
+  };
+
+  size_t capacity_;
+  size_t size_{ 0 };
+  // The stash ids, oldest first.
+  std::list<std::string> order_;
+  std::unordered_map<std::string, Entry> stashes_;
+};
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <ziparchive/zip_archive.h>
+
+// Where the bsdiff/imgdiff commands get their patches from, i.e. the patch data entry of the
+// package. If the entry is stored uncompressed, the patches are read in place from the mapped
+// package. Otherwise the entry is inflated on a background thread as the patches get read, so the
+// package can ship patch.dat compressed.
+class PatchSource {
+ public:
+  virtual ~PatchSource() = default;
+
+  // Creates the source for |entry| of |za|. A stored entry is read from |mapped_package| (the
+  // address of the mapped package, or nullptr if it isn't mapped). A compressed one is inflated
+  // ahead of the reader by up to |window| bytes.
+  static std::unique_ptr<PatchSource> Create(ZipArchiveHandle za, const ZipEntry64& entry,
+                                             const uint8_t* mapped_package, size_t window);
+
+  // Returns all the patch data if it's in memory, or nullptr.
+  virtual const uint8_t* data() const = 0;
+
+  // Sets |patch| to the |length| bytes at |offset| of the patch data. Reading the patches in the
+  // order of their offsets, as the transfer list does, streams through a compressed entry once; an
+  // earlier offset has to inflate it again from the start. Returns false on errors.
+  virtual bool Read(size_t offset, size_t length, std::string* patch) = 0;
+
+  // Same as Read(), but points |patch| into the patch data instead of copying it. Only works when
+  // data() isn't nullptr; returns false otherwise, or if the range is out of bounds.
+  virtual bool ReadInPlace(size_t offset, size_t length, std::string_view* patch) = 0;
+};
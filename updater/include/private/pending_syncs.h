@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <android-base/unique_fd.h>
+
+// Tracks the filesystems that the updater builtins have written to without syncing them, so that
+// a script writing hundreds of files pays for one syncfs() per filesystem instead of a fsync() per
+// file. The filesystems are synced at the barriers: sync() in the script, reboot_now(), unmount()
+// of a dirty filesystem, block_image_update() on the device of a dirty filesystem, and the end of
+// the script.
+//
+// Crash consistency: a write is only durable once the next barrier returns. That's enough for the
+// retry semantics, since an interrupted update resumes by running the whole script again, and every
+// builtin that's tracked here (extracting files, renames, symlinks, write_value) can be redone.
+class PendingSyncs {
+ public:
+  static PendingSyncs& Get();
+
+  // Records that the filesystem containing |path| has unsynced writes. |path| itself doesn't need
+  // to exist or be followable (e.g. a dangling symlink); it's looked up through its directory.
+  void Add(const std::string& path);
+
+  // Syncs all the filesystems with unsynced writes. Returns false if any of them fails.
+  bool SyncAll();
+
+  // Syncs the filesystem on the block device |dev|, if it has unsynced writes.
+  bool SyncDevice(dev_t dev);
+
+  // Returns the number of filesystems with unsynced writes.
+  size_t size() const;
+
+ private:
+  PendingSyncs() = default;
+
+  // A directory on a dirty filesystem, opened for syncfs().
+  struct DirtyFilesystem {
+    android::base::unique_fd fd;
+    std::string dir;
+  };
+
+  static bool Sync(const DirtyFilesystem& filesystem);
+
+  mutable std::mutex mutex_;
+  // The dirty filesystems, keyed by their devices.
+  std::map<dev_t, DirtyFilesystem> filesystems_;
+};
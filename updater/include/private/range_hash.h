@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <openssl/evp.h>
+
+#include "otautil/rangeset.h"
+
+// Computes the SHA-1 of the blocks in |ranges| of |fd|, as range_sha1() does. The blocks are read
+// ahead with large sequential reads on a separate thread, so the reads overlap with the hashing.
+// Returns false and sets errno on read errors.
+bool RangeSha1(int fd, const RangeSet& ranges, size_t block_size, uint8_t* digest);
+
+// Computes the tree digest of range_sha256_tree(). |ranges| is split into |groups| with
+// RangeSet::Split(); the SHA-256 of the blocks of each group forms a leaf, and the digest is the
+// SHA-256 of all the leaves concatenated in order. So the result only depends on |groups|, while
+// the leaves get hashed on up to |threads| threads. Returns false and sets errno on read errors.
+bool RangeSha256Tree(int fd, const RangeSet& ranges, size_t groups, size_t block_size,
+                     size_t threads, uint8_t* digest);
+
+// Computes the bottom level of the dm-verity hash tree over the blocks in |ranges|, i.e. the digest
+// |md|(salt || block) of each block in order, into |leaves|. This is the bulk of the work of
+// HashTreeBuilder, and gets done on up to |threads| threads. Returns false and sets errno on read
+// errors.
+bool HashTreeLeaves(int fd, const RangeSet& ranges, size_t block_size, const EVP_MD* md,
+                    const std::vector<unsigned char>& salt, size_t threads,
+                    std::vector<unsigned char>* leaves);
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "otautil/rangeset.h"
+#include "private/block_buffer.h"
+
+// An LRU cache of the source blocks that have been read from the partition and verified against
+// their SHA-1, keyed by the hash. A command that reads the same ranges again (e.g. a "move" of
+// blocks that were just stashed) then gets them without the disk read or the hashing. The entries
+// must be invalidated as soon as any of their blocks gets written.
+class SourceCache {
+ public:
+  // Keeps up to |capacity| bytes of blocks. A capacity of 0 disables the cache.
+  explicit SourceCache(size_t capacity) : capacity_(capacity) {}
+
+  // Copies the blocks of |ranges| into |buffer| if they are cached with the SHA-1 |hash|, and marks
+  // them as the most recently used. |buffer| must be able to hold |ranges.blocks()| blocks.
+  bool Get(const std::string& hash, const RangeSet& ranges, uint8_t* buffer);
+
+  // Adds (or replaces) the |size| bytes at |data| as the blocks of |ranges| with the SHA-1 |hash|,
+  // evicting the least recently used ones as needed. Blocks larger than the capacity aren't cached.
+  void Put(const std::string& hash, const RangeSet& ranges, const uint8_t* data, size_t size);
+
+  // Drops the entries that overlap with |ranges|, which are about to be written.
+  void Invalidate(const RangeSet& ranges);
+
+  void Clear();
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  void set_capacity(size_t capacity);
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  struct Entry {
+    std::string hash;
+    RangeSet ranges;
+    BlockBuffer data;
+  };
+
+  void Erase(std::list<Entry>::iterator it);
+
+  void EvictToCapacity();
+
+  size_t capacity_;
+  // Total size of the cached blocks.
+  size_t size_{ 0 };
+  // Most recently used first.
+  std::list<Entry> lru_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+};
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <android-base/mapped_file.h>
+
+// An LRU cache of the read-only mappings of the stash files, keyed by the stash id (i.e. the SHA-1
+// of the stashed blocks). Stashes that are referenced by many commands then get mapped once, and
+// the commands copy the blocks straight out of the mapping.
+class StashCache {
+ public:
+  using Mapping = std::shared_ptr<const android::base::MappedFile>;
+
+  // Keeps up to |capacity| bytes worth of mappings. A capacity of 0 disables the cache.
+  explicit StashCache(size_t capacity) : capacity_(capacity) {}
+
+  // Returns the mapping of |id|, or nullptr if it's not cached. Marks it as the most recently used.
+  Mapping Get(const std::string& id);
+
+  // Adds (or replaces) the mapping of |id|, evicting the least recently used ones as needed. A
+  // mapping larger than the capacity isn't cached.
+  void Put(const std::string& id, Mapping mapping);
+
+  // Drops the mapping of |id|, e.g. once the stash file gets deleted or rewritten.
+  void Erase(const std::string& id);
+
+  void Clear();
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  void set_capacity(size_t capacity);
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  void EvictToCapacity();
+
+  size_t capacity_;
+  // Total size of the cached mappings.
+  size_t size_{ 0 };
+  // Most recently used first.
+  std::list<std::pair<std::string, Mapping>> lru_;
+  std::unordered_map<std::string, decltype(lru_)::iterator> entries_;
+};
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "private/block_buffer.h"
+
+// The suffix of the stash files that hold a compressed stash, rather than the raw blocks.
+constexpr const char* kCompressedStashSuffix = ".lz4";
+
+// Compresses the |size| bytes of blocks at |data| into |frame|, as a single LZ4 frame that carries
+// the content size and the checksums of its blocks and of the whole content. Returns false if that
+// fails, or if it wouldn't save a block's worth of space, in which case the stash should be stored
+// raw.
+bool CompressStash(const uint8_t* data, size_t size, std::vector<uint8_t>* frame);
+
+// Decompresses the LZ4 frame of |size| bytes at |frame| into |buffer|. Returns false if the frame
+// is corrupt (i.e. any of its checksums doesn't match), truncated, or doesn't hold a whole number
+// of blocks.
+bool DecompressStash(const uint8_t* frame, size_t size, BlockBuffer* buffer);
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "otautil/rangeset.h"
+#include "private/commands.h"
+
+// The execution plan of a transfer list, worked out from all the commands ahead of time: the
+// largest buffers the commands need, the lifetimes of the stashes, the commands that read from the
+// partition (for read-ahead), and the runs of commands that don't depend on each other.
+struct TransferPlan {
+  static constexpr size_t kNever = std::numeric_limits<size_t>::max();
+
+  // The commands of a run don't touch the blocks (or the stashes) of one another, so they could be
+  // executed in any order, or concurrently.
+  static constexpr size_t kMaxRunLength = 64;
+
+  struct StashLifetime {
+    std::string id;
+    size_t blocks;
+    // The indices of the "stash" command, the last command that loads the stash (or the stash
+    // command itself if none does), and the "free" command (or kNever).
+    size_t stashed;
+    size_t last_use;
+    size_t freed;
+  };
+
+  // The fewest source blocks of a patch that get mapped from the partition instead of copied into
+  // memory; below that, the mapping costs more than the copy.
+  static constexpr size_t kMinMappedSourceBlocks = 256;
+
+  static TransferPlan Analyze(const TransferList& transfer_list);
+
+  // Returns whether |command| is a bsdiff/imgdiff command whose source can be mapped from the
+  // partition for the patch: at least kMinMappedSourceBlocks blocks, read from the partition alone,
+  // and not overlapping the target, which would overwrite it while it's being patched.
+  static bool CanMapSource(const Command& command);
+
+  // Returns the lifetime of the stash made by command |cmdindex|, or nullptr if that isn't a
+  // "stash" command (or re-stashes a live id).
+  const StashLifetime* FindStash(size_t cmdindex) const;
+
+  size_t commands{ 0 };
+  // The most blocks a command reads as its source (at least 1, for the zero command), writes as its
+  // target, or stashes at once.
+  size_t max_source_blocks{ 1 };
+  size_t max_target_blocks{ 0 };
+  size_t max_stash_blocks{ 0 };
+  // Same as max_source_blocks, for the commands whose source can't be mapped (see CanMapSource()).
+  size_t max_copied_source_blocks{ 1 };
+  // The most blocks in the stashes made by the "stash" commands that are alive at the same time.
+  size_t peak_stash_blocks{ 0 };
+  // In the order of the stash commands.
+  std::vector<StashLifetime> stashes;
+  // A command that reads blocks from the partition.
+  struct Read {
+    size_t index;
+    RangeSet ranges;
+  };
+
+  // In the order of the commands.
+  std::vector<Read> reads;
+  // The index of the first command of each run (see kMaxRunLength).
+  std::vector<size_t> runs;
+
+  // Totals, which give an idea of how long the update takes.
+  uint64_t blocks_read{ 0 };
+  uint64_t blocks_written{ 0 };
+  uint64_t new_blocks{ 0 };
+  uint64_t blocks_stashed{ 0 };
+  uint64_t patch_bytes{ 0 };
+};
+
+std::ostream& operator<<(std::ostream& os, const TransferPlan& plan);
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ostream>
+#include <vector>
+
+#include "private/commands.h"
+
+// The outcome of a hash check that CheckCommandsAhead() made; kUnknown if it wasn't made, or
+// couldn't be (e.g. on a read error, or for a stash that's not loaded from the source blocks).
+enum class AheadCheck : uint8_t {
+  kUnknown,
+  kMatch,
+  kMismatch,
+};
+
+struct AheadChecks {
+  // Whether the target blocks of a move/bsdiff/imgdiff command have the expected contents already.
+  AheadCheck target = AheadCheck::kUnknown;
+  // Whether the source of a move/bsdiff/imgdiff command, assembled from the source blocks and the
+  // stashes, or the source blocks of a stash command, have the expected contents. Only a kMatch is
+  // reported; a source that doesn't match is left kUnknown, for the command to find out (and
+  // report) by itself.
+  AheadCheck source = AheadCheck::kUnknown;
+};
+
+struct AheadCheckStats {
+  size_t checks = 0;
+  size_t batches = 0;
+  size_t extents = 0;  // The reads, after merging the ranges of the checks in a batch.
+  uint64_t bytes = 0;  // The bytes read, including the gaps that have been read across.
+};
+
+std::ostream& operator<<(std::ostream& os, const AheadCheckStats& stats);
+
+// Makes the hash checks of block_image_verify for all the commands of |transfer_list| at once. In
+// verify mode nothing gets written, so the checks are independent of each other, as long as the
+// stashes are taken from the source blocks of their stash commands, as LoadStash() does in verify
+// mode. The checks are sorted by their first block and put into batches of up to |batch_bytes|;
+// the ranges of a batch are merged into large sorted reads, and the batches get read and hashed on
+// |threads| threads. A check larger than a batch is read in |batch_bytes| pieces on its own.
+// Returns the outcomes by command index.
+std::vector<AheadChecks> CheckCommandsAhead(int fd, const TransferList& transfer_list,
+                                            size_t block_size, size_t threads, size_t batch_bytes,
+                                            AheadCheckStats* stats);
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "private/brotli_segments.h"
+
+// The zstd compressed variant of the new data (e.g. system.new.dat.zst). It's a sequence of one or
+// more zstd frames, which can be decompressed as a single stream. The frames don't depend on each
+// other; if the frames record their uncompressed sizes, they can also be decompressed in parallel,
+// straight out of the mapped package, which is how a package compressed with `zstd -T0` (or with
+// any multi-threaded compressor that produces one frame per job) gets decompressed the fastest.
+
+constexpr const char* kZstdSuffix = ".zst";
+
+// Splits the |size| bytes of zstd compressed |data| into its frames. Returns false and sets |err|
+// if the data is malformed, or if any frame doesn't record its uncompressed size, in which case
+// the data can only be decompressed as a stream.
+bool FindZstdFrames(const uint8_t* data, size_t size, std::vector<CompressedSegment>* frames,
+                    std::string* err);
+
+// Decompresses the zstd |frames| of |data|, as DecompressSegments() does.
+bool DecompressZstdFrames(const uint8_t* data, const std::vector<CompressedSegment>& frames,
+                          size_t num_threads,
+                          const std::function<bool(const uint8_t*, size_t)>& sink);
@@ -51,6 +51,10 @@ class BuildInfo {
   std::string FindBlockDeviceName(const std::string_view name) const;
   // Parses the given target-file, initializes the build properties and extracts the images.
   bool ParseTargetFile(const std::string_view target_file_path, bool extracted_input);
+  // Points the mock block devices to copies of their images under |dir|, so that another update
+  // can be simulated on the same source build without parsing it again. Removing the copies is up
+  // to the caller.
+  bool CopyImages(const std::string_view dir);
 
   std::string GetOemSettings() const {
     return oem_settings_;
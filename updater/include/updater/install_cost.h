@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "private/io_trace.h"
+
+// The cost of a simulated install, as named values, e.g. "io_system.img_read_bytes: 1048576". Most
+// of them are counters that only change along with the package or the updater: the bytes and the
+// operations of the block I/O per file (the stash files counting as "stash"), the bytes written and
+// stashed, and the commands per partition and type. The others are measurements, which vary from
+// run to run: the CPU time (the names ending in "_ms") and the memory (ending in "_kb").
+class InstallCost {
+ public:
+  // The least change of a measurement that counts as a regression, in ms or KiB, since a short
+  // command may well take twice the CPU time in the next run.
+  static constexpr uint64_t kMeasurementSlack = 10;
+
+  // Adds the bytes read and written, the read and the write operations and the fsyncs of each file
+  // in |trace|.
+  void AddIoTrace(const IoTrace& trace);
+
+  // Adds the stats that block_image_update() writes to the command pipe, i.e. the "log" lines of
+  // the bytes written and stashed per partition, and the count and the CPU time of the commands by
+  // type. Ignores the other lines.
+  void AddCommandPipe(const std::string& content);
+
+  void Set(const std::string& name, uint64_t value) {
+    values_[name] = value;
+  }
+
+  const std::map<std::string, uint64_t>& values() const {
+    return values_;
+  }
+
+  // Returns a "<name>: <value>" line per value, sorted by name.
+  std::string ToString() const;
+
+  // Parses |content| written by ToString() into |cost|. Returns false on errors.
+  static bool Parse(const std::string& content, InstallCost* cost);
+
+  // Returns the values that went up from |baseline|, with the old and the new value each. Any
+  // increase of a counter is a regression, whereas a measurement needs to go up by more than
+  // |tolerance_percent| and kMeasurementSlack. The values missing from |baseline| count from 0.
+  std::vector<std::string> FindRegressions(const InstallCost& baseline,
+                                           double tolerance_percent) const;
+
+  static bool IsMeasurement(const std::string& name);
+
+ private:
+  std::map<std::string, uint64_t> values_;
+};
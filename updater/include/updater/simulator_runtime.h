@@ -37,6 +37,12 @@ class SimulatorRuntime : public UpdaterRuntimeInterface {
   std::string GetProperty(const std::string_view key,
                           const std::string_view default_value) const override;
 
+  // Answers GetProperty() for the keys in |overrides| with their values instead of the source
+  // build's, e.g. to pin the updater's tunables.
+  void set_property_overrides(std::map<std::string, std::string, std::less<>> overrides) {
+    property_overrides_ = std::move(overrides);
+  }
+
   int Mount(const std::string_view location, const std::string_view mount_point,
             const std::string_view fs_type, const std::string_view mount_options) override;
   bool IsMounted(const std::string_view mount_point) const override;
@@ -59,5 +65,6 @@ class SimulatorRuntime : public UpdaterRuntimeInterface {
   std::string FindBlockDeviceName(const std::string_view name) const override;
 
   BuildInfo* source_;
+  std::map<std::string, std::string, std::less<>> property_overrides_;
   std::map<std::string, std::string, std::less<>> mounted_partitions_;
 };
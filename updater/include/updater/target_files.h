@@ -16,12 +16,15 @@
 
 #pragma once
 
+#include <sys/types.h>
+
 #include <map>
 #include <string>
 #include <string_view>
 #include <vector>
 
 #include <android-base/file.h>
+#include <android-base/unique_fd.h>
 #include <ziparchive/zip_archive.h>
 
 // This class represents the mount information for each line in a fstab file.
@@ -52,7 +55,8 @@ class TargetFile {
   bool ParseFstabInfo(std::vector<FstabInfo>* fstab_info_list) const;
   // Returns true if the given entry exists in the target file.
   bool EntryExists(const std::string_view name) const;
-  // Extracts the image file |entry_name|. Returns true on success.
+  // Extracts the image file |entry_name|. Returns true on success. Different images may be
+  // extracted on several threads at once.
   bool ExtractImage(const std::string_view entry_name, const FstabInfo& fstab_info,
                     const std::string_view work_dir, TemporaryFile* image_file) const;
 
@@ -61,6 +65,10 @@ class TargetFile {
   // directory.
   bool ReadEntryToString(const std::string_view name, std::string* content) const;
   bool ExtractEntryToTempFile(const std::string_view name, TemporaryFile* temp_file) const;
+  // Opens the entry for reading in place, i.e. the file in the extracted input directory, or the
+  // zipped target-file if the entry is stored uncompressed. On success, sets |*offset| to where the
+  // entry's data starts in the returned fd. Returns -1 if the entry needs to be extracted instead.
+  android::base::unique_fd OpenEntryInPlace(const std::string_view name, off64_t* offset) const;
 
   std::string path_;      // Path to the zipped target-file or an extracted directory.
   bool extracted_input_;  // True if the target-file has been extracted.
@@ -19,7 +19,9 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <chrono>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
 
@@ -45,7 +47,9 @@ class Updater : public UpdaterInterface {
   // evaluation fails.
   bool RunUpdate();
 
-  // Writes the message to command pipe, adds a new line in the end.
+  // Writes the message to command pipe, adds a new line in the end. "set_progress" messages that
+  // follow each other within kProgressInterval are coalesced: only the latest one is kept, and it's
+  // written ahead of the next message (or when the updater finishes).
   void WriteToCommandPipe(const std::string_view message, bool flush = false) const override;
 
   // Sends over the message to recovery to print it on the screen.
@@ -68,6 +72,7 @@ class Updater : public UpdaterInterface {
   size_t GetMappedPackageLength() const override {
     return mapped_package_.length;
   }
+  void AdvisePackageRead(uint64_t offset, uint64_t length) const override;
 
  private:
   friend class UpdaterTestBase;
@@ -82,6 +87,13 @@ class Updater : public UpdaterInterface {
   // Parses the error code embedded in state->errmsg; and reports the error code and cause code.
   void ParseAndReportErrorCode(State* state);
 
+  // Writes out the set_progress message held back by WriteToCommandPipe(), if any.
+  void WritePendingProgress() const;
+  // As above, with pipe_mutex_ held.
+  void WritePendingProgressLocked() const;
+
+  static constexpr std::chrono::milliseconds kProgressInterval{ 50 };
+
   std::unique_ptr<UpdaterRuntimeInterface> runtime_;
 
   MemMapping mapped_package_;
@@ -90,6 +102,11 @@ class Updater : public UpdaterInterface {
 
   bool is_retry_{ false };
   std::unique_ptr<FILE, decltype(&fclose)> cmd_pipe_{ nullptr, fclose };
+  // Guards the writes to the pipe and the progress below, as parallel() may run functions that
+  // report on several threads.
+  mutable std::mutex pipe_mutex_;
+  mutable std::string pending_progress_;
+  mutable std::chrono::steady_clock::time_point last_progress_time_;
 
   std::string result_;
   std::vector<std::string> skipped_functions_;
@@ -16,7 +16,9 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
 #include <utility>
@@ -24,10 +26,15 @@
 
 #include "edify/updater_runtime_interface.h"
 
+class BlockQueueTuner;
+
 class UpdaterRuntime : public UpdaterRuntimeInterface {
  public:
-  explicit UpdaterRuntime(struct selabel_handle* sehandle) : sehandle_(sehandle) {}
-  ~UpdaterRuntime() override = default;
+  // Loads the file contexts with |sehandle_loader| (if set) on the first call to sehandle().
+  // Installs that don't create any files (e.g. block-based ones) never need them, and skip loading
+  // them.
+  explicit UpdaterRuntime(std::function<struct selabel_handle*()> sehandle_loader);
+  ~UpdaterRuntime() override;
 
   bool IsSimulator() const override {
     return false;
@@ -56,10 +63,17 @@ class UpdaterRuntime : public UpdaterRuntimeInterface {
   bool UpdateDynamicPartitions(const std::string_view op_list_value) override;
   std::string AddSlotSuffix(const std::string_view arg) const override;
 
-  struct selabel_handle* sehandle() const override {
-    return sehandle_;
-  }
+  std::vector<std::string> TuneBlockQueues(const std::string_view path,
+                                           BlockAccess access) override;
+  void RestoreBlockQueues(const std::string_view path) override;
+
+  struct selabel_handle* sehandle() const override;
 
  private:
-  struct selabel_handle* sehandle_{ nullptr };
+  std::function<struct selabel_handle*()> sehandle_loader_;
+  mutable std::once_flag sehandle_loaded_;
+  mutable struct selabel_handle* sehandle_{ nullptr };
+  // Created once the first block device gets tuned; see ro.updater.block_queue_*.
+  std::once_flag block_queues_created_;
+  std::unique_ptr<BlockQueueTuner> block_queues_;
 };
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/capability.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -35,11 +36,18 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <linux/fs.h>
 #include <linux/xattr.h>
 
+#include <algorithm>
+#include <atomic>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -63,9 +71,11 @@
 #include "edify/updater_runtime_interface.h"
 #include "otautil/dirutil.h"
 #include "otautil/error_code.h"
+#include "otautil/phase_stats.h"
 #include "otautil/print_sha1.h"
 #include "otautil/sysutil.h"
 #include "otautil/ziputil.h"
+#include "private/pending_syncs.h"
 
 #ifndef __ANDROID__
 #include <cutils/memory.h>  // for strlcpy
@@ -124,16 +134,21 @@ Value* UIPrintFn(const char* name, State* state, const std::vector<std::unique_p
   return StringValue(buffer);
 }
 
-// package_extract_dir(package_dir, dest_dir)
+// The optional last argument of package_extract_dir() and package_extract_file() that leaves the
+// files with the right contents alone.
+static constexpr const char* kSkipUnchanged = "skip_unchanged";
+
+// package_extract_dir(package_dir, dest_dir[, "skip_unchanged"])
 //   Extracts all files from the package underneath package_dir and writes them to the
-//   corresponding tree beneath dest_dir. Any existing files are overwritten.
+//   corresponding tree beneath dest_dir. Any existing files are overwritten, unless
+//   "skip_unchanged" is given and they already have the size and CRC32 of their entries.
 //   Example: package_extract_dir("system", "/system")
 //
 //   Note: package_dir needs to be a relative path; dest_dir needs to be an absolute path.
 Value* PackageExtractDirFn(const char* name, State* state,
                            const std::vector<std::unique_ptr<Expr>>& argv) {
-  if (argv.size() != 2) {
-    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 2 args, got %zu", name,
+  if (argv.size() != 2 && argv.size() != 3) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 2 or 3 args, got %zu", name,
                       argv.size());
   }
 
@@ -143,6 +158,11 @@ Value* PackageExtractDirFn(const char* name, State* state,
   }
   const std::string& zip_path = args[0];
   const std::string& dest_path = args[1];
+  if (args.size() == 3 && args[2] != kSkipUnchanged) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() unknown option \"%s\"", name,
+                      args[2].c_str());
+  }
+  bool skip_unchanged = args.size() == 3;
 
   auto updater = state->updater;
 
@@ -152,24 +172,25 @@ Value* PackageExtractDirFn(const char* name, State* state,
   constexpr struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
   bool success = ExtractPackageRecursive(za, zip_path, dest_path, &timestamp,
-                                         updater->GetRuntime()->sehandle());
+                                         updater->GetRuntime()->sehandle(), skip_unchanged);
 
   return StringValue(success ? "t" : "");
 }
 
-// package_extract_file(package_file[, dest_file])
+// package_extract_file(package_file[, dest_file[, "skip_unchanged"]])
 //   Extracts a single package_file from the update package and writes it to dest_file,
-//   overwriting existing files if necessary. Without the dest_file argument, returns the
+//   overwriting existing files if necessary. With "skip_unchanged", a dest_file that already has
+//   the size and CRC32 of the entry is left alone. Without the dest_file argument, returns the
 //   contents of the package file as a binary blob.
 Value* PackageExtractFileFn(const char* name, State* state,
                             const std::vector<std::unique_ptr<Expr>>& argv) {
-  if (argv.size() < 1 || argv.size() > 2) {
-    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 1 or 2 args, got %zu", name,
+  if (argv.size() < 1 || argv.size() > 3) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 1 to 3 args, got %zu", name,
                       argv.size());
   }
 
-  if (argv.size() == 2) {
-    // The two-argument version extracts to a file.
+  if (argv.size() >= 2) {
+    // The two- and three-argument versions extract to a file.
 
     std::vector<std::string> args;
     if (!ReadArgs(state, argv, &args)) {
@@ -178,6 +199,10 @@ Value* PackageExtractFileFn(const char* name, State* state,
     }
     const std::string& zip_path = args[0];
     std::string dest_path = args[1];
+    if (args.size() == 3 && args[2] != kSkipUnchanged) {
+      return ErrorAbort(state, kArgsParsingFailure, "%s() unknown option \"%s\"", name,
+                        args[2].c_str());
+    }
 
     ZipArchiveHandle za = state->updater->GetPackageHandle();
     ZipEntry64 entry;
@@ -193,6 +218,11 @@ Value* PackageExtractFileFn(const char* name, State* state,
       dest_path = block_device_name;
     }
 
+    if (args.size() == 3 && FileMatchesZipEntry(dest_path, entry)) {
+      LOG(INFO) << name << ": " << dest_path << " is unchanged; skipped";
+      return StringValue("t");
+    }
+
     android::base::unique_fd fd(TEMP_FAILURE_RETRY(
         open(dest_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)));
     if (fd == -1) {
@@ -201,6 +231,7 @@ Value* PackageExtractFileFn(const char* name, State* state,
     }
 
     bool success = true;
+    state->updater->AdvisePackageRead(entry.offset, entry.compressed_length);
     int32_t ret = ExtractEntryToFile(za, &entry, fd);
     if (ret != 0) {
       LOG(ERROR) << name << ": Failed to extract entry \"" << zip_path << "\" ("
@@ -208,7 +239,11 @@ Value* PackageExtractFileFn(const char* name, State* state,
                  << "\": " << ErrorCodeString(ret);
       success = false;
     }
-    if (fsync(fd) == -1) {
+    // A block device is flushed right away. A regular file is left to the next barrier, which
+    // syncs its whole filesystem once for all the files written in between.
+    if (struct stat sb; fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+      PendingSyncs::Get().Add(dest_path);
+    } else if (CountFsync(); fsync(fd) == -1) {
       PLOG(ERROR) << "fsync of \"" << dest_path << "\" failed";
       success = false;
     }
@@ -236,6 +271,16 @@ Value* PackageExtractFileFn(const char* name, State* state,
                         zip_path.c_str());
     }
 
+    // A stored entry is handed out in place from the mapped package, which outlives the script.
+    // This saves copying what is typically a multi-megabyte transfer list or patch.
+    const uint8_t* mapped_package = state->updater->GetMappedPackageAddress();
+    size_t mapped_length = state->updater->GetMappedPackageLength();
+    if (entry.method == kCompressStored && mapped_package != nullptr &&
+        static_cast<uint64_t>(entry.offset) + entry.uncompressed_length <= mapped_length) {
+      const char* data = reinterpret_cast<const char*>(mapped_package) + entry.offset;
+      return new Value(std::string_view(data, entry.uncompressed_length));
+    }
+
     std::string buffer;
     if (entry.uncompressed_length > std::numeric_limits<size_t>::max()) {
       return ErrorAbort(state, kPackageExtractFileFailure,
@@ -252,8 +297,133 @@ Value* PackageExtractFileFn(const char* name, State* state,
                         zip_path.c_str(), buffer.size(), ErrorCodeString(ret));
     }
 
-    return new Value(Value::Type::BLOB, buffer);
+    return new Value(Value::Type::BLOB, std::move(buffer));
+  }
+}
+
+// The size of the writes that package_extract_partition() batches the inflated data into.
+static constexpr size_t kPartitionWriteBufferSize = 1024 * 1024;
+
+// Collects the inflated data of an entry into large writes to |fd|, hashing it on the way.
+struct PartitionWriter {
+  int fd;
+  std::vector<uint8_t> buffer;
+  SHA_CTX sha_ctx;
+
+  bool Write(const uint8_t* data, size_t len) {
+    SHA1_Update(&sha_ctx, data, len);
+    if (buffer.empty() && len >= kPartitionWriteBufferSize) {
+      return android::base::WriteFully(fd, data, len);
+    }
+    buffer.insert(buffer.end(), data, data + len);
+    return buffer.size() < kPartitionWriteBufferSize || Flush();
+  }
+
+  bool Flush() {
+    if (!android::base::WriteFully(fd, buffer.data(), buffer.size())) {
+      return false;
+    }
+    buffer.clear();
+    return true;
+  }
+};
+
+static bool WriteToPartition(const uint8_t* data, size_t len, void* cookie) {
+  return static_cast<PartitionWriter*>(cookie)->Write(data, len);
+}
+
+// package_extract_partition(package_file, block_device[, sha1])
+//   Streams package_file from the update package into block_device, without holding the whole
+//   entry in memory as the one-argument package_extract_file() does. The device is discarded
+//   first, so the flash doesn't need to preserve its old contents. If sha1 is given, the extracted
+//   contents must match it. Returns "t" on success, or "" on failures.
+Value* PackageExtractPartitionFn(const char* name, State* state,
+                                 const std::vector<std::unique_ptr<Expr>>& argv) {
+  if (argv.size() != 2 && argv.size() != 3) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 2 or 3 args, got %zu", name,
+                      argv.size());
+  }
+
+  std::vector<std::string> args;
+  if (!ReadArgs(state, argv, &args)) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() Failed to parse %zu args", name,
+                      argv.size());
+  }
+  const std::string& zip_path = args[0];
+  std::string dest_path = args[1];
+
+  ZipArchiveHandle za = state->updater->GetPackageHandle();
+  ZipEntry64 entry;
+  if (FindEntry(za, zip_path, &entry) != 0) {
+    LOG(ERROR) << name << ": no " << zip_path << " in package";
+    return StringValue("");
+  }
+
+  if (std::string block_device_name = state->updater->FindBlockDeviceName(dest_path);
+      !block_device_name.empty()) {
+    dest_path = block_device_name;
+  }
+
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(open(dest_path.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR)));
+  if (fd == -1) {
+    PLOG(ERROR) << name << ": can't open " << dest_path << " for write";
+    return StringValue("");
+  }
+
+  // The size and discard only apply to block devices; the simulator writes to a regular file.
+  uint64_t device_size;
+  if (ioctl(fd, BLKGETSIZE64, &device_size) == 0) {
+    if (entry.uncompressed_length > device_size) {
+      LOG(ERROR) << name << ": " << zip_path << " (" << entry.uncompressed_length
+                 << " bytes) doesn't fit in " << dest_path << " (" << device_size << " bytes)";
+      return StringValue("");
+    }
+    uint64_t range[2] = { 0, device_size };
+    if (ioctl(fd, BLKDISCARD, &range) == -1 && errno != EOPNOTSUPP) {
+      PLOG(WARNING) << name << ": failed to discard " << dest_path;
+    }
+  }
+
+  PartitionWriter writer{ fd.get(), {}, {} };
+  writer.buffer.reserve(kPartitionWriteBufferSize);
+  SHA1_Init(&writer.sha_ctx);
+
+  // A stored entry is written straight from the mapped package.
+  const uint8_t* mapped_package = state->updater->GetMappedPackageAddress();
+  state->updater->AdvisePackageRead(entry.offset, entry.compressed_length);
+  bool written = true;
+  if (entry.method == kCompressStored && mapped_package != nullptr &&
+      static_cast<uint64_t>(entry.offset) + entry.uncompressed_length <=
+          state->updater->GetMappedPackageLength()) {
+    written = writer.Write(mapped_package + entry.offset, entry.uncompressed_length);
+  } else if (int32_t ret = ProcessZipEntryContents(za, &entry, WriteToPartition, &writer);
+             ret != 0) {
+    LOG(ERROR) << name << ": Failed to extract entry \"" << zip_path << "\" to \"" << dest_path
+               << "\": " << ErrorCodeString(ret);
+    return StringValue("");
+  }
+  if (!written || !writer.Flush()) {
+    PLOG(ERROR) << name << ": Failed to write " << zip_path << " to " << dest_path;
+    return StringValue("");
+  }
+
+  CountFsync();
+  if (fsync(fd) == -1) {
+    PLOG(ERROR) << "fsync of \"" << dest_path << "\" failed";
+    return StringValue("");
+  }
+
+  if (args.size() == 3) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1_Final(digest, &writer.sha_ctx);
+    if (std::string sha1 = print_sha1(digest); sha1 != args[2]) {
+      LOG(ERROR) << name << ": " << zip_path << " has SHA-1 " << sha1 << ", expected " << args[2];
+      return StringValue("");
+    }
   }
+
+  return StringValue("t");
 }
 
 // patch_partition_check(target_partition, source_partition)
@@ -432,6 +602,11 @@ Value* UnmountFn(const char* name, State* state, const std::vector<std::unique_p
                       "mount_point argument to unmount() can't be empty");
   }
 
+  // A pending sync holds a directory of the filesystem open, which would keep it busy.
+  if (struct stat sb; stat(mount_point.c_str(), &sb) == 0) {
+    PendingSyncs::Get().SyncDevice(sb.st_dev);
+  }
+
   auto updater = state->updater;
   auto [mounted, result] = updater->GetRuntime()->Unmount(mount_point);
   if (!mounted) {
@@ -576,6 +751,7 @@ Value* RenameFn(const char* name, State* state, const std::vector<std::unique_pt
     return ErrorAbort(state, kFileRenameFailure, "Rename of %s to %s failed, error %s",
                       src_name.c_str(), dst_name.c_str(), strerror(errno));
   }
+  PendingSyncs::Get().Add(dst_name);
 
   return StringValue(dst_name);
 }
@@ -689,6 +865,8 @@ Value* SymlinkFn(const char* name, State* state, const std::vector<std::unique_p
     } else if (symlink(target.c_str(), src.c_str()) == -1) {
       PLOG(ERROR) << name << ": failed to symlink " << src << " to " << target;
       ++bad;
+    } else {
+      PendingSyncs::Get().Add(src);
     }
   }
   if (bad != 0) {
@@ -817,16 +995,36 @@ static struct perm_parsed_args ParsePermArgs(State* state, const std::vector<std
   return parsed;
 }
 
-static int ApplyParsedPerms(State* state, const char* filename, const struct stat* statptr,
-                            struct perm_parsed_args parsed) {
-  auto updater = state->updater;
+// Returns whether the security context of |filename| is already |selabel|.
+static bool HasFileCon(const char* filename, const char* selabel) {
+  char* secontext = nullptr;
+  if (lgetfilecon(filename, &secontext) < 0) {
+    return false;
+  }
+  bool matches = strcmp(secontext, selabel) == 0;
+  freecon(secontext);
+  return matches;
+}
+
+// Returns whether |filename| already carries exactly the |cap_data| capabilities.
+static bool HasCapabilities(const char* filename, const struct vfs_cap_data& cap_data) {
+  struct vfs_cap_data current;
+  ssize_t size = getxattr(filename, XATTR_NAME_CAPS, &current, sizeof(current));
+  return size == sizeof(current) && memcmp(&current, &cap_data, sizeof(current)) == 0;
+}
+
+// Applies |parsed| to |filename|, skipping the changes that |statptr| shows are already in place.
+// Failures are described in |errors|, since this may run on several threads at once. Returns the
+// number of failures.
+static int ApplyParsedPerms(const char* filename, const struct stat* statptr,
+                            const struct perm_parsed_args& parsed, std::string* errors) {
   int bad = 0;
 
-  if (parsed.has_selabel) {
+  if (parsed.has_selabel && !HasFileCon(filename, parsed.selabel)) {
     if (lsetfilecon(filename, parsed.selabel) != 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
-                            filename, parsed.selabel, strerror(errno)));
+      *errors += android::base::StringPrintf(
+          "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n", filename, parsed.selabel,
+          strerror(errno));
       bad++;
     }
   }
@@ -836,58 +1034,64 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
     return bad;
   }
 
-  if (parsed.has_uid) {
+  // chown() drops the setuid and setgid bits, so it isn't skipped for files that have them, and
+  // the mode read by lstat() no longer holds once anything has been chown'd.
+  mode_t current_mode = statptr->st_mode & 07777;
+  bool mode_known = true;
+  bool has_setid = (statptr->st_mode & (S_ISUID | S_ISGID)) != 0;
+
+  if (parsed.has_uid && (statptr->st_uid != parsed.uid || has_setid)) {
+    mode_known = false;
     if (chown(filename, parsed.uid, -1) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chown of %s to %d failed: %s\n",
-                            filename, parsed.uid, strerror(errno)));
+      *errors += android::base::StringPrintf("ApplyParsedPerms: chown of %s to %d failed: %s\n",
+                                             filename, parsed.uid, strerror(errno));
       bad++;
     }
   }
 
-  if (parsed.has_gid) {
+  if (parsed.has_gid && (statptr->st_gid != parsed.gid || has_setid)) {
+    mode_known = false;
     if (chown(filename, -1, parsed.gid) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
-                            filename, parsed.gid, strerror(errno)));
+      *errors += android::base::StringPrintf("ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
+                                             filename, parsed.gid, strerror(errno));
       bad++;
     }
   }
 
-  if (parsed.has_mode) {
-    if (chmod(filename, parsed.mode) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                            filename, parsed.mode, strerror(errno)));
+  auto apply_mode = [&](mode_t mode) {
+    if (mode_known && current_mode == mode) {
+      return;
+    }
+    if (chmod(filename, mode) < 0) {
+      *errors += android::base::StringPrintf("ApplyParsedPerms: chmod of %s to %d failed: %s\n",
+                                             filename, mode, strerror(errno));
       bad++;
+      mode_known = false;
+      return;
     }
+    current_mode = mode & 07777;
+    mode_known = true;
+  };
+
+  if (parsed.has_mode) {
+    apply_mode(parsed.mode);
   }
 
   if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-    if (chmod(filename, parsed.dmode) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                            filename, parsed.dmode, strerror(errno)));
-      bad++;
-    }
+    apply_mode(parsed.dmode);
   }
 
   if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-    if (chmod(filename, parsed.fmode) < 0) {
-      updater->UiPrint(android::base::StringPrintf(
-                            "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                            filename, parsed.fmode, strerror(errno)));
-      bad++;
-    }
+    apply_mode(parsed.fmode);
   }
 
   if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
     if (parsed.capabilities == 0) {
       if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && (errno != ENODATA)) {
         // Report failure unless it's ENODATA (attribute not set)
-        updater->UiPrint(android::base::StringPrintf(
-                                "ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
-                                filename, parsed.capabilities, strerror(errno)));
+        *errors += android::base::StringPrintf(
+            "ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n", filename,
+            parsed.capabilities, strerror(errno));
         bad++;
       }
     } else {
@@ -898,10 +1102,11 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
       cap_data.data[0].inheritable = 0;
       cap_data.data[1].permitted = (uint32_t)(parsed.capabilities >> 32);
       cap_data.data[1].inheritable = 0;
-      if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
-        updater->UiPrint(android::base::StringPrintf(
-                                "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
-                                filename, parsed.capabilities, strerror(errno)));
+      if (!HasCapabilities(filename, cap_data) &&
+          setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
+        *errors += android::base::StringPrintf(
+            "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n", filename,
+            parsed.capabilities, strerror(errno));
         bad++;
       }
     }
@@ -910,14 +1115,78 @@ static int ApplyParsedPerms(State* state, const char* filename, const struct sta
   return bad;
 }
 
+// Upper bound of the number of threads that apply set_metadata_recursive() to files.
+static constexpr size_t kMaxSetMetadataThreads = 4;
+
+struct MetadataTarget {
+  std::string path;
+  struct stat sb;
+};
+
 // nftw doesn't allow us to pass along context, so we need to use
 // global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-static State* recursive_state;
+static std::vector<MetadataTarget>* recursive_targets;
+
+static int do_CollectMetadataTargets(const char* filename, const struct stat* statptr,
+                                     int /*fileflags*/, struct FTW* /*pfwt*/) {
+  recursive_targets->push_back({ filename, *statptr });
+  return 0;
+}
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat* statptr,
-                                   int /*fileflags*/, struct FTW* /*pfwt*/) {
-  return ApplyParsedPerms(recursive_state, filename, statptr, recursive_parsed_args);
+// Applies |parsed| to everything under |path|. The tree is walked first, and the non-directories
+// are then updated in parallel. The directories follow, children before parents as nftw(3) with
+// FTW_DEPTH would. Like an nftw() walk, this stops at the first entry that fails.
+static int SetMetadataRecursive(State* state, const std::string& path,
+                                const struct perm_parsed_args& parsed) {
+  std::vector<MetadataTarget> targets;
+  recursive_targets = &targets;
+  int walk_result = nftw(path.c_str(), do_CollectMetadataTargets, 30, FTW_DEPTH | FTW_PHYS);
+  recursive_targets = nullptr;
+  if (walk_result != 0) {
+    state->updater->UiPrint(android::base::StringPrintf(
+        "SetMetadataRecursive: failed to walk %s: %s\n", path.c_str(), strerror(errno)));
+    return 1;
+  }
+
+  std::vector<const MetadataTarget*> files;
+  std::vector<const MetadataTarget*> dirs;
+  for (const auto& target : targets) {
+    (S_ISDIR(target.sb.st_mode) ? dirs : files).push_back(&target);
+  }
+
+  std::mutex errors_mutex;
+  std::string errors;
+  std::atomic<size_t> next_file{ 0 };
+  std::atomic<bool> failed{ false };
+  auto apply_to_files = [&]() {
+    for (size_t i = next_file++; i < files.size() && !failed; i = next_file++) {
+      std::string file_errors;
+      if (ApplyParsedPerms(files[i]->path.c_str(), &files[i]->sb, parsed, &file_errors) > 0) {
+        failed = true;
+        std::lock_guard<std::mutex> lock(errors_mutex);
+        errors += file_errors;
+      }
+    }
+  };
+  size_t jobs = std::min<size_t>(
+      { std::thread::hardware_concurrency(), kMaxSetMetadataThreads, files.size() });
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < jobs; ++i) {
+    workers.emplace_back(apply_to_files);
+  }
+  apply_to_files();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  int bad = failed ? 1 : 0;
+  for (size_t i = 0; i < dirs.size() && bad == 0; ++i) {
+    bad += ApplyParsedPerms(dirs[i]->path.c_str(), &dirs[i]->sb, parsed, &errors);
+  }
+  if (!errors.empty()) {
+    state->updater->UiPrint(errors);
+  }
+  return bad;
 }
 
 static Value* SetMetadataFn(const char* name, State* state,
@@ -938,18 +1207,19 @@ static Value* SetMetadataFn(const char* name, State* state,
                       args[0].c_str(), strerror(errno));
   }
 
+  ScopedPhase phase(name);
   struct perm_parsed_args parsed = ParsePermArgs(state, args);
   int bad = 0;
   bool recursive = (strcmp(name, "set_metadata_recursive") == 0);
 
   if (recursive) {
-    recursive_parsed_args = parsed;
-    recursive_state = state;
-    bad += nftw(args[0].c_str(), do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-    memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-    recursive_state = NULL;
+    bad += SetMetadataRecursive(state, args[0], parsed);
   } else {
-    bad += ApplyParsedPerms(state, args[0].c_str(), &sb, parsed);
+    std::string errors;
+    bad += ApplyParsedPerms(args[0].c_str(), &sb, parsed, &errors);
+    if (!errors.empty()) {
+      state->updater->UiPrint(errors);
+    }
   }
 
   if (bad > 0) {
@@ -974,6 +1244,81 @@ Value* GetPropFn(const char* name, State* state, const std::vector<std::unique_p
   return StringValue(value);
 }
 
+// The key=value pairs of a getprop-style file, sorted by the keys. Where a key is repeated, the
+// first value in the file wins.
+using PropFile = std::vector<std::pair<std::string, std::string>>;
+
+static PropFile ParsePropFile(const std::string& content) {
+  PropFile props;
+  for (const auto& raw_line : android::base::Split(content, "\n")) {
+    std::string line = android::base::Trim(raw_line);
+
+    // comment or blank line: skip to next line
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    size_t equal_pos = line.find('=');
+    if (equal_pos == std::string::npos) {
+      continue;
+    }
+
+    // trim whitespace between key and '='
+    props.emplace_back(android::base::Trim(line.substr(0, equal_pos)),
+                       android::base::Trim(line.substr(equal_pos + 1)));
+  }
+
+  std::stable_sort(props.begin(), props.end(),
+                   [](const auto& a, const auto& b) { return a.first < b.first; });
+  props.erase(std::unique(props.begin(), props.end(),
+                          [](const auto& a, const auto& b) { return a.first == b.first; }),
+              props.end());
+  return props;
+}
+
+// A parsed prop file, along with what identifies the version of the file that it came from.
+struct CachedPropFile {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  std::shared_ptr<const PropFile> props;
+};
+
+// Generated scripts call file_getprop() on the same few files many times over, e.g. dozens of
+// assertions on build.prop. Each file is parsed once per run, and again only if it changes.
+static std::mutex prop_files_mutex;
+static std::map<std::string, CachedPropFile> prop_files;
+
+// Returns the parsed contents of |filename|, or nullptr if it can't be read.
+static std::shared_ptr<const PropFile> LoadPropFile(UpdaterRuntimeInterface* runtime,
+                                                    const std::string& filename) {
+  // The simulator serves the files out of the target files, which have nothing to stat; those are
+  // read each time.
+  struct stat sb;
+  bool cachable = stat(filename.c_str(), &sb) == 0;
+  if (cachable) {
+    std::lock_guard<std::mutex> lock(prop_files_mutex);
+    if (auto it = prop_files.find(filename); it != prop_files.end()) {
+      const CachedPropFile& cached = it->second;
+      if (cached.dev == sb.st_dev && cached.ino == sb.st_ino && cached.size == sb.st_size &&
+          cached.mtime.tv_sec == sb.st_mtim.tv_sec && cached.mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+        return cached.props;
+      }
+    }
+  }
+
+  std::string content;
+  if (!runtime->ReadFileToString(filename, &content)) {
+    return nullptr;
+  }
+  auto props = std::make_shared<const PropFile>(ParsePropFile(content));
+  if (cachable) {
+    std::lock_guard<std::mutex> lock(prop_files_mutex);
+    prop_files[filename] = CachedPropFile{ sb.st_dev, sb.st_ino, sb.st_size, sb.st_mtim, props };
+  }
+  return props;
+}
+
 // file_getprop(file, key)
 //
 //   interprets 'file' as a getprop-style file (key=value pairs, one
@@ -993,36 +1338,18 @@ Value* FileGetPropFn(const char* name, State* state,
   const std::string& filename = args[0];
   const std::string& key = args[1];
 
-  std::string buffer;
-  auto updater_runtime = state->updater->GetRuntime();
-  if (!updater_runtime->ReadFileToString(filename, &buffer)) {
+  std::shared_ptr<const PropFile> props = LoadPropFile(state->updater->GetRuntime(), filename);
+  if (!props) {
     ErrorAbort(state, kFreadFailure, "%s: failed to read %s", name, filename.c_str());
     return nullptr;
   }
 
-  std::vector<std::string> lines = android::base::Split(buffer, "\n");
-  for (size_t i = 0; i < lines.size(); i++) {
-    std::string line = android::base::Trim(lines[i]);
-
-    // comment or blank line: skip to next line
-    if (line.empty() || line[0] == '#') {
-      continue;
-    }
-    size_t equal_pos = line.find('=');
-    if (equal_pos == std::string::npos) {
-      continue;
-    }
-
-    // trim whitespace between key and '='
-    std::string str = android::base::Trim(line.substr(0, equal_pos));
-
-    // not the key we're looking for
-    if (key != str) continue;
-
-    return StringValue(android::base::Trim(line.substr(equal_pos + 1)));
+  auto it = std::lower_bound(props->begin(), props->end(), key,
+                             [](const auto& prop, const std::string& k) { return prop.first < k; });
+  if (it == props->end() || it->first != key) {
+    return StringValue("");
   }
-
-  return StringValue("");
+  return StringValue(it->second);
 }
 
 // apply_patch_space(bytes)
@@ -1125,9 +1452,21 @@ Value* WriteValueFn(const char* name, State* state, const std::vector<std::uniqu
     PLOG(ERROR) << name << ": Failed to write to \"" << filename << "\"";
     return StringValue("");
   }
+  PendingSyncs::Get().Add(filename);
   return StringValue("t");
 }
 
+// sync()
+//   Syncs the filesystems that the builtins above have written to since the last barrier. Scripts
+//   can use it to make a group of steps durable before moving on. Returns "t" on success.
+Value* SyncFn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
+  if (!argv.empty()) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() expects no args, got %zu", name,
+                      argv.size());
+  }
+  return StringValue(PendingSyncs::Get().SyncAll() ? "t" : "");
+}
+
 // Immediately reboot the device.  Recovery is not finished normally,
 // so if you reboot into recovery it will re-start applying the
 // current package (because nothing has cleared the copy of the
@@ -1163,6 +1502,9 @@ Value* RebootNowFn(const char* name, State* state, const std::vector<std::unique
     return StringValue("");
   }
 
+  if (!PendingSyncs::Get().SyncAll()) {
+    return ErrorAbort(state, kFsyncFailure, "%s() failed to sync before rebooting", name);
+  }
   Reboot(property);
 
   return ErrorAbort(state, kRebootFailure, "%s() failed to reboot", name);
@@ -1309,6 +1651,7 @@ void RegisterInstallFunctions() {
   RegisterFunction("delete_recursive", DeleteFn);
   RegisterFunction("package_extract_dir", PackageExtractDirFn);
   RegisterFunction("package_extract_file", PackageExtractFileFn);
+  RegisterFunction("package_extract_partition", PackageExtractPartitionFn);
   RegisterFunction("symlink", SymlinkFn);
 
   // Usage:
@@ -1337,6 +1680,7 @@ void RegisterInstallFunctions() {
   RegisterFunction("read_file", ReadFileFn);
   RegisterFunction("rename", RenameFn);
   RegisterFunction("write_value", WriteValueFn);
+  RegisterFunction("sync", SyncFn);
 
   RegisterFunction("wipe_cache", WipeCacheFn);
 
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "updater/install_cost.h"
+
+#include <inttypes.h>
+
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+// Returns the name of |file| of an I/O trace in the cost, i.e. the basename of the block device
+// (like the partition in the lines of block_image_update()), or "stash" for all the stash files.
+static std::string IoFileName(const std::string& file) {
+  if (android::base::StartsWith(file, "stash/")) {
+    return "stash";
+  }
+  size_t slash = file.rfind('/');
+  return slash == std::string::npos ? file : file.substr(slash + 1);
+}
+
+void InstallCost::AddIoTrace(const IoTrace& trace) {
+  // The extents of an operation are consecutive records of the same batch.
+  std::set<std::pair<uint32_t, uint32_t>> operations;
+  for (const auto& record : trace.records) {
+    std::string prefix = "io_" + IoFileName(trace.files[record.file]) + "_";
+    bool first_extent = operations.emplace(record.file, record.batch).second;
+    switch (record.op) {
+      case IoTraceOp::kRead:
+        values_[prefix + "read_bytes"] += record.length;
+        values_[prefix + "read_ops"] += first_extent;
+        break;
+      case IoTraceOp::kWrite:
+        values_[prefix + "write_bytes"] += record.length;
+        values_[prefix + "write_ops"] += first_extent;
+        break;
+      case IoTraceOp::kFsync:
+        values_[prefix + "fsyncs"]++;
+        break;
+      case IoTraceOp::kCount:
+        break;
+    }
+  }
+}
+
+void InstallCost::AddCommandPipe(const std::string& content) {
+  for (const auto& line : android::base::Split(content, "\n")) {
+    if (!android::base::StartsWith(line, "log ")) {
+      continue;
+    }
+    size_t pos = line.find(": ");
+    if (pos == std::string::npos) {
+      continue;
+    }
+    std::string name = line.substr(4, pos - 4);
+    if (!android::base::StartsWith(name, "bytes_written_") &&
+        !android::base::StartsWith(name, "bytes_stashed_") &&
+        !(android::base::StartsWith(name, "latency_") &&
+          (android::base::EndsWith(name, "_count") || android::base::EndsWith(name, "_cpu_ms")))) {
+      continue;
+    }
+    uint64_t value;
+    if (!android::base::ParseUint(line.substr(pos + 2), &value)) {
+      LOG(WARNING) << "Invalid value in the command pipe: " << line;
+      continue;
+    }
+    // The partitions may be updated more than once, e.g. by a retry within the script.
+    values_[name] += value;
+  }
+}
+
+std::string InstallCost::ToString() const {
+  std::string result;
+  for (const auto& [name, value] : values_) {
+    result += android::base::StringPrintf("%s: %" PRIu64 "\n", name.c_str(), value);
+  }
+  return result;
+}
+
+bool InstallCost::Parse(const std::string& content, InstallCost* cost) {
+  cost->values_.clear();
+  for (const auto& line : android::base::Split(content, "\n")) {
+    if (line.empty() || android::base::StartsWith(line, "#")) {
+      continue;
+    }
+    size_t pos = line.find(": ");
+    uint64_t value;
+    if (pos == std::string::npos || !android::base::ParseUint(line.substr(pos + 2), &value)) {
+      LOG(ERROR) << "Invalid line in the install cost: " << line;
+      return false;
+    }
+    cost->values_[line.substr(0, pos)] = value;
+  }
+  return true;
+}
+
+bool InstallCost::IsMeasurement(const std::string& name) {
+  return android::base::EndsWith(name, "_ms") || android::base::EndsWith(name, "_kb");
+}
+
+std::vector<std::string> InstallCost::FindRegressions(const InstallCost& baseline,
+                                                      double tolerance_percent) const {
+  std::vector<std::string> regressions;
+  for (const auto& [name, value] : values_) {
+    auto it = baseline.values_.find(name);
+    uint64_t old_value = it == baseline.values_.end() ? 0 : it->second;
+    if (value <= old_value) {
+      continue;
+    }
+    if (IsMeasurement(name) && (value - old_value <= kMeasurementSlack ||
+                                value <= old_value * (1 + tolerance_percent / 100))) {
+      continue;
+    }
+    std::string change =
+        old_value == 0 ? "new"
+                       : android::base::StringPrintf("+%.1f%%", (value - old_value) * 100.0 /
+                                                                    old_value);
+    regressions.push_back(android::base::StringPrintf("%s: %" PRIu64 " -> %" PRIu64 " (%s)",
+                                                      name.c_str(), old_value, value,
+                                                      change.c_str()));
+  }
+  return regressions;
+}
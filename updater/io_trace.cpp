@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/io_trace.h"
+
+#include <string.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/threads.h>
+
+#include "otautil/trace.h"
+
+// The trace file starts with the magic, followed by the number of files and the number of records
+// as uint32_t, the files as a uint32_t length and the name each, and the records. Everything is in
+// the byte order of the device, which the host shares.
+static constexpr char kIoTraceMagic[8] = { 'I', 'O', 'T', 'R', 'A', 'C', 'E', '1' };
+
+static void AppendUint32(std::string* content, uint32_t value) {
+  content->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+IoTracer& IoTracer::Get() {
+  static IoTracer tracer;
+  return tracer;
+}
+
+void IoTracer::Enable() {
+  if (enabled()) {
+    return;
+  }
+  first_ns_ = MonotonicTimeNs();
+  enabled_ = true;
+}
+
+uint32_t IoTracer::FileId(const std::string& name) {
+  if (!enabled()) {
+    return kNoFile;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto [it, inserted] = file_ids_.emplace(name, trace_.files.size());
+  if (inserted) {
+    trace_.files.push_back(name);
+  }
+  return it->second;
+}
+
+void IoTracer::Record(IoTraceOp op, uint32_t file, uint64_t start_ns,
+                      const std::vector<Extent>& extents) {
+  if (!enabled() || file == kNoFile) {
+    return;
+  }
+  uint64_t now = MonotonicTimeNs();
+  uint32_t tid = android::base::GetThreadId();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  IoTraceRecord record{};
+  // An operation that was already running when tracing got enabled starts at 0.
+  record.start_ns = start_ns > first_ns_ ? start_ns - first_ns_ : 0;
+  record.duration_ns = now - start_ns;
+  record.tid = tid;
+  record.batch = next_batch_++;
+  record.file = file;
+  record.op = op;
+  if (extents.empty()) {
+    trace_.records.push_back(record);
+    return;
+  }
+  for (const auto& [offset, size] : extents) {
+    record.offset = offset;
+    record.length = size;
+    trace_.records.push_back(record);
+  }
+}
+
+bool IoTracer::Write(const std::string& path) const {
+  if (!enabled()) {
+    return true;
+  }
+  std::string content(kIoTraceMagic, sizeof(kIoTraceMagic));
+  std::lock_guard<std::mutex> lock(mutex_);
+  AppendUint32(&content, trace_.files.size());
+  AppendUint32(&content, trace_.records.size());
+  for (const auto& name : trace_.files) {
+    AppendUint32(&content, name.size());
+    content += name;
+  }
+  content.append(reinterpret_cast<const char*>(trace_.records.data()),
+                 trace_.records.size() * sizeof(IoTraceRecord));
+
+  if (!android::base::WriteStringToFile(content, path)) {
+    PLOG(ERROR) << "Failed to write the I/O trace to " << path;
+    return false;
+  }
+  LOG(INFO) << "Wrote " << trace_.records.size() << " I/O trace records to " << path;
+  return true;
+}
+
+void IoTracer::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  enabled_ = false;
+  trace_ = {};
+  file_ids_.clear();
+  first_ns_ = 0;
+  next_batch_ = 0;
+}
+
+bool ReadIoTrace(const std::string& path, IoTrace* trace) {
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    PLOG(ERROR) << "Failed to read " << path;
+    return false;
+  }
+
+  size_t pos = 0;
+  auto read = [&content, &pos](void* data, size_t size) {
+    if (content.size() - pos < size) {
+      return false;
+    }
+    memcpy(data, content.data() + pos, size);
+    pos += size;
+    return true;
+  };
+
+  char magic[sizeof(kIoTraceMagic)];
+  uint32_t file_count;
+  uint32_t record_count;
+  if (!read(magic, sizeof(magic)) || memcmp(magic, kIoTraceMagic, sizeof(magic)) != 0 ||
+      !read(&file_count, sizeof(file_count)) || !read(&record_count, sizeof(record_count))) {
+    LOG(ERROR) << path << " is not an I/O trace";
+    return false;
+  }
+
+  trace->files.clear();
+  for (uint32_t i = 0; i < file_count; i++) {
+    uint32_t length;
+    if (!read(&length, sizeof(length)) || content.size() - pos < length) {
+      LOG(ERROR) << "Truncated file names in " << path;
+      return false;
+    }
+    trace->files.emplace_back(content, pos, length);
+    pos += length;
+  }
+
+  if ((content.size() - pos) / sizeof(IoTraceRecord) != record_count ||
+      (content.size() - pos) % sizeof(IoTraceRecord) != 0) {
+    LOG(ERROR) << "Expected " << record_count << " records in " << path << ", found "
+               << (content.size() - pos) << " bytes";
+    return false;
+  }
+  trace->records.resize(record_count);
+  read(trace->records.data(), record_count * sizeof(IoTraceRecord));
+  for (const auto& record : trace->records) {
+    if (record.file >= trace->files.size() || record.op >= IoTraceOp::kCount) {
+      LOG(ERROR) << "Invalid record in " << path << " (batch " << record.batch << ")";
+      return false;
+    }
+  }
+  return true;
+}
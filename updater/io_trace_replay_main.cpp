@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays a block I/O trace of an install (/cache/recovery/last_io_trace, recorded with
+// ro.updater.io_trace=true) against image files or block devices, to compare I/O backends, queue
+// depths, O_DIRECT and coalescing on a real workload without going through an OTA each time.
+//
+// The operations are issued one at a time in the recorded order; the extents within an operation
+// are what a backend may keep in flight at once, as in the updater.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+
+#include "otautil/trace.h"
+#include "private/block_io.h"
+#include "private/command_stats.h"
+#include "private/io_trace.h"
+
+using namespace std::string_literals;
+
+static constexpr const char* kOpNames[] = { "read", "write", "fsync" };
+static_assert(sizeof(kOpNames) / sizeof(kOpNames[0]) == static_cast<size_t>(IoTraceOp::kCount),
+              "Mismatching number of op names");
+
+static constexpr const char kStashPrefix[] = "stash/";
+
+static void Usage(std::string_view name) {
+  LOG(INFO) << "Usage: " << name << " --trace <io_trace> --target [<device>=]<image_or_device>..."
+            << " [--stash_dir <dir>] [--backend sync|io_uring] [--queue_depth <n>] [--direct]"
+            << " [--coalesce_kb <n>] [--timing asap|original] [--skip_writes]"
+            << "\n\nThe targets get written unless --skip_writes is given. A target without"
+               " <device>= stands for all the block devices of the trace that have no other"
+               " target.";
+}
+
+// A recorded operation, or several consecutive ones merged.
+struct Operation {
+  IoTraceOp op;
+  uint32_t file;
+  uint64_t start_ns;
+  uint64_t recorded_ns;
+  std::vector<Extent> extents;
+  size_t size = 0;
+};
+
+// Groups the records into operations. With |coalesce_bytes| set, consecutive reads (or writes) of
+// the same file are merged into one operation of up to that many bytes, with the adjacent extents
+// joined.
+static std::vector<Operation> GroupOperations(const IoTrace& trace, size_t coalesce_bytes) {
+  std::vector<Operation> operations;
+  uint32_t last_batch = UINT32_MAX;
+  for (const auto& record : trace.records) {
+    bool new_batch = operations.empty() || record.batch != last_batch;
+    last_batch = record.batch;
+    if (new_batch) {
+      Operation* last = operations.empty() ? nullptr : &operations.back();
+      bool merge = last != nullptr && coalesce_bytes > 0 && record.op != IoTraceOp::kFsync &&
+                   last->op == record.op && last->file == record.file &&
+                   last->size + record.length <= coalesce_bytes;
+      if (!merge) {
+        operations.push_back({ record.op, record.file, record.start_ns, 0, {} });
+      }
+      operations.back().recorded_ns += record.duration_ns;
+    }
+
+    if (record.op == IoTraceOp::kFsync) {
+      continue;
+    }
+    Operation& operation = operations.back();
+    if (!operation.extents.empty() &&
+        operation.extents.back().first + operation.extents.back().second == record.offset) {
+      operation.extents.back().second += record.length;
+    } else {
+      operation.extents.emplace_back(record.offset, record.length);
+    }
+    operation.size += record.length;
+  }
+  return operations;
+}
+
+struct ReplayOptions {
+  std::map<std::string, std::string> targets;  // By device in the trace; "" for the default.
+  std::string stash_dir;
+  BlockIo::Type backend = BlockIo::Type::IO_URING;
+  unsigned queue_depth = BlockIo::kDefaultQueueDepth;
+  bool direct = false;
+  size_t coalesce_bytes = 0;
+  bool original_timing = false;
+  bool skip_writes = false;
+};
+
+// Opens the files of |trace| for the replay, into |fds| by file index. The stash files are created
+// in the stash dir, large enough for all their extents.
+static bool OpenFiles(const IoTrace& trace, const ReplayOptions& options,
+                      std::vector<android::base::unique_fd>* fds) {
+  std::vector<uint64_t> file_sizes(trace.files.size(), 0);
+  for (const auto& record : trace.records) {
+    file_sizes[record.file] = std::max(file_sizes[record.file], record.offset + record.length);
+  }
+
+  fds->resize(trace.files.size());
+  for (size_t i = 0; i < trace.files.size(); i++) {
+    const std::string& name = trace.files[i];
+    android::base::unique_fd& fd = (*fds)[i];
+    if (android::base::StartsWith(name, kStashPrefix)) {
+      std::string path = options.stash_dir + "/" + name.substr(strlen(kStashPrefix));
+      fd.reset(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+      if (fd == -1 || ftruncate(fd, file_sizes[i]) == -1) {
+        PLOG(ERROR) << "Failed to create " << path;
+        return false;
+      }
+      continue;
+    }
+
+    auto it = options.targets.find(name);
+    if (it == options.targets.end()) {
+      it = options.targets.find("");
+    }
+    if (it == options.targets.end()) {
+      LOG(ERROR) << "No target for " << name;
+      return false;
+    }
+    int flags = (options.skip_writes ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+    fd.reset(open(it->second.c_str(), flags | (options.direct ? O_DIRECT : 0)));
+    if (fd == -1) {
+      PLOG(ERROR) << "Failed to open " << it->second << " for " << name;
+      return false;
+    }
+    LOG(INFO) << "Replaying " << name << " on " << it->second;
+  }
+  return true;
+}
+
+struct ReplayStats {
+  LatencyHistogram latency[static_cast<size_t>(IoTraceOp::kCount)];
+  uint64_t bytes[static_cast<size_t>(IoTraceOp::kCount)] = {};
+  uint64_t recorded_ns[static_cast<size_t>(IoTraceOp::kCount)] = {};
+  uint64_t wall_ns = 0;
+};
+
+static bool Replay(const std::vector<Operation>& operations, const ReplayOptions& options,
+                   const std::vector<android::base::unique_fd>& fds, ReplayStats* stats) {
+  size_t max_size = 0;
+  for (const auto& operation : operations) {
+    max_size = std::max(max_size, operation.size);
+  }
+  // Aligned for O_DIRECT.
+  void* buffer = nullptr;
+  if (posix_memalign(&buffer, 4096, std::max<size_t>(max_size, 4096)) != 0) {
+    LOG(ERROR) << "Failed to allocate " << max_size << " bytes";
+    return false;
+  }
+  std::unique_ptr<void, decltype(&free)> buffer_holder(buffer, free);
+  memset(buffer, 0x5a, max_size);
+  uint8_t* data = static_cast<uint8_t*>(buffer);
+
+  std::unique_ptr<BlockIo> io = BlockIo::Create(options.backend, options.queue_depth);
+  uint64_t begin_ns = MonotonicTimeNs();
+  for (const auto& operation : operations) {
+    if (options.original_timing) {
+      uint64_t now = MonotonicTimeNs() - begin_ns;
+      if (operation.start_ns > now) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(operation.start_ns - now));
+      }
+    }
+
+    int fd = fds[operation.file].get();
+    uint64_t start_ns = MonotonicTimeNs();
+    bool success = true;
+    switch (operation.op) {
+      case IoTraceOp::kRead:
+        success = io->Read(fd, operation.extents, data);
+        break;
+      case IoTraceOp::kWrite:
+        if (options.skip_writes) {
+          continue;
+        }
+        success = io->Write(fd, operation.extents, data);
+        break;
+      case IoTraceOp::kFsync:
+        success = options.skip_writes || fsync(fd) == 0;
+        break;
+      case IoTraceOp::kCount:
+        break;
+    }
+    if (!success) {
+      PLOG(ERROR) << "Failed to " << kOpNames[static_cast<size_t>(operation.op)] << " "
+                  << operation.size << " bytes of file " << operation.file;
+      return false;
+    }
+
+    size_t op = static_cast<size_t>(operation.op);
+    stats->latency[op].Record((MonotonicTimeNs() - start_ns) / 1000);
+    stats->bytes[op] += operation.size;
+    stats->recorded_ns[op] += operation.recorded_ns;
+  }
+  stats->wall_ns = MonotonicTimeNs() - begin_ns;
+  return true;
+}
+
+static void PrintStats(const IoTrace& trace, size_t operation_count, const ReplayStats& stats) {
+  uint64_t recorded_span_ns = 0;
+  for (const auto& record : trace.records) {
+    recorded_span_ns = std::max(recorded_span_ns, record.start_ns + record.duration_ns);
+  }
+  printf("replayed %zu records as %zu operations in %.3fs (recorded install: %.3fs)\n",
+         trace.records.size(), operation_count, stats.wall_ns / 1e9, recorded_span_ns / 1e9);
+  for (size_t op = 0; op < static_cast<size_t>(IoTraceOp::kCount); op++) {
+    const LatencyHistogram& latency = stats.latency[op];
+    if (latency.count() == 0) {
+      continue;
+    }
+    printf("%-5s %8" PRIu64 " ops %10.1f MiB  p50 %" PRIu64 "us p90 %" PRIu64 "us p99 %" PRIu64
+           "us max %" PRIu64 "us  (recorded %.3fs)\n",
+           kOpNames[op], latency.count(), stats.bytes[op] / 1048576.0, latency.Percentile(50),
+           latency.Percentile(90), latency.Percentile(99), latency.max(),
+           stats.recorded_ns[op] / 1e9);
+  }
+}
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv, &android::base::StderrLogger);
+
+  std::string trace_file;
+  std::string timing = "asap";
+  std::string backend = "io_uring";
+  ReplayOptions options;
+
+  constexpr struct option OPTIONS[] = {
+    { "backend", required_argument, nullptr, 0 },
+    { "coalesce_kb", required_argument, nullptr, 0 },
+    { "direct", no_argument, nullptr, 0 },
+    { "queue_depth", required_argument, nullptr, 0 },
+    { "skip_writes", no_argument, nullptr, 0 },
+    { "stash_dir", required_argument, nullptr, 0 },
+    { "target", required_argument, nullptr, 0 },
+    { "timing", required_argument, nullptr, 0 },
+    { "trace", required_argument, nullptr, 0 },
+    { nullptr, 0, nullptr, 0 },
+  };
+
+  int arg;
+  int option_index;
+  while ((arg = getopt_long(argc, argv, "", OPTIONS, &option_index)) != -1) {
+    if (arg != 0) {
+      LOG(ERROR) << "Invalid command argument";
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    auto option_name = OPTIONS[option_index].name;
+    if (option_name == "backend"s) {
+      backend = optarg;
+    } else if (option_name == "coalesce_kb"s) {
+      if (!android::base::ParseUint(optarg, &options.coalesce_bytes)) {
+        LOG(ERROR) << "Invalid --coalesce_kb: " << optarg;
+        return EXIT_FAILURE;
+      }
+      options.coalesce_bytes *= 1024;
+    } else if (option_name == "direct"s) {
+      options.direct = true;
+    } else if (option_name == "queue_depth"s) {
+      if (!android::base::ParseUint(optarg, &options.queue_depth) || options.queue_depth == 0) {
+        LOG(ERROR) << "Invalid --queue_depth: " << optarg;
+        return EXIT_FAILURE;
+      }
+    } else if (option_name == "skip_writes"s) {
+      options.skip_writes = true;
+    } else if (option_name == "stash_dir"s) {
+      options.stash_dir = optarg;
+    } else if (option_name == "target"s) {
+      std::string target = optarg;
+      size_t pos = target.find('=');
+      if (pos == std::string::npos) {
+        options.targets[""] = target;
+      } else {
+        options.targets[target.substr(0, pos)] = target.substr(pos + 1);
+      }
+    } else if (option_name == "timing"s) {
+      timing = optarg;
+    } else if (option_name == "trace"s) {
+      trace_file = optarg;
+    }
+  }
+
+  if (trace_file.empty() || options.targets.empty() ||
+      !BlockIo::ParseType(backend, &options.backend) ||
+      (timing != "asap" && timing != "original")) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  options.original_timing = timing == "original";
+
+  IoTrace trace;
+  if (!ReadIoTrace(trace_file, &trace)) {
+    return EXIT_FAILURE;
+  }
+
+  TemporaryDir temp_stash_dir;
+  if (options.stash_dir.empty()) {
+    options.stash_dir = temp_stash_dir.path;
+  }
+  std::vector<android::base::unique_fd> fds;
+  if (!OpenFiles(trace, options, &fds)) {
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Operation> operations = GroupOperations(trace, options.coalesce_bytes);
+  ReplayStats stats;
+  if (!Replay(operations, options, fds, &stats)) {
+    return EXIT_FAILURE;
+  }
+  PrintStats(trace, operations.size(), stats);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/load_governor.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+LoadGovernor::LoadGovernor(std::string thermal_dir, std::string pressure_dir)
+    : pressure_dir_(std::move(pressure_dir)) {
+  std::unique_ptr<DIR, decltype(&closedir)> d(opendir(thermal_dir.c_str()), closedir);
+  if (!d) {
+    return;
+  }
+  dirent* de;
+  while ((de = readdir(d.get())) != nullptr) {
+    if (android::base::StartsWith(de->d_name, "thermal_zone")) {
+      thermal_paths_.push_back(thermal_dir + "/" + de->d_name + "/temp");
+    }
+  }
+  std::sort(thermal_paths_.begin(), thermal_paths_.end());
+}
+
+LoadGovernor& LoadGovernor::Get() {
+  static LoadGovernor governor("/sys/class/thermal", "/proc/pressure");
+  return governor;
+}
+
+// Returns the "some avg10" of the PSI file at |path|, or 0 if it can't be read.
+static float ReadPressure(const std::string& path) {
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    return 0;
+  }
+  // "some avg10=1.23 avg60=0.45 avg300=0.06 total=12345"
+  for (const auto& line : android::base::Split(content, "\n")) {
+    if (!android::base::StartsWith(line, "some ")) continue;
+    for (const auto& field : android::base::Split(line, " ")) {
+      if (android::base::StartsWith(field, "avg10=")) {
+        return strtof(field.c_str() + 6, nullptr);
+      }
+    }
+  }
+  return 0;
+}
+
+LoadGovernor::Load LoadGovernor::ReadLoad() const {
+  Load load;
+  for (const auto& path : thermal_paths_) {
+    std::string content;
+    int temperature;
+    if (!android::base::ReadFileToString(path, &content) ||
+        !android::base::ParseInt(android::base::Trim(content), &temperature)) {
+      continue;
+    }
+    // A few drivers report whole degrees.
+    if (temperature > 0 && temperature < 1000) {
+      temperature *= 1000;
+    }
+    load.temperature = std::max(load.temperature, temperature);
+  }
+  load.cpu_pressure = ReadPressure(pressure_dir_ + "/cpu");
+  load.io_pressure = ReadPressure(pressure_dir_ + "/io");
+  load.memory_pressure = ReadPressure(pressure_dir_ + "/memory");
+  return load;
+}
+
+LoadGovernor::Load LoadGovernor::Sample() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto now = std::chrono::steady_clock::now();
+  if (ignore_load_) {
+    return Load{};
+  }
+  if (!has_sample_ || now - sampled_ >= kSampleInterval) {
+    load_ = ReadLoad();
+    sampled_ = now;
+    has_sample_ = true;
+  }
+  return load_;
+}
+
+void LoadGovernor::IgnoreLoad() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ignore_load_ = true;
+}
+
+// Returns 1 up to |soft|, 0 from |hard| on, and goes down linearly in between.
+static float Ramp(float value, float soft, float hard) {
+  if (value <= soft) return 1;
+  if (value >= hard) return 0;
+  return (hard - value) / (hard - soft);
+}
+
+float LoadGovernor::ThreadScale(const Load& load) {
+  return std::min({ Ramp(load.temperature, kSoftTemperature, kHardTemperature),
+                    Ramp(load.cpu_pressure, kSoftPressure, kHardPressure),
+                    Ramp(load.io_pressure, kSoftPressure, kHardPressure) });
+}
+
+float LoadGovernor::BudgetScale(const Load& load) {
+  return Ramp(load.memory_pressure, kSoftMemoryPressure, kHardMemoryPressure);
+}
+
+size_t LoadGovernor::Threads(const std::string& what, size_t max_threads) {
+  Load load = Sample();
+  size_t threads = std::clamp<size_t>(std::lround(max_threads * ThreadScale(load)), 1,
+                                      std::max<size_t>(max_threads, 1));
+  Log(what, threads, max_threads, load);
+  return threads;
+}
+
+size_t LoadGovernor::Budget(const std::string& what, size_t max_size, size_t min_size) {
+  Load load = Sample();
+  size_t size = std::max<size_t>(std::llround(max_size * BudgetScale(load)), min_size);
+  size = std::min(size, std::max(max_size, min_size));
+  Log(what, size, max_size, load);
+  return size;
+}
+
+void LoadGovernor::Log(const std::string& what, size_t value, size_t max_value, const Load& load) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto [it, inserted] = decisions_.emplace(what, value);
+    if (!inserted && it->second == value) {
+      return;
+    }
+    it->second = value;
+  }
+  LOG(INFO) << "Using " << value << " of " << max_value << " for " << what
+            << " (temperature " << load.temperature << ", pressure cpu " << load.cpu_pressure
+            << "% io " << load.io_pressure << "% memory " << load.memory_pressure << "%)";
+}
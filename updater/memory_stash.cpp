@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/memory_stash.h"
+
+#include <functional>
+#include <iterator>
+#include <string>
+#include <utility>
+
+void MemoryStash::Add(const std::string& id, BlockBuffer data) {
+  Erase(id);
+  size_ += data.size();
+  order_.push_back(id);
+  stashes_.emplace(id, Entry{ std::prev(order_.end()), std::move(data) });
+}
+
+const BlockBuffer* MemoryStash::Find(const std::string& id) const {
+  auto it = stashes_.find(id);
+  if (it == stashes_.end()) {
+    return nullptr;
+  }
+  return &it->second.data;
+}
+
+bool MemoryStash::Erase(const std::string& id) {
+  auto it = stashes_.find(id);
+  if (it == stashes_.end()) {
+    return false;
+  }
+  size_ -= it->second.data.size();
+  order_.erase(it->second.order);
+  stashes_.erase(it);
+  return true;
+}
+
+bool MemoryStash::Spill(size_t size, const SpillFunction& spill) {
+  while (!order_.empty() && size_ + size > capacity_) {
+    const std::string id = order_.front();
+    if (!spill(id, stashes_.at(id).data)) {
+      return false;
+    }
+    Erase(id);
+  }
+  return true;
+}
+
+bool MemoryStash::SpillIf(const std::function<bool(const std::string& id)>& select,
+                          const SpillFunction& spill) {
+  for (auto it = order_.begin(); it != order_.end();) {
+    const std::string& id = *it++;
+    if (!select(id)) {
+      continue;
+    }
+    if (!spill(id, stashes_.at(id).data)) {
+      return false;
+    }
+    Erase(id);
+  }
+  return true;
+}
+
+void MemoryStash::Clear() {
+  order_.clear();
+  stashes_.clear();
+  size_ = 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/patch_source.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <android-base/logging.h>
+#include <ziparchive/zip_archive.h>
+
+#include "otautil/ring_buffer.h"
+
+class MappedPatchSource : public PatchSource {
+ public:
+  MappedPatchSource(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  const uint8_t* data() const override {
+    return data_;
+  }
+
+  bool Read(size_t offset, size_t length, std::string* patch) override {
+    std::string_view view;
+    if (!ReadInPlace(offset, length, &view)) {
+      return false;
+    }
+    patch->assign(view);
+    return true;
+  }
+
+  bool ReadInPlace(size_t offset, size_t length, std::string_view* patch) override {
+    if (offset > size_ || length > size_ - offset) {
+      LOG(ERROR) << "patch at " << offset << " (" << length << " bytes) is out of range " << size_;
+      return false;
+    }
+    *patch = std::string_view(reinterpret_cast<const char*>(data_ + offset), length);
+    return true;
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+};
+
+class StreamingPatchSource : public PatchSource {
+ public:
+  StreamingPatchSource(ZipArchiveHandle za, const ZipEntry64& entry, size_t window)
+      : za_(za), entry_(entry), window_(window) {}
+
+  ~StreamingPatchSource() override {
+    Stop();
+  }
+
+  const uint8_t* data() const override {
+    return nullptr;
+  }
+
+  bool ReadInPlace(size_t /* offset */, size_t /* length */,
+                   std::string_view* /* patch */) override {
+    return false;
+  }
+
+  bool Read(size_t offset, size_t length, std::string* patch) override {
+    size_t size = entry_.uncompressed_length;
+    if (offset > size || length > size - offset) {
+      LOG(ERROR) << "patch at " << offset << " (" << length << " bytes) is out of range " << size;
+      return false;
+    }
+    if (ring_ == nullptr || offset < position_) {
+      if (ring_ != nullptr) {
+        LOG(WARNING) << "patch at " << offset << " is behind " << position_ << "; inflating again";
+      }
+      Start();
+    }
+
+    // Skip to the patch, and then copy it out.
+    if (!Consume(offset - position_, nullptr)) {
+      return false;
+    }
+    patch->resize(length);
+    return Consume(length, patch->data());
+  }
+
+ private:
+  static bool ReceiveData(const uint8_t* data, size_t size, void* cookie) {
+    return static_cast<RingBuffer*>(cookie)->Write(data, size);
+  }
+
+  void Start() {
+    Stop();
+    ring_ = std::make_unique<RingBuffer>(window_);
+    position_ = 0;
+    thread_ = std::thread([this]() {
+      if (int32_t err = ProcessZipEntryContents(za_, &entry_, ReceiveData, ring_.get());
+          err != 0 && !ring_->aborted()) {
+        LOG(ERROR) << "Failed to inflate the patch data: " << ErrorCodeString(err);
+      }
+      ring_->Close();
+    });
+  }
+
+  void Stop() {
+    if (ring_ != nullptr) {
+      ring_->Abort();
+    }
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  // Takes the next |size| bytes of the patch data, copying them into |out| unless it's nullptr.
+  bool Consume(size_t size, char* out) {
+    while (size > 0) {
+      const uint8_t* data;
+      size_t available = ring_->GetReadable(&data);
+      if (available == 0) {
+        LOG(ERROR) << "patch data ended at " << position_;
+        return false;
+      }
+      size_t consumed = std::min(size, available);
+      if (out != nullptr) {
+        memcpy(out, data, consumed);
+        out += consumed;
+      }
+      ring_->Consume(consumed);
+      position_ += consumed;
+      size -= consumed;
+    }
+    return true;
+  }
+
+  ZipArchiveHandle za_;
+  const ZipEntry64 entry_;
+  const size_t window_;
+  std::unique_ptr<RingBuffer> ring_;
+  std::thread thread_;
+  // The offset of the next byte in ring_.
+  size_t position_{ 0 };
+};
+
+std::unique_ptr<PatchSource> PatchSource::Create(ZipArchiveHandle za, const ZipEntry64& entry,
+                                                 const uint8_t* mapped_package, size_t window) {
+  if (entry.method == kCompressStored && mapped_package != nullptr) {
+    return std::make_unique<MappedPatchSource>(mapped_package + entry.offset,
+                                               entry.uncompressed_length);
+  }
+  return std::make_unique<StreamingPatchSource>(za, entry, std::max<size_t>(window, 1));
+}
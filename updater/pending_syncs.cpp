@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/pending_syncs.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+#include "otautil/phase_stats.h"
+
+PendingSyncs& PendingSyncs::Get() {
+  static PendingSyncs pending_syncs;
+  return pending_syncs;
+}
+
+void PendingSyncs::Add(const std::string& path) {
+  std::string dir = android::base::Dirname(path);
+  android::base::unique_fd fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) == -1) {
+    // Nothing to sync later; whatever wrote to |path| would have failed too.
+    PLOG(WARNING) << "Failed to open " << dir << " for syncing";
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  filesystems_.try_emplace(sb.st_dev, DirtyFilesystem{ std::move(fd), std::move(dir) });
+}
+
+bool PendingSyncs::Sync(const DirtyFilesystem& filesystem) {
+  CountFsync();
+  if (syncfs(filesystem.fd) == -1) {
+    PLOG(ERROR) << "Failed to sync the filesystem of " << filesystem.dir;
+    return false;
+  }
+  return true;
+}
+
+bool PendingSyncs::SyncAll() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  bool success = true;
+  for (const auto& [dev, filesystem] : filesystems_) {
+    success &= Sync(filesystem);
+  }
+  filesystems_.clear();
+  return success;
+}
+
+bool PendingSyncs::SyncDevice(dev_t dev) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = filesystems_.find(dev);
+  if (it == filesystems_.end()) {
+    return true;
+  }
+  bool success = Sync(it->second);
+  filesystems_.erase(it);
+  return success;
+}
+
+size_t PendingSyncs::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return filesystems_.size();
+}
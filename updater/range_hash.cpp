@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/range_hash.h"
+
+#include <errno.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <openssl/sha.h>
+
+#include "otautil/ring_buffer.h"
+
+// The largest read issued at once.
+static constexpr size_t kMaxReadSize = 1024 * 1024;
+// How far RangeSha1() reads ahead of the hashing.
+static constexpr size_t kReadAheadSize = 4 * kMaxReadSize;
+// HashTreeLeaves() splits the blocks into this many groups per thread, so that the threads still
+// finish at about the same time when some of the reads are slower.
+static constexpr size_t kLeafGroupsPerThread = 4;
+
+// Reads the blocks of |ranges| into |buffer| (of kMaxReadSize bytes), a chunk at a time, and passes
+// each chunk to |update|. kMaxReadSize is a multiple of the block size, and so are the chunks.
+template <typename Update>
+static bool ReadRanges(int fd, const RangeSet& ranges, size_t block_size, uint8_t* buffer,
+                       Update update) {
+  for (const auto& [begin, end] : ranges) {
+    off64_t offset = static_cast<off64_t>(begin) * block_size;
+    size_t remaining = (end - begin) * block_size;
+    while (remaining > 0) {
+      size_t size = std::min(remaining, kMaxReadSize);
+      if (!android::base::ReadFullyAtOffset(fd, buffer, size, offset)) {
+        return false;
+      }
+      update(buffer, size);
+      offset += size;
+      remaining -= size;
+    }
+  }
+  return true;
+}
+
+bool RangeSha1(int fd, const RangeSet& ranges, size_t block_size, uint8_t* digest) {
+  RingBuffer ring(kReadAheadSize);
+  int read_error = 0;
+  std::thread reader([&]() {
+    for (const auto& [begin, end] : ranges) {
+      off64_t offset = static_cast<off64_t>(begin) * block_size;
+      size_t remaining = (end - begin) * block_size;
+      while (remaining > 0) {
+        uint8_t* space;
+        size_t size = std::min({ ring.GetWritable(&space), remaining, kMaxReadSize });
+        if (size == 0) {
+          return;
+        }
+        if (!android::base::ReadFullyAtOffset(fd, space, size, offset)) {
+          // A short read leaves errno intact.
+          read_error = errno != 0 ? errno : EIO;
+          ring.Abort();
+          return;
+        }
+        ring.Commit(size);
+        offset += size;
+        remaining -= size;
+      }
+    }
+    ring.Close();
+  });
+
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  const uint8_t* data;
+  while (size_t size = ring.GetReadable(&data)) {
+    SHA1_Update(&ctx, data, size);
+    ring.Consume(size);
+  }
+  reader.join();
+
+  if (ring.aborted()) {
+    errno = read_error;
+    return false;
+  }
+  SHA1_Final(digest, &ctx);
+  return true;
+}
+
+bool RangeSha256Tree(int fd, const RangeSet& ranges, size_t groups, size_t block_size,
+                     size_t threads, uint8_t* digest) {
+  std::vector<RangeSet> leaves = ranges.Split(groups);
+  std::vector<uint8_t> leaf_digests(leaves.size() * SHA256_DIGEST_LENGTH);
+
+  std::atomic<size_t> next_leaf{ 0 };
+  std::atomic<int> read_error{ 0 };
+  auto worker = [&]() {
+    std::vector<uint8_t> buffer(kMaxReadSize);
+    for (size_t i = next_leaf++; i < leaves.size() && read_error == 0; i = next_leaf++) {
+      SHA256_CTX ctx;
+      SHA256_Init(&ctx);
+      if (!ReadRanges(fd, leaves[i], block_size, buffer.data(),
+                      [&ctx](const uint8_t* data, size_t size) {
+                        SHA256_Update(&ctx, data, size);
+                      })) {
+        int expected = 0;
+        read_error.compare_exchange_strong(expected, errno != 0 ? errno : EIO);
+        return;
+      }
+      SHA256_Final(leaf_digests.data() + i * SHA256_DIGEST_LENGTH, &ctx);
+    }
+  };
+
+  threads = std::clamp<size_t>(threads, 1, std::max<size_t>(leaves.size(), 1));
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+
+  if (read_error != 0) {
+    errno = read_error;
+    return false;
+  }
+  SHA256(leaf_digests.data(), leaf_digests.size(), digest);
+  return true;
+}
+
+bool HashTreeLeaves(int fd, const RangeSet& ranges, size_t block_size, const EVP_MD* md,
+                    const std::vector<unsigned char>& salt, size_t threads,
+                    std::vector<unsigned char>* leaves) {
+  threads = std::max<size_t>(threads, 1);
+  std::vector<RangeSet> groups = ranges.Split(threads * kLeafGroupsPerThread);
+  std::vector<std::vector<unsigned char>> group_leaves(groups.size());
+  size_t hash_size = EVP_MD_size(md);
+
+  // The digest state after the salt, which gets copied for each block.
+  using EvpMdCtx = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
+  EvpMdCtx salted(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  EVP_DigestInit_ex(salted.get(), md, nullptr);
+  EVP_DigestUpdate(salted.get(), salt.data(), salt.size());
+
+  std::atomic<size_t> next_group{ 0 };
+  std::atomic<int> read_error{ 0 };
+  auto worker = [&]() {
+    std::vector<uint8_t> buffer(kMaxReadSize);
+    EvpMdCtx ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    for (size_t i = next_group++; i < groups.size() && read_error == 0; i = next_group++) {
+      std::vector<unsigned char>& output = group_leaves[i];
+      output.resize(groups[i].blocks() * hash_size);
+      unsigned char* out = output.data();
+      if (!ReadRanges(fd, groups[i], block_size, buffer.data(),
+                      [&](const uint8_t* data, size_t size) {
+                        for (size_t offset = 0; offset < size; offset += block_size) {
+                          EVP_MD_CTX_copy_ex(ctx.get(), salted.get());
+                          EVP_DigestUpdate(ctx.get(), data + offset, block_size);
+                          EVP_DigestFinal_ex(ctx.get(), out, nullptr);
+                          out += hash_size;
+                        }
+                      })) {
+        int expected = 0;
+        read_error.compare_exchange_strong(expected, errno != 0 ? errno : EIO);
+        return;
+      }
+    }
+  };
+
+  threads = std::min(threads, std::max<size_t>(groups.size(), 1));
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+
+  if (read_error != 0) {
+    errno = read_error;
+    return false;
+  }
+
+  leaves->clear();
+  leaves->reserve(ranges.blocks() * hash_size);
+  for (const auto& group : group_leaves) {
+    leaves->insert(leaves->end(), group.begin(), group.end());
+  }
+  return true;
+}
@@ -37,6 +37,9 @@
 
 std::string SimulatorRuntime::GetProperty(const std::string_view key,
                                           const std::string_view default_value) const {
+  if (auto it = property_overrides_.find(key); it != property_overrides_.end()) {
+    return it->second;
+  }
   return source_->GetProperty(key, default_value);
 }
 
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/source_cache.h"
+
+#include <string.h>
+
+#include <iterator>
+#include <string>
+
+bool SourceCache::Get(const std::string& hash, const RangeSet& ranges, uint8_t* buffer) {
+  auto it = entries_.find(hash);
+  if (it == entries_.end() || it->second->ranges != ranges) {
+    return false;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  memcpy(buffer, it->second->data.data(), it->second->data.size());
+  return true;
+}
+
+void SourceCache::Put(const std::string& hash, const RangeSet& ranges, const uint8_t* data,
+                      size_t size) {
+  if (auto it = entries_.find(hash); it != entries_.end()) {
+    Erase(it->second);
+  }
+  if (size == 0 || size > capacity_) {
+    return;
+  }
+
+  size_ += size;
+  lru_.push_front({ hash, ranges, BlockBuffer(data, data + size) });
+  entries_[hash] = lru_.begin();
+  EvictToCapacity();
+}
+
+void SourceCache::Invalidate(const RangeSet& ranges) {
+  if (!ranges) {
+    return;
+  }
+  for (auto it = lru_.begin(); it != lru_.end();) {
+    auto current = it++;
+    if (current->ranges.Overlaps(ranges)) {
+      Erase(current);
+    }
+  }
+}
+
+void SourceCache::Clear() {
+  lru_.clear();
+  entries_.clear();
+  size_ = 0;
+}
+
+void SourceCache::set_capacity(size_t capacity) {
+  capacity_ = capacity;
+  EvictToCapacity();
+}
+
+void SourceCache::Erase(std::list<Entry>::iterator it) {
+  size_ -= it->data.size();
+  entries_.erase(it->hash);
+  lru_.erase(it);
+}
+
+void SourceCache::EvictToCapacity() {
+  while (size_ > capacity_) {
+    Erase(std::prev(lru_.end()));
+  }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/stash_cache.h"
+
+#include <string>
+#include <utility>
+
+StashCache::Mapping StashCache::Get(const std::string& id) {
+  auto it = entries_.find(id);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->second;
+}
+
+void StashCache::Put(const std::string& id, Mapping mapping) {
+  Erase(id);
+  if (mapping == nullptr || mapping->size() > capacity_) {
+    return;
+  }
+
+  size_ += mapping->size();
+  lru_.emplace_front(id, std::move(mapping));
+  entries_[id] = lru_.begin();
+  EvictToCapacity();
+}
+
+void StashCache::Erase(const std::string& id) {
+  auto it = entries_.find(id);
+  if (it == entries_.end()) {
+    return;
+  }
+  size_ -= it->second->second->size();
+  lru_.erase(it->second);
+  entries_.erase(it);
+}
+
+void StashCache::Clear() {
+  lru_.clear();
+  entries_.clear();
+  size_ = 0;
+}
+
+void StashCache::set_capacity(size_t capacity) {
+  capacity_ = capacity;
+  EvictToCapacity();
+}
+
+void StashCache::EvictToCapacity() {
+  while (size_ > capacity_) {
+    const auto& [id, mapping] = lru_.back();
+    size_ -= mapping->size();
+    entries_.erase(id);
+    lru_.pop_back();
+  }
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "private/stash_compression.h"
+
+#include <lz4frame.h>
+
+#include <memory>
+#include <vector>
+
+#include <android-base/logging.h>
+
+static LZ4F_preferences_t StashPreferences(size_t size) {
+  LZ4F_preferences_t prefs = {};
+  prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+  prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+  prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+  prefs.frameInfo.blockChecksumFlag = LZ4F_blockChecksumEnabled;
+  prefs.frameInfo.contentSize = size;
+  return prefs;
+}
+
+bool CompressStash(const uint8_t* data, size_t size, std::vector<uint8_t>* frame) {
+  LZ4F_preferences_t prefs = StashPreferences(size);
+  frame->resize(LZ4F_compressFrameBound(size, &prefs));
+  size_t compressed = LZ4F_compressFrame(frame->data(), frame->size(), data, size, &prefs);
+  if (LZ4F_isError(compressed)) {
+    LOG(ERROR) << "Failed to compress " << size << " bytes: " << LZ4F_getErrorName(compressed);
+    return false;
+  }
+  frame->resize(compressed);
+  return compressed + kBlockBufferAlignment <= size;
+}
+
+bool DecompressStash(const uint8_t* frame, size_t size, BlockBuffer* buffer) {
+  LZ4F_dctx* dctx_ptr;
+  if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx_ptr, LZ4F_VERSION))) {
+    LOG(ERROR) << "Failed to create the LZ4 decompression context";
+    return false;
+  }
+  std::unique_ptr<LZ4F_dctx, decltype(&LZ4F_freeDecompressionContext)> dctx(
+      dctx_ptr, LZ4F_freeDecompressionContext);
+
+  LZ4F_frameInfo_t info;
+  size_t header_size = size;
+  size_t result = LZ4F_getFrameInfo(dctx.get(), &info, frame, &header_size);
+  if (LZ4F_isError(result)) {
+    LOG(ERROR) << "Invalid LZ4 frame header: " << LZ4F_getErrorName(result);
+    return false;
+  }
+  if (info.contentSize == 0 || info.contentSize % kBlockBufferAlignment != 0) {
+    LOG(ERROR) << "Invalid content size of the LZ4 frame: " << info.contentSize;
+    return false;
+  }
+
+  buffer->resize(info.contentSize);
+  size_t in_pos = header_size;
+  size_t out_pos = 0;
+  // LZ4F_decompress() returns 0 once it has reached the end of the frame and checked the content
+  // checksum, or a hint of the bytes it expects next.
+  while (result != 0) {
+    if (in_pos == size) {
+      LOG(ERROR) << "Truncated LZ4 frame after " << out_pos << " bytes";
+      return false;
+    }
+    size_t in_size = size - in_pos;
+    size_t out_size = buffer->size() - out_pos;
+    result = LZ4F_decompress(dctx.get(), buffer->data() + out_pos, &out_size, frame + in_pos,
+                             &in_size, nullptr);
+    if (LZ4F_isError(result)) {
+      LOG(ERROR) << "Failed to decompress the LZ4 frame: " << LZ4F_getErrorName(result);
+      return false;
+    }
+    in_pos += in_size;
+    out_pos += out_size;
+  }
+
+  if (in_pos != size || out_pos != buffer->size()) {
+    LOG(ERROR) << "Unexpected size of the LZ4 frame: " << size << " bytes (" << in_pos
+               << " used), " << out_pos << " bytes of content (" << buffer->size() << " expected)";
+    return false;
+  }
+  return true;
+}
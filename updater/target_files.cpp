@@ -16,18 +16,22 @@
 
 #include "updater/target_files.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <filesystem>
 #include <memory>
+#include <optional>
 
 #include <android-base/logging.h>
 #include <android-base/strings.h>
 #include <sparse/sparse.h>
 
-static bool SimgToImg(int input_fd, int output_fd) {
-  if (lseek64(input_fd, 0, SEEK_SET) == -1) {
+// Converts the sparse image that starts at |input_offset| of |input_fd| to raw. The RAW chunks are
+// read from |input_fd| as they're written out, so the sparse image doesn't need a file of its own.
+static bool SimgToImg(int input_fd, off64_t input_offset, int output_fd) {
+  if (lseek64(input_fd, input_offset, SEEK_SET) == -1) {
     PLOG(ERROR) << "Failed to lseek64 on the input sparse image";
     return false;
   }
@@ -177,6 +181,33 @@ bool TargetFile::ExtractEntryToTempFile(const std::string_view name,
   return true;
 }
 
+android::base::unique_fd TargetFile::OpenEntryInPlace(const std::string_view name,
+                                                      off64_t* offset) const {
+  if (extracted_input_) {
+    std::string entry_path = path_ + "/" + std::string(name);
+    android::base::unique_fd fd(open(entry_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+      PLOG(WARNING) << "Failed to open " << entry_path;
+    }
+    *offset = 0;
+    return fd;
+  }
+
+  CHECK(handle_);
+  ZipEntry64 entry;
+  if (FindEntry(handle_, name, &entry) != 0 || entry.method != kCompressStored) {
+    return {};
+  }
+  // A new fd rather than the zip's own one, whose file offset would be shared by the threads that
+  // extract the images.
+  android::base::unique_fd fd(open(path_.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    PLOG(WARNING) << "Failed to open " << path_;
+  }
+  *offset = entry.offset;
+  return fd;
+}
+
 bool TargetFile::Open() {
   if (!extracted_input_) {
     if (auto ret = OpenArchive(path_.c_str(), &handle_); ret != 0) {
@@ -248,13 +279,21 @@ bool TargetFile::ExtractImage(const std::string_view entry_name, const FstabInfo
       return false;
     }
   } else {  // treated as ext4 sparse image
-    TemporaryFile sparse_image{ std::string(work_dir) };
-    if (!ExtractEntryToTempFile(entry_name, &sparse_image)) {
-      return false;
+    // Convert the sparse image to raw. Read it in place if possible, which saves writing out the
+    // whole sparse image once more before the raw one.
+    off64_t offset;
+    android::base::unique_fd sparse_fd = OpenEntryInPlace(entry_name, &offset);
+    std::optional<TemporaryFile> sparse_image;
+    if (sparse_fd == -1) {
+      sparse_image.emplace(std::string(work_dir));
+      if (!ExtractEntryToTempFile(entry_name, &*sparse_image)) {
+        return false;
+      }
+      offset = 0;
     }
 
-    // Convert the sparse image to raw.
-    if (!SimgToImg(sparse_image.fd, image_file->fd)) {
+    int input_fd = sparse_image ? sparse_image->fd : sparse_fd.get();
+    if (!SimgToImg(input_fd, offset, image_file->fd)) {
       LOG(ERROR) << "Failed to convert " << fstab_info.mount_point << " to raw.";
       return false;
     }
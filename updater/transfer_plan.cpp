@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/transfer_plan.h"
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "otautil/rangeset.h"
+#include "private/commands.h"
+
+namespace {
+
+// The blocks and the stashes that a command touches.
+struct Access {
+  const RangeSet* reads{ nullptr };
+  const RangeSet* writes{ nullptr };
+  std::vector<const std::string*> stashes;
+};
+
+Access GetAccess(const Command& command) {
+  Access access;
+  switch (command.type()) {
+    case Command::Type::ZERO:
+    case Command::Type::NEW:
+    case Command::Type::ERASE:
+      access.writes = &command.target().ranges();
+      break;
+    case Command::Type::MOVE:
+    case Command::Type::BSDIFF:
+    case Command::Type::IMGDIFF:
+      access.reads = &command.source().ranges();
+      access.writes = &command.target().ranges();
+      for (const auto& stash : command.source().stashes()) {
+        access.stashes.push_back(&stash.id());
+      }
+      break;
+    case Command::Type::STASH:
+      access.reads = &command.stash().ranges();
+      access.stashes.push_back(&command.stash().id());
+      break;
+    case Command::Type::FREE:
+      access.stashes.push_back(&command.stash().id());
+      break;
+    case Command::Type::COMPUTE_HASH_TREE:
+      access.reads = &command.hash_tree_info().source_ranges();
+      access.writes = &command.hash_tree_info().hash_tree_ranges();
+      break;
+    case Command::Type::COMPUTE_FEC:
+      access.reads = &command.fec_info().source_ranges();
+      access.writes = &command.fec_info().fec_ranges();
+      break;
+    default:
+      break;
+  }
+  return access;
+}
+
+bool Overlaps(const RangeSet* a, const RangeSet* b) {
+  return a != nullptr && b != nullptr && *a && *b && a->Overlaps(*b);
+}
+
+// Whether |command| depends on any of the commands of |run|, or the other way around.
+bool Conflicts(const std::vector<Access>& run, const Access& command) {
+  for (const auto& other : run) {
+    if (Overlaps(command.reads, other.writes) || Overlaps(command.writes, other.reads) ||
+        Overlaps(command.writes, other.writes)) {
+      return true;
+    }
+    for (const auto* id : command.stashes) {
+      for (const auto* other_id : other.stashes) {
+        if (*id == *other_id) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+bool TransferPlan::CanMapSource(const Command& command) {
+  if (command.type() != Command::Type::BSDIFF && command.type() != Command::Type::IMGDIFF) {
+    return false;
+  }
+  const SourceInfo& source = command.source();
+  return source.stashes().empty() && source.ranges().blocks() == source.blocks() &&
+         source.blocks() >= kMinMappedSourceBlocks && !source.Overlaps(command.target());
+}
+
+TransferPlan TransferPlan::Analyze(const TransferList& transfer_list) {
+  TransferPlan plan;
+  // The live stashes, as indices into plan.stashes.
+  std::unordered_map<std::string, size_t> live;
+  size_t live_blocks = 0;
+  std::vector<Access> run;
+
+  for (const auto& command : transfer_list.commands()) {
+    size_t index = command.index();
+    plan.commands++;
+
+    switch (command.type()) {
+      case Command::Type::MOVE:
+      case Command::Type::BSDIFF:
+      case Command::Type::IMGDIFF:
+        plan.max_source_blocks = std::max(plan.max_source_blocks, command.source().blocks());
+        if (!CanMapSource(command)) {
+          plan.max_copied_source_blocks =
+              std::max(plan.max_copied_source_blocks, command.source().blocks());
+        }
+        plan.max_target_blocks = std::max(plan.max_target_blocks, command.target().blocks());
+        // The source blocks get stashed if they overlap with the target.
+        plan.max_stash_blocks = std::max(plan.max_stash_blocks, command.source().blocks());
+        plan.blocks_read += command.source().ranges().blocks();
+        plan.blocks_written += command.target().blocks();
+        plan.patch_bytes += command.patch().length();
+        for (const auto& stash : command.source().stashes()) {
+          if (auto it = live.find(stash.id()); it != live.end()) {
+            plan.stashes[it->second].last_use = index;
+          }
+        }
+        break;
+      case Command::Type::STASH: {
+        size_t blocks = command.stash().ranges().blocks();
+        plan.max_source_blocks = std::max(plan.max_source_blocks, blocks);
+        plan.max_copied_source_blocks = std::max(plan.max_copied_source_blocks, blocks);
+        plan.max_stash_blocks = std::max(plan.max_stash_blocks, blocks);
+        plan.blocks_read += blocks;
+        if (live.find(command.stash().id()) == live.end()) {
+          live.emplace(command.stash().id(), plan.stashes.size());
+          plan.stashes.push_back({ command.stash().id(), blocks, index, index, kNever });
+          live_blocks += blocks;
+          plan.peak_stash_blocks = std::max(plan.peak_stash_blocks, live_blocks);
+          plan.blocks_stashed += blocks;
+        }
+        break;
+      }
+      case Command::Type::FREE:
+        if (auto it = live.find(command.stash().id()); it != live.end()) {
+          plan.stashes[it->second].freed = index;
+          live_blocks -= plan.stashes[it->second].blocks;
+          live.erase(it);
+        }
+        break;
+      case Command::Type::NEW:
+        plan.new_blocks += command.target().blocks();
+        plan.blocks_written += command.target().blocks();
+        break;
+      case Command::Type::ZERO:
+      case Command::Type::ERASE:
+        plan.blocks_written += command.target().blocks();
+        break;
+      case Command::Type::COMPUTE_HASH_TREE:
+        plan.blocks_read += command.hash_tree_info().source_ranges().blocks();
+        break;
+      case Command::Type::COMPUTE_FEC:
+        plan.blocks_read += command.fec_info().source_ranges().blocks();
+        break;
+      default:
+        break;
+    }
+
+    Access access = GetAccess(command);
+    if (access.reads != nullptr && *access.reads) {
+      plan.reads.push_back({ index, *access.reads });
+    }
+    if (run.empty() || run.size() >= kMaxRunLength || Conflicts(run, access)) {
+      plan.runs.push_back(index);
+      run.clear();
+    }
+    run.push_back(std::move(access));
+  }
+  return plan;
+}
+
+const TransferPlan::StashLifetime* TransferPlan::FindStash(size_t cmdindex) const {
+  auto it = std::lower_bound(
+      stashes.begin(), stashes.end(), cmdindex,
+      [](const StashLifetime& stash, size_t index) { return stash.stashed < index; });
+  if (it == stashes.end() || it->stashed != cmdindex) {
+    return nullptr;
+  }
+  return &*it;
+}
+
+std::ostream& operator<<(std::ostream& os, const TransferPlan& plan) {
+  os << plan.commands << " commands: read " << plan.blocks_read << " blocks, write "
+     << plan.blocks_written << " blocks (" << plan.new_blocks << " new), stash "
+     << plan.blocks_stashed << " blocks in " << plan.stashes.size() << " stashes (peak "
+     << plan.peak_stash_blocks << "), patch " << plan.patch_bytes << " bytes; "
+     << plan.runs.size() << " runs of independent commands";
+  return os;
+}
@@ -15,23 +15,40 @@
  */
 
 #include <getopt.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parsedouble.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
 #include "edify/expr.h"
 #include "otautil/error_code.h"
 #include "otautil/paths.h"
+#include "private/io_trace.h"
+#include "private/load_governor.h"
 #include "updater/blockimg.h"
 #include "updater/build_info.h"
 #include "updater/dynamic_partitions.h"
 #include "updater/install.h"
+#include "updater/install_cost.h"
 #include "updater/simulator_runtime.h"
 #include "updater/updater.h"
 
@@ -41,7 +58,12 @@ void Usage(std::string_view name) {
   LOG(INFO) << "Usage: " << name << "[--oem_settings <oem_property_file>]"
             << "[--skip_functions <skip_function_file>]"
             << " --source <source_target_file>"
-            << " --ota_package <ota_package>";
+            << " --ota_package <ota_package>"
+            << " [--cost_report <cost_file>] [--cost_baseline <cost_file>]"
+            << " [--cost_tolerance <percent>]"
+            << "\n   or: " << name << "[--oem_settings <oem_property_file>]"
+            << "[--skip_functions <skip_function_file>]"
+            << " --batch <batch_file> [--jobs <jobs>] [--report <report_file>]";
 }
 
 Value* SimulatorPlaceHolderFn(const char* name, State* /* state */,
@@ -50,6 +72,261 @@ Value* SimulatorPlaceHolderFn(const char* name, State* /* state */,
   return StringValue("t");
 }
 
+// The threads of each pool of the updater while measuring the cost of an install, instead of the
+// default that follows the CPUs of the host.
+static constexpr const char* kCostThreads = "4";
+
+static uint64_t CpuMs(const rusage& usage) {
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+}
+
+// Simulates the update of |package_name| on the source build. Returns true if the script succeeds.
+// If |cost| isn't null, it gets the cost of the install (see InstallCost).
+static bool RunSimulation(BuildInfo* source_build_info, const std::string& package_name,
+                          InstallCost* cost = nullptr) {
+  TemporaryFile temp_saved_source;
+  TemporaryFile temp_last_command;
+  TemporaryDir temp_stash_base;
+  TemporaryFile temp_io_trace;
+
+  Paths::Get().set_cache_temp_source(temp_saved_source.path);
+  Paths::Get().set_last_command_file(temp_last_command.path);
+  Paths::Get().set_stash_directory_base(temp_stash_base.path);
+  Paths::Get().set_temporary_io_trace_file(temp_io_trace.path);
+
+  auto runtime = std::make_unique<SimulatorRuntime>(source_build_info);
+  if (cost != nullptr) {
+    // The block I/O is counted off the I/O trace. The threads and the memory budgets, which would
+    // follow the CPUs and the load of the host, are pinned, so that the counters only change along
+    // with the package and the updater.
+    std::map<std::string, std::string, std::less<>> overrides{ { "ro.updater.io_trace", "true" } };
+    for (const auto& pool :
+         { "brotli", "hash", "imgpatch", "patch", "recover", "verify", "zstd" }) {
+      overrides.emplace("ro.updater."s + pool + "_threads", kCostThreads);
+    }
+    runtime->set_property_overrides(std::move(overrides));
+    LoadGovernor::Get().IgnoreLoad();
+  }
+
+  TemporaryFile cmd_pipe;
+  rusage start_usage;
+  getrusage(RUSAGE_SELF, &start_usage);
+  {
+    // The command pipe is flushed once the updater is gone.
+    Updater updater(std::move(runtime));
+    if (!updater.Init(cmd_pipe.release(), package_name, false)) {
+      return false;
+    }
+
+    if (!updater.RunUpdate()) {
+      return false;
+    }
+
+    LOG(INFO) << "\nscript succeeded, result: " << updater.GetResult();
+  }
+  if (cost == nullptr) {
+    return true;
+  }
+
+  std::string content;
+  if (!android::base::ReadFileToString(cmd_pipe.path, &content)) {
+    PLOG(ERROR) << "Failed to read the command pipe " << cmd_pipe.path;
+    return false;
+  }
+  cost->AddCommandPipe(content);
+  // Scripts without block_image_update() leave the tracing off.
+  if (IoTracer::Get().enabled()) {
+    IoTrace trace;
+    if (!ReadIoTrace(temp_io_trace.path, &trace)) {
+      return false;
+    }
+    cost->AddIoTrace(trace);
+  }
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  cost->Set("cpu_ms", CpuMs(usage) - CpuMs(start_usage));
+  cost->Set("peak_rss_kb", usage.ru_maxrss);
+  return true;
+}
+
+// Writes |cost| to |report_file|, if any, and checks it against the one in |baseline_file|, if
+// any. Returns false on errors, or if the cost went up (see InstallCost::FindRegressions()).
+static bool CheckCost(const InstallCost& cost, const std::string& report_file,
+                      const std::string& baseline_file, double tolerance_percent) {
+  if (!report_file.empty() && !android::base::WriteStringToFile(cost.ToString(), report_file)) {
+    PLOG(ERROR) << "Failed to write " << report_file;
+    return false;
+  }
+  if (baseline_file.empty()) {
+    return true;
+  }
+
+  std::string content;
+  if (!android::base::ReadFileToString(baseline_file, &content)) {
+    PLOG(ERROR) << "Failed to read " << baseline_file;
+    return false;
+  }
+  InstallCost baseline;
+  if (!InstallCost::Parse(content, &baseline)) {
+    LOG(ERROR) << "Failed to parse the install cost in " << baseline_file;
+    return false;
+  }
+  auto regressions = cost.FindRegressions(baseline, tolerance_percent);
+  for (const auto& regression : regressions) {
+    LOG(ERROR) << "Install cost regression: " << regression;
+  }
+  if (!regressions.empty()) {
+    LOG(ERROR) << regressions.size() << " values of the install cost went up from "
+               << baseline_file;
+    return false;
+  }
+  LOG(INFO) << "The install cost is within " << baseline_file;
+  return true;
+}
+
+// A temporary directory that's removed along with its contents when going out of scope.
+struct ScopedTempDir {
+  explicit ScopedTempDir(const std::string& parent) : path(parent + "/XXXXXX") {
+    if (mkdtemp(path.data()) == nullptr) {
+      PLOG(ERROR) << "Failed to create a temporary directory under " << parent;
+      path.clear();
+    }
+  }
+  ~ScopedTempDir() {
+    if (!path.empty()) {
+      std::error_code ec;
+      std::filesystem::remove_all(path, ec);
+    }
+  }
+
+  std::string path;
+};
+
+// One line of the batch file, i.e. a package to simulate on a source build, and how it went.
+struct BatchRun {
+  std::string source;
+  std::string package;
+  bool succeeded = false;
+  std::chrono::steady_clock::time_point start;
+  double seconds = 0;
+};
+
+// Runs the simulations listed in |batch_file|, one "<source_target_file> <ota_package>" per line,
+// on up to |jobs| processes at a time. Each source build is parsed and has its images extracted
+// once; every run then works on copies of the images in a process of its own, since the updater
+// keeps global state. Writes a tab separated line per run to |report_file|, or to stdout if empty.
+static int RunBatch(const std::string& batch_file, const std::string& report_file, size_t jobs,
+                    const std::string& oem_settings, const std::string& work_dir) {
+  std::string content;
+  if (!android::base::ReadFileToString(batch_file, &content)) {
+    PLOG(ERROR) << "Failed to read " << batch_file;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<BatchRun> runs;
+  for (const auto& line : android::base::Split(content, "\n")) {
+    if (line.empty() || android::base::StartsWith(line, "#")) {
+      continue;
+    }
+    auto tokens = android::base::Tokenize(line, " \t");
+    if (tokens.size() != 2) {
+      LOG(ERROR) << "Invalid line in " << batch_file << ": " << line;
+      return EXIT_FAILURE;
+    }
+    runs.push_back(BatchRun{ tokens[0], tokens[1] });
+  }
+
+  // Parse each source build once, before forking the runs that share it. The directories outlive
+  // the BuildInfo objects, which remove the images that they've extracted.
+  std::list<ScopedTempDir> source_dirs;
+  std::map<std::string, std::unique_ptr<BuildInfo>> sources;
+  for (const auto& run : runs) {
+    if (sources.count(run.source) != 0) {
+      continue;
+    }
+    source_dirs.emplace_back(work_dir);
+    if (source_dirs.back().path.empty()) {
+      return EXIT_FAILURE;
+    }
+    auto build_info = std::make_unique<BuildInfo>(source_dirs.back().path, false);
+    if (!build_info->ParseTargetFile(run.source, false)) {
+      LOG(ERROR) << "Failed to parse the target file " << run.source;
+      build_info.reset();
+    } else if (!oem_settings.empty()) {
+      CHECK_EQ(0, access(oem_settings.c_str(), R_OK));
+      build_info->SetOemSettings(oem_settings);
+    }
+    sources.emplace(run.source, std::move(build_info));
+  }
+
+  std::map<pid_t, size_t> running;
+  size_t next_run = 0;
+  while (next_run < runs.size() || !running.empty()) {
+    while (next_run < runs.size() && running.size() < jobs) {
+      BatchRun& run = runs[next_run];
+      BuildInfo* build_info = sources[run.source].get();
+      if (build_info == nullptr) {
+        next_run++;
+        continue;
+      }
+      run.start = std::chrono::steady_clock::now();
+      pid_t pid = fork();
+      if (pid == -1) {
+        PLOG(ERROR) << "Failed to fork";
+        return EXIT_FAILURE;
+      }
+      if (pid == 0) {
+        // The child must not run the destructors of the parent's objects, which would remove the
+        // extracted source images; hence _exit().
+        bool succeeded;
+        {
+          ScopedTempDir image_dir(work_dir);
+          succeeded = !image_dir.path.empty() && build_info->CopyImages(image_dir.path) &&
+                      RunSimulation(build_info, run.package);
+        }
+        _exit(succeeded ? EXIT_SUCCESS : EXIT_FAILURE);
+      }
+      running.emplace(pid, next_run++);
+    }
+    if (running.empty()) {
+      break;
+    }
+
+    int status;
+    pid_t pid = TEMP_FAILURE_RETRY(waitpid(-1, &status, 0));
+    if (pid == -1) {
+      PLOG(ERROR) << "Failed to wait for the simulations";
+      return EXIT_FAILURE;
+    }
+    auto it = running.find(pid);
+    if (it == running.end()) {
+      continue;
+    }
+    BatchRun& run = runs[it->second];
+    run.succeeded = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - run.start;
+    run.seconds = duration.count();
+    running.erase(it);
+  }
+
+  std::string report = "source\tpackage\tresult\tseconds\n";
+  bool all_succeeded = true;
+  for (const auto& run : runs) {
+    report += android::base::StringPrintf("%s\t%s\t%s\t%.3f\n", run.source.c_str(),
+                                          run.package.c_str(), run.succeeded ? "pass" : "fail",
+                                          run.seconds);
+    all_succeeded = all_succeeded && run.succeeded;
+  }
+  if (report_file.empty()) {
+    printf("%s", report.c_str());
+  } else if (!android::base::WriteStringToFile(report, report_file)) {
+    PLOG(ERROR) << "Failed to write " << report_file;
+    return EXIT_FAILURE;
+  }
+  return all_succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char** argv) {
   // Write the logs to stdout.
   android::base::InitLogging(argv, &android::base::StderrLogger);
@@ -60,11 +337,23 @@ int main(int argc, char** argv) {
   std::string package_name;
   std::string work_dir;
   bool keep_images = false;
+  std::string batch_file;
+  std::string report_file;
+  std::string cost_report_file;
+  std::string cost_baseline_file;
+  double cost_tolerance = 10;
+  size_t jobs = std::max(1u, std::thread::hardware_concurrency());
 
   constexpr struct option OPTIONS[] = {
+    { "batch", required_argument, nullptr, 0 },
+    { "cost_baseline", required_argument, nullptr, 0 },
+    { "cost_report", required_argument, nullptr, 0 },
+    { "cost_tolerance", required_argument, nullptr, 0 },
+    { "jobs", required_argument, nullptr, 0 },
     { "keep_images", no_argument, nullptr, 0 },
     { "oem_settings", required_argument, nullptr, 0 },
     { "ota_package", required_argument, nullptr, 0 },
+    { "report", required_argument, nullptr, 0 },
     { "skip_functions", required_argument, nullptr, 0 },
     { "source", required_argument, nullptr, 0 },
     { "work_dir", required_argument, nullptr, 0 },
@@ -94,16 +383,41 @@ int main(int argc, char** argv) {
       keep_images = true;
     } else if (option_name == "work_dir"s) {
       work_dir = optarg;
+    } else if (option_name == "batch"s) {
+      batch_file = optarg;
+    } else if (option_name == "report"s) {
+      report_file = optarg;
+    } else if (option_name == "jobs"s) {
+      if (!android::base::ParseUint(optarg, &jobs) || jobs == 0) {
+        LOG(ERROR) << "Invalid number of jobs: " << optarg;
+        return EXIT_FAILURE;
+      }
+    } else if (option_name == "cost_report"s) {
+      cost_report_file = optarg;
+    } else if (option_name == "cost_baseline"s) {
+      cost_baseline_file = optarg;
+    } else if (option_name == "cost_tolerance"s) {
+      // The percentage that the measurements of the cost (the CPU time and the memory) may go up
+      // by from the baseline.
+      if (!android::base::ParseDouble(optarg, &cost_tolerance, 0.0)) {
+        LOG(ERROR) << "Invalid cost tolerance: " << optarg;
+        return EXIT_FAILURE;
+      }
     } else {
       Usage(argv[0]);
       return EXIT_FAILURE;
     }
   }
 
-  if (source_target_file.empty() || package_name.empty()) {
+  if (batch_file.empty() && (source_target_file.empty() || package_name.empty())) {
     Usage(argv[0]);
     return EXIT_FAILURE;
   }
+  bool measure_cost = !cost_report_file.empty() || !cost_baseline_file.empty();
+  if (measure_cost && !batch_file.empty()) {
+    LOG(ERROR) << "The install cost is only measured for a single simulation";
+    return EXIT_FAILURE;
+  }
 
   // Configure edify's functions.
   RegisterBuiltins();
@@ -127,20 +441,15 @@ int main(int argc, char** argv) {
     }
   }
 
-  TemporaryFile temp_saved_source;
-  TemporaryFile temp_last_command;
-  TemporaryDir temp_stash_base;
-
-  Paths::Get().set_cache_temp_source(temp_saved_source.path);
-  Paths::Get().set_last_command_file(temp_last_command.path);
-  Paths::Get().set_stash_directory_base(temp_stash_base.path);
-
-  TemporaryFile cmd_pipe;
   TemporaryDir source_temp_dir;
   if (work_dir.empty()) {
     work_dir = source_temp_dir.path;
   }
 
+  if (!batch_file.empty()) {
+    return RunBatch(batch_file, report_file, jobs, oem_settings, work_dir);
+  }
+
   BuildInfo source_build_info(work_dir, keep_images);
   if (!source_build_info.ParseTargetFile(source_target_file, false)) {
     LOG(ERROR) << "Failed to parse the target file " << source_target_file;
@@ -152,16 +461,12 @@ int main(int argc, char** argv) {
     source_build_info.SetOemSettings(oem_settings);
   }
 
-  Updater updater(std::make_unique<SimulatorRuntime>(&source_build_info));
-  if (!updater.Init(cmd_pipe.release(), package_name, false)) {
+  InstallCost cost;
+  if (!RunSimulation(&source_build_info, package_name, measure_cost ? &cost : nullptr)) {
     return EXIT_FAILURE;
   }
-
-  if (!updater.RunUpdate()) {
+  if (measure_cost && !CheckCost(cost, cost_report_file, cost_baseline_file, cost_tolerance)) {
     return EXIT_FAILURE;
   }
-
-  LOG(INFO) << "\nscript succeeded, result: " << updater.GetResult();
-
-  return 0;
+  return EXIT_SUCCESS;
 }
@@ -17,16 +17,25 @@
 #include "updater/updater.h"
 
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <string>
 
 #include <android-base/logging.h>
 #include <android-base/strings.h>
 
 #include "edify/updater_runtime_interface.h"
+#include "otautil/paths.h"
+#include "otautil/phase_stats.h"
+#include "otautil/trace.h"
+#include "private/io_trace.h"
+#include "private/pending_syncs.h"
 
 Updater::~Updater() {
+  WritePendingProgress();
   if (package_handle_) {
     CloseArchive(package_handle_);
   }
@@ -79,6 +88,20 @@ bool Updater::RunUpdate() {
   state.is_retry = is_retry_;
 
   bool status = Evaluate(&state, root, &result_);
+  // The end of the script is the last barrier for the writes that the builtins didn't sync. A
+  // failed script still syncs what it got done, so that a retry starts from there.
+  if (!PendingSyncs::Get().SyncAll() && status) {
+    state.errmsg = "Failed to sync the files written by the script\n";
+    state.cause_code = kFsyncFailure;
+    status = false;
+  }
+  WritePendingProgress();
+  WriteTraceFile(Paths::Get().temporary_trace_file());
+  IoTracer::Get().Write(Paths::Get().temporary_io_trace_file());
+  // The stats of the phases go into last_install, whether or not the script succeeded.
+  for (const auto& line : FormatPhaseStats("log ")) {
+    WriteToCommandPipe(line);
+  }
   if (status) {
     fprintf(cmd_pipe_.get(), "ui_print script succeeded: result was [%s]\n", result_.c_str());
     // Even though the script doesn't abort, still log the cause code if result is empty.
@@ -96,19 +119,51 @@ bool Updater::RunUpdate() {
 }
 
 void Updater::WriteToCommandPipe(const std::string_view message, bool flush) const {
+  std::lock_guard<std::mutex> lock(pipe_mutex_);
+  // Progress updates can come once per block command, far more often than the UI redraws.
+  if (android::base::StartsWith(message, "set_progress ")) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_progress_time_ < kProgressInterval) {
+      pending_progress_ = message;
+      return;
+    }
+    last_progress_time_ = now;
+    pending_progress_.clear();
+  } else {
+    WritePendingProgressLocked();
+  }
+
   fprintf(cmd_pipe_.get(), "%s\n", std::string(message).c_str());
   if (flush) {
     fflush(cmd_pipe_.get());
   }
 }
 
+void Updater::WritePendingProgress() const {
+  std::lock_guard<std::mutex> lock(pipe_mutex_);
+  WritePendingProgressLocked();
+}
+
+void Updater::WritePendingProgressLocked() const {
+  if (pending_progress_.empty()) {
+    return;
+  }
+  fprintf(cmd_pipe_.get(), "%s\n", pending_progress_.c_str());
+  last_progress_time_ = std::chrono::steady_clock::now();
+  pending_progress_.clear();
+}
+
 void Updater::UiPrint(const std::string_view message) const {
-  // "line1\nline2\n" will be split into 3 tokens: "line1", "line2" and "".
-  // so skip sending empty strings to ui.
-  std::vector<std::string> lines = android::base::Split(std::string(message), "\n");
-  for (const auto& line : lines) {
-    if (!line.empty()) {
-      fprintf(cmd_pipe_.get(), "ui_print %s\n", line.c_str());
+  {
+    std::lock_guard<std::mutex> lock(pipe_mutex_);
+    WritePendingProgressLocked();
+    // "line1\nline2\n" will be split into 3 tokens: "line1", "line2" and "".
+    // so skip sending empty strings to ui.
+    std::vector<std::string> lines = android::base::Split(std::string(message), "\n");
+    for (const auto& line : lines) {
+      if (!line.empty()) {
+        fprintf(cmd_pipe_.get(), "ui_print %s\n", line.c_str());
+      }
     }
   }
 
@@ -122,6 +177,18 @@ std::string Updater::FindBlockDeviceName(const std::string_view name) const {
   return runtime_->FindBlockDeviceName(name);
 }
 
+// How much of an entry gets read ahead of time, on top of the more aggressive readahead for
+// sequential reads. Limited to not evict the pages that are in use on low memory devices.
+static constexpr uint64_t kPackageWillNeedSize = 16 * 1024 * 1024;
+
+void Updater::AdvisePackageRead(uint64_t offset, uint64_t length) const {
+  if (mapped_package_.addr == nullptr) {
+    return;
+  }
+  mapped_package_.Advise(offset, length, MADV_SEQUENTIAL);
+  mapped_package_.Advise(offset, std::min(length, kPackageWillNeedSize), MADV_WILLNEED);
+}
+
 void Updater::ParseAndReportErrorCode(State* state) {
   CHECK(state);
   if (state->errmsg.empty()) {
@@ -28,6 +28,8 @@
 #include <selinux/selinux.h>
 
 #include "edify/expr.h"
+#include "otautil/live_stats.h"
+#include "otautil/memory_budget.h"
 #include "updater/blockimg.h"
 #include "updater/dynamic_partitions.h"
 #include "updater/install.h"
@@ -93,6 +95,10 @@ int main(int argc, char** argv) {
     }
   }
 
+  // The caches of the block image functions give memory back when the device stalls on it.
+  MemoryBudget::Get().MonitorPressure();
+  StartLiveStats("updater");
+
   // Configure edify's functions.
   RegisterBuiltins();
   RegisterInstallFunctions();
@@ -100,10 +106,11 @@ int main(int argc, char** argv) {
   RegisterDynamicPartitionsFunctions();
   RegisterDeviceExtensions();
 
-  auto sehandle = selinux_android_file_context_handle();
-  selinux_android_set_sehandle(sehandle);
-
-  Updater updater(std::make_unique<UpdaterRuntime>(sehandle));
+  Updater updater(std::make_unique<UpdaterRuntime>([]() {
+    auto sehandle = selinux_android_file_context_handle();
+    selinux_android_set_sehandle(sehandle);
+    return sehandle;
+  }));
   if (!updater.Init(fd, package_name, is_retry)) {
     return EXIT_FAILURE;
   }
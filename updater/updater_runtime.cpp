@@ -34,6 +34,12 @@
 
 #include "mounts.h"
 #include "otautil/sysutil.h"
+#include "private/block_queue.h"
+
+UpdaterRuntime::UpdaterRuntime(std::function<struct selabel_handle*()> sehandle_loader)
+    : sehandle_loader_(std::move(sehandle_loader)) {}
+
+UpdaterRuntime::~UpdaterRuntime() = default;
 
 std::string UpdaterRuntime::GetProperty(const std::string_view key,
                                         const std::string_view default_value) const {
@@ -44,6 +50,46 @@ std::string UpdaterRuntime::FindBlockDeviceName(const std::string_view name) con
   return std::string(name);
 }
 
+std::vector<std::string> UpdaterRuntime::TuneBlockQueues(const std::string_view path,
+                                                         BlockAccess access) {
+  std::call_once(block_queues_created_, [this]() {
+    if (GetProperty("ro.updater.block_queue_tuning", "true") != "true") {
+      LOG(INFO) << "Not tuning the block queues";
+      return;
+    }
+    block_queues_ = std::make_unique<BlockQueueTuner>();
+    // The profiles may be set per device, e.g. "read_ahead_kb=512,scheduler=none".
+    for (const auto& [access, property] :
+         { std::pair(BlockAccess::kSequential, "ro.updater.block_queue_sequential"),
+           std::pair(BlockAccess::kRandom, "ro.updater.block_queue_random") }) {
+      std::vector<BlockQueueTuner::Setting> profile;
+      if (std::string value = GetProperty(property, "");
+          !value.empty() && BlockQueueTuner::ParseProfile(value, &profile)) {
+        block_queues_->SetProfile(access, profile);
+      }
+    }
+  });
+  if (!block_queues_) {
+    return {};
+  }
+  return block_queues_->Tune(std::string(path), access);
+}
+
+void UpdaterRuntime::RestoreBlockQueues(const std::string_view path) {
+  if (block_queues_) {
+    block_queues_->Restore(std::string(path));
+  }
+}
+
+struct selabel_handle* UpdaterRuntime::sehandle() const {
+  std::call_once(sehandle_loaded_, [this]() {
+    if (sehandle_loader_) {
+      sehandle_ = sehandle_loader_();
+    }
+  });
+  return sehandle_;
+}
+
 static bool setMountFlag(const std::string& flag, unsigned* mount_flags) {
   static constexpr std::pair<const char*, unsigned> mount_flags_list[] = {
     { "noatime", MS_NOATIME },
@@ -96,8 +142,8 @@ int UpdaterRuntime::Mount(const std::string_view location, const std::string_vie
   unsigned mount_flags = 0;
   std::string fs_options;
 
-  if (sehandle_) {
-    selabel_lookup(sehandle_, &secontext, mount_point_string.c_str(), 0755);
+  if (struct selabel_handle* sehandle = this->sehandle(); sehandle) {
+    selabel_lookup(sehandle, &secontext, mount_point_string.c_str(), 0755);
     setfscreatecon(secontext);
   }
 
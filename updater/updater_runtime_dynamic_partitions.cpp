@@ -17,20 +17,27 @@
 #include "updater/updater_runtime.h"
 
 #include <algorithm>
+#include <charconv>
 #include <chrono>
 #include <iterator>
+#include <map>
 #include <optional>
+#include <set>
 #include <string>
+#include <string_view>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
-#include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <fs_mgr.h>
 #include <fs_mgr_dm_linear.h>
 #include <libdm/dm.h>
 #include <liblp/builder.h>
+#include <liblp/liblp.h>
+
+#include "otautil/dirutil.h"
 
 using android::dm::DeviceMapper;
 using android::dm::DmDeviceState;
@@ -86,7 +93,9 @@ bool UpdaterRuntime::MapPartitionOnDeviceMapper(const std::string& partition_nam
   }
 
   if (state == DmDeviceState::ACTIVE) {
-    return DeviceMapper::Instance().GetDmDevicePathByName(partition_name_suffix, path);
+    // The device may have been mapped just before, with its node yet to be created by ueventd.
+    return DeviceMapper::Instance().GetDmDevicePathByName(partition_name_suffix, path) &&
+           WaitForPath(*path, kMapTimeout);
   }
   LOG(ERROR) << "Unknown device mapper state: "
              << static_cast<std::underlying_type_t<DmDeviceState>>(state);
@@ -100,7 +109,8 @@ bool UpdaterRuntime::UnmapPartitionOnDeviceMapper(const std::string& partition_n
 namespace {  // Ops
 
 struct OpParameters {
-  std::vector<std::string> tokens;
+  // Views into the op list, which outlives the ops.
+  std::vector<std::string_view> tokens;
   MetadataBuilder* builder;
 
   bool ExpectArgSize(size_t size) const {
@@ -112,18 +122,20 @@ struct OpParameters {
     }
     return true;
   }
-  const std::string& op() const {
+  std::string_view op() const {
     CHECK(!tokens.empty());
     return tokens[0];
   }
-  const std::string& arg(size_t pos) const {
+  std::string arg(size_t pos) const {
     CHECK_LE(pos + 1, tokens.size());
-    return tokens[pos + 1];
+    return std::string(tokens[pos + 1]);
   }
   std::optional<uint64_t> uint_arg(size_t pos, const std::string& name) const {
-    auto str = arg(pos);
+    CHECK_LE(pos + 1, tokens.size());
+    auto str = tokens[pos + 1];
     uint64_t ret;
-    if (!android::base::ParseUint(str, &ret)) {
+    auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), ret);
+    if (ec != std::errc() || ptr != str.data() + str.size()) {
       LOG(ERROR) << "Op " << op() << " expects uint64 for argument " << name << ", got " << str;
       return std::nullopt;
     }
@@ -132,7 +144,7 @@ struct OpParameters {
 };
 
 using OpFunction = std::function<bool(const OpParameters&)>;
-using OpMap = std::map<std::string, OpFunction>;
+using OpMap = std::map<std::string, OpFunction, std::less<>>;
 
 bool PerformOpResize(const OpParameters& params) {
   if (!params.ExpectArgSize(2)) return false;
@@ -296,6 +308,53 @@ bool PerformOpRemoveAllGroups(const OpParameters& params) {
   return true;
 }
 
+// Returns the linear extents of each partition in |metadata|, as (first sector, number of sectors)
+// on the super partition.
+std::map<std::string, std::set<std::pair<uint64_t, uint64_t>>> GetPartitionExtents(
+    const LpMetadata& metadata) {
+  std::map<std::string, std::set<std::pair<uint64_t, uint64_t>>> result;
+  for (const auto& partition : metadata.partitions) {
+    auto& extents = result[android::fs_mgr::GetPartitionName(partition)];
+    for (size_t i = 0; i < partition.num_extents; i++) {
+      const auto& extent = metadata.extents[partition.first_extent_index + i];
+      if (extent.target_type == LP_TARGET_TYPE_LINEAR) {
+        extents.emplace(extent.target_data, extent.num_sectors);
+      }
+    }
+  }
+  return result;
+}
+
+// Logs what the op list changes in the layout of the super partition before it's committed: the
+// partitions whose extents differ, and the bytes that they newly map, which the update will have
+// to write in full.
+void LogLayoutChange(const LpMetadata& old_metadata, const LpMetadata& new_metadata) {
+  auto old_extents = GetPartitionExtents(old_metadata);
+  auto new_extents = GetPartitionExtents(new_metadata);
+  std::vector<std::string> changed;
+  uint64_t remapped_sectors = 0;
+  for (const auto& [name, extents] : new_extents) {
+    auto it = old_extents.find(name);
+    if (it != old_extents.end() && it->second == extents) {
+      continue;
+    }
+    changed.push_back(name);
+    for (const auto& extent : extents) {
+      if (it == old_extents.end() || it->second.count(extent) == 0) {
+        remapped_sectors += extent.second;
+      }
+    }
+  }
+  for (const auto& [name, extents] : old_extents) {
+    if (new_extents.count(name) == 0) {
+      changed.push_back(name + " (removed)");
+    }
+  }
+  LOG(INFO) << "Dynamic partitions: " << changed.size() << " of " << new_extents.size()
+            << " partition(s) change layout [" << android::base::Join(changed, ", ") << "], "
+            << remapped_sectors * LP_SECTOR_SIZE << " bytes newly mapped";
+}
+
 }  // namespace
 
 bool UpdaterRuntime::UpdateDynamicPartitions(const std::string_view op_list_value) {
@@ -319,23 +378,38 @@ bool UpdaterRuntime::UpdateDynamicPartitions(const std::string_view op_list_valu
     // clang-format on
   };
 
-  std::vector<std::string> lines = android::base::Split(std::string(op_list_value), "\n");
-  for (const auto& line : lines) {
-    auto comment_idx = line.find('#');
-    auto op_and_args = comment_idx == std::string::npos ? line : line.substr(0, comment_idx);
-    op_and_args = android::base::Trim(op_and_args);
-    if (op_and_args.empty()) continue;
+  auto old_metadata = builder->Export();
+  if (old_metadata == nullptr) {
+    LOG(ERROR) << "Failed to export metadata.";
+    return false;
+  }
+
+  // Tokenize the op list in place; only the names that go into the metadata get copied.
+  OpParameters params;
+  params.builder = builder.get();
+  std::string_view remaining = op_list_value;
+  while (!remaining.empty()) {
+    size_t newline = remaining.find('\n');
+    std::string_view line = remaining.substr(0, newline);
+    remaining.remove_prefix(newline == std::string_view::npos ? remaining.size() : newline + 1);
+    line = line.substr(0, line.find('#'));
+
+    params.tokens.clear();
+    while (!line.empty()) {
+      size_t begin = line.find_first_not_of(" \t\r");
+      if (begin == std::string_view::npos) break;
+      line.remove_prefix(begin);
+      size_t end = line.find_first_of(" \t\r");
+      params.tokens.push_back(line.substr(0, end));
+      line.remove_prefix(end == std::string_view::npos ? line.size() : end);
+    }
+    if (params.tokens.empty()) continue;
 
-    auto tokens = android::base::Split(op_and_args, " ");
-    const auto& op = tokens[0];
-    auto it = op_map.find(op);
+    auto it = op_map.find(params.op());
     if (it == op_map.end()) {
-      LOG(ERROR) << "Unknown operation in op_list: " << op;
+      LOG(ERROR) << "Unknown operation in op_list: " << params.op();
       return false;
     }
-    OpParameters params;
-    params.tokens = tokens;
-    params.builder = builder.get();
     if (!it->second(params)) {
       return false;
     }
@@ -346,6 +420,7 @@ bool UpdaterRuntime::UpdateDynamicPartitions(const std::string_view op_list_valu
     LOG(ERROR) << "Failed to export metadata.";
     return false;
   }
+  LogLayoutChange(*old_metadata, *metadata);
 
   if (!UpdatePartitionTable(super_device, *metadata, 0)) {
     LOG(ERROR) << "Failed to write metadata.";
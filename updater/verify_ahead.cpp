@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/verify_ahead.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <openssl/sha.h>
+
+#include "otautil/print_sha1.h"
+
+// The ranges of a batch that are at most this many blocks apart get read together, gap and all.
+static constexpr size_t kMaxGapBlocks = 16;
+
+namespace {
+
+// A run of blocks on the device.
+struct Extent {
+  size_t begin;
+  size_t end;
+};
+
+struct Check {
+  size_t command;
+  bool target;
+  std::string hash;
+  // The blocks to hash, in order.
+  std::vector<Extent> extents;
+  size_t blocks;
+  size_t first_block;
+  // The checks of the stash commands that an assembled source relies on.
+  std::vector<size_t> stashes;
+};
+
+}  // namespace
+
+std::ostream& operator<<(std::ostream& os, const AheadCheckStats& stats) {
+  os << stats.checks << " checks in " << stats.batches << " batches, " << stats.extents
+     << " reads of " << stats.bytes << " bytes";
+  return os;
+}
+
+static void AppendExtent(size_t begin, size_t end, std::vector<Extent>* extents) {
+  if (!extents->empty() && extents->back().end == begin) {
+    extents->back().end = end;
+  } else {
+    extents->push_back({ begin, end });
+  }
+}
+
+static std::vector<Extent> RangesToExtents(const RangeSet& ranges) {
+  std::vector<Extent> extents;
+  for (const auto& [begin, end] : ranges) {
+    AppendExtent(begin, end, &extents);
+  }
+  return extents;
+}
+
+// Moves the blocks of |from| to the positions of |to| in |where|, in order, as MoveRange() does.
+static bool PlaceBlocks(const RangeSet& from, const RangeSet& to, std::vector<size_t>* where) {
+  if (from.blocks() != to.blocks()) {
+    return false;
+  }
+  auto from_it = from.cbegin();
+  size_t block = from_it == from.cend() ? 0 : from_it->first;
+  for (const auto& [begin, end] : to) {
+    for (size_t pos = begin; pos < end; pos++) {
+      if (pos >= where->size()) {
+        return false;
+      }
+      if (block == from_it->second) {
+        ++from_it;
+        block = from_it->first;
+      }
+      (*where)[pos] = block++;
+    }
+  }
+  return true;
+}
+
+// Works out the blocks of an assembled source, in order: the source blocks get moved to
+// |source.location()|, and then the blocks of each stash (i.e. of its stash command) to the ranges
+// of the stash, like LoadSourceBlocks() does. Returns false if any of the blocks would be left
+// unset.
+static bool AssembleSource(const SourceInfo& source, const std::vector<const RangeSet*>& stashes,
+                           std::vector<Extent>* extents) {
+  constexpr size_t kUnset = SIZE_MAX;
+  std::vector<size_t> where(source.blocks(), kUnset);
+  if (source.ranges().blocks() > 0) {
+    RangeSet location = source.location();
+    if (location.blocks() == 0) {
+      location = RangeSet(std::vector<Range>{ { 0, source.ranges().blocks() } });
+    }
+    if (!PlaceBlocks(source.ranges(), location, &where)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < stashes.size(); i++) {
+    if (!PlaceBlocks(*stashes[i], source.stashes()[i].ranges(), &where)) {
+      return false;
+    }
+  }
+
+  extents->clear();
+  for (size_t block : where) {
+    if (block == kUnset) {
+      return false;
+    }
+    AppendExtent(block, block + 1, extents);
+  }
+  return true;
+}
+
+static AheadCheck Compare(SHA_CTX* ctx, const std::string& hash) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, ctx);
+  return print_sha1(digest) == hash ? AheadCheck::kMatch : AheadCheck::kMismatch;
+}
+
+// Reads and hashes the checks of a batch. A read error leaves the outcomes of the batch kUnknown.
+static void RunBatch(int fd, const std::vector<Check>& checks, const std::vector<size_t>& batch,
+                     size_t block_size, size_t max_blocks, std::vector<uint8_t>* buffer,
+                     std::vector<AheadCheck>* outcomes, std::atomic<size_t>* extents_read,
+                     std::atomic<uint64_t>* bytes_read) {
+  if (batch.size() == 1 && checks[batch[0]].blocks > max_blocks) {
+    const Check& check = checks[batch[0]];
+    buffer->resize(max_blocks * block_size);
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    for (const auto& extent : check.extents) {
+      for (size_t block = extent.begin; block < extent.end; block += max_blocks) {
+        size_t size = std::min(extent.end - block, max_blocks) * block_size;
+        if (!android::base::ReadFullyAtOffset(fd, buffer->data(), size,
+                                              static_cast<off64_t>(block) * block_size)) {
+          return;
+        }
+        SHA1_Update(&ctx, buffer->data(), size);
+        (*extents_read)++;
+        (*bytes_read) += size;
+      }
+    }
+    (*outcomes)[batch[0]] = Compare(&ctx, check.hash);
+    return;
+  }
+
+  std::vector<Extent> reads;
+  for (size_t index : batch) {
+    reads.insert(reads.end(), checks[index].extents.begin(), checks[index].extents.end());
+  }
+  std::sort(reads.begin(), reads.end(),
+            [](const Extent& a, const Extent& b) { return a.begin < b.begin; });
+  std::vector<Extent> merged;
+  for (const auto& read : reads) {
+    if (!merged.empty() && read.begin <= merged.back().end + kMaxGapBlocks) {
+      merged.back().end = std::max(merged.back().end, read.end);
+    } else {
+      merged.push_back(read);
+    }
+  }
+
+  // The position of each merged read in |buffer|, in blocks.
+  std::vector<size_t> offsets;
+  size_t total = 0;
+  for (const auto& read : merged) {
+    offsets.push_back(total);
+    total += read.end - read.begin;
+  }
+  buffer->resize(total * block_size);
+  for (size_t i = 0; i < merged.size(); i++) {
+    size_t size = (merged[i].end - merged[i].begin) * block_size;
+    if (!android::base::ReadFullyAtOffset(fd, buffer->data() + offsets[i] * block_size, size,
+                                          static_cast<off64_t>(merged[i].begin) * block_size)) {
+      return;
+    }
+  }
+  (*extents_read) += merged.size();
+  (*bytes_read) += total * block_size;
+
+  for (size_t index : batch) {
+    const Check& check = checks[index];
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    for (const auto& extent : check.extents) {
+      // The merged read that covers the extent, which lies within it as a whole.
+      size_t i = std::upper_bound(merged.begin(), merged.end(), extent.begin,
+                                  [](size_t block, const Extent& read) {
+                                    return block < read.begin;
+                                  }) -
+                 merged.begin() - 1;
+      const uint8_t* data =
+          buffer->data() + (offsets[i] + extent.begin - merged[i].begin) * block_size;
+      SHA1_Update(&ctx, data, (extent.end - extent.begin) * block_size);
+    }
+    (*outcomes)[index] = Compare(&ctx, check.hash);
+  }
+}
+
+std::vector<AheadChecks> CheckCommandsAhead(int fd, const TransferList& transfer_list,
+                                            size_t block_size, size_t threads, size_t batch_bytes,
+                                            AheadCheckStats* stats) {
+  const std::vector<Command>& commands = transfer_list.commands();
+  std::vector<AheadChecks> results(commands.empty() ? 0 : commands.back().index() + 1);
+
+  // Plan the checks. The stashes are tracked like context.stash_map in verify mode: by the stash
+  // command that's in effect for each id.
+  std::vector<Check> checks;
+  std::map<std::string, std::pair<size_t, const RangeSet*>> stashes;
+  auto add_check = [&checks](size_t command, bool target, const std::string& hash,
+                             std::vector<Extent> extents, std::vector<size_t> dependencies) {
+    if (extents.empty()) {
+      return;
+    }
+    size_t blocks = 0;
+    size_t first_block = SIZE_MAX;
+    for (const auto& extent : extents) {
+      blocks += extent.end - extent.begin;
+      first_block = std::min(first_block, extent.begin);
+    }
+    checks.push_back(Check{ command, target, hash, std::move(extents), blocks, first_block,
+                            std::move(dependencies) });
+  };
+  for (const auto& command : commands) {
+    switch (command.type()) {
+      case Command::Type::STASH: {
+        // An id that's in use keeps its blocks, as long as they're intact; the command checks that
+        // by itself.
+        const StashInfo& stash = command.stash();
+        if (stashes.find(stash.id()) != stashes.end()) {
+          break;
+        }
+        stashes[stash.id()] = { checks.size(), &stash.ranges() };
+        add_check(command.index(), false, stash.id(), RangesToExtents(stash.ranges()), {});
+        break;
+      }
+      case Command::Type::FREE:
+        stashes.erase(command.stash().id());
+        break;
+      case Command::Type::MOVE:
+      case Command::Type::BSDIFF:
+      case Command::Type::IMGDIFF: {
+        const TargetInfo& target = command.target();
+        add_check(command.index(), true, target.hash(), RangesToExtents(target.ranges()), {});
+
+        const SourceInfo& source = command.source();
+        std::vector<size_t> dependencies;
+        std::vector<const RangeSet*> stash_ranges;
+        bool resolved = true;
+        for (const auto& stash : source.stashes()) {
+          auto it = stashes.find(stash.id());
+          if (it == stashes.end()) {
+            // Not loaded from the source blocks (e.g. a stash file of an interrupted update).
+            resolved = false;
+            break;
+          }
+          dependencies.push_back(it->second.first);
+          stash_ranges.push_back(it->second.second);
+        }
+        std::vector<Extent> extents;
+        if (resolved && AssembleSource(source, stash_ranges, &extents)) {
+          add_check(command.index(), false, source.hash(), std::move(extents),
+                    std::move(dependencies));
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  // Sort them by the first block, and put them into batches.
+  std::vector<size_t> order(checks.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&checks](size_t a, size_t b) {
+    return checks[a].first_block < checks[b].first_block;
+  });
+  size_t max_blocks = std::max<size_t>(batch_bytes / block_size, 1);
+  std::vector<std::vector<size_t>> batches;
+  size_t batch_blocks = 0;
+  for (size_t index : order) {
+    if (batches.empty() || batch_blocks + checks[index].blocks > max_blocks) {
+      batches.emplace_back();
+      batch_blocks = 0;
+    }
+    batches.back().push_back(index);
+    batch_blocks += checks[index].blocks;
+  }
+
+  std::vector<AheadCheck> outcomes(checks.size(), AheadCheck::kUnknown);
+  std::atomic<size_t> next_batch{ 0 };
+  std::atomic<size_t> extents_read{ 0 };
+  std::atomic<uint64_t> bytes_read{ 0 };
+  auto worker = [&]() {
+    std::vector<uint8_t> buffer;
+    for (size_t i = next_batch++; i < batches.size(); i = next_batch++) {
+      RunBatch(fd, checks, batches[i], block_size, max_blocks, &buffer, &outcomes, &extents_read,
+               &bytes_read);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::min(std::max<size_t>(threads, 1), batches.size()); i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < checks.size(); i++) {
+    const Check& check = checks[i];
+    AheadChecks& result = results[check.command];
+    if (check.target) {
+      result.target = outcomes[i];
+    } else if (outcomes[i] == AheadCheck::kMatch &&
+               std::all_of(check.stashes.begin(), check.stashes.end(), [&outcomes](size_t stash) {
+                 return outcomes[stash] == AheadCheck::kMatch;
+               })) {
+      result.source = AheadCheck::kMatch;
+    }
+  }
+
+  if (stats != nullptr) {
+    stats->checks = checks.size();
+    stats->batches = batches.size();
+    stats->extents = extents_read;
+    stats->bytes = bytes_read;
+  }
+  return results;
+}
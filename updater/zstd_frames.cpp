@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/zstd_frames.h"
+
+#include <limits>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <zstd.h>
+
+bool FindZstdFrames(const uint8_t* data, size_t size, std::vector<CompressedSegment>* frames,
+                    std::string* err) {
+  CHECK(frames != nullptr);
+  CHECK(err != nullptr);
+
+  frames->clear();
+  size_t offset = 0;
+  while (offset < size) {
+    size_t compressed_size = ZSTD_findFrameCompressedSize(data + offset, size - offset);
+    if (ZSTD_isError(compressed_size)) {
+      *err = android::base::StringPrintf("invalid frame at offset %zu: %s", offset,
+                                         ZSTD_getErrorName(compressed_size));
+      return false;
+    }
+    // Skippable frames have a size of 0.
+    unsigned long long frame_size = ZSTD_getFrameContentSize(data + offset, size - offset);
+    if (frame_size == ZSTD_CONTENTSIZE_UNKNOWN || frame_size == ZSTD_CONTENTSIZE_ERROR) {
+      *err = android::base::StringPrintf("frame at offset %zu doesn't record its size", offset);
+      return false;
+    }
+    if (frame_size > std::numeric_limits<size_t>::max()) {
+      *err = android::base::StringPrintf("frame at offset %zu is too large: %llu", offset,
+                                         frame_size);
+      return false;
+    }
+    frames->push_back({ offset, compressed_size, static_cast<size_t>(frame_size) });
+    offset += compressed_size;
+  }
+  return true;
+}
+
+bool DecompressZstdFrames(const uint8_t* data, const std::vector<CompressedSegment>& frames,
+                          size_t num_threads,
+                          const std::function<bool(const uint8_t*, size_t)>& sink) {
+  auto decoder = [](const uint8_t* in, size_t compressed_size, uint8_t* out, size_t size) {
+    size_t result = ZSTD_decompress(out, size, in, compressed_size);
+    if (ZSTD_isError(result) || result != size) {
+      LOG(ERROR) << "Zstd decompression failed ("
+                 << (ZSTD_isError(result) ? ZSTD_getErrorName(result) : "size mismatch")
+                 << "; expected " << size << " bytes)";
+      return false;
+    }
+    return true;
+  };
+  return DecompressSegments(data, frames, num_threads, decoder, sink);
+}
@@ -19,20 +19,29 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
-#include <pwd.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
 #define LOG_TAG "ProcessKiller"
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <cutils/log.h>
 
 #include "Process.h"
@@ -40,118 +49,144 @@
 using android::base::ReadFileToString;
 using android::base::StringPrintf;
 
-int Process::readSymLink(const char* path, char* link, size_t max) {
-    struct stat s;
-    int length;
+// The processes get scanned concurrently, since reading the maps of a large process takes a while.
+static const size_t kMaxScanThreads = 4;
 
-    if (lstat(path, &s) < 0) return 0;
-    if ((s.st_mode & S_IFMT) != S_IFLNK) return 0;
+namespace {
 
-    // we have a symlink
-    length = readlink(path, link, max - 1);
-    if (length <= 0) return 0;
-    link[length] = 0;
-    return 1;
-}
+// The mount point that the processes get checked against, with its device number from
+// /proc/self/mountinfo (if it's found there), which rules out most of the mapped files without
+// looking at their paths.
+struct MountPoint {
+    std::string path;
+    bool hasDevice = false;
+    dev_t device = 0;
+};
+
+}  // namespace
 
-int Process::pathMatchesMountPoint(const char* path, const char* mountPoint) {
-    int length = strlen(mountPoint);
-    if (length > 1 && strncmp(path, mountPoint, length) == 0) {
+static bool pathMatchesMountPoint(const char* path, const std::string& mountPoint) {
+    size_t length = mountPoint.size();
+    if (length > 1 && strncmp(path, mountPoint.c_str(), length) == 0) {
         // we need to do extra checking if mountPoint does not end in a '/'
-        if (mountPoint[length - 1] == '/') return 1;
+        if (mountPoint[length - 1] == '/') return true;
         // if mountPoint does not have a trailing slash, we need to make sure
         // there is one in the path to avoid partial matches.
         return (path[length] == 0 || path[length] == '/');
     }
 
-    return 0;
+    return false;
 }
 
-void Process::getProcessName(int pid, std::string& out_name) {
-    if (!ReadFileToString(StringPrintf("/proc/%d/cmdline", pid), &out_name)) {
-        out_name = "???";
+static MountPoint getMountPoint(const char* path) {
+    MountPoint mountPoint;
+    mountPoint.path = path;
+
+    // Each line goes "<id> <parent> <major>:<minor> <root> <mount point> ...". The last mount on
+    // the path is the one that's visible.
+    std::string mountinfo;
+    if (!ReadFileToString("/proc/self/mountinfo", &mountinfo)) {
+        return mountPoint;
     }
+    std::string trimmed = mountPoint.path;
+    while (trimmed.size() > 1 && trimmed.back() == '/') trimmed.pop_back();
+    for (const auto& line : android::base::Split(mountinfo, "\n")) {
+        std::vector<std::string> fields = android::base::Split(line, " ");
+        unsigned int majorId, minorId;
+        if (fields.size() > 4 && fields[4] == trimmed &&
+            sscanf(fields[2].c_str(), "%u:%u", &majorId, &minorId) == 2) {
+            mountPoint.hasDevice = true;
+            mountPoint.device = makedev(majorId, minorId);
+        }
+    }
+    return mountPoint;
 }
 
-int Process::checkFileDescriptorSymLinks(int pid, const char* mountPoint) {
-    return checkFileDescriptorSymLinks(pid, mountPoint, NULL, 0);
+// Reads the target of the symlink |name| in |dirFd|. The links in /proc don't need an lstat first,
+// and reading them doesn't reach into the filesystems (which may be wedged).
+static bool readLinkAt(int dirFd, const char* name, std::string* link) {
+    char buf[PATH_MAX];
+    ssize_t length = readlinkat(dirFd, name, buf, sizeof(buf) - 1);
+    if (length <= 0) return false;
+    link->assign(buf, length);
+    return true;
 }
 
-int Process::checkFileDescriptorSymLinks(int pid, const char* mountPoint, char* openFilename,
-                                         size_t max) {
-    // compute path to process's directory of open files
-    char path[PATH_MAX];
-    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
-    DIR* dir = opendir(path);
-    if (!dir) return 0;
-
-    // remember length of the path
-    int parent_length = strlen(path);
-    // append a trailing '/'
-    path[parent_length++] = '/';
+static bool checkFileDescriptors(int procFd, const MountPoint& mountPoint, std::string* openFile) {
+    android::base::unique_fd fdDirFd(openat(procFd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fdDirFd == -1) return false;
+    std::unique_ptr<DIR, decltype(&closedir)> dir(fdopendir(fdDirFd.get()), closedir);
+    if (!dir) return false;
+    // The DIR owns the fd now.
+    (void)fdDirFd.release();
 
     struct dirent* de;
-    while ((de = readdir(dir))) {
-        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
-            strlen(de->d_name) + parent_length + 1 >= PATH_MAX)
-            continue;
-
-        // append the file name, after truncating to parent directory
-        path[parent_length] = 0;
-        strlcat(path, de->d_name, PATH_MAX);
-
-        char link[PATH_MAX];
-
-        if (readSymLink(path, link, sizeof(link)) && pathMatchesMountPoint(link, mountPoint)) {
-            if (openFilename) {
-                memset(openFilename, 0, max);
-                strlcpy(openFilename, link, max);
-            }
-            closedir(dir);
-            return 1;
+    while ((de = readdir(dir.get()))) {
+        if (de->d_name[0] == '.') continue;
+        if (readLinkAt(dirfd(dir.get()), de->d_name, openFile) &&
+            pathMatchesMountPoint(openFile->c_str(), mountPoint.path)) {
+            return true;
         }
     }
-
-    closedir(dir);
-    return 0;
+    return false;
 }
 
-int Process::checkFileMaps(int pid, const char* mountPoint) {
-    return checkFileMaps(pid, mountPoint, NULL, 0);
-}
-
-int Process::checkFileMaps(int pid, const char* mountPoint, char* openFilename, size_t max) {
-    FILE* file;
-    char buffer[PATH_MAX + 100];
-
-    snprintf(buffer, sizeof(buffer), "/proc/%d/maps", pid);
-    file = fopen(buffer, "re");
-    if (!file) return 0;
-
-    while (fgets(buffer, sizeof(buffer), file)) {
-        // skip to the path
-        const char* path = strchr(buffer, '/');
-        if (path && pathMatchesMountPoint(path, mountPoint)) {
-            if (openFilename) {
-                memset(openFilename, 0, max);
-                strlcpy(openFilename, path, max);
-            }
-            fclose(file);
-            return 1;
+static bool checkFileMaps(int procFd, const MountPoint& mountPoint, std::string* openFile) {
+    android::base::unique_fd mapsFd(openat(procFd, "maps", O_RDONLY | O_CLOEXEC));
+    std::string maps;
+    if (mapsFd == -1 || !android::base::ReadFdToString(mapsFd, &maps)) return false;
+
+    // Each line goes "<start>-<end> <perms> <offset> <major>:<minor> <inode> <path>".
+    for (const auto& line : android::base::Split(maps, "\n")) {
+        unsigned int majorId, minorId;
+        uint64_t inode;
+        int pathOffset = -1;
+        if (sscanf(line.c_str(), "%*s %*s %*s %x:%x %" SCNu64 " %n", &majorId, &minorId, &inode,
+                   &pathOffset) != 3 ||
+            inode == 0 || pathOffset < 0) {
+            continue;
+        }
+        if (mountPoint.hasDevice && makedev(majorId, minorId) != mountPoint.device) continue;
+        const char* path = line.c_str() + pathOffset;
+        if (pathMatchesMountPoint(path, mountPoint.path)) {
+            *openFile = path;
+            return true;
         }
     }
-
-    fclose(file);
-    return 0;
+    return false;
 }
 
-int Process::checkSymLink(int pid, const char* mountPoint, const char* name) {
-    char path[PATH_MAX];
-    char link[PATH_MAX];
+// Returns why the process |pid| keeps the mount point busy, or an empty string if it doesn't. The
+// cheap checks go first, and everything is read relative to /proc/<pid>.
+static std::string scanProcess(int pid, const MountPoint& mountPoint) {
+    android::base::unique_fd procFd(
+            open(StringPrintf("/proc/%d", pid).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (procFd == -1) return "";
+
+    const char* path = mountPoint.path.c_str();
+    std::string link;
+    if (readLinkAt(procFd, "cwd", &link) && pathMatchesMountPoint(link.c_str(), mountPoint.path)) {
+        return StringPrintf("has cwd within %s", path);
+    }
+    if (readLinkAt(procFd, "root", &link) && pathMatchesMountPoint(link.c_str(), mountPoint.path)) {
+        return StringPrintf("has chroot within %s", path);
+    }
+    if (readLinkAt(procFd, "exe", &link) && pathMatchesMountPoint(link.c_str(), mountPoint.path)) {
+        return StringPrintf("has executable path within %s", path);
+    }
+    if (checkFileDescriptors(procFd, mountPoint, &link)) {
+        return StringPrintf("has open file %s", link.c_str());
+    }
+    if (checkFileMaps(procFd, mountPoint, &link)) {
+        return StringPrintf("has open filemap for %s", link.c_str());
+    }
+    return "";
+}
 
-    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
-    if (readSymLink(path, link, sizeof(link)) && pathMatchesMountPoint(link, mountPoint)) return 1;
-    return 0;
+void Process::getProcessName(int pid, std::string& out_name) {
+    if (!ReadFileToString(StringPrintf("/proc/%d/cmdline", pid), &out_name)) {
+        out_name = "???";
+    }
 }
 
 int Process::getPid(const char* s) {
@@ -168,36 +203,45 @@ int Process::getPid(const char* s) {
  */
 int Process::killProcessesWithOpenFiles(const char* path, int signal) {
     int count = 0;
-    DIR* dir;
-    struct dirent* de;
-
-    if (!(dir = opendir("/proc"))) {
-        SLOGE("opendir failed (%s)", strerror(errno));
-        return count;
+    std::vector<int> pids;
+    {
+        std::unique_ptr<DIR, decltype(&closedir)> dir(opendir("/proc"), closedir);
+        if (!dir) {
+            SLOGE("opendir failed (%s)", strerror(errno));
+            return count;
+        }
+        struct dirent* de;
+        while ((de = readdir(dir.get()))) {
+            int pid = getPid(de->d_name);
+            if (pid != -1) pids.push_back(pid);
+        }
     }
 
-    while ((de = readdir(dir))) {
-        int pid = getPid(de->d_name);
-        if (pid == -1) continue;
+    MountPoint mountPoint = getMountPoint(path);
+    std::vector<std::string> reasons(pids.size());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < pids.size(); i = next++) {
+            reasons[i] = scanProcess(pids[i], mountPoint);
+        }
+    };
+    size_t threads =
+            std::min<size_t>({std::thread::hardware_concurrency(), kMaxScanThreads, pids.size()});
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
 
+    for (size_t i = 0; i < pids.size(); i++) {
+        if (reasons[i].empty()) continue;
+        int pid = pids[i];
         std::string name;
         getProcessName(pid, name);
-
-        char openfile[PATH_MAX];
-
-        if (checkFileDescriptorSymLinks(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open file %s", name.c_str(), pid, openfile);
-        } else if (checkFileMaps(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open filemap for %s", name.c_str(), pid, openfile);
-        } else if (checkSymLink(pid, path, "cwd")) {
-            SLOGE("Process %s (%d) has cwd within %s", name.c_str(), pid, path);
-        } else if (checkSymLink(pid, path, "root")) {
-            SLOGE("Process %s (%d) has chroot within %s", name.c_str(), pid, path);
-        } else if (checkSymLink(pid, path, "exe")) {
-            SLOGE("Process %s (%d) has executable path within %s", name.c_str(), pid, path);
-        } else {
-            continue;
-        }
+        SLOGE("Process %s (%d) %s", name.c_str(), pid, reasons[i].c_str());
 
         if (signal != 0) {
             SLOGW("Sending %s to process %d", strsignal(signal), pid);
@@ -205,6 +249,5 @@ int Process::killProcessesWithOpenFiles(const char* path, int signal) {
             count++;
         }
     }
-    closedir(dir);
     return count;
 }
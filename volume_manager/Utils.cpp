@@ -195,6 +195,10 @@ status_t BindMount(const std::string& source, const std::string& target) {
 
 static status_t readMetadata(const std::string& path, std::string& fsType, std::string& fsUuid,
                              std::string& fsLabel) {
+    // The probes share the blkid cache file, and the disks may get scanned concurrently.
+    static std::mutex blkid_lock;
+    std::lock_guard<std::mutex> lock(blkid_lock);
+
     char* val = NULL;
     val = blkid_get_tag_value(NULL, "TYPE", path.c_str());
     if (val) {
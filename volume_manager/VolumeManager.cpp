@@ -25,9 +25,17 @@
 
 #define LOG_TAG "VolumeManager"
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/strings.h>
 #include <cutils/properties.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
 #include <sysutils/NetlinkEvent.h>
 
 #include <volume_manager/VolumeManager.h>
@@ -37,6 +45,7 @@
 #include "EmulatedVolume.h"
 #include "VolumeBase.h"
 #include "NetlinkManager.h"
+#include "Utils.h"
 
 #include "sehandle.h"
 
@@ -52,44 +61,30 @@ static const unsigned int kMajorBlockExperimentalMax = 254;
 namespace android {
 namespace volmgr {
 
-static void do_coldboot(DIR* d, int lvl) {
-    struct dirent* de;
-    int dfd, fd;
-
-    dfd = dirfd(d);
-
-    fd = openat(dfd, "uevent", O_WRONLY | O_CLOEXEC);
-    if (fd >= 0) {
-        write(fd, "add\n", 4);
-        close(fd);
+// Disks get scanned concurrently on coldboot, since each scan forks sgdisk and probes the
+// partitions, which adds up with several USB / SD devices or lots of virtio disks.
+static const size_t kMaxColdbootThreads = 4;
+
+static Disk* make_disk(VolumeManager::DiskSource* source, const std::string& eventPath,
+                       dev_t device) {
+    // For now, assume that MMC, virtio-blk (the latter is
+    // emulator-specific; see Disk.cpp for details) and UFS card
+    // devices are SD, and that everything else is USB
+    unsigned int majorId = major(device);
+    int flags = source->getFlags();
+    if (majorId == kMajorBlockMmc || (eventPath.find("ufs") != std::string::npos) ||
+        (IsRunningInEmulator() && majorId >= kMajorBlockExperimentalMin &&
+         majorId <= kMajorBlockExperimentalMax)) {
+        flags |= Disk::Flags::kSd;
+    } else {
+        flags |= Disk::Flags::kUsb;
     }
 
-    while ((de = readdir(d))) {
-        DIR* d2;
-
-        if (de->d_name[0] == '.') continue;
-
-        if (de->d_type != DT_DIR && lvl > 0) continue;
-
-        fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-        if (fd < 0) continue;
-
-        d2 = fdopendir(fd);
-        if (d2 == 0)
-            close(fd);
-        else {
-            do_coldboot(d2, lvl + 1);
-            closedir(d2);
-        }
-    }
-}
-
-static void coldboot(const char* path) {
-    DIR* d = opendir(path);
-    if (d) {
-        do_coldboot(d, 0);
-        closedir(d);
-    }
+    return (source->getPartNum() == -1)
+                   ? new Disk(eventPath, device, source->getNickname(), flags)
+                   : new DiskPartition(eventPath, device, source->getNickname(), flags,
+                                       source->getPartNum(), source->getFsType(),
+                                       source->getMntOpts());
 }
 
 static int process_config(VolumeManager* vm, FstabEntry* data_recp) {
@@ -185,7 +180,7 @@ bool VolumeManager::start(VolumeWatcher* watcher) {
         return false;
     }
 
-    coldboot("/sys/block");
+    coldboot();
 
     unmountAll();
 
@@ -277,6 +272,96 @@ void VolumeManager::addDiskSource(DiskSource* source) {
     mDiskSources.push_back(source);
 }
 
+VolumeManager::DiskSource* VolumeManager::findDiskSource(const std::string& eventPath) {
+    for (const auto& source : mDiskSources) {
+        if (source->matches(eventPath)) {
+            return source;
+        }
+    }
+    return nullptr;
+}
+
+Disk* VolumeManager::findDisk(dev_t device) {
+    for (const auto& disk : mDisks) {
+        if (disk->getDevice() == device) {
+            return disk;
+        }
+    }
+    return nullptr;
+}
+
+Disk* VolumeManager::coldbootDisk(const std::string& sysPath) {
+    // The entries of /sys/block link to the devices, whose paths are the DEVPATHs of the uevents.
+    std::string path;
+    if (!android::base::Realpath(sysPath, &path) || !android::base::StartsWith(path, "/sys/")) {
+        return nullptr;
+    }
+    std::string eventPath = path.substr(strlen("/sys"));
+    DiskSource* source = findDiskSource(eventPath);
+    if (!source) {
+        return nullptr;
+    }
+
+    std::string dev;
+    unsigned int majorId, minorId;
+    if (!android::base::ReadFileToString(path + "/dev", &dev) ||
+        sscanf(dev.c_str(), "%u:%u", &majorId, &minorId) != 2) {
+        LOG(WARNING) << "Failed to read the device number of " << path;
+        return nullptr;
+    }
+
+    Disk* disk = make_disk(source, eventPath, makedev(majorId, minorId));
+    disk->create();
+    return disk;
+}
+
+void VolumeManager::coldboot() {
+    // Only the disks that a source manages are of interest: the partitions get read from the
+    // disks, and handleBlockEvent() ignores the rest. So rather than having the kernel replay the
+    // "add" uevents of the whole tree one at a time, create those disks directly (ueventd has
+    // already been through the tree on its own coldboot). The lock keeps handleBlockEvent() from
+    // adding any of them again in the meantime.
+    std::lock_guard<std::mutex> lock(mLock);
+
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir("/sys/block"), closedir);
+    if (!dir) {
+        PLOG(ERROR) << "Failed to open /sys/block";
+        return;
+    }
+    std::vector<std::string> names;
+    struct dirent* de;
+    while ((de = readdir(dir.get()))) {
+        if (de->d_name[0] == '.') continue;
+        names.push_back(de->d_name);
+    }
+    // Keep the order of the volumes stable across boots.
+    std::sort(names.begin(), names.end());
+
+    std::vector<Disk*> disks(names.size(), nullptr);
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < names.size(); i = next++) {
+            disks[i] = coldbootDisk("/sys/block/" + names[i]);
+        }
+    };
+    size_t threads = std::min<size_t>(
+            {std::thread::hardware_concurrency(), kMaxColdbootThreads, names.size()});
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    for (const auto& disk : disks) {
+        if (disk) {
+            mDisks.push_back(disk);
+        }
+    }
+}
+
 void VolumeManager::handleBlockEvent(NetlinkEvent* evt) {
     std::lock_guard<std::mutex> lock(mLock);
 
@@ -295,29 +380,16 @@ void VolumeManager::handleBlockEvent(NetlinkEvent* evt) {
 
     switch (evt->getAction()) {
         case NetlinkEvent::Action::kAdd: {
-            for (const auto& source : mDiskSources) {
-                if (source->matches(eventPath)) {
-                    // For now, assume that MMC, virtio-blk (the latter is
-                    // emulator-specific; see Disk.cpp for details) and UFS card
-                    // devices are SD, and that everything else is USB
-                    int flags = source->getFlags();
-                    if (major == kMajorBlockMmc || (eventPath.find("ufs") != std::string::npos) ||
-                        (IsRunningInEmulator() && major >= (int)kMajorBlockExperimentalMin &&
-                         major <= (int)kMajorBlockExperimentalMax)) {
-                        flags |= Disk::Flags::kSd;
-                    } else {
-                        flags |= Disk::Flags::kUsb;
-                    }
-
-                    Disk* disk = (source->getPartNum() == -1)
-                                     ? new Disk(eventPath, device, source->getNickname(), flags)
-                                     : new DiskPartition(eventPath, device, source->getNickname(),
-                                                         flags, source->getPartNum(),
-                                                         source->getFsType(), source->getMntOpts());
-                    disk->create();
-                    mDisks.push_back(disk);
-                    break;
-                }
+            // A disk that coldboot() has picked up may announce itself as well.
+            if (findDisk(device)) {
+                LOG(DEBUG) << "Disk at " << major << ":" << minor << " already added";
+                break;
+            }
+            DiskSource* source = findDiskSource(eventPath);
+            if (source) {
+                Disk* disk = make_disk(source, eventPath, device);
+                disk->create();
+                mDisks.push_back(disk);
             }
             break;
         }
@@ -21,6 +21,7 @@
 #include <fnmatch.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #include <list>
 #include <mutex>
@@ -121,6 +122,15 @@ class VolumeManager {
     void notifyEvent(int code, const std::vector<std::string>& argv);
 
   private:
+    DiskSource* findDiskSource(const std::string& eventPath);
+    Disk* findDisk(dev_t device);
+
+    // Creates the disks that are already there, in place of their "add" uevents.
+    void coldboot();
+    // Creates the disk of |sysPath| (a /sys/block entry) if a disk source manages it, and returns
+    // it; otherwise returns nullptr.
+    Disk* coldbootDisk(const std::string& sysPath);
+
     VolumeWatcher* mWatcher;
     NetlinkManager* mNetlinkManager;
     std::mutex mLock;